@@ -3,6 +3,8 @@
  */
 
 #include <chrono>
+#include <errno.h>
+#include <poll.h>
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -14,6 +16,7 @@
 #include "output/output.hpp"
 
 #include "image/image.hpp"
+#include "image/save_queue.hpp"
 
 using namespace std::placeholders;
 using libcamera::Stream;
@@ -29,7 +32,7 @@ public:
 };
 
 // Save metadata to file
-static void save_metadata(StillOptions const *options, libcamera::ControlList &metadata) {
+static void save_metadata(StillOptions const *options, libcamera::ControlList const &metadata) {
     std::streambuf *buf = std::cout.rdbuf();
     std::ofstream of;
     const std::string &filename = options->Get().metadata;
@@ -63,23 +66,29 @@ void restore_keyboard(struct termios orig_termios) {
 }
 
 // The new, much simpler kbhit
+// Returns the key pressed, 0 if there isn't one, or -1 once stdin has reached end of file.
 int get_keypress() {
     char ch = 0;
-    // read() will instantly return 0 if no key is pressed, or 1 if a key is pressed
-    if (read(STDIN_FILENO, &ch, 1) > 0) {
+    ssize_t ret = read(STDIN_FILENO, &ch, 1);
+    if (ret > 0) {
         return ch;
     }
-    return 0;
+    return ret == 0 ? -1 : 0;
 }
 
 // The main loop for the application.
 static void event_loop(MathorcamApp& app) {
     StillOptions const *options = app.GetOptions();
     app.OpenCamera();
-    app.ConfigureViewfinder();
+    // Run with both the viewfinder and full resolution still streams configured, so that a capture
+    // just takes the next frame's still buffer instead of tearing the whole pipeline down.
+    app.ConfigureZsl();
     app.StartCamera();
     auto start_time = std::chrono::high_resolution_clock::now();
 
+    // Encoding and writing happen off the event loop, so we're straight back to the viewfinder.
+    SaveQueue save_queue(options->Get().save_queue);
+
     // Open the GPIO chip.
     struct gpiod_chip *chip = gpiod_chip_open("/dev/gpiochip0");
     if (chip == NULL) {
@@ -87,10 +96,13 @@ static void event_loop(MathorcamApp& app) {
         return;
     }
 
-    // Configure the line settings on pin 17.
+    // Configure the line settings on pin 17. Presses are reported as debounced rising edges on the
+    // request's fd, so we never have to sample the pin.
     unsigned int offset = 17;
     struct gpiod_line_settings *settings = gpiod_line_settings_new();
     gpiod_line_settings_set_direction(settings, GPIOD_LINE_DIRECTION_INPUT);
+    gpiod_line_settings_set_edge_detection(settings, GPIOD_LINE_EDGE_RISING);
+    gpiod_line_settings_set_debounce_period_us(settings, 10000);
 
     // Optional but highly recommended: If your physical button doesn't have an external 
     // resistor, uncomment one of these to use the Pi's internal resistors so the pin doesn't float!
@@ -115,89 +127,103 @@ static void event_loop(MathorcamApp& app) {
     gpiod_line_config_free(line_cfg);
     gpiod_request_config_free(req_cfg);
 
-    for (;;) {
-        // Read RPiCamApp message.
-        RPiCamApp::Msg msg = app.Wait();
-
-        if (msg.type == RPiCamApp::MsgType::Timeout) {
-            LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
-            app.StopCamera();
-            app.StartCamera();
-            continue;
+    constexpr size_t EDGE_EVENT_BUFFER_SIZE = 16;
+    struct gpiod_edge_event_buffer *edge_events = gpiod_edge_event_buffer_new(EDGE_EVENT_BUFFER_SIZE);
+
+    // Sleep until a camera message, a shutter edge or a key press arrives.
+    enum { POLL_MESSAGE, POLL_SHUTTER, POLL_KEYBOARD, POLL_COUNT };
+    struct pollfd fds[POLL_COUNT] = {};
+    fds[POLL_MESSAGE] = { app.MessageFd(), POLLIN, 0 };
+    fds[POLL_SHUTTER] = { gpiod_line_request_get_fd(request), POLLIN, 0 };
+    fds[POLL_KEYBOARD] = { STDIN_FILENO, POLLIN, 0 };
+
+    bool want_capture = false;
+    bool running = true;
+    while (running) {
+        if (poll(fds, POLL_COUNT, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error("poll failed");
         }
 
-        if (msg.type == RPiCamApp::MsgType::Quit)
-            break;
-
-        else if (msg.type != RPiCamApp::MsgType::RequestComplete)
-            // This is critical since GPIO chip is not closed.
-            throw std::runtime_error("unrecognised message!");
-
-        // In viewfinder mode, simply run until the timeout. When that happens, switch to
-        // capture mode.
-        if (app.ViewfinderStream()) {
-            // Read the current time from chrono.
-        auto now = std::chrono::high_resolution_clock::now();
+        // The shutter only listens for rising edges, so any event is a press.
+        if ((fds[POLL_SHUTTER].revents & POLLIN) &&
+            gpiod_line_request_read_edge_event(request, edge_events, EDGE_EVENT_BUFFER_SIZE) > 0)
+            want_capture = true;
 
-            // Fetch any pressed key.
+        if (fds[POLL_KEYBOARD].revents & (POLLIN | POLLHUP)) {
+            // Fetch any pressed key. Once stdin has closed, stop watching it.
             int key = get_keypress();
-            // Read the current value of the pin
-            enum gpiod_line_value shutter_button_value = gpiod_line_request_get_value(request, offset);
-
-            bool timeout_passed = options->Get().timeout && (now - start_time) > options->Get().timeout.value;
-            bool key_pressed = key == 'c';
-            bool shutter_button_pressed = shutter_button_value == GPIOD_LINE_VALUE_ACTIVE;
-
-            if (key != 0)
+            if (key < 0)
+                fds[POLL_KEYBOARD].fd = -1;
+            else if (key)
                 printf("\n%c - %d\n", key, key);
+            if (key == 'c')
+                want_capture = true;
+        }
 
-            if (timeout_passed || key_pressed || shutter_button_pressed) {
-                // Change mode to still picture.
+        // Read RPiCamApp messages.
+        while (std::optional<RPiCamApp::Msg> msg = app.TryWait()) {
+            if (msg->type == RPiCamApp::MsgType::Timeout) {
+                LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
                 app.StopCamera();
-                app.Teardown();
-                app.ConfigureStill();
                 app.StartCamera();
-            } else {
-                CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+                continue;
+            }
+
+            if (msg->type == RPiCamApp::MsgType::Quit) {
+                running = false;
+                break;
+            }
+
+            else if (msg->type != RPiCamApp::MsgType::RequestComplete)
+                // This is critical since GPIO chip is not closed.
+                throw std::runtime_error("unrecognised message!");
+
+            CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg->payload);
+
+            auto now = std::chrono::high_resolution_clock::now();
+            if (options->Get().timeout && (now - start_time) > options->Get().timeout.value)
+                want_capture = true;
+
+            // In viewfinder mode, run until the timeout or a key or shutter press.
+            if (!want_capture) {
                 app.ShowPreview(completed_request, app.ViewfinderStream());
+                continue;
             }
-        } else if (app.StillStream()) {
-            // In still capture mode, save a jpeg and get back to viewfinder mode.
-            app.StopCamera();
+
+            // Save a jpeg from the first frame's still stream after the trigger, and carry on with the
+            // viewfinder.
+            want_capture = false;
             LOG(1, "Still capture image received");
 
             Stream *stream = app.StillStream();
             StreamInfo info = app.GetStreamInfo(stream);
-            CompletedRequestPtr &payload = std::get<CompletedRequestPtr>(msg.payload);
-            BufferReadSync r(&app, payload->buffers[stream]);
+            BufferReadSync r(&app, completed_request->buffers[stream]);
             const std::vector<libcamera::Span<uint8_t>> mem = r.Get();
 
             // TODO Fetch target output file.
             std::string output_file_path = options->Get().output;
 
-            jpeg_save(
-                mem,
-                info,
-                payload->metadata,
-                output_file_path,
-                app.CameraModel(),
-                options
-            );
+            save_queue.Push(mem, [info, metadata = completed_request->metadata, output_file_path,
+                                  cam_model = app.CameraModel(), options](std::vector<libcamera::Span<uint8_t>> const &mem) {
+                jpeg_save(
+                    mem,
+                    info,
+                    metadata,
+                    output_file_path,
+                    cam_model,
+                    options
+                );
+            });
 
             if (!options->Get().metadata.empty())
-                save_metadata(options, payload->metadata);
-
-            // Get back to viewfinder mode.
-            app.StopCamera();
-            app.Teardown();
-            app.ConfigureViewfinder();
-            app.StartCamera();
+                save_metadata(options, completed_request->metadata);
+            app.ShowPreview(completed_request, app.ViewfinderStream());
         }
-
-        // Wait for a while to let the processors breathe.
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
 
+    gpiod_edge_event_buffer_free(edge_events);
     gpiod_line_request_release(request);
     gpiod_chip_close(chip);
 }
@@ -216,12 +242,6 @@ int main(int argc, char *argv[]) {
             if (options->Get().output.empty())
                 throw std::runtime_error("output file name required");
 
-            if (options->GetPlatform() == Platform::PISP) {
-                LOG_ERROR("WARNING: Capture will not make use of temporal denoise");
-                LOG_ERROR("         Consider using rpicam-still with the --zsl option for best results, for example:");
-                LOG_ERROR("         rpicam-still --zsl -o " << options->Get().output);
-            }
-
             event_loop(app);
         }
     } catch (std::exception const &e) {
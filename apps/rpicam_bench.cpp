@@ -0,0 +1,159 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * rpicam_bench.cpp - benchmark the post-processing stages without a camera.
+ */
+
+// Frames from a YUV420 file or a generated pattern go through the stages named by --post-process-file, either as
+// fast as the stages will take them or at --framerate. At the end we report the throughput, the latency of each
+// frame from being queued to coming out of the last stage, and the peak memory use. Each stage's own timings are
+// logged with -v 2, and can be written to a JSON file with the post_processor "stats_file" setting.
+
+#include <poll.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "core/frame_source.hpp"
+#include "core/options.hpp"
+#include "core/rpicam_app.hpp"
+
+using namespace std::chrono_literals;
+
+struct BenchOptions : public Options
+{
+	BenchOptions() : Options()
+	{
+		using namespace boost::program_options;
+		// clang-format off
+		options_->add_options()
+			("source", value<std::string>(&v_->source)->default_value("pattern:gradient"),
+			 "File of YUV420 frames to replay on a loop, or pattern:gradient or pattern:noise")
+			("frames", value<uint32_t>(&v_->frames)->default_value(0),
+			 "Run for exactly this many frames, instead of until the timeout")
+			;
+		// clang-format on
+	}
+
+	virtual void Print() const override
+	{
+		Options::Print();
+		std::cerr << "    source: " << v_->source << std::endl;
+		std::cerr << "    frames: " << v_->frames << std::endl;
+	}
+};
+
+class RPiCamBenchApp : public RPiCamApp
+{
+public:
+	RPiCamBenchApp() : RPiCamApp(std::make_unique<BenchOptions>()) {}
+};
+
+static double percentile(std::vector<float> &values, double p)
+{
+	if (values.empty())
+		return 0;
+	auto nth = values.begin() + std::min<size_t>(p * values.size(), values.size() - 1);
+	std::nth_element(values.begin(), nth, values.end());
+	return *nth;
+}
+
+static int64_t now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			   std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+static void bench(RPiCamBenchApp &app)
+{
+	Options const *options = app.GetOptions();
+	unsigned int frames = options->Get().frames;
+
+	FrameSource source(&app, options->Get().buffer_count ? options->Get().buffer_count : 6);
+	source.Open();
+	source.Start();
+
+	std::atomic<bool> stop = false, feeder_done = false;
+	std::atomic<unsigned int> queued = 0;
+	std::thread feeder([&]() {
+		std::chrono::nanoseconds period(0);
+		if (options->Get().framerate)
+			period = std::chrono::nanoseconds((int64_t)(1e9 / *options->Get().framerate));
+		auto next = std::chrono::steady_clock::now();
+		while (!stop && (!frames || queued < frames))
+		{
+			if (period.count())
+			{
+				std::this_thread::sleep_until(next);
+				next += period;
+			}
+			source.Queue(now_ns());
+			queued++;
+		}
+		feeder_done = true;
+	});
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<float> latencies;
+	pollfd p = { app.MessageFd(), POLLIN, 0 };
+	while (true)
+	{
+		poll(&p, 1, 100);
+		while (std::optional<RPiCamApp::Msg> msg = app.TryWait())
+		{
+			if (msg->type != RPiCamApp::MsgType::RequestComplete)
+				continue;
+			CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg->payload);
+			auto ts = completed_request->metadata.get(libcamera::controls::SensorTimestamp);
+			if (ts)
+				latencies.push_back((now_ns() - *ts) / 1000.0);
+		}
+
+		if (!frames && options->Get().timeout && std::chrono::steady_clock::now() - start > options->Get().timeout.value)
+			stop = true;
+		// Finished once everything queued has come out of the stages, or been dropped by them.
+		if (feeder_done && !source.InFlight())
+			break;
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	feeder.join();
+	source.Stop();
+
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	unsigned int completed = latencies.size();
+	LOG(1, "Benchmark: " << queued << " frames queued, " << completed << " completed, " << queued - completed
+						 << " dropped in " << elapsed.count() << "s");
+	LOG(1, "    throughput " << completed / elapsed.count() << " fps");
+	LOG(1, "    latency p50 " << percentile(latencies, 0.5) << "us p95 " << percentile(latencies, 0.95) << "us p99 "
+						  << percentile(latencies, 0.99) << "us max " << percentile(latencies, 1.0) << "us");
+	LOG(1, "    peak memory " << usage.ru_maxrss / 1024.0 << "MB");
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		RPiCamBenchApp app;
+		Options *options = app.GetOptions();
+		if (options->Parse(argc, argv))
+		{
+			if (options->Get().verbose >= 2)
+				options->Print();
+
+			bench(app);
+		}
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: *** " << e.what() << " ***");
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,572 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * rpicam_daemon.cpp - keep the camera running and capture stills on request.
+ */
+
+// The camera is configured once, in zero shutter lag mode, and left running, so AGC and AWB stay converged and
+// there are no buffers to allocate when a capture is wanted. Clients connect to a Unix socket and send commands,
+// one per line, and get back a single line starting "ok" or "error" for each:
+//
+//   capture <file>         save the next frame to <file>, encoded as given by --encoding (and a DNG with --raw)
+//   burst <pattern> <n>    save the next n frames, <pattern> holding a single integer conversion, such as %03d,
+//                          for the frame number
+//   capture-fd             send the next frame in a sealed memfd, passed alongside the reply with SCM_RIGHTS; the
+//                          reply gives the width, height, stride, pixel format and size of the image
+//   set <control> <value>  change shutter (us), gain, ev, brightness, contrast, saturation, sharpness,
+//                          awbgains (r,b) or lens-position; 0 for shutter, gain or awbgains returns it to auto
+//   status                 report the sequence number, exposure time and gain of the latest frame
+//   quit                   stop the daemon
+//
+// A capture reply comes once the file is written, giving the frame's sensor timestamp. With the default
+// --save-queue of 0 the file is written on the event loop, which answers no other client (and takes no other
+// frames) until it's done; give --save-queue a depth to save in the background instead.
+//
+// Files are written wherever a client asks, with the daemon's permissions, so the socket is only open to the
+// user the daemon runs as.
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+
+#include "core/frame_info.hpp"
+#include "core/rpicam_app.hpp"
+#include "core/still_options.hpp"
+
+#include "image/image.hpp"
+#include "image/save_queue.hpp"
+
+using libcamera::Stream;
+
+struct DaemonOptions : public StillOptions
+{
+	DaemonOptions() : StillOptions()
+	{
+		using namespace boost::program_options;
+		// clang-format off
+		options_->add_options()
+			("socket", value<std::string>(&v_->socket)->default_value("/tmp/rpicam-daemon.sock"),
+			 "Path of the Unix socket on which to listen for commands")
+			;
+		// clang-format on
+	}
+
+	virtual void Print() const override
+	{
+		StillOptions::Print();
+		std::cerr << "    socket: " << v_->socket << std::endl;
+	}
+};
+
+class RPiCamDaemonApp : public RPiCamApp
+{
+public:
+	RPiCamDaemonApp() : RPiCamApp(std::make_unique<DaemonOptions>()) {}
+
+	DaemonOptions *GetOptions() const { return static_cast<DaemonOptions *>(RPiCamApp::GetOptions()); }
+};
+
+// A connected client. Replies to captures come from the save thread, so sending is locked, and the socket stays
+// open until the last pending save for it has let go.
+struct Client
+{
+	explicit Client(int fd) : fd(fd) {}
+	~Client() { close(fd); }
+
+	void Reply(std::string const &text, int pass_fd = -1)
+	{
+		std::string line = text + "\n";
+		iovec iov = { line.data(), line.size() };
+		msghdr msg = {};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+		if (pass_fd >= 0)
+		{
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+		}
+
+		// A client that has gone away just misses its reply.
+		std::lock_guard<std::mutex> lock(mutex);
+		if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0)
+			LOG(1, "Failed to reply to client: " << strerror(errno));
+	}
+
+	int fd;
+	std::string input;
+	std::mutex mutex;
+};
+
+using ClientPtr = std::shared_ptr<Client>;
+
+// A capture waiting for frames.
+struct Capture
+{
+	ClientPtr client;
+	bool to_fd;
+	bool burst;
+	std::string filename; // for bursts, a pattern that has passed valid_pattern
+	unsigned int count;
+	unsigned int index;
+};
+
+static int listen_socket(std::string const &path)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("socket path too long: " + path);
+	strcpy(addr.sun_path, path.c_str());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		throw std::runtime_error("failed to create socket: " + std::string(strerror(errno)));
+	// Any socket left behind by a previous run would stop us binding.
+	unlink(path.c_str());
+	// Nobody can connect before we listen, so no one else gets in while the permissions are set.
+	if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || chmod(path.c_str(), S_IRUSR | S_IWUSR) < 0 ||
+		listen(fd, 8) < 0)
+	{
+		int err = errno;
+		close(fd);
+		throw std::runtime_error("failed to listen on " + path + ": " + strerror(err));
+	}
+
+	LOG(1, "Listening on " << path);
+	return fd;
+}
+
+// The pattern goes to snprintf, so it may hold exactly one integer conversion, with flags and a width but
+// nothing else, and no other conversions than "%%".
+
+static bool valid_pattern(std::string const &pattern)
+{
+	unsigned int conversions = 0;
+	for (size_t i = 0; i < pattern.size(); i++)
+	{
+		if (pattern[i] != '%')
+			continue;
+		if (++i < pattern.size() && pattern[i] == '%')
+			continue;
+		while (i < pattern.size() && strchr("-+ #0", pattern[i]))
+			i++;
+		for (unsigned int digits = 0; i < pattern.size() && isdigit((unsigned char)pattern[i]); digits++, i++)
+		{
+			if (digits == 2)
+				return false;
+		}
+		if (i >= pattern.size() || !strchr("diouxX", pattern[i]))
+			return false;
+		conversions++;
+	}
+	return conversions == 1;
+}
+
+static std::string format_filename(std::string const &pattern, unsigned int index)
+{
+	char filename[256];
+	snprintf(filename, sizeof(filename), pattern.c_str(), index);
+	filename[sizeof(filename) - 1] = 0;
+	return std::string(filename);
+}
+
+static void save_frame(RPiCamDaemonApp &app, SaveQueue &save_queue, CompletedRequestPtr &payload, Stream *stream,
+					   std::string const &filename, ClientPtr const &client, bool last)
+{
+	StillOptions const *options = app.GetOptions();
+	StreamInfo info = app.GetStreamInfo(stream);
+	BufferReadSync r(&app, payload->buffers[stream]);
+	const std::vector<libcamera::Span<uint8_t>> mem = r.Get();
+	bool raw = stream == app.RawStream();
+	int64_t ts = payload->metadata.get(libcamera::controls::SensorTimestamp).value_or(0);
+
+	// Errors go back to the client rather than out of the save queue, which would stop the daemon.
+	save_queue.Push(mem, [info, metadata = payload->metadata, filename, cam_model = app.CameraModel(), options, raw,
+						  client, ts, last](std::vector<libcamera::Span<uint8_t>> const &mem) {
+		try
+		{
+			if (raw)
+				dng_save(mem, info, metadata, filename, cam_model, options);
+			else if (options->Get().encoding == "jpg")
+				jpeg_save(mem, info, metadata, filename, cam_model, options);
+			else if (options->Get().encoding == "png")
+				png_save(mem, info, filename, options);
+			else if (options->Get().encoding == "bmp")
+				bmp_save(mem, info, filename, options);
+			else
+				yuv_save(mem, info, filename, options);
+			LOG(2, "Saved image " << info.width << " x " << info.height << " to file " << filename);
+			if (last)
+				client->Reply("ok " + filename + " " + std::to_string(ts));
+		}
+		catch (std::exception const &e)
+		{
+			client->Reply("error " + filename + ": " + e.what());
+		}
+	});
+}
+
+static void send_frame(RPiCamDaemonApp &app, CompletedRequestPtr &payload, Client &client)
+{
+	Stream *stream = app.StillStream();
+	StreamInfo info = app.GetStreamInfo(stream);
+	BufferReadSync r(&app, payload->buffers[stream]);
+	const std::vector<libcamera::Span<uint8_t>> mem = r.Get();
+	size_t size = 0;
+	for (auto const &span : mem)
+		size += span.size();
+
+	// A sealed copy, so the client can keep it as long as it likes and we needn't trust it with our buffers.
+	int fd = memfd_create("rpicam-frame", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		throw std::runtime_error("failed to create memfd: " + std::string(strerror(errno)));
+	void *dest = MAP_FAILED;
+	if (ftruncate(fd, size) == 0)
+		dest = mmap(nullptr, size, PROT_WRITE, MAP_SHARED, fd, 0);
+	if (dest == MAP_FAILED)
+	{
+		close(fd);
+		throw std::runtime_error("failed to map memfd: " + std::string(strerror(errno)));
+	}
+	uint8_t *ptr = static_cast<uint8_t *>(dest);
+	for (auto const &span : mem)
+		ptr = std::copy(span.begin(), span.end(), ptr);
+	munmap(dest, size);
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+
+	int64_t ts = payload->metadata.get(libcamera::controls::SensorTimestamp).value_or(0);
+	client.Reply("ok " + std::to_string(info.width) + " " + std::to_string(info.height) + " " +
+					 std::to_string(info.stride) + " " + info.pixel_format.toString() + " " + std::to_string(size) +
+					 " " + std::to_string(ts),
+				 fd);
+	close(fd);
+}
+
+static void set_control(RPiCamDaemonApp &app, std::string const &name, std::istream &args)
+{
+	libcamera::ControlList cl;
+	if (name == "shutter")
+	{
+		int32_t us = -1;
+		args >> us;
+		cl.set(libcamera::controls::ExposureTimeMode,
+			   us ? libcamera::controls::ExposureTimeModeManual : libcamera::controls::ExposureTimeModeAuto);
+		if (us)
+			cl.set(libcamera::controls::ExposureTime, us);
+	}
+	else if (name == "gain")
+	{
+		float gain = -1;
+		args >> gain;
+		cl.set(libcamera::controls::AnalogueGainMode,
+			   gain ? libcamera::controls::AnalogueGainModeManual : libcamera::controls::AnalogueGainModeAuto);
+		if (gain)
+			cl.set(libcamera::controls::AnalogueGain, gain);
+	}
+	else if (name == "awbgains")
+	{
+		float r = -1, b = -1;
+		char comma = 0;
+		args >> r >> comma >> b;
+		if (comma != ',')
+			args.setstate(std::ios::failbit);
+		cl.set(libcamera::controls::AwbEnable, !r || !b);
+		if (r && b)
+			cl.set(libcamera::controls::ColourGains, libcamera::Span<const float, 2>({ r, b }));
+	}
+	else if (name == "lens-position")
+	{
+		float position = -1;
+		args >> position;
+		cl.set(libcamera::controls::AfMode, libcamera::controls::AfModeManual);
+		cl.set(libcamera::controls::LensPosition, position);
+	}
+	else
+	{
+		static const std::map<std::string, libcamera::Control<float> const *> float_controls = {
+			{ "ev", &libcamera::controls::ExposureValue },		   { "brightness", &libcamera::controls::Brightness },
+			{ "contrast", &libcamera::controls::Contrast },		   { "saturation", &libcamera::controls::Saturation },
+			{ "sharpness", &libcamera::controls::Sharpness },
+		};
+		auto it = float_controls.find(name);
+		if (it == float_controls.end())
+			throw std::runtime_error("unknown control " + name);
+		float value = 0;
+		args >> value;
+		cl.set(*it->second, value);
+	}
+
+	if (args.fail())
+		throw std::runtime_error("bad value for " + name);
+	app.SetControls(cl);
+}
+
+// Returns false if the client asked us to quit.
+static bool handle_command(RPiCamDaemonApp &app, ClientPtr const &client, std::string const &line,
+						   std::list<Capture> &captures, std::optional<FrameInfo> const &latest)
+{
+	std::istringstream args(line);
+	std::string command;
+	args >> command;
+
+	if (command == "capture" || command == "burst")
+	{
+		std::string filename;
+		unsigned int count = 1;
+		args >> filename;
+		if (command == "burst")
+			args >> count;
+		if (args.fail() || filename.empty() || !count)
+			throw std::runtime_error("usage: capture <file> or burst <pattern> <count>");
+		bool burst = command == "burst";
+		if (burst && !valid_pattern(filename))
+			throw std::runtime_error("burst pattern needs a single integer conversion, such as %03d");
+		captures.push_back({ client, false, burst, filename, count, 0 });
+	}
+	else if (command == "capture-fd")
+		captures.push_back({ client, true, false, "", 1, 0 });
+	else if (command == "set")
+	{
+		std::string name;
+		args >> name;
+		set_control(app, name, args);
+		client->Reply("ok");
+	}
+	else if (command == "status")
+	{
+		if (!latest)
+			throw std::runtime_error("no frames yet");
+		client->Reply("ok sequence " + std::to_string(latest->sequence) + " exposure " +
+					  std::to_string(latest->exposure_time) + " gain " + std::to_string(latest->analogue_gain));
+	}
+	else if (command == "quit")
+	{
+		client->Reply("ok");
+		return false;
+	}
+	else if (!command.empty())
+		throw std::runtime_error("unknown command " + command);
+
+	return true;
+}
+
+// Returns false if the client has gone.
+static bool read_client(RPiCamDaemonApp &app, ClientPtr const &client, std::list<Capture> &captures,
+						std::optional<FrameInfo> const &latest, bool &quit)
+{
+	char buf[1024];
+	ssize_t len = read(client->fd, buf, sizeof(buf));
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return true;
+	if (len <= 0)
+		return false;
+
+	client->input.append(buf, len);
+	size_t end;
+	while ((end = client->input.find('\n')) != std::string::npos)
+	{
+		std::string line = client->input.substr(0, end);
+		client->input.erase(0, end + 1);
+		try
+		{
+			if (!handle_command(app, client, line, captures, latest))
+				quit = true;
+		}
+		catch (std::exception const &e)
+		{
+			client->Reply(std::string("error ") + e.what());
+		}
+	}
+
+	if (client->input.size() > 4096)
+	{
+		client->Reply("error command too long");
+		return false;
+	}
+	return true;
+}
+
+static void event_loop(RPiCamDaemonApp &app)
+{
+	StillOptions const *options = app.GetOptions();
+	unsigned int still_flags = RPiCamApp::FLAG_STILL_NONE;
+	if (options->Get().encoding == "rgb24" || options->Get().encoding == "png")
+		still_flags |= RPiCamApp::FLAG_STILL_BGR;
+	if (options->Get().encoding == "rgb48")
+		still_flags |= RPiCamApp::FLAG_STILL_BGR48;
+	else if (options->Get().encoding == "bmp")
+		still_flags |= RPiCamApp::FLAG_STILL_RGB;
+	if (options->Get().raw)
+		still_flags |= RPiCamApp::FLAG_STILL_RAW;
+
+	app.OpenCamera();
+	app.ConfigureZsl(still_flags);
+	app.StartCamera();
+
+	// Pending saves are finished off when this goes out of scope, each still holding its client.
+	SaveQueue save_queue(options->Get().save_queue);
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, nullptr);
+	int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	int listen_fd = listen_socket(app.GetOptions()->Get().socket);
+
+	std::list<ClientPtr> clients;
+	std::list<Capture> captures;
+	std::optional<FrameInfo> latest;
+	bool quit = false;
+
+	enum { POLL_MESSAGE, POLL_SIGNAL, POLL_LISTEN, POLL_CLIENTS };
+	std::vector<pollfd> fds;
+	while (!quit)
+	{
+		fds.resize(POLL_CLIENTS);
+		fds[POLL_MESSAGE] = { app.MessageFd(), POLLIN, 0 };
+		fds[POLL_SIGNAL] = { signal_fd, POLLIN, 0 };
+		fds[POLL_LISTEN] = { listen_fd, POLLIN, 0 };
+		for (auto const &client : clients)
+			fds.push_back({ client->fd, POLLIN, 0 });
+
+		if (poll(fds.data(), fds.size(), -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error("poll failed");
+		}
+
+		if (fds[POLL_SIGNAL].revents & POLLIN)
+		{
+			LOG(1, "Received signal, stopping");
+			break;
+		}
+
+		if (fds[POLL_LISTEN].revents & POLLIN)
+		{
+			int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+			if (fd >= 0)
+			{
+				LOG(2, "Client connected");
+				clients.push_back(std::make_shared<Client>(fd));
+			}
+		}
+
+		unsigned int i = POLL_CLIENTS;
+		for (auto it = clients.begin(); it != clients.end(); i++)
+		{
+			// Clients accepted just now weren't polled.
+			if (i < fds.size() && (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) &&
+				!read_client(app, *it, captures, latest, quit))
+			{
+				LOG(2, "Client disconnected");
+				captures.remove_if([&it](Capture const &c) { return c.client == *it; });
+				it = clients.erase(it);
+			}
+			else
+				it++;
+		}
+
+		while (std::optional<RPiCamApp::Msg> msg = app.TryWait())
+		{
+			if (msg->type == RPiCamApp::MsgType::Timeout)
+			{
+				LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
+				app.StopCamera();
+				app.StartCamera();
+				continue;
+			}
+			if (msg->type == RPiCamApp::MsgType::Quit)
+			{
+				quit = true;
+				break;
+			}
+			else if (msg->type != RPiCamApp::MsgType::RequestComplete)
+				throw std::runtime_error("unrecognised message!");
+
+			CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg->payload);
+			latest.emplace(completed_request);
+
+			// Every capture waiting gets this frame, bursts taking one frame at a time.
+			for (auto it = captures.begin(); it != captures.end();)
+			{
+				try
+				{
+					if (it->to_fd)
+						send_frame(app, completed_request, *it->client);
+					else
+					{
+						std::string filename = it->burst ? format_filename(it->filename, it->index) : it->filename;
+						bool last = it->index + 1 == it->count;
+						save_frame(app, save_queue, completed_request, app.StillStream(), filename, it->client,
+								   last && !options->Get().raw);
+						if (options->Get().raw)
+							save_frame(app, save_queue, completed_request, app.RawStream(),
+									   filename.substr(0, filename.rfind('.')) + ".dng", it->client, last);
+					}
+				}
+				catch (std::exception const &e)
+				{
+					it->client->Reply(std::string("error ") + e.what());
+					it->index = it->count;
+				}
+
+				if (++it->index >= it->count)
+					it = captures.erase(it);
+				else
+					it++;
+			}
+
+			app.ShowPreview(completed_request, app.ViewfinderStream());
+		}
+	}
+
+	close(listen_fd);
+	unlink(app.GetOptions()->Get().socket.c_str());
+	close(signal_fd);
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		RPiCamDaemonApp app;
+		DaemonOptions *options = app.GetOptions();
+		if (options->Parse(argc, argv))
+		{
+			if (options->Get().verbose >= 2)
+				options->Print();
+
+			event_loop(app);
+		}
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: *** " << e.what() << " ***");
+		return -1;
+	}
+	return 0;
+}
@@ -6,8 +6,14 @@
  */
 
 // Example: rpicam-detect --post-process-file object_detect_tf.json --lores-width 400 --lores-height 300 -t 0 --object cat -o cat%03d.jpg
+//
+// With --zsl the camera runs in the full resolution still mode throughout, and a detection saves the frame
+// the detector actually looked at (or the nearest we still have) instead of stopping to capture a new one.
 
+#include <algorithm>
 #include <chrono>
+#include <cstdlib>
+#include <deque>
 
 #include "core/rpicam_app.hpp"
 #include "core/still_options.hpp"
@@ -25,12 +31,15 @@ struct DetectOptions : public StillOptions
 			("object", value<std::string>(&object), "Name of object to detect")
 			("gap", value<unsigned int>(&gap)->default_value(30), "Smallest gap between captures in frames")
 			("timeformat", value<std::string>(&timeformat)->default_value("%m%d%H%M%S"), "Date/Time format string - see C++ strftime()")
+			("history", value<unsigned int>(&history)->default_value(8),
+			 "With --zsl, how many of the most recent frames to keep for a detection to choose from")
 			;
 	}
 
 	std::string object;
 	unsigned int gap;
 	std::string timeformat;
+	unsigned int history;
 
 	virtual void Print() const override
 	{
@@ -38,6 +47,7 @@ struct DetectOptions : public StillOptions
 		std::cerr << "    object: " << object << std::endl;
 		std::cerr << "    gap: " << gap << std::endl;
 		std::cerr << "    timeformat: " << timeformat << std::endl;
+		std::cerr << "    history: " << history << std::endl;
 	}
 };
 
@@ -48,13 +58,63 @@ public:
 	DetectOptions *GetOptions() const { return static_cast<DetectOptions *>(RPiCamApp::GetOptions()); }
 };
 
+static void save_capture(RPiCamDetectApp &app, CompletedRequestPtr &completed_request)
+{
+	DetectOptions *options = app.GetOptions();
+	StreamInfo info;
+	libcamera::Stream *stream = app.StillStream(&info);
+	BufferReadSync r(&app, completed_request->buffers[stream]);
+	const std::vector<libcamera::Span<uint8_t>> mem = r.Get();
+	uint32_t framestart = options->Get().framestart;
+
+	// Generate a filename for the output and save it.
+	char filename[128];
+	if (options->Get().datetime)
+	{
+		std::time_t raw_time;
+		std::time(&raw_time);
+		char time_string[32];
+		std::tm *time_info = std::localtime(&raw_time);
+		std::strftime(time_string, sizeof(time_string), options->timeformat.c_str(), time_info);
+		snprintf(filename, sizeof(filename), "%s%s.%s", options->Get().output.c_str(), time_string,
+				 options->Get().encoding.c_str());
+	}
+	else if (options->Get().timestamp)
+		snprintf(filename, sizeof(filename), "%s%u.%s", options->Get().output.c_str(), (unsigned)time(NULL),
+				 options->Get().encoding.c_str());
+	else
+		snprintf(filename, sizeof(filename), options->Get().output.c_str(), framestart);
+	filename[sizeof(filename) - 1] = 0;
+	options->Set().framestart = framestart + 1;
+	LOG(1, "Save image " << filename);
+	jpeg_save(mem, info, completed_request->metadata, std::string(filename), app.CameraModel(), options);
+}
+
+// Of the frames we're holding on to, the one with the sequence number nearest to the given one.
+
+static CompletedRequestPtr &nearest_frame(std::deque<CompletedRequestPtr> &history, unsigned int sequence)
+{
+	auto distance = [sequence](CompletedRequestPtr const &r) { return std::abs((int)(r->sequence - sequence)); };
+	return *std::min_element(history.begin(), history.end(), [&distance](auto const &a, auto const &b)
+							 { return distance(a) < distance(b); });
+}
+
 // The main even loop for the application.
 
 static void event_loop(RPiCamDetectApp &app)
 {
 	DetectOptions *options = app.GetOptions();
+	bool zsl = options->Get().zsl;
+	// The history holds on to camera buffers, so the camera needs a few more than that.
+	if (zsl && !options->Get().buffer_count)
+		options->Set().buffer_count = options->history + 3;
+	std::deque<CompletedRequestPtr> history;
+
 	app.OpenCamera();
-	app.ConfigureViewfinder();
+	if (zsl)
+		app.ConfigureZsl(RPiCamApp::FLAG_STILL_LORES_VIEWFINDER);
+	else
+		app.ConfigureViewfinder();
 	app.StartCamera();
 	auto start_time = std::chrono::high_resolution_clock::now();
 	unsigned int last_capture_frame = 0;
@@ -83,14 +143,31 @@ static void event_loop(RPiCamDetectApp &app)
 
 			std::vector<Detection> detections;
 			bool detected = completed_request->sequence - last_capture_frame >= options->gap &&
-							completed_request->post_process_metadata.Get("object_detect.results", detections) == 0 &&
+							completed_request->post_process_metadata.Get(OBJECT_DETECT_RESULTS, detections) == 0 &&
 							std::find_if(detections.begin(), detections.end(), [options](const Detection &d)
 										 { return d.name.find(options->object) != std::string::npos; }) !=
 								detections.end();
 
 			app.ShowPreview(completed_request, app.ViewfinderStream());
 
-			if (detected)
+			if (zsl)
+			{
+				history.push_back(completed_request);
+				if (history.size() > std::max(options->history, 1u))
+					history.pop_front();
+				if (detected)
+				{
+					// The detector's results may well come from an earlier frame than this one.
+					unsigned int sequence = completed_request->sequence;
+					completed_request->post_process_metadata.Get(RESULTS_SEQUENCE, sequence);
+					CompletedRequestPtr &frame = nearest_frame(history, sequence);
+					LOG(1, options->object << " detected in frame " << sequence << ", saving frame "
+										   << frame->sequence);
+					last_capture_frame = completed_request->sequence;
+					save_capture(app, frame);
+				}
+			}
+			else if (detected)
 			{
 				app.StopCamera();
 				app.Teardown();
@@ -104,34 +181,7 @@ static void event_loop(RPiCamDetectApp &app)
 		{
 			app.StopCamera();
 			last_capture_frame = completed_request->sequence;
-
-			StreamInfo info;
-			libcamera::Stream *stream = app.StillStream(&info);
-			BufferReadSync r(&app, completed_request->buffers[stream]);
-			const std::vector<libcamera::Span<uint8_t>> mem = r.Get();
-			uint32_t framestart = options->Get().framestart;
-
-			// Generate a filename for the output and save it.
-			char filename[128];
-			if (options->Get().datetime)
-			{
-				std::time_t raw_time;
-				std::time(&raw_time);
-				char time_string[32];
-				std::tm *time_info = std::localtime(&raw_time);
-				std::strftime(time_string, sizeof(time_string), options->timeformat.c_str(), time_info);
-				snprintf(filename, sizeof(filename), "%s%s.%s", options->Get().output.c_str(), time_string,
-						 options->Get().encoding.c_str());
-			}
-			else if (options->Get().timestamp)
-				snprintf(filename, sizeof(filename), "%s%u.%s", options->Get().output.c_str(), (unsigned)time(NULL),
-						 options->Get().encoding.c_str());
-			else
-				snprintf(filename, sizeof(filename), options->Get().output.c_str(), framestart);
-			filename[sizeof(filename) - 1] = 0;
-			options->Set().framestart = framestart + 1;
-			LOG(1, "Save image " << filename);
-			jpeg_save(mem, info, completed_request->metadata, std::string(filename), app.CameraModel(), options);
+			save_capture(app, completed_request);
 
 			// Restart camera in preview mode.
 			app.Teardown();
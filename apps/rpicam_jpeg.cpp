@@ -32,7 +32,7 @@ public:
 };
 
 // Save metadata to file
-static void save_metadata(StillOptions const *options, libcamera::ControlList &metadata)
+static void save_metadata(StillOptions const *options, CompletedRequestPtr &completed_request)
 {
 	std::streambuf *buf = std::cout.rdbuf();
 	std::ofstream of;
@@ -44,7 +44,9 @@ static void save_metadata(StillOptions const *options, libcamera::ControlList &m
 		buf = of.rdbuf();
 	}
 
-	write_metadata(buf, options->Get().metadata_format, metadata, true);
+	SidecarValues extra;
+	completed_request->post_process_metadata.Get(SIDECAR_VALUES, extra);
+	write_metadata(buf, options->Get().metadata_format, completed_request->metadata, true, extra);
 }
 
 // The main even loop for the application.
@@ -103,7 +105,7 @@ static void event_loop(RPiCamJpegApp &app)
 			const std::vector<libcamera::Span<uint8_t>> mem = r.Get();
 			jpeg_save(mem, info, payload->metadata, options->Get().output, app.CameraModel(), options);
 			if (!options->Get().metadata.empty())
-				save_metadata(options, payload->metadata);
+				save_metadata(options, payload);
 			return;
 		}
 	}
@@ -0,0 +1,344 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * rpicam_multi.cpp - record video from several cameras in one process.
+ */
+
+// Example: rpicam-multi --cameras 0,1 -t 10000 -o cam%d.h264
+//
+// Each camera gets an RPiCamEncoder of its own, with its own streams, buffers, post-processing and encoder,
+// all configured from the same command line. They share the process's one libcamera CameraManager (and
+// so one pipeline handler and one set of IPA threads), rather than paying for it once per camera as
+// separate rpicam-vid processes would. A "%d" in --output, --metadata and --save-pts is replaced by
+// the camera number, and every frame's CompletedRequest carries that number too. Only the
+// first camera shows a preview.
+//
+// With two cameras, --pair only records the frames that pair up, by sensor timestamp, with one from the
+// other camera, so that the two recordings hold the same moments, frame for frame. The metadata files
+// then give each frame's pair number and the offset between the two timestamps. Combine it with --sync
+// to bring the cameras' frames close enough together to pair in the first place.
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <signal.h>
+#include <sstream>
+#include <thread>
+
+#include "core/rpicam_encoder.hpp"
+#include "output/output.hpp"
+
+using namespace std::placeholders;
+
+struct MultiOptions : public VideoOptions
+{
+	MultiOptions() : VideoOptions()
+	{
+		using namespace boost::program_options;
+		options_->add_options()
+			("cameras", value<std::string>(&cameras)->default_value("0,1"),
+			 "Comma separated list of the cameras to record from")
+			("pair", value<std::string>(&pair_)->default_value("0us"),
+			 "With two cameras, only record frames whose sensor timestamps are within this much of a frame from "
+			 "the other camera, or 0 to record every frame. If no units are provided default to us.")
+			;
+	}
+
+	std::string cameras;
+	TimeVal<std::chrono::microseconds> pair;
+
+	virtual bool Parse(int argc, char *argv[]) override
+	{
+		if (!VideoOptions::Parse(argc, argv))
+			return false;
+		pair.set(pair_);
+		return true;
+	}
+
+	virtual void Print() const override
+	{
+		VideoOptions::Print();
+		std::cerr << "    cameras: " << cameras << std::endl;
+		std::cerr << "    pair: " << pair.get() << "us" << std::endl;
+	}
+
+private:
+	std::string pair_;
+};
+
+class RPiCamMultiApp : public RPiCamEncoder
+{
+public:
+	RPiCamMultiApp() : RPiCamEncoder(std::make_unique<MultiOptions>()) {}
+	MultiOptions *GetMultiOptions() const { return static_cast<MultiOptions *>(RPiCamApp::GetOptions()); }
+};
+
+static int signal_received;
+static void default_signal_handler(int signal_number)
+{
+	signal_received = signal_number;
+	LOG(1, "Received signal " << signal_number);
+}
+
+static std::string camera_filename(std::string const &name, unsigned int camera)
+{
+	size_t pos = name.find("%d");
+	if (pos == std::string::npos)
+		return name;
+	return name.substr(0, pos) + std::to_string(camera) + name.substr(pos + 2);
+}
+
+// Matches up the frames of two cameras by sensor timestamp. Each camera's thread hands over its frames,
+// and gets back whichever of its own are now paired, in order. That can include a frame paired by the
+// other camera's thread since this one last called. A frame that can no longer be matched, because the
+// other camera has already moved past it, is dropped; so are the oldest when too many frames are waiting,
+// as each holds a camera buffer and the other camera may have stalled.
+
+class FramePairer
+{
+public:
+	FramePairer(int64_t tolerance_ns) : tolerance_(tolerance_ns) {}
+
+	~FramePairer()
+	{
+		LOG(1, "Paired " << pairs_ << " frames, dropped " << dropped_[0] << " and " << dropped_[1] << " unmatched");
+	}
+
+	std::vector<CompletedRequestPtr> Add(unsigned int index, CompletedRequestPtr const &request)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto ts = request->metadata.get(libcamera::controls::SensorTimestamp);
+		if (!ts)
+			dropped_[index]++;
+		else
+		{
+			waiting_[index].push_back({ *ts, request });
+			if (waiting_[index].size() > MAX_WAITING)
+			{
+				waiting_[index].pop_front();
+				dropped_[index]++;
+			}
+			match();
+		}
+		return std::move(paired_[index]);
+	}
+
+	// Let go of everything belonging to a camera that is stopping.
+	void Flush(unsigned int index)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		waiting_[index].clear();
+		paired_[index].clear();
+	}
+
+private:
+	static constexpr unsigned int MAX_WAITING = 4;
+
+	struct Frame
+	{
+		int64_t timestamp;
+		CompletedRequestPtr request;
+	};
+
+	void match()
+	{
+		while (!waiting_[0].empty() && !waiting_[1].empty())
+		{
+			Frame &a = waiting_[0].front(), &b = waiting_[1].front();
+			int64_t offset = b.timestamp - a.timestamp;
+			if (std::abs(offset) <= tolerance_)
+			{
+				std::string offset_us = std::to_string(offset / 1000.0);
+				for (Frame *f : { &a, &b })
+				{
+					AppendSidecar(f->request->post_process_metadata, "pair.sequence", std::to_string(pairs_));
+					AppendSidecar(f->request->post_process_metadata, "pair.offset_us", offset_us);
+				}
+				paired_[0].push_back(std::move(a.request));
+				paired_[1].push_back(std::move(b.request));
+				waiting_[0].pop_front();
+				waiting_[1].pop_front();
+				pairs_++;
+			}
+			else
+			{
+				// The older one can't match anything the other camera has yet to deliver.
+				unsigned int older = offset > 0 ? 0 : 1;
+				waiting_[older].pop_front();
+				dropped_[older]++;
+			}
+		}
+	}
+
+	int64_t tolerance_;
+	std::mutex mutex_;
+	std::deque<Frame> waiting_[2];
+	std::vector<CompletedRequestPtr> paired_[2];
+	uint64_t pairs_ = 0;
+	uint64_t dropped_[2] = {};
+};
+
+// Give a camera its copy of the common options.
+
+static void camera_options(OptsInternal &o, OptsInternal const &common, unsigned int camera, bool first)
+{
+	o = common;
+	o.camera = camera;
+	o.output = camera_filename(common.output, camera);
+	o.metadata = camera_filename(common.metadata, camera);
+	o.save_pts = camera_filename(common.save_pts, camera);
+	if (!first)
+		o.nopreview = true;
+	// The keyboard belongs to the main thread.
+	o.keypress = false;
+}
+
+static void event_loop(RPiCamMultiApp &app, unsigned int index, FramePairer *pairer, std::atomic<bool> &stop)
+{
+	VideoOptions const *options = app.GetOptions();
+	std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
+	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
+	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1, _2));
+
+	app.OpenCamera();
+	app.ConfigureVideo(options->Get().codec == "mjpeg" || options->Get().codec == "yuv420"
+						   ? RPiCamEncoder::FLAG_VIDEO_JPEG_COLOURSPACE
+						   : RPiCamEncoder::FLAG_VIDEO_NONE);
+	app.StartEncoder();
+	app.StartCamera();
+	LOG(1, "Camera " << options->Get().camera << " (" << app.CameraModel() << ") started");
+	auto start_time = std::chrono::high_resolution_clock::now();
+
+	for (unsigned int count = 0;; count++)
+	{
+		RPiCamEncoder::Msg msg = app.Wait();
+		if (msg.type == RPiCamApp::MsgType::Timeout)
+		{
+			LOG_ERROR("ERROR: Device timeout detected on camera " << options->Get().camera
+																	<< ", attempting a restart!!!");
+			app.StopCamera();
+			app.StartCamera();
+			continue;
+		}
+		if (msg.type == RPiCamEncoder::MsgType::Quit)
+			break;
+		else if (msg.type != RPiCamEncoder::MsgType::RequestComplete)
+			throw std::runtime_error("unrecognised message!");
+
+		auto now = std::chrono::high_resolution_clock::now();
+		bool timeout = !options->Get().frames && options->Get().timeout &&
+					   ((now - start_time) > options->Get().timeout.value);
+		bool frameout = options->Get().frames && count >= options->Get().frames;
+		if (timeout || frameout || stop)
+			break;
+
+		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+		std::vector<CompletedRequestPtr> frames;
+		if (pairer)
+			frames = pairer->Add(index, completed_request);
+		else
+			frames.push_back(completed_request);
+		for (CompletedRequestPtr &frame : frames)
+		{
+			if (!app.EncodeBuffer(frame, app.VideoStream()))
+			{
+				// Still waiting to start recording, perhaps for synchronisation with another camera.
+				start_time = now;
+				count = 0;
+			}
+		}
+		app.ShowPreview(completed_request, app.VideoStream());
+	}
+
+	stop = true;
+	if (pairer)
+		pairer->Flush(index);
+	app.StopCamera();
+	app.StopEncoder();
+	LOG(1, "Camera " << options->Get().camera << " stopped");
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		std::vector<std::unique_ptr<RPiCamMultiApp>> apps;
+		apps.push_back(std::make_unique<RPiCamMultiApp>());
+		MultiOptions *options = apps[0]->GetMultiOptions();
+		if (!options->Parse(argc, argv))
+			return 0;
+		if (options->Get().verbose >= 2)
+			options->Print();
+
+		std::vector<unsigned int> cameras;
+		std::stringstream ss(options->cameras);
+		for (std::string cam; std::getline(ss, cam, ',');)
+			cameras.push_back(std::stoul(cam));
+		if (cameras.empty())
+			throw std::runtime_error("no cameras given");
+		OptsInternal common = options->Get();
+		auto numbered = [](std::string const &name) { return name.empty() || name.find("%d") != std::string::npos; };
+		if (cameras.size() > 1 &&
+			(!numbered(common.output) || !numbered(common.metadata) || !numbered(common.save_pts)))
+			throw std::runtime_error("output file names need a %d for the camera number");
+		if (!common.lores_codec.empty())
+			throw std::runtime_error("rpicam-multi does not support --lores-codec");
+		std::unique_ptr<FramePairer> pairer;
+		if (options->pair)
+		{
+			if (cameras.size() != 2)
+				throw std::runtime_error("--pair needs exactly two cameras");
+			pairer = std::make_unique<FramePairer>(options->pair.get<std::chrono::nanoseconds>());
+		}
+
+		for (unsigned int i = 1; i < cameras.size(); i++)
+			apps.push_back(std::make_unique<RPiCamMultiApp>());
+		for (unsigned int i = 0; i < cameras.size(); i++)
+			camera_options(apps[i]->GetOptions()->Set(), common, cameras[i], i == 0);
+
+		signal(SIGINT, default_signal_handler);
+		signal(SIGPIPE, default_signal_handler);
+
+		// A camera that stops, for whatever reason, stops the others too.
+		std::atomic<bool> stop = false;
+		std::mutex error_mutex;
+		std::exception_ptr error;
+		std::vector<std::thread> threads;
+		for (unsigned int i = 0; i < apps.size(); i++)
+		{
+			threads.emplace_back([&app = apps[i], i, &pairer, &stop, &error_mutex, &error]() {
+				try
+				{
+					event_loop(*app, i, pairer.get(), stop);
+				}
+				catch (...)
+				{
+					std::lock_guard<std::mutex> lock(error_mutex);
+					if (!error)
+						error = std::current_exception();
+					stop = true;
+				}
+			});
+		}
+
+		while (!stop)
+		{
+			if (signal_received == SIGINT || signal_received == SIGPIPE)
+				stop = true;
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		}
+		for (auto &thread : threads)
+			thread.join();
+		if (error)
+			std::rethrow_exception(error);
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: *** " << e.what() << " ***");
+		return -1;
+	}
+	return 0;
+}
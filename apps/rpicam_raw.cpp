@@ -10,6 +10,7 @@
 #include "core/rpicam_encoder.hpp"
 #include "encoder/null_encoder.hpp"
 #include "output/output.hpp"
+#include "output/raw_recorder.hpp"
 
 using namespace std::placeholders;
 
@@ -30,10 +31,14 @@ static void event_loop(LibcameraRaw &app)
 	VideoOptions const *options = app.GetOptions();
 	std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
 	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
-	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1));
+	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1, _2));
 
 	app.OpenCamera();
 	app.ConfigureVideo(LibcameraRaw::FLAG_VIDEO_RAW);
+	// The ring recorder takes the raw buffers itself, leaving the encoder and output with nothing to do.
+	std::unique_ptr<RawRecorder> recorder;
+	if (options->Get().raw_ring)
+		recorder = std::make_unique<RawRecorder>(&app, options, app.RawStream());
 	app.StartEncoder();
 	app.StartCamera();
 	auto start_time = std::chrono::high_resolution_clock::now();
@@ -62,12 +67,15 @@ static void event_loop(LibcameraRaw &app)
 		auto now = std::chrono::high_resolution_clock::now();
 		if (options->Get().timeout && (now - start_time) > options->Get().timeout.value)
 		{
+			recorder.reset();
 			app.StopCamera();
 			app.StopEncoder();
 			return;
 		}
 
-		if (!app.EncodeBuffer(std::get<CompletedRequestPtr>(msg.payload), app.RawStream()))
+		if (recorder)
+			recorder->Write(std::get<CompletedRequestPtr>(msg.payload));
+		else if (!app.EncodeBuffer(std::get<CompletedRequestPtr>(msg.payload), app.RawStream()))
 		{
 			// Keep advancing our "start time" if we're still waiting to start recording (e.g.
 			// waiting for synchronisation with another camera).
@@ -5,7 +5,11 @@
  * rpicam_still.cpp - libcamera stills capture app.
  */
 #include <chrono>
+#include <deque>
 #include <filesystem>
+#include <future>
+#include <limits>
+#include <numeric>
 #include <poll.h>
 #include <signal.h>
 #include <sys/signalfd.h>
@@ -20,6 +24,7 @@
 #include "output/output.hpp"
 
 #include "image/image.hpp"
+#include "image/save_queue.hpp"
 
 using namespace std::chrono_literals;
 using namespace std::placeholders;
@@ -77,43 +82,39 @@ static void update_latest_link(std::string const &filename, StillOptions const *
 	}
 }
 
-static void save_image(RPiCamStillApp &app, CompletedRequestPtr &payload, Stream *stream,
-					   std::string const &filename)
+// With a thumb_stream, the saver expects that stream's buffer after the image's own planes, for the
+// JPEG thumbnail.
+
+static SaveQueue::SaveFn image_saver(RPiCamStillApp &app, CompletedRequestPtr &payload, Stream *stream,
+									std::string const &filename, bool update_latest, Stream *thumb_stream = nullptr)
 {
 	StillOptions const *options = app.GetOptions();
 	StreamInfo info = app.GetStreamInfo(stream);
-	BufferReadSync r(&app, payload->buffers[stream]);
-	const std::vector<libcamera::Span<uint8_t>> mem = r.Get();
-	if (stream == app.RawStream())
-		dng_save(mem, info, payload->metadata, filename, app.CameraModel(), options);
-	else if (options->Get().encoding == "jpg")
-		jpeg_save(mem, info, payload->metadata, filename, app.CameraModel(), options);
-	else if (options->Get().encoding == "png")
-		png_save(mem, info, filename, options);
-	else if (options->Get().encoding == "bmp")
-		bmp_save(mem, info, filename, options);
-	else
-		yuv_save(mem, info, filename, options);
-	LOG(2, "Saved image " << info.width << " x " << info.height << " to file " << filename);
-}
-
-static void save_images(RPiCamStillApp &app, CompletedRequestPtr &payload)
-{
-	StillOptions *options = app.GetOptions();
-	std::string filename = generate_filename(options);
-	save_image(app, payload, app.StillStream(), filename);
-	update_latest_link(filename, options);
-	if (options->Get().raw)
-	{
-		filename = filename.substr(0, filename.rfind('.')) + ".dng";
-		save_image(app, payload, app.RawStream(), filename);
-	}
-	options->Set().framestart++;
-	if (options->Get().wrap)
-		options->Set().framestart %= options->Get().wrap;
+	StreamInfo thumb_info = thumb_stream ? app.GetStreamInfo(thumb_stream) : StreamInfo();
+	bool raw = stream == app.RawStream(), thumb = thumb_stream != nullptr;
+	// Everything the save needs is captured by value, as it may run after this request has gone.
+	return [info, thumb_info, metadata = payload->metadata, filename, cam_model = app.CameraModel(), options, raw,
+			thumb, update_latest](std::vector<libcamera::Span<uint8_t>> const &mem) {
+		if (raw)
+			dng_save(mem, info, metadata, filename, cam_model, options);
+		else if (options->Get().encoding == "jpg" && thumb)
+			jpeg_save(std::vector<libcamera::Span<uint8_t>>(mem.begin(), mem.end() - 1), info, metadata, filename,
+					  cam_model, options, { mem.back() }, thumb_info);
+		else if (options->Get().encoding == "jpg")
+			jpeg_save(mem, info, metadata, filename, cam_model, options);
+		else if (options->Get().encoding == "png")
+			png_save(mem, info, filename, options);
+		else if (options->Get().encoding == "bmp")
+			bmp_save(mem, info, filename, options);
+		else
+			yuv_save(mem, info, filename, options);
+		LOG(2, "Saved image " << info.width << " x " << info.height << " to file " << filename);
+		if (update_latest)
+			update_latest_link(filename, options);
+	};
 }
 
-static void save_metadata(StillOptions const *options, libcamera::ControlList &metadata)
+static void save_metadata(StillOptions const *options, CompletedRequestPtr const &completed_request)
 {
 	std::streambuf *buf = std::cout.rdbuf();
 	std::ofstream of;
@@ -125,7 +126,93 @@ static void save_metadata(StillOptions const *options, libcamera::ControlList &m
 		buf = of.rdbuf();
 	}
 
-	write_metadata(buf, options->Get().metadata_format, metadata, true);
+	SidecarValues extra;
+	completed_request->post_process_metadata.Get(SIDECAR_VALUES, extra);
+	write_metadata(buf, options->Get().metadata_format, completed_request->metadata, true, extra);
+}
+
+static void reserve_like(SaveQueue &save_queue, std::vector<libcamera::Span<uint8_t>> const &mem, unsigned int count)
+{
+	std::vector<size_t> sizes;
+	for (auto const &plane : mem)
+		sizes.push_back(plane.size());
+	if (count)
+		save_queue.Reserve(sizes, count);
+}
+
+// Save the still image, the DNG with --raw, and the metadata with --metadata. Without a save queue we have
+// to wait for them all, so they run side by side straight from the camera buffers, which this request
+// holds on to until the last finishes. Otherwise the images join the queue and only the metadata is
+// written here. A JPEG's thumbnail comes from the lores image, when there is one. The queue can be told to
+// reserve copies for this many more images like these ones.
+
+static void save_images(RPiCamStillApp &app, SaveQueue &save_queue, CompletedRequestPtr &payload,
+						unsigned int reserve = 0)
+{
+	StillOptions *options = app.GetOptions();
+	std::string filename = generate_filename(options);
+	std::string raw_filename = filename.substr(0, filename.rfind('.')) + ".dng";
+	bool raw = options->Get().raw, metadata = !options->Get().metadata.empty();
+	Stream *thumb_stream = nullptr;
+	if (options->Get().encoding == "jpg" && options->Get().thumb_quality && app.LoresStream() &&
+		payload->buffers.count(app.LoresStream()))
+		thumb_stream = app.LoresStream();
+	SaveQueue::SaveFn save_still = image_saver(app, payload, app.StillStream(), filename, true, thumb_stream);
+
+	if (!options->Get().save_queue)
+	{
+		BufferReadSync still_r(&app, payload->buffers[app.StillStream()]);
+		std::vector<libcamera::Span<uint8_t>> still_mem = still_r.Get();
+		std::unique_ptr<BufferReadSync> thumb_r, raw_r;
+		if (thumb_stream)
+		{
+			thumb_r = std::make_unique<BufferReadSync>(&app, payload->buffers[thumb_stream]);
+			still_mem.push_back(thumb_r->Get()[0]);
+		}
+		std::future<void> raw_done, metadata_done;
+		if (raw)
+		{
+			raw_r = std::make_unique<BufferReadSync>(&app, payload->buffers[app.RawStream()]);
+			raw_done = std::async(std::launch::async, image_saver(app, payload, app.RawStream(), raw_filename, false),
+								  raw_r->Get());
+		}
+		if (metadata)
+			metadata_done = std::async(std::launch::async, save_metadata, options, payload);
+
+		// The futures wait for their saves even if this one throws.
+		save_still(still_mem);
+		if (raw_done.valid())
+			raw_done.get();
+		if (metadata_done.valid())
+			metadata_done.get();
+	}
+	else
+	{
+		{
+			BufferReadSync r(&app, payload->buffers[app.StillStream()]);
+			std::vector<libcamera::Span<uint8_t>> still_mem = r.Get();
+			std::unique_ptr<BufferReadSync> thumb_r;
+			if (thumb_stream)
+			{
+				thumb_r = std::make_unique<BufferReadSync>(&app, payload->buffers[thumb_stream]);
+				still_mem.push_back(thumb_r->Get()[0]);
+			}
+			reserve_like(save_queue, still_mem, reserve);
+			save_queue.Push(still_mem, save_still);
+		}
+		if (raw)
+		{
+			BufferReadSync r(&app, payload->buffers[app.RawStream()]);
+			reserve_like(save_queue, r.Get(), reserve);
+			save_queue.Push(r.Get(), image_saver(app, payload, app.RawStream(), raw_filename, false));
+		}
+		if (metadata)
+			save_metadata(options, payload);
+	}
+
+	options->Set().framestart++;
+	if (options->Get().wrap)
+		options->Set().framestart %= options->Get().wrap;
 }
 
 // Some keypress/signal handling.
@@ -161,6 +248,137 @@ static int get_key_or_signal(StillOptions const *options, pollfd p[1])
 	return key;
 }
 
+// With --zsl, timelapse captures come straight out of the running camera, which is never reconfigured. The
+// deadlines are exact multiples of the interval after the first frame, measured on the sensor's own clock, and
+// each one takes whichever frame has the nearest timestamp. So the intervals don't drift, however long the
+// saves take. We hold on to the last frame before each deadline until we see the one after it.
+
+static void timelapse_loop(RPiCamStillApp &app, SaveQueue &save_queue)
+{
+	StillOptions const *options = app.GetOptions();
+	int64_t interval = std::chrono::duration_cast<std::chrono::nanoseconds>(options->Get().timelapse.value).count();
+	auto start_time = std::chrono::high_resolution_clock::now();
+	int64_t deadline = -1;
+	CompletedRequestPtr before;
+	int64_t before_ts = 0;
+
+	while (true)
+	{
+		RPiCamApp::Msg msg = app.Wait();
+		if (msg.type == RPiCamApp::MsgType::Timeout)
+		{
+			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
+			before.reset();
+			app.StopCamera();
+			app.StartCamera();
+			continue;
+		}
+		if (msg.type == RPiCamApp::MsgType::Quit)
+			return;
+		else if (msg.type != RPiCamApp::MsgType::RequestComplete)
+			throw std::runtime_error("unrecognised message!");
+
+		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+		if (options->Get().timeout && std::chrono::high_resolution_clock::now() - start_time > options->Get().timeout.value)
+			return;
+
+		app.ShowPreview(completed_request, app.ViewfinderStream());
+		auto ts = completed_request->metadata.get(libcamera::controls::SensorTimestamp);
+		if (!ts)
+			continue;
+		if (deadline < 0)
+			deadline = *ts + interval;
+
+		if (*ts < deadline)
+		{
+			before = completed_request;
+			before_ts = *ts;
+			continue;
+		}
+
+		CompletedRequestPtr &chosen = before && deadline - before_ts < *ts - deadline ? before : completed_request;
+		LOG(1, "Timelapse capture, " << (chosen == before ? before_ts : *ts) - deadline << "ns from deadline");
+		save_images(app, save_queue, chosen);
+		before.reset();
+
+		// If we've fallen behind (say the camera restarted), skip the deadlines we missed rather than bunch up.
+		deadline += interval;
+		while (deadline <= *ts)
+		{
+			LOG_ERROR("WARNING: missed a timelapse deadline");
+			deadline += interval;
+		}
+	}
+}
+
+// With --zsl-select, keeps the best of the last few ZSL frames for the capture to take, instead of the
+// next one to arrive. Only frames that could still be the best are held, as each holds camera buffers: a new
+// frame lets go of the older ones that score no better, and frames are let go of once they fall out of the
+// window. So the best is always at the front.
+
+class ZslSelector
+{
+public:
+	ZslSelector(unsigned int window, std::string const &metric) : window_(window), metric_(metric) {}
+
+	void Add(CompletedRequestPtr const &request)
+	{
+		double s = score(request);
+		while (!frames_.empty() && frames_.front().request->sequence + window_ <= request->sequence)
+			frames_.pop_front();
+		// Frames nobody measured (a stage skipping some, for example) can't be compared, so aren't candidates.
+		if (s == -std::numeric_limits<double>::infinity())
+			return;
+		while (!frames_.empty() && frames_.back().score <= s)
+			frames_.pop_back();
+		frames_.push_back({ s, request });
+	}
+
+	// Returns nothing if none of the frames in the window were measured.
+	CompletedRequestPtr Take()
+	{
+		if (frames_.empty())
+			return {};
+		CompletedRequestPtr best = std::move(frames_.front().request);
+		LOG(2, "ZSL selected frame " << best->sequence << " with " << metric_ << " " << frames_.front().score);
+		frames_.clear();
+		return best;
+	}
+
+private:
+	// Higher is better, and -infinity means the frame has no measurement to go on.
+	double score(CompletedRequestPtr const &request) const
+	{
+		constexpr double missing = -std::numeric_limits<double>::infinity();
+		if (metric_ == "focus")
+		{
+			auto fom = request->metadata.get(libcamera::controls::FocusFoM);
+			return fom ? *fom : missing;
+		}
+		else if (metric_ == "sharpness")
+		{
+			double energy = 0;
+			if (request->post_process_metadata.Get("sobel.edge_energy", energy))
+				return missing;
+			return energy;
+		}
+		std::vector<unsigned int> tiles;
+		if (request->post_process_metadata.Get("motion_detect.tiles", tiles))
+			return missing;
+		return -std::accumulate(tiles.begin(), tiles.end(), 0.0);
+	}
+
+	struct Frame
+	{
+		double score;
+		CompletedRequestPtr request;
+	};
+
+	unsigned int window_;
+	std::string metric_;
+	std::deque<Frame> frames_;
+};
+
 // The main even loop for the application.
 
 static void event_loop(RPiCamStillApp &app)
@@ -180,8 +398,30 @@ static void event_loop(RPiCamStillApp &app)
 	if (options->Get().raw)
 		still_flags |= RPiCamApp::FLAG_STILL_RAW;
 
+	// A burst is copied into the save queue, paused, as it arrives, so the queue needs room for all of it,
+	// and the camera enough buffers to keep streaming meanwhile.
+	unsigned int burst = options->Get().burst, burst_frame = 0;
+	if (burst > 1)
+	{
+		unsigned int images = burst * (options->Get().raw ? 2 : 1);
+		app.GetOptions()->Set().save_queue = std::max(options->Get().save_queue, images);
+		if (!options->Get().buffer_count)
+			still_flags |= RPiCamApp::FLAG_STILL_TRIPLE_BUFFER;
+	}
+	// The selector can hold on to every frame in its window, so leave the camera a few more than that.
+	std::unique_ptr<ZslSelector> selector;
+	if (options->Get().zsl_select)
+	{
+		selector = std::make_unique<ZslSelector>(options->Get().zsl_select, options->Get().zsl_metric);
+		if (!options->Get().buffer_count)
+			app.GetOptions()->Set().buffer_count = options->Get().zsl_select + 3;
+	}
+
 	app.OpenCamera();
 
+	// Pending saves are finished off when this goes out of scope.
+	SaveQueue save_queue(options->Get().save_queue);
+
 	// Monitoring for keypresses and signals.
 	signal(SIGUSR1, default_signal_handler);
 	signal(SIGUSR2, default_signal_handler);
@@ -201,10 +441,17 @@ static void event_loop(RPiCamStillApp &app)
 		}
 	}
 	else if (options->Get().zsl)
-		app.ConfigureZsl();
+		app.ConfigureZsl(still_flags);
 	else
 		app.ConfigureViewfinder();
 	app.StartCamera();
+
+	if (options->Get().zsl && options->Get().timelapse && output && !keypress && !options->Get().af_on_capture &&
+		!options->Get().immediate && burst == 1 && !selector)
+	{
+		timelapse_loop(app, save_queue);
+		return;
+	}
 	auto start_time = std::chrono::high_resolution_clock::now();
 	auto timelapse_time = start_time;
 	int timelapse_frames = 0;
@@ -249,6 +496,8 @@ static void event_loop(RPiCamStillApp &app)
 		{
 			LOG(2, "Viewfinder frame " << count);
 			timelapse_frames++;
+			if (selector)
+				selector->Add(completed_request);
 
 			bool timed_out = options->Get().timeout && (now - start_time) > options->Get().timeout.value;
 			bool timelapse_timed_out = options->Get().timelapse &&
@@ -313,13 +562,32 @@ static void event_loop(RPiCamStillApp &app)
 		// otherwise quit.
 		else if (app.StillStream() && want_capture)
 		{
-			want_capture = false;
-			if (!options->Get().zsl)
-				app.StopCamera();
+			unsigned int frame = burst_frame++;
+			bool last = burst_frame == burst;
+			if (burst > 1 && frame == 0)
+				save_queue.Pause();
+			if (last)
+			{
+				want_capture = false;
+				burst_frame = 0;
+				if (!options->Get().zsl)
+					app.StopCamera();
+			}
 			LOG(1, "Still capture image received");
-			save_images(app, completed_request);
-			if (!options->Get().metadata.empty())
-				save_metadata(options, completed_request->metadata);
+			if (selector)
+			{
+				selector->Add(completed_request);
+				if (CompletedRequestPtr best = selector->Take())
+					completed_request = std::move(best);
+			}
+			save_images(app, save_queue, completed_request, frame == 0 ? burst - 1 : 0);
+			if (!last)
+				continue;
+			if (burst > 1)
+			{
+				LOG(1, "Burst of " << burst << " captured, now saving");
+				save_queue.Resume();
+			}
 			timelapse_frames = 0;
 			if (!options->Get().immediate &&
 				(options->Get().timelapse || options->Get().signal || options->Get().keypress))
@@ -5,11 +5,16 @@
  * rpicam_vid.cpp - libcamera video record app.
  */
 
+#include <algorithm>
 #include <chrono>
 #include <poll.h>
 #include <signal.h>
+#include <sstream>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "core/rpicam_encoder.hpp"
 #include "output/output.hpp"
@@ -25,7 +30,7 @@ static void default_signal_handler(int signal_number)
 	LOG(1, "Received signal " << signal_number);
 }
 
-static int get_key_or_signal(VideoOptions const *options, pollfd p[1])
+static int get_key_or_signal(VideoOptions const *options, pollfd p[1], std::string &line)
 {
 	int key = 0;
 	if (signal_received == SIGINT)
@@ -39,6 +44,8 @@ static int get_key_or_signal(VideoOptions const *options, pollfd p[1])
 			size_t len;
 			[[maybe_unused]] size_t r = getline(&user_string, &len, stdin);
 			key = user_string[0];
+			line = user_string;
+			free(user_string);
 		}
 	}
 	if (options->Get().signal)
@@ -47,11 +54,168 @@ static int get_key_or_signal(VideoOptions const *options, pollfd p[1])
 			key = '\n';
 		else if ((signal_received == SIGUSR2) || (signal_received == SIGPIPE))
 			key = 'x';
+		else if (signal_received == SIGHUP)
+		{
+			key = 'k';
+			line = "k";
+		}
 		signal_received = 0;
 	}
 	return key;
 }
 
+// Commands to change the encoder's settings as it runs, from the keyboard or the --encoder-socket:
+//   k               make a keyframe now
+//   b <bitrate>     change the bitrate, e.g. "b 4mbps"
+//   q [<qp>]        fix the quantiser, or let it vary again
+//   i <frames>      change the intra period
+// Returns false if it isn't one of these.
+
+static bool encoder_command(RPiCamEncoder &app, std::string const &command)
+{
+	std::istringstream in(command);
+	std::string name, arg;
+	in >> name >> arg;
+	EncoderControls &controls = *app.GetEncoderControls();
+
+	try
+	{
+		if (name == "k" || name == "K")
+			controls.keyframe = true;
+		else if (name == "b" && !arg.empty())
+		{
+			Bitrate bitrate;
+			bitrate.set(arg);
+			controls.bitrate = bitrate.bps();
+		}
+		else if (name == "q")
+			controls.qp = arg.empty() ? EncoderControls::QP_FREE : std::clamp(std::stoi(arg), 0, 51);
+		else if (name == "i" && !arg.empty())
+			controls.intra = std::stoul(arg);
+		else
+			return false;
+	}
+	catch (std::exception const &)
+	{
+		LOG_ERROR("Bad encoder command: " << command);
+	}
+	return true;
+}
+
+// A Unix datagram socket for encoder commands, one to a datagram, such as
+//   echo "b 2mbps" | socat - UNIX-SENDTO:/tmp/encoder.sock
+
+class EncoderSocket
+{
+public:
+	EncoderSocket(std::string const &path) : path_(path)
+	{
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(addr.sun_path))
+			throw std::runtime_error("encoder socket path too long: " + path);
+		strcpy(addr.sun_path, path.c_str());
+
+		fd_ = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd_ < 0)
+			throw std::runtime_error("unable to open encoder socket");
+		unlink(path.c_str());
+		// Only our own user may change the encoder's settings. Anything that got in before the chmod is
+		// thrown away.
+		if (bind(fd_, (sockaddr *)&addr, sizeof(addr)) < 0)
+		{
+			close(fd_);
+			throw std::runtime_error("failed to bind encoder socket " + path);
+		}
+		if (chmod(path.c_str(), S_IRUSR | S_IWUSR) < 0)
+		{
+			close(fd_);
+			unlink(path.c_str());
+			throw std::runtime_error("failed to set permissions on encoder socket " + path);
+		}
+		char discard;
+		while (recv(fd_, &discard, sizeof(discard), 0) >= 0)
+			;
+	}
+
+	~EncoderSocket()
+	{
+		close(fd_);
+		unlink(path_.c_str());
+	}
+
+	// Carry out any commands that have arrived, without waiting for more.
+	void Poll(RPiCamEncoder &app)
+	{
+		char command[256];
+		ssize_t n;
+		while ((n = recv(fd_, command, sizeof(command) - 1, 0)) > 0)
+		{
+			command[n] = '\0';
+			if (!encoder_command(app, command))
+				LOG_ERROR("Unknown encoder command: " << command);
+		}
+	}
+
+private:
+	std::string path_;
+	int fd_;
+};
+
+// With --idle-framerate, slow the camera down to that framerate once the motion_detect stage has seen
+// nothing for --idle-holdoff, and speed it back up on the first frame with motion. Going down only after a
+// quiet spell, but straight back up, stops it flapping when motion hovers at the edge of detection. Output
+// timestamps come from the sensor, so the recording keeps real time across the changes, and a keyframe
+// on waking lets anyone joining (or a --motion-gate) start on the motion without a long wait.
+
+class IdleFramerate
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	IdleFramerate(VideoOptions const *options)
+		: full_frame_time_(1000000 / options->Get().framerate.value_or(DEFAULT_FRAMERATE)),
+		  idle_frame_time_(1000000 / options->Get().idle_framerate),
+		  holdoff_(options->Get().idle_holdoff.value)
+	{
+		Reset();
+	}
+
+	// The camera has (re)started at the full framerate.
+	void Reset()
+	{
+		idle_ = false;
+		last_motion_ = clock::now();
+	}
+
+	void Update(RPiCamEncoder &app, bool motion)
+	{
+		clock::time_point now = clock::now();
+		if (motion)
+			last_motion_ = now;
+		bool idle = now - last_motion_ > holdoff_;
+		if (idle == idle_)
+			return;
+
+		idle_ = idle;
+		int64_t frame_time = idle ? idle_frame_time_ : full_frame_time_;
+		libcamera::ControlList controls;
+		controls.set(libcamera::controls::FrameDurationLimits,
+					 libcamera::Span<const int64_t, 2>({ frame_time, frame_time }));
+		app.SetControls(controls);
+		if (!idle)
+			app.GetEncoderControls()->keyframe = true;
+		LOG(1, (idle ? "No motion, going idle at " : "Motion, back to ") << 1e6 / frame_time << "fps");
+	}
+
+private:
+	int64_t full_frame_time_; // us
+	int64_t idle_frame_time_;
+	clock::duration holdoff_;
+	bool idle_;
+	clock::time_point last_motion_;
+};
+
 static int get_colourspace_flags(std::string const &codec)
 {
 	if (codec == "mjpeg" || codec == "yuv420")
@@ -60,6 +224,27 @@ static int get_colourspace_flags(std::string const &codec)
 		return RPiCamEncoder::FLAG_VIDEO_NONE;
 }
 
+// Options for the lores stream encoder, when --lores-codec is given. These are a copy of the main
+// ones, except for the codec and output, and without the file management that only makes sense for
+// the main recording.
+
+static std::unique_ptr<VideoOptions> lores_encoder_options(VideoOptions const *options)
+{
+	auto lores_options = std::make_unique<VideoOptions>();
+	lores_options->Set() = options->Get();
+	OptsInternal &o = lores_options->Set();
+	o.codec = o.lores_codec;
+	o.output = o.lores_output;
+	o.save_pts.clear();
+	o.metadata.clear();
+	o.circular = 0;
+	o.circular_clip.set("0ms");
+	o.split = false;
+	o.segment = 0;
+	o.motion_gate = false;
+	return lores_options;
+}
+
 // The main even loop for the application.
 
 static void event_loop(RPiCamEncoder &app)
@@ -67,11 +252,31 @@ static void event_loop(RPiCamEncoder &app)
 	VideoOptions const *options = app.GetOptions();
 	std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
 	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
-	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1));
+	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1, _2));
+	output->SetEncoderControls(app.GetEncoderControls());
+	std::unique_ptr<VideoOptions> lores_options;
+	std::unique_ptr<Output> lores_output;
+
+	// However we leave, even by an exception, the encoders must stop before the outputs and options
+	// they call into go away.
+	struct EncoderGuard
+	{
+		RPiCamEncoder &app;
+		~EncoderGuard() { app.StopEncoder(); }
+	} encoder_guard { app };
 
 	app.OpenCamera();
 	app.ConfigureVideo(get_colourspace_flags(options->Get().codec));
 	app.StartEncoder();
+
+	if (!options->Get().lores_codec.empty())
+	{
+		lores_options = lores_encoder_options(options);
+		lores_output = std::unique_ptr<Output>(Output::Create(lores_options.get()));
+		app.AddEncoder(app.LoresStream(), lores_options.get(),
+					   std::bind(&Output::OutputReady, lores_output.get(), _1, _2, _3, _4));
+	}
+
 	app.StartCamera();
 	auto start_time = std::chrono::high_resolution_clock::now();
 
@@ -83,8 +288,18 @@ static void event_loop(RPiCamEncoder &app)
 	// you're using TCP to stream to VLC and the user presses the stop button in VLC. Catching the
 	// signal to be able to react on it, otherwise the app terminates.
 	signal(SIGPIPE, default_signal_handler);
+	// SIGHUP (asking for a keyframe) must still hang us up unless we've been told to take signals.
+	if (options->Get().signal)
+		signal(SIGHUP, default_signal_handler);
 	pollfd p[1] = { { STDIN_FILENO, POLLIN, 0 } };
 
+	std::unique_ptr<EncoderSocket> encoder_socket;
+	if (!options->Get().encoder_socket.empty())
+		encoder_socket = std::make_unique<EncoderSocket>(options->Get().encoder_socket);
+	std::unique_ptr<IdleFramerate> idle_framerate;
+	if (options->Get().idle_framerate)
+		idle_framerate = std::make_unique<IdleFramerate>(options);
+
 	for (unsigned int count = 0; ; count++)
 	{
 		RPiCamEncoder::Msg msg = app.Wait();
@@ -93,15 +308,26 @@ static void event_loop(RPiCamEncoder &app)
 			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
 			app.StopCamera();
 			app.StartCamera();
+			if (idle_framerate)
+				idle_framerate->Reset();
 			continue;
 		}
 		if (msg.type == RPiCamEncoder::MsgType::Quit)
 			return;
 		else if (msg.type != RPiCamEncoder::MsgType::RequestComplete)
 			throw std::runtime_error("unrecognised message!");
-		int key = get_key_or_signal(options, p);
+		std::string line;
+		int key = get_key_or_signal(options, p, line);
+		if (key && key != '\n' && key != 'x' && key != 'X')
+			encoder_command(app, line);
+		if (encoder_socket)
+			encoder_socket->Poll(app);
 		if (key == '\n')
+		{
 			output->Signal();
+			if (lores_output)
+				lores_output->Signal();
+		}
 
 		LOG(2, "Viewfinder frame " << count);
 		auto now = std::chrono::high_resolution_clock::now();
@@ -118,6 +344,16 @@ static void event_loop(RPiCamEncoder &app)
 			return;
 		}
 		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+		// Motion reported by the motion_detect stage triggers (or prolongs) a clip in circular-clip mode,
+		// opens the output in motion-gate mode, and sets the framerate with --idle-framerate.
+		bool motion = false;
+		bool measured = !completed_request->post_process_metadata.Get(MOTION_DETECT_RESULT, motion);
+		if (options->Get().circular_clip && motion)
+			output->Signal();
+		output->MotionReady(motion);
+		// A frame the stage didn't look at (perhaps it's been reloaded away) mustn't slow the camera down.
+		if (idle_framerate)
+			idle_framerate->Update(app, motion || !measured);
 		if (!app.EncodeBuffer(completed_request, app.VideoStream()))
 		{
 			// Keep advancing our "start time" if we're still waiting to start recording (e.g.
@@ -125,6 +361,8 @@ static void event_loop(RPiCamEncoder &app)
 			start_time = now;
 			count = 0; // reset the "frames encoded" counter too
 		}
+		else if (lores_output)
+			app.EncodeBuffer(completed_request, app.LoresStream());
 		app.ShowPreview(completed_request, app.VideoStream());
 	}
 }
@@ -5,6 +5,7 @@
  * buffer_sync.cpp - Buffer coherency handling
  */
 
+#include <errno.h>
 #include <linux/dma-buf.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
@@ -13,12 +14,104 @@
 #include "core/rpicam_app.hpp"
 #include "core/logging.hpp"
 
-BufferWriteSync::BufferWriteSync(RPiCamApp *app, libcamera::FrameBuffer *fb)
-	: fb_(fb)
+static int sync_dma_buf(int fd, uint64_t flags)
 {
 	struct dma_buf_sync dma_sync {};
-	dma_sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW;
+	dma_sync.flags = flags;
+	int ret = ::ioctl(fd, DMA_BUF_IOCTL_SYNC, &dma_sync);
+	// Ordinary memory, such as the memfds a FrameSource uses, is always coherent and needs no syncing.
+	if (ret && errno == ENOTTY)
+		return 0;
+	return ret;
+}
+
+void BufferCoherency::DeviceWritten()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	stale_ = true;
+}
+
+int BufferCoherency::BeginRead(int fd)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (open_ == Access::None && stale_)
+	{
+		int ret = sync_dma_buf(fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+		if (ret)
+			return ret;
+		open_ = Access::Read;
+		stale_ = false;
+	}
+	users_++;
+	return 0;
+}
+
+void BufferCoherency::EndRead(int fd)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (endUser(fd))
+		LOG_ERROR("failed to unlock-sync dma buf");
+}
 
+int BufferCoherency::BeginWrite(int fd)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (open_ != Access::ReadWrite)
+	{
+		// A read access must be ended as such before it can be opened again for writing.
+		int ret = 0;
+		if (open_ == Access::Read)
+			ret = sync_dma_buf(fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+		if (!ret)
+			ret = sync_dma_buf(fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW);
+		if (ret)
+		{
+			open_ = Access::None;
+			return ret;
+		}
+		open_ = Access::ReadWrite;
+		stale_ = false;
+	}
+	users_++;
+	return 0;
+}
+
+int BufferCoherency::EndWrite(int fd)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return endUser(fd);
+}
+
+int BufferCoherency::endUser(int fd)
+{
+	// Called with mutex_ held. The writes must be flushed as soon as everyone's done, not when the buffer
+	// is re-queued, as the encoder or preview may be about to read them through the fd.
+	if (users_)
+		users_--;
+	if (users_ || open_ != Access::ReadWrite)
+		return 0;
+	open_ = Access::None;
+	return sync_dma_buf(fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW);
+}
+
+int BufferCoherency::ReleaseToDevice(int fd)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (users_)
+		LOG_ERROR("buffer returned to the camera while still in use by the CPU");
+	int ret = 0;
+	if (open_ == Access::Read)
+		ret = sync_dma_buf(fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+	else if (open_ == Access::ReadWrite)
+		ret = sync_dma_buf(fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW);
+	open_ = Access::None;
+	users_ = 0;
+	return ret;
+}
+
+BufferWriteSync::BufferWriteSync(RPiCamApp *app, libcamera::FrameBuffer *fb)
+	: fb_(fb), coherency_(nullptr)
+{
 	auto it = app->mapped_buffers_.find(fb_);
 	if (it == app->mapped_buffers_.end())
 	{
@@ -26,23 +119,25 @@ BufferWriteSync::BufferWriteSync(RPiCamApp *app, libcamera::FrameBuffer *fb)
 		return;
 	}
 
-	int ret = ::ioctl(fb_->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
-	if (ret)
+	if (!app->mapBuffer(it->second, fb_))
+	{
+		LOG_ERROR("failed to mmap buffer in BufferWriteSync");
+		return;
+	}
+
+	if (it->second.coherency.BeginWrite(fb_->planes()[0].fd.get()))
 	{
 		LOG_ERROR("failed to lock-sync-write dma buf");
 		return;
 	}
+	coherency_ = &it->second.coherency;
 
-	planes_ = it->second;
+	planes_ = it->second.planes;
 }
 
 BufferWriteSync::~BufferWriteSync()
 {
-	struct dma_buf_sync dma_sync {};
-	dma_sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW;
-
-	int ret = ::ioctl(fb_->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
-	if (ret)
+	if (coherency_ && coherency_->EndWrite(fb_->planes()[0].fd.get()))
 		LOG_ERROR("failed to unlock-sync-write dma buf");
 }
 
@@ -52,6 +147,7 @@ const std::vector<libcamera::Span<uint8_t>> &BufferWriteSync::Get() const
 }
 
 BufferReadSync::BufferReadSync(RPiCamApp *app, libcamera::FrameBuffer *fb)
+	: fb_(fb), coherency_(nullptr)
 {
 	auto it = app->mapped_buffers_.find(fb);
 	if (it == app->mapped_buffers_.end())
@@ -60,15 +156,30 @@ BufferReadSync::BufferReadSync(RPiCamApp *app, libcamera::FrameBuffer *fb)
 		return;
 	}
 
-	// DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ happens when the request completes,
-	// so nothing to do here but cache the planes map.
-	planes_ = it->second;
+	if (!app->mapBuffer(it->second, fb))
+	{
+		LOG_ERROR("failed to mmap buffer in BufferReadSync");
+		return;
+	}
+
+	// DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ only happens on the first CPU access after the camera
+	// has written the buffer; later readers find the caches already valid.
+	if (it->second.coherency.BeginRead(fb->planes()[0].fd.get()))
+	{
+		LOG_ERROR("failed to lock-sync-read dma buf");
+		return;
+	}
+	coherency_ = &it->second.coherency;
+
+	planes_ = it->second.planes;
 }
 
 BufferReadSync::~BufferReadSync()
 {
-	// DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ happens when we resend the buffer
-	// in the next request, so nothing to do here.
+	// DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ happens when we resend the buffer in the next request, unless a
+	// writer has come along meanwhile, in which case the last of us to finish ends it.
+	if (coherency_)
+		coherency_->EndRead(fb_->planes()[0].fd.get());
 }
 
 const std::vector<libcamera::Span<uint8_t>> &BufferReadSync::Get() const
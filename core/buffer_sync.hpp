@@ -7,10 +7,49 @@
 
 #pragma once
 
+#include <mutex>
+#include <vector>
+
+#include <libcamera/base/span.h>
 #include <libcamera/framebuffer.h>
 
 class RPiCamApp;
 
+// Tracks the CPU cache state of one dma-buf so that DMA_BUF_IOCTL_SYNC is only issued when CPU access
+// really begins or ends. Buffers that only ever get passed on by fd (to an encoder or DRM) are never
+// synced at all. The methods return the ioctl's result, or 0 if no ioctl was necessary.
+//
+// Every START is matched by an END in the same direction. A read access stays open after its readers
+// finish, so that later ones needn't sync again, until the buffer goes back to the camera. A write
+// upgrades it to read/write, and that is ended, flushing the writes, once the last CPU user is done.
+class BufferCoherency
+{
+public:
+	// The camera has written into the buffer, so anything the CPU has cached is stale.
+	void DeviceWritten();
+	int BeginRead(int fd);
+	void EndRead(int fd);
+	int BeginWrite(int fd);
+	int EndWrite(int fd);
+	// The buffer is about to go back to the camera; close any CPU access that's still open.
+	int ReleaseToDevice(int fd);
+
+private:
+	enum class Access
+	{
+		None,
+		Read, // START|READ issued
+		ReadWrite // START|RW issued
+	};
+
+	int endUser(int fd);
+
+	std::mutex mutex_;
+	Access open_ = Access::None;
+	bool stale_ = true; // CPU caches may be out of date, as the camera has written since
+	unsigned int users_ = 0; // between Begin and End
+};
+
 class BufferWriteSync
 {
 public:
@@ -21,6 +60,7 @@ public:
 
 private:
 	libcamera::FrameBuffer *fb_;
+	BufferCoherency *coherency_;
 	std::vector<libcamera::Span<uint8_t>> planes_;
 };
 
@@ -33,5 +73,7 @@ public:
 	const std::vector<libcamera::Span<uint8_t>> &Get() const;
 
 private:
+	libcamera::FrameBuffer *fb_;
+	BufferCoherency *coherency_;
 	std::vector<libcamera::Span<uint8_t>> planes_;
 };
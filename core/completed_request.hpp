@@ -7,6 +7,8 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstddef>
 #include <memory>
 
 #include <libcamera/controls.h>
@@ -14,23 +16,127 @@
 
 #include "core/metadata.hpp"
 
+// A frame's libcamera metadata. It is copied out of the request once, and anything that keeps it beyond the
+// frame itself, such as the metadata output queue or a background save, shares it by reference rather than
+// taking a copy of its own. Changing it copies it first, unless nothing else is sharing it.
+class FrameMetadata
+{
+public:
+	using ControlList = libcamera::ControlList;
+
+	FrameMetadata() : list_(std::make_shared<ControlList>()) {}
+	explicit FrameMetadata(ControlList const &list) : list_(std::make_shared<ControlList>(list)) {}
+
+	// Refill from a new request, reusing our own list when no one else holds on to it.
+	void Assign(ControlList const &list)
+	{
+		if (list_.use_count() == 1)
+			*list_ = list;
+		else
+			list_ = std::make_shared<ControlList>(list);
+	}
+
+	template <typename T>
+	auto get(libcamera::Control<T> const &ctrl) const
+	{
+		return list_->get(ctrl);
+	}
+
+	template <typename T, typename V>
+	void set(libcamera::Control<T> const &ctrl, V const &value)
+	{
+		if (list_.use_count() != 1)
+			list_ = std::make_shared<ControlList>(*list_);
+		list_->set(ctrl, value);
+	}
+
+	ControlList const &List() const { return *list_; }
+	operator ControlList const &() const { return *list_; }
+
+private:
+	std::shared_ptr<ControlList> list_;
+};
+
 struct CompletedRequest
 {
 	using BufferMap = libcamera::Request::BufferMap;
 	using ControlList = libcamera::ControlList;
 	using Request = libcamera::Request;
 
+	CompletedRequest() : sequence(0), request(nullptr), framerate(0), camera(0) {}
 	CompletedRequest(unsigned int seq, Request *r)
-		: sequence(seq), buffers(r->buffers()), metadata(r->metadata()), request(r)
+		: sequence(seq), buffers(r->buffers()), metadata(r->metadata()), request(r), camera(0)
+	{
+		r->reuse();
+	}
+	// Refill a pooled object in place. Assigning, rather than constructing, the buffer map and
+	// metadata lets those containers recycle the nodes they already own (the metadata's only if
+	// nothing downstream is still sharing it).
+	void Reset(unsigned int seq, Request *r)
 	{
+		sequence = seq;
+		buffers = r->buffers();
+		metadata.Assign(r->metadata());
+		request = r;
+		framerate = 0;
+		post_process_metadata.Clear();
 		r->reuse();
 	}
 	unsigned int sequence;
 	BufferMap buffers;
-	ControlList metadata;
+	FrameMetadata metadata;
 	Request *request;
 	float framerate;
+	unsigned int camera; // the --camera number of the camera it came from
 	Metadata post_process_metadata;
 };
 
 using CompletedRequestPtr = std::shared_ptr<CompletedRequest>;
+
+// Preallocated storage for one in-flight request. RPiCamApp keeps one of these for each libcamera
+// Request, and builds the CompletedRequestPtr's control block (and so its reference count) inside
+// it, which means handing a frame to the application costs no heap allocation.
+struct CompletedRequestSlot
+{
+	static constexpr std::size_t CONTROL_BLOCK_SIZE = 128;
+
+	CompletedRequest completed_request;
+	alignas(std::max_align_t) unsigned char control_block[CONTROL_BLOCK_SIZE];
+	// Set while a CompletedRequestPtr refers to this slot. It is only cleared once the control block
+	// itself has been released, which is after the deleter has run.
+	std::atomic<bool> in_use { false };
+};
+
+// Allocator that hands out a slot's control block storage to std::shared_ptr.
+template <typename T>
+struct CompletedRequestSlotAllocator
+{
+	using value_type = T;
+
+	explicit CompletedRequestSlotAllocator(CompletedRequestSlot *s) : slot(s) {}
+	template <typename U>
+	CompletedRequestSlotAllocator(CompletedRequestSlotAllocator<U> const &other) : slot(other.slot)
+	{
+	}
+
+	T *allocate(std::size_t)
+	{
+		static_assert(sizeof(T) <= CompletedRequestSlot::CONTROL_BLOCK_SIZE, "control block too big for slot");
+		static_assert(alignof(T) <= alignof(std::max_align_t), "control block over-aligned for slot");
+		return reinterpret_cast<T *>(slot->control_block);
+	}
+	void deallocate(T *, std::size_t) { slot->in_use.store(false, std::memory_order_release); }
+
+	template <typename U>
+	bool operator==(CompletedRequestSlotAllocator<U> const &other) const
+	{
+		return slot == other.slot;
+	}
+	template <typename U>
+	bool operator!=(CompletedRequestSlotAllocator<U> const &other) const
+	{
+		return slot != other.slot;
+	}
+
+	CompletedRequestSlot *slot;
+};
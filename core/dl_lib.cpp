@@ -5,9 +5,14 @@
  * dl_lib.cpp - Dynamic loading library
  */
 
+#include <filesystem>
+#include <fstream>
+
 #include "core/dl_lib.hpp"
 #include "core/logging.hpp"
 
+namespace fs = std::filesystem;
+
 DlLib::DlLib(const std::string &lib, int flags)
 {
 	if (!lib.empty())
@@ -54,3 +59,57 @@ const void *DlLib::GetSymbol(const std::string &symbol)
 
 	return symbol_map_[symbol];
 }
+
+void PluginLibraries::Scan(const std::string &dir)
+{
+	std::error_code ec;
+	if (dir.empty() || !fs::exists(dir, ec))
+		return;
+
+	for (auto const &p : fs::recursive_directory_iterator(dir, ec))
+	{
+		if (p.path().extension() != ".so")
+			continue;
+
+		const std::string library_path = p.path().string();
+		fs::path manifest_path = p.path();
+		manifest_path.replace_extension(".manifest");
+
+		std::ifstream manifest(manifest_path);
+		if (!manifest)
+		{
+			Open(library_path);
+			continue;
+		}
+
+		std::string line;
+		while (std::getline(manifest, line))
+		{
+			size_t start = line.find_first_not_of(" \t");
+			if (start == std::string::npos || line[start] == '#')
+				continue;
+			size_t end = line.find_last_not_of(" \t\r");
+			// The first library found to provide a name is the one that gets it.
+			names_.emplace(line.substr(start, end + 1 - start), library_path);
+		}
+		LOG(2, "Indexed plugin library " << library_path);
+	}
+}
+
+std::string PluginLibraries::Find(const std::string &name) const
+{
+	auto it = names_.find(name);
+	if (it == names_.end() || opened_.count(it->second))
+		return {};
+	return it->second;
+}
+
+bool PluginLibraries::Open(const std::string &path)
+{
+	if (path.empty() || !opened_.insert(path).second)
+		return false;
+
+	LOG(2, "Loading plugin library " << path);
+	libraries_.emplace_back(path);
+	return true;
+}
@@ -12,6 +12,9 @@
 #include <map>
 #include <memory>
 #include <mutex>
+#include <set>
+#include <string>
+#include <vector>
 
 // Dynamic library helper.
 class DlLib
@@ -30,3 +33,26 @@ private:
 	std::map<std::string, const void *> symbol_map_;
 	std::mutex lock_;
 };
+
+// The plugin libraries in a directory, which register their stages, encoders or previews when opened. A library
+// "foo.so" may have a "foo.manifest" beside it listing the names it registers, one per line, in which case it is
+// only opened once one of those names is asked for. Any library without a manifest is opened as soon as it's found.
+class PluginLibraries
+{
+public:
+	// Add the libraries under this directory, if it exists. Nothing is ever opened twice.
+	void Scan(const std::string &dir);
+
+	// The library that provides this name and hasn't been opened yet, or an empty string if there isn't one.
+	std::string Find(const std::string &name) const;
+
+	// Open the library if it isn't open already, returning true if it was opened now.
+	bool Open(const std::string &path);
+
+	bool Load(const std::string &name) { return Open(Find(name)); }
+
+private:
+	std::map<std::string, std::string> names_;
+	std::set<std::string> opened_;
+	std::vector<DlLib> libraries_;
+};
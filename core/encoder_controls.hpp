@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * encoder_controls.hpp - changes to make to a running encoder
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Requests for the video encoder to change what it's doing: a keyframe now, a new bitrate, quantiser or
+// intra period. Anyone holding one can ask, from any thread: the application's event loop, or an output
+// that can see its network link is congested or has a new client. The encoder picks the requests up as
+// it takes its next frame, so nobody waits for it, and an output can't outlive the encoder it's asking.
+struct EncoderControls
+{
+	static constexpr int QP_UNCHANGED = -1;
+	static constexpr int QP_FREE = -2;
+
+	std::atomic<uint32_t> bitrate { 0 }; // bits/second, or 0 for no change
+	std::atomic<int> qp { QP_UNCHANGED }; // fix the quantiser at this, or QP_FREE to let it vary again
+	std::atomic<uint32_t> intra { 0 }; // frames between keyframes, or 0 for no change
+	std::atomic<bool> keyframe { false };
+};
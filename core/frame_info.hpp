@@ -4,10 +4,13 @@
  *
  * frame_info.hpp - Frame info class for libcamera apps
  */
+
+#pragma once
+
 #include <array>
-#include <iomanip>
-#include <sstream>
+#include <charconv>
 #include <string>
+#include <vector>
 
 #include <libcamera/control_ids.h>
 #include <libcamera/controls.h>
@@ -64,64 +67,9 @@ struct FrameInfo
 			af_state = *afs;
 	}
 
-	std::string ToString(const std::string &info_string) const
-	{
-		std::string parsed(info_string);
-
-		for (auto const &t : tokens)
-		{
-			std::size_t pos = parsed.find(t);
-			if (pos != std::string::npos)
-			{
-				std::stringstream value;
-				value << std::fixed << std::setprecision(2);
-
-				if (t == "%frame")
-					value << sequence;
-				else if (t == "%fps")
-					value << fps;
-				else if (t == "%exp")
-					value << exposure_time;
-				else if (t == "%ag")
-					value << analogue_gain;
-				else if (t == "%dg")
-					value << digital_gain;
-				else if (t == "%rg")
-					value << colour_gains[0];
-				else if (t == "%bg")
-					value << colour_gains[1];
-				else if (t == "%focus")
-					value << focus;
-				else if (t == "%aelock")
-					value << aelock;
-				else if (t == "%lp")
-					value << lens_position;
-				else if (t == "%temp")
-					value << sensor_temp;
-				else if (t == "%afstate")
-				{
-					switch (af_state)
-					{
-					case libcamera::controls::AfStateIdle:
-						value << "idle";
-						break;
-					case libcamera::controls::AfStateScanning:
-						value << "scanning";
-						break;
-					case libcamera::controls::AfStateFocused:
-						value << "focused";
-						break;
-					default:
-						value << "failed";
-					}
-				}
-
-				parsed.replace(pos, t.length(), value.str());
-			}
-		}
-
-		return parsed;
-	}
+	// Replace the % directives in info_string by these values. To render the same string for every frame,
+	// parse it once into an InfoTextFormat instead.
+	std::string ToString(const std::string &info_string) const;
 
 	unsigned int sequence;
 	float exposure_time;
@@ -134,11 +82,157 @@ struct FrameInfo
 	float lens_position;
 	int af_state;
 	float sensor_temp;
+};
+
+// An info text string, parsed once into the literal text and the FrameInfo values in it, so that each
+// frame's text is rendered without searching the string, or allocating once the output has grown to size.
+// Directives that aren't ours (strftime's, say) are left in the text.
+class InfoTextFormat
+{
+public:
+	InfoTextFormat(std::string const &format = "") { Set(format); }
+
+	std::string const &Format() const { return format_; }
+
+	void Set(std::string const &format)
+	{
+		format_ = format;
+		parts_.clear();
+		size_t literal = 0;
+		for (size_t pos = format.find('%'); pos != std::string::npos; pos = format.find('%', pos))
+		{
+			Field field = NUM_FIELDS;
+			for (unsigned int f = 0; f < NUM_FIELDS && field == NUM_FIELDS; f++)
+			{
+				if (format.compare(pos, names[f].size(), names[f]) == 0)
+					field = (Field)f;
+			}
+			if (field == NUM_FIELDS)
+			{
+				pos++;
+				continue;
+			}
+			parts_.push_back({ literal, pos - literal, field });
+			pos += names[field].size();
+			literal = pos;
+		}
+		parts_.push_back({ literal, format.size() - literal, NUM_FIELDS });
+	}
+
+	void Render(FrameInfo const &info, std::string &out) const
+	{
+		out.clear();
+		for (Part const &part : parts_)
+		{
+			out.append(format_, part.start, part.length);
+			switch (part.field)
+			{
+			case Frame:
+				appendValue(out, info.sequence);
+				break;
+			case Fps:
+				appendValue(out, info.fps);
+				break;
+			case Exp:
+				appendValue(out, info.exposure_time);
+				break;
+			case Ag:
+				appendValue(out, info.analogue_gain);
+				break;
+			case Dg:
+				appendValue(out, info.digital_gain);
+				break;
+			case Rg:
+				appendValue(out, info.colour_gains[0]);
+				break;
+			case Bg:
+				appendValue(out, info.colour_gains[1]);
+				break;
+			case Focus:
+				appendValue(out, info.focus);
+				break;
+			case AeLock:
+				out += info.aelock ? '1' : '0';
+				break;
+			case Lp:
+				appendValue(out, info.lens_position);
+				break;
+			case Temp:
+				appendValue(out, info.sensor_temp);
+				break;
+			case AfState:
+				switch (info.af_state)
+				{
+				case libcamera::controls::AfStateIdle:
+					out += "idle";
+					break;
+				case libcamera::controls::AfStateScanning:
+					out += "scanning";
+					break;
+				case libcamera::controls::AfStateFocused:
+					out += "focused";
+					break;
+				default:
+					out += "failed";
+				}
+				break;
+			case NUM_FIELDS:
+				break;
+			}
+		}
+	}
 
 private:
-	// Info text tokens.
-	inline static const std::string tokens[] = {
-		"%frame", "%fps", "%exp", "%ag", "%dg", "%rg", "%bg",  "%focus",
-		"%aelock","%lp", "%temp", "%afstate"
+	enum Field
+	{
+		Frame,
+		Fps,
+		Exp,
+		Ag,
+		Dg,
+		Rg,
+		Bg,
+		Focus,
+		AeLock,
+		Lp,
+		Temp,
+		AfState,
+		NUM_FIELDS
+	};
+
+	inline static const std::string names[NUM_FIELDS] = {
+		"%frame", "%fps", "%exp", "%ag", "%dg", "%rg", "%bg", "%focus", "%aelock", "%lp", "%temp", "%afstate"
 	};
+
+	// A run of literal text from the format, followed by a value (or nothing, for NUM_FIELDS).
+	struct Part
+	{
+		size_t start;
+		size_t length;
+		Field field;
+	};
+
+	// Floats have 2 decimal places, as they always did.
+	static void appendValue(std::string &out, float value)
+	{
+		char buf[64];
+		auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value, std::chars_format::fixed, 2);
+		out.append(buf, ec == std::errc() ? end : buf);
+	}
+
+	static void appendValue(std::string &out, unsigned int value)
+	{
+		char buf[16];
+		out.append(buf, std::to_chars(buf, buf + sizeof(buf), value).ptr);
+	}
+
+	std::string format_;
+	std::vector<Part> parts_;
 };
+
+inline std::string FrameInfo::ToString(const std::string &info_string) const
+{
+	std::string text;
+	InfoTextFormat(info_string).Render(*this, text);
+	return text;
+}
@@ -0,0 +1,331 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * frame_source.cpp - feed frames from a file or a test pattern through the post-processing stages
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+#include <libcamera/color_space.h>
+#include <libcamera/formats.h>
+
+#include "core/frame_source.hpp"
+#include "core/options.hpp"
+#include "core/rpicam_app.hpp"
+
+using libcamera::FrameBuffer;
+using libcamera::StreamConfiguration;
+
+// Enough generated frames that the pattern visibly changes, without using too much memory at large sizes.
+static constexpr unsigned int PATTERN_FRAMES = 8;
+
+static unsigned int align_up(unsigned int value, unsigned int align)
+{
+	return (value + align - 1) & ~(align - 1);
+}
+
+static std::unique_ptr<FrameBuffer> make_buffer(unsigned int size, uint8_t **mem)
+{
+	int fd = memfd_create("rpicam-frame-source", MFD_CLOEXEC);
+	if (fd < 0)
+		throw std::runtime_error("failed to create frame source buffer");
+	void *ptr = MAP_FAILED;
+	if (ftruncate(fd, size) == 0)
+		ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED)
+	{
+		close(fd);
+		throw std::runtime_error("failed to map frame source buffer");
+	}
+	*mem = static_cast<uint8_t *>(ptr);
+
+	std::vector<FrameBuffer::Plane> planes(1);
+	planes[0].fd = libcamera::SharedFD(std::move(fd));
+	planes[0].offset = 0;
+	planes[0].length = size;
+	return std::make_unique<FrameBuffer>(planes);
+}
+
+FrameSource::FrameSource(RPiCamApp *app, unsigned int num_buffers) : app_(app), num_buffers_(num_buffers)
+{
+}
+
+FrameSource::~FrameSource()
+{
+	for (auto &buffer : buffers_)
+	{
+		munmap(buffer.main_mem, buffer.main->planes()[0].length);
+		if (buffer.lores)
+			munmap(buffer.lores_mem, buffer.lores->planes()[0].length);
+	}
+	if (frames_ && pattern_.empty())
+		munmap(const_cast<uint8_t *>(frames_), frames_size_);
+}
+
+void FrameSource::Open()
+{
+	OptsInternal const &options = app_->GetOptions()->Get();
+
+	if (!options.post_process_file.empty())
+	{
+		app_->post_processor_.LoadModules(options.post_process_libs);
+		app_->post_processor_.Read(options.post_process_file);
+	}
+	app_->post_processor_.SetCallback([this](CompletedRequestPtr &r) {
+		app_->msg_queue_.Post(RPiCamApp::Msg(RPiCamApp::MsgType::RequestComplete, std::move(r)));
+	});
+
+	width_ = options.width ? options.width : 640;
+	height_ = options.height ? options.height : 480;
+	if ((width_ | height_) & 1)
+		throw std::runtime_error("frame source width and height must be even");
+	size_t frame_size = width_ * height_ * 3 / 2;
+
+	if (options.source.rfind("pattern:", 0) == 0)
+	{
+		std::string pattern = options.source.substr(8);
+		if (pattern != "gradient" && pattern != "noise")
+			throw std::runtime_error("unknown frame source pattern " + pattern);
+
+		num_frames_ = PATTERN_FRAMES;
+		pattern_.resize(frame_size * num_frames_);
+		std::minstd_rand rand;
+		for (unsigned int i = 0; i < num_frames_; i++)
+		{
+			uint8_t *y = pattern_.data() + i * frame_size;
+			uint8_t *u = y + width_ * height_, *v = u + width_ * height_ / 4;
+			for (unsigned int row = 0; row < height_; row++)
+			{
+				for (unsigned int col = 0; col < width_; col++)
+					*y++ = pattern == "noise" ? rand() : (col + row + 16 * i) & 0xff;
+			}
+			for (unsigned int j = 0; j < width_ * height_ / 4; j++)
+			{
+				*u++ = pattern == "noise" ? rand() : 96 + (j % (width_ / 2)) * 64 / (width_ / 2);
+				*v++ = pattern == "noise" ? rand() : 160 - (j / (width_ / 2)) * 64 / (height_ / 2);
+			}
+		}
+		frames_ = pattern_.data();
+		frames_size_ = pattern_.size();
+	}
+	else
+	{
+		int fd = open(options.source.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			throw std::runtime_error("failed to open frame source " + options.source);
+		struct stat info;
+		void *ptr = MAP_FAILED;
+		if (fstat(fd, &info) == 0 && (size_t)info.st_size >= frame_size)
+			ptr = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (ptr == MAP_FAILED)
+			throw std::runtime_error("frame source " + options.source + " holds no " + std::to_string(width_) + "x" +
+									 std::to_string(height_) + " YUV420 frames");
+		frames_ = static_cast<uint8_t const *>(ptr);
+		frames_size_ = info.st_size;
+		num_frames_ = frames_size_ / frame_size;
+		if (frames_size_ % frame_size)
+			LOG(1, "Frame source " << options.source << " has a partial frame at the end, which is ignored");
+		madvise(ptr, frames_size_, MADV_SEQUENTIAL);
+	}
+	LOG(1, "Frame source " << options.source << ": " << num_frames_ << " frames of " << width_ << "x" << height_);
+
+	makeStreams();
+	app_->post_processor_.Configure();
+}
+
+void FrameSource::makeStreams()
+{
+	OptsInternal const &options = app_->GetOptions()->Get();
+
+	StreamConfiguration main;
+	main.pixelFormat = libcamera::formats::YUV420;
+	main.size = libcamera::Size(width_, height_);
+	main.stride = align_up(width_, 64);
+	main.frameSize = main.stride * height_ * 3 / 2;
+	main.bufferCount = num_buffers_;
+	main.colorSpace = libcamera::ColorSpace::Rec709;
+	main_stream_ = std::make_unique<SourceStream>(main);
+	app_->streams_["video"] = main_stream_.get();
+
+	StreamConfiguration lores;
+	if (options.lores_width && options.lores_height)
+	{
+		lores.pixelFormat = app_->lores_format_;
+		lores.size = libcamera::Size(options.lores_width & ~1, options.lores_height & ~1);
+		if (lores.pixelFormat == libcamera::formats::YUV420)
+		{
+			lores.stride = align_up(lores.size.width, 64);
+			lores.frameSize = lores.stride * lores.size.height * 3 / 2;
+			lores.colorSpace = libcamera::ColorSpace::Rec709;
+		}
+		else if (lores.pixelFormat == libcamera::formats::RGB888 || lores.pixelFormat == libcamera::formats::BGR888)
+		{
+			lores.stride = align_up(lores.size.width * 3, 64);
+			lores.frameSize = lores.stride * lores.size.height;
+			lores.colorSpace = libcamera::ColorSpace::Sycc;
+		}
+		else
+			throw std::runtime_error("frame source cannot make lores format " + lores.pixelFormat.toString());
+		lores.bufferCount = num_buffers_;
+		lores_stream_ = std::make_unique<SourceStream>(lores);
+		app_->streams_["lores"] = lores_stream_.get();
+	}
+
+	for (unsigned int i = 0; i < num_buffers_; i++)
+	{
+		Buffer buffer;
+		buffer.main = make_buffer(main.frameSize, &buffer.main_mem);
+		app_->mapped_buffers_[buffer.main.get()];
+		if (lores_stream_)
+		{
+			buffer.lores = make_buffer(lores.frameSize, &buffer.lores_mem);
+			app_->mapped_buffers_[buffer.lores.get()];
+		}
+		buffers_.push_back(std::move(buffer));
+		free_.push_back(i);
+	}
+}
+
+void FrameSource::Start()
+{
+	sequence_ = 0;
+	last_timestamp_ = 0;
+	app_->post_processor_.Start();
+}
+
+void FrameSource::Stop()
+{
+	app_->post_processor_.Stop();
+
+	// Anything the application hasn't collected is dropped, as when the camera stops.
+	app_->msg_queue_.Clear();
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		cond_var_.wait(lock, [this] { return free_.size() == buffers_.size(); });
+	}
+
+	app_->Teardown();
+}
+
+void FrameSource::release(unsigned int index)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	free_.push_back(index);
+	cond_var_.notify_one();
+}
+
+unsigned int FrameSource::InFlight()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return buffers_.size() - free_.size();
+}
+
+void FrameSource::fillMain(uint8_t *dest, unsigned int frame) const
+{
+	uint8_t const *src = frames_ + frame * (width_ * height_ * 3 / 2);
+	unsigned int stride = main_stream_->configuration().stride;
+
+	for (unsigned int y = 0; y < height_; y++, src += width_)
+		memcpy(dest + y * stride, src, width_);
+	dest += stride * height_;
+	for (unsigned int y = 0; y < height_; y++, src += width_ / 2)
+		memcpy(dest + y * (stride / 2), src, width_ / 2);
+}
+
+void FrameSource::fillLores(uint8_t const *main, uint8_t *dest) const
+{
+	// Nearest neighbour is fine here, as only the cost of the stages that consume the image is being measured.
+	StreamConfiguration const &cfg = lores_stream_->configuration();
+	unsigned int main_stride = main_stream_->configuration().stride;
+	unsigned int w = cfg.size.width, h = cfg.size.height;
+	uint8_t const *main_u = main + main_stride * height_;
+	uint8_t const *main_v = main_u + main_stride / 2 * height_ / 2;
+
+	if (cfg.pixelFormat == libcamera::formats::YUV420)
+	{
+		uint8_t *u = dest + cfg.stride * h, *v = u + cfg.stride / 2 * h / 2;
+		for (unsigned int y = 0; y < h; y++)
+		{
+			uint8_t const *row = main + (y * height_ / h) * main_stride;
+			for (unsigned int x = 0; x < w; x++)
+				dest[y * cfg.stride + x] = row[x * width_ / w];
+		}
+		for (unsigned int y = 0; y < h / 2; y++)
+		{
+			unsigned int offset = (y * height_ / h) * (main_stride / 2);
+			for (unsigned int x = 0; x < w / 2; x++)
+			{
+				u[y * (cfg.stride / 2) + x] = main_u[offset + x * width_ / w];
+				v[y * (cfg.stride / 2) + x] = main_v[offset + x * width_ / w];
+			}
+		}
+		return;
+	}
+
+	// libcamera's BGR888 is R, G, B in memory, and RGB888 the other way round.
+	bool bgr = cfg.pixelFormat == libcamera::formats::RGB888;
+	for (unsigned int y = 0; y < h; y++)
+	{
+		unsigned int sy = y * height_ / h;
+		uint8_t *out = dest + y * cfg.stride;
+		for (unsigned int x = 0; x < w; x++)
+		{
+			unsigned int sx = x * width_ / w;
+			int Y = main[sy * main_stride + sx];
+			int U = main_u[(sy / 2) * (main_stride / 2) + sx / 2] - 128;
+			int V = main_v[(sy / 2) * (main_stride / 2) + sx / 2] - 128;
+			int R = std::clamp(Y + ((359 * V) >> 8), 0, 255);
+			int G = std::clamp(Y - ((88 * U + 183 * V) >> 8), 0, 255);
+			int B = std::clamp(Y + ((454 * U) >> 8), 0, 255);
+			*out++ = bgr ? B : R;
+			*out++ = G;
+			*out++ = bgr ? R : B;
+		}
+	}
+}
+
+void FrameSource::Queue(int64_t timestamp_ns)
+{
+	unsigned int index;
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		cond_var_.wait(lock, [this] { return !free_.empty(); });
+		index = free_.back();
+		free_.pop_back();
+	}
+
+	Buffer &buffer = buffers_[index];
+	fillMain(buffer.main_mem, sequence_ % num_frames_);
+	if (lores_stream_)
+		fillLores(buffer.main_mem, buffer.lores_mem);
+
+	CompletedRequest *request = new CompletedRequest();
+	request->sequence = sequence_++;
+	request->buffers[main_stream_.get()] = buffer.main.get();
+	app_->mapped_buffers_.find(buffer.main.get())->second.coherency.DeviceWritten();
+	if (lores_stream_)
+	{
+		request->buffers[lores_stream_.get()] = buffer.lores.get();
+		app_->mapped_buffers_.find(buffer.lores.get())->second.coherency.DeviceWritten();
+	}
+	request->metadata.set(libcamera::controls::SensorTimestamp, timestamp_ns);
+	if (last_timestamp_ && timestamp_ns > last_timestamp_)
+		request->framerate = 1e9 / (timestamp_ns - last_timestamp_);
+	last_timestamp_ = timestamp_ns;
+
+	// The buffers come back to us, rather than going to the camera, when the last reference goes.
+	CompletedRequestPtr ptr(request, [this, index](CompletedRequest *r) {
+		delete r;
+		release(index);
+	});
+	app_->post_processor_.Process(ptr);
+}
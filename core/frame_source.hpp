@@ -0,0 +1,86 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * frame_source.hpp - feed frames from a file or a test pattern through the post-processing stages
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <libcamera/framebuffer.h>
+#include <libcamera/stream.h>
+
+#include "core/completed_request.hpp"
+
+class RPiCamApp;
+
+// Stands in for the camera so that the post-processing stages can run, and be benchmarked, without a sensor.
+// Frames come from a file of YUV420 images (as rpicam-vid --codec yuv420 writes them), which is replayed on a
+// loop, or from a generated pattern ("pattern:gradient" or "pattern:noise"). They appear in a "video" stream,
+// and in a "lores" stream too if the options or the post-processing file ask for one. Completed requests come
+// back through the application's Wait() just as they would from the camera.
+class FrameSource
+{
+public:
+	FrameSource(RPiCamApp *app, unsigned int num_buffers);
+	~FrameSource();
+
+	// Load the post-processing stages and create the streams; the counterpart of OpenCamera and Configure.
+	void Open();
+	void Start();
+	void Stop();
+
+	// Copy the next frame into a free buffer, waiting for one if need be, and hand it to the post-processor.
+	// The timestamp is put in the request's SensorTimestamp.
+	void Queue(int64_t timestamp_ns);
+
+	// How many frames have been queued but not yet released by the stages and the application.
+	unsigned int InFlight();
+
+private:
+	// A Stream whose configuration we can fill in, as the camera would.
+	class SourceStream : public libcamera::Stream
+	{
+	public:
+		SourceStream(libcamera::StreamConfiguration const &config) { configuration_ = config; }
+	};
+
+	struct Buffer
+	{
+		std::unique_ptr<libcamera::FrameBuffer> main;
+		std::unique_ptr<libcamera::FrameBuffer> lores;
+		uint8_t *main_mem = nullptr;
+		uint8_t *lores_mem = nullptr;
+	};
+
+	void makeStreams();
+	void release(unsigned int index);
+	void fillMain(uint8_t *dest, unsigned int frame) const;
+	void fillLores(uint8_t const *main, uint8_t *dest) const;
+
+	RPiCamApp *app_;
+	unsigned int num_buffers_;
+	std::unique_ptr<SourceStream> main_stream_;
+	std::unique_ptr<SourceStream> lores_stream_;
+	std::vector<Buffer> buffers_;
+	std::vector<unsigned int> free_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	unsigned int sequence_ = 0;
+	int64_t last_timestamp_ = 0;
+
+	// The source frames, tightly packed YUV420, either mapped from the file or generated.
+	unsigned int width_ = 0;
+	unsigned int height_ = 0;
+	uint8_t const *frames_ = nullptr;
+	size_t frames_size_ = 0;
+	std::vector<uint8_t> pattern_;
+	unsigned int num_frames_ = 0;
+};
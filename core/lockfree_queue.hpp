@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * lockfree_queue.hpp - bounded lock-free multi-producer queue
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+// A bounded queue based on Dmitry Vyukov's MPMC ring. Each cell carries a sequence number that tells
+// producers and consumers whose turn it is, so neither side ever takes a lock. Push fails (rather than
+// blocking) when the ring is full. SIZE must be a power of 2.
+
+template <typename T, size_t SIZE>
+class LockFreeQueue
+{
+	static_assert(SIZE >= 2 && (SIZE & (SIZE - 1)) == 0, "LockFreeQueue size must be a power of 2");
+
+public:
+	LockFreeQueue() : head_(0), tail_(0)
+	{
+		for (size_t i = 0; i < SIZE; i++)
+			cells_[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	template <typename U>
+	bool Push(U &&item)
+	{
+		Cell *cell;
+		size_t pos = tail_.load(std::memory_order_relaxed);
+		while (true)
+		{
+			cell = &cells_[pos & (SIZE - 1)];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0)
+			{
+				if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+				return false; // full
+			else
+				pos = tail_.load(std::memory_order_relaxed);
+		}
+
+		cell->data.emplace(std::forward<U>(item));
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	std::optional<T> Pop()
+	{
+		Cell *cell;
+		size_t pos = head_.load(std::memory_order_relaxed);
+		while (true)
+		{
+			cell = &cells_[pos & (SIZE - 1)];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (diff == 0)
+			{
+				if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+				return std::nullopt; // empty
+			else
+				pos = head_.load(std::memory_order_relaxed);
+		}
+
+		std::optional<T> item(std::move(cell->data));
+		cell->data.reset();
+		cell->sequence.store(pos + SIZE, std::memory_order_release);
+		return item;
+	}
+
+private:
+	// Keep the cells and the two indices on separate cache lines so producers and the consumer don't
+	// keep stealing them from each other.
+	struct alignas(64) Cell
+	{
+		std::atomic<size_t> sequence;
+		std::optional<T> data;
+	};
+
+	Cell cells_[SIZE];
+	alignas(64) std::atomic<size_t> head_;
+	alignas(64) std::atomic<size_t> tail_;
+};
@@ -0,0 +1,127 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * memory_account.cpp - who in the pipeline is holding how much memory
+ */
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <utility>
+
+#include "core/logging.hpp"
+#include "core/memory_account.hpp"
+
+namespace
+{
+
+struct Entry
+{
+	MemoryPool pool;
+	uint64_t bytes = 0;
+	unsigned int buffers = 0;
+	uint64_t peak = 0;
+};
+
+char const *const pool_names[] = { "dma", "system", "import" };
+
+std::mutex mutex;
+std::map<std::pair<unsigned int, std::string>, Entry> entries;
+
+// The kernel's CmaTotal and CmaFree, in bytes, or 0 if it doesn't report them.
+void read_cma(uint64_t &total, uint64_t &free)
+{
+	total = free = 0;
+	FILE *fp = fopen("/proc/meminfo", "r");
+	if (!fp)
+		return;
+	char line[128];
+	uint64_t kb;
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (sscanf(line, "CmaTotal: %" SCNu64, &kb) == 1)
+			total = kb * 1024;
+		else if (sscanf(line, "CmaFree: %" SCNu64, &kb) == 1)
+			free = kb * 1024;
+	}
+	fclose(fp);
+}
+
+std::string megabytes(uint64_t bytes)
+{
+	char text[32];
+	snprintf(text, sizeof(text), "%.1fMB", bytes / (1024.0 * 1024.0));
+	return text;
+}
+
+} // namespace
+
+void MemoryAccount::Set(unsigned int camera, std::string const &owner, MemoryPool pool, uint64_t bytes,
+						unsigned int buffers)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	Entry &entry = entries[{ camera, owner }];
+	entry.pool = pool;
+	entry.bytes = bytes;
+	entry.buffers = buffers;
+	entry.peak = std::max(entry.peak, bytes);
+}
+
+void MemoryAccount::Report(unsigned int level)
+{
+	if (RPiCamApp::GetVerbosity() < level)
+		return;
+
+	uint64_t totals[3] = {};
+	uint64_t cma_total, cma_free;
+	read_cma(cma_total, cma_free);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	LOG(level, "Memory held:");
+	for (auto const &[key, entry] : entries)
+	{
+		LOG(level, "    camera " << key.first << " " << key.second << " (" << pool_names[(unsigned int)entry.pool]
+							  << "): " << megabytes(entry.bytes) << " in " << entry.buffers << " buffers, peak "
+							  << megabytes(entry.peak));
+		totals[(unsigned int)entry.pool] += entry.bytes;
+	}
+	LOG(level, "    total: " << megabytes(totals[(unsigned int)MemoryPool::Dma]) << " dma, "
+						   << megabytes(totals[(unsigned int)MemoryPool::System]) << " system");
+	if (cma_total)
+		LOG(level, "    CMA free: " << megabytes(cma_free) << " of " << megabytes(cma_total));
+}
+
+std::string MemoryAccount::Format()
+{
+	std::string body = "# HELP rpicam_memory_bytes Memory held by each part of the pipeline\n"
+					   "# TYPE rpicam_memory_bytes gauge\n";
+	std::string buffers = "# HELP rpicam_memory_buffers Buffers held by each part of the pipeline\n"
+						  "# TYPE rpicam_memory_buffers gauge\n";
+	std::string peak = "# HELP rpicam_memory_peak_bytes Most memory each part of the pipeline has held at once\n"
+					   "# TYPE rpicam_memory_peak_bytes gauge\n";
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto const &[key, entry] : entries)
+		{
+			std::string labels = "{camera=\"" + std::to_string(key.first) + "\",owner=\"" + key.second +
+								 "\",pool=\"" + pool_names[(unsigned int)entry.pool] + "\"} ";
+			body += "rpicam_memory_bytes" + labels + std::to_string(entry.bytes) + "\n";
+			buffers += "rpicam_memory_buffers" + labels + std::to_string(entry.buffers) + "\n";
+			peak += "rpicam_memory_peak_bytes" + labels + std::to_string(entry.peak) + "\n";
+		}
+	}
+
+	uint64_t cma_total, cma_free;
+	read_cma(cma_total, cma_free);
+	body += buffers + peak;
+	body += "# HELP rpicam_cma_total_bytes The kernel's CmaTotal\n# TYPE rpicam_cma_total_bytes gauge\n"
+			"rpicam_cma_total_bytes " +
+			std::to_string(cma_total) + "\n";
+	body += "# HELP rpicam_cma_free_bytes The kernel's CmaFree\n# TYPE rpicam_cma_free_bytes gauge\n"
+			"rpicam_cma_free_bytes " +
+			std::to_string(cma_free) + "\n";
+	return body;
+}
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * memory_account.hpp - who in the pipeline is holding how much memory
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+enum class MemoryPool : unsigned int
+{
+	Dma, // dma-heap and V4L2 driver buffers: CMA on Pi 4 and earlier, the system heap on Pi 5
+	System, // ordinary process memory
+	Import, // someone else's buffers, imported or mapped, so counted once already by their owner
+};
+
+// Each part of the pipeline that allocates buffers says what it now holds, under an owner name such as
+// "stream.video", "h264.capture" or "stage.hdr", replacing whatever it said before (so 0 when it lets
+// go). Report logs the lot, with the kernel's own CmaTotal and CmaFree, and Format gives the same figures
+// for --metrics to serve, so that a configuration can be sized to the device before it runs out of CMA.
+class MemoryAccount
+{
+public:
+	static void Set(unsigned int camera, std::string const &owner, MemoryPool pool, uint64_t bytes,
+					unsigned int buffers = 1);
+
+	static void Report(unsigned int level);
+	static std::string Format();
+};
@@ -7,11 +7,21 @@
 #pragma once
 
 // A simple class for carrying arbitrary metadata, for example about an image.
+//
+// Every tag name is interned once into a small integer id, and the entries are kept in a flat vector
+// that is searched by id. Code that exchanges metadata every frame should declare a MetadataKey for the
+// tag (typically as an inline variable in a shared header), which does the interning up front and fixes
+// the value type. The string based calls still work, but look the name up each time.
 
 #include <any>
-#include <map>
 #include <mutex>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+template <typename T>
+class MetadataKey;
 
 class Metadata
 {
@@ -31,26 +41,54 @@ public:
 		other.data_.clear();
 	}
 
+	// Returns the id for this tag name, the same one every time.
+	static unsigned int Intern(std::string const &tag)
+	{
+		static std::mutex mutex;
+		static std::unordered_map<std::string, unsigned int> ids;
+		std::scoped_lock lock(mutex);
+		return ids.emplace(tag, ids.size()).first->second;
+	}
+
+	template <typename T>
+	void Set(MetadataKey<T> const &key, typename MetadataKey<T>::Type value)
+	{
+		std::scoped_lock lock(mutex_);
+		SetLocked(key, std::move(value));
+	}
+
+	template <typename T>
+	int Get(MetadataKey<T> const &key, T &value) const
+	{
+		std::scoped_lock lock(mutex_);
+		std::any const *it = find(key.Id());
+		if (!it)
+			return -1;
+		value = std::any_cast<T const &>(*it);
+		return 0;
+	}
+
 	template <typename T>
 	void Set(std::string const &tag, T &&value)
 	{
 		std::scoped_lock lock(mutex_);
-		data_.insert_or_assign(tag, std::forward<T>(value));
+		assign(Intern(tag), std::forward<T>(value));
 	}
 
 	template <typename T>
 	int Get(std::string const &tag, T &value) const
 	{
 		std::scoped_lock lock(mutex_);
-		auto it = data_.find(tag);
-		if (it == data_.end())
+		std::any const *it = find(Intern(tag));
+		if (!it)
 			return -1;
-		value = std::any_cast<T>(it->second);
+		value = std::any_cast<T>(*it);
 		return 0;
 	}
 
 	void Clear()
 	{
+		// The vector keeps its capacity, so a recycled request doesn't allocate for its entries again.
 		std::scoped_lock lock(mutex_);
 		data_.clear();
 	}
@@ -72,8 +110,29 @@ public:
 
 	void Merge(Metadata &other)
 	{
+		// As with std::map::merge, anything we already have is left in the other one.
 		std::scoped_lock lock(mutex_, other.mutex_);
-		data_.merge(other.data_);
+		auto keep = other.data_.begin();
+		for (auto &entry : other.data_)
+		{
+			if (find(entry.first))
+				*keep++ = std::move(entry);
+			else
+				data_.push_back(std::move(entry));
+		}
+		other.data_.erase(keep, other.data_.end());
+	}
+
+	template <typename T>
+	T *GetLocked(MetadataKey<T> const &key)
+	{
+		return std::any_cast<T>(find(key.Id()));
+	}
+
+	template <typename T>
+	void SetLocked(MetadataKey<T> const &key, typename MetadataKey<T>::Type value)
+	{
+		assign(key.Id(), std::move(value));
 	}
 
 	template <typename T>
@@ -81,17 +140,14 @@ public:
 	{
 		// This allows in-place access to the Metadata contents,
 		// for which you should be holding the lock.
-		auto it = data_.find(tag);
-		if (it == data_.end())
-			return nullptr;
-		return std::any_cast<T>(&it->second);
+		return std::any_cast<T>(find(Intern(tag)));
 	}
 
 	template <typename T>
 	void SetLocked(std::string const &tag, T &&value)
 	{
 		// Use this only if you're holding the lock yourself.
-		data_.insert_or_assign(tag, std::forward<T>(value));
+		assign(Intern(tag), std::forward<T>(value));
 	}
 
 	// Note: use of (lowercase) lock and unlock means you can create scoped
@@ -101,6 +157,49 @@ public:
 	void unlock() { mutex_.unlock(); }
 
 private:
+	// There are only ever a handful of entries, so a linear search beats anything cleverer.
+	std::any *find(unsigned int id)
+	{
+		for (auto &entry : data_)
+		{
+			if (entry.first == id)
+				return &entry.second;
+		}
+		return nullptr;
+	}
+
+	std::any const *find(unsigned int id) const { return const_cast<Metadata *>(this)->find(id); }
+
+	template <typename T>
+	void assign(unsigned int id, T &&value)
+	{
+		if (std::any *it = find(id))
+			*it = std::forward<T>(value);
+		else
+			data_.emplace_back(id, std::forward<T>(value));
+	}
+
 	mutable std::mutex mutex_;
-	std::map<std::string, std::any> data_;
+	std::vector<std::pair<unsigned int, std::any>> data_;
+};
+
+// A tag name, interned when the key is constructed, along with the type of its value.
+template <typename T>
+class MetadataKey
+{
+public:
+	using Type = T;
+
+	explicit MetadataKey(std::string const &tag) : id_(Metadata::Intern(tag)) {}
+	unsigned int Id() const { return id_; }
+
+private:
+	unsigned int id_;
 };
+
+// Keys for metadata that stages share with each other and with the applications.
+inline const MetadataKey<bool> MOTION_DETECT_RESULT("motion_detect.result");
+inline const MetadataKey<std::string> ANNOTATE_TEXT("annotate.text");
+// The sequence number of the frame that a stage's results were worked out from, where that may be an earlier
+// frame than the one they're attached to (as with the TFLite stages, which run asynchronously).
+inline const MetadataKey<unsigned int> RESULTS_SEQUENCE("results.sequence");
@@ -0,0 +1,201 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * metrics.cpp - live pipeline counters, served in the Prometheus text format
+ */
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "core/logging.hpp"
+#include "core/memory_account.hpp"
+#include "core/metrics.hpp"
+
+namespace
+{
+
+struct MetricInfo
+{
+	char const *name;
+	char const *type;
+	char const *help;
+	double scale; // what to divide the stored value by
+};
+
+const MetricInfo metric_info[] = {
+	{ "rpicam_frames_captured_total", "counter", "Frames completed by the camera", 1 },
+	{ "rpicam_frames_failed_total", "counter", "Frames the camera completed with an error", 1 },
+	{ "rpicam_framerate", "gauge", "Instantaneous capture framerate", 1000 },
+	{ "rpicam_postprocess_queue_depth", "gauge", "Frames waiting in or passing through the post-processing stages", 1 },
+	{ "rpicam_postprocess_dropped_total", "counter", "Frames dropped because the post-processing stages were full", 1 },
+	{ "rpicam_preview_displayed_total", "counter", "Frames shown in the preview window", 1 },
+	{ "rpicam_preview_dropped_total", "counter", "Frames replaced by a newer one before the preview could show them", 1 },
+	{ "rpicam_encoder_queue_depth", "gauge", "Camera buffers held by the encoders", 1 },
+	{ "rpicam_encoder_dropped_total", "counter", "Frames dropped because the encoder was overloaded", 1 },
+	{ "rpicam_output_frames_total", "counter", "Encoded frames written to the output", 1 },
+	{ "rpicam_output_bytes_total", "counter", "Encoded bytes written to the output", 1 },
+	{ "rpicam_output_write_seconds_total", "counter", "Time spent writing encoded frames to the output", 1e6 },
+};
+
+static_assert(sizeof(metric_info) / sizeof(metric_info[0]) == (unsigned int)Metric::Count, "missing metric info");
+
+struct ServerState
+{
+	std::mutex mutex;
+	std::thread thread;
+	int listen_fd = -1;
+	int abort_fd = -1;
+	std::string unix_path;
+};
+
+ServerState server;
+
+} // namespace
+
+std::atomic<int64_t> Metrics::values_[(unsigned int)Metric::Count] = {};
+
+void Metrics::Start(std::string const &address)
+{
+	std::lock_guard<std::mutex> lock(server.mutex);
+	if (server.listen_fd >= 0)
+		return;
+
+	int fd;
+	if (address[0] == '/')
+	{
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		if (address.size() >= sizeof(addr.sun_path))
+			throw std::runtime_error("metrics socket path too long: " + address);
+		strcpy(addr.sun_path, address.c_str());
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			throw std::runtime_error("unable to open metrics socket");
+		unlink(address.c_str());
+		if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+		{
+			close(fd);
+			throw std::runtime_error("failed to bind metrics socket " + address);
+		}
+		server.unix_path = address;
+	}
+	else
+	{
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = INADDR_ANY;
+		size_t colon = address.rfind(':');
+		std::string host = colon == std::string::npos ? "" : address.substr(0, colon);
+		char *end;
+		long port = strtol(address.c_str() + (colon == std::string::npos ? 0 : colon + 1), &end, 10);
+		if (*end || port <= 0 || port > 65535 || (!host.empty() && inet_aton(host.c_str(), &addr.sin_addr) == 0))
+			throw std::runtime_error("bad metrics address " + address);
+		addr.sin_port = htons(port);
+
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			throw std::runtime_error("unable to open metrics socket");
+		int enable = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+		if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+		{
+			close(fd);
+			throw std::runtime_error("failed to bind metrics socket " + address);
+		}
+	}
+	listen(fd, 4);
+
+	server.listen_fd = fd;
+	server.abort_fd = eventfd(0, EFD_CLOEXEC);
+	server.thread = std::thread(&Metrics::serverThread);
+	LOG(2, "Serving metrics on " << address);
+}
+
+void Metrics::Stop()
+{
+	std::lock_guard<std::mutex> lock(server.mutex);
+	if (server.listen_fd < 0)
+		return;
+
+	uint64_t one = 1;
+	if (write(server.abort_fd, &one, sizeof(one)) < 0)
+		LOG_ERROR("ERROR: failed to stop metrics server");
+	server.thread.join();
+	close(server.listen_fd);
+	close(server.abort_fd);
+	server.listen_fd = server.abort_fd = -1;
+	if (!server.unix_path.empty())
+		unlink(server.unix_path.c_str());
+	server.unix_path.clear();
+}
+
+std::string Metrics::format()
+{
+	std::string body;
+	char line[512];
+	for (unsigned int i = 0; i < (unsigned int)Metric::Count; i++)
+	{
+		MetricInfo const &info = metric_info[i];
+		int64_t value = values_[i].load(std::memory_order_relaxed);
+		if (info.scale == 1)
+			snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %lld\n", info.name, info.help, info.name,
+					 info.type, info.name, (long long)value);
+		else
+			snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %.3f\n", info.name, info.help, info.name,
+					 info.type, info.name, value / info.scale);
+		body += line;
+	}
+	// Along with what each part of the pipeline is holding.
+	body += MemoryAccount::Format();
+	return body;
+}
+
+void Metrics::serverThread()
+{
+	while (true)
+	{
+		pollfd fds[2] = { { server.listen_fd, POLLIN, 0 }, { server.abort_fd, POLLIN, 0 } };
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			LOG_ERROR("ERROR: metrics server poll failed");
+			return;
+		}
+		if (fds[1].revents & POLLIN)
+			return;
+		if (!(fds[0].revents & POLLIN))
+			continue;
+
+		int fd = accept4(server.listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		// Whatever the request, the answer is the same, so read what's there and don't wait for more. A
+		// client that hasn't sent anything within a moment just gets the metrics anyway.
+		char request[1024];
+		pollfd p = { fd, POLLIN, 0 };
+		if (poll(&p, 1, 100) > 0 && recv(fd, request, sizeof(request), MSG_DONTWAIT) < 0)
+			LOG(2, "metrics request read failed");
+
+		std::string body = format();
+		std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+							   std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+		if (send(fd, response.data(), response.size(), MSG_NOSIGNAL) < 0)
+			LOG(2, "metrics response send failed");
+		close(fd);
+	}
+}
@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * metrics.hpp - live pipeline counters, served in the Prometheus text format
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+enum class Metric : unsigned int
+{
+	FramesCaptured,
+	FramesFailed, // completed by the camera, but not successfully
+	Framerate, // in millihertz
+	PostProcessQueueDepth,
+	PostProcessDropped,
+	PreviewDisplayed,
+	PreviewDropped,
+	EncoderQueueDepth, // camera buffers the encoders are holding
+	EncoderDropped,
+	OutputFrames,
+	OutputBytes,
+	OutputWriteTime, // in microseconds, summed over all the frames output
+	Count
+};
+
+// The counters are plain relaxed atomics that are always updated, so the pipeline never takes a lock
+// for them. With --metrics, a thread of our own serves them to anything that connects, either over TCP
+// ("[address:]port") or a Unix socket (a path starting with "/"), answering every request with the
+// current values as an HTTP response that Prometheus, or curl, is happy with.
+class Metrics
+{
+public:
+	static void Start(std::string const &address);
+	static void Stop();
+
+	static void Add(Metric m, int64_t value = 1) { values_[(unsigned int)m].fetch_add(value, std::memory_order_relaxed); }
+	static void Set(Metric m, int64_t value) { values_[(unsigned int)m].store(value, std::memory_order_relaxed); }
+	static int64_t Get(Metric m) { return values_[(unsigned int)m].load(std::memory_order_relaxed); }
+
+private:
+	static std::string format();
+	static void serverThread();
+
+	static std::atomic<int64_t> values_[(unsigned int)Metric::Count];
+};
@@ -15,11 +15,17 @@
 #include <string>
 #include <sys/ioctl.h>
 
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
 #include <libcamera/formats.h>
 #include <libcamera/logging.h>
 #include <libcamera/property_ids.h>
 
+#include "core/metrics.hpp"
 #include "core/options.hpp"
+#include "core/thread_config.hpp"
+#include "core/trace.hpp"
 
 namespace fs = std::filesystem;
 
@@ -64,6 +70,23 @@ const std::map<libcamera::PixelFormat, unsigned int> &bayer_formats()
 	return map;
 }
 
+// Whether the post-processing file has this stage, for options that depend on what it measures.
+bool post_process_has_stage(std::string const &file, std::string const &stage)
+{
+	if (file.empty())
+		return false;
+	boost::property_tree::ptree root;
+	try
+	{
+		boost::property_tree::read_json(file, root);
+	}
+	catch (std::exception const &)
+	{
+		return false;
+	}
+	return root.find(stage) != root.not_found();
+}
+
 }
 
 Mode::Mode(std::string const &mode_string) : Mode()
@@ -237,6 +260,8 @@ Options::Options()
 			"Set the file name for configuring the post-processing")
 		("post-process-libs", value<std::string>(&v_->post_process_libs),
 			"Set a custom location for the post-processing library .so files")
+		("post-process-reload", value<bool>(&v_->post_process_reload)->default_value(false)->implicit_value(true),
+			"Watch the post-process-file, and rebuild the stages that change whenever it is saved")
 		("nopreview,n", value<bool>(&v_->nopreview)->default_value(false)->implicit_value(true),
 			"Do not show a preview window")
 		("preview,p", value<std::string>(&v_->preview)->default_value("0,0,0,0"),
@@ -247,6 +272,11 @@ Options::Options()
 			"Use Qt-based preview window (WARNING: causes heavy CPU load, fullscreen not supported)")
 		("preview-libs", value<std::string>(&v_->preview_libs)->default_value(""),
 			"Set a custom location for the preview library .so files")
+		("preview-sync", value<std::string>(&v_->preview_sync)->default_value("vsync"),
+			"How the EGL preview presents frames: vsync, or none to show only the latest frame without waiting "
+			"for the display and return each camera buffer straight away")
+		("preview-fps", value<float>(&v_->preview_fps)->default_value(0),
+			"Show at most this many frames per second in the preview window, 0 for every frame")
 		("hflip", value<bool>(&v_->hflip_)->default_value(false)->implicit_value(true), "Request a horizontal flip transform")
 		("vflip", value<bool>(&v_->vflip_)->default_value(false)->implicit_value(true), "Request a vertical flip transform")
 		("rotation", value<int>(&v_->rotation_)->default_value(0), "Request an image rotation, 0 or 180")
@@ -291,6 +321,17 @@ Options::Options()
 			"Height of viewfinder frames from the camera (distinct from the preview window size)")
 		("tuning-file", value<std::string>(&v_->tuning_file)->default_value("-"),
 			"Name of camera tuning file to use, omit this option for libcamera default behaviour")
+		("mode-cache", value<std::string>(&v_->mode_cache)->default_value(""),
+			"File in which to keep the camera's sensor modes between runs, so that they need not be enumerated each time")
+		("trace", value<std::string>(&v_->trace)->default_value(""),
+			"Record when each frame passes each stage of the pipeline, to this file (read it with utils/trace.py) "
+			"or to the kernel's trace buffer with \"ftrace\"")
+		("metrics", value<std::string>(&v_->metrics)->default_value(""),
+			"Serve live pipeline metrics in the Prometheus text format on this TCP [address:]port, or on the Unix "
+			"socket at this path")
+		("thread-config", value<std::string>(&v_->thread_config)->default_value(""),
+			"Pin classes of thread to CPUs and set their scheduling, as a ';' separated list of "
+			"class:cpus[:policy[:priority]], e.g. \"encode:2-3:fifo:20;pp-worker:0-1\"")
 		("lores-width", value<unsigned int>(&v_->lores_width)->default_value(0),
 			"Width of low resolution frames (use 0 to omit low resolution stream)")
 		("lores-height", value<unsigned int>(&v_->lores_height)->default_value(0),
@@ -322,7 +363,8 @@ Options::Options()
 		("metadata", value<std::string>(&v_->metadata),
 			"Save captured image metadata to a file or \"-\" for stdout")
 		("metadata-format", value<std::string>(&v_->metadata_format)->default_value("json"),
-			"Format to save the metadata in, either txt or json (requires --metadata)")
+			"Format to save the metadata in, either txt, json or bin (requires --metadata). bin writes a fixed "
+			"size record per frame, which utils/metadata_to_json.py can convert")
 		("flicker-period", value<std::string>(&v_->flicker_period_)->default_value("0s"),
 			"Manual flicker correction period"
 			"\nSet to 10000us to cancel 50Hz flicker."
@@ -408,6 +450,12 @@ bool OptsInternal::Parse(boost::program_options::variables_map &vm, RPiCamApp *a
 	if (!verbose || list_cameras)
 		libcamera::logSetTarget(libcamera::LoggingTargetNone);
 
+	if (!trace.empty())
+		Trace::Open(trace);
+	ThreadConfig::Set(thread_config);
+	if (!metrics.empty())
+		Metrics::Start(metrics);
+
 	app->initCameraManager();
 
 	bool log_env_set = getenv("LIBCAMERA_LOG_LEVELS");
@@ -573,6 +621,10 @@ bool OptsInternal::Parse(boost::program_options::variables_map &vm, RPiCamApp *a
 
 	if (sscanf(preview.c_str(), "%u,%u,%u,%u", &preview_x, &preview_y, &preview_width, &preview_height) != 4)
 		preview_x = preview_y = preview_width = preview_height = 0; // use default window
+	if (preview_sync != "vsync" && preview_sync != "none")
+		throw std::runtime_error("invalid preview-sync value " + preview_sync);
+	if (preview_fps < 0)
+		throw std::runtime_error("preview-fps must not be negative");
 
 	transform = Transform::Identity;
 	if (hflip_)
@@ -671,6 +723,8 @@ bool OptsInternal::Parse(boost::program_options::variables_map &vm, RPiCamApp *a
 		metadata_format = "json";
 	else if (strcasecmp(metadata_format.c_str(), "txt") == 0)
 		metadata_format = "txt";
+	else if (strcasecmp(metadata_format.c_str(), "bin") == 0)
+		metadata_format = "bin";
 	else
 		throw std::runtime_error("unrecognised metadata format " + metadata_format);
 
@@ -693,6 +747,8 @@ void OptsInternal::Print() const
 	std::cerr << "    output: " << output << std::endl;
 	std::cerr << "    post_process_file: " << post_process_file << std::endl;
 	std::cerr << "    post_process_libs: " << post_process_libs << std::endl;
+	if (post_process_reload)
+		std::cerr << "    post_process_reload: 1" << std::endl;
 	if (nopreview)
 		std::cerr << "    preview: none" << std::endl;
 	else if (fullscreen)
@@ -703,6 +759,9 @@ void OptsInternal::Print() const
 		std::cerr << "    preview: " << preview_x << "," << preview_y << "," << preview_width << ","
 					<< preview_height << std::endl;
 	std::cerr << "    qt-preview: " << qt_preview << std::endl;
+	std::cerr << "    preview-sync: " << preview_sync << std::endl;
+	if (preview_fps)
+		std::cerr << "    preview-fps: " << preview_fps << std::endl;
 	std::cerr << "    transform: " << transformToString(transform) << std::endl;
 	if (roi_width == 0 || roi_height == 0)
 		std::cerr << "    roi: all" << std::endl;
@@ -731,6 +790,14 @@ void OptsInternal::Print() const
 	std::cerr << "    viewfinder-width: " << viewfinder_width << std::endl;
 	std::cerr << "    viewfinder-height: " << viewfinder_height << std::endl;
 	std::cerr << "    tuning-file: " << (tuning_file == "-" ? "(libcamera)" : tuning_file) << std::endl;
+	if (!mode_cache.empty())
+		std::cerr << "    mode-cache: " << mode_cache << std::endl;
+	if (!trace.empty())
+		std::cerr << "    trace: " << trace << std::endl;
+	if (!metrics.empty())
+		std::cerr << "    metrics: " << metrics << std::endl;
+	if (!thread_config.empty())
+		std::cerr << "    thread-config: " << thread_config << std::endl;
 	std::cerr << "    lores-width: " << lores_width << std::endl;
 	std::cerr << "    lores-height: " << lores_height << std::endl;
 	std::cerr << "    lores-par: " << lores_par << std::endl;
@@ -762,7 +829,15 @@ bool OptsInternal::ParseVideo()
 {
 	bitrate.set(bitrate_);
 	av_sync.set(av_sync_);
+	libav_fragment.set(libav_fragment_);
 	audio_bitrate.set(audio_bitrate_);
+	net_abr.set(net_abr_);
+	circular_clip.set(circular_clip_);
+	circular_preroll.set(circular_preroll_);
+	motion_holdoff.set(motion_holdoff_);
+	motion_preroll.set(motion_preroll_);
+	idle_holdoff.set(idle_holdoff_);
+	encoder_overload_timeout.set(encoder_overload_timeout_);
 	if (width == 0)
 		width = 640;
 	if (height == 0)
@@ -777,6 +852,21 @@ bool OptsInternal::ParseVideo()
 		codec = "mjpeg";
 	else
 		throw std::runtime_error("unrecognised codec " + codec);
+	if (!lores_codec.empty())
+	{
+		if (strcasecmp(lores_codec.c_str(), "h264") == 0)
+			lores_codec = "h264";
+		else if (strcasecmp(lores_codec.c_str(), "mjpeg") == 0)
+			lores_codec = "mjpeg";
+		else if (strcasecmp(lores_codec.c_str(), "yuv420") == 0)
+			lores_codec = "yuv420";
+		else
+			throw std::runtime_error("unrecognised lores codec " + lores_codec);
+		if (!lores_width || !lores_height)
+			throw std::runtime_error("lores-codec requires lores-width and lores-height");
+		if (lores_output.empty())
+			throw std::runtime_error("lores-codec requires lores-output");
+	}
 	if (strcasecmp(initial.c_str(), "pause") == 0)
 		pause = true;
 	else if (strcasecmp(initial.c_str(), "record") == 0)
@@ -787,6 +877,24 @@ bool OptsInternal::ParseVideo()
 		LOG_ERROR("WARNING: consider inline headers with 'pause'/split/segment/circular");
 	if ((split || segment) && output.find('%') == std::string::npos)
 		LOG_ERROR("WARNING: expected % directive in output filename");
+	if (circular_clip && !circular)
+		throw std::runtime_error("circular-clip requires the circular option");
+	if (circular_clip && output.find('%') == std::string::npos)
+		LOG_ERROR("WARNING: expected % directive in output filename for circular-clip");
+	if (motion_gate && circular)
+		throw std::runtime_error("motion-gate cannot be used with circular, try circular-clip instead");
+	if (idle_framerate < 0 || (idle_framerate && idle_framerate >= framerate.value_or(DEFAULT_FRAMERATE)))
+		throw std::runtime_error("idle-framerate must be positive and less than the framerate");
+	if (idle_framerate && !post_process_has_stage(post_process_file, "motion_detect"))
+		throw std::runtime_error("idle-framerate needs a motion_detect stage in the post-process-file");
+	if (encoder_overload != "drop" && encoder_overload != "drop-oldest" && encoder_overload != "block")
+		throw std::runtime_error("encoder-overload must be drop, drop-oldest or block");
+	if (!raw_index.empty() && !raw_ring)
+		throw std::runtime_error("raw-index requires the raw-ring option");
+	if (net_abr && (!bitrate || codec != "h264"))
+		throw std::runtime_error("net-abr requires the h264 codec and a bitrate");
+	if (net_abr && net_abr.bps() > bitrate.bps())
+		throw std::runtime_error("net-abr must not be more than the bitrate");
 
 	// From https://en.wikipedia.org/wiki/Advanced_Video_Coding#Levels
 	double mbps = ((width + 15) >> 4) * ((height + 15) >> 4) * framerate.value_or(DEFAULT_FRAMERATE);
@@ -819,13 +927,42 @@ void OptsInternal::PrintVideo() const
 	std::cerr << "    inline: " << inline_headers << std::endl;
 	std::cerr << "    save-pts: " << save_pts << std::endl;
 	std::cerr << "    codec: " << codec << std::endl;
+	if (!lores_codec.empty())
+		std::cerr << "    lores-codec: " << lores_codec << " (output " << lores_output << ")" << std::endl;
 	std::cerr << "    quality (for MJPEG): " << quality << std::endl;
+	std::cerr << "    MJPEG fast DCT: " << jpeg_fast_dct << ", optimize: " << jpeg_optimize << std::endl;
+	if (codec == "libav")
+	{
+		std::cerr << "    libav-mux-buffer: " << libav_mux_buffer << "MB" << (libav_mux_drop ? " (drop)" : "")
+				  << std::endl;
+		if (libav_fragment)
+			std::cerr << "    libav-fragment: " << libav_fragment.get() << "ms" << (libav_cmaf ? " (cmaf)" : "")
+					  << std::endl;
+	}
+	std::cerr << "    net-sndbuf: " << net_sndbuf << std::endl;
+	if (net_abr)
+		std::cerr << "    net-abr: " << net_abr.kbps() << "kbps" << std::endl;
+	if (!encoder_socket.empty())
+		std::cerr << "    encoder-socket: " << encoder_socket << std::endl;
 	std::cerr << "    keypress: " << keypress << std::endl;
 	std::cerr << "    signal: " << signal << std::endl;
 	std::cerr << "    initial: " << initial << std::endl;
 	std::cerr << "    split: " << split << std::endl;
 	std::cerr << "    segment: " << segment << std::endl;
 	std::cerr << "    circular: " << circular << std::endl;
+	std::cerr << "    circular-clip: " << circular_clip.get() << "ms" << std::endl;
+	std::cerr << "    circular-preroll: " << circular_preroll.get() << "ms" << std::endl;
+	std::cerr << "    motion-gate: " << motion_gate << std::endl;
+	std::cerr << "    motion-holdoff: " << motion_holdoff.get() << "ms" << std::endl;
+	std::cerr << "    motion-preroll: " << motion_preroll.get() << "ms" << std::endl;
+	if (idle_framerate)
+		std::cerr << "    idle-framerate: " << idle_framerate << " (holdoff " << idle_holdoff.get() << "ms)"
+				  << std::endl;
+	if (raw_ring)
+		std::cerr << "    raw-ring: " << raw_ring << " frames, index " << (raw_index.empty() ? "none" : raw_index)
+				  << std::endl;
+	std::cerr << "    encoder-overload: " << encoder_overload << " (timeout " << encoder_overload_timeout.get()
+			  << "ms)" << std::endl;
 #ifndef DISABLE_RPI_FEATURES
 	std::cerr << "    sync: " << sync << std::endl;
 #endif
@@ -841,6 +978,20 @@ bool OptsInternal::ParseStill()
 		thumb_quality = 0;
 	else if (sscanf(thumb.c_str(), "%u:%u:%u", &thumb_width, &thumb_height, &thumb_quality) != 3)
 		throw std::runtime_error("bad thumbnail parameters " + thumb);
+	if (png_level > 9)
+		throw std::runtime_error("png-level must be between 0 and 9");
+	if (!burst)
+		burst = 1;
+	if (burst > 1 && (datetime || timestamp || output.find('%') == std::string::npos))
+		throw std::runtime_error("--burst needs a frame number (such as %03d) in the output file name");
+	if (zsl_select && (!zsl || burst > 1))
+		throw std::runtime_error("--zsl-select needs --zsl, and no --burst");
+	if (zsl_metric != "focus" && zsl_metric != "sharpness" && zsl_metric != "motion")
+		throw std::runtime_error("invalid zsl-metric " + zsl_metric);
+	if (zsl_select && zsl_metric == "sharpness" && !post_process_has_stage(post_process_file, "sobel_cv"))
+		throw std::runtime_error("--zsl-metric sharpness needs a sobel_cv stage in the post-process-file");
+	if (zsl_select && zsl_metric == "motion" && !post_process_has_stage(post_process_file, "motion_detect"))
+		throw std::runtime_error("--zsl-metric motion needs a motion_detect stage in the post-process-file");
 	if (strcasecmp(encoding.c_str(), "jpg") == 0)
 		encoding = "jpg";
 	else if (strcasecmp(encoding.c_str(), "yuv420") == 0)
@@ -865,6 +1016,10 @@ void OptsInternal::PrintStill() const
 	std::cerr << "    quality: " << quality << std::endl;
 	std::cerr << "    raw: " << raw << std::endl;
 	std::cerr << "    restart: " << restart << std::endl;
+	std::cerr << "    JPEG fast DCT: " << jpeg_fast_dct << ", optimize: " << jpeg_optimize << std::endl;
+	std::cerr << "    JPEG threads: " << jpeg_threads << std::endl;
+	std::cerr << "    PNG level: " << png_level << ", threads: " << png_threads << std::endl;
+	std::cerr << "    keep-stride: " << keep_stride << std::endl;
 	std::cerr << "    timelapse: " << timelapse.get() << "ms" << std::endl;
 	std::cerr << "    framestart: " << framestart << std::endl;
 	std::cerr << "    datetime: " << datetime << std::endl;
@@ -878,6 +1033,9 @@ void OptsInternal::PrintStill() const
 	std::cerr << "    immediate " << immediate << std::endl;
 	std::cerr << "    AF on capture: " << af_on_capture << std::endl;
 	std::cerr << "    Zero shutter lag: " << zsl << std::endl;
+	std::cerr << "    ZSL select: " << zsl_select << ", metric: " << zsl_metric << std::endl;
+	std::cerr << "    save queue: " << save_queue << std::endl;
+	std::cerr << "    burst: " << burst << std::endl;
 	for (auto &s : exif)
 		std::cerr << "    EXIF: " << s << std::endl;
 }
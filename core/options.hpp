@@ -190,12 +190,15 @@ struct OptsInternal
 	std::string output;
 	std::string post_process_file;
 	std::string post_process_libs;
+	bool post_process_reload;
 	unsigned int width;
 	unsigned int height;
 	bool nopreview;
 	std::string preview;
 	bool fullscreen;
 	unsigned int preview_x, preview_y, preview_width, preview_height;
+	std::string preview_sync;
+	float preview_fps;
 	libcamera::Transform transform;
 	std::string roi;
 	float roi_x, roi_y, roi_width, roi_height;
@@ -225,6 +228,10 @@ struct OptsInternal
 	unsigned int viewfinder_width;
 	unsigned int viewfinder_height;
 	std::string tuning_file;
+	std::string mode_cache;
+	std::string trace;
+	std::string metrics;
+	std::string thread_config;
 	bool qt_preview;
 	unsigned int lores_width;
 	unsigned int lores_height;
@@ -267,9 +274,15 @@ struct OptsInternal
 	unsigned int intra;
 	bool inline_headers;
 	std::string codec;
+	std::string lores_codec;
+	std::string lores_output;
 	std::string libav_video_codec;
 	std::string libav_video_codec_opts;
 	std::string libav_format;
+	uint32_t libav_mux_buffer;
+	bool libav_mux_drop;
+	TimeVal<std::chrono::milliseconds> libav_fragment;
+	bool libav_cmaf;
 	bool libav_audio;
 	std::string audio_codec;
 	std::string audio_device;
@@ -280,7 +293,12 @@ struct OptsInternal
 	TimeVal<std::chrono::microseconds> av_sync;
 	std::string save_pts;
 	int quality;
+	bool jpeg_fast_dct;
+	bool jpeg_optimize;
 	bool listen;
+	uint32_t net_sndbuf;
+	Bitrate net_abr;
+	std::string encoder_socket;
 	bool keypress;
 	bool signal;
 	std::string initial;
@@ -288,14 +306,33 @@ struct OptsInternal
 	bool split;
 	uint32_t segment;
 	size_t circular;
+	TimeVal<std::chrono::milliseconds> circular_clip;
+	TimeVal<std::chrono::milliseconds> circular_preroll;
+	bool motion_gate;
+	TimeVal<std::chrono::milliseconds> motion_holdoff;
+	std::string encoder_overload;
+	TimeVal<std::chrono::milliseconds> encoder_overload_timeout;
+	TimeVal<std::chrono::milliseconds> motion_preroll;
+	float idle_framerate;
+	TimeVal<std::chrono::milliseconds> idle_holdoff;
 	uint32_t frames;
+	unsigned int raw_ring;
+	std::string raw_index;
 	bool low_latency;
 #ifndef DISABLE_RPI_FEATURES
 	uint32_t sync;
 #endif
 	std::string bitrate_;
+	std::string circular_clip_;
+	std::string circular_preroll_;
+	std::string motion_holdoff_;
+	std::string encoder_overload_timeout_;
+	std::string motion_preroll_;
+	std::string idle_holdoff_;
 	std::string av_sync_;
+	std::string libav_fragment_;
 	std::string audio_bitrate_;
+	std::string net_abr_;
 #ifndef DISABLE_RPI_FEATURES
 	std::string sync_;
 #endif
@@ -307,6 +344,10 @@ struct OptsInternal
 	bool datetime;
 	bool timestamp;
 	unsigned int restart;
+	unsigned int jpeg_threads;
+	unsigned int png_level;
+	unsigned int png_threads;
+	bool keep_stride;
 	//bool keypress;
 	//bool signal;
 	std::string thumb;
@@ -316,7 +357,15 @@ struct OptsInternal
 	std::string latest;
 	bool immediate;
 	bool zsl;
+	unsigned int zsl_select;
+	std::string zsl_metric;
+	unsigned int save_queue;
+	unsigned int burst;
 	std::string timelapse_;
+	// rpicam-daemon
+	std::string socket;
+	// rpicam-bench
+	std::string source;
 
 	std::string preview_libs;
 	std::string encoder_libs;
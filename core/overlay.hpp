@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * overlay.hpp - vector annotations for the preview to draw over the image
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "core/metadata.hpp"
+
+// Stages that annotate the image can describe what they would have drawn, rather than writing it into the camera
+// buffer. A preview that supports overlays then draws these shapes on top of the frame itself, and the buffer is
+// never touched. Only the preview sees them; encoded or saved images don't include them.
+
+struct OverlayShape
+{
+	enum Type
+	{
+		Line, // from (x0, y0) to (x1, y1)
+		Rect, // corners at (x0, y0) and (x1, y1)
+		Circle, // centred on (x0, y0), with radius x1
+	};
+	Type type;
+	float x0, y0, x1, y1;
+	uint32_t colour; // 0xRRGGBB
+	unsigned int thickness;
+};
+
+struct Overlay
+{
+	// The shapes are given in the pixel coordinates of an image of this size, normally the main stream.
+	unsigned int width = 0;
+	unsigned int height = 0;
+	std::vector<OverlayShape> shapes;
+};
+
+inline const MetadataKey<Overlay> PREVIEW_OVERLAY("preview.overlay");
+
+// Add shapes to any that other stages have already put in the metadata.
+inline void AppendOverlay(Metadata &metadata, unsigned int width, unsigned int height,
+						  std::vector<OverlayShape> const &shapes)
+{
+	std::scoped_lock lock(metadata);
+	Overlay *overlay = metadata.GetLocked(PREVIEW_OVERLAY);
+	if (!overlay)
+	{
+		metadata.SetLocked(PREVIEW_OVERLAY, Overlay { width, height, shapes });
+		return;
+	}
+
+	float sx = overlay->width / (float)width, sy = overlay->height / (float)height;
+	for (OverlayShape shape : shapes)
+	{
+		shape.x0 *= sx, shape.y0 *= sy, shape.x1 *= sx, shape.y1 *= sy;
+		overlay->shapes.push_back(shape);
+	}
+}
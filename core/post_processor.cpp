@@ -6,14 +6,25 @@
  */
 
 #include <dlfcn.h>
-#include <filesystem>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
 #include <iostream>
 #include <map>
+#include <sstream>
 #include <string>
+#include <tuple>
 
 #include "core/options.hpp"
 #include "core/rpicam_app.hpp"
+#include "core/metrics.hpp"
 #include "core/post_processor.hpp"
+#include "core/thread_config.hpp"
+#include "core/trace.hpp"
 
 #include "post_processing_stages/post_processing_stage.hpp"
 
@@ -24,50 +35,83 @@
 
 #include "config.h"
 
-namespace fs = std::filesystem;
-
-PostProcessor::PostProcessor(RPiCamApp *app) : app_(app)
+PostProcessor::PostProcessor(RPiCamApp *app)
+	: app_(app), quit_(false), num_threads_(std::max(std::thread::hardware_concurrency(), 1u)), max_in_flight_(0),
+	  pipelined_(false), overflow_drops_(0)
 {
 }
 
 PostProcessor::~PostProcessor()
 {
+	if (watch_thread_.joinable())
+	{
+		uint64_t one = 1;
+		if (write(watch_abort_fd_, &one, sizeof(one)) < 0)
+			LOG_ERROR("ERROR: failed to stop post-process file watcher");
+		watch_thread_.join();
+	}
+	if (watch_abort_fd_ >= 0)
+		close(watch_abort_fd_);
+	if (inotify_fd_ >= 0)
+		close(inotify_fd_);
+	if (!stats_file_.empty())
+		writeStats();
+
 	// Must clear stages_ before dynamic_stages_ as the latter will unload the necessary symbols.
 	stages_.clear();
 	dynamic_stages_.clear();
 }
 
-void PostProcessor::LoadModules(const std::string &lib_dir)
+// The libraries live until the process exits, so nothing a stage leaves behind can outlast its code.
+static PluginLibraries &postproc_libraries()
 {
-	static std::vector<DlLib> dynamic_stages_;
+	static PluginLibraries libraries;
+	return libraries;
+}
 
-	const fs::path path(!lib_dir.empty() ? lib_dir : POSTPROC_LIB_DIR);
-	const std::string ext(".so");
+void PostProcessor::LoadModules(const std::string &lib_dir)
+{
+	// Only index the libraries here (and load any that have no manifest). Each of the others gets loaded when
+	// the JSON file names one of its stages.
+	postproc_libraries().Scan(!lib_dir.empty() ? lib_dir : POSTPROC_LIB_DIR);
+}
 
-	if (!fs::exists(path))
+static void load_stage_library(const std::string &name)
+{
+	const std::string library_path = postproc_libraries().Find(name);
+	if (library_path.empty())
 		return;
 
-	// Dynamically load all .so files from the system postprocessing lib path.
-	// This will automatically register the stages with the factory.
-	for (auto const &p : fs::recursive_directory_iterator(path))
-	{
 #ifdef HAILORT_LIB_PATH
-		if (p.path().string().find("hailo-postproc") != std::string::npos)
-		{
-			// Special case where we need to load libhailort.so as the Hailo postprocessing stages rely on symbols
-			// within it.
-			static DlLib hailort(HAILORT_LIB_PATH, RTLD_GLOBAL | RTLD_NOW);
-		}
-#endif
-		if (p.path().extension() == ext)
-			dynamic_stages_.emplace_back(p.path().string());
+	if (library_path.find("hailo-postproc") != std::string::npos)
+	{
+		// Special case where we need to load libhailort.so as the Hailo postprocessing stages rely on symbols
+		// within it.
+		static DlLib hailort(HAILORT_LIB_PATH, RTLD_GLOBAL | RTLD_NOW);
 	}
+#endif
+	postproc_libraries().Open(library_path);
+}
+
+static std::string to_json(boost::property_tree::ptree const &node)
+{
+	std::ostringstream ss;
+	boost::property_tree::write_json(ss, node, false);
+	return ss.str();
+}
+
+static bool same_config(StreamConfiguration const &a, StreamConfiguration const &b)
+{
+	return a.pixelFormat == b.pixelFormat && a.size == b.size && a.stride == b.stride &&
+		   a.bufferCount == b.bufferCount && a.colorSpace == b.colorSpace;
 }
 
 void PostProcessor::Read(std::string const &filename)
 {
 	boost::property_tree::ptree root;
 	boost::property_tree::read_json(filename, root);
+	filename_ = filename;
+	bool lores_given = app_->GetOptions()->Get().lores_width && app_->GetOptions()->Get().lores_height;
 	for (auto const &key_and_value : root)
 	{
 		if (key_and_value.first == "rpicam-apps")
@@ -76,6 +120,8 @@ void PostProcessor::Read(std::string const &filename)
 
 			if (node.find("lores") != node.not_found())
 			{
+				lores_given = true;
+				lores_node_ = to_json(node.get_child("lores"));
 				static std::map<std::string, libcamera::PixelFormat> formats {
 					{ "rgb", libcamera::formats::BGR888 },
 					{ "bgr", libcamera::formats::RGB888 },
@@ -102,24 +148,444 @@ void PostProcessor::Read(std::string const &filename)
 
 				LOG(1, "Postprocessing requested lores: " << lores_width << "x" << lores_height << " " << lores_format);
 			}
+
+			if (node.find("post_processor") != node.not_found())
+				readConfig(node.get_child("post_processor"));
 		}
 		else
 		{
-			PostProcessingStage *stage = createPostProcessingStage(key_and_value.first.c_str());
+			StageSchedule schedule;
+			StagePtr stage = readStage(key_and_value.first, key_and_value.second, schedule);
 			if (stage)
 			{
-				LOG(1, "Reading post processing stage \"" << key_and_value.first << "\"");
-				stage->Read(key_and_value.second);
-				stages_.push_back(StagePtr(stage));
+				stages_.push_back(std::move(stage));
+				entries_.push_back({ key_and_value.first, to_json(key_and_value.second) });
+				schedules_.push_back(schedule);
+			}
+		}
+	}
+
+	sortShedding();
+
+	if (!lores_given)
+		negotiateLores();
+
+	if (app_->GetOptions()->Get().post_process_reload)
+		watchFile(filename);
+}
+
+StagePtr PostProcessor::readStage(std::string const &name, boost::property_tree::ptree const &params,
+								  StageSchedule &schedule)
+{
+	StagePtr stage(createPostProcessingStage(name.c_str()));
+	if (!stage)
+	{
+		LOG(1, "No post processing stage found for \"" << name << "\"");
+		return stage;
+	}
+
+	LOG(1, "Reading post processing stage \"" << name << "\"");
+	std::string stage_name = stage->Name();
+	stage->SetTimingCallback([this, stage_name](char const *what, double time_us) {
+		std::lock_guard<std::mutex> lock(stats_mutex_);
+		extra_stats_[stage_name + "." + what].Add(time_us, false);
+	});
+	stage->Read(params);
+
+	schedule.every = std::max(params.get<unsigned int>("every", 1), 1u);
+	double max_fps = params.get<double>("max_fps", 0);
+	schedule.min_interval_us = max_fps > 0 ? 1e6 / max_fps : 0;
+	if (auto priority = params.get_optional<int>("priority"))
+		schedule.priority = *priority;
+	return stage;
+}
+
+// Editors often save by writing a new file and renaming it over the old one, so we watch the directory for
+// anything arriving with the file's name. That happens on a thread of our own, well away from the frames.
+
+void PostProcessor::watchFile(std::string const &filename)
+{
+	size_t slash = filename.rfind('/');
+	std::string dir = slash == std::string::npos ? "." : filename.substr(0, slash + 1);
+	inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd_ < 0 || inotify_add_watch(inotify_fd_, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+		throw std::runtime_error("PostProcessor: unable to watch " + filename);
+	watch_abort_fd_ = eventfd(0, EFD_CLOEXEC);
+	watch_thread_ = std::thread(&PostProcessor::watchThread, this);
+	LOG(1, "PostProcessor: watching " << filename << " for changes");
+}
+
+void PostProcessor::watchThread()
+{
+	ThreadConfig::Apply("pp-reload");
+
+	// A change made while the camera is stopped waits until it is running again.
+	bool pending = false;
+	while (true)
+	{
+		pollfd fds[2] = { { watch_abort_fd_, POLLIN, 0 }, { inotify_fd_, POLLIN, 0 } };
+		int ret = poll(fds, 2, pending ? 500 : -1);
+		if (ret < 0 && errno != EINTR)
+		{
+			LOG_ERROR("ERROR: post-process file watcher poll failed");
+			return;
+		}
+		if (fds[0].revents & POLLIN)
+			return;
+		if (ret > 0 && (fds[1].revents & POLLIN) && fileChanged())
+			pending = true;
+		if (pending)
+			pending = !reload();
+	}
+}
+
+bool PostProcessor::fileChanged()
+{
+	size_t slash = filename_.rfind('/');
+	std::string name = slash == std::string::npos ? filename_ : filename_.substr(slash + 1);
+	alignas(inotify_event) char buf[4096];
+	bool changed = false;
+	ssize_t n;
+	while ((n = read(inotify_fd_, buf, sizeof(buf))) > 0)
+	{
+		for (char *p = buf; p < buf + n;)
+		{
+			inotify_event const *event = (inotify_event const *)p;
+			if (event->len && name == event->name)
+				changed = true;
+			p += sizeof(inotify_event) + event->len;
+		}
+	}
+	return changed;
+}
+
+// Read the file again, and build the stages that have changed while the old ones carry on with the frames.
+// Stages whose name and parameters are unchanged are kept just as they are, along with their loaded models and
+// statistics. Once the new ones are configured and started, new frames are held back until those already in
+// the stages are done, the stages are swapped over, and the held frames are let go. So the camera never
+// waits, and only a stage that changes misses any frames. Only changes that fit the streams as configured can
+// be taken on; for others, and for anything else that goes wrong, we carry on with the stages we had. Returns
+// false if the post-processor isn't running, so that the caller can try again later.
+//
+// The exception is a stage with a device to itself (see ExclusiveDevice), which its replacement couldn't open.
+// Frames are held back while such a stage is destroyed and the new ones built, which for a large network may
+// be long enough to stall the camera, and if the new stages fail we carry on without the one we destroyed.
+
+bool PostProcessor::reload()
+{
+	std::lock_guard<std::mutex> reload_lock(reload_mutex_);
+	if (!running_)
+		return false;
+
+	boost::property_tree::ptree root;
+	try
+	{
+		boost::property_tree::read_json(filename_, root);
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("PostProcessor: not reloading " << filename_ << ": " << e.what());
+		return true;
+	}
+
+	std::vector<StageEntry> entries;
+	boost::property_tree::ptree const *config = nullptr;
+	for (auto const &[name, node] : root)
+	{
+		if (name != "rpicam-apps")
+			entries.push_back({ name, to_json(node) });
+		else
+		{
+			auto lores = node.get_child_optional("lores");
+			if ((lores ? to_json(*lores) : "") != lores_node_)
+				LOG_ERROR("PostProcessor: changing the lores stream needs a restart, ignoring it");
+			if (auto pp = node.get_child_optional("post_processor"))
+				config = &*pp;
+		}
+	}
+
+	LOG(1, "PostProcessor: reloading " << filename_);
+
+	// Only the workers touch entries_ and stages_ while we run, and they never change them.
+	std::vector<int> reuse;
+	std::vector<bool> taken;
+	auto match = [&]()
+	{
+		reuse.assign(entries.size(), -1);
+		taken.assign(stages_.size(), false);
+		for (unsigned int i = 0; i < entries.size(); i++)
+		{
+			for (unsigned int j = 0; j < stages_.size() && reuse[i] < 0; j++)
+			{
+				if (!taken[j] && entries_[j].name == entries[i].name && entries_[j].params == entries[i].params)
+					reuse[i] = j, taken[j] = true;
+			}
+		}
+	};
+	match();
+
+	std::vector<unsigned int> evict;
+	for (unsigned int j = 0; j < stages_.size(); j++)
+	{
+		if (!taken[j] && stages_[j]->ExclusiveDevice())
+			evict.push_back(j);
+	}
+	if (!evict.empty())
+	{
+		holdFrames();
+		evictStages(evict);
+		match();
+	}
+
+	std::vector<StagePtr> fresh(entries.size());
+	std::vector<StageSchedule> fresh_schedules(entries.size());
+	try
+	{
+		for (unsigned int i = 0; i < entries.size(); i++)
+		{
+			if (reuse[i] >= 0)
+				continue;
+			boost::property_tree::ptree params;
+			std::istringstream ss(entries[i].params);
+			boost::property_tree::read_json(ss, params);
+			StagePtr stage = readStage(entries[i].name, params, fresh_schedules[i]);
+			if (!stage)
+				continue;
+			for (auto const &[use_case, config] : adjusted_configs_)
+			{
+				StreamConfiguration adjusted = config;
+				stage->AdjustConfig(use_case, &adjusted);
+				if (!same_config(adjusted, config))
+					throw std::runtime_error(entries[i].name + " needs the " + use_case + " stream changing");
+			}
+			stage->Configure();
+			stage->Start();
+			fresh[i] = std::move(stage);
+		}
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("PostProcessor: reload failed (" << e.what() << "), keeping the previous stages");
+		for (StagePtr &stage : fresh)
+		{
+			if (stage)
+			{
+				stage->Stop();
+				stage->Teardown();
+			}
+		}
+		if (!evict.empty())
+		{
+			LOG_ERROR("PostProcessor: " << evict.size() << " stage(s) already replaced are not coming back");
+			releaseFrames();
+		}
+		return true;
+	}
+
+	holdFrames();
+
+	std::vector<StagePtr> removed;
+	unsigned int kept = 0;
+	{
+		std::scoped_lock lock(mutex_, stats_mutex_);
+		if (config)
+		{
+			auto saved = std::make_tuple(num_threads_, max_in_flight_, pipelined_, overflow_policy_, stats_interval_,
+										 stats_file_, frame_budget_us_);
+			try
+			{
+				readConfig(*config);
+			}
+			catch (std::exception const &e)
+			{
+				LOG_ERROR("PostProcessor: keeping the previous post_processor settings: " << e.what());
+				std::tie(num_threads_, max_in_flight_, pipelined_, overflow_policy_, stats_interval_, stats_file_,
+						 frame_budget_us_) = saved;
+			}
+		}
+
+		std::vector<StagePtr> stages;
+		std::vector<StageEntry> stage_entries;
+		std::vector<StageStats> stats;
+		std::vector<StageSchedule> schedules;
+		stage_stats_.resize(stages_.size());
+		for (unsigned int i = 0; i < entries.size(); i++)
+		{
+			if (reuse[i] >= 0)
+			{
+				stages.push_back(std::move(stages_[reuse[i]]));
+				stats.push_back(std::move(stage_stats_[reuse[i]]));
+				schedules.push_back(schedules_[reuse[i]]);
+				kept++;
+			}
+			else if (fresh[i])
+			{
+				stages.push_back(std::move(fresh[i]));
+				stats.emplace_back();
+				schedules.push_back(fresh_schedules[i]);
 			}
 			else
-				LOG(1, "No post processing stage found for \"" << key_and_value.first << "\"");
+				continue;
+			stage_entries.push_back(entries[i]);
+		}
+		for (unsigned int j = 0; j < stages_.size(); j++)
+		{
+			if (!taken[j])
+				removed.push_back(std::move(stages_[j]));
+		}
+
+		std::swap(stages, stages_);
+		std::swap(stage_entries, entries_);
+		std::swap(stats, stage_stats_);
+		std::swap(schedules, schedules_);
+		sortShedding();
+		fuseStages();
+	}
+
+	releaseFrames();
+
+	for (StagePtr &stage : removed)
+	{
+		stage->Stop();
+		stage->Teardown();
+	}
+	LOG(1, "PostProcessor: kept " << kept << " of " << stages_.size() << " stages");
+	return true;
+}
+
+// Hold new frames back, and wait for the stages to finish with those they have, so that the stages can be
+// changed. Nothing happens if they are held already.
+
+void PostProcessor::holdFrames()
+{
+	{
+		std::unique_lock<std::mutex> l(mutex_);
+		if (gate_closed_)
+			return;
+		gate_closed_ = true;
+		idle_cv_.wait(l, [this] { return active_tasks_ == 0; });
+	}
+	stopSlots();
+}
+
+void PostProcessor::releaseFrames()
+{
+	startSlots();
+	std::lock_guard<std::mutex> lock(mutex_);
+	gate_closed_ = false;
+	while (!deferred_.empty())
+	{
+		dispatch(std::move(deferred_.front()));
+		deferred_.pop();
+	}
+}
+
+// Destroy the given stages (in ascending order of index), with frames held back, so that their devices are free.
+
+void PostProcessor::evictStages(std::vector<unsigned int> const &evict)
+{
+	std::vector<StagePtr> evicted;
+	{
+		std::scoped_lock lock(mutex_, stats_mutex_);
+		stage_stats_.resize(stages_.size());
+		for (auto it = evict.rbegin(); it != evict.rend(); it++)
+		{
+			LOG(1, "PostProcessor: removing " << stages_[*it]->Name() << " before replacing it");
+			evicted.push_back(std::move(stages_[*it]));
+			stages_.erase(stages_.begin() + *it);
+			entries_.erase(entries_.begin() + *it);
+			stage_stats_.erase(stage_stats_.begin() + *it);
+			schedules_.erase(schedules_.begin() + *it);
+		}
+		sortShedding();
+		fuseStages();
+	}
+
+	for (StagePtr &stage : evicted)
+	{
+		stage->Stop();
+		stage->Teardown();
+	}
+}
+
+// Give the stages that want a lores image of a particular size the largest of those. It's only RGB if every
+// stage has asked for the lores image at the same, even, size and can take RGB: any other stage may be
+// expecting YUV420, and any stage wanting a different size gets it by scaling, which only the YUV420 path does
+// properly. And only on Pi 5, as the VC4 ISP can't produce it.
+
+void PostProcessor::negotiateLores()
+{
+	unsigned int width = 0, height = 0;
+	bool rgb = app_->GetOptions()->GetPlatform() == Platform::PISP;
+	for (auto const &stage : stages_)
+	{
+		auto preference = stage->PreferredLores();
+		if (!preference)
+		{
+			rgb = false;
+			continue;
 		}
+		if (width && (preference->width != width || preference->height != height))
+			rgb = false;
+		width = std::max(width, preference->width);
+		height = std::max(height, preference->height);
+		rgb &= preference->rgb && !(preference->width & 1) && !(preference->height & 1);
 	}
+	if (!width || !height)
+		return;
+
+	// The stream dimensions must be even, so don't let them get rounded down below what was asked for.
+	app_->GetOptions()->Set().lores_width = (width + 1) & ~1;
+	app_->GetOptions()->Set().lores_height = (height + 1) & ~1;
+	app_->GetOptions()->Set().lores_par = false;
+	app_->lores_format_ = rgb ? libcamera::formats::BGR888 : libcamera::formats::YUV420;
+	LOG(1, "Postprocessing chose lores: " << app_->GetOptions()->Get().lores_width << "x"
+										  << app_->GetOptions()->Get().lores_height << " "
+										  << app_->lores_format_);
+}
+
+void PostProcessor::readConfig(boost::property_tree::ptree const &node)
+{
+	num_threads_ = node.get<unsigned int>("threads", num_threads_);
+	if (!num_threads_)
+		throw std::runtime_error("PostProcessor: threads must be at least 1");
+
+	// A value of zero leaves the number of requests in flight bounded only by the camera buffers.
+	max_in_flight_ = node.get<unsigned int>("max_in_flight", max_in_flight_);
+
+	// Statistics are logged at verbosity level 2 every stats_interval seconds (0 to disable), and written as
+	// JSON to stats_file when the post-processor is destroyed.
+	stats_interval_ = std::chrono::duration<double>(node.get<double>("stats_interval", stats_interval_.count()));
+	stats_file_ = node.get<std::string>("stats_file", stats_file_);
+
+	// Zero means stages are never shed.
+	frame_budget_us_ = node.get<double>("frame_budget_ms", frame_budget_us_ / 1000) * 1000;
+
+	std::string mode = node.get<std::string>("mode", "pool");
+	if (mode == "pool")
+		pipelined_ = false;
+	else if (mode == "pipelined")
+		pipelined_ = true;
+	else
+		throw std::runtime_error("PostProcessor: unknown mode " + mode);
+
+	std::string overflow = node.get<std::string>("overflow", "drop");
+	if (overflow == "drop")
+		overflow_policy_ = OverflowPolicy::Drop;
+	else if (overflow == "block")
+		overflow_policy_ = OverflowPolicy::Block;
+	else
+		throw std::runtime_error("PostProcessor: unknown overflow policy " + overflow);
+
+	LOG(1, "Postprocessing in " << mode << " mode using " << num_threads_ << " threads, max in flight "
+								 << max_in_flight_ << ", overflow " << overflow);
 }
 
 PostProcessingStage *PostProcessor::createPostProcessingStage(char const *name)
 {
+	if (!GetPostProcessingStages().count(name))
+		load_stage_library(name);
+
 	auto it = GetPostProcessingStages().find(std::string(name));
 	return it != GetPostProcessingStages().end() ? (*it->second)(app_) : nullptr;
 }
@@ -135,6 +601,7 @@ void PostProcessor::AdjustConfig(std::string const &use_case, StreamConfiguratio
 	{
 		stage->AdjustConfig(use_case, config);
 	}
+	adjusted_configs_[use_case] = *config;
 }
 
 void PostProcessor::Configure()
@@ -143,53 +610,433 @@ void PostProcessor::Configure()
 	{
 		stage->Configure();
 	}
+
+	fuseStages();
+}
+
+void PostProcessor::fuseStages()
+{
+	fused_end_.assign(stages_.size(), 0);
+	for (unsigned int i = 0; i < stages_.size(); i++)
+	{
+		unsigned int end = i;
+		while (end < stages_.size() && stages_[end]->PerPixel())
+			end++;
+		if (end - i > 1)
+		{
+			fused_end_[i] = end;
+			LOG(2, "PostProcessor: fusing " << end - i << " per-pixel stages from " << stages_[i]->Name());
+			i = end - 1;
+		}
+	}
 }
 
 void PostProcessor::Start()
 {
+	std::lock_guard<std::mutex> reload_lock(reload_mutex_);
 	quit_ = false;
+	overflow_drops_ = 0;
+	last_report_ = std::chrono::steady_clock::now();
+	{
+		std::lock_guard<std::mutex> lock(stats_mutex_);
+		stage_stats_.resize(stages_.size());
+	}
 	output_thread_ = std::thread(&PostProcessor::outputThread, this);
 
+	startSlots();
+
 	for (auto &stage : stages_)
 	{
 		stage->Start();
 	}
+	running_ = true;
+}
+
+void PostProcessor::startSlots()
+{
+	if (pipelined_)
+	{
+		// One thread per stage keeps every stage seeing the frames in order.
+		for (unsigned int i = 0; i < stages_.size(); i++)
+		{
+			slots_.push_back(std::make_unique<Slot>());
+			slots_.back()->first_stage = i;
+			slots_.back()->end_stage = i + 1;
+		}
+	}
+	else if (!stages_.empty())
+	{
+		slots_.push_back(std::make_unique<Slot>());
+		slots_.back()->first_stage = 0;
+		slots_.back()->end_stage = stages_.size();
+	}
+
+	for (unsigned int i = 0; i < slots_.size(); i++)
+	{
+		unsigned int num_threads = pipelined_ ? 1 : num_threads_;
+		for (unsigned int j = 0; j < num_threads; j++)
+			slots_[i]->threads.emplace_back(&PostProcessor::workerThread, this, i);
+	}
+}
+
+// Called with mutex_ held. With no stages there are no slots, and the request goes straight to the output
+// thread, which keeps it in order behind any still in the stages.
+
+void PostProcessor::dispatch(Task task)
+{
+	if (slots_.empty())
+	{
+		task.promise.set_value(false);
+		cv_.notify_one();
+		return;
+	}
+	active_tasks_++;
+	slots_[0]->tasks.push(std::move(task));
+	slots_[0]->cv.notify_one();
 }
 
 void PostProcessor::Process(CompletedRequestPtr &request)
 {
-	if (stages_.empty())
+	std::unique_lock<std::mutex> l(mutex_);
+
+	// A reload may be swapping the stages over, or have just left held requests in front of this one.
+	if (stages_.empty() && !gate_closed_ && futures_.empty())
 	{
+		l.unlock();
+		Trace::Event(TraceHop::PostProcessed, request->sequence);
 		callback_(request);
 		return;
 	}
 
-	std::unique_lock<std::mutex> l(mutex_);
-	requests_.push(std::move(request)); // caller has given us ownership of this reference
+	if (max_in_flight_ && futures_.size() >= max_in_flight_)
+	{
+		if (overflow_policy_ == OverflowPolicy::Block)
+			space_cv_.wait(l, [this] { return quit_ || futures_.size() < max_in_flight_; });
 
-	std::promise<bool> promise;
-	auto process_fn = [this](CompletedRequestPtr &request, std::promise<bool> promise) {
-		bool drop_request = false;
-		for (auto &stage : stages_)
+		if (overflow_policy_ == OverflowPolicy::Drop || quit_)
 		{
-			if (stage->Process(request))
+			// Dropping our reference returns the buffers to the camera.
+			overflow_drops_++;
+			Metrics::Add(Metric::PostProcessDropped);
 			{
-				drop_request = true;
-				break;
+				std::lock_guard<std::mutex> lock(stats_mutex_);
+				requests_seen_++;
+				total_overflow_drops_++;
 			}
+			LOG(2, "PostProcessor: dropping request, " << futures_.size() << " already in flight");
+			l.unlock();
+			request.reset();
+			return;
 		}
-		promise.set_value(drop_request);
-		cv_.notify_one();
-	};
+	}
+
+	{
+		// The stage costs are moving averages, so there's no need to reconsider the shedding on every frame.
+		constexpr unsigned int SHED_INTERVAL = 16;
+		std::lock_guard<std::mutex> lock(stats_mutex_);
+		requests_seen_++;
+		queue_depth_sum_ += futures_.size();
+		queue_depth_max_ = std::max<unsigned int>(queue_depth_max_, futures_.size());
+		if (requests_seen_ % SHED_INTERVAL == 0)
+			updateShedding();
+	}
+
+	requests_.push(std::move(request)); // caller has given us ownership of this reference
 
 	// Queue the futures to ensure we have correct ordering in the output thread. The promise/future return value
 	// tells us when all the streams for this request have been processed and output_ready_callback_ can be called.
+	std::promise<bool> promise;
 	futures_.push(promise.get_future());
-	std::thread { process_fn, std::ref(requests_.back()), std::move(promise) }.detach();
+	Metrics::Set(Metric::PostProcessQueueDepth, futures_.size());
+	Task task { &requests_.back(), std::move(promise) };
+	if (gate_closed_)
+		deferred_.push(std::move(task));
+	else
+		dispatch(std::move(task));
+}
+
+bool PostProcessor::runStages(CompletedRequestPtr &request, unsigned int first, unsigned int end)
+{
+	for (unsigned int i = first; i < end; i++)
+	{
+		// In pipelined mode each stage has a slot to itself, so nothing gets fused.
+		if (fused_end_[i] && fused_end_[i] <= end)
+		{
+			runFused(request, i, fused_end_[i]);
+			i = fused_end_[i] - 1;
+			continue;
+		}
+
+		if (!scheduleStage(i, *request))
+			continue;
+
+		auto start = std::chrono::steady_clock::now();
+		bool dropped = stages_[i]->Process(request);
+		std::chrono::duration<double, std::micro> time = std::chrono::steady_clock::now() - start;
+		recordStage(i, time.count(), dropped);
+
+		if (dropped)
+			return true;
+	}
+
+	return false;
+}
+
+void PostProcessor::runFused(CompletedRequestPtr &request, unsigned int first, unsigned int end)
+{
+	// Small enough for the tile to stay in the L1 cache while every stage works on it.
+	constexpr size_t TILE_SIZE = 32768;
+
+	std::vector<unsigned int> run;
+	for (unsigned int i = first; i < end; i++)
+	{
+		if (scheduleStage(i, *request))
+			run.push_back(i);
+	}
+	if (run.empty())
+		return;
+
+	std::vector<double> time_us(run.size(), 0);
+	{
+		BufferWriteSync w(app_, request->buffers[app_->GetMainStream()]);
+		libcamera::Span<uint8_t> buffer = w.Get()[0];
+		for (size_t offset = 0; offset < buffer.size(); offset += TILE_SIZE)
+		{
+			size_t size = std::min(TILE_SIZE, buffer.size() - offset);
+			for (unsigned int j = 0; j < run.size(); j++)
+			{
+				auto start = std::chrono::steady_clock::now();
+				stages_[run[j]]->ProcessTile(buffer.data() + offset, offset, size);
+				std::chrono::duration<double, std::micro> time = std::chrono::steady_clock::now() - start;
+				time_us[j] += time.count();
+			}
+		}
+	}
+
+	for (unsigned int j = 0; j < run.size(); j++)
+		recordStage(run[j], time_us[j], false);
+}
+
+void PostProcessor::recordStage(unsigned int stage, double time_us, bool dropped)
+{
+	std::lock_guard<std::mutex> lock(stats_mutex_);
+	stage_stats_[stage].Add(time_us, dropped);
+	StageSchedule &schedule = schedules_[stage];
+	schedule.cost_us = schedule.cost_us ? 0.9 * schedule.cost_us + 0.1 * time_us : time_us;
+}
+
+bool PostProcessor::scheduleStage(unsigned int stage, CompletedRequest const &request)
+{
+	std::lock_guard<std::mutex> lock(stats_mutex_);
+	StageSchedule &schedule = schedules_[stage];
+	bool run = !schedule.shed && request.sequence % schedule.every == 0;
+	if (run && schedule.min_interval_us)
+	{
+		auto ts = request.metadata.get(libcamera::controls::SensorTimestamp);
+		int64_t now_us = ts ? *ts / 1000
+							: std::chrono::duration_cast<std::chrono::microseconds>(
+								  std::chrono::steady_clock::now().time_since_epoch())
+								  .count();
+		if (schedule.last_run_us >= 0 && now_us - schedule.last_run_us < schedule.min_interval_us)
+			run = false;
+		else
+			schedule.last_run_us = now_us;
+	}
+	if (!run)
+		stage_stats_[stage].skips++;
+	return run;
+}
+
+// The order in which stages get shed only changes when the stages do, so it's worked out just then.
+
+void PostProcessor::sortShedding()
+{
+	shed_order_.clear();
+	for (unsigned int i = 0; i < schedules_.size(); i++)
+	{
+		if (schedules_[i].priority)
+			shed_order_.push_back(i);
+	}
+	std::stable_sort(shed_order_.begin(), shed_order_.end(),
+					 [this](unsigned int a, unsigned int b) { return *schedules_[a].priority < *schedules_[b].priority; });
+}
+
+// Work out which stages to shed, given what each costs when it runs. Stages that are already shed have a
+// little headroom to find before they come back, so that they don't flip in and out on every frame.
+
+void PostProcessor::updateShedding()
+{
+	if (!frame_budget_us_)
+		return;
+
+	double total_us = 0;
+	for (StageSchedule const &schedule : schedules_)
+		total_us += schedule.cost_us / schedule.every;
+
+	for (unsigned int i : shed_order_)
+	{
+		StageSchedule &schedule = schedules_[i];
+		bool shed = total_us > frame_budget_us_ * (schedule.shed ? 0.9 : 1);
+		if (shed)
+			total_us -= schedule.cost_us / schedule.every;
+		if (shed != schedule.shed)
+			LOG(1, "PostProcessor: " << (shed ? "shedding" : "restoring") << " stage " << stages_[i]->Name());
+		schedule.shed = shed;
+	}
+}
+
+void PostProcessor::StageStats::Add(double time_us, bool dropped)
+{
+	frames++;
+	drops += dropped;
+	total_us += time_us;
+	max_us = std::max(max_us, time_us);
+
+	if (window.size() < WINDOW)
+		window.push_back(time_us);
+	else
+		window[next] = time_us;
+	next = (next + 1) % WINDOW;
+}
+
+double PostProcessor::StageStats::Percentile(double p) const
+{
+	if (window.empty())
+		return 0;
+
+	std::vector<float> sorted(window);
+	auto nth = sorted.begin() + std::min<size_t>(p * sorted.size(), sorted.size() - 1);
+	std::nth_element(sorted.begin(), nth, sorted.end());
+	return *nth;
+}
+
+void PostProcessor::reportStats(bool final)
+{
+	auto now = std::chrono::steady_clock::now();
+	if (!final && (stats_interval_.count() <= 0 || now - last_report_ < stats_interval_))
+		return;
+	last_report_ = now;
+
+	std::lock_guard<std::mutex> lock(stats_mutex_);
+	double mean_depth = requests_seen_ ? (double)queue_depth_sum_ / requests_seen_ : 0;
+	LOG(2, "PostProcessor: " << requests_seen_ << " requests, " << total_overflow_drops_ << " overflow drops, queue depth mean "
+							 << mean_depth << " max " << queue_depth_max_);
+	for (unsigned int i = 0; i < stage_stats_.size(); i++)
+	{
+		StageStats const &stats = stage_stats_[i];
+		LOG(2, "    " << stages_[i]->Name() << ": " << stats.frames << " frames, " << stats.drops << " dropped, "
+					  << stats.skips << " skipped, p50 "
+					  << stats.Percentile(0.5) << "us p95 " << stats.Percentile(0.95) << "us p99 "
+					  << stats.Percentile(0.99) << "us max " << stats.max_us << "us");
+	}
+	for (auto const &[name, stats] : extra_stats_)
+	{
+		LOG(2, "    " << name << ": " << stats.frames << " samples, p50 " << stats.Percentile(0.5) << "us p95 "
+					  << stats.Percentile(0.95) << "us p99 " << stats.Percentile(0.99) << "us max " << stats.max_us
+					  << "us");
+	}
+}
+
+void PostProcessor::writeStats() const
+{
+	boost::property_tree::ptree root, stages;
+
+	std::lock_guard<std::mutex> lock(stats_mutex_);
+	root.put("requests", requests_seen_);
+	root.put("overflow_drops", total_overflow_drops_);
+	root.put("queue_depth_mean", requests_seen_ ? (double)queue_depth_sum_ / requests_seen_ : 0);
+	root.put("queue_depth_max", queue_depth_max_);
+
+	for (unsigned int i = 0; i < stage_stats_.size() && i < stages_.size(); i++)
+	{
+		StageStats const &stats = stage_stats_[i];
+		boost::property_tree::ptree stage;
+		stage.put("name", stages_[i]->Name());
+		stage.put("frames", stats.frames);
+		stage.put("drops", stats.drops);
+		stage.put("skips", stats.skips);
+		stage.put("mean_us", stats.frames ? stats.total_us / stats.frames : 0);
+		stage.put("p50_us", stats.Percentile(0.5));
+		stage.put("p95_us", stats.Percentile(0.95));
+		stage.put("p99_us", stats.Percentile(0.99));
+		stage.put("max_us", stats.max_us);
+		stages.push_back(std::make_pair("", stage));
+	}
+	root.add_child("stages", stages);
+
+	boost::property_tree::ptree timings;
+	for (auto const &[name, stats] : extra_stats_)
+	{
+		boost::property_tree::ptree timing;
+		timing.put("name", name);
+		timing.put("samples", stats.frames);
+		timing.put("mean_us", stats.frames ? stats.total_us / stats.frames : 0);
+		timing.put("p50_us", stats.Percentile(0.5));
+		timing.put("p95_us", stats.Percentile(0.95));
+		timing.put("p99_us", stats.Percentile(0.99));
+		timing.put("max_us", stats.max_us);
+		timings.push_back(std::make_pair("", timing));
+	}
+	root.add_child("timings", timings);
+
+	try
+	{
+		boost::property_tree::write_json(stats_file_, root);
+		LOG(1, "PostProcessor: statistics written to " << stats_file_);
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("PostProcessor: failed to write statistics to " << stats_file_ << ": " << e.what());
+	}
+}
+
+void PostProcessor::workerThread(unsigned int slot_index)
+{
+	ThreadConfig::Apply("pp-worker");
+
+	Slot &slot = *slots_[slot_index];
+	bool last_slot = slot_index == slots_.size() - 1;
+
+	while (true)
+	{
+		Task task;
+		{
+			std::unique_lock<std::mutex> l(mutex_);
+			slot.cv.wait(l, [&slot] { return slot.quit || !slot.tasks.empty(); });
+
+			// Drain any outstanding work before quitting so that every future gets a value.
+			if (slot.tasks.empty())
+				break;
+
+			task = std::move(slot.tasks.front());
+			slot.tasks.pop();
+		}
+
+		// The queue never moves its elements, so the request reference stays valid until the output thread
+		// has seen our promise being fulfilled.
+		bool drop_request = runStages(*task.request, slot.first_stage, slot.end_stage);
+
+		std::unique_lock<std::mutex> l(mutex_);
+		if (drop_request || last_slot)
+		{
+			task.promise.set_value(drop_request);
+			cv_.notify_one();
+			if (--active_tasks_ == 0)
+				idle_cv_.notify_all();
+		}
+		else
+		{
+			Slot &next = *slots_[slot_index + 1];
+			next.tasks.push(std::move(task));
+			next.cv.notify_one();
+		}
+	}
 }
 
 void PostProcessor::outputThread()
 {
+	ThreadConfig::Apply("pp-output");
+
 	while (true)
 	{
 		CompletedRequestPtr request;
@@ -209,17 +1056,28 @@ void PostProcessor::outputThread()
 
 			drop_request = futures_.front().get();
 			futures_.pop();
+			Metrics::Set(Metric::PostProcessQueueDepth, futures_.size());
 			request = std::move(requests_.front()); // reuse as it's being dropped from the queue
 			requests_.pop();
+			space_cv_.notify_one();
 		}
 
 		if (!drop_request)
+		{
+			Trace::Event(TraceHop::PostProcessed, request->sequence);
 			callback_(request); // callback can take over ownership from us
+		}
+
+		reportStats(false);
 	}
 }
 
 void PostProcessor::Stop()
 {
+	std::lock_guard<std::mutex> reload_lock(reload_mutex_);
+	running_ = false;
+	stopSlots();
+
 	for (auto &stage : stages_)
 	{
 		stage->Stop();
@@ -229,9 +1087,33 @@ void PostProcessor::Stop()
 		std::unique_lock<std::mutex> l(mutex_);
 		quit_ = true;
 		cv_.notify_one();
+		space_cv_.notify_all();
 	}
 
 	output_thread_.join();
+
+	if (overflow_drops_)
+		LOG(1, "PostProcessor: dropped " << overflow_drops_ << " requests with too many in flight");
+
+	if (!stages_.empty())
+		reportStats(true);
+}
+
+void PostProcessor::stopSlots()
+{
+	// Stop the slots in order, so that no slot can receive more work once its threads have gone.
+	for (auto &slot : slots_)
+	{
+		{
+			std::unique_lock<std::mutex> l(mutex_);
+			slot->quit = true;
+			slot->cv.notify_all();
+		}
+
+		for (auto &thread : slot->threads)
+			thread.join();
+	}
+	slots_.clear();
 }
 
 void PostProcessor::Teardown()
@@ -240,4 +1122,5 @@ void PostProcessor::Teardown()
 	{
 		stage->Teardown();
 	}
+	adjusted_configs_.clear();
 }
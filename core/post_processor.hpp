@@ -10,17 +10,20 @@
 #include <chrono>
 #include <condition_variable>
 #include <future>
+#include <map>
 #include <mutex>
+#include <optional>
 #include <queue>
+#include <thread>
+#include <vector>
 
 #include "core/completed_request.hpp"
 #include "core/dl_lib.hpp"
 #include "core/logging.hpp"
 
-namespace libcamera
-{
-struct StreamConfiguration;
-}
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <libcamera/stream.h>
 
 class RPiCamApp;
 
@@ -56,12 +59,101 @@ public:
 	void Teardown();
 
 private:
+	// What to do with a new request when max_in_flight_ requests are already being processed.
+	enum class OverflowPolicy
+	{
+		Drop, // return the request straight to the camera
+		Block // make the caller wait until a request completes
+	};
+
+	struct Task
+	{
+		CompletedRequestPtr *request;
+		std::promise<bool> promise;
+	};
+
+	// A slot runs a contiguous range of stages on its own queue and threads. In the default "pool" mode a
+	// single slot runs every stage, whereas in "pipelined" mode each stage gets a slot (and thread) of its
+	// own so that consecutive stages work on successive frames concurrently.
+	struct Slot
+	{
+		unsigned int first_stage;
+		unsigned int end_stage;
+		std::queue<Task> tasks;
+		std::condition_variable cv;
+		std::vector<std::thread> threads;
+		bool quit = false;
+	};
+
+	// Timing and drop statistics for one stage. Percentiles come from a window of the most recent samples.
+	struct StageStats
+	{
+		static constexpr unsigned int WINDOW = 1024;
+
+		void Add(double time_us, bool dropped);
+		double Percentile(double p) const;
+
+		uint64_t frames = 0;
+		uint64_t drops = 0;
+		uint64_t skips = 0; // frames the stage didn't run on, by its schedule or through shedding
+		double total_us = 0;
+		double max_us = 0;
+		std::vector<float> window;
+		unsigned int next = 0;
+	};
+
+	// When a stage runs, from the "every" (run on every Nth frame), "max_fps" and "priority" keys in its JSON
+	// parameters. When the stages together take longer than frame_budget_ms over a frame, on average, the
+	// stages that have a priority are shed, lowest first, until they fit. Stages with no priority always run.
+	struct StageSchedule
+	{
+		unsigned int every = 1;
+		double min_interval_us = 0;
+		std::optional<int> priority;
+		int64_t last_run_us = -1;
+		double cost_us = 0; // moving average of the stage's run time
+		bool shed = false;
+	};
+
+	// A stage as the JSON file gave it, with its parameters kept as JSON text.
+	struct StageEntry
+	{
+		std::string name;
+		std::string params;
+	};
+
 	PostProcessingStage *createPostProcessingStage(char const *name);
+	StagePtr readStage(std::string const &name, boost::property_tree::ptree const &params, StageSchedule &schedule);
+	void fuseStages();
+	void watchFile(std::string const &filename);
+	void watchThread();
+	bool fileChanged();
+	bool reload();
+	void holdFrames();
+	void releaseFrames();
+	void evictStages(std::vector<unsigned int> const &evict);
+	void startSlots();
+	void stopSlots();
+	void dispatch(Task task);
+	void reportStats(bool final);
+	void writeStats() const;
+	void readConfig(boost::property_tree::ptree const &node);
+	void negotiateLores();
+	bool runStages(CompletedRequestPtr &request, unsigned int first, unsigned int end);
+	void runFused(CompletedRequestPtr &request, unsigned int first, unsigned int end);
+	void recordStage(unsigned int stage, double time_us, bool dropped);
+	bool scheduleStage(unsigned int stage, CompletedRequest const &request);
+	void sortShedding();
+	void updateShedding();
 
 	RPiCamApp *app_;
 	std::vector<StagePtr> stages_;
+	std::vector<StageEntry> entries_; // one for each of stages_
+	// For the first stage of each run of per-pixel stages that get fused, the end of the run, or otherwise 0.
+	std::vector<unsigned int> fused_end_;
 	std::vector<DlLib> dynamic_stages_;
 	void outputThread();
+	void workerThread(unsigned int slot);
 
 	std::queue<CompletedRequestPtr> requests_;
 	std::queue<std::future<bool>> futures_;
@@ -70,4 +162,45 @@ private:
 	PostProcessorCallback callback_;
 	std::mutex mutex_;
 	std::condition_variable cv_;
+
+	// Fixed set of threads that run the stages, fed through the slot queues.
+	unsigned int num_threads_;
+	unsigned int max_in_flight_;
+	bool pipelined_;
+	OverflowPolicy overflow_policy_ = OverflowPolicy::Drop;
+	std::vector<std::unique_ptr<Slot>> slots_;
+	std::condition_variable space_cv_;
+	unsigned int overflow_drops_;
+
+	// Instrumentation, protected by stats_mutex_ rather than mutex_ to keep it off the hot path.
+	mutable std::mutex stats_mutex_;
+	std::vector<StageStats> stage_stats_;
+	std::vector<StageSchedule> schedules_;
+	double frame_budget_us_ = 0;
+	std::vector<unsigned int> shed_order_; // stages with a priority, lowest first
+	std::map<std::string, StageStats> extra_stats_; // reported by the stages themselves, by "stage.what"
+	uint64_t requests_seen_ = 0;
+	uint64_t total_overflow_drops_ = 0;
+	uint64_t queue_depth_sum_ = 0;
+	unsigned int queue_depth_max_ = 0;
+	std::chrono::duration<double> stats_interval_ = 5s;
+	std::chrono::steady_clock::time_point last_report_;
+	std::string stats_file_;
+
+	// For --post-process-reload. We remember the configuration each use case's stream had from the stages, so
+	// that a stage that would change it (and so need the camera reconfiguring) isn't taken on. reload_mutex_
+	// keeps a reload apart from Start and Stop. While the stages are swapped over, the gate is closed and new
+	// requests wait in deferred_; active_tasks_ counts the requests in the slots, under mutex_.
+	std::string filename_;
+	int inotify_fd_ = -1;
+	int watch_abort_fd_ = -1;
+	std::thread watch_thread_;
+	std::mutex reload_mutex_;
+	bool running_ = false;
+	bool gate_closed_ = false;
+	std::queue<Task> deferred_;
+	unsigned int active_tasks_ = 0;
+	std::condition_variable idle_cv_;
+	std::string lores_node_;
+	std::map<std::string, StreamConfiguration> adjusted_configs_;
 };
@@ -8,17 +8,22 @@
 #include "preview/preview.hpp"
 
 #include "core/frame_info.hpp"
+#include "core/memory_account.hpp"
+#include "core/metrics.hpp"
 #include "core/rpicam_app.hpp"
 #include "core/options.hpp"
+#include "core/thread_config.hpp"
+#include "core/trace.hpp"
 
 #include <cmath>
 #include <fcntl.h>
+#include <fstream>
 #include <stdlib.h>
 
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
-#include <linux/dma-buf.h>
 #include <linux/videodev2.h>
 
 #include <libcamera/base/shared_fd.h>
@@ -26,6 +31,11 @@
 
 unsigned int RPiCamApp::verbosity = 1;
 
+// How long after the first frame we report how many buffers the application needed.
+static constexpr uint64_t BUFFER_WARMUP_NS = 2000000000;
+// Window titles don't need to change every frame, and each change is a round trip to the window system.
+static constexpr std::chrono::milliseconds INFO_TEXT_INTERVAL(200);
+
 static libcamera::PixelFormat mode_to_pixel_format(Mode const &mode)
 {
 	// The saving grace here is that we can ignore the Bayer order and return anything -
@@ -76,6 +86,73 @@ static void set_pipeline_configuration(Platform platform)
 	}
 }
 
+// The sensor mode cache is a text file. Its first line identifies the camera, the libcamera version and any
+// tuning file, so that a change to any of them invalidates it, and each line after that is one mode: the fourcc
+// and modifier of its format, its size, and its maximum framerate (or 0 if that wasn't measured).
+static std::string mode_cache_key(std::string const &cam_id)
+{
+	std::stringstream key;
+	key << libcamera::CameraManager::version() << " " << cam_id;
+	char const *tuning_file = getenv("LIBCAMERA_RPI_TUNING_FILE");
+	struct stat info;
+	if (tuning_file && stat(tuning_file, &info) == 0)
+		key << " " << tuning_file << " " << info.st_mtim.tv_sec << "." << info.st_mtim.tv_nsec;
+	return key.str();
+}
+
+static bool read_mode_cache(std::string const &filename, std::string const &key, bool need_fps,
+							std::vector<RPiCamApp::SensorMode> &modes)
+{
+	std::ifstream file(filename);
+	std::string line;
+	if (!std::getline(file, line) || line != key)
+		return false;
+
+	std::vector<RPiCamApp::SensorMode> cached;
+	uint32_t fourcc;
+	uint64_t modifier;
+	unsigned int width, height;
+	double fps;
+	while (file >> fourcc >> modifier >> width >> height >> fps)
+	{
+		// Modes listed without a framerate are no use if we need to know it.
+		if (need_fps && !fps)
+			return false;
+		cached.emplace_back(libcamera::Size(width, height), libcamera::PixelFormat(fourcc, modifier), fps);
+	}
+	if (!file.eof() || cached.empty())
+		return false;
+
+	modes = std::move(cached);
+	return true;
+}
+
+static void write_mode_cache(std::string const &filename, std::string const &key,
+							 std::vector<RPiCamApp::SensorMode> const &modes)
+{
+	// Write a new file and rename it into place, so that other instances starting up never see half of one.
+	std::string tmp = filename + "." + std::to_string(getpid());
+	{
+		std::ofstream file(tmp);
+		file << key << std::endl;
+		file.precision(17);
+		for (auto const &mode : modes)
+			file << mode.format.fourcc() << " " << mode.format.modifier() << " " << mode.size.width << " "
+				 << mode.size.height << " " << mode.fps << std::endl;
+		if (!file)
+		{
+			LOG_ERROR("WARNING: failed to write sensor mode cache " << tmp);
+			unlink(tmp.c_str());
+			return;
+		}
+	}
+	if (rename(tmp.c_str(), filename.c_str()))
+	{
+		LOG_ERROR("WARNING: failed to update sensor mode cache " << filename);
+		unlink(tmp.c_str());
+	}
+}
+
 RPiCamApp::RPiCamApp(std::unique_ptr<Options> opts)
 	: options_(std::move(opts)), controls_(controls::controls), post_processor_(this)
 {
@@ -106,19 +183,61 @@ RPiCamApp::~RPiCamApp()
 	if (!options_->Get().help)
 		LOG(2, "Closing RPiCam application"
 				   << "(frames displayed " << preview_frames_displayed_ << ", dropped " << preview_frames_dropped_
-				   << ")");
+				   << ", skipped " << preview_frames_skipped_ << ")");
 	StopCamera();
 	Teardown();
 	CloseCamera();
+	Metrics::Stop();
+	Trace::Close();
+}
+
+void RPiCamApp::startupPhase(char const *name, bool done)
+{
+	if (startup_reported_)
+		return;
+
+	auto now = std::chrono::steady_clock::now();
+	std::stringstream ss;
+	ss.precision(1);
+	ss << std::fixed << (startup_timing_.empty() ? "" : ", ") << name << " "
+	   << std::chrono::duration<double, std::milli>(now - startup_mark_).count() << "ms";
+	startup_timing_ += ss.str();
+	startup_mark_ = now;
+
+	if (done)
+	{
+		ss.str("");
+		ss << std::chrono::duration<double, std::milli>(now - startup_begin_).count();
+		LOG(2, "Startup timing: " << startup_timing_ << " (total " << ss.str() << "ms)");
+		startup_reported_ = true;
+	}
+}
+
+// libcamera only allows one CameraManager in a process, so every RPiCamApp in it shares the same one,
+// which lasts as long as any of them is holding it.
+
+static std::shared_ptr<libcamera::CameraManager> shared_camera_manager()
+{
+	static std::mutex mutex;
+	static std::weak_ptr<libcamera::CameraManager> shared;
+	std::lock_guard<std::mutex> lock(mutex);
+
+	std::shared_ptr<libcamera::CameraManager> camera_manager = shared.lock();
+	if (!camera_manager)
+	{
+		camera_manager = std::make_shared<libcamera::CameraManager>();
+		int ret = camera_manager->start();
+		if (ret)
+			throw std::runtime_error("camera manager failed to start, code " + std::to_string(-ret));
+		shared = camera_manager;
+	}
+	return camera_manager;
 }
 
 void RPiCamApp::initCameraManager()
 {
 	camera_manager_.reset();
-	camera_manager_ = std::make_unique<CameraManager>();
-	int ret = camera_manager_->start();
-	if (ret)
-		throw std::runtime_error("camera manager failed to start, code " + std::to_string(-ret));
+	camera_manager_ = shared_camera_manager();
 }
 
 std::string const &RPiCamApp::CameraId() const
@@ -136,11 +255,13 @@ void RPiCamApp::OpenCamera()
 	// Make a preview window.
 	preview_ = std::unique_ptr<Preview>(make_preview(RPiCamApp::GetOptions()));
 	preview_->SetDoneCallback(std::bind(&RPiCamApp::previewDoneCallback, this, std::placeholders::_1));
+	startupPhase("preview");
 
 	LOG(2, "Opening camera...");
 
 	if (!camera_manager_)
 		initCameraManager();
+	startupPhase("camera manager");
 
 	std::vector<std::shared_ptr<libcamera::Camera>> cameras = GetCameras();
 	if (cameras.size() == 0)
@@ -159,16 +280,36 @@ void RPiCamApp::OpenCamera()
 	camera_acquired_ = true;
 
 	LOG(2, "Acquired camera " << cam_id);
+	startupPhase("acquire");
 
 	if (!options_->Get().post_process_file.empty())
 	{
 		post_processor_.LoadModules(options_->Get().post_process_libs);
 		post_processor_.Read(options_->Get().post_process_file);
+		startupPhase("post-processing");
 	}
 	// The queue takes over ownership from the post-processor.
 	post_processor_.SetCallback(
 		[this](CompletedRequestPtr &r) { this->msg_queue_.Post(Msg(MsgType::RequestComplete, std::move(r))); });
 
+	enumerateSensorModes();
+	startupPhase("sensor modes");
+}
+
+void RPiCamApp::enumerateSensorModes()
+{
+	std::string const &cache = options_->Get().mode_cache;
+	std::string key;
+	if (!cache.empty())
+	{
+		key = mode_cache_key(camera_->id());
+		if (read_mode_cache(cache, key, !!options_->Get().framerate, sensor_modes_))
+		{
+			LOG(2, "Read " << sensor_modes_.size() << " sensor modes from " << cache);
+			return;
+		}
+	}
+
 	// We're going to make a list of all the available sensor modes, but we only populate
 	// the framerate field if the user has requested a framerate (as this requires us actually
 	// to configure the sensor, which is otherwise best avoided).
@@ -211,12 +352,17 @@ void RPiCamApp::OpenCamera()
 		libcamera::logSetLevel("RPI", "INFO");
 		libcamera::logSetLevel("Camera", "INFO");
 	}
+
+	if (!cache.empty())
+		write_mode_cache(cache, key, sensor_modes_);
 }
 
 void RPiCamApp::CloseCamera()
 {
 	preview_.reset();
 
+	releaseSpareBuffers();
+
 	if (camera_acquired_)
 		camera_->release();
 	camera_acquired_ = false;
@@ -281,6 +427,7 @@ Mode RPiCamApp::selectMode(const Mode &mode) const
 void RPiCamApp::ConfigureViewfinder()
 {
 	LOG(2, "Configuring viewfinder...");
+	buffer_count_option_ = "viewfinder-buffer-count";
 
 	int lores_stream_num = 0, raw_stream_num = 0;
 	bool have_lores_stream = options_->Get().lores_width && options_->Get().lores_height;
@@ -375,6 +522,7 @@ void RPiCamApp::ConfigureViewfinder()
 void RPiCamApp::ConfigureZsl(unsigned int still_flags)
 {
 	LOG(2, "Configuring ZSL...");
+	buffer_count_option_ = "buffer-count";
 
 	StreamRoles stream_roles = { StreamRole::StillCapture, StreamRole::Viewfinder };
 	if (!options_->Get().no_raw)
@@ -445,6 +593,16 @@ void RPiCamApp::ConfigureZsl(unsigned int still_flags)
 		LOG(2, "Final viewfinder size is " << size.toString());
 	}
 
+	// There's no ISP output left over for a lores stream, so an application that wants one (and can live without
+	// a full sized preview) may ask for the viewfinder to be made lores sized and double as it.
+	bool have_lores_stream = (still_flags & FLAG_STILL_LORES_VIEWFINDER) && options_->Get().lores_width &&
+							 options_->Get().lores_height;
+	if (have_lores_stream)
+	{
+		size = Size(options_->Get().lores_width, options_->Get().lores_height).alignedDownTo(2, 2);
+		LOG(2, "Viewfinder is the lores stream, size " << size.toString());
+	}
+
 	// Now we get to override any of the default settings from the options_->Get().
 	configuration_->at(1).pixelFormat = libcamera::formats::YUV420;
 	configuration_->at(1).size = size;
@@ -459,6 +617,8 @@ void RPiCamApp::ConfigureZsl(unsigned int still_flags)
 
 	streams_["still"] = configuration_->at(0).stream();
 	streams_["viewfinder"] = configuration_->at(1).stream();
+	if (have_lores_stream)
+		streams_["lores"] = configuration_->at(1).stream();
 	if (!options_->Get().no_raw)
 		streams_["raw"] = configuration_->at(2).stream();
 
@@ -470,6 +630,7 @@ void RPiCamApp::ConfigureZsl(unsigned int still_flags)
 void RPiCamApp::ConfigureStill(unsigned int flags)
 {
 	LOG(2, "Configuring still capture...");
+	buffer_count_option_ = "buffer-count";
 
 	// Always request a raw stream as this forces the full resolution capture mode,
 	// unless the no-raw option is used.
@@ -535,6 +696,7 @@ void RPiCamApp::ConfigureStill(unsigned int flags)
 void RPiCamApp::ConfigureVideo(unsigned int flags)
 {
 	LOG(2, "Configuring video...");
+	buffer_count_option_ = "buffer-count";
 
 	bool have_lores_stream = options_->Get().lores_width && options_->Get().lores_height;
 	StreamRoles stream_roles = { StreamRole::VideoRecording };
@@ -617,19 +779,39 @@ void RPiCamApp::Teardown()
 	if (!options_->Get().help)
 		LOG(2, "Tearing down requests, buffers and configuration");
 
+	// Hold on to the buffers themselves, and their mappings, until the next configuration is set up. If it
+	// needs buffers of a similar size it gets them back, and anything that imported them, such as the preview,
+	// can keep what it made of them, which spares the CMA heap some fragmenting.
+	for (auto const &[stream, buffers] : frame_buffers_)
+	{
+		for (auto const &fb : buffers)
+		{
+			FrameBuffer::Plane const &plane = fb->planes()[0];
+			SpareBuffer spare { plane.fd };
+			auto it = mapped_buffers_.find(fb.get());
+			if (it != mapped_buffers_.end() && !it->second.planes.empty())
+			{
+				spare.mem = it->second.planes[0].data();
+				spare.mapped_size = it->second.planes[0].size();
+				it->second.planes.clear();
+			}
+			// A dma-buf reports its real size, which can be more than this configuration used of it.
+			off_t size = lseek(plane.fd.get(), 0, SEEK_END);
+			spare_buffers_.emplace(size > 0 ? size : plane.length, std::move(spare));
+		}
+	}
+	frame_buffers_.clear();
+	accountBuffers();
+
 	for (auto &iter : mapped_buffers_)
 	{
-		// assert(iter.first->planes().size() == iter.second.size());
-		// for (unsigned i = 0; i < iter.first->planes().size(); i++)
-		for (auto &span : iter.second)
+		for (auto &span : iter.second.planes)
 			munmap(span.data(), span.size());
 	}
 	mapped_buffers_.clear();
 
 	configuration_.reset();
 
-	frame_buffers_.clear();
-
 	streams_.clear();
 }
 
@@ -637,6 +819,7 @@ void RPiCamApp::StartCamera()
 {
 	// This makes all the Request objects that we shall need.
 	makeRequests();
+	accountBuffers();
 
 	// Build a list of initial controls that we must set in the camera before starting it.
 	// We don't overwrite anything the application may have set before calling us.
@@ -803,6 +986,7 @@ void RPiCamApp::StartCamera()
 	controls_.clear();
 	camera_started_ = true;
 	last_timestamp_ = 0;
+	buffer_usage_.Reset();
 
 	post_processor_.Start();
 
@@ -815,6 +999,8 @@ void RPiCamApp::StartCamera()
 	}
 
 	LOG(2, "Camera started!");
+	MemoryAccount::Report(2);
+	startupPhase("start");
 }
 
 void RPiCamApp::StopCamera()
@@ -838,7 +1024,10 @@ void RPiCamApp::StopCamera()
 
 	// An application might be holding a CompletedRequest, so queueRequest will get
 	// called to delete it later, but we need to know not to try and re-queue it.
-	completed_requests_.clear();
+	camera_epoch_++;
+
+	if (!requests_.empty())
+		reportBufferUsage(false);
 
 	msg_queue_.Clear();
 
@@ -852,12 +1041,32 @@ void RPiCamApp::StopCamera()
 
 RPiCamApp::Msg RPiCamApp::Wait()
 {
-	return msg_queue_.Wait();
+	Msg msg = msg_queue_.Wait();
+	if (msg.type == MsgType::RequestComplete)
+		startupPhase("first frame", true);
+	return msg;
+}
+
+std::optional<RPiCamApp::Msg> RPiCamApp::TryWait()
+{
+	std::optional<Msg> msg = msg_queue_.TryWait();
+	if (msg && msg->type == MsgType::RequestComplete)
+		startupPhase("first frame", true);
+	return msg;
+}
+
+int RPiCamApp::MessageFd() const
+{
+	return msg_queue_.Fd();
 }
 
-void RPiCamApp::queueRequest(CompletedRequest *completed_request)
+void RPiCamApp::queueRequest(CompletedRequest *completed_request, unsigned int epoch, bool pooled)
 {
-	BufferMap buffers(std::move(completed_request->buffers));
+	// Pooled requests stay untouched until their slot is released, which happens only after we return.
+	BufferMap heap_buffers;
+	if (!pooled)
+		heap_buffers = std::move(completed_request->buffers);
+	BufferMap const &buffers = pooled ? completed_request->buffers : heap_buffers;
 
 	// This function may run asynchronously so needs protection from the
 	// camera stopping at the same time.
@@ -865,21 +1074,13 @@ void RPiCamApp::queueRequest(CompletedRequest *completed_request)
 
 	// An application could be holding a CompletedRequest while it stops and re-starts
 	// the camera, after which we don't want to queue another request now.
-	bool request_found;
-	{
-		std::lock_guard<std::mutex> lock(completed_requests_mutex_);
-		auto it = completed_requests_.find(completed_request);
-		if (it != completed_requests_.end())
-		{
-			request_found = true;
-			completed_requests_.erase(it);
-		}
-		else
-			request_found = false;
-	}
+	bool request_found = epoch == camera_epoch_;
+	if (request_found)
+		buffer_usage_.held--;
 
 	Request *request = completed_request->request;
-	delete completed_request;
+	if (!pooled)
+		delete completed_request;
 	assert(request);
 
 	if (!camera_started_ || !request_found)
@@ -887,15 +1088,12 @@ void RPiCamApp::queueRequest(CompletedRequest *completed_request)
 
 	for (auto const &p : buffers)
 	{
-		struct dma_buf_sync dma_sync {};
-		dma_sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
-
 		auto it = mapped_buffers_.find(p.second);
 		if (it == mapped_buffers_.end())
 			throw std::runtime_error("failed to identify queue request buffer");
 
-		int ret = ::ioctl(p.second->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
-		if (ret)
+		// Only buffers the CPU actually touched need an END sync here.
+		if (it->second.coherency.ReleaseToDevice(p.second->planes()[0].fd.get()))
 			throw std::runtime_error("failed to sync dma buf on queue request");
 
 		if (request->addBuffer(p.first, p.second) < 0)
@@ -973,12 +1171,44 @@ const libcamera::CameraManager *RPiCamApp::GetCameraManager()
 
 void RPiCamApp::ShowPreview(CompletedRequestPtr &completed_request, Stream *stream)
 {
-	std::lock_guard<std::mutex> lock(preview_item_mutex_);
-	if (!preview_item_.stream)
+	// With a rate cap, skip frames that arrive before the next display slot. The slots keep to a fixed
+	// cadence, with a quarter of an interval's grace so that timestamp jitter doesn't drop the frame that
+	// lands right on one.
+	float preview_fps = options_->Get().preview_fps;
+	if (preview_fps > 0)
+	{
+		auto ts = completed_request->metadata.get(controls::SensorTimestamp);
+		if (ts)
+		{
+			int64_t interval = 1e9 / preview_fps;
+			if (*ts + interval / 4 < next_preview_ts_)
+			{
+				preview_frames_skipped_++;
+				return;
+			}
+			next_preview_ts_ = *ts >= next_preview_ts_ + interval ? *ts + interval : next_preview_ts_ + interval;
+		}
+	}
+
+	// A frame still waiting when a newer one arrives is stale, so the newer one replaces it. The displaced
+	// request is released once we've dropped the lock, which lets it go straight back to the camera.
+	PreviewItem displaced;
+	{
+		std::lock_guard<std::mutex> lock(preview_item_mutex_);
+		if (preview_item_.stream)
+		{
+			displaced = std::move(preview_item_);
+			preview_frames_dropped_++;
+			Metrics::Add(Metric::PreviewDropped);
+		}
 		preview_item_ = PreviewItem(completed_request, stream); // copy the shared_ptr here
-	else
-		preview_frames_dropped_++;
-	preview_cond_var_.notify_one();
+		preview_cond_var_.notify_one();
+	}
+}
+
+bool RPiCamApp::PreviewSupportsOverlay() const
+{
+	return preview_ && preview_->SupportsOverlay();
 }
 
 void RPiCamApp::SetControls(const ControlList &controls)
@@ -1019,46 +1249,140 @@ void RPiCamApp::setupCapture()
 	if (camera_->configure(configuration_.get()) < 0)
 		throw std::runtime_error("failed to configure streams");
 	LOG(2, "Camera streams configured");
+	startupPhase("configure");
 
 	LOG(2, "Available controls:");
 	for (auto const &[id, info] : camera_->controls())
 		LOG(2, "    " << id->name() << " : " << info.toString());
 
-	// Next allocate all the buffers we need, mmap them and store them on a free list.
+	// Next allocate all the buffers we need and store them on a free list. Buffers left over from the last
+	// configuration go first, each stream taking the smallest that are big enough without more than a quarter
+	// of them going to waste. Spares that nothing wanted are freed once we're done, or sooner if we run out of
+	// memory, so that they don't keep CMA from the encoder, the preview or anyone else.
+
+	auto add_buffer = [this](std::vector<std::unique_ptr<FrameBuffer>> &fb, SpareBuffer const &buffer,
+							 unsigned int size) {
+		std::vector<FrameBuffer::Plane> plane(1);
+		plane[0].fd = buffer.fd;
+		plane[0].offset = 0;
+		plane[0].length = size;
+
+		fb.push_back(std::make_unique<FrameBuffer>(plane));
+		// Mapping is left until the CPU first touches the buffer; many are only ever passed on by fd. A spare
+		// that was mapped at exactly this size keeps its mapping.
+		MappedBuffer &mapped = mapped_buffers_[fb.back().get()];
+		if (buffer.mem && buffer.mapped_size == size)
+			mapped.planes.push_back(libcamera::Span<uint8_t>(static_cast<uint8_t *>(buffer.mem), size));
+		else if (buffer.mem)
+			munmap(buffer.mem, buffer.mapped_size);
+	};
+
+	unsigned int reused = 0, allocated = 0;
+	for (StreamConfiguration &config : *configuration_)
+	{
+		std::vector<std::unique_ptr<FrameBuffer>> &fb = frame_buffers_[config.stream()];
+		for (auto it = spare_buffers_.lower_bound(config.frameSize);
+			 it != spare_buffers_.end() && it->first <= config.frameSize + config.frameSize / 4 &&
+			 fb.size() < config.bufferCount;
+			 it = spare_buffers_.erase(it), reused++)
+			add_buffer(fb, it->second, config.frameSize);
+	}
 
 	for (StreamConfiguration &config : *configuration_)
 	{
-		Stream *stream = config.stream();
-		std::vector<std::unique_ptr<FrameBuffer>> fb;
+		std::vector<std::unique_ptr<FrameBuffer>> &fb = frame_buffers_[config.stream()];
 
-		for (unsigned int i = 0; i < config.bufferCount; i++)
+		for (unsigned int i = fb.size(); i < config.bufferCount; i++)
 		{
 			std::string name("rpicam-apps" + std::to_string(i));
 			libcamera::UniqueFD fd = dma_heap_.alloc(name.c_str(), config.frameSize);
+			if (!fd.isValid() && !spare_buffers_.empty())
+			{
+				LOG(2, "Buffer allocation failed, freeing " << spare_buffers_.size() << " spare buffers");
+				releaseSpareBuffers();
+				fd = dma_heap_.alloc(name.c_str(), config.frameSize);
+			}
 
 			if (!fd.isValid())
+			{
+				LOG_ERROR("Failed to allocate buffer " << i + 1 << " of " << config.bufferCount << " for "
+													   << config.toString());
+				MemoryAccount::Report(1);
 				throw std::runtime_error("failed to allocate capture buffers for stream");
+			}
 
-			std::vector<FrameBuffer::Plane> plane(1);
-			plane[0].fd = libcamera::SharedFD(std::move(fd));
-			plane[0].offset = 0;
-			plane[0].length = config.frameSize;
-
-			fb.push_back(std::make_unique<FrameBuffer>(plane));
-			void *memory = mmap(NULL, config.frameSize, PROT_READ | PROT_WRITE, MAP_SHARED, plane[0].fd.get(), 0);
-			mapped_buffers_[fb.back().get()].push_back(
-						libcamera::Span<uint8_t>(static_cast<uint8_t *>(memory), config.frameSize));
+			add_buffer(fb, SpareBuffer { libcamera::SharedFD(std::move(fd)) }, config.frameSize);
+			allocated++;
 		}
-
-		frame_buffers_[stream] = std::move(fb);
 	}
-	LOG(2, "Buffers allocated and mapped");
+	LOG(2, "Buffers allocated (" << allocated << " new, " << reused << " reused, " << spare_buffers_.size()
+								 << " spare freed)");
+	releaseSpareBuffers();
 
 	startPreview();
 
 	// The requests will be made when StartCamera() is called.
 }
 
+void RPiCamApp::releaseSpareBuffers()
+{
+	for (auto const &[size, spare] : spare_buffers_)
+	{
+		if (spare.mem)
+			munmap(spare.mem, spare.mapped_size);
+	}
+	spare_buffers_.clear();
+	accountBuffers();
+}
+
+// Tell the MemoryAccount what each stream's buffers, and the spares, come to. A stream known by two names,
+// such as a still capture's viewfinder doubling as its lores, only counts under the first.
+
+void RPiCamApp::accountBuffers()
+{
+	unsigned int camera = options_->Get().camera;
+	std::set<Stream *> counted;
+	for (auto const &[name, stream] : streams_)
+	{
+		if (!counted.insert(stream).second)
+			continue;
+		uint64_t bytes = 0;
+		unsigned int count = 0;
+		auto it = frame_buffers_.find(stream);
+		if (it != frame_buffers_.end())
+		{
+			for (auto const &fb : it->second)
+			{
+				off_t size = lseek(fb->planes()[0].fd.get(), 0, SEEK_END);
+				bytes += size > 0 ? size : fb->planes()[0].length;
+				count++;
+			}
+		}
+		MemoryAccount::Set(camera, "stream." + name, MemoryPool::Dma, bytes, count);
+	}
+
+	uint64_t spare = 0;
+	for (auto const &[size, buffer] : spare_buffers_)
+		spare += size;
+	MemoryAccount::Set(camera, "stream.spare", MemoryPool::Dma, spare, spare_buffers_.size());
+}
+
+bool RPiCamApp::mapBuffer(MappedBuffer &mapped, FrameBuffer *fb)
+{
+	// Once made, the mapping lasts until Teardown, so callers can use the planes without the lock.
+	std::lock_guard<std::mutex> lock(mapped.mmap_mutex);
+	if (!mapped.planes.empty())
+		return true;
+
+	FrameBuffer::Plane const &plane = fb->planes()[0];
+	void *memory = mmap(NULL, plane.length, PROT_READ | PROT_WRITE, MAP_SHARED, plane.fd.get(), 0);
+	if (memory == MAP_FAILED)
+		return false;
+
+	mapped.planes.push_back(libcamera::Span<uint8_t>(static_cast<uint8_t *>(memory), plane.length));
+	return true;
+}
+
 void RPiCamApp::makeRequests()
 {
 	std::map<Stream *, std::queue<FrameBuffer *>> free_buffers;
@@ -1082,10 +1406,13 @@ void RPiCamApp::makeRequests()
 					LOG(2, "Requests created");
 					return;
 				}
-				std::unique_ptr<Request> request = camera_->createRequest();
+				// The cookie tells requestComplete which slot to recycle.
+				std::unique_ptr<Request> request = camera_->createRequest(requests_.size());
 				if (!request)
 					throw std::runtime_error("failed to make request");
 				requests_.push_back(std::move(request));
+				if (request_slots_.size() < requests_.size())
+					request_slots_.push_back(std::make_unique<CompletedRequestSlot>());
 			}
 			else if (free_buffers[stream].empty())
 				throw std::runtime_error("concurrent streams need matching numbers of buffers");
@@ -1110,44 +1437,125 @@ void RPiCamApp::requestComplete(Request *request)
 		return;
 	}
 
-	struct dma_buf_sync dma_sync {};
-	dma_sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+	// Rather than syncing every buffer for the CPU now, just note that its caches are stale. The sync
+	// happens on the first BufferReadSync or BufferWriteSync, so buffers that only get passed on by fd
+	// are never synced.
 	for (auto const &buffer_map : request->buffers())
 	{
 		auto it = mapped_buffers_.find(buffer_map.second);
 		if (it == mapped_buffers_.end())
 			throw std::runtime_error("failed to identify request complete buffer");
 
-		int ret = ::ioctl(buffer_map.second->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
-		if (ret)
-			throw std::runtime_error("failed to sync dma buf on request complete");
+		it->second.coherency.DeviceWritten();
 	}
 
-	CompletedRequest *r = new CompletedRequest(sequence_++, request);
-	CompletedRequestPtr payload(r, [this](CompletedRequest *cr) { this->queueRequest(cr); });
+	// Normally the request's own slot is free by the time it completes again. The exception is when
+	// the application still holds it from before a camera restart, or the last reference is only just
+	// being dropped, in which case we fall back to the heap.
+	CompletedRequest *r;
+	CompletedRequestPtr payload;
+	unsigned int epoch = camera_epoch_;
+	uint64_t index = request->cookie();
+	CompletedRequestSlot *slot = index < request_slots_.size() ? request_slots_[index].get() : nullptr;
+	if (slot && !slot->in_use.exchange(true, std::memory_order_acquire))
 	{
-		std::lock_guard<std::mutex> lock(completed_requests_mutex_);
-		completed_requests_.insert(r);
+		r = &slot->completed_request;
+		r->Reset(sequence_++, request);
+		r->camera = options_->Get().camera;
+		payload = CompletedRequestPtr(
+			r, [this, epoch](CompletedRequest *cr) { this->queueRequest(cr, epoch, true); },
+			CompletedRequestSlotAllocator<CompletedRequest>(slot));
+	}
+	else
+	{
+		r = new CompletedRequest(sequence_++, request);
+		r->camera = options_->Get().camera;
+		payload = CompletedRequestPtr(r, [this, epoch](CompletedRequest *cr) { this->queueRequest(cr, epoch, false); });
 	}
 
+	unsigned int held = ++buffer_usage_.held;
+
 	// Framebuffer reports possibly being in a startup or error state, ignore these.
 	if (r->buffers.begin()->second->metadata().status != libcamera::FrameMetadata::FrameSuccess)
+	{
+		Metrics::Add(Metric::FramesFailed);
 		return;
+	}
 
 	// We calculate the instantaneous framerate in case anyone wants it.
 	// Use the sensor timestamp if possible as it ought to be less glitchy than
 	// the buffer timestamps.
 	auto ts = payload->metadata.get(controls::SensorTimestamp);
 	uint64_t timestamp = ts ? *ts : payload->buffers.begin()->second->metadata().timestamp;
+	Trace::EventAt(TraceHop::Sensor, r->sequence, Trace::NO_TIMESTAMP, timestamp);
+	noteBufferUsage(held, timestamp, payload->metadata.get(controls::FrameDuration));
+	Trace::Event(TraceHop::RequestComplete, r->sequence);
 	if (last_timestamp_ == 0 || last_timestamp_ == timestamp)
 		payload->framerate = 0;
 	else
 		payload->framerate = 1e9 / (timestamp - last_timestamp_);
 	last_timestamp_ = timestamp;
+	Metrics::Add(Metric::FramesCaptured);
+	Metrics::Set(Metric::Framerate, payload->framerate * 1000);
 
 	post_processor_.Process(payload); // post-processor can re-use our shared_ptr
 }
 
+void RPiCamApp::noteBufferUsage(unsigned int held, uint64_t timestamp, std::optional<int64_t> frame_duration)
+{
+	BufferUsage &u = buffer_usage_;
+	u.peak = std::max(u.peak, held);
+	if (held >= requests_.size())
+		u.starved++;
+	// A gap of more than one and a half frame durations between sensor timestamps means frames were lost.
+	if (last_timestamp_ && frame_duration && *frame_duration > 0 && timestamp > last_timestamp_)
+	{
+		uint64_t duration = *frame_duration * 1000;
+		uint64_t interval = timestamp - last_timestamp_;
+		if (interval > duration * 3 / 2)
+			u.lost += (interval + duration / 2) / duration - 1;
+	}
+
+	if (u.warmup_done)
+		return;
+	if (!u.first_timestamp)
+		u.first_timestamp = timestamp;
+	u.warmup_peak = u.peak;
+	if (timestamp - u.first_timestamp >= BUFFER_WARMUP_NS)
+	{
+		u.warmup_done = true;
+		reportBufferUsage(true);
+	}
+}
+
+void RPiCamApp::reportBufferUsage(bool warmup)
+{
+	BufferUsage const &u = buffer_usage_;
+	unsigned int count = requests_.size();
+	if (GetVerbosity() < 2 || !count || !configuration_)
+		return;
+
+	// On top of what the application holds, the sensor needs one buffer to fill and one more queued behind
+	// it to ride out any jitter. If the camera ever ran dry we only know that more were needed.
+	unsigned int peak = warmup ? u.warmup_peak : u.peak;
+	unsigned int recommended = peak + 2;
+	size_t request_size = 0;
+	for (StreamConfiguration const &config : *configuration_)
+		request_size += config.frameSize;
+
+	std::stringstream ss;
+	ss << "Buffer usage " << (warmup ? "after warm-up" : "over the run") << ": " << count << " buffers, at most "
+	   << peak << " held by the application";
+	if (u.starved)
+		ss << ", camera ran out " << u.starved << " times";
+	if (u.lost)
+		ss << ", " << u.lost << " frames lost";
+	ss << "; recommend --" << buffer_count_option_ << " " << recommended;
+	if (recommended < count)
+		ss << " (saving " << (count - recommended) * request_size / (1024 * 1024) << "MB)";
+	LOG(2, ss.str());
+}
+
 void RPiCamApp::previewDoneCallback(int fd)
 {
 	std::lock_guard<std::mutex> lock(preview_mutex_);
@@ -1160,6 +1568,7 @@ void RPiCamApp::previewDoneCallback(int fd)
 void RPiCamApp::startPreview()
 {
 	preview_abort_ = false;
+	next_preview_ts_ = 0;
 	preview_thread_ = std::thread(&RPiCamApp::previewThread, this);
 }
 
@@ -1180,6 +1589,12 @@ void RPiCamApp::stopPreview()
 
 void RPiCamApp::previewThread()
 {
+	ThreadConfig::Apply("preview");
+
+	InfoTextFormat info_format;
+	std::string info_text;
+	std::chrono::steady_clock::time_point info_time;
+
 	while (true)
 	{
 		PreviewItem item;
@@ -1205,8 +1620,21 @@ void RPiCamApp::previewThread()
 		BufferReadSync r(this, buffer);
 		libcamera::Span span = r.Get()[0];
 
-		// Fill the frame info with the ControlList items and ancillary bits.
-		FrameInfo frame_info(item.completed_request);
+		// Fill the frame info with the ControlList items and ancillary bits, when the info text is due.
+		std::optional<FrameInfo> frame_info;
+		auto now = std::chrono::steady_clock::now();
+		if (!options_->Get().info_text.empty() && now - info_time >= INFO_TEXT_INTERVAL)
+		{
+			frame_info.emplace(item.completed_request);
+			info_time = now;
+		}
+
+		if (preview_->SupportsOverlay())
+		{
+			Overlay overlay;
+			item.completed_request->post_process_metadata.Get(PREVIEW_OVERLAY, overlay);
+			preview_->SetOverlay(overlay);
+		}
 
 		int fd = buffer->planes()[0].fd.get();
 		{
@@ -1220,11 +1648,14 @@ void RPiCamApp::previewThread()
 			msg_queue_.Post(Msg(MsgType::Quit));
 		}
 		preview_frames_displayed_++;
+		Metrics::Add(Metric::PreviewDisplayed);
 		preview_->Show(fd, span, info);
-		if (!options_->Get().info_text.empty())
+		if (frame_info)
 		{
-			std::string s = frame_info.ToString(options_->Get().info_text);
-			preview_->SetInfoText(s);
+			if (info_format.Format() != options_->Get().info_text)
+				info_format.Set(options_->Get().info_text);
+			info_format.Render(*frame_info, info_text);
+			preview_->SetInfoText(info_text);
 		}
 	}
 }
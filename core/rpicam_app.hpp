@@ -7,12 +7,17 @@
 
 #pragma once
 
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
+#include <chrono>
 #include <condition_variable>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <queue>
 #include <set>
 #include <sstream>
@@ -33,6 +38,7 @@
 #include "core/buffer_sync.hpp"
 #include "core/completed_request.hpp"
 #include "core/dma_heaps.hpp"
+#include "core/lockfree_queue.hpp"
 #include "core/post_processor.hpp"
 #include "core/stream_info.hpp"
 
@@ -120,6 +126,7 @@ public:
 	static constexpr unsigned int FLAG_STILL_DOUBLE_BUFFER = 32; // double-buffer stream
 	static constexpr unsigned int FLAG_STILL_TRIPLE_BUFFER = 64; // triple-buffer stream
 	static constexpr unsigned int FLAG_STILL_BUFFER_MASK = 96; // mask for buffer flags
+	static constexpr unsigned int FLAG_STILL_LORES_VIEWFINDER = 128; // ZSL: lores-sized viewfinder doubles as lores
 
 	static constexpr unsigned int FLAG_VIDEO_NONE = 0;
 	static constexpr unsigned int FLAG_VIDEO_RAW = 1; // request raw image stream
@@ -145,6 +152,10 @@ public:
 	void StopCamera();
 
 	Msg Wait();
+	// For applications that multiplex the camera with other inputs: MessageFd() polls readable
+	// whenever a message may be waiting, and TryWait() returns one without blocking.
+	std::optional<Msg> TryWait();
+	int MessageFd() const;
 	void PostMessage(MsgType &t, MsgPayload &p);
 
 	Stream *GetStream(std::string const &name, StreamInfo *info = nullptr) const;
@@ -162,6 +173,8 @@ public:
 	}
 
 	void ShowPreview(CompletedRequestPtr &completed_request, Stream *stream);
+	// Whether annotations given as a PREVIEW_OVERLAY will be drawn by the preview window.
+	bool PreviewSupportsOverlay() const;
 
 	void SetControls(const ControlList &controls);
 	StreamInfo GetStreamInfo(Stream const *stream) const;
@@ -186,6 +199,7 @@ public:
 
 	friend class BufferWriteSync;
 	friend class BufferReadSync;
+	friend class FrameSource;
 	friend class PostProcessor;
 	friend struct OptsInternal;
 
@@ -193,35 +207,66 @@ protected:
 	std::unique_ptr<Options> options_;
 
 private:
+	// Messages are passed through a lock-free ring so that the libcamera and post-processing threads never
+	// block on the application thread. An eventfd wakes the application when it is waiting on an empty queue.
 	template <typename T>
 	class MessageQueue
 	{
 	public:
+		MessageQueue() : event_fd_(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+		{
+			if (event_fd_ < 0)
+				throw std::runtime_error("failed to create message queue eventfd");
+		}
+		~MessageQueue() { close(event_fd_); }
 		template <typename U>
 		void Post(U &&msg)
 		{
-			std::unique_lock<std::mutex> lock(mutex_);
-			queue_.push(std::forward<U>(msg));
-			cond_.notify_one();
+			// The queue is sized well beyond the number of requests that can be in flight, so it filling
+			// up means the application has stopped reading. Wait for it rather than lose the message.
+			while (!queue_.Push(std::forward<U>(msg)))
+				std::this_thread::yield();
+			uint64_t one = 1;
+			[[maybe_unused]] ssize_t ret = write(event_fd_, &one, sizeof(one));
 		}
 		T Wait()
 		{
-			std::unique_lock<std::mutex> lock(mutex_);
-			cond_.wait(lock, [this] { return !queue_.empty(); });
-			T msg = std::move(queue_.front());
-			queue_.pop();
-			return msg;
+			while (true)
+			{
+				std::optional<T> msg = queue_.Pop();
+				if (msg)
+					return std::move(*msg);
+				struct pollfd pfd = { event_fd_, POLLIN, 0 };
+				poll(&pfd, 1, -1);
+				clearEvent();
+			}
+		}
+		std::optional<T> TryWait()
+		{
+			std::optional<T> msg = queue_.Pop();
+			if (msg)
+				return msg;
+			// Reset the eventfd before looking again, so that a Post racing with us still leaves it readable.
+			clearEvent();
+			return queue_.Pop();
 		}
+		int Fd() const { return event_fd_; }
 		void Clear()
 		{
-			std::unique_lock<std::mutex> lock(mutex_);
-			queue_ = {};
+			while (queue_.Pop())
+				;
 		}
 
 	private:
-		std::queue<T> queue_;
-		std::mutex mutex_;
-		std::condition_variable cond_;
+		void clearEvent()
+		{
+			uint64_t count;
+			[[maybe_unused]] ssize_t ret = read(event_fd_, &count, sizeof(count));
+		}
+
+		static constexpr size_t QUEUE_SIZE = 128;
+		LockFreeQueue<T, QUEUE_SIZE> queue_;
+		int event_fd_;
 	};
 	struct PreviewItem
 	{
@@ -237,11 +282,21 @@ private:
 		CompletedRequestPtr completed_request;
 		Stream *stream;
 	};
+	struct MappedBuffer
+	{
+		// Empty until the CPU first asks for the buffer, see mapBuffer().
+		std::vector<libcamera::Span<uint8_t>> planes;
+		std::mutex mmap_mutex;
+		BufferCoherency coherency;
+	};
 
 	void initCameraManager();
 	void setupCapture();
+	void releaseSpareBuffers();
+	void accountBuffers();
 	void makeRequests();
-	void queueRequest(CompletedRequest *completed_request);
+	bool mapBuffer(MappedBuffer &mapped, FrameBuffer *fb);
+	void queueRequest(CompletedRequest *completed_request, unsigned int epoch, bool pooled);
 	void requestComplete(Request *request);
 	void previewDoneCallback(int fd);
 	void startPreview();
@@ -249,22 +304,64 @@ private:
 	void previewThread();
 	void configureDenoise(const std::string &denoise_mode);
 	Mode selectMode(const Mode &mode) const;
+	void enumerateSensorModes();
+	void startupPhase(char const *name, bool done = false);
+	void noteBufferUsage(unsigned int held, uint64_t timestamp, std::optional<int64_t> frame_duration);
+	void reportBufferUsage(bool warmup);
 
-	std::unique_ptr<CameraManager> camera_manager_;
+	std::shared_ptr<CameraManager> camera_manager_;
 	std::shared_ptr<Camera> camera_;
 	bool camera_acquired_ = false;
 	std::unique_ptr<CameraConfiguration> configuration_;
-	std::map<FrameBuffer *, std::vector<libcamera::Span<uint8_t>>> mapped_buffers_;
+	std::map<FrameBuffer *, MappedBuffer> mapped_buffers_;
 	std::map<std::string, Stream *> streams_;
 	DmaHeap dma_heap_;
 	std::map<Stream *, std::vector<std::unique_ptr<FrameBuffer>>> frame_buffers_;
+	// Buffers kept back by Teardown, by allocated size, which later configurations take first. They keep
+	// their mappings too, if the CPU ever touched them.
+	struct SpareBuffer
+	{
+		libcamera::SharedFD fd;
+		void *mem = nullptr;
+		size_t mapped_size = 0;
+	};
+	std::multimap<size_t, SpareBuffer> spare_buffers_;
 	std::vector<std::unique_ptr<Request>> requests_;
-	std::mutex completed_requests_mutex_;
-	std::set<CompletedRequest *> completed_requests_;
+	// One slot per request, indexed by the request's cookie. Never shrinks, as the application may
+	// still hold a CompletedRequestPtr into it after the camera has stopped.
+	std::vector<std::unique_ptr<CompletedRequestSlot>> request_slots_;
+	// Bumped every time the camera stops, so that requests completed before then don't get re-queued.
+	std::atomic<unsigned int> camera_epoch_ { 0 };
 	bool camera_started_ = false;
 	std::mutex camera_stop_mutex_;
 	MessageQueue<Msg> msg_queue_;
 	std::vector<SensorMode> sensor_modes_;
+	// How long each step took from construction up to the first completed request, reported once at -v 2.
+	std::chrono::steady_clock::time_point startup_mark_ = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point startup_begin_ = startup_mark_;
+	std::string startup_timing_;
+	bool startup_reported_ = false;
+	// How many of the requests the application holds at once, so that at -v 2 we can say how many buffers
+	// it really needs, first after a warm-up period and again when the camera stops.
+	struct BufferUsage
+	{
+		void Reset()
+		{
+			held = 0;
+			peak = warmup_peak = starved = lost = 0;
+			first_timestamp = 0;
+			warmup_done = false;
+		}
+		std::atomic<unsigned int> held { 0 };
+		unsigned int peak = 0;
+		unsigned int warmup_peak = 0;
+		unsigned int starved = 0; // completions that left the camera with nothing queued
+		unsigned int lost = 0; // frames missing from the sensor timestamps
+		uint64_t first_timestamp = 0;
+		bool warmup_done = false;
+	};
+	BufferUsage buffer_usage_;
+	char const *buffer_count_option_ = "buffer-count";
 	// Related to the preview window.
 	std::unique_ptr<Preview> preview_;
 	std::map<int, CompletedRequestPtr> preview_completed_requests_;
@@ -275,6 +372,8 @@ private:
 	bool preview_abort_ = false;
 	uint32_t preview_frames_displayed_ = 0;
 	uint32_t preview_frames_dropped_ = 0;
+	uint32_t preview_frames_skipped_ = 0;
+	int64_t next_preview_ts_ = 0; // for --preview-fps, in sensor timestamp nanoseconds
 	std::thread preview_thread_;
 	// For setting camera controls.
 	std::mutex control_mutex_;
@@ -7,14 +7,21 @@
 
 #pragma once
 
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "core/metrics.hpp"
 #include "core/rpicam_app.hpp"
+#include "core/sidecar.hpp"
 #include "core/stream_info.hpp"
+#include "core/trace.hpp"
 #include "core/video_options.hpp"
 
 #include "encoder/encoder.hpp"
 
 typedef std::function<void(void *, size_t, int64_t, bool)> EncodeOutputReadyCallback;
-typedef std::function<void(libcamera::ControlList &)> MetadataReadyCallback;
+typedef std::function<void(FrameMetadata const &, SidecarValues const &)> MetadataReadyCallback;
 
 class RPiCamEncoder : public RPiCamApp
 {
@@ -23,12 +30,15 @@ public:
 	using FrameBuffer = libcamera::FrameBuffer;
 
 	RPiCamEncoder() : RPiCamApp(std::make_unique<VideoOptions>()) {}
+	RPiCamEncoder(std::unique_ptr<VideoOptions> opts) : RPiCamApp(std::move(opts)) {}
 
 	void StartEncoder()
 	{
 		createEncoder();
-		encoder_->SetInputDoneCallback(std::bind(&RPiCamEncoder::encodeBufferDone, this, std::placeholders::_1));
+		encoder_->SetInputDoneCallback(
+			std::bind(&RPiCamEncoder::encodeBufferDone, this, std::ref(encode_queue_), true, std::placeholders::_1));
 		encoder_->SetOutputReadyCallback(encode_output_ready_callback_);
+		encoder_->SetControls(controls_);
 
 #ifndef DISABLE_RPI_FEATURES
 		// Set up the encode function to wait for synchronisation with another camera system,
@@ -47,6 +57,25 @@ public:
 	// This is callback when the encoder gives you the encoded output data.
 	void SetEncodeOutputReadyCallback(EncodeOutputReadyCallback callback) { encode_output_ready_callback_ = callback; }
 	void SetMetadataReadyCallback(MetadataReadyCallback callback) { metadata_ready_callback_ = callback; }
+	// Change the video encoder's settings while it runs. The output gets these too (see Output::SetEncoderControls).
+	std::shared_ptr<EncoderControls> GetEncoderControls() const { return controls_; }
+	// Encode another stream (such as lores) at the same time as the video stream, using its own encoder
+	// created from the given options, which must outlive it. Call this once the camera is configured.
+	void AddEncoder(Stream *stream, VideoOptions *options, EncodeOutputReadyCallback callback)
+	{
+		StreamInfo info = GetStreamInfo(stream);
+		if (!stream || !info.width || !info.height || !info.stride)
+			throw std::runtime_error("stream for extra encoder is not configured");
+		auto extra = std::make_unique<ExtraEncoder>();
+		extra->stream = stream;
+		extra->encoder = std::unique_ptr<Encoder>(Encoder::Create(options, info));
+		extra->encoder->SetInputDoneCallback(
+			std::bind(&RPiCamEncoder::encodeBufferDone, this, std::ref(extra->queue), false, std::placeholders::_1));
+		extra->encoder->SetOutputReadyCallback(callback);
+		extra_encoders_.push_back(std::move(extra));
+	}
+	// Encode the buffer for this stream, using the extra encoder for it if there is one, otherwise the
+	// main one. Each encoder holds its own reference to the completed request until it's done.
 	bool EncodeBuffer(CompletedRequestPtr &completed_request, Stream *stream)
 	{
 		assert(encoder_);
@@ -64,26 +93,21 @@ public:
 		sync_achieved_ = true;
 #endif
 
-		StreamInfo info = GetStreamInfo(stream);
-		FrameBuffer *buffer = completed_request->buffers[stream];
-		BufferReadSync r(this, buffer);
-		libcamera::Span span = r.Get()[0];
-		void *mem = span.data();
-		if (!buffer || !mem)
-			throw std::runtime_error("no buffer to encode");
-		auto ts = completed_request->metadata.get(controls::FrameWallClock);
-		int64_t timestamp_ns = ts ? *ts : buffer->metadata().timestamp;
+		for (auto &extra : extra_encoders_)
 		{
-			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			encode_buffer_queue_.push(completed_request); // creates a new reference
+			if (extra->stream == stream)
+				return encodeBuffer(extra->encoder.get(), extra->queue, completed_request, stream);
 		}
-		encoder_->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_ns / 1000);
-
-		// Tell our caller that encoding is underway.
-		return true;
+		return encodeBuffer(encoder_.get(), encode_queue_, completed_request, stream);
 	}
 	VideoOptions *GetOptions() const { return static_cast<VideoOptions *>(RPiCamApp::GetOptions()); }
-	void StopEncoder() { encoder_.reset(); }
+	// Frames dropped so far because the encoder could not keep up.
+	uint64_t DroppedFrames() const { return encoder_ ? encoder_->DroppedFrames() : 0; }
+	void StopEncoder()
+	{
+		encoder_.reset();
+		extra_encoders_.clear();
+	}
 
 protected:
 	virtual void createEncoder()
@@ -95,9 +119,58 @@ protected:
 		encoder_ = std::unique_ptr<Encoder>(Encoder::Create(GetOptions(), info));
 	}
 	std::unique_ptr<Encoder> encoder_;
+	std::shared_ptr<EncoderControls> controls_ = std::make_shared<EncoderControls>();
 
 private:
-	void encodeBufferDone(void *mem)
+	// The completed requests that an encoder is still using, in the order it was given them.
+	struct EncodeQueue
+	{
+		std::deque<CompletedRequestPtr> requests;
+		std::mutex mutex;
+	};
+
+	struct ExtraEncoder
+	{
+		Stream *stream;
+		std::unique_ptr<Encoder> encoder;
+		EncodeQueue queue;
+	};
+
+	bool encodeBuffer(Encoder *encoder, EncodeQueue &queue, CompletedRequestPtr &completed_request, Stream *stream)
+	{
+		StreamInfo info = GetStreamInfo(stream);
+		FrameBuffer *buffer = completed_request->buffers[stream];
+		BufferReadSync r(this, buffer);
+		libcamera::Span span = r.Get()[0];
+		void *mem = span.data();
+		if (!buffer || !mem)
+			throw std::runtime_error("no buffer to encode");
+		auto ts = completed_request->metadata.get(controls::FrameWallClock);
+		int64_t timestamp_ns = ts ? *ts : buffer->metadata().timestamp;
+		{
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.requests.push_back(completed_request); // creates a new reference
+			Metrics::Add(Metric::EncoderQueueDepth);
+		}
+		Trace::Event(TraceHop::EncodeQueued, completed_request->sequence, timestamp_ns / 1000);
+		if (!encoder->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_ns / 1000))
+		{
+			// The encoder was overloaded and dropped the frame, so let go of it straight away. Other
+			// frames only get taken off the front of the queue, so ours is still at the back.
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.requests.pop_back();
+			Metrics::Add(Metric::EncoderQueueDepth, -1);
+			Metrics::Add(Metric::EncoderDropped);
+			LOG(2, "Encoder overloaded, dropped frame " << completed_request->sequence << " ("
+														<< encoder->DroppedFrames() << " so far)");
+		}
+
+		// Tell our caller that encoding is underway (even if this frame was dropped,
+		// we don't want the caller to think it is still waiting to start).
+		return true;
+	}
+
+	void encodeBufferDone(EncodeQueue &queue, bool metadata, void *mem)
 	{
 		// If non-NULL, mem would indicate which buffer has been completed, but
 		// currently we're just assuming everything is done in order. (We could
@@ -105,18 +178,24 @@ private:
 		// pairs.)
 		assert(mem == nullptr);
 		{
-			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			if (encode_buffer_queue_.empty())
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (queue.requests.empty())
 				throw std::runtime_error("no buffer available to return");
-			CompletedRequestPtr &completed_request = encode_buffer_queue_.front();
-			if (metadata_ready_callback_ && !GetOptions()->Get().metadata.empty())
-				metadata_ready_callback_(completed_request->metadata);
-			encode_buffer_queue_.pop(); // drop shared_ptr reference
+			CompletedRequestPtr &completed_request = queue.requests.front();
+			Trace::Event(TraceHop::EncodeInputDone, completed_request->sequence);
+			if (metadata && metadata_ready_callback_ && !GetOptions()->Get().metadata.empty())
+			{
+				SidecarValues extra;
+				completed_request->post_process_metadata.Get(SIDECAR_VALUES, extra);
+				metadata_ready_callback_(completed_request->metadata, extra);
+			}
+			queue.requests.pop_front(); // drop shared_ptr reference
+			Metrics::Add(Metric::EncoderQueueDepth, -1);
 		}
 	}
 
-	std::queue<CompletedRequestPtr> encode_buffer_queue_;
-	std::mutex encode_buffer_queue_mutex_;
+	EncodeQueue encode_queue_;
+	std::vector<std::unique_ptr<ExtraEncoder>> extra_encoders_;
 	EncodeOutputReadyCallback encode_output_ready_callback_;
 	MetadataReadyCallback metadata_ready_callback_;
 	bool sync_achieved_ = false;
@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * sidecar.hpp - values that stages add to the per-frame metadata file
+ */
+
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "core/metadata.hpp"
+
+// Stages can add values of their own to what --metadata writes for each frame. Each is a name and a
+// value already formatted as JSON (a number, a quoted string or an array), which the "json" and "txt"
+// formats write after the camera's own metadata. The fixed size "bin" records have no room for them.
+
+using SidecarValues = std::vector<std::pair<std::string, std::string>>;
+
+inline const MetadataKey<SidecarValues> SIDECAR_VALUES("sidecar.values");
+
+// Add a value to any that other stages have already put in the metadata.
+inline void AppendSidecar(Metadata &metadata, std::string const &name, std::string value)
+{
+	std::scoped_lock lock(metadata);
+	SidecarValues *values = metadata.GetLocked(SIDECAR_VALUES);
+	if (!values)
+		metadata.SetLocked(SIDECAR_VALUES, SidecarValues { { name, std::move(value) } });
+	else
+		values->emplace_back(name, std::move(value));
+}
@@ -30,8 +30,18 @@ struct StillOptions : public Options
 			 "Use date format for output file names")
 			("timestamp", value<bool>(&v_->timestamp)->default_value(false)->implicit_value(true),
 			 "Use system timestamps for output file names")
+			("jpeg-fast-dct", value<bool>(&v_->jpeg_fast_dct)->default_value(false)->implicit_value(true),
+			 "Use the faster, slightly less accurate, integer DCT for JPEG encoding")
+			("jpeg-optimize", value<bool>(&v_->jpeg_optimize)->default_value(false)->implicit_value(true),
+			 "Compute optimal Huffman tables for each JPEG, for smaller files at the cost of a slower encode")
 			("restart", value<unsigned int>(&v_->restart)->default_value(0),
 			 "Set JPEG restart interval")
+			("jpeg-threads", value<unsigned int>(&v_->jpeg_threads)->default_value(1),
+			 "Encode JPEGs as this many strips in parallel, using restart markers to join them. 0 uses every core")
+			("png-level", value<unsigned int>(&v_->png_level)->default_value(1),
+			 "Set the PNG (zlib) compression level, 0 to 9")
+			("png-threads", value<unsigned int>(&v_->png_threads)->default_value(1),
+			 "Compress PNGs as this many strips in parallel. 0 uses every core")
 			("keypress,k", value<bool>(&v_->keypress)->default_value(false)->implicit_value(true),
 			 "Perform capture when ENTER pressed")
 			("signal,s", value<bool>(&v_->signal)->default_value(false)->implicit_value(true),
@@ -40,6 +50,9 @@ struct StillOptions : public Options
 			 "Set thumbnail parameters as width:height:quality, or none")
 			("encoding,e", value<std::string>(&v_->encoding)->default_value("jpg"),
 			 "Set the desired output encoding, either jpg, png, rgb/rgb24, rgb48, bmp or yuv420")
+			("keep-stride", value<bool>(&v_->keep_stride)->default_value(false)->implicit_value(true),
+			 "With the rgb and yuv420 encodings, write the image buffer as it is, including any padding at the end "
+			 "of each row, and describe its layout in a .hdr file alongside")
 			("raw,r", value<bool>(&v_->raw)->default_value(false)->implicit_value(true),
 			 "Also save raw file in DNG format")
 			("latest", value<std::string>(&v_->latest),
@@ -50,6 +63,16 @@ struct StillOptions : public Options
 			 "Switch to AfModeAuto and trigger a scan just before capturing a still")
 			("zsl", value<bool>(&v_->zsl)->default_value(false)->implicit_value(true),
 			 "Use the capture mode for preview in order to reduce the shutter lag for the final capture")
+			("zsl-select", value<unsigned int>(&v_->zsl_select)->default_value(0),
+			 "With --zsl, capture the best of this many of the most recent frames, rather than the next one")
+			("zsl-metric", value<std::string>(&v_->zsl_metric)->default_value("focus"),
+			 "How --zsl-select judges the frames: focus (the focus figure of merit), sharpness (the sobel_cv "
+			 "edge energy) or motion (the least motion_detect activity)")
+			("burst", value<unsigned int>(&v_->burst)->default_value(1),
+			 "Capture this many stills at the full frame rate, holding them all in memory until the last is taken "
+			 "and only then saving them. The output file name needs a frame number such as %03d")
+			("save-queue", value<unsigned int>(&v_->save_queue)->default_value(0),
+			 "Encode and write images on a background thread, allowing this many to be pending. 0 saves each image before continuing")
 			;
 		// clang-format on
 	}
@@ -0,0 +1,133 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * thread_config.cpp - name our threads, and pin and prioritise them as asked
+ */
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+#include "core/thread_config.hpp"
+
+namespace
+{
+
+struct Settings
+{
+	cpu_set_t cpus;
+	bool set_cpus = false;
+	int policy = -1;
+	int priority = 0;
+};
+
+char const *const thread_classes[] = { "preview", "pp-output", "pp-worker", "pp-reload", "encode",
+									   "enc-output", "audio", "output", "save" };
+
+const std::map<std::string, int> policies = {
+	{ "other", SCHED_OTHER }, { "batch", SCHED_BATCH }, { "idle", SCHED_IDLE },
+	{ "fifo", SCHED_FIFO },	  { "rr", SCHED_RR },
+};
+
+// Only written while the options are parsed, before any of our threads start.
+std::map<std::string, Settings> settings;
+
+void parse_cpus(std::string const &list, cpu_set_t &cpus)
+{
+	CPU_ZERO(&cpus);
+	std::stringstream ss(list);
+	std::string range;
+	while (std::getline(ss, range, ','))
+	{
+		unsigned int first, last;
+		char dash;
+		std::stringstream rs(range);
+		if (!(rs >> first))
+			throw std::runtime_error("bad CPU list in thread config: " + list);
+		last = first;
+		if (rs >> dash && (dash != '-' || !(rs >> last) || last < first))
+			throw std::runtime_error("bad CPU list in thread config: " + list);
+		if (last >= CPU_SETSIZE)
+			throw std::runtime_error("CPU out of range in thread config: " + list);
+		for (unsigned int cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, &cpus);
+	}
+}
+
+} // namespace
+
+void ThreadConfig::Set(std::string const &spec)
+{
+	std::stringstream ss(spec);
+	std::string entry;
+	while (std::getline(ss, entry, ';'))
+	{
+		if (entry.empty())
+			continue;
+
+		std::stringstream es(entry);
+		std::string name, cpus, policy, priority;
+		std::getline(es, name, ':');
+		std::getline(es, cpus, ':');
+		std::getline(es, policy, ':');
+		std::getline(es, priority, ':');
+
+		bool known = false;
+		for (char const *c : thread_classes)
+			known |= name == c;
+		if (!known)
+			throw std::runtime_error("unknown thread class in thread config: " + name);
+
+		Settings s = settings[name];
+		if (!cpus.empty())
+		{
+			parse_cpus(cpus, s.cpus);
+			s.set_cpus = true;
+		}
+		if (!policy.empty())
+		{
+			auto it = policies.find(policy);
+			if (it == policies.end())
+				throw std::runtime_error("unknown scheduling policy in thread config: " + policy);
+			s.policy = it->second;
+			s.priority = priority.empty() ? 0 : std::stoi(priority);
+			if ((s.policy == SCHED_FIFO || s.policy == SCHED_RR)
+					? s.priority < sched_get_priority_min(s.policy) || s.priority > sched_get_priority_max(s.policy)
+					: s.priority != 0)
+				throw std::runtime_error("bad priority for " + policy + " in thread config: " + priority);
+		}
+		settings[name] = s;
+	}
+}
+
+void ThreadConfig::Apply(char const *thread_class)
+{
+	pthread_t self = pthread_self();
+	pthread_setname_np(self, thread_class);
+
+	auto it = settings.find(thread_class);
+	if (it == settings.end())
+		return;
+	Settings const &s = it->second;
+
+	if (s.set_cpus)
+	{
+		int ret = pthread_setaffinity_np(self, sizeof(s.cpus), &s.cpus);
+		if (ret)
+			LOG(1, "WARNING: failed to set CPU affinity of " << thread_class << " thread: " << strerror(ret));
+	}
+	if (s.policy >= 0)
+	{
+		sched_param param = {};
+		param.sched_priority = s.priority;
+		int ret = pthread_setschedparam(self, s.policy, &param);
+		if (ret)
+			LOG(1, "WARNING: failed to set scheduling of " << thread_class << " thread: " << strerror(ret));
+	}
+}
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * thread_config.hpp - name our threads, and pin and prioritise them as asked
+ */
+
+#pragma once
+
+#include <string>
+
+// Every thread we start calls Apply with the name of its class as its first act. The classes are:
+//   preview      showing frames in the preview window
+//   pp-output    handing post-processed frames back to the application
+//   pp-worker    running the post-processing stages, and stage threads such as the IMX500 decoder
+//   pp-reload    watching the post-process file, and rebuilding the stages when it changes
+//   encode       feeding and draining the encoder
+//   enc-output   passing encoded frames to the output
+//   audio        capturing and encoding audio
+//   output       writing to files and serving network clients
+//   save         saving still images
+// --thread-config sets the CPUs and scheduling for some of them, as a ';' separated list of
+// "class:cpus[:policy[:priority]]", where cpus is a list such as "2-3" or "0,2" (or empty, to leave it
+// alone) and policy is one of other, batch, idle, fifo or rr. For example
+//   --thread-config "encode:2-3:fifo:20;enc-output:3;pp-worker:0-1"
+// Asking for a real-time policy without CAP_SYS_NICE (or an rtprio limit) only gets a warning.
+class ThreadConfig
+{
+public:
+	static void Set(std::string const &spec);
+	static void Apply(char const *thread_class);
+};
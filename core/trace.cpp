@@ -0,0 +1,143 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * trace.cpp - per-frame timestamps at each hop through the pipeline
+ */
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "core/logging.hpp"
+#include "core/trace.hpp"
+
+// About ten minutes of every hop at 30fps.
+static constexpr uint64_t RING_SIZE = 1 << 17;
+
+static char const *const hop_names[] = {
+	"sensor", "request-complete", "post-processed", "encode-queued", "encode-input-done", "encode-dequeued",
+	"output-ready", "written",
+};
+static_assert(sizeof(hop_names) / sizeof(hop_names[0]) == (unsigned int)TraceHop::Count, "missing hop name");
+
+namespace
+{
+
+struct TraceState
+{
+	std::mutex mutex; // for opening and closing
+	std::string filename;
+	int marker_fd = -1;
+	std::vector<TraceEvent> ring;
+	std::atomic<uint64_t> next { 0 };
+};
+
+TraceState state;
+
+} // namespace
+
+std::atomic<bool> Trace::enabled_ { false };
+
+void Trace::Open(std::string const &target)
+{
+	std::lock_guard<std::mutex> lock(state.mutex);
+	if (enabled_)
+		return;
+
+	if (target == "ftrace")
+	{
+		for (char const *path : { "/sys/kernel/tracing/trace_marker", "/sys/kernel/debug/tracing/trace_marker" })
+		{
+			state.marker_fd = open(path, O_WRONLY | O_CLOEXEC);
+			if (state.marker_fd >= 0)
+				break;
+		}
+		if (state.marker_fd < 0)
+			throw std::runtime_error("failed to open ftrace trace_marker: " + std::string(strerror(errno)));
+	}
+	else
+	{
+		// Check now that we can write the file, rather than finding out when we exit.
+		FILE *fp = fopen(target.c_str(), "wb");
+		if (!fp)
+			throw std::runtime_error("failed to open trace file " + target);
+		fclose(fp);
+		state.filename = target;
+		state.ring.resize(RING_SIZE);
+		state.next = 0;
+	}
+
+	enabled_ = true;
+}
+
+void Trace::Close()
+{
+	std::lock_guard<std::mutex> lock(state.mutex);
+	if (!enabled_)
+		return;
+	enabled_ = false;
+
+	if (state.marker_fd >= 0)
+	{
+		close(state.marker_fd);
+		state.marker_fd = -1;
+		return;
+	}
+
+	// Anything still running when we get here may be half way through writing one last event, which
+	// at worst leaves a garbled record at the very end of the trace.
+	uint64_t end = state.next;
+	uint64_t begin = end > RING_SIZE ? end - RING_SIZE : 0;
+	FILE *fp = fopen(state.filename.c_str(), "wb");
+	if (!fp)
+	{
+		LOG_ERROR("ERROR: failed to write trace file " << state.filename);
+		return;
+	}
+	TraceFileHeader header = { { 'R', 'P', 'I', 'T', 'R', 'A', 'C', 'E' }, 1, sizeof(TraceEvent) };
+	fwrite(&header, sizeof(header), 1, fp);
+	for (uint64_t i = begin; i < end; i++)
+		fwrite(&state.ring[i % RING_SIZE], sizeof(TraceEvent), 1, fp);
+	fclose(fp);
+	if (begin)
+		LOG(1, "Trace ring overflowed, only the last " << RING_SIZE << " events were kept");
+	LOG(2, "Wrote " << end - begin << " trace events to " << state.filename);
+	state.ring.clear();
+	state.ring.shrink_to_fit();
+}
+
+int64_t Trace::now()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void Trace::record(TraceHop hop, uint32_t sequence, int64_t timestamp_us, int64_t time_ns)
+{
+	if (state.marker_fd >= 0)
+	{
+		// The kernel stamps the marker itself; passing our own time along matters for the sensor hop.
+		char line[128];
+		int n = snprintf(line, sizeof(line), "rpicam: hop=%s seq=%d ts_us=%lld time_ns=%lld\n",
+						 hop_names[(unsigned int)hop], sequence == NO_SEQUENCE ? -1 : (int)sequence,
+						 (long long)timestamp_us, (long long)time_ns);
+		if (write(state.marker_fd, line, n) < 0)
+			LOG(2, "trace_marker write failed");
+		return;
+	}
+
+	TraceEvent &event = state.ring[state.next.fetch_add(1, std::memory_order_relaxed) % RING_SIZE];
+	event.time_ns = time_ns;
+	event.timestamp_us = timestamp_us;
+	event.sequence = sequence;
+	event.hop = (uint16_t)hop;
+	event.reserved = 0;
+}
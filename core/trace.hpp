@@ -0,0 +1,81 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * trace.hpp - per-frame timestamps at each hop through the pipeline
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <string>
+
+// The points in the pipeline at which a frame gets stamped, in the order it passes them.
+enum class TraceHop : uint16_t
+{
+	Sensor, // the event time is the frame's SensorTimestamp
+	RequestComplete, // libcamera has handed us the request
+	PostProcessed, // the last post-processing stage has finished with it
+	EncodeQueued, // given to the encoder
+	EncodeInputDone, // the encoder has finished with the camera buffer
+	EncodeDequeued, // the encoded frame came out of the codec
+	OutputReady, // Output::OutputReady has been called with it
+	Written, // the output has passed it to the sink
+	Count
+};
+
+// What --trace writes to its file: this header, then the events oldest first. All little endian.
+struct TraceFileHeader
+{
+	char magic[8]; // "RPITRACE"
+	uint32_t version;
+	uint32_t event_size;
+};
+
+// Frames are identified by their sequence number until they reach the encoder, and by their encoder
+// timestamp from then on. The EncodeQueued event carries both, and so links the two.
+struct TraceEvent
+{
+	int64_t time_ns; // CLOCK_MONOTONIC, the same clock as the sensor timestamps
+	int64_t timestamp_us;
+	uint32_t sequence;
+	uint16_t hop;
+	uint16_t reserved;
+};
+
+static_assert(sizeof(TraceEvent) == 24, "TraceEvent must stay 24 bytes");
+
+// Tracing is off unless --trace is given, when each event costs a clock read and a store into a ring
+// of the most recent events, which is written out when the application exits. With "--trace ftrace"
+// the events go to the kernel's trace_marker instead, so they line up with everything else in a
+// system trace.
+class Trace
+{
+public:
+	static constexpr uint32_t NO_SEQUENCE = std::numeric_limits<uint32_t>::max();
+	static constexpr int64_t NO_TIMESTAMP = -1;
+
+	static void Open(std::string const &target);
+	static void Close();
+
+	static bool Enabled() { return enabled_.load(std::memory_order_relaxed); }
+	static void Event(TraceHop hop, uint32_t sequence, int64_t timestamp_us = NO_TIMESTAMP)
+	{
+		if (Enabled())
+			record(hop, sequence, timestamp_us, now());
+	}
+	// For hops that happened at a known time, such as the sensor timestamp.
+	static void EventAt(TraceHop hop, uint32_t sequence, int64_t timestamp_us, int64_t time_ns)
+	{
+		if (Enabled())
+			record(hop, sequence, timestamp_us, time_ns);
+	}
+
+private:
+	static int64_t now();
+	static void record(TraceHop hop, uint32_t sequence, int64_t timestamp_us, int64_t time_ns);
+
+	static std::atomic<bool> enabled_;
+};
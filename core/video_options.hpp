@@ -34,18 +34,36 @@ struct VideoOptions : public Options
 			 "Force PPS/SPS header with every I frame (h264 only)")
 			("codec", value<std::string>(&v_->codec)->default_value("h264"),
 			 "Set the codec to use, either h264, libav (if available), mjpeg or yuv420")
+			("lores-codec", value<std::string>(&v_->lores_codec)->default_value(""),
+			 "Also encode the low resolution stream with this codec (h264, mjpeg or yuv420), alongside the main "
+			 "video stream. Needs --lores-width, --lores-height and --lores-output")
+			("lores-output", value<std::string>(&v_->lores_output),
+			 "Where to write the encoded low resolution stream (see --lores-codec)")
 			("encoder-libs", value<std::string>(&v_->encoder_libs)->default_value(""),
 			 "Set a custom location for the encoder library .so files")
 			("save-pts", value<std::string>(&v_->save_pts),
 			 "Save a timestamp file with this name")
 			("quality,q", value<int>(&v_->quality)->default_value(50),
 			 "Set the MJPEG quality parameter (mjpeg only)")
+			("jpeg-fast-dct", value<bool>(&v_->jpeg_fast_dct)->default_value(false)->implicit_value(true),
+			 "Use the faster, slightly less accurate, integer DCT for MJPEG encoding (mjpeg only)")
+			("jpeg-optimize", value<bool>(&v_->jpeg_optimize)->default_value(false)->implicit_value(true),
+			 "Compute optimal Huffman tables for each MJPEG frame, for smaller files at the cost of a slower encode")
 			("listen,l", value<bool>(&v_->listen)->default_value(false)->implicit_value(true),
 			 "Listen for an incoming client network connection before sending data to the client")
+			("net-sndbuf", value<uint32_t>(&v_->net_sndbuf)->default_value(0),
+			 "Set the network socket send buffer size in bytes, or 0 to leave the system default")
+			("net-abr", value<std::string>(&v_->net_abr_)->default_value("0bps"),
+			 "Lower the bitrate when the network can't keep up, but never below this one, or 0 to stay at --bitrate. "
+			 "If no units are provided, default to bits/second.")
+			("encoder-socket", value<std::string>(&v_->encoder_socket),
+			 "Take encoder commands, as with --keypress, as datagrams on a Unix socket at this path")
 			("keypress,k", value<bool>(&v_->keypress)->default_value(false)->implicit_value(true),
-			 "Pause or resume video recording when ENTER pressed")
+			 "Pause or resume video recording when ENTER pressed. Also \"k\" for a keyframe now, "
+			 "\"b <bitrate>\", \"q <qp>\" (or just \"q\" to let it vary) and \"i <frames>\" to change "
+			 "the encoder's bitrate, quantiser and intra period")
 			("signal,s", value<bool>(&v_->signal)->default_value(false)->implicit_value(true),
-			 "Pause or resume video recording when signal received")
+			 "Pause or resume video recording when signal received, or make a keyframe on SIGHUP")
 			("initial,i", value<std::string>(&v_->initial)->default_value("record"),
 			 "Use 'pause' to pause the recording at startup, otherwise 'record' (the default)")
 			("split", value<bool>(&v_->split)->default_value(false)->implicit_value(true),
@@ -54,8 +72,41 @@ struct VideoOptions : public Options
 			 "Break the recording into files of approximately this many milliseconds")
 			("circular", value<size_t>(&v_->circular)->default_value(0)->implicit_value(4),
 			 "Write output to a circular buffer of the given size (in MB) which is saved on exit")
+			("circular-clip", value<std::string>(&v_->circular_clip_)->default_value("0ms"),
+			 "With --circular, save a clip to a new file whenever recording is triggered (ENTER, signal or motion) "
+			 "rather than on exit. The clip holds the buffered history and then this much time after the trigger. "
+			 "If no units are provided default to ms.")
+			("circular-preroll", value<std::string>(&v_->circular_preroll_)->default_value("0ms"),
+			 "Limit the history in each --circular-clip to this long before the trigger, or 0 to keep all of it. "
+			 "If no units are provided default to ms.")
+			("motion-gate", value<bool>(&v_->motion_gate)->default_value(false)->implicit_value(true),
+			 "Only record while the motion_detect post-processing stage reports motion")
+			("motion-holdoff", value<std::string>(&v_->motion_holdoff_)->default_value("2s"),
+			 "With --motion-gate, carry on recording for this long after the motion stops. "
+			 "If no units are provided default to ms.")
+			("motion-preroll", value<std::string>(&v_->motion_preroll_)->default_value("0ms"),
+			 "With --motion-gate, also record up to this much video from before the motion started. "
+			 "If no units are provided default to ms.")
+			("idle-framerate", value<float>(&v_->idle_framerate)->default_value(0),
+			 "Run the camera at this lower framerate while the motion_detect post-processing stage sees no motion, "
+			 "returning to the full framerate as soon as it does, or 0 to always run at full rate")
+			("idle-holdoff", value<std::string>(&v_->idle_holdoff_)->default_value("5s"),
+			 "With --idle-framerate, only drop to the idle framerate after this long without motion. "
+			 "If no units are provided default to ms.")
+			("encoder-overload", value<std::string>(&v_->encoder_overload)->default_value("drop"),
+			 "What the encoder does when it has no free input buffers: drop (the new frame), drop-oldest "
+			 "(discard queued encoded frames up to the next keyframe, then wait) or block (wait, then drop)")
+			("encoder-overload-timeout", value<std::string>(&v_->encoder_overload_timeout_)->default_value("100ms"),
+			 "How long the drop-oldest and block overload policies wait for the encoder. "
+			 "If no units are provided default to ms.")
 			("frames", value<unsigned int>(&v_->frames)->default_value(0),
 			 "Run for the exact number of frames specified. This will override any timeout set.")
+			("raw-ring", value<unsigned int>(&v_->raw_ring)->default_value(0),
+			 "rpicam-raw only: preallocate the output file with room for this many frames and write the raw "
+			 "buffers into it directly, wrapping round when it's full")
+			("raw-index", value<std::string>(&v_->raw_index),
+			 "With --raw-ring, write a line per frame to this file giving its position in the ring, timestamp "
+			 "and exposure")
 			("libav-video-codec", value<std::string>(&v_->libav_video_codec)->default_value("h264_v4l2m2m"),
 			 "Sets the libav video codec to use. "
 			 "To list available codecs, run  the \"ffmpeg -codecs\" command.")
@@ -69,6 +120,15 @@ struct VideoOptions : public Options
 			 "Sets the libav encoder output format to use. "
 			 "Leave blank to try and deduce this from the filename.\n"
 			 "To list available formats, run  the \"ffmpeg -formats\" command.")
+			("libav-mux-buffer", value<uint32_t>(&v_->libav_mux_buffer)->default_value(8),
+			 "Megabytes of encoded packets the libav encoder may hold while the muxer is busy writing them out")
+			("libav-mux-drop", value<bool>(&v_->libav_mux_drop)->default_value(false)->implicit_value(true),
+			 "When the libav mux buffer is full, drop packets (video until the next keyframe) rather than waiting")
+			("libav-fragment", value<std::string>(&v_->libav_fragment_)->default_value("0ms"),
+			 "Write MP4/MOV output as fragments, each starting on a keyframe and at least this long (in ms if no "
+			 "units are provided), so that a recording cut short is still playable. 0 writes an ordinary file.")
+			("libav-cmaf", value<bool>(&v_->libav_cmaf)->default_value(false)->implicit_value(true),
+			 "With --libav-fragment, make the fragments CMAF compliant, as used for (LL-)HLS and DASH")
 			("libav-audio", value<bool>(&v_->libav_audio)->default_value(false)->implicit_value(true),
 			 "Records an audio stream together with the video.")
 			("audio-codec", value<std::string>(&v_->audio_codec)->default_value("aac"),
@@ -7,7 +7,6 @@
 
 #include <cstring>
 #include <fcntl.h>
-#include <filesystem>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 
@@ -22,8 +21,6 @@
 
 #include "config.h"
 
-namespace fs = std::filesystem;
-
 EncoderFactory &EncoderFactory::GetInstance()
 {
 	static EncoderFactory instance;
@@ -37,41 +34,22 @@ void EncoderFactory::RegisterEncoder(const std::string &name, EncoderCreateFunc
 
 EncoderCreateFunc EncoderFactory::CreateEncoder(const std::string &name)
 {
-	auto it = encoders_.find(name);
-	if (it != encoders_.end())
-		return it->second;
-	return nullptr;
+	if (!HasEncoder(name))
+		return nullptr;
+	return encoders_.find(name)->second;
 }
 
 bool EncoderFactory::HasEncoder(const std::string &name) const
 {
+	// Asking about an encoder we haven't met loads the library that provides it, if it's in a manifest.
+	if (encoders_.find(name) == encoders_.end())
+		libraries_.Load(name);
 	return encoders_.find(name) != encoders_.end();
 }
 
 void EncoderFactory::LoadEncoderLibraries(const std::string &lib_dir)
 {
-	const fs::path path(!lib_dir.empty() ? lib_dir : ENCODER_LIB_DIR);
-	const std::string ext(".so");
-
-	if (!fs::exists(path))
-		return;
-
-	// Dynamically load all .so files from the system encoder lib path.
-	// This will automatically register the stages with the factory.
-	for (auto const &p : fs::recursive_directory_iterator(path))
-	{
-		if (p.path().extension() == ext)
-		{
-			const std::string library_path = p.path().string();
-
-			// Check if this library has already been loaded
-			if (loaded_library_paths_.find(library_path) == loaded_library_paths_.end())
-			{
-				encoder_libraries_.emplace_back(library_path);
-				loaded_library_paths_.insert(library_path);
-			}
-		}
-	}
+	libraries_.Scan(!lib_dir.empty() ? lib_dir : ENCODER_LIB_DIR);
 }
 
 RegisterEncoder::RegisterEncoder(char const *name, EncoderCreateFunc create_func)
@@ -111,6 +89,26 @@ static Encoder *libav_codec_select(VideoOptions *options, const StreamInfo &info
 	return factory.CreateEncoder("libav")(options, info);
 }
 
+static Encoder *mjpeg_codec_select(VideoOptions *options, const StreamInfo &info)
+{
+	auto &factory = EncoderFactory::GetInstance();
+
+	// Use a hardware JPEG codec if there is one that can take this stream, otherwise libjpeg.
+	if (factory.HasEncoder("v4l2_jpeg"))
+	{
+		try
+		{
+			return factory.CreateEncoder("v4l2_jpeg")(options, info);
+		}
+		catch (std::exception const &e)
+		{
+			LOG(2, "Hardware JPEG encoder not used: " << e.what());
+		}
+	}
+
+	return factory.CreateEncoder("mjpeg")(options, info);
+}
+
 Encoder *Encoder::Create(VideoOptions *options, const StreamInfo &info)
 {
 	auto &factory = EncoderFactory::GetInstance();
@@ -123,6 +121,6 @@ Encoder *Encoder::Create(VideoOptions *options, const StreamInfo &info)
 	else if (factory.HasEncoder("libav") && strcasecmp(options->Get().codec.c_str(), "libav") == 0)
 		return libav_codec_select(options, info);
 	else if (strcasecmp(options->Get().codec.c_str(), "mjpeg") == 0)
-		return factory.CreateEncoder("mjpeg")(options, info);
+		return mjpeg_codec_select(options, info);
 	throw std::runtime_error("Unrecognised codec " + options->Get().codec);
 }
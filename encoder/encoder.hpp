@@ -7,9 +7,13 @@
 
 #pragma once
 
+#include <atomic>
 #include <functional>
 #include <map>
+#include <memory>
 
+#include "core/dl_lib.hpp"
+#include "core/encoder_controls.hpp"
 #include "core/stream_info.hpp"
 #include "core/video_options.hpp"
 
@@ -30,13 +34,22 @@ public:
 	// available. The application may not hang on to the memory once it returns
 	// (but the callback is already running in its own thread).
 	void SetOutputReadyCallback(OutputReadyCallback callback) { output_ready_callback_ = callback; }
+	// Encoders that can change their settings, or make a keyframe, while they run take requests to do
+	// so from here (see EncoderControls). Others ignore it.
+	void SetControls(std::shared_ptr<EncoderControls> controls) { controls_ = std::move(controls); }
 	// Encode the given buffer. The buffer is specified both by an fd and size
-	// describing a DMABUF, and by a mmapped userland pointer.
-	virtual void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) = 0;
+	// describing a DMABUF, and by a mmapped userland pointer. Returns false if the
+	// encoder is overloaded and has dropped the frame, in which case the input done
+	// callback will not be called for it.
+	virtual bool EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) = 0;
+	// The number of frames dropped because the encoder was overloaded.
+	uint64_t DroppedFrames() const { return dropped_frames_; }
 
 protected:
+	std::atomic<uint64_t> dropped_frames_ = 0;
 	InputDoneCallback input_done_callback_;
 	OutputReadyCallback output_ready_callback_;
+	std::shared_ptr<EncoderControls> controls_;
 	VideoOptions const *options_;
 };
 
@@ -64,8 +77,8 @@ private:
 	~EncoderFactory() = default;
 
 	std::map<std::string, EncoderCreateFunc> encoders_;
-	std::vector<DlLib> encoder_libraries_;
-	std::set<std::string> loaded_library_paths_;
+	// Libraries are only loaded when someone asks for an encoder they provide, even from a const method.
+	mutable PluginLibraries libraries_;
 };
 
 struct RegisterEncoder
@@ -7,6 +7,7 @@
 
 #include <fcntl.h>
 #include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 
@@ -14,6 +15,12 @@
 
 #include <chrono>
 #include <iostream>
+#include <string>
+#include <utility>
+
+#include "core/memory_account.hpp"
+#include "core/thread_config.hpp"
+#include "core/trace.hpp"
 
 #include "h264_encoder.hpp"
 
@@ -49,6 +56,10 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 		throw std::runtime_error("failed to open V4L2 H264 encoder");
 	LOG(2, "Opened H264Encoder on " << device_name << " as fd " << fd_);
 
+	abort_fd_ = eventfd(0, EFD_CLOEXEC);
+	if (abort_fd_ < 0)
+		throw std::runtime_error("failed to create abort eventfd");
+
 	// Apply any options->Get().
 
 	v4l2_control ctrl = {};
@@ -58,6 +69,7 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 		ctrl.value = options->Get().bitrate.bps();
 		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
 			throw std::runtime_error("failed to set bitrate");
+		bitrate_ = ctrl.value;
 	}
 	if (!options->Get().profile.empty())
 	{
@@ -101,6 +113,13 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
 			throw std::runtime_error("failed to set inline headers");
 	}
+	// Remember the codec's own quantiser limits so that "q" on its own can put them back.
+	ctrl.id = V4L2_CID_MPEG_VIDEO_H264_MIN_QP;
+	if (xioctl(fd_, VIDIOC_G_CTRL, &ctrl) == 0)
+		qp_min_ = default_qp_min_ = ctrl.value;
+	ctrl.id = V4L2_CID_MPEG_VIDEO_H264_MAX_QP;
+	if (xioctl(fd_, VIDIOC_G_CTRL, &ctrl) == 0)
+		qp_max_ = default_qp_max_ = ctrl.value;
 
 	// Set the output and capture formats. We know exactly what they will be.
 
@@ -154,6 +173,7 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
 		throw std::runtime_error("request for output buffers failed");
 	LOG(2, "Got " << reqbufs.count << " output buffers");
+	MemoryAccount::Set(options_->Get().camera, "h264.output", MemoryPool::Import, 0, reqbufs.count);
 
 	// We have to maintain a list of the buffers we can use when our caller gives
 	// us another frame to encode.
@@ -169,6 +189,7 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 	LOG(2, "Got " << reqbufs.count << " capture buffers");
 	num_capture_buffers_ = reqbufs.count;
 
+	uint64_t capture_bytes = 0;
 	for (unsigned int i = 0; i < reqbufs.count; i++)
 	{
 		v4l2_plane planes[VIDEO_MAX_PLANES];
@@ -185,12 +206,15 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 		if (buffers_[i].mem == MAP_FAILED)
 			throw std::runtime_error("failed to mmap capture buffer " + std::to_string(i));
 		buffers_[i].size = buffer.m.planes[0].length;
+		capture_bytes += buffers_[i].size;
 		// Whilst we're going through all the capture buffers, we may as well queue
 		// them ready for the encoder to write into.
 		if (xioctl(fd_, VIDIOC_QBUF, &buffer) < 0)
 			throw std::runtime_error("failed to queue capture buffer " + std::to_string(i));
 	}
 
+	MemoryAccount::Set(options_->Get().camera, "h264.capture", MemoryPool::Dma, capture_bytes, reqbufs.count);
+
 	// Enable streaming and we're done.
 
 	v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
@@ -208,9 +232,17 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 H264Encoder::~H264Encoder()
 {
 	abortPoll_ = true;
+	uint64_t one = 1;
+	if (write(abort_fd_, &one, sizeof(one)) != sizeof(one))
+		LOG(1, "Failed to signal abort to poll thread");
 	poll_thread_.join();
-	abortOutput_ = true;
+	{
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		abortOutput_ = true;
+	}
+	output_cond_var_.notify_all();
 	output_thread_.join();
+	close(abort_fd_);
 
 	// Turn off streaming on both the output and capture queues, and "free" the
 	// buffers that we requested. The capture ones need to be "munmapped" first.
@@ -238,20 +270,48 @@ H264Encoder::~H264Encoder()
 	reqbufs.memory = V4L2_MEMORY_MMAP;
 	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
 		LOG(1, "Request to free capture buffers failed");
+	MemoryAccount::Set(options_->Get().camera, "h264.output", MemoryPool::Import, 0, 0);
+	MemoryAccount::Set(options_->Get().camera, "h264.capture", MemoryPool::Dma, 0, 0);
 
 	close(fd_);
+	if (dropped_frames_ || discarded_frames_)
+		LOG(1, "H264Encoder: overloaded " << overload_waits_ << " times, dropped " << dropped_frames_
+										 << " input frames and discarded " << discarded_frames_ << " encoded frames");
 	LOG(2, "H264Encoder closed");
 }
 
-void H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
+bool H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
 {
+	applyControls();
+
 	int index;
 	{
 		// We need to find an available output buffer (input to the codec) to
-		// "wrap" the DMABUF.
-		std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
+		// "wrap" the DMABUF. If there isn't one, the application is probably
+		// not keeping up with the encoded output, and what we do then depends
+		// on the overload policy.
+		std::unique_lock<std::mutex> lock(input_buffers_available_mutex_);
 		if (input_buffers_available_.empty())
-			throw std::runtime_error("no buffers available to queue codec input");
+		{
+			std::string const &policy = options_->Get().encoder_overload;
+			if (policy == "drop-oldest")
+			{
+				lock.unlock();
+				discardOutput();
+				lock.lock();
+			}
+			if (policy != "drop")
+			{
+				overload_waits_++;
+				input_buffers_available_cond_var_.wait_for(lock, options_->Get().encoder_overload_timeout.value,
+														   [this] { return !input_buffers_available_.empty(); });
+			}
+			if (input_buffers_available_.empty())
+			{
+				dropped_frames_++;
+				return false;
+			}
+		}
 		index = input_buffers_available_.front();
 		input_buffers_available_.pop();
 	}
@@ -270,19 +330,140 @@ void H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 	buf.m.planes[0].length = size;
 	if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0)
 		throw std::runtime_error("failed to queue input to codec");
+	return true;
+}
+
+void H264Encoder::applyControls()
+{
+	if (!controls_)
+		return;
+
+	// The codec takes new settings while it's running, from the next frame it encodes.
+	uint32_t bitrate = controls_->bitrate.exchange(0);
+	if (bitrate && bitrate != bitrate_)
+	{
+		v4l2_control ctrl = {};
+		ctrl.id = V4L2_CID_MPEG_VIDEO_BITRATE;
+		ctrl.value = bitrate;
+		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+			LOG(1, "H264Encoder: failed to change bitrate to " << bitrate);
+		else
+		{
+			LOG(2, "H264Encoder: bitrate now " << bitrate / 1000 << "kbps");
+			bitrate_ = bitrate;
+		}
+	}
+
+	// A fixed quantiser is a minimum and maximum that are the same. The codec won't take a minimum above
+	// its maximum, so when the range moves up the maximum has to go first.
+	int qp = controls_->qp.exchange(EncoderControls::QP_UNCHANGED);
+	if (qp != EncoderControls::QP_UNCHANGED)
+	{
+		bool fixed = qp != EncoderControls::QP_FREE;
+		v4l2_control min_ctrl = { V4L2_CID_MPEG_VIDEO_H264_MIN_QP, fixed ? qp : default_qp_min_ };
+		v4l2_control max_ctrl = { V4L2_CID_MPEG_VIDEO_H264_MAX_QP, fixed ? qp : default_qp_max_ };
+		v4l2_control *first = &min_ctrl, *second = &max_ctrl;
+		if (min_ctrl.value > qp_max_)
+			std::swap(first, second);
+		if (xioctl(fd_, VIDIOC_S_CTRL, first) < 0 || xioctl(fd_, VIDIOC_S_CTRL, second) < 0)
+			LOG(1, "H264Encoder: failed to change quantiser");
+		else
+		{
+			LOG(2, "H264Encoder: quantiser now " << (fixed ? std::to_string(qp) : "free"));
+			qp_min_ = min_ctrl.value;
+			qp_max_ = max_ctrl.value;
+		}
+	}
+
+	uint32_t intra = controls_->intra.exchange(0);
+	if (intra)
+	{
+		v4l2_control ctrl = {};
+		ctrl.id = V4L2_CID_MPEG_VIDEO_H264_I_PERIOD;
+		ctrl.value = intra;
+		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+			LOG(1, "H264Encoder: failed to change intra period to " << intra);
+		else
+			LOG(2, "H264Encoder: intra period now " << intra);
+	}
+
+	if (controls_->keyframe.exchange(false))
+	{
+		v4l2_control ctrl = {};
+		ctrl.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
+		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+			LOG(1, "H264Encoder: failed to force keyframe");
+	}
+}
+
+void H264Encoder::discardOutput()
+{
+	std::lock_guard<std::mutex> lock(output_mutex_);
+	std::queue<OutputItem> kept;
+	bool discarding = false, discarded = false;
+	for (; !output_queue_.empty(); output_queue_.pop())
+	{
+		OutputItem &item = output_queue_.front();
+		if (item.keyframe)
+			discarding = false;
+		else if (!discarded)
+			discarding = discarded = true;
+
+		if (discarding)
+		{
+			requeueCapture(item.index, item.length);
+			discarded_frames_++;
+		}
+		else
+			kept.push(item);
+	}
+	output_queue_ = std::move(kept);
+
+	// If we were still discarding at the end of the queue, frames yet to come out of the codec
+	// will be no good either, so get it to make a keyframe soon.
+	if (discarding)
+	{
+		skip_to_keyframe_ = true;
+		v4l2_control ctrl = {};
+		ctrl.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
+		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+			LOG(1, "H264Encoder: failed to force keyframe");
+	}
+}
+
+void H264Encoder::requeueCapture(unsigned int index, size_t length)
+{
+	v4l2_buffer buf = {};
+	v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = index;
+	buf.length = 1;
+	buf.m.planes = planes;
+	buf.m.planes[0].bytesused = 0;
+	buf.m.planes[0].length = length;
+	if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0)
+		throw std::runtime_error("failed to re-queue encoded buffer");
 }
 
 void H264Encoder::pollThread()
 {
+	ThreadConfig::Apply("encode");
+
 	while (true)
 	{
-		pollfd p = { fd_, POLLIN, 0 };
-		int ret = poll(&p, 1, 200);
+		// Once we're aborting there's no need to watch the abort_fd_ (which stays readable), we
+		// just wait for the codec to give back all the buffers.
+		bool abort = abortPoll_;
+		if (abort)
 		{
 			std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
-			if (abortPoll_ && input_buffers_available_.size() == NUM_OUTPUT_BUFFERS)
+			if (input_buffers_available_.size() == NUM_OUTPUT_BUFFERS)
 				break;
 		}
+		pollfd fds[2] = { { fd_, POLLIN, 0 }, { abort_fd_, POLLIN, 0 } };
+		pollfd &p = fds[0];
+		int ret = poll(fds, abort ? 1 : 2, -1);
 		if (ret == -1)
 		{
 			if (errno == EINTR)
@@ -306,6 +487,7 @@ void H264Encoder::pollThread()
 					std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
 					input_buffers_available_.push(buf.index);
 				}
+				input_buffers_available_cond_var_.notify_one();
 				input_done_callback_(nullptr);
 			}
 
@@ -322,6 +504,7 @@ void H264Encoder::pollThread()
 				// application can take its time with the data without blocking the
 				// encode process.
 				int64_t timestamp_us = (buf.timestamp.tv_sec * (int64_t)1000000) + buf.timestamp.tv_usec;
+				Trace::Event(TraceHop::EncodeDequeued, Trace::NO_SEQUENCE, timestamp_us);
 				OutputItem item = { buffers_[buf.index].mem,
 									buf.m.planes[0].bytesused,
 									buf.m.planes[0].length,
@@ -329,6 +512,13 @@ void H264Encoder::pollThread()
 									!!(buf.flags & V4L2_BUF_FLAG_KEYFRAME),
 									timestamp_us };
 				std::lock_guard<std::mutex> lock(output_mutex_);
+				if (skip_to_keyframe_ && !item.keyframe)
+				{
+					requeueCapture(item.index, item.length);
+					discarded_frames_++;
+					continue;
+				}
+				skip_to_keyframe_ = false;
 				output_queue_.push(item);
 				output_cond_var_.notify_one();
 			}
@@ -338,6 +528,8 @@ void H264Encoder::pollThread()
 
 void H264Encoder::outputThread()
 {
+	ThreadConfig::Apply("enc-output");
+
 	OutputItem item;
 	while (true)
 	{
@@ -345,7 +537,6 @@ void H264Encoder::outputThread()
 			std::unique_lock<std::mutex> lock(output_mutex_);
 			while (true)
 			{
-				using namespace std::chrono_literals;
 				// Must check the abort first, to allow items in the output
 				// queue to have a callback.
 				if (abortOutput_ && output_queue_.empty())
@@ -358,22 +549,12 @@ void H264Encoder::outputThread()
 					break;
 				}
 				else
-					output_cond_var_.wait_for(lock, 200ms);
+					output_cond_var_.wait(lock);
 			}
 		}
 
 		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, item.keyframe);
-		v4l2_buffer buf = {};
-		v4l2_plane planes[VIDEO_MAX_PLANES] = {};
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-		buf.memory = V4L2_MEMORY_MMAP;
-		buf.index = item.index;
-		buf.length = 1;
-		buf.m.planes = planes;
-		buf.m.planes[0].bytesused = 0;
-		buf.m.planes[0].length = item.length;
-		if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0)
-			throw std::runtime_error("failed to re-queue encoded buffer");
+		requeueCapture(item.index, item.length);
 	}
 }
 
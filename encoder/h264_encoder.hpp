@@ -7,6 +7,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <condition_variable>
 #include <mutex>
 #include <queue>
@@ -20,7 +21,7 @@ public:
 	H264Encoder(VideoOptions const *options, StreamInfo const &info);
 	~H264Encoder();
 	// Encode the given DMABUF.
-	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	bool EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
 
 private:
 	// We want at least as many output buffers as there are in the camera queue
@@ -40,8 +41,19 @@ private:
 	// re-use.
 	void outputThread();
 
-	bool abortPoll_;
+	// Act on any requests to change our settings or make a keyframe.
+	void applyControls();
+
+	// Give an encoded buffer back to the codec.
+	void requeueCapture(unsigned int index, size_t length);
+	// Free up capture buffers by discarding encoded frames that are still waiting for the
+	// application, starting from the oldest non-keyframe up to the next keyframe.
+	void discardOutput();
+
+	std::atomic<bool> abortPoll_;
 	bool abortOutput_;
+	// Signalled to wake the poll thread when we're closing down.
+	int abort_fd_;
 	int fd_;
 	struct BufferDescription
 	{
@@ -52,7 +64,18 @@ private:
 	int num_capture_buffers_;
 	std::thread poll_thread_;
 	std::mutex input_buffers_available_mutex_;
+	std::condition_variable input_buffers_available_cond_var_;
 	std::queue<int> input_buffers_available_;
+	// After discarding frames, the ones that depend on them must go too, until a keyframe.
+	bool skip_to_keyframe_ = false;
+	uint32_t bitrate_ = 0;
+	// The quantiser limits the codec has now, and the ones it started with.
+	int qp_min_ = 0;
+	int qp_max_ = 51;
+	int default_qp_min_ = 0;
+	int default_qp_max_ = 51;
+	uint64_t discarded_frames_ = 0;
+	uint64_t overload_waits_ = 0;
 	struct OutputItem
 	{
 		void *mem;
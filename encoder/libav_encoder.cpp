@@ -17,6 +17,9 @@
 #include <chrono>
 #include <iostream>
 
+#include "core/thread_config.hpp"
+#include "core/trace.hpp"
+
 #include "libav_encoder.hpp"
 
 namespace {
@@ -75,10 +78,37 @@ void encoderOptionsGeneral(VideoOptions const *options, AVCodecContext *codec)
 
 void encoderOptionsH264M2M(VideoOptions const *options, AVCodecContext *codec)
 {
-	codec->pix_fmt = AV_PIX_FMT_DRM_PRIME;
 	codec->max_b_frames = 0;
 }
 
+// Encoders that take DRM PRIME frames are given the camera's dmabuf itself, and nothing ever copies it.
+bool acceptsDrmPrime(const AVCodec *codec, AVCodecContext *ctx)
+{
+	// h264_v4l2m2m takes DRM PRIME frames but doesn't list them among its formats, so we can't ask it.
+	if (!strcmp(codec->name, "h264_v4l2m2m"))
+		return true;
+
+	const enum AVPixelFormat *pix_fmts = nullptr;
+#if LIBAVCODEC_VERSION_MAJOR < 61
+	pix_fmts = codec->pix_fmts;
+#else
+	avcodec_get_supported_config(ctx, codec, AV_CODEC_CONFIG_PIX_FORMAT, 0, (const void **)&pix_fmts, nullptr);
+#endif
+	for (; pix_fmts && *pix_fmts != AV_PIX_FMT_NONE; pix_fmts++)
+	{
+		if (*pix_fmts == AV_PIX_FMT_DRM_PRIME)
+			return true;
+	}
+	return false;
+}
+
+// The mp4, mov and related muxers are the ones that can write fragments.
+bool isMovMuxer(const AVOutputFormat *fmt)
+{
+	return fmt->priv_class &&
+		   av_opt_find((void *)&fmt->priv_class, "movflags", nullptr, 0, AV_OPT_SEARCH_FAKE_OBJ) != nullptr;
+}
+
 void encoderOptionsLibx264(VideoOptions const *options, AVCodecContext *codec)
 {
 	codec->me_range = 16;
@@ -134,7 +164,9 @@ void LibAvEncoder::initVideoCodec(VideoOptions const *options, StreamInfo const
 	// usec timebase
 	codec_ctx_[Video]->time_base = { 1, 1000 * 1000 };
 	codec_ctx_[Video]->sw_pix_fmt = AV_PIX_FMT_YUV420P;
-	codec_ctx_[Video]->pix_fmt = AV_PIX_FMT_YUV420P;
+	codec_ctx_[Video]->pix_fmt = acceptsDrmPrime(codec, codec_ctx_[Video]) ? AV_PIX_FMT_DRM_PRIME : AV_PIX_FMT_YUV420P;
+	LOG(2, "libav: " << codec->name << " takes "
+					 << (codec_ctx_[Video]->pix_fmt == AV_PIX_FMT_DRM_PRIME ? "dmabufs" : "mapped buffers"));
 
 	if (info.colour_space)
 	{
@@ -236,6 +268,10 @@ void LibAvEncoder::initVideoCodec(VideoOptions const *options, StreamInfo const
 	if (!out_fmt_ctx_)
 		throw std::runtime_error("libav: cannot allocate output context, try setting with --libav-format");
 
+	if (options->Get().libav_fragment && !isMovMuxer(out_fmt_ctx_->oformat))
+		throw std::runtime_error("libav: --libav-fragment needs an mp4 or mov output format, not " +
+								 std::string(out_fmt_ctx_->oformat->name));
+
 	if (out_fmt_ctx_->oformat->flags & AVFMT_GLOBALHEADER)
 		codec_ctx_[Video]->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
@@ -359,8 +395,9 @@ void LibAvEncoder::initAudioOutCodec(VideoOptions const *options, StreamInfo con
 
 LibAvEncoder::LibAvEncoder(VideoOptions const *options, StreamInfo const &info)
 	: Encoder(options), output_ready_(false), abort_video_(false), abort_audio_(false), video_start_ts_(0),
-	  in_fmt_ctx_(nullptr), out_fmt_ctx_(nullptr), output_file_(options->Get().output), output_initialised_(false),
-	  elementary_stream_(false)
+	  mux_bytes_(0), mux_limit_((size_t)options->Get().libav_mux_buffer << 20), mux_skip_to_key_(false),
+	  mux_dropped_(0), abort_mux_(false), in_fmt_ctx_(nullptr), out_fmt_ctx_(nullptr),
+	  output_file_(options->Get().output), output_initialised_(false), elementary_stream_(false)
 {
 	avdevice_register_all();
 
@@ -379,6 +416,11 @@ LibAvEncoder::LibAvEncoder(VideoOptions const *options, StreamInfo const &info)
 
 	LOG(2, "libav: codec init completed");
 
+	// Muxer writes can block for a long time on a slow card or network, so they get a thread of their own
+	// rather than holding up the encoders.
+	if (!elementary_stream_)
+		mux_thread_ = std::thread(&LibAvEncoder::muxThread, this);
+
 	video_thread_ = std::thread(&LibAvEncoder::videoThread, this);
 
 	if (options->Get().libav_audio)
@@ -393,9 +435,23 @@ LibAvEncoder::~LibAvEncoder()
 		audio_thread_.join();
 	}
 
-	abort_video_ = true;
+	{
+		std::lock_guard<std::mutex> lock(video_mutex_);
+		abort_video_ = true;
+	}
+	video_cv_.notify_all();
 	video_thread_.join();
 
+	if (mux_thread_.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(mux_mutex_);
+			abort_mux_ = true;
+		}
+		mux_cv_.notify_all();
+		mux_thread_.join();
+	}
+
 	avformat_free_context(out_fmt_ctx_);
 	avcodec_free_context(&codec_ctx_[Video]);
 
@@ -409,7 +465,7 @@ LibAvEncoder::~LibAvEncoder()
 	LOG(2, "libav: codec closed");
 }
 
-void LibAvEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
+bool LibAvEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
 {
 	AVFrame *frame = av_frame_alloc();
 	if (!frame)
@@ -459,13 +515,15 @@ void LibAvEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 	else
 	{
 		frame->buf[0] = av_buffer_create((uint8_t *)mem, size, &LibAvEncoder::releaseBuffer, this, 0);
+		// The encoder only reads the frame, so it can use our mapping as it is. Asking for it to be made
+		// writable would risk a copy of the whole frame, for nothing.
 		av_image_fill_pointers(frame->data, AV_PIX_FMT_YUV420P, frame->height, frame->buf[0]->data, frame->linesize);
-		av_frame_make_writable(frame);
 	}
 
 	std::scoped_lock<std::mutex> lock(video_mutex_);
 	frame_queue_.push(frame);
 	video_cv_.notify_all();
+	return true;
 }
 
 void LibAvEncoder::initOutput()
@@ -493,7 +551,22 @@ void LibAvEncoder::initOutput()
 		}
 	}
 
-	ret = avformat_write_header(out_fmt_ctx_, nullptr);
+	// A fragmented file starts with an empty moov, and then each fragment is written out, and flushed, once
+	// complete. The muxer only ever holds the current fragment, and a file cut short loses just that one.
+	AVDictionary *mux_opts = nullptr;
+	if (options_->Get().libav_fragment)
+	{
+		std::string flags = "+frag_keyframe+empty_moov+default_base_moof";
+		if (options_->Get().libav_cmaf)
+			flags += "+cmaf";
+		av_dict_set(&mux_opts, "movflags", flags.c_str(), 0);
+		av_dict_set_int(&mux_opts, "min_frag_duration",
+						options_->Get().libav_fragment.get<std::chrono::microseconds>(), 0);
+		out_fmt_ctx_->flush_packets = 1;
+	}
+
+	ret = avformat_write_header(out_fmt_ctx_, &mux_opts);
+	av_dict_free(&mux_opts);
 	if (ret < 0)
 	{
 		av_strerror(ret, err, sizeof(err));
@@ -534,43 +607,87 @@ void LibAvEncoder::encode(AVPacket *pkt, unsigned int stream_id)
 			throw std::runtime_error("libav: error receiving packet: " + std::to_string(ret));
 
 		// Initialise the ouput mux on the first received video packet, as we may need
-		// to copy global header data from the encoder.
-		if (stream_id == Video && !output_ready_)
-		{
+		// to copy global header data from the encoder. The mux thread does this for
+		// anything but an elementary stream, before it writes the packet.
+		if (stream_id == Video && !output_ready_ && elementary_stream_)
 			initOutput();
-			output_ready_ = true;
-		}
 
 		pkt->stream_index = stream_id;
 		pkt->pos = -1;
 		pkt->duration = 0;
 
-		// Rescale from the codec timebase to the stream timebase.
-		av_packet_rescale_ts(pkt, codec_ctx_[stream_id]->time_base, out_fmt_ctx_->streams[stream_id]->time_base);
-
-		if (!elementary_stream_)
+		// The trace knows frames by the timestamp EncodeBuffer was given, before we rebased it. The codec
+		// timebase is microseconds so the packet's pts is still in those units here.
+		int64_t trace_ts = Trace::NO_TIMESTAMP;
+		if (stream_id == Video && Trace::Enabled())
 		{
-			std::scoped_lock<std::mutex> lock(output_mutex_);
-			// pkt is now blank (av_interleaved_write_frame() takes ownership of
-			// its contents and resets pkt), so that no unreferencing is necessary.
-			// This would be different if one used av_write_frame().
-			ret = av_interleaved_write_frame(out_fmt_ctx_, pkt);
-			if (ret < 0)
-			{
-				char err[AV_ERROR_MAX_STRING_SIZE];
-				av_strerror(ret, err, sizeof(err));
-				throw std::runtime_error("libav: error writing output: " + std::string(err));
-			}
+			trace_ts = pkt->pts + video_start_ts_ -
+					   (options_->Get().av_sync.value < 0us ? -options_->Get().av_sync.get<std::chrono::microseconds>() : 0);
+			Trace::Event(TraceHop::EncodeDequeued, Trace::NO_SEQUENCE, trace_ts);
 		}
+
+		if (!elementary_stream_)
+			queuePacket(pkt, stream_id, trace_ts);
 		else
 		{
+			// Rescale from the codec timebase to the stream timebase.
+			av_packet_rescale_ts(pkt, codec_ctx_[stream_id]->time_base, out_fmt_ctx_->streams[stream_id]->time_base);
 			// H.264 elementary streams use the Output class to write encoded data so that they can use features such as
 			// pause/circular/split/metadata, etc.
 			output_ready_callback_(pkt->data, pkt->size, pkt->pts, pkt->flags & AV_PKT_FLAG_KEY);
 		}
+
+		// Audio waits for the first video packet to be on its way to the mux.
+		if (stream_id == Video)
+			output_ready_ = true;
 	}
 }
 
+// Hand a packet over to the mux thread, leaving pkt blank. When --libav-mux-buffer is already full we either
+// wait for the mux to catch up, or with --libav-mux-drop, drop the packet and any video that depends on it.
+
+void LibAvEncoder::queuePacket(AVPacket *pkt, unsigned int stream_id, int64_t trace_ts)
+{
+	std::unique_lock<std::mutex> lock(mux_mutex_);
+	if (!mux_error_.empty())
+		throw std::runtime_error(mux_error_);
+
+	auto full = [this, pkt]() { return !mux_queue_.empty() && mux_bytes_ + pkt->size > mux_limit_; };
+	bool drop = stream_id == Video && mux_skip_to_key_ && !(pkt->flags & AV_PKT_FLAG_KEY);
+	if (!drop && full())
+	{
+		if (options_->Get().libav_mux_drop)
+		{
+			drop = true;
+			if (stream_id == Video)
+				mux_skip_to_key_ = true;
+		}
+		else
+		{
+			mux_space_cv_.wait(lock, [this, &full]() { return !mux_error_.empty() || !full(); });
+			if (!mux_error_.empty())
+				throw std::runtime_error(mux_error_);
+		}
+	}
+
+	if (drop)
+	{
+		if (!mux_dropped_++)
+			LOG(1, "libav: mux buffer full, dropping packets");
+		av_packet_unref(pkt);
+		return;
+	}
+
+	if (stream_id == Video)
+		mux_skip_to_key_ = false;
+	AVPacket *queued = av_packet_alloc();
+	av_packet_move_ref(queued, pkt);
+	mux_bytes_ += queued->size;
+	mux_queue_.push_back({ queued, stream_id, trace_ts });
+	lock.unlock();
+	mux_cv_.notify_one();
+}
+
 extern "C" void LibAvEncoder::releaseBuffer(void *opaque, uint8_t *data)
 {
 	LibAvEncoder *enc = static_cast<LibAvEncoder *>(opaque);
@@ -583,8 +700,34 @@ extern "C" void LibAvEncoder::releaseBuffer(void *opaque, uint8_t *data)
 		enc->drm_frame_queue_.pop();
 }
 
+void LibAvEncoder::applyControls(AVFrame *frame)
+{
+	if (!controls_)
+		return;
+
+	// libx264 reconfigures itself when it sees the rate control settings change, from this frame on.
+	uint32_t bitrate = controls_->bitrate.exchange(0);
+	if (bitrate && bitrate != codec_ctx_[Video]->bit_rate)
+	{
+		codec_ctx_[Video]->bit_rate = bitrate;
+		if (codec_ctx_[Video]->rc_max_rate)
+			codec_ctx_[Video]->rc_max_rate = bitrate;
+		LOG(2, "LibAvEncoder: bitrate now " << bitrate / 1000 << "kbps");
+	}
+
+	if (controls_->qp.exchange(EncoderControls::QP_UNCHANGED) != EncoderControls::QP_UNCHANGED ||
+		controls_->intra.exchange(0))
+		LOG(1, "LibAvEncoder: can't change the quantiser or intra period while running");
+
+	// Both libx264 and h264_v4l2m2m turn an I frame request into a keyframe.
+	if (controls_->keyframe.exchange(false))
+		frame->pict_type = AV_PICTURE_TYPE_I;
+}
+
 void LibAvEncoder::videoThread()
 {
+	ThreadConfig::Apply("encode");
+
 	AVPacket *pkt = av_packet_alloc();
 	AVFrame *frame = nullptr;
 
@@ -594,7 +737,6 @@ void LibAvEncoder::videoThread()
 			std::unique_lock<std::mutex> lock(video_mutex_);
 			while (true)
 			{
-				using namespace std::chrono_literals;
 				// Must check the abort first, to allow items in the output
 				// queue to have a callback.
 				if (abort_video_ && frame_queue_.empty())
@@ -607,10 +749,11 @@ void LibAvEncoder::videoThread()
 					break;
 				}
 				else
-					video_cv_.wait_for(lock, 200ms);
+					video_cv_.wait(lock);
 			}
 		}
 
+		applyControls(frame);
 		int ret = avcodec_send_frame(codec_ctx_[Video], frame);
 		if (ret < 0)
 			throw std::runtime_error("libav: error encoding frame: " + std::to_string(ret));
@@ -625,11 +768,78 @@ done:
 	encode(pkt, Video);
 
 	av_packet_free(&pkt);
+	if (elementary_stream_)
+		deinitOutput();
+}
+
+void LibAvEncoder::muxThread()
+{
+	ThreadConfig::Apply("output");
+
+	while (true)
+	{
+		MuxPacket item;
+		bool failed = false;
+		{
+			std::unique_lock<std::mutex> lock(mux_mutex_);
+			mux_cv_.wait(lock, [this]() { return abort_mux_ || !mux_queue_.empty(); });
+			if (mux_queue_.empty())
+				break;
+			item = mux_queue_.front();
+			mux_queue_.pop_front();
+			mux_bytes_ -= item.pkt->size;
+			failed = !mux_error_.empty();
+		}
+		mux_space_cv_.notify_all();
+
+		// After a failure, keep emptying the queue so that nothing waits on it.
+		if (!failed)
+		{
+			try
+			{
+				if (!output_initialised_)
+					initOutput();
+
+				// Rescale from the codec timebase to the stream timebase, which the muxer may have changed
+				// when it wrote the header.
+				av_packet_rescale_ts(item.pkt, codec_ctx_[item.stream_id]->time_base,
+									 out_fmt_ctx_->streams[item.stream_id]->time_base);
+
+				// av_interleaved_write_frame() takes ownership of the packet's contents
+				// and resets it, leaving only the AVPacket itself to free.
+				int ret = av_interleaved_write_frame(out_fmt_ctx_, item.pkt);
+				if (ret < 0)
+				{
+					char err[AV_ERROR_MAX_STRING_SIZE];
+					av_strerror(ret, err, sizeof(err));
+					throw std::runtime_error("libav: error writing output: " + std::string(err));
+				}
+				if (item.stream_id == Video)
+					Trace::Event(TraceHop::Written, Trace::NO_SEQUENCE, item.trace_ts);
+			}
+			catch (std::exception const &e)
+			{
+				// The encoding threads throw this the next time they have a packet for us.
+				LOG_ERROR("ERROR: " << e.what());
+				{
+					std::lock_guard<std::mutex> lock(mux_mutex_);
+					mux_error_ = e.what();
+				}
+				mux_space_cv_.notify_all();
+			}
+		}
+		av_packet_free(&item.pkt);
+	}
+
+	if (mux_dropped_)
+		LOG(1, "libav: dropped " << mux_dropped_ << " packets while the mux was behind");
 	deinitOutput();
 }
 
 void LibAvEncoder::audioThread()
 {
+	ThreadConfig::Apply("audio");
+
 	const AVSampleFormat required_fmt = codec_ctx_[AudioOut]->sample_fmt;
 	int ret;
 
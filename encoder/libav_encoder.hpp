@@ -9,6 +9,7 @@
 
 #include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <memory>
 #include <mutex>
 #include <queue>
@@ -42,7 +43,7 @@ public:
 	LibAvEncoder(VideoOptions const *options, StreamInfo const &info);
 	~LibAvEncoder();
 	// Encode the given DMABUF.
-	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	bool EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
 
 private:
 	void initVideoCodec(VideoOptions const *options, StreamInfo const &info);
@@ -52,9 +53,12 @@ private:
 	void initOutput();
 	void deinitOutput();
 	void encode(AVPacket *pkt, unsigned int stream_id);
+	void queuePacket(AVPacket *pkt, unsigned int stream_id, int64_t trace_ts);
 
 	void videoThread();
+	void applyControls(AVFrame *frame);
 	void audioThread();
+	void muxThread();
 
 	static void releaseBuffer(void *opaque, uint8_t *data);
 
@@ -65,11 +69,29 @@ private:
 
 	std::queue<AVFrame *> frame_queue_;
 	std::mutex video_mutex_;
-	std::mutex output_mutex_;
 	std::condition_variable video_cv_;
 	std::thread video_thread_;
 	std::thread audio_thread_;
 
+	// Encoded packets waiting for the mux thread to write them out, still in the codec timebase.
+	struct MuxPacket
+	{
+		AVPacket *pkt;
+		unsigned int stream_id;
+		int64_t trace_ts;
+	};
+	std::deque<MuxPacket> mux_queue_;
+	size_t mux_bytes_;
+	size_t mux_limit_;
+	bool mux_skip_to_key_;
+	uint64_t mux_dropped_;
+	bool abort_mux_;
+	std::string mux_error_;
+	std::mutex mux_mutex_;
+	std::condition_variable mux_cv_;
+	std::condition_variable mux_space_cv_;
+	std::thread mux_thread_;
+
 	// The ordering in the enum below must not change!
 	enum Context { Video = 0, AudioOut = 1, AudioIn = 2 };
 	AVCodecContext *codec_ctx_[3];
@@ -5,22 +5,105 @@
  * mjpeg_encoder.cpp - mjpeg video encoder.
  */
 
+#include <errno.h>
+
 #include <chrono>
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <stdexcept>
 
 #include <jpeglib.h>
 
+#include "core/thread_config.hpp"
+
+#include "config.h"
 #include "mjpeg_encoder.hpp"
 
-#if JPEG_LIB_VERSION_MAJOR > 9 || (JPEG_LIB_VERSION_MAJOR == 9 && JPEG_LIB_VERSION_MINOR >= 4)
-typedef size_t jpeg_mem_len_t;
-#else
-typedef unsigned long jpeg_mem_len_t;
+#ifdef TURBOJPEG_PRESENT
+#include <turbojpeg.h>
+#endif
+
+// A libjpeg destination that writes into a std::vector, doubling its size should it ever fill up.
+
+struct VectorDestination
+{
+	jpeg_destination_mgr pub;
+	std::vector<uint8_t> *buffer;
+};
+
+static void vector_init_destination(j_compress_ptr cinfo)
+{
+	VectorDestination *dest = (VectorDestination *)cinfo->dest;
+	dest->pub.next_output_byte = dest->buffer->data();
+	dest->pub.free_in_buffer = dest->buffer->size();
+}
+
+static boolean vector_empty_output_buffer(j_compress_ptr cinfo)
+{
+	VectorDestination *dest = (VectorDestination *)cinfo->dest;
+	size_t used = dest->buffer->size();
+	dest->buffer->resize(2 * used);
+	LOG(2, "MjpegEncoder: output buffer grown to " << dest->buffer->size() << " bytes");
+	dest->pub.next_output_byte = dest->buffer->data() + used;
+	dest->pub.free_in_buffer = dest->buffer->size() - used;
+	return TRUE;
+}
+
+static void vector_term_destination(j_compress_ptr cinfo)
+{
+}
+
+#ifdef TURBOJPEG_PRESENT
+// With TurboJPEG, each encode thread keeps a handle with these settings, and the frame's strided planes
+// are encoded in one call, straight into a buffer grown to the worst case size first.
+
+struct TurboDeleter
+{
+	void operator()(void *tj) const { tj3Destroy(tj); }
+};
+using TurboHandle = std::unique_ptr<void, TurboDeleter>;
+
+static TurboHandle turbo_init(VideoOptions const *options)
+{
+	TurboHandle tj(tj3Init(TJINIT_COMPRESS));
+	if (!tj)
+		throw std::runtime_error("MjpegEncoder: failed to create TurboJPEG encoder");
+	tj3Set(tj.get(), TJPARAM_QUALITY, options->Get().quality);
+	tj3Set(tj.get(), TJPARAM_SUBSAMP, TJSAMP_420);
+	tj3Set(tj.get(), TJPARAM_FASTDCT, options->Get().jpeg_fast_dct);
+	tj3Set(tj.get(), TJPARAM_OPTIMIZE, options->Get().jpeg_optimize);
+	tj3Set(tj.get(), TJPARAM_NOREALLOC, 1);
+	return tj;
+}
+
+static size_t turbo_encode(tjhandle tj, void *mem, StreamInfo const &info, std::vector<uint8_t> &encoded_buffer)
+{
+	int stride2 = info.stride / 2;
+	const uint8_t *Y = (const uint8_t *)mem, *U = Y + info.stride * info.height;
+	const unsigned char *planes[3] = { Y, U, U + stride2 * (info.height / 2) };
+	int strides[3] = { (int)info.stride, stride2, stride2 };
+
+	size_t size = tj3JPEGBufSize(info.width, info.height, TJSAMP_420);
+	if (encoded_buffer.size() < size)
+		encoded_buffer.resize(size);
+	unsigned char *dest = encoded_buffer.data();
+	if (tj3CompressFromYUVPlanes8(tj, planes, info.width, strides, info.height, &dest, &size))
+		throw std::runtime_error(std::string("MjpegEncoder: TurboJPEG encode failed: ") + tj3GetErrorStr(tj));
+	return size;
+}
 #endif
 
 MjpegEncoder::MjpegEncoder(VideoOptions const *options)
 	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0)
 {
+	sem_init(&encode_sem_, 0, 0);
+	for (unsigned int i = 0; i < OUTPUT_DEPTH; i++)
+	{
+		output_slots_[i].sequence.store(i, std::memory_order_relaxed);
+		sem_init(&output_slots_[i].ready, 0, 0);
+	}
+
 	output_thread_ = std::thread(&MjpegEncoder::outputThread, this);
 	for (int i = 0; i < NUM_ENC_THREADS; i++)
 		encode_thread_[i] = std::thread(std::bind(&MjpegEncoder::encodeThread, this, i));
@@ -30,23 +113,69 @@ MjpegEncoder::MjpegEncoder(VideoOptions const *options)
 MjpegEncoder::~MjpegEncoder()
 {
 	abortEncode_ = true;
+	for (int i = 0; i < NUM_ENC_THREADS; i++)
+		sem_post(&encode_sem_);
 	for (int i = 0; i < NUM_ENC_THREADS; i++)
 		encode_thread_[i].join();
+
+	// Every frame has now been published, so the output thread will end up waiting on the slot
+	// for the frame that never arrives. Wake it there.
 	abortOutput_ = true;
+	sem_post(&output_slots_[index_ % OUTPUT_DEPTH].ready);
 	output_thread_.join();
+
+	sem_destroy(&encode_sem_);
+	for (auto &slot : output_slots_)
+		sem_destroy(&slot.ready);
 	LOG(2, "MjpegEncoder closed");
 }
 
-void MjpegEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
+bool MjpegEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
+{
+	// The frame index is only used up if the frame is accepted, as the output thread is waiting for it.
+	EncodeItem item = { mem, info, timestamp_us, index_ };
+	if (!encode_queue_.Push(item))
+	{
+		dropped_frames_++;
+		return false;
+	}
+	index_++;
+	sem_post(&encode_sem_);
+	return true;
+}
+
+// Retry sem_wait if a signal interrupts it.
+static void sem_wait_intr(sem_t *sem)
 {
-	std::lock_guard<std::mutex> lock(encode_mutex_);
-	EncodeItem item = { mem, info, timestamp_us, index_++ };
-	encode_queue_.push(item);
-	encode_cond_var_.notify_all();
+	while (sem_wait(sem) == -1 && errno == EINTR)
+	{
+	}
+}
+
+std::vector<uint8_t> *MjpegEncoder::getBuffer(int num, size_t size)
+{
+	std::vector<uint8_t> *buffer;
+	{
+		std::lock_guard<std::mutex> lock(buffer_mutex_);
+		if (!free_buffers_[num].empty())
+		{
+			buffer = free_buffers_[num].back();
+			free_buffers_[num].pop_back();
+		}
+		else
+		{
+			buffers_[num].push_back(std::make_unique<std::vector<uint8_t>>());
+			buffer = buffers_[num].back().get();
+		}
+	}
+
+	if (buffer->size() < size)
+		buffer->resize(size);
+	return buffer;
 }
 
-void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer,
-							  size_t &buffer_len)
+void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item,
+							  std::vector<uint8_t> &encoded_buffer, size_t &buffer_len)
 {
 	// Copied from YUV420_to_JPEG_fast in jpeg.cpp.
 	cinfo.image_width = item.info.width;
@@ -58,10 +187,10 @@ void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &it
 	jpeg_set_defaults(&cinfo);
 	cinfo.raw_data_in = TRUE;
 	jpeg_set_quality(&cinfo, options_->Get().quality, TRUE);
-	encoded_buffer = nullptr;
-	buffer_len = 0;
-	jpeg_mem_len_t jpeg_mem_len;
-	jpeg_mem_dest(&cinfo, &encoded_buffer, &jpeg_mem_len);
+	cinfo.dct_method = options_->Get().jpeg_fast_dct ? JDCT_IFAST : JDCT_ISLOW;
+	cinfo.optimize_coding = options_->Get().jpeg_optimize;
+	VectorDestination *dest = (VectorDestination *)cinfo.dest;
+	dest->buffer = &encoded_buffer;
 	jpeg_start_compress(&cinfo, TRUE);
 
 	int stride2 = item.info.stride / 2;
@@ -88,50 +217,55 @@ void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &it
 	}
 
 	jpeg_finish_compress(&cinfo);
-	buffer_len = jpeg_mem_len;
+	buffer_len = encoded_buffer.size() - dest->pub.free_in_buffer;
 }
 
 void MjpegEncoder::encodeThread(int num)
 {
+	ThreadConfig::Apply("encode");
+
 	struct jpeg_compress_struct cinfo;
 	struct jpeg_error_mgr jerr;
 	cinfo.err = jpeg_std_error(&jerr);
 	jpeg_create_compress(&cinfo);
+	VectorDestination dest;
+	dest.pub.init_destination = vector_init_destination;
+	dest.pub.empty_output_buffer = vector_empty_output_buffer;
+	dest.pub.term_destination = vector_term_destination;
+	dest.buffer = nullptr;
+	cinfo.dest = &dest.pub;
+#ifdef TURBOJPEG_PRESENT
+	TurboHandle tj = turbo_init(options_);
+#endif
 	std::chrono::duration<double> encode_time(0);
 	uint32_t frames = 0;
 
-	EncodeItem encode_item;
 	while (true)
 	{
+		sem_wait_intr(&encode_sem_);
+		std::optional<EncodeItem> next = encode_queue_.Pop();
+		if (!next)
 		{
-			std::unique_lock<std::mutex> lock(encode_mutex_);
-			while (true)
-			{
-				using namespace std::chrono_literals;
-				if (abortEncode_ && encode_queue_.empty())
-				{
-					if (frames)
-						LOG(2, "Encode " << frames << " frames, average time " << encode_time.count() * 1000 / frames
-										 << "ms");
-					jpeg_destroy_compress(&cinfo);
-					return;
-				}
-				if (!encode_queue_.empty())
-				{
-					encode_item = encode_queue_.front();
-					encode_queue_.pop();
-					break;
-				}
-				else
-					encode_cond_var_.wait_for(lock, 200ms);
-			}
+			// Only the wakeups on closing find nothing to do (as the queue is drained first).
+			if (!abortEncode_)
+				continue;
+			if (frames)
+				LOG(2, "Encode " << frames << " frames, average time " << encode_time.count() * 1000 / frames << "ms");
+			jpeg_destroy_compress(&cinfo);
+			return;
 		}
+		EncodeItem &encode_item = *next;
 
-		// Encode the buffer.
-		uint8_t *encoded_buffer = nullptr;
+		// Encode the buffer. Starting with the size of the YUV image should almost never overflow.
+		std::vector<uint8_t> *encoded_buffer =
+			getBuffer(num, encode_item.info.stride * encode_item.info.height * 3 / 2);
 		size_t buffer_len = 0;
 		auto start_time = std::chrono::high_resolution_clock::now();
-		encodeJPEG(cinfo, encode_item, encoded_buffer, buffer_len);
+#ifdef TURBOJPEG_PRESENT
+		buffer_len = turbo_encode(tj.get(), encode_item.mem, encode_item.info, *encoded_buffer);
+#else
+		encodeJPEG(cinfo, encode_item, *encoded_buffer, buffer_len);
+#endif
 		encode_time += (std::chrono::high_resolution_clock::now() - start_time);
 		frames++;
 		// Don't return buffers until the output thread as that's where they're
@@ -139,55 +273,44 @@ void MjpegEncoder::encodeThread(int num)
 
 		// We push this encoded buffer to another thread so that our
 		// application can take its time with the data without blocking the
-		// encode process.
-		OutputItem output_item = { encoded_buffer, buffer_len, encode_item.timestamp_us, encode_item.index };
-		std::lock_guard<std::mutex> lock(output_mutex_);
-		output_queue_[num].push(output_item);
-		output_cond_var_.notify_one();
+		// encode process. If the output has fallen a whole ring behind, we
+		// must wait for it.
+		OutputSlot &slot = output_slots_[encode_item.index % OUTPUT_DEPTH];
+		while (slot.sequence.load(std::memory_order_acquire) != encode_item.index)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		slot.item = { encoded_buffer, buffer_len, encode_item.timestamp_us, encode_item.index, num };
+		slot.sequence.store(encode_item.index + 1, std::memory_order_release);
+		sem_post(&slot.ready);
 	}
 }
 
 void MjpegEncoder::outputThread()
 {
-	OutputItem item;
+	ThreadConfig::Apply("enc-output");
+
 	uint64_t index = 0;
 	while (true)
 	{
+		// Wait for the frame we want next. The only other thing that wakes us is the abort, once
+		// all the frames have been output.
+		OutputSlot &slot = output_slots_[index % OUTPUT_DEPTH];
+		sem_wait_intr(&slot.ready);
+		if (slot.sequence.load(std::memory_order_acquire) != index + 1)
 		{
-			std::unique_lock<std::mutex> lock(output_mutex_);
-			while (true)
-			{
-				using namespace std::chrono_literals;
-				// We look for the thread that's completed the frame we want next.
-				// If we don't find it, we wait.
-				//
-				// Must also check for an abort signal, and if set, all queues must
-				// be empty. This is done first to ensure all frame callbacks have
-				// had a chance to run.
-				bool abort = abortOutput_ ? true : false;
-				for (auto &q : output_queue_)
-				{
-					if (abort && !q.empty())
-						abort = false;
-
-					if (!q.empty() && q.front().index == index)
-					{
-						item = q.front();
-						q.pop();
-						goto got_item;
-					}
-				}
-				if (abort)
-					return;
-
-				output_cond_var_.wait_for(lock, 200ms);
-			}
+			if (abortOutput_)
+				return;
+			continue;
 		}
-	got_item:
+		OutputItem item = slot.item;
+		slot.sequence.store(index + OUTPUT_DEPTH, std::memory_order_release);
+
 		input_done_callback_(nullptr);
 
-		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
-		free(item.mem);
+		output_ready_callback_(item.buffer->data(), item.bytes_used, item.timestamp_us, true);
+		{
+			std::lock_guard<std::mutex> lock(buffer_mutex_);
+			free_buffers_[item.thread].push_back(item.buffer);
+		}
 		index++;
 	}
 }
@@ -7,10 +7,15 @@
 
 #pragma once
 
-#include <condition_variable>
+#include <semaphore.h>
+
+#include <atomic>
+#include <memory>
 #include <mutex>
-#include <queue>
 #include <thread>
+#include <vector>
+
+#include "core/lockfree_queue.hpp"
 
 #include "encoder.hpp"
 
@@ -22,7 +27,7 @@ public:
 	MjpegEncoder(VideoOptions const *options);
 	~MjpegEncoder();
 	// Encode the given buffer.
-	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	bool EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
 
 private:
 	// How many threads to use. Whichever thread is idle will pick up the next frame.
@@ -36,8 +41,8 @@ private:
 	// re-use.
 	void outputThread();
 
-	bool abortEncode_;
-	bool abortOutput_;
+	std::atomic<bool> abortEncode_;
+	std::atomic<bool> abortOutput_;
 	uint64_t index_;
 
 	struct EncodeItem
@@ -47,21 +52,40 @@ private:
 		int64_t timestamp_us;
 		uint64_t index;
 	};
-	std::queue<EncodeItem> encode_queue_;
-	std::mutex encode_mutex_;
-	std::condition_variable encode_cond_var_;
+	// Frames for encoding, and a count of them that the encode threads wait on.
+	LockFreeQueue<EncodeItem, 64> encode_queue_;
+	sem_t encode_sem_;
 	std::thread encode_thread_[NUM_ENC_THREADS];
-	void encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len);
+	void encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, std::vector<uint8_t> &encoded_buffer,
+					size_t &buffer_len);
+
+	// Each encode thread keeps its own output buffers, which come back to it once the output
+	// callback is done with them, so that after the first few frames nothing gets allocated.
+	// A buffer only grows if a frame ever overflows it.
+	std::vector<std::unique_ptr<std::vector<uint8_t>>> buffers_[NUM_ENC_THREADS];
+	std::vector<std::vector<uint8_t> *> free_buffers_[NUM_ENC_THREADS];
+	std::mutex buffer_mutex_;
+	std::vector<uint8_t> *getBuffer(int num, size_t size);
 
 	struct OutputItem
 	{
-		void *mem;
+		std::vector<uint8_t> *buffer;
 		size_t bytes_used;
 		int64_t timestamp_us;
 		uint64_t index;
+		int thread;
+	};
+	// Encoded frames are put back in order in this ring, frame n going in slot n % OUTPUT_DEPTH. The
+	// slot's sequence number says whose turn it is: n when frame n may be written to it, n + 1 once
+	// it has been, and so none of the threads needs a lock. The output thread sleeps on the ready
+	// semaphore of the one slot it wants next.
+	static const unsigned int OUTPUT_DEPTH = 4 * NUM_ENC_THREADS;
+	struct alignas(64) OutputSlot
+	{
+		std::atomic<uint64_t> sequence;
+		sem_t ready;
+		OutputItem item;
 	};
-	std::queue<OutputItem> output_queue_[NUM_ENC_THREADS];
-	std::mutex output_mutex_;
-	std::condition_variable output_cond_var_;
+	OutputSlot output_slots_[OUTPUT_DEPTH];
 	std::thread output_thread_;
 };
@@ -9,6 +9,8 @@
 #include <iostream>
 #include <stdexcept>
 
+#include "core/thread_config.hpp"
+
 #include "null_encoder.hpp"
 
 NullEncoder::NullEncoder(VideoOptions const *options) : Encoder(options), abort_(false)
@@ -19,43 +21,41 @@ NullEncoder::NullEncoder(VideoOptions const *options) : Encoder(options), abort_
 
 NullEncoder::~NullEncoder()
 {
-	abort_ = true;
+	{
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		abort_ = true;
+	}
+	output_cond_var_.notify_all();
 	output_thread_.join();
 	LOG(2, "NullEncoder closed");
 }
 
 // Push the buffer onto the output queue to be "encoded" and returned.
-void NullEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
+bool NullEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
 {
 	std::lock_guard<std::mutex> lock(output_mutex_);
 	OutputItem item = { mem, size, timestamp_us };
 	output_queue_.push(item);
 	output_cond_var_.notify_one();
+	return true;
 }
 
 // Realistically we would probably want more of a queue as the caller's number
 // of buffers limits the amount of queueing possible here...
 void NullEncoder::outputThread()
 {
+	ThreadConfig::Apply("enc-output");
+
 	OutputItem item;
 	while (true)
 	{
 		{
 			std::unique_lock<std::mutex> lock(output_mutex_);
-			while (true)
-			{
-				using namespace std::chrono_literals;
-				if (!output_queue_.empty())
-				{
-					item = output_queue_.front();
-					output_queue_.pop();
-					break;
-				}
-				else
-					output_cond_var_.wait_for(lock, 200ms);
-				if (abort_)
-					return;
-			}
+			output_cond_var_.wait(lock, [this] { return abort_ || !output_queue_.empty(); });
+			if (output_queue_.empty())
+				return;
+			item = output_queue_.front();
+			output_queue_.pop();
 		}
 		// Ensure the input done callback happens before the output ready callback.
 		// This is needed as the metadata queue gets pushed in the former, and popped
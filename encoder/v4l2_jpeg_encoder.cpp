@@ -0,0 +1,388 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * v4l2_jpeg_encoder.cpp - mjpeg video encoder using a V4L2 M2M JPEG codec.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <linux/videodev2.h>
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+#include "core/thread_config.hpp"
+#include "core/trace.hpp"
+
+#include "v4l2_jpeg_encoder.hpp"
+
+static int xioctl(int fd, unsigned long ctl, void *arg)
+{
+	int ret, num_tries = 10;
+	do
+	{
+		ret = ioctl(fd, ctl, arg);
+	} while (ret == -1 && errno == EINTR && num_tries-- > 0);
+	return ret;
+}
+
+static bool has_format(int fd, v4l2_buf_type type, std::initializer_list<uint32_t> fourccs)
+{
+	v4l2_fmtdesc desc = {};
+	desc.type = type;
+	for (desc.index = 0; xioctl(fd, VIDIOC_ENUM_FMT, &desc) == 0; desc.index++)
+	{
+		for (uint32_t fourcc : fourccs)
+		{
+			if (desc.pixelformat == fourcc)
+				return true;
+		}
+	}
+	return false;
+}
+
+std::string V4l2JpegEncoder::FindDevice()
+{
+	for (unsigned int i = 0; i < 64; i++)
+	{
+		std::string device_name = "/dev/video" + std::to_string(i);
+		int fd = open(device_name.c_str(), O_RDWR, 0);
+		if (fd < 0)
+			continue;
+
+		v4l2_capability caps = {};
+		bool found = xioctl(fd, VIDIOC_QUERYCAP, &caps) == 0 &&
+					 (caps.device_caps & V4L2_CAP_VIDEO_M2M_MPLANE) &&
+					 has_format(fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, { V4L2_PIX_FMT_JPEG, V4L2_PIX_FMT_MJPEG }) &&
+					 has_format(fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, { V4L2_PIX_FMT_YUV420 });
+		close(fd);
+		if (found)
+			return device_name;
+	}
+
+	return {};
+}
+
+V4l2JpegEncoder::V4l2JpegEncoder(VideoOptions const *options, StreamInfo const &info)
+	: Encoder(options), abortPoll_(false), abortOutput_(false), num_capture_buffers_(0)
+{
+	std::string device_name = FindDevice();
+	if (device_name.empty())
+		throw std::runtime_error("no V4L2 JPEG encoder found");
+	fd_ = open(device_name.c_str(), O_RDWR, 0);
+	if (fd_ < 0)
+		throw std::runtime_error("failed to open V4L2 JPEG encoder " + device_name);
+	LOG(2, "Opened V4l2JpegEncoder on " << device_name << " as fd " << fd_);
+
+	abort_fd_ = eventfd(0, EFD_CLOEXEC);
+	if (abort_fd_ < 0)
+	{
+		close(fd_);
+		throw std::runtime_error("failed to create abort eventfd");
+	}
+
+	try
+	{
+		configure(options, info);
+	}
+	catch (std::exception const &e)
+	{
+		releaseBuffers();
+		close(abort_fd_);
+		close(fd_);
+		throw;
+	}
+
+	output_thread_ = std::thread(&V4l2JpegEncoder::outputThread, this);
+	poll_thread_ = std::thread(&V4l2JpegEncoder::pollThread, this);
+}
+
+void V4l2JpegEncoder::configure(VideoOptions const *options, StreamInfo const &info)
+{
+	v4l2_control ctrl = {};
+	ctrl.id = V4L2_CID_JPEG_COMPRESSION_QUALITY;
+	ctrl.value = options->Get().quality;
+	if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+		LOG(1, "V4l2JpegEncoder: failed to set quality");
+
+	// The codec reads straight from the camera's YUV420 buffers, and writes out JPEGs.
+
+	v4l2_format fmt = {};
+	fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	fmt.fmt.pix_mp.width = info.width;
+	fmt.fmt.pix_mp.height = info.height;
+	fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_YUV420;
+	fmt.fmt.pix_mp.plane_fmt[0].bytesperline = info.stride;
+	fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+	fmt.fmt.pix_mp.colorspace = V4L2_COLORSPACE_JPEG;
+	fmt.fmt.pix_mp.num_planes = 1;
+	if (xioctl(fd_, VIDIOC_S_FMT, &fmt) < 0)
+		throw std::runtime_error("failed to set output format");
+	if (fmt.fmt.pix_mp.width != info.width || fmt.fmt.pix_mp.height != info.height ||
+		fmt.fmt.pix_mp.plane_fmt[0].bytesperline != info.stride)
+		throw std::runtime_error("V4L2 JPEG encoder does not support this image size");
+
+	fmt = {};
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	fmt.fmt.pix_mp.width = info.width;
+	fmt.fmt.pix_mp.height = info.height;
+	fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_JPEG;
+	fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+	fmt.fmt.pix_mp.colorspace = V4L2_COLORSPACE_JPEG;
+	fmt.fmt.pix_mp.num_planes = 1;
+	fmt.fmt.pix_mp.plane_fmt[0].bytesperline = 0;
+	// Even at high quality a JPEG should not be bigger than the YUV image.
+	fmt.fmt.pix_mp.plane_fmt[0].sizeimage = info.stride * info.height * 3 / 2;
+	if (xioctl(fd_, VIDIOC_S_FMT, &fmt) < 0)
+		throw std::runtime_error("failed to set capture format");
+	if (fmt.fmt.pix_mp.pixelformat != V4L2_PIX_FMT_JPEG)
+	{
+		fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_MJPEG;
+		if (xioctl(fd_, VIDIOC_S_FMT, &fmt) < 0 || fmt.fmt.pix_mp.pixelformat != V4L2_PIX_FMT_MJPEG)
+			throw std::runtime_error("failed to set JPEG capture format");
+	}
+
+	// Input buffers are the caller's DMABUFs, encoded JPEGs go into buffers that we mmap.
+
+	v4l2_requestbuffers reqbufs = {};
+	reqbufs.count = NUM_OUTPUT_BUFFERS;
+	reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	reqbufs.memory = V4L2_MEMORY_DMABUF;
+	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+		throw std::runtime_error("request for output buffers failed");
+	LOG(2, "Got " << reqbufs.count << " output buffers");
+
+	for (unsigned int i = 0; i < reqbufs.count; i++)
+		input_buffers_available_.push(i);
+
+	reqbufs = {};
+	reqbufs.count = NUM_CAPTURE_BUFFERS;
+	reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	reqbufs.memory = V4L2_MEMORY_MMAP;
+	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+		throw std::runtime_error("request for capture buffers failed");
+	LOG(2, "Got " << reqbufs.count << " capture buffers");
+
+	for (unsigned int i = 0; i < std::min<unsigned int>(reqbufs.count, NUM_CAPTURE_BUFFERS); i++)
+	{
+		v4l2_plane planes[VIDEO_MAX_PLANES];
+		v4l2_buffer buffer = {};
+		buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		buffer.memory = V4L2_MEMORY_MMAP;
+		buffer.index = i;
+		buffer.length = 1;
+		buffer.m.planes = planes;
+		if (xioctl(fd_, VIDIOC_QUERYBUF, &buffer) < 0)
+			throw std::runtime_error("failed to capture query buffer " + std::to_string(i));
+		buffers_[i].mem = mmap(0, buffer.m.planes[0].length, PROT_READ | PROT_WRITE, MAP_SHARED, fd_,
+							   buffer.m.planes[0].m.mem_offset);
+		if (buffers_[i].mem == MAP_FAILED)
+			throw std::runtime_error("failed to mmap capture buffer " + std::to_string(i));
+		buffers_[i].size = buffer.m.planes[0].length;
+		num_capture_buffers_++;
+		if (xioctl(fd_, VIDIOC_QBUF, &buffer) < 0)
+			throw std::runtime_error("failed to queue capture buffer " + std::to_string(i));
+	}
+
+	v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	if (xioctl(fd_, VIDIOC_STREAMON, &type) < 0)
+		throw std::runtime_error("failed to start output streaming");
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	if (xioctl(fd_, VIDIOC_STREAMON, &type) < 0)
+		throw std::runtime_error("failed to start capture streaming");
+	LOG(2, "JPEG codec streaming started");
+}
+
+void V4l2JpegEncoder::releaseBuffers()
+{
+	v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	xioctl(fd_, VIDIOC_STREAMOFF, &type);
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	xioctl(fd_, VIDIOC_STREAMOFF, &type);
+
+	v4l2_requestbuffers reqbufs = {};
+	reqbufs.count = 0;
+	reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	reqbufs.memory = V4L2_MEMORY_DMABUF;
+	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+		LOG(1, "Request to free output buffers failed");
+
+	for (int i = 0; i < num_capture_buffers_; i++)
+		if (munmap(buffers_[i].mem, buffers_[i].size) < 0)
+			LOG(1, "Failed to unmap buffer");
+	num_capture_buffers_ = 0;
+	reqbufs = {};
+	reqbufs.count = 0;
+	reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	reqbufs.memory = V4L2_MEMORY_MMAP;
+	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+		LOG(1, "Request to free capture buffers failed");
+}
+
+V4l2JpegEncoder::~V4l2JpegEncoder()
+{
+	abortPoll_ = true;
+	uint64_t one = 1;
+	if (write(abort_fd_, &one, sizeof(one)) != sizeof(one))
+		LOG(1, "Failed to signal abort to poll thread");
+	poll_thread_.join();
+	{
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		abortOutput_ = true;
+	}
+	output_cond_var_.notify_all();
+	output_thread_.join();
+	close(abort_fd_);
+
+	releaseBuffers();
+	close(fd_);
+	LOG(2, "V4l2JpegEncoder closed");
+}
+
+bool V4l2JpegEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
+{
+	int index;
+	{
+		std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
+		if (input_buffers_available_.empty())
+		{
+			// Every JPEG stands alone, so we can simply drop the frame.
+			dropped_frames_++;
+			return false;
+		}
+		index = input_buffers_available_.front();
+		input_buffers_available_.pop();
+	}
+	v4l2_buffer buf = {};
+	v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+	buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	buf.index = index;
+	buf.field = V4L2_FIELD_NONE;
+	buf.memory = V4L2_MEMORY_DMABUF;
+	buf.length = 1;
+	buf.timestamp.tv_sec = timestamp_us / 1000000;
+	buf.timestamp.tv_usec = timestamp_us % 1000000;
+	buf.m.planes = planes;
+	buf.m.planes[0].m.fd = fd;
+	buf.m.planes[0].bytesused = size;
+	buf.m.planes[0].length = size;
+	if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0)
+		throw std::runtime_error("failed to queue input to JPEG codec");
+	return true;
+}
+
+void V4l2JpegEncoder::pollThread()
+{
+	ThreadConfig::Apply("encode");
+
+	while (true)
+	{
+		// Once we're aborting there's no need to watch the abort_fd_ (which stays readable), we
+		// just wait for the codec to give back all the buffers.
+		bool abort = abortPoll_;
+		if (abort)
+		{
+			std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
+			if (input_buffers_available_.size() == NUM_OUTPUT_BUFFERS)
+				break;
+		}
+		pollfd fds[2] = { { fd_, POLLIN, 0 }, { abort_fd_, POLLIN, 0 } };
+		pollfd &p = fds[0];
+		int ret = poll(fds, abort ? 1 : 2, -1);
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error("unexpected errno " + std::to_string(errno) + " from poll");
+		}
+		if (p.revents & POLLIN)
+		{
+			v4l2_buffer buf = {};
+			v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+			buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+			buf.memory = V4L2_MEMORY_DMABUF;
+			buf.length = 1;
+			buf.m.planes = planes;
+			if (xioctl(fd_, VIDIOC_DQBUF, &buf) == 0)
+			{
+				{
+					std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
+					input_buffers_available_.push(buf.index);
+				}
+				input_done_callback_(nullptr);
+			}
+
+			buf = {};
+			memset(planes, 0, sizeof(planes));
+			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+			buf.memory = V4L2_MEMORY_MMAP;
+			buf.length = 1;
+			buf.m.planes = planes;
+			if (xioctl(fd_, VIDIOC_DQBUF, &buf) == 0)
+			{
+				int64_t timestamp_us = (buf.timestamp.tv_sec * (int64_t)1000000) + buf.timestamp.tv_usec;
+				Trace::Event(TraceHop::EncodeDequeued, Trace::NO_SEQUENCE, timestamp_us);
+				OutputItem item = { buffers_[buf.index].mem, buf.m.planes[0].bytesused, buf.m.planes[0].length,
+									buf.index, timestamp_us };
+				std::lock_guard<std::mutex> lock(output_mutex_);
+				output_queue_.push(item);
+				output_cond_var_.notify_one();
+			}
+		}
+	}
+}
+
+void V4l2JpegEncoder::outputThread()
+{
+	ThreadConfig::Apply("enc-output");
+
+	OutputItem item;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(output_mutex_);
+			while (true)
+			{
+				if (abortOutput_ && output_queue_.empty())
+					return;
+
+				if (!output_queue_.empty())
+				{
+					item = output_queue_.front();
+					output_queue_.pop();
+					break;
+				}
+				else
+					output_cond_var_.wait(lock);
+			}
+		}
+
+		// Every JPEG is a keyframe.
+		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
+		v4l2_buffer buf = {};
+		v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = item.index;
+		buf.length = 1;
+		buf.m.planes = planes;
+		buf.m.planes[0].bytesused = 0;
+		buf.m.planes[0].length = item.length;
+		if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0)
+			throw std::runtime_error("failed to re-queue encoded buffer");
+	}
+}
+
+static Encoder *Create(VideoOptions *options, StreamInfo const &info)
+{
+	return new V4l2JpegEncoder(options, info);
+}
+
+static RegisterEncoder reg("v4l2_jpeg", &Create);
@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * v4l2_jpeg_encoder.hpp - mjpeg video encoder using a V4L2 M2M JPEG codec.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+
+#include "encoder.hpp"
+
+class V4l2JpegEncoder : public Encoder
+{
+public:
+	V4l2JpegEncoder(VideoOptions const *options, StreamInfo const &info);
+	~V4l2JpegEncoder();
+	// Encode the given DMABUF.
+	bool EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+
+	// Return the name of a V4L2 device that can encode YUV420 to JPEG, or an empty string.
+	static std::string FindDevice();
+
+private:
+	// As for the H264Encoder, we want at least as many output buffers as there are in the
+	// camera queue, and the capture buffers are where we absorb any delays in the output.
+	static constexpr int NUM_OUTPUT_BUFFERS = 6;
+	static constexpr int NUM_CAPTURE_BUFFERS = 8;
+
+	void configure(VideoOptions const *options, StreamInfo const &info);
+	void releaseBuffers();
+
+	// This thread waits for the codec, returning input buffers to the caller and passing
+	// the encoded frames on to the output thread.
+	void pollThread();
+
+	// Pass encoded frames to the application, after which we give the buffer back to the codec.
+	void outputThread();
+
+	std::atomic<bool> abortPoll_;
+	bool abortOutput_;
+	// Signalled to wake the poll thread when we're closing down.
+	int abort_fd_;
+	int fd_;
+	struct BufferDescription
+	{
+		void *mem;
+		size_t size;
+	};
+	BufferDescription buffers_[NUM_CAPTURE_BUFFERS];
+	int num_capture_buffers_;
+	std::thread poll_thread_;
+	std::mutex input_buffers_available_mutex_;
+	std::queue<int> input_buffers_available_;
+	struct OutputItem
+	{
+		void *mem;
+		size_t bytes_used;
+		size_t length;
+		unsigned int index;
+		int64_t timestamp_us;
+	};
+	std::queue<OutputItem> output_queue_;
+	std::mutex output_mutex_;
+	std::condition_variable output_cond_var_;
+	std::thread output_thread_;
+};
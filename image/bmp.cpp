@@ -71,10 +71,19 @@ void bmp_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 			fwrite(&image_header, sizeof(image_header), 1, fp) != 1)
 			throw std::runtime_error("failed to write BMP file");
 
-		for (unsigned int i = 0; i < info.height; i++, ptr += info.stride)
+		// With no padding anywhere, the pixels can go out in one go.
+		if (pad == 0 && info.stride == line)
 		{
-			if (fwrite(ptr, line, 1, fp) != 1 || (pad != 0 && fwrite(padding, pad, 1, fp) != 1))
-				throw std::runtime_error("failed to write BMP file, row " + std::to_string(i));
+			if (fwrite(ptr, line * info.height, 1, fp) != 1)
+				throw std::runtime_error("failed to write BMP file");
+		}
+		else
+		{
+			for (unsigned int i = 0; i < info.height; i++, ptr += info.stride)
+			{
+				if (fwrite(ptr, line, 1, fp) != 1 || (pad != 0 && fwrite(padding, pad, 1, fp) != 1))
+					throw std::runtime_error("failed to write BMP file, row " + std::to_string(i));
+			}
 		}
 
 		LOG(2, "Wrote " << file_header.filesize << " bytes to BMP file");
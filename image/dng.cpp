@@ -5,8 +5,17 @@
  * dng.cpp - Save raw image as DNG file.
  */
 
+#include <algorithm>
+#include <functional>
+#include <future>
 #include <limits>
 #include <map>
+#include <thread>
+#include <vector>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include <libcamera/control_ids.h>
 #include <libcamera/formats.h>
@@ -93,52 +102,73 @@ static bool is_mono(const PixelFormat &format)
 	return it != mono_formats.end();
 }
 
-static void unpack_10bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+// The unpackers each convert one row of width pixels, so that dng_save can hand out bands of rows to several
+// threads.
+
+static void unpack_10bit(uint8_t const *ptr, unsigned int width, uint16_t *dest)
 {
-	unsigned int w_align = info.width & ~3;
-	for (unsigned int y = 0; y < info.height; y++, src += info.stride)
+	unsigned int w_align = width & ~3;
+	unsigned int x = 0;
+#if defined(__aarch64__)
+	// 8 pixels come from 10 bytes, but we load 16, so stop while there are still that many left in the row.
+	static const uint8_t hi_idx[8] = { 0, 1, 2, 3, 5, 6, 7, 8 };
+	static const uint8_t lo_idx[8] = { 4, 4, 4, 4, 9, 9, 9, 9 };
+	static const int16_t lo_shift[8] = { 0, -2, -4, -6, 0, -2, -4, -6 };
+	uint8x8_t hi_tbl = vld1_u8(hi_idx), lo_tbl = vld1_u8(lo_idx);
+	int16x8_t shift = vld1q_s16(lo_shift);
+	uint16x8_t mask = vdupq_n_u16(3);
+	for (; x * 5 / 4 + 16 <= w_align * 5 / 4; x += 8, ptr += 10, dest += 8)
 	{
-		uint8_t const *ptr = src;
-		unsigned int x;
-		for (x = 0; x < w_align; x += 4, ptr += 5)
-		{
-			*dest++ = (ptr[0] << 2) | ((ptr[4] >> 0) & 3);
-			*dest++ = (ptr[1] << 2) | ((ptr[4] >> 2) & 3);
-			*dest++ = (ptr[2] << 2) | ((ptr[4] >> 4) & 3);
-			*dest++ = (ptr[3] << 2) | ((ptr[4] >> 6) & 3);
-		}
-		for (; x < info.width; x++)
-			*dest++ = (ptr[x & 3] << 2) | ((ptr[4] >> ((x & 3) << 1)) & 3);
+		uint8x16_t in = vld1q_u8(ptr);
+		uint16x8_t hi = vshll_n_u8(vqtbl1_u8(in, hi_tbl), 2);
+		uint16x8_t lo = vandq_u16(vshlq_u16(vmovl_u8(vqtbl1_u8(in, lo_tbl)), shift), mask);
+		vst1q_u16(dest, vorrq_u16(hi, lo));
 	}
+#endif
+	for (; x < w_align; x += 4, ptr += 5)
+	{
+		*dest++ = (ptr[0] << 2) | ((ptr[4] >> 0) & 3);
+		*dest++ = (ptr[1] << 2) | ((ptr[4] >> 2) & 3);
+		*dest++ = (ptr[2] << 2) | ((ptr[4] >> 4) & 3);
+		*dest++ = (ptr[3] << 2) | ((ptr[4] >> 6) & 3);
+	}
+	for (; x < width; x++)
+		*dest++ = (ptr[x & 3] << 2) | ((ptr[4] >> ((x & 3) << 1)) & 3);
 }
 
-static void unpack_12bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+static void unpack_12bit(uint8_t const *ptr, unsigned int width, uint16_t *dest)
 {
-	unsigned int w_align = info.width & ~1;
-	for (unsigned int y = 0; y < info.height; y++, src += info.stride)
+	unsigned int w_align = width & ~1;
+	unsigned int x = 0;
+#if defined(__aarch64__)
+	// 8 pixels come from 12 bytes, and as above we mustn't load past the end of the row.
+	static const uint8_t hi_idx[8] = { 0, 1, 3, 4, 6, 7, 9, 10 };
+	static const uint8_t lo_idx[8] = { 2, 2, 5, 5, 8, 8, 11, 11 };
+	static const int16_t lo_shift[8] = { 0, -4, 0, -4, 0, -4, 0, -4 };
+	uint8x8_t hi_tbl = vld1_u8(hi_idx), lo_tbl = vld1_u8(lo_idx);
+	int16x8_t shift = vld1q_s16(lo_shift);
+	uint16x8_t mask = vdupq_n_u16(15);
+	for (; x * 3 / 2 + 16 <= w_align * 3 / 2; x += 8, ptr += 12, dest += 8)
 	{
-		uint8_t const *ptr = src;
-		unsigned int x;
-		for (x = 0; x < w_align; x += 2, ptr += 3)
-		{
-			*dest++ = (ptr[0] << 4) | ((ptr[2] >> 0) & 15);
-			*dest++ = (ptr[1] << 4) | ((ptr[2] >> 4) & 15);
-		}
-		if (x < info.width)
-			*dest++ = (ptr[x & 1] << 4) | ((ptr[2] >> ((x & 1) << 2)) & 15);
+		uint8x16_t in = vld1q_u8(ptr);
+		uint16x8_t hi = vshll_n_u8(vqtbl1_u8(in, hi_tbl), 4);
+		uint16x8_t lo = vandq_u16(vshlq_u16(vmovl_u8(vqtbl1_u8(in, lo_tbl)), shift), mask);
+		vst1q_u16(dest, vorrq_u16(hi, lo));
 	}
+#endif
+	for (; x < w_align; x += 2, ptr += 3)
+	{
+		*dest++ = (ptr[0] << 4) | ((ptr[2] >> 0) & 15);
+		*dest++ = (ptr[1] << 4) | ((ptr[2] >> 4) & 15);
+	}
+	if (x < width)
+		*dest++ = (ptr[x & 1] << 4) | ((ptr[2] >> ((x & 1) << 2)) & 15);
 }
 
-static void unpack_16bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+static void unpack_16bit(uint8_t const *src, unsigned int width, uint16_t *dest)
 {
 	/* Assume the pixels in memory are already in native byte order */
-	unsigned int w = info.width;
-	for (unsigned int y = 0; y < info.height; y++)
-	{
-		memcpy(dest, src, 2 * w);
-		dest += w;
-		src += info.stride;
-	}
+	memcpy(dest, src, 2 * width);
 }
 
 // We always use these compression parameters.
@@ -232,38 +262,55 @@ static void subBlockFunction(uint16_t *d, uint32_t w)
 	d[6] = dequantize(q[3], qmode);
 }
 
-static void uncompress(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+static void uncompress(uint8_t const *sp, unsigned int width, uint16_t *dp)
 {
-	// In all cases, the *decompressed* image must be a multiple of 8 columns wide.
-	unsigned int buf_stride_pixels = (info.width + 7) & ~7;
-	for (unsigned int y = 0; y < info.height; ++y)
+	for (unsigned int x = 0; x < width; x += 8)
 	{
-		uint16_t *dp = dest + y * buf_stride_pixels;
-		uint8_t const *sp = src + y * info.stride;
-
-		for (unsigned int x = 0; x < info.width; x+=8)
+		if (COMPRESS_MODE & 1)
 		{
-			if (COMPRESS_MODE & 1)
-			{
-				uint32_t w0 = 0, w1 = 0;
-				for (int b = 0; b < 4; ++b)
-					w0 |= (*sp++) << (b * 8);
-				for (int b = 0; b < 4; ++b)
-					w1 |= (*sp++) << (b * 8);
-				subBlockFunction(dp, w0);
-				subBlockFunction(dp + 1, w1);
-				for (int i = 0; i < 8; ++i, ++dp)
-					*dp = postprocess(*dp);
-			}
-			else
-			{
-				for (int i = 0; i < 8; ++i)
-					*dp++ = postprocess((*sp++) << 8);
-			}
+			uint32_t w0 = 0, w1 = 0;
+			for (int b = 0; b < 4; ++b)
+				w0 |= (*sp++) << (b * 8);
+			for (int b = 0; b < 4; ++b)
+				w1 |= (*sp++) << (b * 8);
+			subBlockFunction(dp, w0);
+			subBlockFunction(dp + 1, w1);
+			for (int i = 0; i < 8; ++i, ++dp)
+				*dp = postprocess(*dp);
+		}
+		else
+		{
+			for (int i = 0; i < 8; ++i)
+				*dp++ = postprocess((*sp++) << 8);
 		}
 	}
 }
 
+typedef void (*UnpackFunc)(uint8_t const *, unsigned int, uint16_t *);
+
+// Run the row unpacker over rows y0 to y1 of the image, which land at the top of dest, in bands of rows on
+// separate threads.
+static void unpack_rows(UnpackFunc unpack, uint8_t const *src, StreamInfo const &info, unsigned int y0,
+						unsigned int y1, uint16_t *dest, unsigned int dest_stride)
+{
+	unsigned int threads = std::min(4u, std::max(1u, std::thread::hardware_concurrency()));
+	unsigned int band = (y1 - y0 + threads - 1) / threads;
+	auto unpack_band = [&](unsigned int start, unsigned int end) {
+		for (unsigned int y = start; y < end; y++)
+			unpack(src + y * info.stride, info.width, dest + (y - y0) * dest_stride);
+	};
+
+	std::vector<std::future<void>> futures;
+	for (unsigned int y = y0 + band; y < y1; y += band)
+		futures.push_back(std::async(std::launch::async, unpack_band, y, std::min(y + band, y1)));
+	unpack_band(y0, std::min(y0 + band, y1));
+	for (auto &f : futures)
+		f.get();
+}
+
+// The main image is unpacked this many rows at a time, and written out while the next lot is unpacked.
+static constexpr unsigned int STRIP_ROWS = 64;
+
 struct Matrix
 {
 Matrix(float m0, float m1, float m2,
@@ -335,28 +382,13 @@ void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 	}
 
 	// Decompression will require a buffer that's 8 pixels aligned.
-	unsigned int buf_stride_pixels = info.width;
-	unsigned int buf_stride_pixels_padded = (buf_stride_pixels + 7) & ~7;
-	std::vector<uint16_t> buf(buf_stride_pixels_padded * info.height);
+	unsigned int buf_stride_pixels = format.compressed ? (info.width + 7) & ~7 : info.width;
+	UnpackFunc unpack = unpack_16bit;
 	if (format.compressed)
-	{
-		uncompress(mem[0].data(), info, &buf[0]);
-		buf_stride_pixels = buf_stride_pixels_padded;
-	}
+		unpack = uncompress;
 	else if (format.packed)
-	{
-		switch (format.bits)
-		{
-		case 10:
-			unpack_10bit(mem[0].data(), info, &buf[0]);
-			break;
-		case 12:
-			unpack_12bit(mem[0].data(), info, &buf[0]);
-			break;
-		}
-	}
-	else
-		unpack_16bit(mem[0].data(), info, &buf[0]);
+		unpack = format.bits == 10 ? unpack_10bit : unpack_12bit;
+	uint8_t const *src = mem[0].data();
 
 	// We need to fish out some metadata values for the DNG.
 	float black = 4096 * (1 << format.bits) / 65536.0;
@@ -472,14 +504,18 @@ void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 			TIFFSetField(tif, TIFFTAG_EXIFIFD, offset_exififd);
 		}
 
-		// Make a small greyscale thumbnail, just to give some clue what's in here.
+		// Make a small greyscale thumbnail, just to give some clue what's in here. Only the two rows at the top of
+		// each 16 are needed, so those are all we unpack.
 		std::vector<uint8_t> thumb_buf((info.width >> 4) * 3);
+		std::vector<uint16_t> buf(2 * buf_stride_pixels);
 
 		for (unsigned int y = 0; y < (info.height >> 4); y++)
 		{
+			unpack(src + (y << 4) * info.stride, info.width, &buf[0]);
+			unpack(src + ((y << 4) + 1) * info.stride, info.width, &buf[buf_stride_pixels]);
 			for (unsigned int x = 0; x < (info.width >> 4); x++)
 			{
-				unsigned int off = (y * buf_stride_pixels + x) << 4;
+				unsigned int off = x << 4;
 				uint32_t grey =
 					buf[off] + buf[off + 1] + buf[off + buf_stride_pixels] + buf[off + buf_stride_pixels + 1];
 				grey = (grey << 14) >> format.bits;
@@ -522,10 +558,31 @@ void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 			TIFFSetField(tif, TIFFTAG_BLACKLEVEL, 1, &black_level);
 		}
 
-		for (unsigned int y = 0; y < info.height; y++)
+		// Rather than unpack the whole image to 16 bits first, which for a large sensor is tens of MB, go through it
+		// a strip at a time, unpacking the next strip while libtiff writes out this one.
+		std::vector<uint16_t> strips[2];
+		for (auto &strip : strips)
+			strip.resize(STRIP_ROWS * buf_stride_pixels);
+		auto unpack_strip = [&](unsigned int y, std::vector<uint16_t> &strip) {
+			unpack_rows(unpack, src, info, y, std::min(y + STRIP_ROWS, info.height), &strip[0], buf_stride_pixels);
+		};
+
+		unpack_strip(0, strips[0]);
+		for (unsigned int y0 = 0, i = 0; y0 < info.height; y0 += STRIP_ROWS, i ^= 1)
 		{
-			if (TIFFWriteScanline(tif, &buf[buf_stride_pixels * y], y, 0) != 1)
-				throw std::runtime_error("error writing DNG image data");
+			std::future<void> next;
+			if (y0 + STRIP_ROWS < info.height)
+				next = std::async(std::launch::async, unpack_strip, y0 + STRIP_ROWS, std::ref(strips[i ^ 1]));
+
+			for (unsigned int y = y0; y < std::min(y0 + STRIP_ROWS, info.height); y++)
+			{
+				// If this throws, the future's destructor still waits for the unpacking.
+				if (TIFFWriteScanline(tif, &strips[i][buf_stride_pixels * (y - y0)], y, 0) != 1)
+					throw std::runtime_error("error writing DNG image data");
+			}
+
+			if (next.valid())
+				next.get();
 		}
 
 		// We have to checkpoint before the directory offset is valid.
@@ -18,9 +18,11 @@
 struct StillOptions;
 
 // In jpeg.cpp:
+// The thumbnail is made from thumb_mem, normally the lores image, if given, or else from the image itself.
 void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 			   libcamera::ControlList const &metadata, std::string const &filename, std::string const &cam_model,
-			   StillOptions const *options);
+			   StillOptions const *options, std::vector<libcamera::Span<uint8_t>> const &thumb_mem = {},
+			   StreamInfo const &thumb_info = StreamInfo());
 
 // In yuv.cpp:
 void yuv_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
@@ -9,9 +9,12 @@
 #include <cstring>
 
 #include <algorithm>
+#include <future>
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
 #include <libcamera/control_ids.h>
@@ -23,6 +26,12 @@
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
 
+#include "config.h"
+
+#ifdef TURBOJPEG_PRESENT
+#include <turbojpeg.h>
+#endif
+
 #ifndef MAKE_STRING
 #define MAKE_STRING "Raspberry Pi"
 #endif
@@ -35,6 +44,19 @@ typedef unsigned long jpeg_mem_len_t;
 
 using namespace libcamera;
 
+// How the full size image is encoded (thumbnails just take the defaults).
+struct JpegTuning
+{
+	bool fast_dct = false;
+	bool optimize = false;
+};
+
+static void jpeg_set_tuning(struct jpeg_compress_struct &cinfo, JpegTuning const &tuning)
+{
+	cinfo.dct_method = tuning.fast_dct ? JDCT_IFAST : JDCT_ISLOW;
+	cinfo.optimize_coding = tuning.optimize;
+}
+
 typedef int (*ExifReadFunction)(char const *, unsigned char *);
 
 static int exif_read_short(char const *str, unsigned char *mem);
@@ -255,7 +277,8 @@ void exif_read_tag(ExifData *exif, char const *str)
 
 static void YUYV_to_JPEG(const uint8_t *input, StreamInfo const &info,
 						 const unsigned int output_width, const unsigned int output_height,
-						 const int quality, const unsigned int restart, uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
+						 const int quality, const unsigned int restart, uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len,
+						 JpegTuning const &tuning = {})
 {
 	struct jpeg_compress_struct cinfo;
 	struct jpeg_error_mgr jerr;
@@ -267,10 +290,11 @@ static void YUYV_to_JPEG(const uint8_t *input, StreamInfo const &info,
 	cinfo.image_height = output_height;
 	cinfo.input_components = 3;
 	cinfo.in_color_space = JCS_YCbCr;
-	cinfo.restart_interval = restart;
 
 	jpeg_set_defaults(&cinfo);
+	cinfo.restart_interval = restart;
 	jpeg_set_quality(&cinfo, quality, TRUE);
+	jpeg_set_tuning(cinfo, tuning);
 	jpeg_buffer = NULL;
 	jpeg_len = 0;
 	jpeg_mem_dest(&cinfo, &jpeg_buffer, &jpeg_len);
@@ -307,10 +331,49 @@ static void YUYV_to_JPEG(const uint8_t *input, StreamInfo const &info,
 	jpeg_destroy_compress(&cinfo);
 }
 
+// Encode rows [first_row, first_row + num_rows) of the image, which by default is all of it.
+
 static void YUV420_to_JPEG_fast(const uint8_t *input, StreamInfo const &info,
 								const int quality, const unsigned int restart,
-								uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
+								uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len,
+								unsigned int first_row = 0, unsigned int num_rows = 0,
+								JpegTuning const &tuning = {})
 {
+	if (!num_rows)
+		num_rows = info.height - first_row;
+
+#ifdef TURBOJPEG_PRESENT
+	// TurboJPEG reads the strided planes itself, so there are no row pointers to build. We allocate the
+	// (worst case sized) output so that it can be freed like libjpeg's.
+	tjhandle tj = tj3Init(TJINIT_COMPRESS);
+	if (!tj)
+		throw std::runtime_error("failed to create TurboJPEG encoder");
+	tj3Set(tj, TJPARAM_QUALITY, quality);
+	tj3Set(tj, TJPARAM_SUBSAMP, TJSAMP_420);
+	tj3Set(tj, TJPARAM_RESTARTBLOCKS, restart);
+	tj3Set(tj, TJPARAM_FASTDCT, tuning.fast_dct);
+	tj3Set(tj, TJPARAM_OPTIMIZE, tuning.optimize);
+	tj3Set(tj, TJPARAM_NOREALLOC, 1);
+
+	int stride2 = info.stride / 2;
+	const uint8_t *Y = input, *U = Y + info.stride * info.height, *V = U + stride2 * (info.height / 2);
+	const unsigned char *planes[3] = { Y + first_row * info.stride, U + (first_row / 2) * stride2,
+									   V + (first_row / 2) * stride2 };
+	int strides[3] = { (int)info.stride, stride2, stride2 };
+
+	size_t size = tj3JPEGBufSize(info.width, num_rows, TJSAMP_420);
+	jpeg_buffer = (uint8_t *)malloc(size);
+	if (!jpeg_buffer || tj3CompressFromYUVPlanes8(tj, planes, info.width, strides, num_rows, &jpeg_buffer, &size))
+	{
+		std::string err = jpeg_buffer ? tj3GetErrorStr(tj) : "out of memory";
+		tj3Destroy(tj);
+		free(jpeg_buffer);
+		jpeg_buffer = nullptr;
+		throw std::runtime_error("TurboJPEG encode failed: " + err);
+	}
+	tj3Destroy(tj);
+	jpeg_len = size;
+#else
 	struct jpeg_compress_struct cinfo;
 	struct jpeg_error_mgr jerr;
 
@@ -318,14 +381,16 @@ static void YUV420_to_JPEG_fast(const uint8_t *input, StreamInfo const &info,
 	jpeg_create_compress(&cinfo);
 
 	cinfo.image_width = info.width;
-	cinfo.image_height = info.height;
+	cinfo.image_height = num_rows;
 	cinfo.input_components = 3;
 	cinfo.in_color_space = JCS_YCbCr;
-	cinfo.restart_interval = restart;
 
 	jpeg_set_defaults(&cinfo);
+	// (jpeg_set_defaults clears the restart interval.)
+	cinfo.restart_interval = restart;
 	cinfo.raw_data_in = TRUE;
 	jpeg_set_quality(&cinfo, quality, TRUE);
+	jpeg_set_tuning(cinfo, tuning);
 	jpeg_buffer = NULL;
 	jpeg_len = 0;
 	jpeg_mem_dest(&cinfo, &jpeg_buffer, &jpeg_len);
@@ -343,7 +408,9 @@ static void YUV420_to_JPEG_fast(const uint8_t *input, StreamInfo const &info,
 	JSAMPROW u_rows[8];
 	JSAMPROW v_rows[8];
 
-	for (uint8_t *Y_row = Y, *U_row = U, *V_row = V; cinfo.next_scanline < info.height;)
+	for (uint8_t *Y_row = Y + first_row * info.stride, *U_row = U + (first_row / 2) * stride2,
+				 *V_row = V + (first_row / 2) * stride2;
+		 cinfo.next_scanline < num_rows;)
 	{
 		for (int i = 0; i < 16; i++, Y_row += info.stride)
 			y_rows[i] = std::min(Y_row, Y_max);
@@ -356,6 +423,133 @@ static void YUV420_to_JPEG_fast(const uint8_t *input, StreamInfo const &info,
 
 	jpeg_finish_compress(&cinfo);
 	jpeg_destroy_compress(&cinfo);
+#endif
+}
+
+// Walk the markers of a JPEG made by libjpeg, returning the offset where the entropy coded data
+// starts, and the offset of the SOF0 marker.
+
+static size_t jpeg_scan_offset(const uint8_t *buffer, size_t len, size_t &sof_offset)
+{
+	sof_offset = 0;
+	for (size_t pos = 2; pos + 4 <= len;)
+	{
+		if (buffer[pos] != 0xff)
+			break;
+		unsigned int marker = buffer[pos + 1], segment_len = (buffer[pos + 2] << 8) | buffer[pos + 3];
+		if (marker == 0xc0)
+			sof_offset = pos;
+		pos += 2 + segment_len;
+		if (marker == 0xda)
+		{
+			if (!sof_offset || pos + 2 > len || buffer[len - 2] != 0xff || buffer[len - 1] != 0xd9)
+				break;
+			return pos;
+		}
+	}
+	throw std::runtime_error("unexpected JPEG strip layout");
+}
+
+// Encode horizontal strips of the image on separate threads, and stitch them together into a single
+// JPEG. Every strip is a whole number of restart intervals, so its entropy coded data can follow the
+// previous strip's after another restart marker, with the markers renumbered to run on in sequence.
+// All the strips use the same (standard) quantisation and Huffman tables, so we can keep the headers
+// of the first one. Optimised Huffman tables would differ from strip to strip, so they mean one strip.
+
+static void YUV420_to_JPEG_parallel(const uint8_t *input, StreamInfo const &info, const int quality,
+									unsigned int restart, unsigned int threads, uint8_t *&jpeg_buffer,
+									jpeg_mem_len_t &jpeg_len, JpegTuning const &tuning)
+{
+	if (tuning.optimize)
+		threads = 1;
+	unsigned int mcus_per_row = (info.width + 15) / 16, mcu_rows = (info.height + 15) / 16;
+	unsigned int strip_mcu_rows = (mcu_rows + threads - 1) / threads;
+	unsigned int num_strips = (mcu_rows + strip_mcu_rows - 1) / strip_mcu_rows;
+	if (num_strips < 2)
+	{
+		YUV420_to_JPEG_fast(input, info, quality, restart, jpeg_buffer, jpeg_len, 0, 0, tuning);
+		return;
+	}
+
+	// The requested restart interval can only be used if it divides a strip exactly.
+	if (!restart || (mcus_per_row * strip_mcu_rows) % restart)
+		restart = mcus_per_row;
+
+	std::vector<uint8_t *> strips(num_strips, nullptr);
+	std::vector<jpeg_mem_len_t> strip_lens(num_strips, 0);
+	std::vector<std::future<void>> futures;
+	for (unsigned int i = 0; i < num_strips; i++)
+	{
+		unsigned int first_row = i * strip_mcu_rows * 16;
+		unsigned int num_rows = std::min(strip_mcu_rows * 16, info.height - first_row);
+		futures.push_back(std::async(std::launch::async, [&, i, first_row, num_rows] {
+			YUV420_to_JPEG_fast(input, info, quality, restart, strips[i], strip_lens[i], first_row, num_rows,
+								tuning);
+		}));
+	}
+
+	jpeg_buffer = nullptr;
+	try
+	{
+		for (auto &f : futures)
+			f.get();
+
+		size_t total = 2;
+		for (unsigned int i = 0; i < num_strips; i++)
+			total += strip_lens[i] + 2;
+		jpeg_buffer = (uint8_t *)malloc(total);
+		if (!jpeg_buffer)
+			throw std::runtime_error("failed to allocate JPEG buffer");
+
+		size_t sof_offset, scan_offset = jpeg_scan_offset(strips[0], strip_lens[0], sof_offset);
+		uint8_t *dest = jpeg_buffer;
+		memcpy(dest, strips[0], scan_offset);
+		dest[sof_offset + 5] = info.height >> 8;
+		dest[sof_offset + 6] = info.height & 0xff;
+		dest += scan_offset;
+
+		unsigned int rst = 0;
+		for (unsigned int i = 0; i < num_strips; i++)
+		{
+			if (i)
+			{
+				scan_offset = jpeg_scan_offset(strips[i], strip_lens[i], sof_offset);
+				*(dest++) = 0xff, *(dest++) = 0xd0 + (rst++ & 7);
+			}
+
+			// Copy the entropy coded data (leaving out the EOI), renumbering any restart markers.
+			const uint8_t *src = strips[i] + scan_offset, *src_end = strips[i] + strip_lens[i] - 2;
+			while (src < src_end)
+			{
+				if (src[0] == 0xff && src + 1 < src_end && src[1] >= 0xd0 && src[1] <= 0xd7)
+				{
+					*(dest++) = 0xff, *(dest++) = 0xd0 + (rst++ & 7);
+					src += 2;
+				}
+				else
+					*(dest++) = *(src++);
+			}
+		}
+		*(dest++) = 0xff, *(dest++) = 0xd9;
+		jpeg_len = dest - jpeg_buffer;
+	}
+	catch (std::exception const &e)
+	{
+		for (auto &f : futures)
+		{
+			if (f.valid())
+				f.wait();
+		}
+		for (auto strip : strips)
+			free(strip);
+		free(jpeg_buffer);
+		jpeg_buffer = nullptr;
+		throw;
+	}
+
+	for (auto strip : strips)
+		free(strip);
+	LOG(2, "JPEG encoded in " << num_strips << " strips, restart interval " << restart);
 }
 
 static void YUV420_to_JPEG(const uint8_t *input, StreamInfo const &info,
@@ -379,9 +573,9 @@ static void YUV420_to_JPEG(const uint8_t *input, StreamInfo const &info,
 	cinfo.image_height = output_height;
 	cinfo.input_components = 3;
 	cinfo.in_color_space = JCS_YCbCr;
-	cinfo.restart_interval = restart;
 
 	jpeg_set_defaults(&cinfo);
+	cinfo.restart_interval = restart;
 	jpeg_set_quality(&cinfo, quality, TRUE);
 	jpeg_buffer = NULL;
 	jpeg_len = 0;
@@ -434,68 +628,61 @@ static void YUV_to_JPEG(const uint8_t *input, StreamInfo const &info, const int
 		throw std::runtime_error("unsupported YUV format in JPEG encode");
 }
 
-static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
-							 ControlList const &metadata, std::string const &cam_model, StillOptions const *options,
-							 uint8_t *&exif_buffer, unsigned int &exif_len, uint8_t *&thumb_buffer,
-							 jpeg_mem_len_t &thumb_len)
+static void exif_remove_tag(ExifData *exif, ExifIfd ifd, ExifTag tag)
 {
-	exif_buffer = nullptr;
+	ExifEntry *entry = exif_content_get_entry(exif->ifd[ifd], tag);
+	if (entry)
+		exif_content_remove_entry(exif->ifd[ifd], entry);
+}
+
+// The EXIF tags that stay the same from one capture to the next (the camera, the --exif tags and the
+// thumbnail's format) are built once and kept, and only the tags that change are updated for each
+// image. The per-shot tags are left alone if --exif has set them.
+
+struct ExifTemplate
+{
+	std::mutex mutex;
+	std::string key;
 	ExifData *exif = nullptr;
+	std::vector<std::pair<ExifIfd, ExifTag>> user_tags;
+	~ExifTemplate()
+	{
+		if (exif)
+			exif_data_unref(exif);
+	}
+};
+
+static ExifTemplate exif_template;
+
+static ExifData *exif_template_get(std::string const &cam_model, StillOptions const *options)
+{
+	// Called with exif_template.mutex held.
+	std::string key = cam_model + '\n' + std::to_string(options->Get().thumb_quality) + ':' +
+					  std::to_string(options->Get().thumb_width) + ':' + std::to_string(options->Get().thumb_height);
+	for (auto &exif_item : options->Get().exif)
+		key += '\n' + exif_item;
+	if (exif_template.exif && exif_template.key == key)
+		return exif_template.exif;
+
+	if (exif_template.exif)
+		exif_data_unref(exif_template.exif);
+	exif_template.exif = nullptr;
+	exif_template.user_tags.clear();
+
+	ExifData *exif = exif_data_new();
+	if (!exif)
+		throw std::runtime_error("failed to allocate EXIF data");
 
 	try
 	{
-		exif = exif_data_new();
-		if (!exif)
-			throw std::runtime_error("failed to allocate EXIF data");
 		exif_data_set_byte_order(exif, exif_byte_order);
 
-		// First add some fixed EXIF tags.
-
 		ExifEntry *entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_MAKE);
 		exif_set_string(entry, MAKE_STRING);
 		entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_MODEL);
 		exif_set_string(entry, cam_model.c_str());
 		entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_SOFTWARE);
 		exif_set_string(entry, "rpicam-apps");
-		entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_DATE_TIME);
-		std::time_t raw_time;
-		std::time(&raw_time);
-		std::tm *time_info;
-		char time_string[32];
-		time_info = std::localtime(&raw_time);
-		std::strftime(time_string, sizeof(time_string), "%Y:%m:%d %H:%M:%S", time_info);
-		exif_set_string(entry, time_string);
-		entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_DATE_TIME_ORIGINAL);
-		exif_set_string(entry, time_string);
-		entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_DATE_TIME_DIGITIZED);
-		exif_set_string(entry, time_string);
-
-		// Now add some tags filled in from the image metadata.
-		auto exposure_time = metadata.get(libcamera::controls::ExposureTime);
-		if (exposure_time)
-		{
-			entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_EXPOSURE_TIME);
-			LOG(2, "Exposure time: " << *exposure_time);
-			ExifRational exposure = { (ExifLong)*exposure_time, 1000000 };
-			exif_set_rational(entry->data, exif_byte_order, exposure);
-		}
-		auto ag = metadata.get(libcamera::controls::AnalogueGain);
-		if (ag)
-		{
-			entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_ISO_SPEED_RATINGS);
-			auto dg = metadata.get(libcamera::controls::DigitalGain);
-			float gain;
-			gain = *ag * (dg ? *dg : 1.0);
-			LOG(2, "Ag " << *ag << " Dg " << *dg << " Total " << gain);
-			exif_set_short(entry->data, exif_byte_order, 100 * gain);
-		}
-		auto lp = metadata.get(libcamera::controls::LensPosition);
-		if (lp)
-		{
-			entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_SUBJECT_DISTANCE);
-			ExifRational dist = { 1000, (ExifLong)(1000.0 * *lp) };
-			exif_set_rational(entry->data, exif_byte_order, dist);
-		}
 
 		// Command-line supplied tags.
 		for (auto &exif_item : options->Get().exif)
@@ -503,6 +690,12 @@ static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, S
 			LOG(2, "Processing EXIF item: " << exif_item);
 			exif_read_tag(exif, exif_item.c_str());
 		}
+		for (ExifTag tag : { EXIF_TAG_DATE_TIME, EXIF_TAG_DATE_TIME_ORIGINAL, EXIF_TAG_DATE_TIME_DIGITIZED,
+							 EXIF_TAG_EXPOSURE_TIME, EXIF_TAG_ISO_SPEED_RATINGS, EXIF_TAG_SUBJECT_DISTANCE })
+		{
+			if (exif_content_get_entry(exif->ifd[EXIF_IFD_EXIF], tag))
+				exif_template.user_tags.push_back({ EXIF_IFD_EXIF, tag });
+		}
 
 		if (options->Get().thumb_quality)
 		{
@@ -516,36 +709,144 @@ static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, S
 			exif_set_short(entry->data, exif_byte_order, options->Get().thumb_height);
 			entry = exif_create_tag(exif, EXIF_IFD_1, EXIF_TAG_COMPRESSION);
 			exif_set_short(entry->data, exif_byte_order, 6);
-			ExifEntry *thumb_offset_entry = exif_create_tag(exif, EXIF_IFD_1, EXIF_TAG_JPEG_INTERCHANGE_FORMAT);
-			exif_set_long(thumb_offset_entry->data, exif_byte_order, 0);
-			ExifEntry *thumb_length_entry = exif_create_tag(exif, EXIF_IFD_1, EXIF_TAG_JPEG_INTERCHANGE_FORMAT_LENGTH);
-			exif_set_long(thumb_length_entry->data, exif_byte_order, 0);
+			entry = exif_create_tag(exif, EXIF_IFD_1, EXIF_TAG_JPEG_INTERCHANGE_FORMAT);
+			exif_set_long(entry->data, exif_byte_order, 0);
+			entry = exif_create_tag(exif, EXIF_IFD_1, EXIF_TAG_JPEG_INTERCHANGE_FORMAT_LENGTH);
+			exif_set_long(entry->data, exif_byte_order, 0);
+		}
+	}
+	catch (std::exception const &e)
+	{
+		exif_data_unref(exif);
+		throw;
+	}
 
-			// We actually have to write out an EXIF buffer to find out how long it is.
+	exif_template.exif = exif;
+	exif_template.key = key;
+	return exif;
+}
 
-			exif_len = 0;
-			exif_data_save_data(exif, &exif_buffer, &exif_len);
-			free(exif_buffer);
-			exif_buffer = nullptr;
+static bool exif_user_tag(ExifIfd ifd, ExifTag tag)
+{
+	auto const &tags = exif_template.user_tags;
+	return std::find(tags.begin(), tags.end(), std::make_pair(ifd, tag)) != tags.end();
+}
+
+// The thumbnail comes from the lores image when there is one at least as big as the thumbnail, as there's
+// much less to downscale.
+
+static void create_thumbnail(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
+							 std::vector<libcamera::Span<uint8_t>> const &thumb_mem, StreamInfo const &thumb_info,
+							 StillOptions const *options, uint8_t *&thumb_buffer, jpeg_mem_len_t &thumb_len)
+{
+	bool lores = !thumb_mem.empty() && thumb_info.width >= options->Get().thumb_width &&
+				 thumb_info.height >= options->Get().thumb_height &&
+				 (thumb_info.pixel_format == libcamera::formats::YUV420 ||
+				  thumb_info.pixel_format == libcamera::formats::YUYV);
+	uint8_t const *src = (uint8_t const *)(lores ? thumb_mem[0].data() : mem[0].data());
+	LOG(2, "Thumbnail made from the " << (lores ? "lores" : "full") << " image");
+
+	int q = options->Get().thumb_quality;
+	for (; q > 0; q -= 5)
+	{
+		YUV_to_JPEG(src, lores ? thumb_info : info, options->Get().thumb_width, options->Get().thumb_height, q, 0,
+					thumb_buffer, thumb_len);
+		if (thumb_len < 60000) // entire EXIF data must be < 65536, so this should be safe
+			break;
+		free(thumb_buffer);
+		thumb_buffer = nullptr;
+	}
+	LOG(2, "Thumbnail size " << thumb_len);
+	if (q <= 0)
+		throw std::runtime_error("failed to make acceptable thumbnail");
+}
+
+static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
+							 std::vector<libcamera::Span<uint8_t>> const &thumb_mem, StreamInfo const &thumb_info,
+							 ControlList const &metadata, std::string const &cam_model, StillOptions const *options,
+							 uint8_t *&exif_buffer, unsigned int &exif_len, uint8_t *&thumb_buffer,
+							 jpeg_mem_len_t &thumb_len)
+{
+	exif_buffer = nullptr;
 
-			// Next create the JPEG for the thumbnail, we need to do this now so that we can
-			// go back and fill in the correct values for the thumbnail offsets/length.
+	try
+	{
+		// The thumbnail doesn't depend on the EXIF data, so make it before taking the template.
+		if (options->Get().thumb_quality)
+			create_thumbnail(mem, info, thumb_mem, thumb_info, options, thumb_buffer, thumb_len);
+
+		std::lock_guard<std::mutex> lock(exif_template.mutex);
+		ExifData *exif = exif_template_get(cam_model, options);
+
+		// Now the tags that change with every image.
+
+		ExifEntry *entry;
+		std::time_t raw_time;
+		std::time(&raw_time);
+		std::tm *time_info;
+		char time_string[32];
+		time_info = std::localtime(&raw_time);
+		std::strftime(time_string, sizeof(time_string), "%Y:%m:%d %H:%M:%S", time_info);
+		for (ExifTag tag : { EXIF_TAG_DATE_TIME, EXIF_TAG_DATE_TIME_ORIGINAL, EXIF_TAG_DATE_TIME_DIGITIZED })
+		{
+			if (!exif_user_tag(EXIF_IFD_EXIF, tag))
+				exif_set_string(exif_create_tag(exif, EXIF_IFD_EXIF, tag), time_string);
+		}
 
-			int q = options->Get().thumb_quality;
-			for (; q > 0; q -= 5)
+		auto exposure_time = metadata.get(libcamera::controls::ExposureTime);
+		if (!exif_user_tag(EXIF_IFD_EXIF, EXIF_TAG_EXPOSURE_TIME))
+		{
+			if (exposure_time)
+			{
+				entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_EXPOSURE_TIME);
+				LOG(2, "Exposure time: " << *exposure_time);
+				ExifRational exposure = { (ExifLong)*exposure_time, 1000000 };
+				exif_set_rational(entry->data, exif_byte_order, exposure);
+			}
+			else
+				exif_remove_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_EXPOSURE_TIME);
+		}
+		auto ag = metadata.get(libcamera::controls::AnalogueGain);
+		if (!exif_user_tag(EXIF_IFD_EXIF, EXIF_TAG_ISO_SPEED_RATINGS))
+		{
+			if (ag)
+			{
+				entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_ISO_SPEED_RATINGS);
+				auto dg = metadata.get(libcamera::controls::DigitalGain);
+				float gain;
+				gain = *ag * (dg ? *dg : 1.0);
+				LOG(2, "Ag " << *ag << " Dg " << (dg ? *dg : 1.0) << " Total " << gain);
+				exif_set_short(entry->data, exif_byte_order, 100 * gain);
+			}
+			else
+				exif_remove_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_ISO_SPEED_RATINGS);
+		}
+		auto lp = metadata.get(libcamera::controls::LensPosition);
+		if (!exif_user_tag(EXIF_IFD_EXIF, EXIF_TAG_SUBJECT_DISTANCE))
+		{
+			if (lp)
 			{
-				YUV_to_JPEG((uint8_t *)(mem[0].data()), info, options->Get().thumb_width, options->Get().thumb_height,
-							q, 0, thumb_buffer, thumb_len);
-				if (thumb_len < 60000) // entire EXIF data must be < 65536, so this should be safe
-					break;
-				free(thumb_buffer);
-				thumb_buffer = nullptr;
+				entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_SUBJECT_DISTANCE);
+				ExifRational dist = { 1000, (ExifLong)(1000.0 * *lp) };
+				exif_set_rational(entry->data, exif_byte_order, dist);
 			}
-			LOG(2, "Thumbnail size " << thumb_len);
-			if (q <= 0)
-				throw std::runtime_error("failed to make acceptable thumbnail");
+			else
+				exif_remove_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_SUBJECT_DISTANCE);
+		}
+
+		if (options->Get().thumb_quality)
+		{
+			// We actually have to write out an EXIF buffer to find out how long it is, and so where the
+			// thumbnail will go.
+
+			ExifEntry *thumb_offset_entry = exif_create_tag(exif, EXIF_IFD_1, EXIF_TAG_JPEG_INTERCHANGE_FORMAT);
+			ExifEntry *thumb_length_entry = exif_create_tag(exif, EXIF_IFD_1, EXIF_TAG_JPEG_INTERCHANGE_FORMAT_LENGTH);
+			exif_set_long(thumb_offset_entry->data, exif_byte_order, 0);
 
-			// Now fill in the correct offsets and length.
+			exif_len = 0;
+			exif_data_save_data(exif, &exif_buffer, &exif_len);
+			free(exif_buffer);
+			exif_buffer = nullptr;
 
 			unsigned int offset = exif_len - 6; // do not ask me why "- 6", I have no idea
 			exif_set_long(thumb_offset_entry->data, exif_byte_order, offset);
@@ -555,13 +856,9 @@ static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, S
 		// And create the EXIF data buffer *again*.
 
 		exif_data_save_data(exif, &exif_buffer, &exif_len);
-		exif_data_unref(exif);
-		exif = nullptr;
 	}
 	catch (std::exception const &e)
 	{
-		if (exif)
-			exif_data_unref(exif);
 		if (exif_buffer)
 			free(exif_buffer);
 		if (thumb_buffer)
@@ -571,12 +868,20 @@ static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, S
 }
 
 void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info, ControlList const &metadata,
-			   std::string const &filename, std::string const &cam_model, StillOptions const *options)
+			   std::string const &filename, std::string const &cam_model, StillOptions const *options,
+			   std::vector<libcamera::Span<uint8_t>> const &thumb_mem, StreamInfo const &thumb_info)
 {
 	FILE *fp = nullptr;
 	uint8_t *thumb_buffer = nullptr;
 	unsigned char *exif_buffer = nullptr;
 	uint8_t *jpeg_buffer = nullptr;
+	// The encode thread uses these, so they must outlive the try block, where we wait for it if anything throws.
+	jpeg_mem_len_t jpeg_len = 0;
+	unsigned int threads = options->Get().jpeg_threads;
+	if (!threads)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	JpegTuning tuning = { options->Get().jpeg_fast_dct, options->Get().jpeg_optimize };
+	std::future<void> encode;
 
 	try
 	{
@@ -585,18 +890,28 @@ void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo cons
 		if (mem.size() != 1)
 			throw std::runtime_error("only single plane YUV supported");
 
-		// Make all the EXIF data, which includes the thumbnail.
+		// Start making the full size JPEG on another thread, optionally splitting it into strips
+		// that get encoded in parallel.
+
+		encode = std::async(std::launch::async, [&] {
+			if (info.pixel_format == libcamera::formats::YUV420)
+				YUV420_to_JPEG_parallel((uint8_t *)(mem[0].data()), info, options->Get().quality,
+										options->Get().restart, threads, jpeg_buffer, jpeg_len, tuning);
+			else if (info.pixel_format == libcamera::formats::YUYV)
+				YUYV_to_JPEG((uint8_t *)(mem[0].data()), info, info.width, info.height, options->Get().quality,
+							 options->Get().restart, jpeg_buffer, jpeg_len, tuning);
+			else
+				throw std::runtime_error("unsupported YUV format in JPEG encode");
+		});
+
+		// Meanwhile, make all the EXIF data, which includes the thumbnail.
 
 		jpeg_mem_len_t thumb_len = 0; // stays zero if no thumbnail
 		unsigned int exif_len;
-		create_exif_data(mem, info, metadata, cam_model, options, exif_buffer, exif_len, thumb_buffer, thumb_len);
-
-		// Make the full size JPEG (could probably be more efficient if we had
-		// YUV422 or YUV420 planar format).
+		create_exif_data(mem, info, thumb_mem, thumb_info, metadata, cam_model, options, exif_buffer, exif_len,
+						 thumb_buffer, thumb_len);
 
-		jpeg_mem_len_t jpeg_len;
-		YUV_to_JPEG((uint8_t *)(mem[0].data()), info, info.width, info.height, options->Get().quality,
-					options->Get().restart, jpeg_buffer, jpeg_len);
+		encode.get();
 		LOG(2, "JPEG size is " << jpeg_len);
 
 		// Write everything out.
@@ -626,6 +941,9 @@ void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo cons
 	}
 	catch (std::exception const &e)
 	{
+		// The encode thread may still be writing to jpeg_buffer.
+		if (encode.valid())
+			encode.wait();
 		if (fp)
 			fclose(fp);
 		free(exif_buffer);
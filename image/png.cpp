@@ -5,16 +5,164 @@
  * png.cpp - Encode image as png and write to file.
  */
 
+#include <algorithm>
 #include <cstdio>
+#include <future>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <libcamera/formats.h>
 
-#include <png.h>
+#include <zlib.h>
 
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
 
+// The PNG image data is one zlib stream, but like pigz we can deflate strips of rows separately and join them:
+// every strip bar the last ends with a sync flush, so it finishes on a byte boundary, and starts with the last
+// 32K of the rows before it as its dictionary, so very little compression is lost. The Adler-32 checksums of the
+// strips combine into the one for the whole stream. Each strip goes out as its own IDAT chunk.
+
+static constexpr unsigned int STRIP_ROWS = 64;
+static constexpr size_t WINDOW_SIZE = 32768;
+
+struct PngStrip
+{
+	// Filtered rows, starting with the ones from before the strip that make up the dictionary.
+	std::vector<uint8_t> filtered;
+	size_t dict_len;
+	std::vector<uint8_t> out;
+	uLong adler;
+};
+
+// Every row uses the "average" filter, which gets most of the compression for little effort.
+static void filter_rows(uint8_t const *src, StreamInfo const &info, unsigned int y0, unsigned int y1, uint8_t *dst)
+{
+	unsigned int line = info.width * 3;
+	for (unsigned int y = y0; y < y1; y++)
+	{
+		uint8_t const *row = src + y * info.stride;
+		uint8_t const *prev = y ? row - info.stride : nullptr;
+		*dst++ = 3;
+		for (unsigned int i = 0; i < 3; i++)
+			dst[i] = row[i] - (prev ? prev[i] >> 1 : 0);
+		if (prev)
+		{
+			for (unsigned int i = 3; i < line; i++)
+				dst[i] = row[i] - ((row[i - 3] + prev[i]) >> 1);
+		}
+		else
+		{
+			for (unsigned int i = 3; i < line; i++)
+				dst[i] = row[i] - (row[i - 3] >> 1);
+		}
+		dst += line;
+	}
+}
+
+static void encode_strip(uint8_t const *src, StreamInfo const &info, unsigned int y0, unsigned int y1, int level,
+						 PngStrip &strip)
+{
+	size_t row_size = info.width * 3 + 1;
+	unsigned int dict_rows = std::min<unsigned int>(y0, (WINDOW_SIZE + row_size - 1) / row_size);
+	strip.filtered.resize((y1 - y0 + dict_rows) * row_size);
+	filter_rows(src, info, y0 - dict_rows, y1, strip.filtered.data());
+	strip.dict_len = std::min(dict_rows * row_size, WINDOW_SIZE);
+
+	uint8_t *data = strip.filtered.data() + dict_rows * row_size;
+	size_t len = (y1 - y0) * row_size;
+	strip.adler = adler32(adler32(0, Z_NULL, 0), data, len);
+
+	z_stream z = {};
+	if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		throw std::runtime_error("failed to initialise deflate");
+	if (strip.dict_len)
+		deflateSetDictionary(&z, data - strip.dict_len, strip.dict_len);
+
+	// A sync flush adds a few bytes beyond what deflateBound allows for.
+	strip.out.resize(deflateBound(&z, len) + 16);
+	z.next_in = data;
+	z.avail_in = len;
+	z.next_out = strip.out.data();
+	z.avail_out = strip.out.size();
+	bool last = y1 == info.height;
+	int ret = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+	strip.out.resize(z.total_out);
+	deflateEnd(&z);
+	if (ret != (last ? Z_STREAM_END : Z_OK) || z.avail_in)
+		throw std::runtime_error("failed to deflate png data");
+}
+
+static void write_chunk(FILE *fp, char const *type, uint8_t const *data, size_t len)
+{
+	uint8_t head[8] = { (uint8_t)(len >> 24), (uint8_t)(len >> 16), (uint8_t)(len >> 8), (uint8_t)len };
+	std::copy(type, type + 4, head + 4);
+	// Careful, as crc32 given a null pointer just returns the initial value.
+	uLong crc = crc32(0, head + 4, 4);
+	if (len)
+		crc = crc32(crc, data, len);
+	uint8_t tail[4] = { (uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8), (uint8_t)crc };
+	if (fwrite(head, sizeof(head), 1, fp) != 1 || (len && fwrite(data, len, 1, fp) != 1) ||
+		fwrite(tail, sizeof(tail), 1, fp) != 1)
+		throw std::runtime_error("failed to write png file");
+}
+
+static void put_be32(uint8_t *p, uint32_t value)
+{
+	p[0] = value >> 24, p[1] = value >> 16, p[2] = value >> 8, p[3] = value;
+}
+
+static void write_png(FILE *fp, uint8_t const *src, StreamInfo const &info, int level, unsigned int threads)
+{
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	if (fwrite(signature, sizeof(signature), 1, fp) != 1)
+		throw std::runtime_error("failed to write png file");
+
+	// 8 bit RGB, no interlacing.
+	uint8_t ihdr[13] = {};
+	put_be32(ihdr, info.width);
+	put_be32(ihdr + 4, info.height);
+	ihdr[8] = 8;
+	ihdr[9] = 2;
+	write_chunk(fp, "IHDR", ihdr, sizeof(ihdr));
+
+	// The zlib header: deflate with a 32K window, and no preset dictionary.
+	static const uint8_t zlib_header[2] = { 0x78, 0x01 };
+	write_chunk(fp, "IDAT", zlib_header, sizeof(zlib_header));
+
+	unsigned int num_strips = (info.height + STRIP_ROWS - 1) / STRIP_ROWS;
+	threads = std::min(threads, num_strips);
+
+	// Only "threads" strips are ever in flight, each re-using the buffers of the one "threads" before it.
+	std::vector<PngStrip> strips(threads);
+	std::vector<std::future<void>> futures(threads);
+	auto launch = [&](unsigned int k) {
+		unsigned int y0 = k * STRIP_ROWS, y1 = std::min(y0 + STRIP_ROWS, info.height);
+		futures[k % threads] = std::async(std::launch::async, encode_strip, src, std::cref(info), y0, y1, level,
+										  std::ref(strips[k % threads]));
+	};
+	for (unsigned int k = 0; k < threads; k++)
+		launch(k);
+
+	uLong adler = adler32(0, Z_NULL, 0);
+	for (unsigned int k = 0; k < num_strips; k++)
+	{
+		PngStrip &strip = strips[k % threads];
+		futures[k % threads].get();
+		write_chunk(fp, "IDAT", strip.out.data(), strip.out.size());
+		size_t len = (std::min(k * STRIP_ROWS + STRIP_ROWS, info.height) - k * STRIP_ROWS) * (info.width * 3 + 1);
+		adler = adler32_combine(adler, strip.adler, len);
+		if (k + threads < num_strips)
+			launch(k + threads);
+	}
+
+	uint8_t trailer[4];
+	put_be32(trailer, adler);
+	write_chunk(fp, "IDAT", trailer, sizeof(trailer));
+	write_chunk(fp, "IEND", nullptr, 0);
+}
+
 void png_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 			  std::string const &filename, StillOptions const *options)
 {
@@ -22,56 +170,24 @@ void png_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 		throw std::runtime_error("pixel format for png should be BGR");
 
 	FILE *fp = filename == "-" ? stdout : fopen(filename.c_str(), "wb");
-	png_structp png_ptr = NULL;
-	png_infop info_ptr = NULL;
-
 	if (fp == NULL)
 		throw std::runtime_error("failed to open file " + filename);
 
 	try
 	{
-		// Open everything up.
-		png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-		if (png_ptr == NULL)
-			throw std::runtime_error("failed to create png write struct");
-
-		info_ptr = png_create_info_struct(png_ptr);
-		if (info_ptr == NULL)
-			throw std::runtime_error("failed to create png info struct");
-
-		if (setjmp(png_jmpbuf(png_ptr)))
-			throw std::runtime_error("failed to set png error handling");
-
-		// Set image attributes.
-		png_set_IHDR(png_ptr, info_ptr, info.width, info.height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
-					 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-		// These settings get us most of the compression, but are much faster.
-		png_set_filter(png_ptr, 0, PNG_FILTER_AVG);
-		png_set_compression_level(png_ptr, 1);
-
-		// Set up the image data.
-		png_byte **row_ptrs = (png_byte **)png_malloc(png_ptr, info.height * sizeof(png_byte *));
-		png_byte *row = (uint8_t *)mem[0].data();
-		for (unsigned int i = 0; i < info.height; i++, row += info.stride)
-			row_ptrs[i] = row;
-
-		png_init_io(png_ptr, fp);
-		png_set_rows(png_ptr, info_ptr, row_ptrs);
-		png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+		unsigned int threads = options->Get().png_threads;
+		if (!threads)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		write_png(fp, mem[0].data(), info, options->Get().png_level, threads);
 
 		long int size = ftell(fp);
 		LOG(2, "Wrote PNG file of " << size << " bytes");
 
-		// Free and close everything and we're done.
-		png_free(png_ptr, row_ptrs);
-		png_destroy_write_struct(&png_ptr, &info_ptr);
 		if (fp != stdout)
 			fclose(fp);
 	}
 	catch (std::exception const &e)
 	{
-		if (png_ptr)
-			png_destroy_write_struct(&png_ptr, &info_ptr);
 		if (fp && fp != stdout)
 			fclose(fp);
 		throw;
@@ -0,0 +1,198 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * save_queue.cpp - background still image saving
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include "core/logging.hpp"
+#include "core/thread_config.hpp"
+
+#include "image/save_queue.hpp"
+
+SaveQueue::SaveQueue(unsigned int depth) : depth_(depth), busy_(0), reserved_(0), paused_(false), abort_(false)
+{
+	if (depth_)
+		thread_ = std::thread(&SaveQueue::workerThread, this);
+}
+
+SaveQueue::~SaveQueue()
+{
+	if (!depth_)
+		return;
+
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		abort_ = true;
+		cond_var_.notify_all();
+	}
+	thread_.join();
+
+	if (error_)
+	{
+		try
+		{
+			std::rethrow_exception(error_);
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("ERROR: failed to save image: " << e.what());
+		}
+	}
+}
+
+void SaveQueue::Push(std::vector<libcamera::Span<uint8_t>> const &mem, SaveFn save)
+{
+	if (!depth_)
+	{
+		save(mem);
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	cond_var_.wait(lock, [this] { return jobs_.size() + busy_ + reserved_ < depth_ || error_; });
+	rethrow();
+
+	Job job;
+	if (!free_planes_.empty())
+	{
+		// Prefer copies that already fit, as still and raw images take turns.
+		auto fits = [&mem](std::vector<std::vector<uint8_t>> const &planes) {
+			if (planes.size() != mem.size())
+				return false;
+			for (unsigned int i = 0; i < mem.size(); i++)
+			{
+				if (planes[i].size() != mem[i].size())
+					return false;
+			}
+			return true;
+		};
+		auto it = std::find_if(free_planes_.begin(), free_planes_.end(), fits);
+		if (it == free_planes_.end())
+			it = free_planes_.end() - 1;
+		job.planes = std::move(*it);
+		free_planes_.erase(it);
+	}
+
+	// Our place in the queue is held while we copy, so the lock needn't be, and the worker can get on.
+	reserved_++;
+	lock.unlock();
+	try
+	{
+		job.planes.resize(mem.size());
+		for (unsigned int i = 0; i < mem.size(); i++)
+		{
+			job.planes[i].resize(mem[i].size());
+			memcpy(job.planes[i].data(), mem[i].data(), mem[i].size());
+		}
+	}
+	catch (...)
+	{
+		lock.lock();
+		reserved_--;
+		cond_var_.notify_all();
+		throw;
+	}
+	job.save = std::move(save);
+
+	lock.lock();
+	reserved_--;
+	jobs_.push(std::move(job));
+	cond_var_.notify_all();
+}
+
+void SaveQueue::Flush()
+{
+	if (!depth_)
+		return;
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	paused_ = false;
+	cond_var_.notify_all();
+	cond_var_.wait(lock, [this] { return (jobs_.empty() && !busy_ && !reserved_) || error_; });
+	rethrow();
+}
+
+void SaveQueue::Pause()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	paused_ = true;
+}
+
+void SaveQueue::Resume()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	paused_ = false;
+	cond_var_.notify_all();
+}
+
+void SaveQueue::Reserve(std::vector<size_t> const &plane_sizes, unsigned int count)
+{
+	if (!depth_)
+		return;
+
+	// Allocating (and so touching) the memory now spares the page faults when the images are copied.
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (count--)
+	{
+		std::vector<std::vector<uint8_t>> planes;
+		for (size_t size : plane_sizes)
+			planes.emplace_back(size);
+		free_planes_.push_back(std::move(planes));
+	}
+}
+
+void SaveQueue::rethrow()
+{
+	// Called with mutex_ held.
+	if (error_)
+	{
+		std::exception_ptr error = error_;
+		error_ = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
+void SaveQueue::workerThread()
+{
+	ThreadConfig::Apply("save");
+
+	while (true)
+	{
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			// Pending saves still get written when we're told to stop, paused or not.
+			cond_var_.wait(lock, [this] { return (!jobs_.empty() && !paused_) || abort_; });
+			if (jobs_.empty())
+				return;
+			job = std::move(jobs_.front());
+			jobs_.pop();
+			busy_++;
+		}
+
+		std::vector<libcamera::Span<uint8_t>> mem;
+		for (auto &plane : job.planes)
+			mem.emplace_back(plane.data(), plane.size());
+
+		std::exception_ptr error;
+		try
+		{
+			job.save(mem);
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		if (error && !error_)
+			error_ = error;
+		free_planes_.push_back(std::move(job.planes));
+		busy_--;
+		cond_var_.notify_all();
+	}
+}
@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * save_queue.hpp - background still image saving
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include <libcamera/base/span.h>
+
+// Runs still image saves (encoding and writing the file) on a worker thread so that the capture loop
+// doesn't have to wait for them. Each job works on its own copy of the image, so the camera buffer can
+// be recycled, or even torn down, as soon as Push returns. Push blocks once depth saves are pending,
+// and a depth of zero just saves synchronously. A save that throws has its exception re-thrown by the
+// next call to Push or Flush.
+//
+// Pause holds back the saves, so that a burst of images can be copied in without the encodes competing
+// for the CPU, and Resume (or Flush) lets them go. Reserve allocates the copies in advance.
+class SaveQueue
+{
+public:
+	using SaveFn = std::function<void(std::vector<libcamera::Span<uint8_t>> const &mem)>;
+
+	explicit SaveQueue(unsigned int depth);
+	~SaveQueue();
+
+	void Push(std::vector<libcamera::Span<uint8_t>> const &mem, SaveFn save);
+	// Wait for all the pending saves to finish.
+	void Flush();
+
+	void Pause();
+	void Resume();
+	// Have count copies of images with planes of these sizes ready for Push.
+	void Reserve(std::vector<size_t> const &plane_sizes, unsigned int count);
+
+private:
+	struct Job
+	{
+		std::vector<std::vector<uint8_t>> planes;
+		SaveFn save;
+	};
+
+	void workerThread();
+	void rethrow();
+
+	unsigned int depth_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	std::queue<Job> jobs_;
+	// Plane copies from finished jobs, kept so that we don't reallocate large buffers every capture.
+	std::vector<std::vector<std::vector<uint8_t>>> free_planes_;
+	unsigned int busy_;
+	unsigned int reserved_; // places taken by a Push that is still copying its image
+	bool paused_;
+	bool abort_;
+	std::exception_ptr error_;
+	std::thread thread_;
+};
@@ -5,11 +5,112 @@
  * yuv.cpp - dummy stills encoder to save uncompressed data
  */
 
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+
 #include <libcamera/formats.h>
 
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
 
+// The images are written straight from the mapped buffers with writev, one iovec per row, so dropping the stride
+// padding costs a handful of system calls rather than one per row.
+
+class RawFile
+{
+public:
+	RawFile(std::string const &filename) : filename_(filename)
+	{
+		fd_ = filename == "-" ? STDOUT_FILENO : open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd_ < 0)
+			throw std::runtime_error("failed to open file " + filename);
+	}
+	~RawFile()
+	{
+		if (fd_ != STDOUT_FILENO)
+			close(fd_);
+	}
+	// Queue rows of width bytes, each stride bytes after the last.
+	void AddRows(uint8_t const *ptr, unsigned int rows, size_t width, size_t stride)
+	{
+		if (width == stride)
+			add(ptr, width * rows);
+		else
+		{
+			for (unsigned int i = 0; i < rows; i++, ptr += stride)
+				add(ptr, width);
+		}
+	}
+	// Anything not yet written is lost unless you call this.
+	void Finish() { flush(); }
+
+private:
+	void add(uint8_t const *ptr, size_t len)
+	{
+		if (iov_.size() == IOV_MAX)
+			flush();
+		iov_.push_back({ const_cast<uint8_t *>(ptr), len });
+	}
+	void flush()
+	{
+		iovec *iov = iov_.data();
+		int count = iov_.size();
+		while (count)
+		{
+			ssize_t ret = writev(fd_, iov, count);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+			{
+				iov_.clear();
+				throw std::runtime_error("failed to write file " + filename_ + ": " + strerror(errno));
+			}
+			// Step past whatever got written, which may end part way through an iovec.
+			for (; count && (size_t)ret >= iov->iov_len; iov++, count--)
+				ret -= iov->iov_len;
+			if (count)
+			{
+				iov->iov_base = (uint8_t *)iov->iov_base + ret;
+				iov->iov_len -= ret;
+			}
+		}
+		iov_.clear();
+	}
+
+	std::string filename_;
+	int fd_;
+	std::vector<iovec> iov_;
+};
+
+// With --keep-stride the buffer goes out exactly as it is, padding and all, and a small text file alongside it
+// says how to interpret it.
+static void save_padded(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
+						std::string const &filename)
+{
+	{
+		RawFile file(filename);
+		for (auto const &plane : mem)
+			file.AddRows(plane.data(), 1, plane.size(), plane.size());
+		file.Finish();
+	}
+
+	if (filename == "-")
+		return;
+	std::ofstream header(filename + ".hdr");
+	header << "format " << info.pixel_format.toString() << "\n"
+		   << "width " << info.width << "\n"
+		   << "height " << info.height << "\n"
+		   << "stride " << info.stride << "\n";
+	if (!header)
+		throw std::runtime_error("failed to write header for " + filename);
+}
+
 static void yuv420_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 						std::string const &filename, StillOptions const *options)
 {
@@ -20,39 +121,14 @@ static void yuv420_save(std::vector<libcamera::Span<uint8_t>> const &mem, Stream
 			throw std::runtime_error("both width and height must be even");
 		if (mem.size() != 1)
 			throw std::runtime_error("incorrect number of planes in YUV420 data");
-		FILE *fp = filename == "-" ? stdout : fopen(filename.c_str(), "w");
-		if (!fp)
-			throw std::runtime_error("failed to open file " + filename);
-		try
-		{
-			uint8_t *Y = (uint8_t *)mem[0].data();
-			for (unsigned int j = 0; j < h; j++)
-			{
-				if (fwrite(Y + j * stride, w, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
-			uint8_t *U = Y + stride * h;
-			h /= 2, w /= 2, stride /= 2;
-			for (unsigned int j = 0; j < h; j++)
-			{
-				if (fwrite(U + j * stride, w, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
-			uint8_t *V = U + stride * h;
-			for (unsigned int j = 0; j < h; j++)
-			{
-				if (fwrite(V + j * stride, w, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
-			if (fp != stdout)
-				fclose(fp);
-		}
-		catch (std::exception const &e)
-		{
-			if (fp != stdout)
-				fclose(fp);
-			throw;
-		}
+		RawFile file(filename);
+		uint8_t const *Y = mem[0].data();
+		file.AddRows(Y, h, w, stride);
+		uint8_t const *U = Y + stride * h;
+		file.AddRows(U, h / 2, w / 2, stride / 2);
+		uint8_t const *V = U + stride / 2 * h / 2;
+		file.AddRows(V, h / 2, w / 2, stride / 2);
+		file.Finish();
 	}
 	else
 		throw std::runtime_error("output format " + options->Get().encoding + " not supported");
@@ -66,47 +142,27 @@ static void yuyv_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamIn
 		if ((info.width & 1) || (info.height & 1))
 			throw std::runtime_error("both width and height must be even");
 
-		FILE *fp = filename == "-" ? stdout : fopen(filename.c_str(), "w");
-		if (!fp)
-			throw std::runtime_error("failed to open file " + filename);
-		try
+		// Pick the planes out into one buffer, and write that in one go.
+		unsigned int w = info.width, h = info.height;
+		std::vector<uint8_t> out(w * h + w * h / 2);
+		uint8_t *Y = out.data(), *U = Y + w * h, *V = U + w * h / 4;
+		uint8_t const *ptr = mem[0].data();
+		for (unsigned int j = 0; j < h; j++, ptr += info.stride)
 		{
-			// We could doubtless do this much quicker. Though starting with
-			// YUV420 planar buffer would have been nice.
-			std::vector<uint8_t> row(info.width);
-			uint8_t *ptr = (uint8_t *)mem[0].data();
-			for (unsigned int j = 0; j < info.height; j++, ptr += info.stride)
-			{
-				for (unsigned int i = 0; i < info.width; i++)
-					row[i] = ptr[i << 1];
-				if (fwrite(&row[0], info.width, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
-			ptr = (uint8_t *)mem[0].data();
-			for (unsigned int j = 0; j < info.height; j += 2, ptr += 2 * info.stride)
+			for (unsigned int i = 0; i < w; i++)
+				*Y++ = ptr[i << 1];
+			if (j & 1)
+				continue;
+			for (unsigned int i = 0; i < w / 2; i++)
 			{
-				for (unsigned int i = 0; i < info.width / 2; i++)
-					row[i] = ptr[(i << 2) + 1];
-				if (fwrite(&row[0], info.width / 2, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
+				*U++ = ptr[(i << 2) + 1];
+				*V++ = ptr[(i << 2) + 3];
 			}
-			ptr = (uint8_t *)mem[0].data();
-			for (unsigned int j = 0; j < info.height; j += 2, ptr += 2 * info.stride)
-			{
-				for (unsigned int i = 0; i < info.width / 2; i++)
-					row[i] = ptr[(i << 2) + 3];
-				if (fwrite(&row[0], info.width / 2, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
-			if (fp != stdout)
-				fclose(fp);
-		}
-		catch (std::exception const &e)
-		{
-			if (fp != stdout)
-				fclose(fp);
-			throw;
 		}
+
+		RawFile file(filename);
+		file.AddRows(out.data(), 1, out.size(), out.size());
+		file.Finish();
 	}
 	else
 		throw std::runtime_error("output format " + options->Get().encoding + " not supported");
@@ -117,35 +173,20 @@ static void rgb_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInf
 {
 	if (options->Get().encoding != "rgb24" && options->Get().encoding != "rgb48")
 		throw std::runtime_error("encoding should be set to rgb");
-	FILE *fp = filename == "-" ? stdout : fopen(filename.c_str(), "w");
-	if (!fp)
-		throw std::runtime_error("failed to open file " + filename);
-	try
-	{
-		uint8_t *ptr = (uint8_t *)mem[0].data();
-		unsigned int wr_stride = 3 * info.width;
-		if (options->Get().encoding == "rgb48")
-			wr_stride *= 2;
-		for (unsigned int j = 0; j < info.height; j++, ptr += info.stride)
-		{
-			if (fwrite(ptr, wr_stride, 1, fp) != 1)
-				throw std::runtime_error("failed to write file " + filename);
-		}
-		if (fp != stdout)
-			fclose(fp);
-	}
-	catch (std::exception const &e)
-	{
-		if (fp != stdout)
-			fclose(fp);
-		throw;
-	}
+	unsigned int wr_stride = 3 * info.width;
+	if (options->Get().encoding == "rgb48")
+		wr_stride *= 2;
+	RawFile file(filename);
+	file.AddRows(mem[0].data(), info.height, wr_stride, info.stride);
+	file.Finish();
 }
 
 void yuv_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 			  std::string const &filename, StillOptions const *options)
 {
-	if (info.pixel_format == libcamera::formats::YUYV)
+	if (options->Get().keep_stride && info.pixel_format != libcamera::formats::YUYV)
+		save_padded(mem, info, filename);
+	else if (info.pixel_format == libcamera::formats::YUYV)
 		yuyv_save(mem, info, filename, options);
 	else if (info.pixel_format == libcamera::formats::YUV420)
 		yuv420_save(mem, info, filename, options);
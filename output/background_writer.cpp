@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * background_writer.cpp - buffered file writing on a separate thread.
+ */
+
+#include "core/logging.hpp"
+#include "core/thread_config.hpp"
+
+#include "background_writer.hpp"
+
+// Hours of metadata at high framerates fit in the limit, so in practice Write never waits.
+static constexpr size_t WRITE_THRESHOLD = 64 << 10;
+static constexpr size_t BUFFER_LIMIT = 8 << 20;
+
+BackgroundWriter::BackgroundWriter(FILE *fp, bool flush) : fp_(fp), flush_(flush), abort_(false)
+{
+	buffer_.reserve(WRITE_THRESHOLD * 2);
+	thread_ = std::thread(&BackgroundWriter::writerThread, this);
+}
+
+BackgroundWriter::~BackgroundWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		cond_var_.notify_one();
+	}
+	thread_.join();
+
+	if (fp_ == stdout)
+		fflush(fp_);
+	else
+		fclose(fp_);
+}
+
+void BackgroundWriter::Write(void const *data, size_t size)
+{
+	uint8_t const *bytes = static_cast<uint8_t const *>(data);
+	std::unique_lock<std::mutex> lock(mutex_);
+	cond_var_.wait(lock, [&] { return buffer_.size() + size <= BUFFER_LIMIT; });
+	buffer_.insert(buffer_.end(), bytes, bytes + size);
+	if (flush_ || buffer_.size() >= WRITE_THRESHOLD)
+		cond_var_.notify_all();
+}
+
+void BackgroundWriter::writerThread()
+{
+	ThreadConfig::Apply("output");
+
+	std::vector<uint8_t> buffer;
+	buffer.reserve(WRITE_THRESHOLD * 2);
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	while (true)
+	{
+		cond_var_.wait(lock, [&] { return abort_ || buffer_.size() >= (flush_ ? 1 : WRITE_THRESHOLD); });
+		bool done = abort_;
+		buffer.swap(buffer_);
+		cond_var_.notify_all();
+		lock.unlock();
+
+		if (!buffer.empty() && fwrite(buffer.data(), buffer.size(), 1, fp_) != 1)
+			LOG_ERROR("ERROR: BackgroundWriter: failed to write file");
+		if (flush_)
+			fflush(fp_);
+		buffer.clear();
+
+		lock.lock();
+		if (done && buffer_.empty())
+			return;
+	}
+}
@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * background_writer.hpp - buffered file writing on a separate thread.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Small per-frame records (timestamps, metadata) are appended to a memory buffer, which a thread of its
+// own swaps out and writes in big chunks. With "flush", it writes (and flushes) as soon as there's
+// anything at all. The file is closed, unless it's stdout, when we're done.
+
+class BackgroundWriter
+{
+public:
+	BackgroundWriter(FILE *fp, bool flush);
+	~BackgroundWriter();
+	void Write(void const *data, size_t size);
+
+private:
+	void writerThread();
+
+	FILE *fp_;
+	bool flush_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	std::vector<uint8_t> buffer_;
+	bool abort_;
+	std::thread thread_;
+};
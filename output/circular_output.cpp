@@ -5,22 +5,164 @@
  * circular_output.cpp - Write output to circular buffer which we save on exit.
  */
 
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "core/memory_account.hpp"
+#include "core/thread_config.hpp"
+
 #include "circular_output.hpp"
 
-// We're going to align the frames within the buffer to friendly byte boundaries
-static constexpr int ALIGN = 16; // power of 2, please
+// Initial number of index entries. The ring doubles if the frames turn out to be smaller than this.
+static constexpr unsigned int INITIAL_FRAMES = 1024;
+
+// The default huge page size from /proc/meminfo, or 0 if it doesn't say.
+static size_t huge_page_size()
+{
+	size_t size = 0;
+	FILE *fp = fopen("/proc/meminfo", "r");
+	if (!fp)
+		return 0;
+	char line[128];
+	uint64_t kb;
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (sscanf(line, "Hugepagesize: %" SCNu64, &kb) == 1)
+			size = kb * 1024;
+	}
+	fclose(fp);
+	return size;
+}
+
+CircularBuffer::CircularBuffer(size_t size)
+	: size_(size), map_size_(size), arena_(nullptr), wptr_(0), frames_(INITIAL_FRAMES), first_(0), count_(0),
+	  first_seq_(0)
+{
+	// Big buffers are much cheaper on the TLB when they can use huge pages, but they often aren't
+	// configured, so quietly fall back to normal ones. A huge page mapping has to be a whole number of
+	// them, and munmap must be given the same rounded length.
+	void *mem = MAP_FAILED;
+	size_t huge = huge_page_size();
+	if (huge)
+	{
+		map_size_ = (size_ + huge - 1) / huge * huge;
+		mem = mmap(NULL, map_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+	if (mem == MAP_FAILED)
+	{
+		map_size_ = size_;
+		mem = mmap(NULL, map_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (mem == MAP_FAILED)
+		throw std::runtime_error("failed to allocate circular buffer");
+	arena_ = static_cast<uint8_t *>(mem);
+}
+
+CircularBuffer::~CircularBuffer()
+{
+	munmap(arena_, map_size_);
+}
+
+void CircularBuffer::pop()
+{
+	first_ = (first_ + 1) % frames_.size();
+	count_--;
+	first_seq_++;
+}
+
+bool CircularBuffer::Write(const void *mem, size_t length, bool keyframe, int64_t timestamp, uint64_t protect_from)
+{
+	if (length >= size_)
+		throw std::runtime_error("circular buffer too small");
+
+	// Find a contiguous gap for the frame. Frames never straddle the end of the arena; when one won't
+	// fit there, it goes back at the start instead. The gaps are strict so that wptr_ never lands on
+	// the oldest frame, which keeps "full" distinguishable from "empty".
+	while (true)
+	{
+		if (Empty())
+		{
+			wptr_ = 0;
+			break;
+		}
+		size_t oldest = At(0).offset;
+		if (wptr_ > oldest)
+		{
+			if (size_ - wptr_ >= length)
+				break;
+			if (oldest > length)
+			{
+				wptr_ = 0;
+				break;
+			}
+		}
+		else if (oldest - wptr_ > length)
+			break;
+		if (first_seq_ >= protect_from)
+			return false;
+		pop();
+	}
+
+	if (count_ == frames_.size())
+	{
+		std::vector<Frame> frames(frames_.size() * 2);
+		for (unsigned int i = 0; i < count_; i++)
+			frames[i] = At(i);
+		frames_ = std::move(frames);
+		first_ = 0;
+	}
 
-struct Header
+	memcpy(arena_ + wptr_, mem, length);
+	frames_[(first_ + count_) % frames_.size()] = { wptr_, length, keyframe, timestamp };
+	count_++;
+	wptr_ += length;
+	return true;
+}
+
+// writev may write less than it was asked to (into a pipe, say), so keep going until everything is out.
+static bool write_iov(int fd, std::vector<struct iovec> iov)
 {
-	unsigned int length;
-	bool keyframe;
-	int64_t timestamp;
-};
-static_assert(sizeof(Header) % ALIGN == 0, "Header should have aligned size");
+	size_t i = 0;
+	while (i < iov.size())
+	{
+		ssize_t ret = writev(fd, &iov[i], std::min<size_t>(iov.size() - i, IOV_MAX));
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		size_t n = ret;
+		while (i < iov.size() && n >= iov[i].iov_len)
+			n -= iov[i++].iov_len;
+		if (n)
+		{
+			iov[i].iov_base = static_cast<uint8_t *>(iov[i].iov_base) + n;
+			iov[i].iov_len -= n;
+		}
+	}
+	return true;
+}
 
 // Size of buffer (options->Get().circular) is given in megabytes.
-CircularOutput::CircularOutput(VideoOptions const *options) : Output(options), cb_(options->Get().circular << 20)
+CircularOutput::CircularOutput(VideoOptions const *options)
+	: Output(options), cb_(options->Get().circular << 20), fp_(nullptr), abort_(false), clip_active_(false),
+	  clip_keyframe_seen_(false), clip_next_(0), clip_end_(0), clip_count_(0)
 {
+	// Pages of the buffer only become real as it first fills, but it all will in the end.
+	MemoryAccount::Set(options_->Get().camera, "output.circular", MemoryPool::System, cb_.MappedSize());
+
+	// Clips get their own files as they are triggered.
+	if (options_->Get().circular_clip)
+	{
+		clip_thread_ = std::thread(&CircularOutput::clipThread, this);
+		return;
+	}
+
 	// Open this now, so that we can get any complaints out of the way
 	if (options_->Get().output == "-")
 		fp_ = stdout;
@@ -34,62 +176,171 @@ CircularOutput::CircularOutput(VideoOptions const *options) : Output(options), c
 
 CircularOutput::~CircularOutput()
 {
+	MemoryAccount::Set(options_->Get().camera, "output.circular", MemoryPool::System, 0, 0);
+
+	if (options_->Get().circular_clip)
+	{
+		// Any clip in progress gets everything that has been buffered so far.
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			abort_ = true;
+			cond_var_.notify_all();
+		}
+		clip_thread_.join();
+		return;
+	}
+
 	// We do have to skip to the first I frame before dumping stuff to disk. If there are
 	// no I frames you will get nothing. Caveat emptor, methinks.
-	unsigned int total = 0, frames = 0;
-	bool seen_keyframe = false;
-	Header header;
-	FILE *fp = fp_; // can't capture a class member in a lambda
-	while (!cb_.Empty())
+	unsigned int i = 0;
+	while (i < cb_.Count() && !cb_.At(i).keyframe)
+		i++;
+
+	// Frames that follow each other in the arena are merged into a single iovec, so normally there are
+	// only one or two of them (either side of the wrap).
+	std::vector<struct iovec> iov;
+	size_t total = 0;
+	unsigned int frames = 0;
+	for (; i < cb_.Count(); i++, frames++)
+	{
+		CircularBuffer::Frame const &frame = cb_.At(i);
+		uint8_t *data = const_cast<uint8_t *>(cb_.Data(frame));
+		if (!iov.empty() && static_cast<uint8_t *>(iov.back().iov_base) + iov.back().iov_len == data)
+			iov.back().iov_len += frame.length;
+		else
+			iov.push_back({ data, frame.length });
+		total += frame.length;
+		if (timestamps_)
+			Output::timestampReady(frame.timestamp);
+	}
+
+	fflush(fp_);
+	if (!write_iov(fileno(fp_), std::move(iov)))
+		LOG_ERROR("failed to write circular buffer");
+	fclose(fp_);
+	LOG(1, "Wrote " << total << " bytes (" << frames << " frames)");
+}
+
+void CircularOutput::Signal()
+{
+	if (!options_->Get().circular_clip)
+	{
+		Output::Signal();
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (cb_.Empty())
+		return;
+
+	// A trigger during a clip just makes it run on for longer.
+	int64_t now = cb_.At(cb_.Count() - 1).timestamp;
+	clip_end_ = now + options_->Get().circular_clip.get<std::chrono::microseconds>();
+	if (clip_active_)
+		return;
+
+	// Start at the latest keyframe that still gives us all the preroll, or failing that the earliest.
+	int64_t preroll = options_->Get().circular_preroll.get<std::chrono::microseconds>();
+	unsigned int start = 0;
+	if (preroll)
+	{
+		for (unsigned int i = 0; i < cb_.Count() && cb_.At(i).timestamp <= now - preroll; i++)
+		{
+			if (cb_.At(i).keyframe)
+				start = i;
+		}
+	}
+
+	clip_next_ = cb_.FirstSeq() + start;
+	clip_keyframe_seen_ = false;
+	clip_active_ = true;
+	cond_var_.notify_all();
+}
+
+void CircularOutput::clipThread()
+{
+	ThreadConfig::Apply("output");
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true)
 	{
-		uint8_t *dst = (uint8_t *)&header;
-		cb_.Read(
-			[&dst](void *src, int n) {
-				memcpy(dst, src, n);
-				dst += n;
-			},
-			sizeof(header));
-		seen_keyframe |= header.keyframe;
-		if (seen_keyframe)
+		cond_var_.wait(lock, [this] {
+			return abort_ || (clip_active_ && clip_next_ < cb_.FirstSeq() + cb_.Count());
+		});
+
+		if (!clip_active_)
+			return; // aborting
+
+		if (!fp_)
 		{
-			cb_.Read([fp](void *src, int n) { fwrite(src, 1, n, fp); }, header.length);
-			cb_.Skip((ALIGN - header.length) & (ALIGN - 1));
-			total += header.length;
-			if (fp_timestamps_)
+			char filename[256];
+			snprintf(filename, sizeof(filename), options_->Get().output.c_str(), clip_count_++);
+			filename[sizeof(filename) - 1] = 0;
+			fp_ = fopen(filename, "w");
+			if (!fp_)
 			{
-				Output::timestampReady(header.timestamp);
+				LOG_ERROR("failed to open circular clip " << filename);
+				clip_active_ = false;
+				continue;
 			}
-			frames++;
+			LOG(1, "Saving circular clip " << filename);
+		}
+
+		// Collect everything up to the end of the clip that has arrived so far. Those frames stay pinned
+		// in the buffer, so they can be written with the lock released.
+		std::vector<struct iovec> iov;
+		uint64_t seq = clip_next_, end = cb_.FirstSeq() + cb_.Count();
+		bool finished = false;
+		for (; seq < end; seq++)
+		{
+			CircularBuffer::Frame const &frame = cb_.At(seq - cb_.FirstSeq());
+			if (frame.timestamp > clip_end_)
+			{
+				finished = true;
+				break;
+			}
+			clip_keyframe_seen_ |= frame.keyframe;
+			if (!clip_keyframe_seen_)
+				continue;
+			uint8_t *data = const_cast<uint8_t *>(cb_.Data(frame));
+			if (!iov.empty() && static_cast<uint8_t *>(iov.back().iov_base) + iov.back().iov_len == data)
+				iov.back().iov_len += frame.length;
+			else
+				iov.push_back({ data, frame.length });
+		}
+
+		lock.unlock();
+		bool ok = write_iov(fileno(fp_), std::move(iov));
+		lock.lock();
+
+		clip_next_ = seq;
+		cond_var_.notify_all();
+		if (!ok)
+			LOG_ERROR("failed to write circular clip");
+		if (finished || !ok || (abort_ && seq == cb_.FirstSeq() + cb_.Count()))
+		{
+			fclose(fp_);
+			fp_ = nullptr;
+			clip_active_ = false;
+			LOG(1, "Circular clip finished");
 		}
-		else
-			cb_.Skip((header.length + ALIGN - 1) & ~(ALIGN - 1));
 	}
-	fclose(fp_);
-	LOG(1, "Wrote " << total << " bytes (" << frames << " frames)");
 }
 
 void CircularOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
-	// First make sure there's enough space.
-	int pad = (ALIGN - size) & (ALIGN - 1);
-	while (size + pad + sizeof(Header) > cb_.Available())
+	bool keyframe = !!(flags & FLAG_KEYFRAME);
+	if (!options_->Get().circular_clip)
 	{
-		if (cb_.Empty())
-			throw std::runtime_error("circular buffer too small");
-		Header header;
-		uint8_t *dst = (uint8_t *)&header;
-		cb_.Read(
-			[&dst](void *src, int n) {
-				memcpy(dst, src, n);
-				dst += n;
-			},
-			sizeof(header));
-		cb_.Skip((header.length + ALIGN - 1) & ~(ALIGN - 1));
+		cb_.Write(mem, size, keyframe, timestamp_us);
+		return;
 	}
-	Header header = { static_cast<unsigned int>(size), !!(flags & FLAG_KEYFRAME), timestamp_us };
-	cb_.Write(&header, sizeof(header));
-	cb_.Write(mem, size);
-	cb_.Pad(pad);
+
+	// If a clip is still being written right back at the oldest frames, we have to wait for it.
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (!cb_.Write(mem, size, keyframe, timestamp_us, clip_active_ ? clip_next_ : UINT64_MAX))
+		cond_var_.wait(lock);
+	cond_var_.notify_all();
 }
 
 void CircularOutput::timestampReady(int64_t timestamp)
@@ -7,62 +7,92 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "output.hpp"
 
-// A simple circular buffer implementation used by the CircularOutput class.
+// Encoded frames are stored whole and contiguously in a single large arena, with a ring of index entries
+// recording where each one is. Evicting the oldest frame is then just dropping its index entry, and runs
+// of neighbouring frames can be written out with one writev.
 
 class CircularBuffer
 {
 public:
-	CircularBuffer(size_t size) : size_(size), buf_(size), rptr_(0), wptr_(0) {}
-	bool Empty() const { return rptr_ == wptr_; }
-	size_t Available() const { return wptr_ == rptr_ ? size_ - 1 : (size_ - wptr_ + rptr_) % size_ - 1; }
-	void Skip(unsigned int n) { rptr_ = (rptr_ + n) % size_; }
-	// The dst function allows bytes read to go straight to memory or a file etc.
-	void Read(std::function<void(void *src, unsigned int n)> dst, unsigned int n)
+	struct Frame
 	{
-		if (rptr_ + n >= size_)
-		{
-			dst(&buf_[rptr_], size_ - rptr_);
-			n -= size_ - rptr_;
-			rptr_ = 0;
-		}
-		dst(&buf_[rptr_], n);
-		rptr_ += n;
-	}
-	void Pad(unsigned int n) { wptr_ = (wptr_ + n) % size_; }
-	void Write(const void *ptr, unsigned int n)
+		size_t offset;
+		size_t length;
+		bool keyframe;
+		int64_t timestamp;
+	};
+
+	CircularBuffer(size_t size);
+	~CircularBuffer();
+
+	// What the arena actually takes, once rounded up to its pages.
+	size_t MappedSize() const { return map_size_; }
+	bool Empty() const { return count_ == 0; }
+	unsigned int Count() const { return count_; }
+	// Every frame ever written gets a sequence number; this is the oldest one's.
+	uint64_t FirstSeq() const { return first_seq_; }
+	// Frame i counts from the oldest one still held.
+	Frame const &At(unsigned int i) const { return frames_[(first_ + i) % frames_.size()]; }
+	uint8_t const *Data(Frame const &frame) const { return arena_ + frame.offset; }
+	void Clear()
 	{
-		if (wptr_ + n >= size_)
-		{
-			memcpy(&buf_[wptr_], ptr, size_ - wptr_);
-			n -= size_ - wptr_;
-			ptr = static_cast<const uint8_t *>(ptr) + size_ - wptr_;
-			wptr_ = 0;
-		}
-		memcpy(&buf_[wptr_], ptr, n);
-		wptr_ += n;
+		first_seq_ += count_;
+		count_ = 0;
 	}
+	// Discards the oldest frames until there's room, so the caller is charged O(1) per evicted frame.
+	// Frames from sequence number protect_from onwards are never discarded; if they are in the way,
+	// nothing is written and we return false.
+	bool Write(const void *mem, size_t length, bool keyframe, int64_t timestamp,
+			   uint64_t protect_from = UINT64_MAX);
 
 private:
+	void pop();
+
 	const size_t size_;
-	std::vector<uint8_t> buf_;
-	size_t rptr_, wptr_;
+	size_t map_size_; // size_ rounded up to the pages it was mapped with
+	uint8_t *arena_;
+	size_t wptr_;
+	std::vector<Frame> frames_;
+	unsigned int first_, count_;
+	uint64_t first_seq_;
 };
 
-// Write frames to a circular buffer, and dump them to disk when we quit.
+// Write frames to a circular buffer, and dump them to disk when we quit. In "circular-clip" mode, Signal()
+// instead saves a clip of the buffered history plus whatever follows over the next little while to a new
+// file, on a separate thread, while recording into the buffer carries on.
 
 class CircularOutput : public Output
 {
 public:
 	CircularOutput(VideoOptions const *options);
 	~CircularOutput();
+	void Signal() override;
 
 protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
 	void timestampReady(int64_t timestamp) override;
 
 private:
+	void clipThread();
+
 	CircularBuffer cb_;
 	FILE *fp_;
+	// Clip mode only. The frames from clip_next_ onwards are still to be written, so stay pinned in cb_.
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	std::thread clip_thread_;
+	bool abort_;
+	bool clip_active_;
+	bool clip_keyframe_seen_;
+	uint64_t clip_next_;
+	int64_t clip_end_;
+	unsigned int clip_count_;
 };
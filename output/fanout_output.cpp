@@ -0,0 +1,186 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * fanout_output.cpp - send one encoded stream to several outputs.
+ */
+
+#include <cstring>
+#include <stdexcept>
+
+#include "core/thread_config.hpp"
+
+#include "circular_output.hpp"
+#include "fanout_output.hpp"
+#include "file_output.hpp"
+#include "net_output.hpp"
+
+// Around a second of video at normal framerates. Beyond this a client is not keeping up.
+static constexpr size_t SINK_QUEUE_DEPTH = 32;
+
+FanOutOutput::FanOutOutput(VideoOptions const *options, std::vector<std::string> const &sinks)
+	: Output(options)
+{
+	for (auto const &name : sinks)
+	{
+		auto sink = std::make_unique<Sink>();
+
+		// Each sink is created with its own copy of the options, less the things we look after.
+		sink->options = std::make_unique<VideoOptions>();
+		sink->options->Set() = options->Get();
+		OptsInternal &o = sink->options->Set();
+		o.save_pts.clear();
+		o.metadata.clear();
+		o.pause = false;
+		o.motion_gate = false;
+
+		if (strncmp(name.c_str(), "circular:", 9) == 0)
+		{
+			o.output = name.substr(9);
+			if (!o.circular)
+				o.circular = 4;
+			sink->output = std::make_unique<CircularOutput>(sink->options.get());
+			sink->circular = true;
+		}
+		else
+		{
+			o.output = name;
+			o.circular = 0;
+			o.circular_clip.set("0ms");
+			if (strncmp(name.c_str(), "udp://", 6) == 0 || strncmp(name.c_str(), "tcp://", 6) == 0)
+			{
+				sink->output = std::make_unique<NetOutput>(sink->options.get());
+				sink->threaded = true;
+			}
+			else
+				sink->output = std::make_unique<FileOutput>(sink->options.get());
+		}
+
+		sinks_.push_back(std::move(sink));
+	}
+
+	for (auto &sink : sinks_)
+	{
+		if (sink->threaded)
+			sink->thread = std::thread(&FanOutOutput::sinkThread, this, std::ref(*sink));
+	}
+}
+
+FanOutOutput::~FanOutOutput()
+{
+	// Network sinks get to send whatever they still have queued before we close them.
+	for (auto &sink : sinks_)
+	{
+		if (!sink->threaded)
+			continue;
+		{
+			std::lock_guard<std::mutex> lock(sink->mutex);
+			sink->abort = true;
+			sink->cond_var.notify_one();
+		}
+		sink->thread.join();
+		if (sink->dropped)
+			LOG(1, "Output " << sink->options->Get().output << " dropped " << sink->dropped << " frames");
+	}
+}
+
+void FanOutOutput::Signal()
+{
+	// In circular-clip mode, a signal saves a clip rather than pausing everything.
+	if (!options_->Get().circular_clip)
+	{
+		Output::Signal();
+		return;
+	}
+
+	for (auto &sink : sinks_)
+	{
+		if (sink->circular)
+			sink->output->Signal();
+	}
+}
+
+void FanOutOutput::SetEncoderControls(std::shared_ptr<EncoderControls> controls)
+{
+	Output::SetEncoderControls(controls);
+	for (auto &sink : sinks_)
+		sink->output->SetEncoderControls(controls);
+}
+
+void FanOutOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	std::shared_ptr<std::vector<uint8_t>> copy;
+
+	for (auto &sink : sinks_)
+	{
+		if (!sink->threaded)
+		{
+			sink->output->outputBuffer(mem, size, timestamp_us, flags);
+			continue;
+		}
+
+		std::lock_guard<std::mutex> lock(sink->mutex);
+		if (sink->dead)
+			continue;
+		if (sink->waiting_keyframe && !(flags & FLAG_KEYFRAME))
+		{
+			sink->dropped++;
+			continue;
+		}
+		if (sink->queue.size() >= SINK_QUEUE_DEPTH)
+		{
+			if (!sink->waiting_keyframe)
+			{
+				LOG(1, "Output " << sink->options->Get().output << " is not keeping up, dropping frames");
+				// Don't leave it waiting a whole intra period to start again.
+				if (controls_)
+					controls_->keyframe = true;
+			}
+			sink->waiting_keyframe = true;
+			sink->dropped++;
+			continue;
+		}
+		// After dropping frames, the sink restarts cleanly on this keyframe.
+		uint32_t sink_flags = sink->waiting_keyframe ? flags | FLAG_RESTART : flags;
+		sink->waiting_keyframe = false;
+
+		if (!copy)
+		{
+			uint8_t *data = static_cast<uint8_t *>(mem);
+			copy = std::make_shared<std::vector<uint8_t>>(data, data + size);
+		}
+		sink->queue.push_back({ copy, timestamp_us, sink_flags });
+		sink->cond_var.notify_one();
+	}
+}
+
+void FanOutOutput::sinkThread(Sink &sink)
+{
+	ThreadConfig::Apply("output");
+
+	while (true)
+	{
+		Frame frame;
+		{
+			std::unique_lock<std::mutex> lock(sink.mutex);
+			sink.cond_var.wait(lock, [&] { return sink.abort || !sink.queue.empty(); });
+			if (sink.queue.empty())
+				return;
+			frame = std::move(sink.queue.front());
+			sink.queue.pop_front();
+		}
+
+		try
+		{
+			sink.output->outputBuffer(frame.data->data(), frame.data->size(), frame.timestamp_us, frame.flags);
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("ERROR: output " << sink.options->Get().output << " failed, dropping it: " << e.what());
+			std::lock_guard<std::mutex> lock(sink.mutex);
+			sink.dead = true;
+			sink.queue.clear();
+			return;
+		}
+	}
+}
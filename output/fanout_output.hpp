@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * fanout_output.hpp - send one encoded stream to several outputs.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "output.hpp"
+
+// Hands every frame to a list of sinks, given as a comma separated "--output", e.g.
+// "video.h264,tcp://0.0.0.0:8000,circular:last.h264". Pausing, motion gating, timestamps and
+// metadata are all handled here once, so the sinks only ever see frames they should write.
+//
+// Files and circular buffers are written directly from the encoder's buffer. Network sinks get their
+// own thread and a bounded queue, sharing a single copy of each frame between them, so that a stalled
+// client can't hold up the rest. When a queue fills, that sink drops frames until the next keyframe.
+// A network sink that fails (its peer going away, say) is just dropped, and the others carry on.
+
+class FanOutOutput : public Output
+{
+public:
+	FanOutOutput(VideoOptions const *options, std::vector<std::string> const &sinks);
+	~FanOutOutput();
+	void Signal() override;
+	void SetEncoderControls(std::shared_ptr<EncoderControls> controls) override;
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	struct Frame
+	{
+		std::shared_ptr<std::vector<uint8_t>> data;
+		int64_t timestamp_us;
+		uint32_t flags;
+	};
+
+	struct Sink
+	{
+		std::unique_ptr<VideoOptions> options;
+		std::unique_ptr<Output> output;
+		bool threaded = false;
+		bool circular = false;
+		// Threaded sinks only.
+		std::mutex mutex;
+		std::condition_variable cond_var;
+		std::deque<Frame> queue;
+		bool waiting_keyframe = false;
+		bool abort = false;
+		bool dead = false; // it threw, so it gets nothing more
+		unsigned int dropped = 0;
+		std::thread thread;
+	};
+
+	void sinkThread(Sink &sink);
+
+	std::vector<std::unique_ptr<Sink>> sinks_;
+};
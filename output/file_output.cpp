@@ -5,74 +5,371 @@
  * file_output.cpp - Write output to file.
  */
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "core/thread_config.hpp"
+
 #include "file_output.hpp"
 
+// The ring is big enough to ride out several seconds of storage stalls at high bitrates. Unless asked
+// to flush every frame, we wait until there's a decent batch before writing, as flash prefers big writes.
+static constexpr size_t RING_SIZE = 16 << 20;
+static constexpr size_t WRITE_ALIGN = 4096;
+static constexpr size_t WRITE_BATCH = 1 << 20;
+// When preallocating the next segment, allow for it being somewhat bigger than the last one.
+static constexpr double PREALLOCATE_MARGIN = 1.25;
+
+static uint64_t align_up(uint64_t pos)
+{
+	return (pos + WRITE_ALIGN - 1) & ~(uint64_t)(WRITE_ALIGN - 1);
+}
+
+// O_DIRECT isn't available on every filesystem, in which case we just write through the page cache.
+static int open_output(std::string const &filename, int flags, bool &direct)
+{
+	if (direct)
+	{
+		int fd = open(filename.c_str(), flags | O_DIRECT, 0644);
+		if (fd >= 0 || errno == EEXIST)
+			return fd;
+		direct = false;
+	}
+	return open(filename.c_str(), flags, 0644);
+}
+
 FileOutput::FileOutput(VideoOptions const *options)
-	: Output(options), fp_(nullptr), count_(0), file_start_time_ms_(0)
+	: Output(options), open_(false), count_(0), file_start_time_ms_(0), file_start_(0), segment_rate_(0),
+	  ring_(nullptr), wptr_(0), abort_(false), error_(false), prepare_state_(PREPARE_NONE), prepare_size_(0),
+	  prepared_fd_(-1), prepared_direct_(false), prepared_created_(false)
 {
+	// Until we've seen a whole segment, the requested bitrate is our best guess at its size.
+	segment_rate_ = options_->Get().bitrate.bps() / 8000.0;
+
+	void *ring;
+	if (posix_memalign(&ring, WRITE_ALIGN, RING_SIZE))
+		throw std::runtime_error("failed to allocate output buffer");
+	ring_ = static_cast<uint8_t *>(ring);
+	writer_thread_ = std::thread(&FileOutput::writerThread, this);
 }
 
 FileOutput::~FileOutput()
 {
+	// Everything still in the ring is written out before we go.
 	closeFile();
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		cond_var_.notify_all();
+	}
+	writer_thread_.join();
+	discardPrepared();
+	free(ring_);
 }
 
 void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (error_)
+			throw std::runtime_error("failed to write output bytes");
+	}
+
 	// We need to open a new file if we're in "segment" mode and our segment is full
 	// (though we have to wait for the next I frame), or if we're in "split" mode
 	// and recording is being restarted (this is necessarily an I-frame already).
-	if (fp_ == nullptr ||
+	if (!open_ ||
 		(options_->Get().segment && (flags & FLAG_KEYFRAME) &&
 		 timestamp_us / 1000 - file_start_time_ms_ > options_->Get().segment) ||
 		(options_->Get().split && (flags & FLAG_RESTART)))
 	{
+		// Remember how quickly the last segment filled up, for sizing the next one.
+		int64_t duration_ms = timestamp_us / 1000 - file_start_time_ms_;
+		if (open_ && options_->Get().segment && duration_ms > 0)
+			segment_rate_ = (double)(wptr_ - file_start_) / duration_ms;
+
 		closeFile();
 		openFile(timestamp_us);
 	}
 
 	LOG(2, "FileOutput: output buffer " << mem << " size " << size);
-	if (fp_ && size)
+	if (open_ && size)
 	{
-		if (fwrite(mem, size, 1, fp_) != 1)
-			throw std::runtime_error("failed to write output bytes");
-		if (options_->Get().flush)
-			fflush(fp_);
+		if (size > RING_SIZE - WRITE_ALIGN)
+			throw std::runtime_error("output buffer too small for frame");
+
+		// We only ever wait here if the storage has fallen a whole ring behind. Only this thread moves
+		// wptr_, and the writer never reads beyond the end of the file, so the copy needs no lock.
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_var_.wait(lock, [&] {
+				File const &oldest = files_.front();
+				return error_ || wptr_ + size - (oldest.start + oldest.written) <= RING_SIZE;
+			});
+		}
+
+		size_t offset = wptr_ % RING_SIZE;
+		size_t first = std::min(size, RING_SIZE - offset);
+		memcpy(ring_ + offset, mem, first);
+		memcpy(ring_, static_cast<uint8_t *>(mem) + first, size - first);
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		wptr_ += size;
+		files_.back().end = wptr_;
+		cond_var_.notify_all();
 	}
 }
 
+std::string FileOutput::filename(unsigned int count) const
+{
+	char filename[256];
+	int n = snprintf(filename, sizeof(filename), options_->Get().output.c_str(), count);
+	if (n < 0)
+		throw std::runtime_error("failed to generate filename");
+	return filename;
+}
+
 void FileOutput::openFile(int64_t timestamp_us)
 {
 	if (options_->Get().output == "-")
-		fp_ = stdout;
+		startFile(STDOUT_FILENO, false);
 	else if (!options_->Get().output.empty())
 	{
 		// Generate the next output file name.
-		char filename[256];
-		int n = snprintf(filename, sizeof(filename), options_->Get().output.c_str(), count_);
+		std::string name = filename(count_);
 		count_++;
 		if (options_->Get().wrap)
 			count_ = count_ % options_->Get().wrap;
-		if (n < 0)
-			throw std::runtime_error("failed to generate filename");
 
-		fp_ = fopen(filename, "w");
-		if (!fp_)
-			throw std::runtime_error("failed to open output file " + std::string(filename));
-		LOG(2, "FileOutput: opened output file " << filename);
+		// Normally the writer thread has already opened this file for us. If it hasn't got round to
+		// it yet, we're better off doing it ourselves.
+		int fd = -1;
+		bool direct = false;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (prepare_state_ == PREPARE_REQUESTED)
+				prepare_state_ = PREPARE_NONE;
+			cond_var_.wait(lock, [this] { return prepare_state_ != PREPARE_BUSY; });
+			if (prepare_state_ == PREPARE_READY && prepare_name_ == name)
+			{
+				fd = prepared_fd_, direct = prepared_direct_;
+				prepared_fd_ = -1;
+				prepare_state_ = PREPARE_NONE;
+			}
+		}
+		discardPrepared();
+
+		if (fd < 0)
+		{
+			direct = !options_->Get().flush;
+			fd = open_output(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, direct);
+		}
+		if (fd < 0)
+			throw std::runtime_error("failed to open output file " + name);
+		LOG(2, "FileOutput: opened output file " << name << (direct ? " (direct)" : ""));
 
 		file_start_time_ms_ = timestamp_us / 1000;
+		startFile(fd, direct);
+
+		// Get the writer thread to open the one after, ready for when we need it. (Not if there's no
+		// % directive in the name, as it's the file we're still writing to.)
+		std::string next_name = filename(count_);
+		if ((options_->Get().segment || options_->Get().split) && next_name != name)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			prepare_name_ = next_name;
+			prepare_size_ = options_->Get().segment ? segment_rate_ * options_->Get().segment * PREALLOCATE_MARGIN : 0;
+			prepare_state_ = PREPARE_REQUESTED;
+			cond_var_.notify_all();
+		}
 	}
 }
 
+void FileOutput::startFile(int fd, bool direct)
+{
+	// Each file starts on an aligned boundary in the ring, so that its aligned file offsets are also
+	// aligned in memory.
+	std::lock_guard<std::mutex> lock(mutex_);
+	wptr_ = align_up(wptr_);
+	file_start_ = wptr_;
+	files_.push_back({ fd, direct, false, wptr_, wptr_, 0 });
+	open_ = true;
+}
+
+void FileOutput::prepareFile(std::string const &name, uint64_t size)
+{
+	// We don't truncate the file here in case it never gets used, in which case it's left as it was (or
+	// removed, if we created it). Files are truncated to the right length once they're written instead.
+	bool direct = !options_->Get().flush;
+	bool created = true;
+	int fd = open_output(name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, direct);
+	if (fd < 0 && errno == EEXIST)
+	{
+		created = false;
+		direct = !options_->Get().flush;
+		fd = open_output(name, O_WRONLY | O_CLOEXEC, direct);
+	}
+
+	// Grabbing the space up front saves the filesystem finding it bit by bit as the segment is written.
+	// Not all filesystems can do this, which is fine.
+	if (fd >= 0 && size && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) < 0)
+		LOG(2, "FileOutput: could not preallocate " << name << ": " << strerror(errno));
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	prepared_fd_ = fd;
+	prepared_direct_ = direct;
+	prepared_created_ = created;
+	prepare_state_ = PREPARE_READY;
+	cond_var_.notify_all();
+}
+
+void FileOutput::discardPrepared()
+{
+	std::string name;
+	int fd;
+	bool created;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (prepare_state_ != PREPARE_READY)
+			return;
+		name = prepare_name_, fd = prepared_fd_, created = prepared_created_;
+		prepared_fd_ = -1;
+		prepare_state_ = PREPARE_NONE;
+	}
+
+	if (fd < 0)
+		return;
+	if (created)
+		unlink(name.c_str());
+	else
+	{
+		// Give back anything we preallocated beyond the end of the existing file.
+		struct stat st;
+		if (fstat(fd, &st) == 0 && ftruncate(fd, st.st_size) < 0)
+			LOG(2, "FileOutput: could not trim " << name);
+	}
+	close(fd);
+}
+
 void FileOutput::closeFile()
 {
-	if (fp_)
+	// The writer thread finishes the file off once it has written everything in it.
+	if (open_)
 	{
-		if (options_->Get().flush)
-			fflush(fp_);
-		if (fp_ != stdout)
-			fclose(fp_);
-		fp_ = nullptr;
+		std::lock_guard<std::mutex> lock(mutex_);
+		files_.back().closed = true;
+		cond_var_.notify_all();
+		open_ = false;
 	}
 }
+
+void FileOutput::writerThread()
+{
+	ThreadConfig::Apply("output");
+
+	size_t batch = options_->Get().flush ? 1 : WRITE_BATCH;
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	while (true)
+	{
+		cond_var_.wait(lock, [&] {
+			if (prepare_state_ == PREPARE_REQUESTED)
+				return true;
+			if (files_.empty())
+				return abort_;
+			File const &file = files_.front();
+			return file.closed || file.end - (file.start + file.written) >= batch;
+		});
+		if (prepare_state_ == PREPARE_REQUESTED)
+		{
+			prepare_state_ = PREPARE_BUSY;
+			std::string name = prepare_name_;
+			uint64_t size = prepare_size_;
+			lock.unlock();
+			prepareFile(name, size);
+			lock.lock();
+			continue;
+		}
+		if (files_.empty())
+			return;
+
+		// Direct writes must be whole aligned blocks, except that the last one in a file is padded out and
+		// the file truncated back afterwards. Writes also stop at the end of the ring (which is aligned).
+		File &file = files_.front();
+		uint64_t pos = file.start + file.written;
+		size_t len = file.end - pos;
+		bool last = file.closed;
+		if (file.direct && !last)
+			len &= ~(WRITE_ALIGN - 1);
+		size_t offset = pos % RING_SIZE;
+		if (len > RING_SIZE - offset)
+			len = RING_SIZE - offset, last = false;
+
+		// Once a write has failed, outputBuffer throws and nothing more goes to disk.
+		bool failed = error_;
+		lock.unlock();
+		bool ok = !failed && writeFile(file, ring_ + offset, len, last);
+		int err = errno;
+		if (last)
+			finishFile(file, ok);
+		lock.lock();
+
+		if (!ok && !failed)
+		{
+			LOG_ERROR("ERROR: failed to write output file: " << strerror(err));
+			error_ = true;
+		}
+		file.written += len;
+		if (last)
+			files_.pop_front();
+		cond_var_.notify_all();
+	}
+}
+
+bool FileOutput::writeFile(File &file, uint8_t const *mem, size_t len, bool last)
+{
+	size_t padded = file.direct && last ? align_up(len) : len;
+	uint64_t file_pos = file.written;
+
+	for (size_t done = 0; done < padded;)
+	{
+		ssize_t n = file.fd == STDOUT_FILENO ? write(file.fd, mem + done, padded - done)
+											 : pwrite(file.fd, mem + done, padded - done, file_pos + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EINVAL && file.direct)
+		{
+			// Some filesystems accept O_DIRECT on open but then refuse the writes.
+			int fl = fcntl(file.fd, F_GETFL);
+			if (fl < 0 || fcntl(file.fd, F_SETFL, fl & ~O_DIRECT) < 0)
+				return false;
+			file.direct = false;
+			padded = len;
+			continue;
+		}
+		if (n <= 0)
+			return false;
+		done += n;
+	}
+
+	return true;
+}
+
+void FileOutput::finishFile(File &file, bool ok)
+{
+	if (file.fd == STDOUT_FILENO)
+		return;
+	// This cuts off any padding from the last direct write, as well as any space that was preallocated
+	// or left over from a file that was there before.
+	if (ok && ftruncate(file.fd, file.end - file.start) < 0)
+		LOG_ERROR("ERROR: failed to truncate output file: " << strerror(errno));
+	if (ok && fdatasync(file.fd) < 0)
+		LOG_ERROR("ERROR: failed to sync output file: " << strerror(errno));
+	close(file.fd);
+}
@@ -7,8 +7,22 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
 #include "output.hpp"
 
+// Frames are copied into a large staging ring and written out by a separate thread, so storage
+// hiccups don't hold up the encoder. Where the filesystem allows, files are opened with O_DIRECT and
+// written in big aligned batches, each file starting on an aligned boundary in the ring. Data is only
+// synced to the card when a file is closed.
+//
+// In segment and split modes, the writer thread also opens the next file ahead of time (preallocating
+// roughly what the last segment needed), so rolling over to it costs almost nothing.
+
 class FileOutput : public Output
 {
 public:
@@ -19,9 +33,53 @@ protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
 
 private:
+	// A file's bytes occupy [start, end) of the ring, counting positions from when we began.
+	struct File
+	{
+		int fd;
+		bool direct;
+		bool closed;
+		uint64_t start;
+		uint64_t end;
+		uint64_t written;
+	};
+
+	enum PrepareState
+	{
+		PREPARE_NONE,
+		PREPARE_REQUESTED,
+		PREPARE_BUSY,
+		PREPARE_READY
+	};
+
+	std::string filename(unsigned int count) const;
 	void openFile(int64_t timestamp_us);
+	void startFile(int fd, bool direct);
+	void prepareFile(std::string const &name, uint64_t size);
+	void discardPrepared();
 	void closeFile();
-	FILE *fp_;
+	void writerThread();
+	bool writeFile(File &file, uint8_t const *mem, size_t len, bool last);
+	void finishFile(File &file, bool ok);
+
+	bool open_;
 	unsigned int count_;
 	int64_t file_start_time_ms_;
+	uint64_t file_start_;
+	double segment_rate_; // bytes per ms
+
+	uint8_t *ring_;
+	uint64_t wptr_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	std::deque<File> files_;
+	bool abort_;
+	bool error_;
+	PrepareState prepare_state_;
+	std::string prepare_name_;
+	uint64_t prepare_size_;
+	int prepared_fd_;
+	bool prepared_direct_;
+	bool prepared_created_;
+	std::thread writer_thread_;
 };
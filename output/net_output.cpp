@@ -6,11 +6,39 @@
  */
 
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/sockios.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include "core/thread_config.hpp"
 
 #include "net_output.hpp"
 
-NetOutput::NetOutput(VideoOptions const *options) : Output(options)
+// Beyond this many frames behind, a client is disconnected rather than holding frames up.
+constexpr size_t MAX_CLIENT_QUEUE = 32;
+constexpr unsigned int MAX_CLIENTS = 16;
+
+// With "net-abr", a client this many frames behind skips to the next keyframe.
+constexpr size_t ABR_CLIENT_QUEUE = MAX_CLIENT_QUEUE / 4;
+// How full the send queue is (from 0 to 1) before the bitrate comes down, and how empty it must stay before
+// it goes back up. Beyond ABR_SKIP, rather than block, we skip frames to a keyframe.
+constexpr double ABR_HIGH = 0.5;
+constexpr double ABR_LOW = 0.1;
+constexpr double ABR_SKIP = 0.9;
+constexpr std::chrono::milliseconds ABR_DECREASE_INTERVAL(250);
+constexpr std::chrono::milliseconds ABR_INCREASE_INTERVAL(2000);
+
+NetOutput::NetOutput(VideoOptions const *options)
+	: Output(options), fd_(-1), listen_fd_(-1), epoll_fd_(-1), wake_fd_(-1), abort_(false)
 {
 	char protocol[4];
 	int start, end, a, b, c, d, port;
@@ -39,9 +67,10 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 		// WARNING: I've not actually tried this yet...
 		if (options->Get().listen)
 		{
-			// We are the server.
-			int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-			if (listen_fd < 0)
+			// We are the server. We wait for a first client here so that it gets everything from the
+			// start, but then carry on accepting more on our own thread (see serverThread).
+			listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			if (listen_fd_ < 0)
 				throw std::runtime_error("unable to open listen socket");
 
 			sockaddr_in server_saddr = {};
@@ -50,20 +79,31 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 			server_saddr.sin_port = htons(port);
 
 			int enable = 1;
-			if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
+			if (setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
 				throw std::runtime_error("failed to setsockopt listen socket");
 
-			if (bind(listen_fd, (struct sockaddr *)&server_saddr, sizeof(server_saddr)) < 0)
+			if (bind(listen_fd_, (struct sockaddr *)&server_saddr, sizeof(server_saddr)) < 0)
 				throw std::runtime_error("failed to bind listen socket");
-			listen(listen_fd, 1);
+			listen(listen_fd_, MAX_CLIENTS);
+
+			epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+			wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+			if (epoll_fd_ < 0 || wake_fd_ < 0)
+				throw std::runtime_error("failed to create epoll for listen socket");
+			epoll_event ev = {};
+			ev.events = EPOLLIN;
+			ev.data.ptr = &listen_fd_;
+			epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+			ev.data.ptr = &wake_fd_;
+			epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
 
 			LOG(2, "Waiting for client to connect...");
-			fd_ = accept(listen_fd, (struct sockaddr *)&saddr_, &sockaddr_in_size_);
-			if (fd_ < 0)
+			sockaddr_in_size_ = sizeof(saddr_);
+			int client_fd = accept4(listen_fd_, (struct sockaddr *)&saddr_, &sockaddr_in_size_, SOCK_CLOEXEC);
+			if (client_fd < 0)
 				throw std::runtime_error("accept socket failed");
 			LOG(2, "Client connection accepted");
-
-			close(listen_fd);
+			addClient(client_fd, false);
 		}
 		else
 		{
@@ -89,26 +129,347 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 	}
 	else
 		throw std::runtime_error("unrecognised network protocol " + options->Get().output);
+
+	if (listen_fd_ >= 0)
+	{
+		server_thread_ = std::thread(&NetOutput::serverThread, this);
+		return;
+	}
+
+	if (options->Get().net_sndbuf)
+	{
+		int sndbuf = options->Get().net_sndbuf;
+		if (setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0)
+			LOG_ERROR("WARNING: failed to set socket send buffer size");
+	}
 }
 
 NetOutput::~NetOutput()
 {
-	close(fd_);
+	if (listen_fd_ < 0)
+	{
+		close(fd_);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	uint64_t one = 1;
+	if (write(wake_fd_, &one, sizeof(one)) != sizeof(one))
+		LOG_ERROR("NetOutput: failed to stop server thread");
+	server_thread_.join();
+
+	for (auto &client : clients_)
+		close(client->fd);
+	close(wake_fd_);
+	close(epoll_fd_);
+	close(listen_fd_);
 }
 
 // Maximum size that sendto will accept.
 constexpr size_t MAX_UDP_SIZE = 65507;
 
-void NetOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, uint32_t /*flags*/)
+void NetOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, uint32_t flags)
 {
 	LOG(2, "NetOutput: output buffer " << mem << " size " << size);
-	size_t max_size = saddr_ptr_ ? MAX_UDP_SIZE : size;
-	for (uint8_t *ptr = (uint8_t *)mem; size;)
+	bool keyframe = flags & FLAG_KEYFRAME;
+	if (listen_fd_ >= 0)
+	{
+		queueFrame(static_cast<uint8_t *>(mem), size, keyframe);
+		return;
+	}
+
+	if (options_->Get().net_abr)
+	{
+		double congestion = socketCongestion(fd_);
+		adaptBitrate(congestion);
+		if (!skip_to_keyframe_ && !keyframe && congestion >= ABR_SKIP)
+		{
+			LOG(2, "NetOutput: send queue full, skipping to a keyframe");
+			skip_to_keyframe_ = true;
+			if (controls_)
+				controls_->keyframe = true;
+		}
+		if (skip_to_keyframe_ && !keyframe)
+			return;
+		skip_to_keyframe_ = false;
+	}
+
+	if (saddr_ptr_)
+		sendUdp(static_cast<uint8_t *>(mem), size);
+	else
+		sendTcp(static_cast<uint8_t *>(mem), size);
+}
+
+// How full the socket's send queue is, from 0 to 1. Over tcp this includes what has been sent but not yet
+// acknowledged, which is where a slow link shows up first.
+
+double NetOutput::socketCongestion(int fd) const
+{
+	int queued = 0, sndbuf = 0;
+	socklen_t len = sizeof(sndbuf);
+	if (ioctl(fd, SIOCOUTQ, &queued) < 0 || getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) < 0 || sndbuf <= 0)
+		return 0;
+	// The kernel reports double the size that was asked for, the other half being for its own overheads.
+	return std::min(1.0, 2.0 * queued / sndbuf);
+}
+
+void NetOutput::adaptBitrate(double congestion)
+{
+	if (!controls_)
+		return;
+
+	auto now = std::chrono::steady_clock::now();
+	uint32_t nominal = options_->Get().bitrate.bps();
+	uint32_t minimum = options_->Get().net_abr.bps();
+	if (!abr_bitrate_)
+	{
+		abr_bitrate_ = nominal;
+		abr_changed_ = abr_congested_ = now;
+	}
+	if (congestion >= ABR_LOW)
+		abr_congested_ = now;
+
+	// Back off quickly while the queue is growing, and creep back up only once it has stayed clear.
+	uint32_t bitrate = abr_bitrate_;
+	if (congestion >= ABR_HIGH && now - abr_changed_ >= ABR_DECREASE_INTERVAL)
+		bitrate = std::max<uint32_t>(minimum, bitrate / 4 * 3);
+	else if (now - abr_congested_ >= ABR_INCREASE_INTERVAL && now - abr_changed_ >= ABR_INCREASE_INTERVAL)
+		bitrate = std::min(nominal, bitrate + nominal / 20);
+	if (bitrate == abr_bitrate_)
+		return;
+
+	LOG(2, "NetOutput: congestion " << congestion << ", asking for " << bitrate / 1000 << "kbps");
+	abr_bitrate_ = bitrate;
+	abr_changed_ = now;
+	controls_->bitrate = bitrate;
+}
+
+void NetOutput::sendUdp(uint8_t *mem, size_t size)
+{
+	// Each frame goes out as a batch of datagrams, all in a single syscall where possible.
+	unsigned int count = (size + MAX_UDP_SIZE - 1) / MAX_UDP_SIZE;
+	std::vector<iovec> iov(count);
+	std::vector<mmsghdr> msgs(count);
+	for (unsigned int i = 0; i < count; i++)
+	{
+		size_t offset = i * MAX_UDP_SIZE;
+		iov[i] = { mem + offset, std::min(size - offset, MAX_UDP_SIZE) };
+		msgs[i] = {};
+		msgs[i].msg_hdr.msg_name = const_cast<sockaddr *>(saddr_ptr_);
+		msgs[i].msg_hdr.msg_namelen = sockaddr_in_size_;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (unsigned int sent = 0; sent < count;)
+	{
+		int n = sendmmsg(fd_, &msgs[sent], count - sent, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			throw std::runtime_error("failed to send data on socket");
+		sent += n;
+	}
+}
+
+void NetOutput::sendTcp(uint8_t *mem, size_t size)
+{
+	for (size_t sent = 0; sent < size;)
 	{
-		size_t bytes_to_send = std::min(size, max_size);
-		if (sendto(fd_, ptr, bytes_to_send, 0, saddr_ptr_, sockaddr_in_size_) < 0)
+		ssize_t n = send(fd_, mem + sent, size - sent, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
 			throw std::runtime_error("failed to send data on socket");
-		ptr += bytes_to_send;
-		size -= bytes_to_send;
+		sent += n;
+	}
+}
+
+void NetOutput::addClient(int fd, bool wait_keyframe)
+{
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	if (options_->Get().net_sndbuf)
+	{
+		int sndbuf = options_->Get().net_sndbuf;
+		if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0)
+			LOG_ERROR("WARNING: failed to set socket send buffer size");
+	}
+
+	auto client = std::make_unique<Client>();
+	client->fd = fd;
+	client->waiting_keyframe = wait_keyframe;
+	epoll_event ev = {};
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = client.get();
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+	{
+		close(fd);
+		return;
+	}
+	clients_.push_back(std::move(client));
+}
+
+void NetOutput::queueFrame(uint8_t *mem, size_t size, bool keyframe)
+{
+	// All the clients share the one copy, which goes once the slowest of them has sent it.
+	std::shared_ptr<std::vector<uint8_t>> frame;
+	bool abr = static_cast<bool>(options_->Get().net_abr);
+	double congestion = 0;
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (auto &client : clients_)
+	{
+		if (abr)
+		{
+			// The bitrate has to suit the slowest client.
+			double queued = (double)client->queue.size() / ABR_CLIENT_QUEUE;
+			congestion = std::max({ congestion, std::min(queued, 1.0), socketCongestion(client->fd) });
+			if (client->queue.size() >= ABR_CLIENT_QUEUE && !client->waiting_keyframe)
+			{
+				// Rather than fall so far behind that it's cut off, it starts again from the next keyframe,
+				// once it has finished any frame it's part way through.
+				LOG(2, "NetOutput: client falling behind, skipping to a keyframe");
+				client->queue.erase(client->queue.begin() + (client->offset ? 1 : 0), client->queue.end());
+				client->waiting_keyframe = true;
+				if (controls_)
+					controls_->keyframe = true;
+			}
+		}
+		if (client->waiting_keyframe && !keyframe)
+			continue;
+		client->waiting_keyframe = false;
+		if (client->queue.size() >= MAX_CLIENT_QUEUE)
+		{
+			client->dead = true;
+			continue;
+		}
+		if (!frame)
+			frame = std::make_shared<std::vector<uint8_t>>(mem, mem + size);
+		client->queue.push_back(frame);
+	}
+
+	if (abr)
+		adaptBitrate(congestion);
+
+	uint64_t one = 1;
+	if (frame && write(wake_fd_, &one, sizeof(one)) != sizeof(one))
+		LOG_ERROR("NetOutput: failed to wake server thread");
+}
+
+void NetOutput::flushClient(Client &client)
+{
+	while (!client.queue.empty())
+	{
+		std::vector<uint8_t> const &frame = *client.queue.front();
+		ssize_t n = send(client.fd, frame.data() + client.offset, frame.size() - client.offset, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n < 0)
+		{
+			client.dead = true;
+			return;
+		}
+		client.offset += n;
+		if (client.offset == frame.size())
+		{
+			client.queue.pop_front();
+			client.offset = 0;
+		}
+	}
+
+	// Only ask to hear when the socket has room again if there's something waiting to go.
+	bool want_out = !client.queue.empty();
+	if (want_out != client.want_out)
+	{
+		epoll_event ev = {};
+		ev.events = EPOLLIN | EPOLLRDHUP | (want_out ? (uint32_t)EPOLLOUT : 0);
+		ev.data.ptr = &client;
+		epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, client.fd, &ev);
+		client.want_out = want_out;
+	}
+}
+
+void NetOutput::serverThread()
+{
+	ThreadConfig::Apply("output");
+
+	while (true)
+	{
+		epoll_event events[MAX_CLIENTS + 2];
+		int n = epoll_wait(epoll_fd_, events, MAX_CLIENTS + 2, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+		{
+			LOG_ERROR("NetOutput: epoll failed: " << strerror(errno));
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (abort_)
+			return;
+
+		for (int i = 0; i < n; i++)
+		{
+			if (events[i].data.ptr == &wake_fd_)
+			{
+				uint64_t count;
+				if (read(wake_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+					LOG_ERROR("NetOutput: failed to read wake eventfd");
+				for (auto &client : clients_)
+					flushClient(*client);
+			}
+			else if (events[i].data.ptr == &listen_fd_)
+			{
+				sockaddr_in addr;
+				socklen_t len = sizeof(addr);
+				int fd = accept4(listen_fd_, (sockaddr *)&addr, &len, SOCK_CLOEXEC);
+				if (fd >= 0 && clients_.size() >= MAX_CLIENTS)
+					close(fd);
+				else if (fd >= 0)
+				{
+					// New clients can only start at a keyframe. Without inline headers, that won't be enough
+					// for them to decode anything.
+					LOG(1, "NetOutput: client connected from " << inet_ntoa(addr.sin_addr));
+					if (!options_->Get().inline_headers)
+						LOG(1, "NetOutput: late joining clients need --inline headers");
+					addClient(fd, true);
+					// So that it needn't wait for the next one to come round.
+					if (controls_)
+						controls_->keyframe = true;
+				}
+			}
+			else
+			{
+				Client &client = *static_cast<Client *>(events[i].data.ptr);
+				if (events[i].events & EPOLLOUT)
+					flushClient(client);
+				if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+				{
+					// Clients don't send us anything, so this is just them hanging up.
+					char buf[256];
+					ssize_t r = recv(client.fd, buf, sizeof(buf), MSG_DONTWAIT);
+					if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+						client.dead = true;
+				}
+			}
+		}
+
+		for (auto it = clients_.begin(); it != clients_.end();)
+		{
+			if (!(*it)->dead)
+			{
+				it++;
+				continue;
+			}
+			LOG(1, "NetOutput: " << ((*it)->queue.size() >= MAX_CLIENT_QUEUE ? "client not keeping up, dropping it"
+																				 : "client disconnected"));
+			close((*it)->fd);
+			it = clients_.erase(it);
+		}
 	}
 }
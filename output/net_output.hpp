@@ -9,8 +9,27 @@
 
 #include <netinet/in.h>
 
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "output.hpp"
 
+// Sends the stream over UDP, or TCP either as a client or (with "listen") as a server. A server waits for
+// its first client before starting and then accepts more as it goes, each starting at the next keyframe,
+// which the encoder is asked to make straight away.
+// Server clients each have a bounded queue of frames, all sharing one copy of each, and are sent to from
+// a separate thread. Any client that falls too far behind is disconnected instead of holding things up.
+//
+// With "net-abr", we watch how much is queued to go out and ask the encoder to lower its bitrate while
+// it builds up, and to raise it again, up to --bitrate, once it has stayed clear for a while. A client
+// (or, when we're not listening, the one socket) that gets badly behind skips frames up to a keyframe,
+// which we ask for at once, instead of blocking the encoder or being disconnected.
+
 class NetOutput : public Output
 {
 public:
@@ -21,8 +40,41 @@ protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
 
 private:
+	void sendUdp(uint8_t *mem, size_t size);
+	void sendTcp(uint8_t *mem, size_t size);
+	double socketCongestion(int fd) const;
+	void adaptBitrate(double congestion);
+
+	struct Client
+	{
+		int fd;
+		std::deque<std::shared_ptr<std::vector<uint8_t>>> queue;
+		size_t offset = 0; // how much of the front frame has gone
+		bool waiting_keyframe = true;
+		bool want_out = false;
+		bool dead = false;
+	};
+
+	void addClient(int fd, bool wait_keyframe);
+	void queueFrame(uint8_t *mem, size_t size, bool keyframe);
+	void flushClient(Client &client);
+	void serverThread();
+
 	int fd_;
 	sockaddr_in saddr_;
 	const sockaddr *saddr_ptr_;
 	socklen_t sockaddr_in_size_;
+	// With "net-abr" only.
+	uint32_t abr_bitrate_ = 0;
+	std::chrono::steady_clock::time_point abr_changed_;
+	std::chrono::steady_clock::time_point abr_congested_;
+	bool skip_to_keyframe_ = false;
+	// Server mode only.
+	int listen_fd_;
+	int epoll_fd_;
+	int wake_fd_;
+	std::mutex mutex_;
+	std::vector<std::unique_ptr<Client>> clients_;
+	bool abort_;
+	std::thread server_thread_;
 };
@@ -8,23 +8,45 @@
 #include <cinttypes>
 #include <stdexcept>
 
+#include "core/metrics.hpp"
+#include "core/trace.hpp"
+
+#include "background_writer.hpp"
 #include "circular_output.hpp"
+#include "fanout_output.hpp"
 #include "file_output.hpp"
 #include "net_output.hpp"
 #include "output.hpp"
+#include "rtsp_output.hpp"
+
+// Most of a second or two of pre-roll fits comfortably at typical bitrates. If it doesn't, the oldest
+// frames are lost and the pre-roll is shorter.
+static constexpr size_t PREROLL_BUFFER_SIZE = 16 << 20;
 
 Output::Output(VideoOptions const *options)
-	: options_(options), fp_timestamps_(nullptr), state_(WAITING_KEYFRAME), time_offset_(0), last_timestamp_(0),
+	: options_(options), state_(WAITING_KEYFRAME), time_offset_(0), last_timestamp_(0),
 	  buf_metadata_(std::cout.rdbuf()), of_metadata_()
 {
 	if (!options->Get().save_pts.empty())
 	{
-		fp_timestamps_ = fopen(options->Get().save_pts.c_str(), "w");
-		if (!fp_timestamps_)
+		FILE *fp = fopen(options->Get().save_pts.c_str(), "w");
+		if (!fp)
 			throw std::runtime_error("Failed to open timestamp file " + options->Get().save_pts);
-		fprintf(fp_timestamps_, "# timecode format v2\n");
+		timestamps_ = std::make_unique<BackgroundWriter>(fp, options->Get().flush);
+		static const char header[] = "# timecode format v2\n";
+		timestamps_->Write(header, sizeof(header) - 1);
+	}
+	if (!options->Get().metadata.empty() && options->Get().metadata_format == "bin")
+	{
+		const std::string &filename = options_->Get().metadata;
+		FILE *fp = filename == "-" ? stdout : fopen(filename.c_str(), "wb");
+		if (!fp)
+			throw std::runtime_error("Failed to open metadata file " + filename);
+		metadata_writer_ = std::make_unique<BackgroundWriter>(fp, options->Get().flush);
+		MetadataFileHeader header = metadata_file_header();
+		metadata_writer_->Write(&header, sizeof(header));
 	}
-	if (!options->Get().metadata.empty())
+	else if (!options->Get().metadata.empty())
 	{
 		const std::string &filename = options_->Get().metadata;
 
@@ -37,13 +59,14 @@ Output::Output(VideoOptions const *options)
 	}
 
 	enable_ = !options->Get().pause;
+	motion_enable_ = !options->Get().motion_gate;
+	if (options->Get().motion_gate && options->Get().motion_preroll)
+		preroll_ = std::make_unique<CircularBuffer>(PREROLL_BUFFER_SIZE);
 }
 
 Output::~Output()
 {
-	if (fp_timestamps_)
-		fclose(fp_timestamps_);
-	if (!options_->Get().metadata.empty())
+	if (!options_->Get().metadata.empty() && !metadata_writer_)
 		stop_metadata_output(buf_metadata_, options_->Get().metadata_format);
 }
 
@@ -52,11 +75,64 @@ void Output::Signal()
 	enable_ = !enable_;
 }
 
+void Output::MotionReady(bool motion)
+{
+	if (!options_->Get().motion_gate)
+		return;
+
+	auto now = std::chrono::steady_clock::now();
+	if (motion)
+		last_motion_ = now;
+	bool enable = motion || now - last_motion_ < options_->Get().motion_holdoff.value;
+	if (enable != motion_enable_)
+		LOG(1, (enable ? "Motion detected, recording" : "Motion stopped, recording paused"));
+	// Without a pre-roll to start from, ask for a keyframe rather than wait for the next one to come round.
+	if (enable && !motion_enable_ && !preroll_ && controls_)
+		controls_->keyframe = true;
+	motion_enable_ = enable;
+}
+
 void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe)
 {
-	// When output is enabled, we may have to wait for the next keyframe.
+	Trace::Event(TraceHop::OutputReady, Trace::NO_SEQUENCE, timestamp_us);
 	uint32_t flags = keyframe ? FLAG_KEYFRAME : FLAG_NONE;
-	if (!enable_)
+	if (preroll_)
+	{
+		if (!motion_enable_)
+		{
+			state_ = DISABLED;
+			preroll_->Write(mem, size, keyframe, timestamp_us);
+			return;
+		}
+
+		// The gate has just opened, so start with the earliest keyframe within the pre-roll period.
+		if (!preroll_->Empty())
+		{
+			int64_t start_time = timestamp_us - options_->Get().motion_preroll.get<std::chrono::microseconds>();
+			unsigned int i = 0;
+			while (i < preroll_->Count() &&
+				   !(preroll_->At(i).keyframe && preroll_->At(i).timestamp >= start_time))
+				i++;
+			if (i == preroll_->Count() && controls_)
+				controls_->keyframe = true;
+			for (; i < preroll_->Count(); i++)
+			{
+				CircularBuffer::Frame const &frame = preroll_->At(i);
+				outputFrame(const_cast<uint8_t *>(preroll_->Data(frame)), frame.length, frame.timestamp,
+							frame.keyframe ? FLAG_KEYFRAME : FLAG_NONE);
+			}
+			preroll_->Clear();
+		}
+	}
+
+	outputFrame(mem, size, timestamp_us, flags);
+}
+
+void Output::outputFrame(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	// When output is enabled, we may have to wait for the next keyframe.
+	bool keyframe = flags & FLAG_KEYFRAME;
+	if (!enable_ || !motion_enable_)
 		state_ = DISABLED;
 	else if (state_ == DISABLED)
 		state_ = WAITING_KEYFRAME;
@@ -70,18 +146,33 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 		time_offset_ = timestamp_us - last_timestamp_;
 	last_timestamp_ = timestamp_us - time_offset_;
 
+	auto start = std::chrono::steady_clock::now();
 	outputBuffer(mem, size, last_timestamp_, flags);
+	std::chrono::duration<double, std::micro> write_time = std::chrono::steady_clock::now() - start;
+	Metrics::Add(Metric::OutputWriteTime, write_time.count());
+	Metrics::Add(Metric::OutputFrames);
+	Metrics::Add(Metric::OutputBytes, size);
+	Trace::Event(TraceHop::Written, Trace::NO_SEQUENCE, timestamp_us);
 
 	// Save timestamps to a file, if that was requested.
-	if (fp_timestamps_)
+	if (timestamps_)
 	{
 		timestampReady(last_timestamp_);
 	}
 
-	if (!options_->Get().metadata.empty())
+	if (metadata_writer_)
 	{
-		libcamera::ControlList metadata = metadata_queue_.front();
-		write_metadata(buf_metadata_, options_->Get().metadata_format, metadata, !metadata_started_);
+		MetadataRecord record = metadata_record(metadata_queue_.front().first);
+		record.timestamp_us = last_timestamp_;
+		record.sequence = metadata_sequence_++;
+		record.flags = (flags & FLAG_KEYFRAME) ? (uint32_t)MetadataRecord::KEYFRAME : 0;
+		metadata_writer_->Write(&record, sizeof(record));
+		metadata_queue_.pop();
+	}
+	else if (!options_->Get().metadata.empty())
+	{
+		auto &[metadata, extra] = metadata_queue_.front();
+		write_metadata(buf_metadata_, options_->Get().metadata_format, metadata, !metadata_started_, extra);
 		metadata_started_ = true;
 		metadata_queue_.pop();
 	}
@@ -89,9 +180,9 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 
 void Output::timestampReady(int64_t timestamp)
 {
-	fprintf(fp_timestamps_, "%" PRId64 ".%03" PRId64 "\n", timestamp / 1000, timestamp % 1000);
-	if (options_->Get().flush)
-		fflush(fp_timestamps_);
+	char line[32];
+	int n = snprintf(line, sizeof(line), "%" PRId64 ".%03" PRId64 "\n", timestamp / 1000, timestamp % 1000);
+	timestamps_->Write(line, n);
 }
 
 void Output::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
@@ -105,7 +196,25 @@ Output *Output::Create(VideoOptions const *options)
 				 (options->Get().codec == "h264" && options->GetPlatform() != Platform::VC4);
 	const std::string out_file = options->Get().output;
 
-	if (!libav && (strncmp(out_file.c_str(), "udp://", 6) == 0 || strncmp(out_file.c_str(), "tcp://", 6) == 0))
+	// A comma separated list of outputs all get the same stream.
+	if (!libav && out_file.find(',') != std::string::npos)
+	{
+		std::vector<std::string> sinks;
+		size_t start = 0, end;
+		do
+		{
+			end = out_file.find(',', start);
+			std::string sink = out_file.substr(start, end == std::string::npos ? std::string::npos : end - start);
+			if (!sink.empty())
+				sinks.push_back(sink);
+			start = end + 1;
+		} while (end != std::string::npos);
+		return new FanOutOutput(options, sinks);
+	}
+
+	if (!libav && strncmp(out_file.c_str(), "rtsp://", 7) == 0)
+		return new RtspOutput(options);
+	else if (!libav && (strncmp(out_file.c_str(), "udp://", 6) == 0 || strncmp(out_file.c_str(), "tcp://", 6) == 0))
 		return new NetOutput(options);
 	else if (options->Get().circular)
 		return new CircularOutput(options);
@@ -115,12 +224,12 @@ Output *Output::Create(VideoOptions const *options)
 		return new Output(options);
 }
 
-void Output::MetadataReady(libcamera::ControlList &metadata)
+void Output::MetadataReady(FrameMetadata const &metadata, SidecarValues const &extra)
 {
 	if (options_->Get().metadata.empty())
 		return;
 
-	metadata_queue_.push(metadata);
+	metadata_queue_.emplace(metadata, extra);
 }
 
 void start_metadata_output(std::streambuf *buf, std::string fmt)
@@ -130,14 +239,60 @@ void start_metadata_output(std::streambuf *buf, std::string fmt)
 		out << "[" << std::endl;
 }
 
-void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList &metadata, bool first_write)
+MetadataFileHeader metadata_file_header()
+{
+	return { { 'R', 'P', 'I', 'M', 'E', 'T', 'A', '\0' }, 1, sizeof(MetadataRecord) };
+}
+
+MetadataRecord metadata_record(libcamera::ControlList const &metadata)
+{
+	using namespace libcamera;
+	MetadataRecord record = {};
+	if (auto v = metadata.get(controls::SensorTimestamp))
+		record.sensor_timestamp_ns = *v, record.valid |= MetadataRecord::SENSOR_TIMESTAMP;
+	if (auto v = metadata.get(controls::ExposureTime))
+		record.exposure_time_us = *v, record.valid |= MetadataRecord::EXPOSURE_TIME;
+	if (auto v = metadata.get(controls::AnalogueGain))
+		record.analogue_gain = *v, record.valid |= MetadataRecord::ANALOGUE_GAIN;
+	if (auto v = metadata.get(controls::DigitalGain))
+		record.digital_gain = *v, record.valid |= MetadataRecord::DIGITAL_GAIN;
+	if (auto v = metadata.get(controls::ColourGains))
+	{
+		record.colour_gains[0] = (*v)[0], record.colour_gains[1] = (*v)[1];
+		record.valid |= MetadataRecord::COLOUR_GAINS;
+	}
+	if (auto v = metadata.get(controls::ColourTemperature))
+		record.colour_temperature = *v, record.valid |= MetadataRecord::COLOUR_TEMPERATURE;
+	if (auto v = metadata.get(controls::Lux))
+		record.lux = *v, record.valid |= MetadataRecord::LUX;
+	if (auto v = metadata.get(controls::LensPosition))
+		record.lens_position = *v, record.valid |= MetadataRecord::LENS_POSITION;
+	if (auto v = metadata.get(controls::FocusFoM))
+		record.focus_fom = *v, record.valid |= MetadataRecord::FOCUS_FOM;
+	return record;
+}
+
+void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList const &metadata, bool first_write,
+					SidecarValues const &extra)
 {
 	std::ostream out(buf);
 	const libcamera::ControlIdMap *id_map = metadata.idMap();
-	if (fmt == "txt")
+	if (fmt == "bin")
+	{
+		if (first_write)
+		{
+			MetadataFileHeader header = metadata_file_header();
+			out.write(reinterpret_cast<char const *>(&header), sizeof(header));
+		}
+		MetadataRecord record = metadata_record(metadata);
+		out.write(reinterpret_cast<char const *>(&record), sizeof(record));
+	}
+	else if (fmt == "txt")
 	{
 		for (auto const &[id, val] : metadata)
 			out << id_map->at(id)->name() << "=" << val.toString() << std::endl;
+		for (auto const &[name, value] : extra)
+			out << name << "=" << value << std::endl;
 		out << std::endl;
 	}
 	else
@@ -153,6 +308,11 @@ void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList
 				<< "    \"" << id_map->at(id)->name() << "\": " << arg_quote << val.toString() << arg_quote;
 			first_done = true;
 		}
+		for (auto const &[name, value] : extra)
+		{
+			out << (first_done ? "," : "") << std::endl << "    \"" << name << "\": " << value;
+			first_done = true;
+		}
 		out << std::endl << "}";
 	}
 }
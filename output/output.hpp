@@ -10,9 +10,17 @@
 #include <cstdio>
 
 #include <atomic>
+#include <chrono>
+#include <memory>
 
+#include "core/completed_request.hpp"
+#include "core/encoder_controls.hpp"
+#include "core/sidecar.hpp"
 #include "core/video_options.hpp"
 
+class BackgroundWriter;
+class CircularBuffer;
+
 class Output
 {
 public:
@@ -22,9 +30,17 @@ public:
 	virtual ~Output();
 	virtual void Signal(); // a derived class might redefine what this means
 	void OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe);
-	void MetadataReady(libcamera::ControlList &metadata);
+	void MetadataReady(FrameMetadata const &metadata, SidecarValues const &extra);
+	// With "motion-gate", only frames that arrive while there's motion (or within the hold-off period
+	// after it) are output. Call this once per camera frame.
+	void MotionReady(bool motion);
+	// Where an output that watches its network link, or its clients, can ask things of the encoder.
+	virtual void SetEncoderControls(std::shared_ptr<EncoderControls> controls) { controls_ = std::move(controls); }
 
 protected:
+	// A FanOutOutput passes frames straight to the outputBuffer of each of its sinks.
+	friend class FanOutOutput;
+
 	enum Flag
 	{
 		FLAG_NONE = 0,
@@ -34,9 +50,12 @@ protected:
 	virtual void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags);
 	virtual void timestampReady(int64_t timestamp);
 	VideoOptions const *options_;
-	FILE *fp_timestamps_;
+	std::unique_ptr<BackgroundWriter> timestamps_;
+	std::shared_ptr<EncoderControls> controls_;
 
 private:
+	void outputFrame(void *mem, size_t size, int64_t timestamp_us, uint32_t flags);
+
 	enum State
 	{
 		DISABLED = 0,
@@ -45,14 +64,70 @@ private:
 	};
 	State state_;
 	std::atomic<bool> enable_;
+	std::atomic<bool> motion_enable_;
+	std::chrono::steady_clock::time_point last_motion_;
+	// While the motion gate is closed, recent frames are kept here so they can be output as pre-roll.
+	std::unique_ptr<CircularBuffer> preroll_;
 	int64_t time_offset_;
 	int64_t last_timestamp_;
 	std::streambuf *buf_metadata_;
 	std::ofstream of_metadata_;
 	bool metadata_started_ = false;
-	std::queue<libcamera::ControlList> metadata_queue_;
+	std::queue<std::pair<FrameMetadata, SidecarValues>> metadata_queue_;
+	// Binary ("bin" format) metadata is written on a thread of its own.
+	std::unique_ptr<BackgroundWriter> metadata_writer_;
+	uint32_t metadata_sequence_ = 0;
+};
+
+// The "bin" metadata format is this header followed by one fixed size record per frame, all little
+// endian. Fields the camera didn't report are zero and missing from the valid mask.
+struct MetadataFileHeader
+{
+	char magic[8]; // "RPIMETA\0"
+	uint32_t version;
+	uint32_t record_size;
+};
+
+struct MetadataRecord
+{
+	enum Valid : uint32_t
+	{
+		SENSOR_TIMESTAMP = 1,
+		EXPOSURE_TIME = 2,
+		ANALOGUE_GAIN = 4,
+		DIGITAL_GAIN = 8,
+		COLOUR_GAINS = 16,
+		COLOUR_TEMPERATURE = 32,
+		LUX = 64,
+		LENS_POSITION = 128,
+		FOCUS_FOM = 256
+	};
+	enum Flags : uint32_t
+	{
+		KEYFRAME = 1
+	};
+
+	int64_t sensor_timestamp_ns;
+	int64_t timestamp_us; // as output, so matching any saved pts
+	uint32_t sequence;
+	uint32_t flags;
+	int32_t exposure_time_us;
+	float analogue_gain;
+	float digital_gain;
+	float colour_gains[2];
+	int32_t colour_temperature;
+	float lux;
+	float lens_position;
+	int32_t focus_fom;
+	uint32_t valid;
 };
 
+static_assert(sizeof(MetadataRecord) == 64, "MetadataRecord must stay 64 bytes");
+
+MetadataFileHeader metadata_file_header();
+MetadataRecord metadata_record(libcamera::ControlList const &metadata);
+
 void start_metadata_output(std::streambuf *buf, std::string fmt);
-void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList &metadata, bool first_write);
+void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList const &metadata, bool first_write,
+					SidecarValues const &extra = {});
 void stop_metadata_output(std::streambuf *buf, std::string fmt);
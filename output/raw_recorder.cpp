@@ -0,0 +1,179 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * raw_recorder.cpp - write raw camera buffers straight into a preallocated ring file.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <libcamera/control_ids.h>
+
+#include "core/buffer_sync.hpp"
+#include "core/logging.hpp"
+#include "core/rpicam_app.hpp"
+#include "core/thread_config.hpp"
+
+#include "background_writer.hpp"
+#include "raw_recorder.hpp"
+
+// O_DIRECT wants the offset and length to be multiples of the block size. The buffers themselves are mapped a
+// page at a time, so rounding a frame's length up to a page never reads outside the mapping.
+static constexpr size_t SLOT_ALIGN = 4096;
+
+RawRecorder::RawRecorder(RPiCamApp *app, VideoOptions const *options, libcamera::Stream *stream)
+	: app_(app), stream_(stream), direct_(true), slots_(options->Get().raw_ring), frames_(0), last_sequence_(0),
+	  dropped_(0), abort_(false), error_(false)
+{
+	StreamInfo info = app_->GetStreamInfo(stream_);
+	frame_size_ = info.stride * info.height;
+	slot_size_ = (frame_size_ + SLOT_ALIGN - 1) & ~(SLOT_ALIGN - 1);
+
+	std::string const &filename = options->Get().output;
+	if (filename.empty() || filename == "-")
+		throw std::runtime_error("raw-ring needs an output file");
+	fd_ = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	if (fd_ < 0)
+	{
+		direct_ = false;
+		fd_ = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if (fd_ < 0)
+		throw std::runtime_error("failed to open raw output file " + filename);
+
+	// Allocating it all now means the filesystem never has to find space while we're recording.
+	off_t total = (off_t)slot_size_ * slots_;
+	if (posix_fallocate(fd_, 0, total))
+	{
+		LOG(1, "RawRecorder: couldn't preallocate " << total << " bytes, file will grow as it's written");
+		if (ftruncate(fd_, total) < 0)
+			LOG_ERROR("WARNING: RawRecorder: failed to size output file");
+	}
+
+	if (!options->Get().raw_index.empty())
+	{
+		FILE *fp = fopen(options->Get().raw_index.c_str(), "w");
+		if (!fp)
+			throw std::runtime_error("failed to open raw index file " + options->Get().raw_index);
+		index_ = std::make_unique<BackgroundWriter>(fp, false);
+		char header[160];
+		int len = snprintf(header, sizeof(header),
+						   "# %ux%u stride %u %s, frame size %zu, slot size %zu, %u slots\n"
+						   "# frame slot offset sequence timestamp_ns exposure_us analogue_gain dropped\n",
+						   info.width, info.height, info.stride, info.pixel_format.toString().c_str(), frame_size_,
+						   slot_size_, slots_);
+		index_->Write(header, std::min<size_t>(len, sizeof(header) - 1));
+	}
+
+	LOG(1, "RawRecorder: " << slots_ << " slots of " << slot_size_ << " bytes" << (direct_ ? " (direct)" : ""));
+	thread_ = std::thread(&RawRecorder::writerThread, this);
+}
+
+RawRecorder::~RawRecorder()
+{
+	// Frames already queued are still written.
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		cond_var_.notify_one();
+	}
+	thread_.join();
+	close(fd_);
+	index_.reset();
+
+	LOG(1, "RawRecorder: wrote " << frames_ << " frames, camera dropped " << dropped_);
+}
+
+void RawRecorder::Write(CompletedRequestPtr &completed_request)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (error_)
+		throw std::runtime_error("failed to write raw frame");
+	// The queue can't grow beyond the camera's buffers, so if we fall behind it's the camera that drops frames.
+	queue_.push(completed_request);
+	cond_var_.notify_one();
+}
+
+void RawRecorder::writerThread()
+{
+	ThreadConfig::Apply("output");
+
+	while (true)
+	{
+		CompletedRequestPtr completed_request;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_var_.wait(lock, [this] { return abort_ || !queue_.empty(); });
+			if (queue_.empty())
+				return;
+			completed_request = std::move(queue_.front());
+			queue_.pop();
+		}
+
+		try
+		{
+			writeFrame(completed_request);
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("ERROR: RawRecorder: " << e.what());
+			std::lock_guard<std::mutex> lock(mutex_);
+			error_ = true;
+		}
+		// Dropping the request here hands the buffer straight back to the camera.
+	}
+}
+
+void RawRecorder::writeFrame(CompletedRequestPtr &completed_request)
+{
+	BufferReadSync r(app_, completed_request->buffers[stream_]);
+	libcamera::Span<uint8_t> span = r.Get()[0];
+	unsigned int slot = frames_ % slots_;
+	off_t offset = (off_t)slot * slot_size_;
+	size_t length = direct_ ? slot_size_ : std::min(span.size(), frame_size_);
+
+	uint8_t const *ptr = span.data();
+	while (length)
+	{
+		ssize_t ret = pwrite(fd_, ptr, length, offset);
+		if (ret < 0 && direct_ && (errno == EINVAL || errno == EFAULT))
+		{
+			// Some buffer memory can't be used for direct I/O, so carry on through the page cache.
+			LOG(1, "RawRecorder: direct writes not possible, falling back to buffered writes");
+			fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT);
+			direct_ = false;
+			length = std::min(span.size(), frame_size_) - (ptr - span.data());
+			continue;
+		}
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			throw std::runtime_error("write failed: " + std::string(strerror(errno)));
+		ptr += ret, offset += ret, length -= ret;
+	}
+
+	unsigned int sequence = completed_request->sequence;
+	unsigned int dropped = frames_ ? sequence - last_sequence_ - 1 : 0;
+	dropped_ += dropped;
+	last_sequence_ = sequence;
+
+	if (index_)
+	{
+		auto const &metadata = completed_request->metadata;
+		int64_t ts = metadata.get(libcamera::controls::SensorTimestamp).value_or(0);
+		int32_t exposure = metadata.get(libcamera::controls::ExposureTime).value_or(0);
+		float gain = metadata.get(libcamera::controls::AnalogueGain).value_or(0);
+		char line[128];
+		int len = snprintf(line, sizeof(line), "%" PRIu64 " %u %lld %u %" PRId64 " %d %.3f %u\n", frames_, slot,
+						   (long long)slot * slot_size_, sequence, ts, exposure, gain, dropped);
+		index_->Write(line, std::min<size_t>(len, sizeof(line) - 1));
+	}
+
+	frames_++;
+}
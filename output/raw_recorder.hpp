@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * raw_recorder.hpp - write raw camera buffers straight into a preallocated ring file.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+
+#include "core/completed_request.hpp"
+#include "core/video_options.hpp"
+
+class BackgroundWriter;
+class RPiCamApp;
+
+// For rpicam-raw with "--raw-ring N": the output file is preallocated to hold N frames, each in a slot rounded up
+// to the page size, and frames are written into the slots in turn, wrapping round when they're all used. Each
+// buffer is written with O_DIRECT (where the filesystem allows it) straight from the camera's own mapping, and the
+// request is held onto until that's done, so nothing is copied. An optional index file gets a line per frame
+// giving its slot and offset, its timestamp and some sensor metadata, along with the number of frames the camera
+// dropped just before it.
+
+class RawRecorder
+{
+public:
+	RawRecorder(RPiCamApp *app, VideoOptions const *options, libcamera::Stream *stream);
+	~RawRecorder();
+	void Write(CompletedRequestPtr &completed_request);
+
+private:
+	void writerThread();
+	void writeFrame(CompletedRequestPtr &completed_request);
+
+	RPiCamApp *app_;
+	libcamera::Stream *stream_;
+	int fd_;
+	bool direct_;
+	size_t frame_size_;
+	size_t slot_size_;
+	unsigned int slots_;
+	uint64_t frames_;
+	unsigned int last_sequence_;
+	uint64_t dropped_;
+	std::unique_ptr<BackgroundWriter> index_;
+
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	std::queue<CompletedRequestPtr> queue_;
+	bool abort_;
+	bool error_;
+	std::thread thread_;
+};
@@ -0,0 +1,634 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * rtsp_output.cpp - serve an H.264 stream to RTSP clients.
+ */
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+#include "core/thread_config.hpp"
+
+#include "rtsp_output.hpp"
+
+static constexpr unsigned int MAX_CLIENTS = 4;
+// Keeps packets comfortably inside a 1500 byte Ethernet MTU, with room for tunnels and the like.
+static constexpr size_t MAX_RTP_PAYLOAD = 1400;
+static constexpr uint8_t RTP_PAYLOAD_TYPE = 96;
+static constexpr uint8_t NAL_TYPE_SPS = 7;
+static constexpr uint8_t NAL_TYPE_PPS = 8;
+static constexpr uint8_t NAL_TYPE_FU_A = 28;
+// More than this much stuck in the way of an interleaved client and we give up on it.
+static constexpr size_t MAX_PENDING = 1 << 20;
+static constexpr size_t MAX_REQUEST = 8192;
+// sendmmsg and sendmsg each take at most this many entries at once.
+static constexpr size_t MAX_BATCH = 1024;
+// How often each client gets an RTCP sender report, which is what lets it put our RTP timestamps on a clock.
+static constexpr std::chrono::seconds RTCP_INTERVAL(5);
+static constexpr uint8_t RTCP_SR = 200;
+static constexpr uint8_t RTCP_SDES = 202;
+static constexpr char RTCP_CNAME[] = "rpicam-apps";
+// Tries at finding an even RTP port with a free one after it for RTCP.
+static constexpr unsigned int RTP_PORT_TRIES = 16;
+
+static std::string base64(std::vector<uint8_t> const &data)
+{
+	static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string out;
+	for (size_t i = 0; i < data.size(); i += 3)
+	{
+		uint32_t n = data[i] << 16;
+		if (i + 1 < data.size())
+			n |= data[i + 1] << 8;
+		if (i + 2 < data.size())
+			n |= data[i + 2];
+		out += table[(n >> 18) & 63];
+		out += table[(n >> 12) & 63];
+		out += i + 1 < data.size() ? table[(n >> 6) & 63] : '=';
+		out += i + 2 < data.size() ? table[n & 63] : '=';
+	}
+	return out;
+}
+
+// Returns the value of the named header in an RTSP request, or an empty string.
+static std::string header(std::string const &request, std::string const &name)
+{
+	std::istringstream lines(request);
+	std::string line;
+	while (std::getline(lines, line))
+	{
+		if (line.size() > name.size() && strncasecmp(line.c_str(), name.c_str(), name.size()) == 0 &&
+			line[name.size()] == ':')
+		{
+			size_t start = line.find_first_not_of(' ', name.size() + 1);
+			size_t end = line.find_last_not_of("\r ");
+			return start == std::string::npos ? "" : line.substr(start, end - start + 1);
+		}
+	}
+	return "";
+}
+
+// Interleaved data goes on the RTSP connection, so we must never block on it, nor leave half a packet
+// behind. Whatever the socket won't take is held back and sent before anything else.
+static bool send_pending(int fd, std::vector<uint8_t> &pending)
+{
+	while (!pending.empty())
+	{
+		ssize_t n = send(fd, pending.data(), pending.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		pending.erase(pending.begin(), pending.begin() + n);
+	}
+	return true;
+}
+
+RtspOutput::RtspOutput(VideoOptions const *options) : Output(options), rtp_port_(0), next_session_(0)
+{
+	if (options->Get().codec != "h264")
+		throw std::runtime_error("rtsp output requires the h264 codec");
+
+	int start, end, path = 0, a, b, c, d, port;
+	if (sscanf(options->Get().output.c_str(), "rtsp://%n%d.%d.%d.%d%n:%d%n", &start, &a, &b, &c, &d, &end, &port,
+			   &path) != 5)
+		throw std::runtime_error("bad rtsp address " + options->Get().output);
+	std::string address = options->Get().output.substr(start, end - start);
+	path_ = path ? options->Get().output.substr(path) : "/";
+
+	sockaddr_in saddr = {};
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(port);
+	if (inet_aton(address.c_str(), &saddr.sin_addr) == 0)
+		throw std::runtime_error("inet_aton failed for " + address);
+
+	listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to open rtsp socket");
+	int enable = 1;
+	if (setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
+		throw std::runtime_error("failed to setsockopt rtsp socket");
+	if (bind(listen_fd_, (sockaddr *)&saddr, sizeof(saddr)) < 0)
+		throw std::runtime_error("failed to bind rtsp socket");
+	listen(listen_fd_, MAX_CLIENTS);
+
+	// All the UDP clients get their RTP from this one socket, on whatever port it's given, and their RTCP
+	// from another on the port after it. RTP ports are meant to be even, so the pair may take a few goes.
+	rtp_fd_ = rtcp_fd_ = -1;
+	for (unsigned int i = 0; i < RTP_PORT_TRIES && rtcp_fd_ < 0; i++)
+	{
+		if (rtp_fd_ >= 0)
+			close(rtp_fd_);
+		rtp_fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (rtp_fd_ < 0 || fd < 0)
+			throw std::runtime_error("unable to open rtp socket");
+		sockaddr_in rtp_addr = {};
+		rtp_addr.sin_family = AF_INET;
+		rtp_addr.sin_addr = saddr.sin_addr;
+		socklen_t rtp_addr_len = sizeof(rtp_addr);
+		if (bind(rtp_fd_, (sockaddr *)&rtp_addr, sizeof(rtp_addr)) < 0 ||
+			getsockname(rtp_fd_, (sockaddr *)&rtp_addr, &rtp_addr_len) < 0)
+			throw std::runtime_error("failed to bind rtp socket");
+		rtp_port_ = ntohs(rtp_addr.sin_port);
+		sockaddr_in rtcp_addr = rtp_addr;
+		rtcp_addr.sin_port = htons(rtp_port_ + 1);
+		if (rtp_port_ % 2 == 0 && bind(fd, (sockaddr *)&rtcp_addr, sizeof(rtcp_addr)) == 0)
+			rtcp_fd_ = fd;
+		else
+			close(fd);
+	}
+	if (rtcp_fd_ < 0)
+		throw std::runtime_error("failed to find a pair of ports for rtp and rtcp");
+
+	std::random_device rd;
+	sequence_ = rd();
+	ssrc_ = rd();
+	timestamp_base_ = rd();
+
+	abort_fd_ = eventfd(0, EFD_CLOEXEC);
+	if (abort_fd_ < 0)
+		throw std::runtime_error("failed to create abort eventfd");
+	server_thread_ = std::thread(&RtspOutput::serverThread, this);
+	LOG(1, "RTSP server listening on " << options->Get().output);
+}
+
+RtspOutput::~RtspOutput()
+{
+	uint64_t one = 1;
+	if (write(abort_fd_, &one, sizeof(one)) != sizeof(one))
+		LOG_ERROR("RtspOutput: failed to stop server thread");
+	server_thread_.join();
+
+	for (auto &client : clients_)
+		close(client->fd);
+	close(abort_fd_);
+	close(rtcp_fd_);
+	close(rtp_fd_);
+	close(listen_fd_);
+}
+
+void RtspOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	// Split the Annex B byte stream into NAL units, without their start codes.
+	uint8_t const *data = static_cast<uint8_t const *>(mem);
+	std::vector<std::pair<uint8_t const *, size_t>> nals;
+	bool has_sps = false;
+	for (size_t i = 0; i + 3 <= size;)
+	{
+		if (data[i] || data[i + 1] || data[i + 2] != 1)
+		{
+			i++;
+			continue;
+		}
+		if (!nals.empty())
+		{
+			size_t nal_end = i > 0 && data[i - 1] == 0 ? i - 1 : i;
+			nals.back().second = data + nal_end - nals.back().first;
+		}
+		i += 3;
+		nals.emplace_back(data + i, size - i);
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	// Remember the parameter sets, for the SDP and for clients that join between keyframes.
+	for (auto const &[nal, len] : nals)
+	{
+		uint8_t type = len ? nal[0] & 0x1f : 0;
+		if (type == NAL_TYPE_SPS)
+			sps_.assign(nal, nal + len), has_sps = true;
+		else if (type == NAL_TYPE_PPS)
+			pps_.assign(nal, nal + len);
+	}
+
+	bool keyframe = flags & FLAG_KEYFRAME;
+	bool wanted = false;
+	for (auto const &client : clients_)
+		wanted |= client->playing && (keyframe || !client->waiting_keyframe);
+	if (!wanted)
+		return;
+
+	// RTP uses a 90kHz clock for video.
+	uint32_t timestamp = timestamp_base_ + (uint32_t)(timestamp_us * 9 / 100);
+	packets_.clear();
+	if (keyframe && !has_sps && !sps_.empty() && !pps_.empty())
+	{
+		packetise(sps_.data(), sps_.size(), timestamp, false);
+		packetise(pps_.data(), pps_.size(), timestamp, false);
+	}
+	for (size_t i = 0; i < nals.size(); i++)
+	{
+		if (nals[i].second)
+			packetise(nals[i].first, nals[i].second, timestamp, i + 1 == nals.size());
+	}
+
+	// The sender report counts what we've sent, and ties this frame's RTP timestamp to the wall clock.
+	packet_count_ += packets_.size();
+	for (auto const &packet : packets_)
+		octet_count_ += packet.head_len - 12 + packet.payload_len;
+	timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	std::vector<uint8_t> report = senderReport(now, timestamp);
+	auto report_time = std::chrono::steady_clock::now();
+
+	for (auto &client : clients_)
+	{
+		if (!client->playing || (client->waiting_keyframe && !keyframe))
+			continue;
+		client->waiting_keyframe = false;
+		if (client->interleaved)
+			sendInterleaved(*client);
+		else
+			sendUdp(*client);
+
+		if (report_time - client->last_report < RTCP_INTERVAL)
+			continue;
+		client->last_report = report_time;
+		if (!client->interleaved)
+			sendto(rtcp_fd_, report.data(), report.size(), MSG_DONTWAIT, (sockaddr *)&client->rtcp_addr,
+				   sizeof(client->rtcp_addr));
+		else if (client->pending.empty())
+		{
+			// Only between whole packets, like everything else on the connection.
+			uint8_t prefix[4] = { '$', (uint8_t)(client->channel + 1), (uint8_t)(report.size() >> 8),
+								  (uint8_t)report.size() };
+			client->pending.insert(client->pending.end(), prefix, prefix + 4);
+			client->pending.insert(client->pending.end(), report.begin(), report.end());
+			send_pending(client->fd, client->pending);
+		}
+	}
+}
+
+std::vector<uint8_t> RtspOutput::senderReport(timespec const &now, uint32_t timestamp) const
+{
+	// A compound RTCP packet (RFC 3550): the sender report, with no report blocks as we receive nothing,
+	// then the SDES with our CNAME that every compound packet must carry.
+	std::vector<uint8_t> report;
+	auto put32 = [&report](uint32_t value) {
+		for (int shift = 24; shift >= 0; shift -= 8)
+			report.push_back(value >> shift);
+	};
+
+	uint64_t ntp_seconds = now.tv_sec + 2208988800ull; // from 1900 rather than 1970
+	uint64_t ntp_fraction = ((uint64_t)now.tv_nsec << 32) / 1000000000;
+	report = { 0x80, RTCP_SR, 0, 6 };
+	put32(ssrc_);
+	put32(ntp_seconds);
+	put32(ntp_fraction);
+	put32(timestamp);
+	put32(packet_count_);
+	put32(octet_count_);
+
+	size_t cname_len = sizeof(RTCP_CNAME) - 1;
+	size_t sdes_words = (4 + 2 + cname_len + 1 + 3) / 4; // the SSRC, the item and at least one null, in words
+	report.insert(report.end(), { 0x81, RTCP_SDES, 0, (uint8_t)sdes_words });
+	put32(ssrc_);
+	report.insert(report.end(), { 1, (uint8_t)cname_len }); // CNAME
+	report.insert(report.end(), RTCP_CNAME, RTCP_CNAME + cname_len);
+	report.resize(28 + 4 * (sdes_words + 1), 0); // the sender report is 28 bytes
+	return report;
+}
+
+void RtspOutput::packetise(uint8_t const *nal, size_t len, uint32_t timestamp, bool last)
+{
+	auto add_packet = [&](uint8_t const *payload, size_t payload_len, bool marker) -> Packet & {
+		Packet &packet = packets_.emplace_back();
+		packet.head[0] = 0x80; // version 2
+		packet.head[1] = (marker ? 0x80 : 0) | RTP_PAYLOAD_TYPE;
+		packet.head[2] = sequence_ >> 8;
+		packet.head[3] = sequence_;
+		packet.head[4] = timestamp >> 24;
+		packet.head[5] = timestamp >> 16;
+		packet.head[6] = timestamp >> 8;
+		packet.head[7] = timestamp;
+		packet.head[8] = ssrc_ >> 24;
+		packet.head[9] = ssrc_ >> 16;
+		packet.head[10] = ssrc_ >> 8;
+		packet.head[11] = ssrc_;
+		packet.head_len = 12;
+		packet.payload = payload;
+		packet.payload_len = payload_len;
+		sequence_++;
+		return packet;
+	};
+
+	if (len <= MAX_RTP_PAYLOAD)
+	{
+		add_packet(nal, len, last);
+		return;
+	}
+
+	// FU-A fragments carry the NAL header's NRI bits in the indicator and its type in the FU header,
+	// with flags for the first and last fragments.
+	uint8_t indicator = (nal[0] & 0xe0) | NAL_TYPE_FU_A;
+	uint8_t type = nal[0] & 0x1f;
+	for (size_t pos = 1; pos < len;)
+	{
+		size_t chunk = std::min(MAX_RTP_PAYLOAD - 2, len - pos);
+		bool end = pos + chunk == len;
+		Packet &packet = add_packet(nal + pos, chunk, last && end);
+		packet.head[12] = indicator;
+		packet.head[13] = type | (pos == 1 ? 0x80 : 0) | (end ? 0x40 : 0);
+		packet.head_len = 14;
+		pos += chunk;
+	}
+}
+
+void RtspOutput::sendUdp(Client &client)
+{
+	std::vector<iovec> iov(2 * packets_.size());
+	std::vector<mmsghdr> msgs(packets_.size());
+	for (size_t i = 0; i < packets_.size(); i++)
+	{
+		iov[2 * i] = { packets_[i].head, packets_[i].head_len };
+		iov[2 * i + 1] = { const_cast<uint8_t *>(packets_[i].payload), packets_[i].payload_len };
+		msgs[i] = {};
+		msgs[i].msg_hdr.msg_name = &client.addr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(client.addr);
+		msgs[i].msg_hdr.msg_iov = &iov[2 * i];
+		msgs[i].msg_hdr.msg_iovlen = 2;
+	}
+
+	for (size_t sent = 0; sent < msgs.size();)
+	{
+		int n = sendmmsg(rtp_fd_, &msgs[sent], std::min(msgs.size() - sent, MAX_BATCH), MSG_DONTWAIT);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+		{
+			// The rest of this frame is lost, so there's no point sending more until the next keyframe.
+			client.waiting_keyframe = true;
+			return;
+		}
+		sent += n;
+	}
+}
+
+void RtspOutput::sendInterleaved(Client &client)
+{
+	if (!send_pending(client.fd, client.pending) || !client.pending.empty())
+	{
+		client.waiting_keyframe = true;
+		return;
+	}
+
+	std::vector<std::array<uint8_t, 4>> prefixes(packets_.size());
+	std::vector<iovec> iov;
+	iov.reserve(3 * packets_.size());
+	for (size_t i = 0; i < packets_.size(); i++)
+	{
+		size_t len = packets_[i].head_len + packets_[i].payload_len;
+		prefixes[i] = { '$', client.channel, (uint8_t)(len >> 8), (uint8_t)len };
+		iov.push_back({ prefixes[i].data(), 4 });
+		iov.push_back({ packets_[i].head, packets_[i].head_len });
+		iov.push_back({ const_cast<uint8_t *>(packets_[i].payload), packets_[i].payload_len });
+	}
+
+	for (size_t i = 0; i < iov.size();)
+	{
+		msghdr msg = {};
+		msg.msg_iov = &iov[i];
+		msg.msg_iovlen = std::min(iov.size() - i, MAX_BATCH);
+		size_t batch_end = i + msg.msg_iovlen;
+		ssize_t n = sendmsg(client.fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			return; // the server thread will notice the connection has gone
+		n = std::max<ssize_t>(n, 0);
+
+		// Step over whatever was sent.
+		for (; i < batch_end && (size_t)n >= iov[i].iov_len; i++)
+			n -= iov[i].iov_len;
+		if (i == batch_end)
+			continue;
+
+		// The socket is full. Only whole packets can go, so keep the rest of this one but nothing more.
+		if (n || i % 3)
+		{
+			iov[i].iov_base = static_cast<uint8_t *>(iov[i].iov_base) + n;
+			iov[i].iov_len -= n;
+			for (size_t packet_end = (i / 3 + 1) * 3; i < packet_end; i++)
+			{
+				uint8_t const *base = static_cast<uint8_t const *>(iov[i].iov_base);
+				client.pending.insert(client.pending.end(), base, base + iov[i].iov_len);
+			}
+		}
+		client.waiting_keyframe = true;
+		break;
+	}
+}
+
+void RtspOutput::serverThread()
+{
+	ThreadConfig::Apply("output");
+
+	while (true)
+	{
+		std::vector<pollfd> fds = { { abort_fd_, POLLIN, 0 }, { listen_fd_, POLLIN, 0 } };
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			for (auto const &client : clients_)
+				fds.push_back({ client->fd, POLLIN, 0 });
+		}
+
+		if (poll(fds.data(), fds.size(), -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			LOG_ERROR("RtspOutput: poll failed: " << strerror(errno));
+			return;
+		}
+		if (fds[0].revents)
+			return;
+
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		if (fds[1].revents & POLLIN)
+		{
+			auto client = std::make_unique<Client>();
+			socklen_t len = sizeof(client->addr);
+			client->fd = accept4(listen_fd_, (sockaddr *)&client->addr, &len, SOCK_CLOEXEC);
+			if (client->fd >= 0 && clients_.size() >= MAX_CLIENTS)
+			{
+				LOG(1, "RtspOutput: too many clients, refusing connection");
+				close(client->fd);
+			}
+			else if (client->fd >= 0)
+			{
+				LOG(1, "RtspOutput: client connected from " << inet_ntoa(client->addr.sin_addr));
+				clients_.push_back(std::move(client));
+			}
+		}
+
+		// Clients only ever get added at the end, so the fds we polled still line up with them.
+		for (size_t i = 2, c = 0; i < fds.size(); i++)
+		{
+			Client &client = *clients_[c];
+			bool ok = true;
+			if (fds[i].revents)
+			{
+				char buf[2048];
+				ssize_t n = recv(client.fd, buf, sizeof(buf), MSG_DONTWAIT);
+				ok = n > 0 || (n < 0 && (errno == EAGAIN || errno == EINTR));
+				if (n > 0)
+					client.request.append(buf, n);
+			}
+
+			while (ok && !client.request.empty())
+			{
+				// Clients may send us RTCP receiver reports interleaved on the connection, which we ignore.
+				if (client.request[0] == '$')
+				{
+					if (client.request.size() < 4)
+						break;
+					size_t len = 4 + ((uint8_t)client.request[2] << 8 | (uint8_t)client.request[3]);
+					if (client.request.size() < len)
+						break;
+					client.request.erase(0, len);
+					continue;
+				}
+
+				size_t end = client.request.find("\r\n\r\n");
+				if (end == std::string::npos)
+				{
+					ok = client.request.size() < MAX_REQUEST;
+					break;
+				}
+				std::string request = client.request.substr(0, end + 4);
+				client.request.erase(0, end + 4);
+				ok = handleRequest(client, request);
+			}
+
+			if (ok && client.pending.size() <= MAX_PENDING)
+			{
+				c++;
+				continue;
+			}
+			LOG(1, "RtspOutput: client " << inet_ntoa(client.addr.sin_addr) << " disconnected");
+			close(client.fd);
+			clients_.erase(clients_.begin() + c);
+		}
+	}
+}
+
+bool RtspOutput::handleRequest(Client &client, std::string const &request)
+{
+	std::istringstream first_line(request);
+	std::string method, url;
+	first_line >> method >> url;
+	LOG(2, "RtspOutput: " << method << " " << url);
+
+	std::string cseq = header(request, "CSeq");
+	std::string status = "200 OK", extra, body;
+	bool keep = true;
+
+	if (method == "OPTIONS")
+		extra = "Public: OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN, GET_PARAMETER\r\n";
+	else if (method == "DESCRIBE" && url.find(path_) == std::string::npos)
+		status = "404 Not Found";
+	else if (method == "DESCRIBE")
+	{
+		sockaddr_in local = {};
+		socklen_t len = sizeof(local);
+		getsockname(client.fd, (sockaddr *)&local, &len);
+		body = describe(inet_ntoa(local.sin_addr));
+		extra = "Content-Base: " + url + "/\r\nContent-Type: application/sdp\r\nContent-Length: " +
+				std::to_string(body.size()) + "\r\n";
+	}
+	else if (method == "SETUP")
+	{
+		std::string transport = header(request, "Transport");
+		size_t interleaved = transport.find("interleaved=");
+		size_t client_port = transport.find("client_port=");
+		if (client.session.empty())
+			client.session = std::to_string(ssrc_ ^ (0x9e3779b9 * ++next_session_));
+		if (interleaved != std::string::npos)
+		{
+			client.interleaved = true;
+			client.channel = atoi(transport.c_str() + interleaved + 12);
+			extra = "Transport: RTP/AVP/TCP;unicast;interleaved=" + std::to_string(client.channel) + "-" +
+					std::to_string(client.channel + 1) + "\r\n";
+		}
+		else if (client_port != std::string::npos)
+		{
+			char const *ports = transport.c_str() + client_port + 12;
+			char *end;
+			int rtp_port = strtol(ports, &end, 10);
+			int rtcp_port = *end == '-' ? atoi(end + 1) : rtp_port + 1;
+			client.interleaved = false;
+			client.addr.sin_port = htons(rtp_port);
+			client.rtcp_addr = client.addr;
+			client.rtcp_addr.sin_port = htons(rtcp_port);
+			extra = "Transport: RTP/AVP;unicast;client_port=" + std::to_string(rtp_port) + "-" +
+					std::to_string(rtcp_port) + ";server_port=" + std::to_string(rtp_port_) + "-" +
+					std::to_string(rtp_port_ + 1) + "\r\n";
+		}
+		else
+			status = "461 Unsupported Transport";
+		if (status[0] == '2')
+		{
+			client.set_up = true;
+			extra += "Session: " + client.session + ";timeout=60\r\n";
+		}
+	}
+	else if (method == "PLAY" && !client.set_up)
+		status = "455 Method Not Valid in This State";
+	else if (method == "PLAY")
+	{
+		client.playing = true;
+		client.waiting_keyframe = true;
+		client.last_report = {};
+		extra = "Session: " + client.session + "\r\nRange: npt=0.000-\r\n";
+	}
+	else if (method == "TEARDOWN")
+	{
+		client.playing = false;
+		extra = "Session: " + client.session + "\r\n";
+		keep = false;
+	}
+	else if (method == "GET_PARAMETER" || method == "SET_PARAMETER")
+		extra = "Session: " + client.session + "\r\n";
+	else
+		status = "501 Not Implemented";
+
+	std::string response = "RTSP/1.0 " + status + "\r\nCSeq: " + cseq + "\r\n" + extra + "\r\n" + body;
+	client.pending.insert(client.pending.end(), response.begin(), response.end());
+	return send_pending(client.fd, client.pending) && keep;
+}
+
+std::string RtspOutput::describe(std::string const &address) const
+{
+	std::string fmtp = "packetization-mode=1";
+	if (sps_.size() >= 4 && !pps_.empty())
+	{
+		char profile[7];
+		snprintf(profile, sizeof(profile), "%02x%02x%02x", sps_[1], sps_[2], sps_[3]);
+		fmtp += std::string(";profile-level-id=") + profile + ";sprop-parameter-sets=" + base64(sps_) + "," +
+				base64(pps_);
+	}
+
+	return "v=0\r\n"
+		   "o=- " + std::to_string(ssrc_) + " 1 IN IP4 " + address + "\r\n"
+		   "s=rpicam-apps\r\n"
+		   "c=IN IP4 0.0.0.0\r\n"
+		   "t=0 0\r\n"
+		   "a=control:*\r\n"
+		   "m=video 0 RTP/AVP " + std::to_string(RTP_PAYLOAD_TYPE) + "\r\n"
+		   "a=rtpmap:" + std::to_string(RTP_PAYLOAD_TYPE) + " H264/90000\r\n"
+		   "a=fmtp:" + std::to_string(RTP_PAYLOAD_TYPE) + " " + fmtp + "\r\n"
+		   "a=control:track0\r\n";
+}
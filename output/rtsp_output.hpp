@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * rtsp_output.hpp - serve an H.264 stream to RTSP clients.
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+#include <time.h>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "output.hpp"
+
+// A small RTSP server for a handful of clients, started with "--output rtsp://0.0.0.0:8554/stream".
+// Each H.264 frame is split into NAL units and packetised as RTP (RFC 6184), using single NAL unit
+// packets or FU-A fragments, and sent to every playing client either over UDP or interleaved on its
+// RTSP connection. We never wait for a client: one that can't keep up just misses frames until the
+// next keyframe. Every few seconds each client also gets an RTCP sender report, on the port (or channel)
+// after its RTP one.
+
+class RtspOutput : public Output
+{
+public:
+	RtspOutput(VideoOptions const *options);
+	~RtspOutput();
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	struct Packet
+	{
+		// RTP header plus FU-A indicator and header, if there is one, then the payload.
+		uint8_t head[14];
+		size_t head_len;
+		uint8_t const *payload;
+		size_t payload_len;
+	};
+
+	struct Client
+	{
+		int fd;
+		sockaddr_in addr;
+		std::string request; // partial RTSP request
+		std::string session;
+		bool set_up = false; // a SETUP has succeeded, so we know where to send the stream
+		bool playing = false;
+		bool interleaved = false;
+		uint8_t channel = 0;
+		bool waiting_keyframe = true;
+		std::vector<uint8_t> pending; // interleaved data the socket wouldn't take
+		sockaddr_in rtcp_addr; // UDP clients only
+		std::chrono::steady_clock::time_point last_report;
+	};
+
+	void serverThread();
+	bool handleRequest(Client &client, std::string const &request);
+	std::string describe(std::string const &address) const;
+	void packetise(uint8_t const *nal, size_t len, uint32_t timestamp, bool last);
+	std::vector<uint8_t> senderReport(timespec const &now, uint32_t timestamp) const;
+	void sendUdp(Client &client);
+	void sendInterleaved(Client &client);
+
+	int listen_fd_;
+	int rtp_fd_;
+	int rtcp_fd_;
+	uint16_t rtp_port_;
+	std::string path_;
+	int abort_fd_;
+	std::thread server_thread_;
+
+	// Shared between the server thread and outputBuffer.
+	std::mutex mutex_;
+	std::vector<std::unique_ptr<Client>> clients_;
+	std::vector<uint8_t> sps_, pps_;
+
+	std::vector<Packet> packets_;
+	uint16_t sequence_;
+	uint32_t ssrc_;
+	uint32_t timestamp_base_;
+	uint32_t packet_count_ = 0;
+	uint32_t octet_count_ = 0;
+	unsigned int next_session_;
+};
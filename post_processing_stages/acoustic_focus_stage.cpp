@@ -12,25 +12,36 @@
  * Note: Sound output hardware must be present for this stage to function.
  */
 
+#include <atomic>
 #include <chrono>
 #include <cmath>
-#include <fstream>
 #include <iomanip>
-#include <iostream>
-#include <libcamera/controls.h>
-#include <libcamera/stream.h>
 #include <sstream>
 #include <thread>
+#include <vector>
+
+#include <libcamera/controls.h>
+#include <libcamera/stream.h>
 
+#ifdef HAVE_ALSA
+#include <alsa/asoundlib.h>
+#endif
+
+#include "core/logging.hpp"
 #include "core/rpicam_app.hpp"
+#include "core/thread_config.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 
+using namespace std::chrono_literals;
+
+// The tone is made here, on a thread of our own, and played through ALSA. Process only posts the latest
+// frequency, and when the tone should stop, to that thread through a couple of atomics, so it never waits
+// for the sound. Without ALSA we fall back to running "play" for each beep, one at a time.
 class AcousticFocusStage : public PostProcessingStage
 {
 public:
-	AcousticFocusStage(RPiCamApp *app) : PostProcessingStage(app)
-	{
-	}
+	AcousticFocusStage(RPiCamApp *app) : PostProcessingStage(app) {}
+	~AcousticFocusStage() { Stop(); }
 
 	char const *Name() const override { return "acoustic_focus"; }
 
@@ -41,54 +52,166 @@ public:
 		min_freq_ = params.get<int>("minFreq", 300);
 		max_freq_ = params.get<int>("maxFreq", 3000);
 		duration_ = params.get<double>("duration", 0.1);
+		interval_ = params.get<double>("interval", 1.0);
+		continuous_ = params.get<bool>("continuous", false);
+		volume_ = params.get<double>("volume", 0.5);
+		device_ = params.get<std::string>("device", "default");
 		mapping_ = params.get<std::string>("mapping", "log");
 	}
 
+	void Start() override
+	{
+#ifdef HAVE_ALSA
+		abort_ = false;
+		tone_until_ = 0;
+		thread_ = std::thread(&AcousticFocusStage::playbackThread, this);
+#endif
+	}
+
 	bool Process(CompletedRequestPtr &completed_request) override
 	{
-		static auto last = std::chrono::steady_clock::now();
+		auto fom = completed_request->metadata.get(libcamera::controls::FocusFoM);
+		if (!fom)
+			return false;
+
+		// In continuous mode the tone follows every frame. Otherwise it's a beep once every interval.
+		int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+						  std::chrono::steady_clock::now().time_since_epoch())
+						  .count();
+		// Process runs on several pool workers at once, so only the one that moves next_beep_ on gets to beep.
+		int64_t next = next_beep_.load(std::memory_order_relaxed);
+		if (!continuous_ &&
+			(now < next ||
+			 !next_beep_.compare_exchange_strong(next, now + static_cast<int64_t>(interval_ * 1e9),
+												 std::memory_order_relaxed)))
+			return false;
+
+		int freq = frequency(*fom);
+#ifdef HAVE_ALSA
+		freq_.store(freq, std::memory_order_relaxed);
+		// Keep a continuous tone going until the frames stop coming.
+		int64_t length = continuous_ ? 500000000 : static_cast<int64_t>(duration_ * 1e9);
+		tone_until_.store(now + length, std::memory_order_release);
+#else
+		if (!playing_.exchange(true))
+		{
+			std::ostringstream oss;
+			oss << std::fixed << std::setprecision(6) << duration_;
+			std::string cmd = "/usr/bin/play -nq -t alsa synth " + oss.str() + " sine " + std::to_string(freq);
+			std::thread([this, cmd]() {
+				[[maybe_unused]] int i = system(cmd.c_str());
+				playing_ = false;
+			}).detach();
+		}
+#endif
+		return false;
+	}
+
+	void Stop() override
+	{
+#ifdef HAVE_ALSA
+		abort_ = true;
+		if (thread_.joinable())
+			thread_.join();
+#else
+		while (playing_)
+			std::this_thread::sleep_for(10ms);
+#endif
+	}
+
+private:
+	int frequency(int fom) const
+	{
+		int freq = min_freq_;
+		if (mapping_ == "log")
+		{
+			double norm = std::log(std::max(fom, min_fom_)) - std::log(min_fom_);
+			double denom = std::log(max_fom_) - std::log(min_fom_);
+			freq = min_freq_ + static_cast<int>(norm / denom * (max_freq_ - min_freq_));
+		}
+		else
+		{ // linear
+			double norm = std::max(fom, min_fom_) - min_fom_;
+			double denom = max_fom_ - min_fom_;
+			freq = min_freq_ + static_cast<int>(norm / denom * (max_freq_ - min_freq_));
+		}
+		return std::min(max_freq_, std::max(min_freq_, freq));
+	}
+
+#ifdef HAVE_ALSA
+	void playbackThread()
+	{
+		ThreadConfig::Apply("audio");
 
-		auto now = std::chrono::steady_clock::now();
-		auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - last).count();
+		static constexpr unsigned int RATE = 48000;
+		static constexpr unsigned int PERIOD = RATE / 100; // 10ms, which is how quickly the tone can change
 
-		if (ms >= 1000)
+		snd_pcm_t *pcm;
+		int ret = snd_pcm_open(&pcm, device_.c_str(), SND_PCM_STREAM_PLAYBACK, 0);
+		if (ret == 0)
+			ret = snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16_LE, SND_PCM_ACCESS_RW_INTERLEAVED, 1, RATE, 1, 50000);
+		if (ret < 0)
 		{
-			last = now;
+			LOG_ERROR("AcousticFocusStage: failed to open ALSA device " << device_ << ": " << snd_strerror(ret));
+			return;
+		}
+
+		std::vector<int16_t> samples(PERIOD);
+		double phase = 0, freq = min_freq_, gain = 0;
+		// Glide between frequencies, and fade in and out, over a few milliseconds so that nothing clicks.
+		const double glide = 1 - std::exp(-1.0 / (0.005 * RATE));
+		while (!abort_)
+		{
+			int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+							  std::chrono::steady_clock::now().time_since_epoch())
+							  .count();
+			bool on = now < tone_until_.load(std::memory_order_acquire);
+			double target_freq = freq_.load(std::memory_order_relaxed);
+			double target_gain = on ? volume_ * 32767 : 0;
+			if (gain == 0 && on)
+				freq = target_freq; // a new beep starts on its own frequency
+
+			for (auto &sample : samples)
+			{
+				freq += (target_freq - freq) * glide;
+				gain += (target_gain - gain) * glide;
+				phase += 2 * M_PI * freq / RATE;
+				if (phase > 2 * M_PI)
+					phase -= 2 * M_PI;
+				sample = static_cast<int16_t>(gain * std::sin(phase));
+			}
+			if (target_gain == 0 && gain < 1)
+				gain = 0;
 
-			auto fom = completed_request->metadata.get(libcamera::controls::FocusFoM);
-			if (fom)
+			snd_pcm_sframes_t written = snd_pcm_writei(pcm, samples.data(), PERIOD);
+			if (written < 0 && snd_pcm_recover(pcm, written, 1) < 0)
 			{
-				int freq = min_freq_;
-				if (mapping_ == "log")
-				{
-					double norm = std::log(std::max(*fom, min_fom_)) - std::log(min_fom_);
-					double denom = std::log(max_fom_) - std::log(min_fom_);
-					freq = min_freq_ + static_cast<int>(norm / denom * (max_freq_ - min_freq_));
-				}
-				else
-				{ // linear
-					double norm = std::max(*fom, min_fom_) - min_fom_;
-					double denom = max_fom_ - min_fom_;
-					freq = min_freq_ + static_cast<int>(norm / denom * (max_freq_ - min_freq_));
-				}
-				freq = std::min(max_freq_, std::max(min_freq_, freq));
-
-				std::ostringstream oss;
-				oss << std::fixed << std::setprecision(6) << duration_;
-				std::string duration_str = oss.str();
-
-				std::string cmd = "/usr/bin/play -nq -t alsa synth " + duration_str + " sine " + std::to_string(freq);
-				std::thread([](std::string cmd) { [[maybe_unused]] int i = system(cmd.c_str()); }, cmd).detach();
+				LOG_ERROR("AcousticFocusStage: ALSA playback failed: " << snd_strerror(written));
+				break;
 			}
 		}
-		return false;
+
+		snd_pcm_drop(pcm);
+		snd_pcm_close(pcm);
 	}
 
-private:
+	std::thread thread_;
+	std::atomic<bool> abort_ { false };
+	std::atomic<int> freq_ { 0 };
+	std::atomic<int64_t> tone_until_ { 0 };
+#else
+	std::atomic<bool> playing_ { false };
+#endif
+
 	int min_fom_ = 1, max_fom_ = 2000;
 	int min_freq_ = 400, max_freq_ = 2000;
 	double duration_ = 0.1;
+	double interval_ = 1.0;
+	bool continuous_ = false;
+	double volume_ = 0.5;
+	std::string device_ = "default";
 	std::string mapping_ = "log";
+	std::atomic<int64_t> next_beep_ { 0 };
 };
 
 static PostProcessingStage *Create(RPiCamApp *app)
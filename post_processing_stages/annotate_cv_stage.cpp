@@ -40,6 +40,7 @@ private:
 	Stream *stream_;
 	StreamInfo info_;
 	std::string text_;
+	InfoTextFormat format_;
 	int fg_;
 	int bg_;
 	double scale_;
@@ -87,8 +88,11 @@ bool AnnotateCvStage::Process(CompletedRequestPtr &completed_request)
 	FrameInfo info(completed_request);
 
 	// Other post-processing stages can supply metadata to update the text.
-	completed_request->post_process_metadata.Get("annotate.text", text_);
-	std::string text = info.ToString(text_);
+	completed_request->post_process_metadata.Get(ANNOTATE_TEXT, text_);
+	if (format_.Format() != text_)
+		format_.Set(text_);
+	std::string text;
+	format_.Render(info, text);
 	char text_with_date[256];
 	time_t t = time(NULL);
 	tm *tm_ptr = localtime(&t);
@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * exposure_stats.hpp - image statistics for exposure monitoring
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "core/metadata.hpp"
+
+struct ExposureStats
+{
+	// Histograms of the Y, U and V samples, each with the configured number of bins covering 0 to 255.
+	std::vector<uint32_t> histogram[3];
+	double mean[3];
+	// Each requested percentage, with the Y level below which that percentage of the samples lie.
+	std::vector<std::pair<double, double>> percentiles;
+	unsigned int samples; // Y samples that went into the statistics
+};
+
+inline const MetadataKey<ExposureStats> EXPOSURE_STATS("exposure_stats.results");
@@ -0,0 +1,239 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * exposure_stats_stage.cpp - luma and chroma histograms and percentiles for exposure monitoring
+ */
+
+// The stage samples every stride'th pixel of every stride'th row of each plane of the (normally lores)
+// image, and adds an ExposureStats to the metadata as "exposure_stats.results". With "sidecar" the means,
+// percentiles and histograms also go into the --metadata file. The rows sampled move on by one each time
+// the stage runs, so that over stride frames every row is looked at and nothing regular in the scene can
+// hide between the samples. frame_period runs the stage only on every frame_period'th frame.
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <libcamera/formats.h>
+#include <libcamera/stream.h>
+
+#include "core/rpicam_app.hpp"
+#include "core/sidecar.hpp"
+
+#include "post_processing_stages/exposure_stats.hpp"
+#include "post_processing_stages/histogram.hpp"
+#include "post_processing_stages/post_processing_stage.hpp"
+
+using Stream = libcamera::Stream;
+
+class ExposureStatsStage : public PostProcessingStage
+{
+public:
+	ExposureStatsStage(RPiCamApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+private:
+	unsigned int histogramPlane(uint8_t const *src, unsigned int width, unsigned int height, unsigned int stride,
+								unsigned int phase, uint32_t *histogram) const;
+
+	Stream *stream_;
+	StreamInfo info_;
+	bool lores_ = true;
+	unsigned int stride_ = 4;
+	unsigned int bins_ = 64;
+	unsigned int frame_period_ = 1;
+	std::vector<double> percentiles_;
+	bool sidecar_ = true;
+};
+
+#define NAME "exposure_stats"
+
+// Copy every step'th pixel of the row to dest, returning how many there were. NEON can pick these out
+// directly for the small steps that are the usual choice.
+
+static unsigned int sample_row(uint8_t const *src, unsigned int width, unsigned int step, uint8_t *dest)
+{
+	unsigned int x = 0, n = 0;
+#if defined(__ARM_NEON)
+	if (step == 1)
+	{
+		for (; x + 16 <= width; x += 16, n += 16)
+			vst1q_u8(dest + n, vld1q_u8(src + x));
+	}
+	else if (step == 2)
+	{
+		for (; x + 32 <= width; x += 32, n += 16)
+			vst1q_u8(dest + n, vld2q_u8(src + x).val[0]);
+	}
+	else if (step == 4)
+	{
+		for (; x + 64 <= width; x += 64, n += 16)
+			vst1q_u8(dest + n, vld4q_u8(src + x).val[0]);
+	}
+#endif
+	for (; x < width; x += step)
+		dest[n++] = src[x];
+	return n;
+}
+
+char const *ExposureStatsStage::Name() const
+{
+	return NAME;
+}
+
+void ExposureStatsStage::Read(boost::property_tree::ptree const &params)
+{
+	lores_ = params.get<std::string>("stream", "lores") == "lores";
+	stride_ = std::max(params.get<unsigned int>("stride", 4), 1u);
+	bins_ = params.get<unsigned int>("bins", 64);
+	if (bins_ == 0 || bins_ > 256 || (bins_ & (bins_ - 1)))
+		throw std::runtime_error("ExposureStatsStage: bins must be a power of 2 no more than 256");
+	frame_period_ = std::max(params.get<unsigned int>("frame_period", 1), 1u);
+	sidecar_ = params.get<bool>("sidecar", true);
+
+	if (params.find("percentiles") != params.not_found())
+	{
+		for (auto const &p : params.get_child("percentiles"))
+			percentiles_.push_back(std::clamp(p.second.get_value<double>(), 0.0, 100.0));
+	}
+	else
+		percentiles_ = { 1, 5, 50, 95, 99 };
+}
+
+void ExposureStatsStage::Configure()
+{
+	stream_ = lores_ ? app_->LoresStream() : nullptr;
+	if (lores_ && !stream_)
+		LOG(1, "ExposureStatsStage: no lores stream, using the main stream");
+	if (!stream_)
+		stream_ = app_->GetMainStream();
+	if (!stream_)
+		return;
+	if (stream_->configuration().pixelFormat != libcamera::formats::YUV420)
+		throw std::runtime_error("ExposureStatsStage: only YUV420 format supported");
+	info_ = app_->GetStreamInfo(stream_);
+}
+
+// Add the samples of one plane to a full 256 bin histogram, returning the number of samples. The counts
+// are spread over four copies of the histogram, so that runs of equal pixels don't each have to wait for
+// the last one's increment before they can do their own.
+
+unsigned int ExposureStatsStage::histogramPlane(uint8_t const *src, unsigned int width, unsigned int height,
+												unsigned int stride, unsigned int phase, uint32_t *histogram) const
+{
+	uint32_t counts[4][256] = {};
+	std::vector<uint8_t> samples(width);
+	unsigned int total = 0;
+
+	for (unsigned int y = phase % std::min(stride_, height); y < height; y += stride_)
+	{
+		unsigned int n = sample_row(src + y * stride, width, stride_, samples.data()), i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			counts[0][samples[i]]++;
+			counts[1][samples[i + 1]]++;
+			counts[2][samples[i + 2]]++;
+			counts[3][samples[i + 3]]++;
+		}
+		for (; i < n; i++)
+			counts[0][samples[i]]++;
+		total += n;
+	}
+
+	for (unsigned int b = 0; b < 256; b++)
+		histogram[b] = counts[0][b] + counts[1][b] + counts[2][b] + counts[3][b];
+	return total;
+}
+
+template <typename T>
+static std::string json_array(std::vector<T> const &values)
+{
+	std::stringstream out;
+	out << "[";
+	for (unsigned int i = 0; i < values.size(); i++)
+		out << (i ? ", " : "") << values[i];
+	out << "]";
+	return out.str();
+}
+
+bool ExposureStatsStage::Process(CompletedRequestPtr &completed_request)
+{
+	if (!stream_ || completed_request->sequence % frame_period_)
+		return false;
+
+	uint32_t histograms[3][256];
+	unsigned int samples[3];
+	unsigned int phase = completed_request->sequence / frame_period_;
+	{
+		BufferReadSync r(app_, completed_request->buffers[stream_]);
+		uint8_t const *y = r.Get()[0].data();
+		uint8_t const *u = y + info_.stride * info_.height;
+		uint8_t const *v = u + (info_.stride / 2) * (info_.height / 2);
+
+		samples[0] = histogramPlane(y, info_.width, info_.height, info_.stride, phase, histograms[0]);
+		samples[1] = histogramPlane(u, info_.width / 2, info_.height / 2, info_.stride / 2, phase, histograms[1]);
+		samples[2] = histogramPlane(v, info_.width / 2, info_.height / 2, info_.stride / 2, phase, histograms[2]);
+	}
+
+	ExposureStats stats;
+	unsigned int shift = __builtin_ctz(256 / bins_);
+	for (unsigned int p = 0; p < 3; p++)
+	{
+		uint64_t sum = 0;
+		stats.histogram[p].assign(bins_, 0);
+		for (unsigned int b = 0; b < 256; b++)
+		{
+			stats.histogram[p][b >> shift] += histograms[p][b];
+			sum += (uint64_t)b * histograms[p][b];
+		}
+		stats.mean[p] = samples[p] ? (double)sum / samples[p] : 0;
+	}
+	stats.samples = samples[0];
+
+	if (samples[0])
+	{
+		Histogram histogram(histograms[0], 256);
+		for (double p : percentiles_)
+			stats.percentiles.emplace_back(p, histogram.Quantile(p / 100));
+	}
+
+	if (sidecar_)
+	{
+		Metadata &metadata = completed_request->post_process_metadata;
+		char const *planes[] = { "y", "u", "v" };
+		std::vector<double> levels;
+		for (auto const &p : stats.percentiles)
+			levels.push_back(p.second);
+		for (unsigned int p = 0; p < 3; p++)
+			AppendSidecar(metadata, std::string(NAME ".") + planes[p] + "_mean", std::to_string(stats.mean[p]));
+		AppendSidecar(metadata, NAME ".y_percentiles", json_array(levels));
+		for (unsigned int p = 0; p < 3; p++)
+			AppendSidecar(metadata, std::string(NAME ".") + planes[p] + "_histogram",
+						  json_array(stats.histogram[p]));
+	}
+
+	LOG(2, "ExposureStats: Y mean " << stats.mean[0] << " from " << stats.samples << " samples");
+	completed_request->post_process_metadata.Set(EXPOSURE_STATS, std::move(stats));
+
+	return false;
+}
+
+static PostProcessingStage *Create(RPiCamApp *app)
+{
+	return new ExposureStatsStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
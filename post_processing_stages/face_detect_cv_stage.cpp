@@ -26,6 +26,11 @@ using namespace cv;
 
 using Stream = libcamera::Stream;
 
+// With "tracking" set, a search of the whole image only happens every "detect_interval" searches. In between,
+// we look only around the faces we last found (grown by "search_margin" times their size) and, if a motion
+// detect stage runs before us, in the regions where it saw motion. The work then depends on the number of
+// faces rather than on the size of the image, and a new face that nothing moved near waits for the next full
+// search to be found.
 class FaceDetectCvStage : public PostProcessingStage
 {
 public:
@@ -42,7 +47,7 @@ public:
 	void Stop() override;
 
 private:
-	void detectFeatures(cv::CascadeClassifier &cascade);
+	void detectFeatures(cv::CascadeClassifier &cascade, std::vector<cv::Rect> rois);
 	void drawFeatures(cv::Mat &img);
 
 	Stream *stream_;
@@ -54,6 +59,7 @@ private:
 	std::mutex future_ptr_mutex_;
 	Mat image_;
 	std::vector<cv::Rect> faces_;
+	std::vector<cv::Rect> lores_faces_; // where faces_ are in the low res image
 	CascadeClassifier cascade_;
 	std::string cascadeName_;
 	double scaling_factor_;
@@ -62,6 +68,10 @@ private:
 	int max_size_;
 	int refresh_rate_;
 	int draw_features_;
+	bool tracking_;
+	int detect_interval_;
+	double search_margin_;
+	unsigned int searches_ = 0;
 };
 
 #define NAME "face_detect_cv"
@@ -83,6 +93,9 @@ void FaceDetectCvStage::Read(boost::property_tree::ptree const &params)
 	max_size_ = params.get<int>("max_size", 256);
 	refresh_rate_ = params.get<int>("refresh_rate", 5);
 	draw_features_ = params.get<int>("draw_features", 1);
+	tracking_ = params.get<int>("tracking", 0);
+	detect_interval_ = std::max(params.get<int>("detect_interval", 10), 1);
+	search_margin_ = params.get<double>("search_margin", 0.5);
 }
 
 void FaceDetectCvStage::Configure()
@@ -126,8 +139,43 @@ bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 			Mat image(low_res_info_.height, low_res_info_.width, CV_8U, ptr, low_res_info_.stride);
 			image_ = image.clone();
 
-			future_ptr_ = std::make_unique<std::future<void>>();
-			*future_ptr_ = std::async(std::launch::async, [this] { detectFeatures(cascade_); });
+			std::vector<Rect> rois;
+			bool search = true;
+			if (tracking_ && searches_++ % detect_interval_)
+			{
+				Rect bounds(0, 0, low_res_info_.width, low_res_info_.height);
+				{
+					std::unique_lock<std::mutex> lock(face_mutex_);
+					for (Rect const &face : lores_faces_)
+					{
+						int dx = face.width * search_margin_, dy = face.height * search_margin_;
+						rois.push_back(Rect(face.x - dx, face.y - dy, face.width + 2 * dx, face.height + 2 * dy) &
+									   bounds);
+					}
+				}
+				std::vector<libcamera::Rectangle> motion;
+				completed_request->post_process_metadata.Get("motion_detect.regions", motion);
+				for (libcamera::Rectangle const &r : motion)
+					rois.push_back(Rect(r.x, r.y, r.width, r.height) & bounds);
+				// Too small to hold a face is as good as nothing at all.
+				rois.erase(std::remove_if(rois.begin(), rois.end(),
+										  [this](Rect const &r) { return r.width < min_size_ || r.height < min_size_; }),
+						   rois.end());
+				if (rois.empty())
+				{
+					// Nothing to look at until the next full search.
+					std::unique_lock<std::mutex> lock(face_mutex_);
+					faces_.clear();
+					lores_faces_.clear();
+					search = false;
+				}
+			}
+
+			if (search)
+			{
+				future_ptr_ = std::make_unique<std::future<void>>();
+				*future_ptr_ = std::async(std::launch::async, [this, rois] { detectFeatures(cascade_, rois); });
+			}
 		}
 	}
 
@@ -150,13 +198,37 @@ bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 	return false;
 }
 
-void FaceDetectCvStage::detectFeatures(CascadeClassifier &cascade)
+void FaceDetectCvStage::detectFeatures(CascadeClassifier &cascade, std::vector<Rect> rois)
 {
-	equalizeHist(image_, image_);
-
 	std::vector<Rect> temp_faces;
-	cascade.detectMultiScale(image_, temp_faces, scaling_factor_, min_neighbors_, CASCADE_SCALE_IMAGE,
-							 Size(min_size_, min_size_), Size(max_size_, max_size_));
+	if (rois.empty())
+	{
+		equalizeHist(image_, image_);
+		cascade.detectMultiScale(image_, temp_faces, scaling_factor_, min_neighbors_, CASCADE_SCALE_IMAGE,
+								 Size(min_size_, min_size_), Size(max_size_, max_size_));
+	}
+	else
+	{
+		for (Rect const &roi : rois)
+		{
+			Mat region = image_(roi);
+			equalizeHist(region, region);
+			std::vector<Rect> found;
+			cascade.detectMultiScale(region, found, scaling_factor_, min_neighbors_, CASCADE_SCALE_IMAGE,
+									 Size(min_size_, min_size_), Size(max_size_, max_size_));
+			// Regions can overlap, so the same face may turn up more than once.
+			for (Rect face : found)
+			{
+				face += roi.tl();
+				bool duplicate = std::any_of(temp_faces.begin(), temp_faces.end(), [&face](Rect const &other) {
+					return (face & other).area() * 2 > std::min(face.area(), other.area());
+				});
+				if (!duplicate)
+					temp_faces.push_back(face);
+			}
+		}
+	}
+	std::vector<Rect> lores_faces = temp_faces;
 
 	// Scale faces back to the size and location in the full res image.
 	double scale_x = full_stream_info_.width / (double)low_res_info_.width;
@@ -170,6 +242,7 @@ void FaceDetectCvStage::detectFeatures(CascadeClassifier &cascade)
 	}
 	std::unique_lock<std::mutex> lock(face_mutex_);
 	faces_ = std::move(temp_faces);
+	lores_faces_ = std::move(lores_faces);
 }
 
 void FaceDetectCvStage::drawFeatures(Mat &img)
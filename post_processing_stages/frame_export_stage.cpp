@@ -0,0 +1,363 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * frame_export_stage.cpp - hand camera buffers to other processes over a Unix socket
+ */
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <libcamera/control_ids.h>
+
+#include "core/rpicam_app.hpp"
+#include "core/sidecar.hpp"
+#include "core/thread_config.hpp"
+#include "output/output.hpp"
+
+#include "post_processing_stages/post_processing_stage.hpp"
+
+// Other processes connect to a SOCK_SEQPACKET Unix socket, and are sent one message for each frame:
+// a FrameExportHeader, followed by the frame's metadata as a JSON object (as --metadata would write it),
+// with the dmabuf of the image attached as SCM_RIGHTS. They can mmap the dmabuf, bracketed by
+// DMA_BUF_IOCTL_SYNC, and must send back the 4 byte frame number once they are done with it. Until every
+// client it was sent to does so, or disconnects, we hold on to the frame and the camera can't reuse its
+// buffers, so at most "max_outstanding" frames are held at once. Frames that arrive when that many are
+// held aren't exported, and nor are any to a client whose socket is full. Give the camera enough buffers
+// (--buffer-count) to cover the frames held as well as the rest of the pipeline.
+
+namespace
+{
+
+struct FrameExportHeader
+{
+	uint32_t magic; // "RPFX"
+	uint16_t version;
+	uint16_t header_size;
+	uint32_t frame; // the number to send back
+	uint32_t sequence; // the camera's frame sequence number
+	int64_t timestamp; // sensor timestamp, ns
+	uint32_t camera;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t pixel_format; // DRM fourcc
+	uint32_t offset; // of the image within the dmabuf
+	uint32_t length; // of the image
+	uint32_t metadata_size; // bytes of JSON following the header
+};
+
+static_assert(sizeof(FrameExportHeader) == 56, "FrameExportHeader must stay 56 bytes");
+
+constexpr uint32_t EXPORT_MAGIC = 0x58465052; // "RPFX"
+constexpr uint16_t EXPORT_VERSION = 1;
+
+} // namespace
+
+using Stream = libcamera::Stream;
+
+class FrameExportStage : public PostProcessingStage
+{
+public:
+	FrameExportStage(RPiCamApp *app) : PostProcessingStage(app) {}
+	~FrameExportStage();
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+	void Stop() override;
+
+private:
+	// A frame that clients still have.
+	struct HeldFrame
+	{
+		uint32_t frame;
+		CompletedRequestPtr request;
+		std::vector<int> clients;
+	};
+
+	void serverThread();
+	void acknowledge(int client, uint32_t frame, std::vector<CompletedRequestPtr> &released);
+	void dropClient(int client, std::vector<CompletedRequestPtr> &released);
+
+	std::string socket_path_;
+	bool lores_ = false;
+	unsigned int max_outstanding_ = 2;
+
+	Stream *stream_ = nullptr;
+	StreamInfo info_;
+	int listen_fd_ = -1;
+	bool bound_ = false; // so we only ever unlink a socket that is ours
+	int abort_fd_ = -1;
+	std::thread thread_;
+
+	std::mutex mutex_;
+	std::vector<int> clients_;
+	std::deque<HeldFrame> held_;
+	uint32_t frame_ = 0;
+	uint64_t exported_ = 0;
+	uint64_t skipped_ = 0;
+};
+
+#define NAME "frame_export"
+
+char const *FrameExportStage::Name() const
+{
+	return NAME;
+}
+
+FrameExportStage::~FrameExportStage()
+{
+	if (thread_.joinable())
+	{
+		uint64_t one = 1;
+		if (write(abort_fd_, &one, sizeof(one)) < 0)
+			LOG_ERROR("ERROR: failed to stop frame export server");
+		thread_.join();
+	}
+
+	for (int client : clients_)
+		close(client);
+	if (listen_fd_ >= 0)
+		close(listen_fd_);
+	if (bound_)
+		unlink(socket_path_.c_str());
+	if (abort_fd_ >= 0)
+		close(abort_fd_);
+
+	LOG(1, "Exported " << exported_ << " frames, skipped " << skipped_);
+}
+
+void FrameExportStage::Read(boost::property_tree::ptree const &params)
+{
+	socket_path_ = params.get<std::string>("socket", "/tmp/rpicam-frames.sock");
+	lores_ = params.get<std::string>("stream", "main") == "lores";
+	max_outstanding_ = std::max(1u, params.get<unsigned int>("max_outstanding", 2));
+
+	// The server lasts as long as the stage, so clients stay connected when the camera is reconfigured.
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (socket_path_.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("frame export socket path too long: " + socket_path_);
+	strcpy(addr.sun_path, socket_path_.c_str());
+
+	listen_fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to open frame export socket");
+	unlink(socket_path_.c_str());
+	if (bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) < 0)
+		throw std::runtime_error("failed to bind frame export socket " + socket_path_);
+	bound_ = true;
+	// Clients get writable camera buffers, so only our own user may connect. Nobody can before we listen.
+	if (chmod(socket_path_.c_str(), S_IRUSR | S_IWUSR) < 0 || listen(listen_fd_, 4) < 0)
+		throw std::runtime_error("failed to listen on frame export socket " + socket_path_);
+
+	abort_fd_ = eventfd(0, EFD_CLOEXEC);
+	thread_ = std::thread(&FrameExportStage::serverThread, this);
+	LOG(2, "Exporting frames on " << socket_path_);
+}
+
+void FrameExportStage::Configure()
+{
+	stream_ = lores_ ? app_->LoresStream() : app_->GetMainStream();
+	if (!stream_)
+		throw std::runtime_error("FrameExportStage: no " + std::string(lores_ ? "lores" : "main") + " stream");
+	info_ = app_->GetStreamInfo(stream_);
+}
+
+bool FrameExportStage::Process(CompletedRequestPtr &completed_request)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (clients_.empty())
+			return false;
+		if (held_.size() >= max_outstanding_)
+		{
+			skipped_++;
+			return false;
+		}
+	}
+
+	auto it = completed_request->buffers.find(stream_);
+	if (it == completed_request->buffers.end())
+		return false;
+	libcamera::FrameBuffer::Plane const &plane = it->second->planes()[0];
+
+	SidecarValues extra;
+	completed_request->post_process_metadata.Get(SIDECAR_VALUES, extra);
+	std::stringbuf json;
+	write_metadata(&json, "json", completed_request->metadata, true, extra);
+	std::string metadata = json.str();
+
+	FrameExportHeader header = {};
+	header.magic = EXPORT_MAGIC;
+	header.version = EXPORT_VERSION;
+	header.header_size = sizeof(header);
+	header.sequence = completed_request->sequence;
+	header.timestamp = completed_request->metadata.get(libcamera::controls::SensorTimestamp).value_or(0);
+	header.camera = completed_request->camera;
+	header.width = info_.width;
+	header.height = info_.height;
+	header.stride = info_.stride;
+	header.pixel_format = info_.pixel_format.fourcc();
+	header.offset = plane.offset;
+	header.length = plane.length;
+	header.metadata_size = metadata.size();
+
+	iovec iov[2] = { { &header, sizeof(header) }, { metadata.data(), metadata.size() } };
+	char control[CMSG_SPACE(sizeof(int))] = {};
+	msghdr msg = {};
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	int fd = plane.fd.get();
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+
+	std::vector<CompletedRequestPtr> released;
+	std::lock_guard<std::mutex> lock(mutex_);
+	header.frame = frame_++;
+	HeldFrame held { header.frame, completed_request, {} };
+	for (unsigned int i = 0; i < clients_.size();)
+	{
+		int client = clients_[i];
+		if (sendmsg(client, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0)
+			held.clients.push_back(client);
+		else if (errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			dropClient(client, released);
+			continue;
+		}
+		// Otherwise this client is behind, and misses the frame.
+		i++;
+	}
+
+	if (held.clients.empty())
+		skipped_++;
+	else
+	{
+		held_.push_back(std::move(held));
+		exported_++;
+	}
+
+	return false;
+}
+
+void FrameExportStage::Stop()
+{
+	// The camera is stopping and needs its buffers back. Clients may still get late acknowledgements
+	// through to us, which will find nothing to release.
+	std::deque<HeldFrame> held;
+	std::lock_guard<std::mutex> lock(mutex_);
+	std::swap(held, held_);
+}
+
+// Called with the mutex held. Requests to release go into released, for the caller to let go of after the
+// mutex, as doing so hands the buffers back to the camera.
+
+void FrameExportStage::acknowledge(int client, uint32_t frame, std::vector<CompletedRequestPtr> &released)
+{
+	auto it = std::find_if(held_.begin(), held_.end(), [frame](HeldFrame const &f) { return f.frame == frame; });
+	if (it == held_.end())
+		return;
+	it->clients.erase(std::remove(it->clients.begin(), it->clients.end(), client), it->clients.end());
+	if (it->clients.empty())
+	{
+		released.push_back(std::move(it->request));
+		held_.erase(it);
+	}
+}
+
+void FrameExportStage::dropClient(int client, std::vector<CompletedRequestPtr> &released)
+{
+	LOG(2, "Frame export client disconnected");
+	std::vector<uint32_t> frames;
+	for (HeldFrame const &f : held_)
+		frames.push_back(f.frame);
+	for (uint32_t frame : frames)
+		acknowledge(client, frame, released);
+	clients_.erase(std::remove(clients_.begin(), clients_.end(), client), clients_.end());
+	close(client);
+}
+
+void FrameExportStage::serverThread()
+{
+	ThreadConfig::Apply("output");
+
+	while (true)
+	{
+		std::vector<pollfd> fds = { { abort_fd_, POLLIN, 0 }, { listen_fd_, POLLIN, 0 } };
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			for (int client : clients_)
+				fds.push_back({ client, POLLIN, 0 });
+		}
+
+		if (poll(fds.data(), fds.size(), -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			LOG_ERROR("ERROR: frame export server poll failed");
+			return;
+		}
+		if (fds[0].revents & POLLIN)
+			return;
+
+		std::vector<CompletedRequestPtr> released;
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		if (fds[1].revents & POLLIN)
+		{
+			int client = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+			if (client >= 0)
+			{
+				LOG(2, "Frame export client connected");
+				clients_.push_back(client);
+			}
+		}
+
+		for (unsigned int i = 2; i < fds.size(); i++)
+		{
+			// Process may have dropped the client since we polled.
+			if (!fds[i].revents || std::find(clients_.begin(), clients_.end(), fds[i].fd) == clients_.end())
+				continue;
+
+			uint32_t frame;
+			ssize_t n = recv(fds[i].fd, &frame, sizeof(frame), MSG_DONTWAIT);
+			if (n == sizeof(frame))
+				acknowledge(fds[i].fd, frame, released);
+			else if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) ||
+					 (fds[i].revents & (POLLHUP | POLLERR)))
+				dropClient(fds[i].fd, released);
+		}
+	}
+}
+
+static PostProcessingStage *Create(RPiCamApp *app)
+{
+	return new FrameExportStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
@@ -17,6 +17,7 @@
 #include "classification/classification.hpp"
 
 #include "core/rpicam_app.hpp"
+#include "post_processing_stages/object_detect.hpp"
 
 #include "hailo_postprocessing_stage.hpp"
 
@@ -40,13 +41,19 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
-	std::vector<HailoClassificationPtr> runInference(uint8_t *frame);
+	std::vector<HailoClassificationPtr> runInference(HailoInput frame);
+	std::vector<HailoClassificationPtr> classify(std::vector<OutTensor> &output_tensors);
+	void runCascade(CompletedRequestPtr &completed_request);
 
 	DlLib postproc_;
 
 	// Config params
 	float threshold_;
 	bool do_softmax_;
+	// In cascade mode we classify the objects found by an earlier detector stage, rather than the whole frame.
+	bool cascade_;
+	unsigned int max_objects_;
+	unsigned int min_size_;
 };
 
 HailoClassifier::HailoClassifier(RPiCamApp *app)
@@ -64,6 +71,10 @@ void HailoClassifier::Read(boost::property_tree::ptree const &params)
 	threshold_ = params.get<float>("threshold", 0.5f);
 	do_softmax_ = params.get<bool>("do_softmax", true);
 
+	cascade_ = params.find("cascade") != params.not_found();
+	max_objects_ = params.get<unsigned int>("cascade.max_objects", 8);
+	min_size_ = params.get<unsigned int>("cascade.min_size", 16);
+
 	HailoPostProcessingStage::Read(params);
 }
 
@@ -80,58 +91,73 @@ bool HailoClassifier::Process(CompletedRequestPtr &completed_request)
 		return false;
 	}
 
-	BufferReadSync r(app_, completed_request->buffers[low_res_stream_]);
-	libcamera::Span<uint8_t> buffer = r.Get()[0];
-	std::shared_ptr<uint8_t> input;
-	uint8_t *input_ptr;
-
-	if (low_res_info_.pixel_format == libcamera::formats::YUV420)
+	if (cascade_)
 	{
-		StreamInfo rgb_info;
-		rgb_info.width = InputTensorSize().width;
-		rgb_info.height = InputTensorSize().height;
-		rgb_info.stride = rgb_info.width * 3;
+		runCascade(completed_request);
+		return false;
+	}
 
-		input = allocator_.Allocate(rgb_info.stride * rgb_info.height);
-		input_ptr = input.get();
+	std::vector<HailoClassificationPtr> results;
+	libcamera::FrameBuffer *dmabuf = DmabufInput(completed_request);
 
-		Yuv420ToRgb(input.get(), buffer.data(), low_res_info_, rgb_info);
-	}
-	else if (low_res_info_.pixel_format == libcamera::formats::RGB888 ||
-			 low_res_info_.pixel_format == libcamera::formats::BGR888)
+	if (dmabuf)
+		results = runInference(dmabuf);
+	else
 	{
-		unsigned int stride = low_res_info_.width * 3;
+		BufferReadSync r(app_, completed_request->buffers[low_res_stream_]);
+		libcamera::Span<uint8_t> buffer = r.Get()[0];
+		std::shared_ptr<uint8_t> input;
+		uint8_t *input_ptr;
 
-		// If the stride shows we have padding on the right edge of the buffer, we must copy it out to another buffer
-		// without padding.
-		if (low_res_info_.stride != stride)
+		if (low_res_info_.pixel_format == libcamera::formats::YUV420)
 		{
-			input = allocator_.Allocate(stride * low_res_info_.height);
+			StreamInfo rgb_info;
+			rgb_info.width = InputTensorSize().width;
+			rgb_info.height = InputTensorSize().height;
+			rgb_info.stride = rgb_info.width * 3;
+
+			input = allocator_.Allocate(rgb_info.stride * rgb_info.height);
 			input_ptr = input.get();
 
-			for (unsigned int i = 0; i < low_res_info_.height; i++)
-				memcpy(input_ptr + i * stride, buffer.data() + i * low_res_info_.stride, stride);
+			Yuv420ToRgb(input.get(), buffer.data(), low_res_info_, rgb_info);
+		}
+		else if (low_res_info_.pixel_format == libcamera::formats::RGB888 ||
+				 low_res_info_.pixel_format == libcamera::formats::BGR888)
+		{
+			unsigned int stride = low_res_info_.width * 3;
+
+			// If the stride shows we have padding on the right edge of the buffer, we must copy it out to another
+			// buffer without padding.
+			if (low_res_info_.stride != stride)
+			{
+				input = allocator_.Allocate(stride * low_res_info_.height);
+				input_ptr = input.get();
+
+				for (unsigned int i = 0; i < low_res_info_.height; i++)
+					memcpy(input_ptr + i * stride, buffer.data() + i * low_res_info_.stride, stride);
+			}
+			else
+				input_ptr = buffer.data();
 		}
 		else
-			input_ptr = buffer.data();
-	}
-	else
-	{
-		LOG_ERROR("Unexpected lores format " << low_res_info_.pixel_format);
-		return false;
+		{
+			LOG_ERROR("Unexpected lores format " << low_res_info_.pixel_format);
+			return false;
+		}
+
+		results = runInference(input_ptr);
 	}
 
-	std::vector<HailoClassificationPtr> results = runInference(input_ptr);
 	if (results.size())
 	{
 		LOG(2, "Result: " << results[0]->get_label());
-		completed_request->post_process_metadata.Set("annotate.text", results[0]->get_label());
+		completed_request->post_process_metadata.Set(ANNOTATE_TEXT, results[0]->get_label());
 	}
 
 	return false;
 }
 
-std::vector<HailoClassificationPtr> HailoClassifier::runInference(uint8_t *frame)
+std::vector<HailoClassificationPtr> HailoClassifier::runInference(HailoInput frame)
 {
 	hailort::AsyncInferJob job;
 	std::vector<OutTensor> output_tensors;
@@ -149,6 +175,11 @@ std::vector<HailoClassificationPtr> HailoClassifier::runInference(uint8_t *frame
 		return {};
 	}
 
+	return classify(output_tensors);
+}
+
+std::vector<HailoClassificationPtr> HailoClassifier::classify(std::vector<OutTensor> &output_tensors)
+{
 	// Postprocess tensor
 	PostProcFuncPtr filter = reinterpret_cast<PostProcFuncPtr>(postproc_.GetSymbol("resnet_v1_50"));
 	if (!filter)
@@ -161,6 +192,85 @@ std::vector<HailoClassificationPtr> HailoClassifier::runInference(uint8_t *frame
 	return detections;
 }
 
+void HailoClassifier::runCascade(CompletedRequestPtr &completed_request)
+{
+	std::vector<Detection> objects;
+	if (completed_request->post_process_metadata.Get(OBJECT_DETECT_RESULTS, objects) || objects.empty())
+		return;
+
+	if (output_stream_info_.pixel_format != libcamera::formats::YUV420)
+	{
+		LOG_ERROR("Cascade classification needs a YUV420 main stream");
+		return;
+	}
+
+	// The detector gives us boxes on the main stream, so crop them from there at full resolution, straight
+	// into network sized RGB inputs. Only the pixels of the crops are ever read.
+	BufferReadSync r(app_, completed_request->buffers[output_stream_]);
+	libcamera::Span<uint8_t> buffer = r.Get()[0];
+	const libcamera::Rectangle frame(0, 0, output_stream_info_.width, output_stream_info_.height);
+
+	StreamInfo rgb_info;
+	rgb_info.width = InputTensorSize().width;
+	rgb_info.height = InputTensorSize().height;
+	rgb_info.stride = rgb_info.width * 3;
+
+	std::vector<unsigned int> indices;
+	std::vector<std::shared_ptr<uint8_t>> inputs;
+	for (unsigned int i = 0; i < objects.size() && indices.size() < max_objects_; i++)
+	{
+		libcamera::Rectangle crop = objects[i].box.boundedTo(frame);
+		if (crop.width < min_size_ || crop.height < min_size_)
+			continue;
+
+		std::shared_ptr<uint8_t> input = allocator_.Allocate(rgb_info.stride * rgb_info.height);
+		if (!input)
+		{
+			LOG_ERROR("Could not allocate an input buffer!");
+			break;
+		}
+		Yuv420ToRgbScaled(input.get(), buffer.data(), output_stream_info_, crop, rgb_info, true);
+		indices.push_back(i);
+		inputs.push_back(std::move(input));
+	}
+
+	// Submit the crops BatchSize() at a time, so a network configured with a batch size of at least
+	// max_objects classifies all of them in a single job.
+	for (unsigned int start = 0; start < inputs.size(); start += BatchSize())
+	{
+		unsigned int end = std::min<unsigned int>(start + BatchSize(), inputs.size());
+		std::vector<const uint8_t *> batch;
+		for (unsigned int i = start; i < end; i++)
+			batch.push_back(inputs[i].get());
+
+		hailort::AsyncInferJob job;
+		std::vector<std::vector<OutTensor>> output_tensors;
+		hailo_status status = HailoPostProcessingStage::DispatchBatch(batch, job, output_tensors);
+		if (status != HAILO_SUCCESS)
+			return;
+
+		status = job.wait(1s);
+		if (status != HAILO_SUCCESS)
+		{
+			LOG_ERROR("Failed to wait for inference to finish, status = " << status);
+			return;
+		}
+
+		for (unsigned int i = start; i < end; i++)
+		{
+			std::vector<HailoClassificationPtr> results = classify(output_tensors[i - start]);
+			if (results.empty() || results[0]->get_confidence() < threshold_)
+				continue;
+
+			Detection &object = objects[indices[i]];
+			object.name += ": " + results[0]->get_label();
+			LOG(2, "Classified: " << object.toString());
+		}
+	}
+
+	completed_request->post_process_metadata.Set(OBJECT_DETECT_RESULTS, objects);
+}
+
 static PostProcessingStage *Create(RPiCamApp *app)
 {
 	return new HailoClassifier(app);
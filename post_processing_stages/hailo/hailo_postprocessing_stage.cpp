@@ -8,6 +8,7 @@
 #include <algorithm>
 #include <array>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
@@ -64,35 +65,6 @@ private:
 	bool init_ = false;
 };
 
-// Singleton class for the hardware virtual device.
-class vdevice
-{
-public:
-	vdevice(vdevice &other) = delete;
-	void operator=(const vdevice &) = delete;
-
-	static VDevice *get_instance()
-	{
-		static std::unique_ptr<VDevice> _vdevice {};
-
-		if (!_vdevice)
-		{
-			Expected<std::unique_ptr<VDevice>> vdevice_exp = VDevice::create();
-			if (!vdevice_exp)
-			{
-				LOG_ERROR("Failed create vdevice, status = " << vdevice_exp.status());
-				return nullptr;
-			}
-			_vdevice = vdevice_exp.release();
-		}
-
-		return _vdevice.get();
-	}
-
-private:
-	vdevice() {}
-};
-
 // Sigh :(
 std::string get_hailo_architecture()
 {
@@ -124,8 +96,114 @@ std::string get_hailo_architecture()
 	return {};
 }
 
+// Everything the stages share: the device, and each network configured on it, keyed by HEF file and batch size.
+// Stages hold references to their networks, which hold one to the device, so the lot is released along with the
+// last stage using it, and a network that several stages run is configured only once.
+class Registry
+{
+public:
+	static Registry &Get()
+	{
+		static Registry registry;
+		return registry;
+	}
+
+	std::shared_ptr<HailoNetwork> Acquire(const std::string &hef_file, unsigned int batch_size);
+
+	const std::string &Architecture()
+	{
+		std::scoped_lock<std::mutex> l(lock_);
+		if (!arch_read_)
+		{
+			arch_ = get_hailo_architecture();
+			arch_read_ = true;
+		}
+		return arch_;
+	}
+
+private:
+	std::shared_ptr<VDevice> device();
+
+	std::mutex lock_;
+	std::weak_ptr<VDevice> vdevice_;
+	std::map<std::pair<std::string, unsigned int>, std::weak_ptr<HailoNetwork>> networks_;
+	std::string arch_;
+	bool arch_read_ = false;
+};
+
+std::shared_ptr<VDevice> Registry::device()
+{
+	std::shared_ptr<VDevice> vdevice = vdevice_.lock();
+	if (vdevice)
+		return vdevice;
+
+	hailo_vdevice_params_t params;
+	hailo_init_vdevice_params(&params);
+	// The scheduler switches the device between the networks of all the stages sharing it.
+	params.scheduling_algorithm = HAILO_SCHEDULING_ALGORITHM_ROUND_ROBIN;
+
+	Expected<std::unique_ptr<VDevice>> vdevice_exp = VDevice::create(params);
+	if (!vdevice_exp)
+	{
+		LOG_ERROR("Failed create vdevice, status = " << vdevice_exp.status());
+		return nullptr;
+	}
+
+	vdevice = vdevice_exp.release();
+	vdevice_ = vdevice;
+	return vdevice;
+}
+
+std::shared_ptr<HailoNetwork> Registry::Acquire(const std::string &hef_file, unsigned int batch_size)
+{
+	std::scoped_lock<std::mutex> l(lock_);
+
+	std::weak_ptr<HailoNetwork> &entry = networks_[{ hef_file, batch_size }];
+	if (std::shared_ptr<HailoNetwork> network = entry.lock())
+	{
+		LOG(1, "Sharing configured Hailo network " << hef_file);
+		return network;
+	}
+
+	auto network = std::make_shared<HailoNetwork>();
+	network->vdevice = device();
+	if (!network->vdevice)
+		return nullptr;
+
+	// Create infer model from HEF file.
+	Expected<std::shared_ptr<InferModel>> infer_model_exp = network->vdevice->create_infer_model(hef_file);
+	if (!infer_model_exp)
+	{
+		LOG_ERROR("Failed to create infer model, status = " << infer_model_exp.status());
+		return nullptr;
+	}
+	network->infer_model = infer_model_exp.release();
+	network->infer_model->set_hw_latency_measurement_flags(HAILO_LATENCY_MEASURE);
+	if (batch_size > 1)
+		network->infer_model->set_batch_size(batch_size);
+
+	// Configure the infer model
+	//infer_model_->output()->set_format_type(HAILO_FORMAT_TYPE_FLOAT32);
+	Expected<ConfiguredInferModel> configured_infer_model_exp = network->infer_model->configure();
+	if (!configured_infer_model_exp)
+	{
+		LOG_ERROR("Failed to create configured infer model, status = " << configured_infer_model_exp.status());
+		return nullptr;
+	}
+	network->configured_infer_model = std::make_shared<ConfiguredInferModel>(configured_infer_model_exp.release());
+
+	entry = network;
+	return network;
+}
+
 } // namespace
 
+HailoNetwork::~HailoNetwork()
+{
+	if (configured_infer_model)
+		configured_infer_model->shutdown();
+}
+
 
 Allocator::Allocator()
 {
@@ -189,8 +267,6 @@ HailoPostProcessingStage::HailoPostProcessingStage(RPiCamApp *app)
 
 HailoPostProcessingStage::~HailoPostProcessingStage()
 {
-	if (init_)
-		configured_infer_model_->shutdown();
 }
 
 void HailoPostProcessingStage::Read(boost::property_tree::ptree const &params)
@@ -199,6 +275,14 @@ void HailoPostProcessingStage::Read(boost::property_tree::ptree const &params)
 	hef_file_8_ = params.get<std::string>("hef_file_8", "");
 	hef_file_8L_ = params.get<std::string>("hef_file_8L", "");
 	hef_file_10_ = params.get<std::string>("hef_file_10", "");
+	batch_size_ = params.get<unsigned int>("batch_size", 1);
+	if (!batch_size_)
+		throw std::runtime_error("Hailo batch_size must be at least 1");
+	dmabuf_input_ = params.get<bool>("dmabuf_input", true);
+
+	// Load the network now, so that its input size is known when the lores stream is chosen.
+	if (!init_ && !configureHailoRT())
+		init_ = true;
 }
 
 void HailoPostProcessingStage::Configure()
@@ -221,16 +305,61 @@ void HailoPostProcessingStage::Configure()
 	last_frame_ = {};
 }
 
-int HailoPostProcessingStage::configureHailoRT()
+void HailoPostProcessingStage::Teardown()
+{
+	// The camera buffers are about to be freed, so the device must let go of them first.
+	std::scoped_lock<std::mutex> l(lock_);
+	for (auto const &[fd, size] : mapped_dmabufs_)
+		network_->vdevice->dma_unmap_dmabuf(fd, size, HAILO_DMA_BUFFER_DIRECTION_H2D);
+	mapped_dmabufs_.clear();
+
+	PostProcessingStage::Teardown();
+}
+
+std::optional<PostProcessingStage::LoresPreference> HailoPostProcessingStage::PreferredLores() const
+{
+	if (!init_)
+		return {};
+
+	// An RGB lores at the input size can go straight to the device (see DmabufInput).
+	return LoresPreference { input_tensor_size_.width, input_tensor_size_.height, true };
+}
+
+libcamera::FrameBuffer *HailoPostProcessingStage::DmabufInput(CompletedRequestPtr &completed_request) const
+{
+	if (!dmabuf_input_ || !low_res_stream_ ||
+		(low_res_info_.pixel_format != libcamera::formats::RGB888 &&
+		 low_res_info_.pixel_format != libcamera::formats::BGR888) ||
+		low_res_info_.width != input_tensor_size_.width || low_res_info_.height != input_tensor_size_.height ||
+		low_res_info_.stride != low_res_info_.width * 3)
+		return nullptr;
+
+	auto it = completed_request->buffers.find(low_res_stream_);
+	if (it == completed_request->buffers.end() || it->second->planes()[0].offset != 0)
+		return nullptr;
+
+	return it->second;
+}
+
+// Map a camera buffer for the device the first time we see it, rather than having HailoRT map and unmap it for
+// every job. Failing that, HailoRT still maps it for each job, only more slowly.
+void HailoPostProcessingStage::mapDmabuf(int fd, size_t size)
 {
-	vdevice_ = vdevice::get_instance();
-	if (!vdevice_)
+	if (mapped_dmabufs_.count(fd))
+		return;
+
+	hailo_status status = network_->vdevice->dma_map_dmabuf(fd, size, HAILO_DMA_BUFFER_DIRECTION_H2D);
+	if (status != HAILO_SUCCESS)
 	{
-		LOG_ERROR("Failed to get a vdevice instance.");
-		return -1;
+		LOG(2, "Could not map camera buffer for the Hailo device, status = " << status);
+		return;
 	}
+	mapped_dmabufs_[fd] = size;
+}
 
-	std::string device = get_hailo_architecture();
+int HailoPostProcessingStage::configureHailoRT()
+{
+	std::string device = Registry::Get().Architecture();
 	if (device.empty())
 	{
 		LOG_ERROR("Defaulting to HAILO8 architecture");
@@ -258,34 +387,24 @@ int HailoPostProcessingStage::configureHailoRT()
 		return -1;
 	}
 
-	// Create infer model from HEF file.
-	Expected<std::shared_ptr<InferModel>> infer_model_exp = vdevice_->create_infer_model(hef_file);
-	if (!infer_model_exp)
-	{
-		LOG_ERROR("Failed to create infer model, status = " << infer_model_exp.status());
-		return infer_model_exp.status();
-	}
-	infer_model_ = infer_model_exp.release();
-	infer_model_->set_hw_latency_measurement_flags(HAILO_LATENCY_MEASURE);
-
-	// Configure the infer model
-	//infer_model_->output()->set_format_type(HAILO_FORMAT_TYPE_FLOAT32);
-	Expected<ConfiguredInferModel> configured_infer_model_exp = infer_model_->configure();
-	if (!configured_infer_model_exp)
-	{
-		LOG_ERROR("Failed to create configured infer model, status = " << configured_infer_model_exp.status());
-		return configured_infer_model_exp.status();
-	}
-	configured_infer_model_ = std::make_shared<ConfiguredInferModel>(configured_infer_model_exp.release());
+	network_ = Registry::Get().Acquire(hef_file, batch_size_);
+	if (!network_)
+		return -1;
+	infer_model_ = network_->infer_model;
+	configured_infer_model_ = network_->configured_infer_model;
 
-	// Create infer bindings
-	Expected<ConfiguredInferModel::Bindings> bindings_exp = configured_infer_model_->create_bindings();
-	if (!bindings_exp)
+	// Create infer bindings, a set for each frame of a batch.
+	bindings_.clear();
+	for (unsigned int i = 0; i < batch_size_; i++)
 	{
-		LOG_ERROR("Failed to create infer bindings, status = " << bindings_exp.status());
-		return bindings_exp.status();
+		Expected<ConfiguredInferModel::Bindings> bindings_exp = configured_infer_model_->create_bindings();
+		if (!bindings_exp)
+		{
+			LOG_ERROR("Failed to create infer bindings, status = " << bindings_exp.status());
+			return bindings_exp.status();
+		}
+		bindings_.push_back(std::move(bindings_exp.release()));
 	}
-	bindings_ = std::move(bindings_exp.release());
 
 	hailo_3d_image_shape_t shape = infer_model_->inputs()[0].shape();
 	input_tensor_size_ = libcamera::Size(shape.width, shape.height);
@@ -293,50 +412,88 @@ int HailoPostProcessingStage::configureHailoRT()
 	return 0;
 }
 
-hailo_status HailoPostProcessingStage::DispatchJob(const uint8_t *input, AsyncInferJob &job,
+hailo_status HailoPostProcessingStage::DispatchJob(HailoInput input, AsyncInferJob &job,
 												   std::vector<OutTensor> &output_tensors)
 {
-	hailo_status status;
+	std::vector<std::vector<OutTensor>> batch_tensors;
+	hailo_status status = dispatch({ input }, job, batch_tensors);
+	if (!batch_tensors.empty())
+		output_tensors = std::move(batch_tensors[0]);
+	return status;
+}
+
+hailo_status HailoPostProcessingStage::DispatchBatch(const std::vector<const uint8_t *> &inputs, AsyncInferJob &job,
+													 std::vector<std::vector<OutTensor>> &output_tensors)
+{
+	return dispatch(std::vector<HailoInput>(inputs.begin(), inputs.end()), job, output_tensors);
+}
+
+hailo_status HailoPostProcessingStage::dispatch(const std::vector<HailoInput> &inputs, AsyncInferJob &job,
+												std::vector<std::vector<OutTensor>> &output_tensors)
+{
+	hailo_status status = HAILO_SUCCESS;
 
 	std::scoped_lock<std::mutex> l(lock_);
 
-	// Input tensor.
+	if (inputs.empty() || inputs.size() > bindings_.size())
+	{
+		LOG_ERROR("Cannot dispatch a batch of " << inputs.size() << " frames to a network taking " << bindings_.size());
+		return HAILO_INVALID_ARGUMENT;
+	}
+
 	const std::string &input_name = infer_model_->get_input_names()[0];
 	size_t input_frame_size = infer_model_->input(input_name)->get_frame_size();
+	output_tensors.resize(inputs.size());
 
-	status = bindings_.input(input_name)->set_buffer(MemoryView((void *)(input), input_frame_size));
-	if (status != HAILO_SUCCESS)
+	for (unsigned int i = 0; i < inputs.size(); i++)
 	{
-		LOG_ERROR("Could not write to input stream with status " << status);
-		return status;
-	}
+		ConfiguredInferModel::Bindings &bindings = bindings_[i];
 
-	// Output tensors.
-	for (auto const &output_name : infer_model_->get_output_names())
-	{
-		size_t output_size = infer_model_->output(output_name)->get_frame_size();
-		std::shared_ptr<uint8_t> output_buffer = allocator_.Allocate(output_size);
-		if (!output_buffer)
+		// Input tensor. A camera buffer is handed over as a dmabuf, so the CPU never touches it.
+		if (inputs[i].buffer)
 		{
-			LOG_ERROR("Could not allocate an output buffer!");
-			return status;
+			int fd = inputs[i].buffer->planes()[0].fd.get();
+			mapDmabuf(fd, input_frame_size);
+			status = bindings.input(input_name)->set_dma_buffer(hailo_dma_buffer_t { fd, input_frame_size });
 		}
-
-		status = bindings_.output(output_name)->set_buffer(MemoryView(output_buffer.get(), output_size));
+		else
+			status = bindings.input(input_name)->set_buffer(MemoryView((void *)(inputs[i].ptr), input_frame_size));
 		if (status != HAILO_SUCCESS)
 		{
-			LOG_ERROR("Failed to set infer output buffer, status = " << status);
+			LOG_ERROR("Could not write to input stream with status " << status);
 			return status;
 		}
 
-		const std::vector<hailo_quant_info_t> quant = infer_model_->output(output_name)->get_quant_infos();
-		const hailo_3d_image_shape_t shape = infer_model_->output(output_name)->shape();
-		const hailo_format_t format = infer_model_->output(output_name)->format();
-		output_tensors.emplace_back(std::move(output_buffer), output_name, quant[0], shape, format);
+		// Output tensors.
+		for (auto const &output_name : infer_model_->get_output_names())
+		{
+			size_t output_size = infer_model_->output(output_name)->get_frame_size();
+			std::shared_ptr<uint8_t> output_buffer = allocator_.Allocate(output_size);
+			if (!output_buffer)
+			{
+				LOG_ERROR("Could not allocate an output buffer!");
+				return status;
+			}
+
+			status = bindings.output(output_name)->set_buffer(MemoryView(output_buffer.get(), output_size));
+			if (status != HAILO_SUCCESS)
+			{
+				LOG_ERROR("Failed to set infer output buffer, status = " << status);
+				return status;
+			}
+
+			const std::vector<hailo_quant_info_t> quant = infer_model_->output(output_name)->get_quant_infos();
+			const hailo_3d_image_shape_t shape = infer_model_->output(output_name)->shape();
+			const hailo_format_t format = infer_model_->output(output_name)->format();
+			output_tensors[i].emplace_back(std::move(output_buffer), output_name, quant[0], shape, format);
+		}
 	}
 
+	// Other stages may be submitting jobs to the same network.
+	std::scoped_lock<std::mutex> network_lock(network_->lock);
+
 	// Waiting for available requests in the pipeline.
-	status = configured_infer_model_->wait_for_async_ready(1s);
+	status = configured_infer_model_->wait_for_async_ready(1s, inputs.size());
 	if (status != HAILO_SUCCESS)
 	{
 		LOG_ERROR("Failed to wait for async ready, status = " << status);
@@ -359,8 +516,13 @@ hailo_status HailoPostProcessingStage::DispatchJob(const uint8_t *input, AsyncIn
 
 	last_frame_ = this_frame;
 
-	// Dispatch the job.
-	Expected<AsyncInferJob> job_exp = configured_infer_model_->run_async(bindings_);
+	// Dispatch the job, which runs the whole batch in one go.
+	Expected<AsyncInferJob> job_exp = [&] {
+		if (inputs.size() == 1)
+			return configured_infer_model_->run_async(bindings_[0]);
+		std::vector<ConfiguredInferModel::Bindings> batch(bindings_.begin(), bindings_.begin() + inputs.size());
+		return configured_infer_model_->run_async(batch);
+	}();
 	if (!job_exp)
 	{
 		LOG_ERROR("Failed to start async infer job, status = " << job_exp.status());
@@ -9,12 +9,15 @@
 
 #include <chrono>
 #include <deque>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include <libcamera/framebuffer.h>
 #include <libcamera/geometry.h>
 
 #include <hailo/hailort.hpp>
@@ -144,6 +147,17 @@ private:
 	std::condition_variable cond_;
 };
 
+// A network configured on the (shared) Hailo device, which stages running the same HEF file share.
+struct HailoNetwork
+{
+	~HailoNetwork();
+
+	std::shared_ptr<hailort::VDevice> vdevice;
+	std::shared_ptr<hailort::InferModel> infer_model;
+	std::shared_ptr<hailort::ConfiguredInferModel> configured_infer_model;
+	std::mutex lock; // serialises job submission
+};
+
 class HailoPostProcessingStage : public PostProcessingStage
 {
 public:
@@ -154,7 +168,23 @@ public:
 
 	void Configure() override;
 
+	void Teardown() override;
+
+	std::optional<LoresPreference> PreferredLores() const override;
+
+	bool ExclusiveDevice() const override { return true; }
+
 protected:
+	// A frame's input tensor, either in memory or in a camera buffer, which the device then reads for itself.
+	struct HailoInput
+	{
+		HailoInput(const uint8_t *p) : ptr(p) {}
+		HailoInput(libcamera::FrameBuffer *b) : buffer(b) {}
+
+		const uint8_t *ptr = nullptr;
+		libcamera::FrameBuffer *buffer = nullptr;
+	};
+
 	bool Ready() const
 	{
 		return init_ && low_res_stream_ && output_stream_;
@@ -170,7 +200,22 @@ protected:
 		return input_tensor_size_;
 	}
 
-	hailo_status DispatchJob(const uint8_t *input, hailort::AsyncInferJob &job, std::vector<OutTensor> &output_tensors);
+	// The number of frames the network was configured to take in one job, from the "batch_size" parameter.
+	unsigned int BatchSize() const
+	{
+		return batch_size_;
+	}
+
+	// Returns the request's lores buffer if the network can take it exactly as it is, being RGB, at the input tensor
+	// size and with no padding at the end of its rows. Otherwise returns nullptr, and the stage must make up the
+	// input tensor itself.
+	libcamera::FrameBuffer *DmabufInput(CompletedRequestPtr &completed_request) const;
+
+	hailo_status DispatchJob(HailoInput input, hailort::AsyncInferJob &job, std::vector<OutTensor> &output_tensors);
+	// As DispatchJob, but submitting up to BatchSize() inputs as a single job, with one set of output tensors for
+	// each of them.
+	hailo_status DispatchBatch(const std::vector<const uint8_t *> &inputs, hailort::AsyncInferJob &job,
+							   std::vector<std::vector<OutTensor>> &output_tensors);
 	HailoROIPtr MakeROI(const std::vector<OutTensor> &output_tensors) const;
 
 	libcamera::Rectangle ConvertInferenceCoordinates(const std::vector<float> &coords,
@@ -184,19 +229,25 @@ protected:
 
 	Allocator allocator_;
 
-	hailort::VDevice *vdevice_;
 	std::shared_ptr<hailort::InferModel> infer_model_;
 	std::shared_ptr<hailort::ConfiguredInferModel> configured_infer_model_;
 	MessageQueue &msg_queue_;
 
 private:
 	int configureHailoRT();
+	hailo_status dispatch(const std::vector<HailoInput> &inputs, hailort::AsyncInferJob &job,
+						  std::vector<std::vector<OutTensor>> &output_tensors);
+	void mapDmabuf(int fd, size_t size);
 	void displayThread();
 
+	std::shared_ptr<HailoNetwork> network_;
 	std::mutex lock_;
 	bool init_ = false;
 	std::string hef_file_, hef_file_8_, hef_file_8L_, hef_file_10_;
-	hailort::ConfiguredInferModel::Bindings bindings_;
+	unsigned int batch_size_ = 1;
+	bool dmabuf_input_ = true;
+	std::map<int, size_t> mapped_dmabufs_; // camera buffers mapped for the device, by fd
+	std::vector<hailort::ConfiguredInferModel::Bindings> bindings_; // one per frame in a batch
 	std::chrono::time_point<std::chrono::steady_clock> last_frame_;
 	libcamera::Size input_tensor_size_;
 };
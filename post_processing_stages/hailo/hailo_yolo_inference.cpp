@@ -50,7 +50,19 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
-	std::vector<Detection> runInference(const uint8_t *frame, const std::vector<libcamera::Rectangle> &scaler_crops);
+	// A frame waiting for the rest of its batch.
+	struct PendingFrame
+	{
+		std::shared_ptr<uint8_t> input;
+		std::vector<libcamera::Rectangle> scaler_crops;
+	};
+
+	std::vector<Detection> runInference(HailoInput frame, const std::vector<libcamera::Rectangle> &scaler_crops);
+	std::vector<Detection> runBatched(std::shared_ptr<uint8_t> input, const uint8_t *input_ptr,
+									  const std::vector<libcamera::Rectangle> &scaler_crops);
+	std::vector<Detection> getDetections(std::vector<OutTensor> &output_tensors,
+										 const std::vector<libcamera::Rectangle> &scaler_crops);
+	void temporalFilter(std::vector<Detection> &objects);
 	void filterOutputObjects(std::vector<Detection> &objects);
 
 	struct LtObject
@@ -63,6 +75,12 @@ private:
 
 	std::vector<LtObject> lt_objects_;
 	std::mutex lock_;
+
+	// In batched mode, frames collect here until there are BatchSize() of them, with every request in the
+	// meantime getting the results of the last batch.
+	std::mutex batch_lock_;
+	std::vector<PendingFrame> batch_;
+	std::vector<Detection> batch_objects_;
 	DlLib postproc_nms_;
 	YoloParamsNMS *yolo_params_ = nullptr;
 
@@ -128,6 +146,13 @@ void YoloInference::Read(boost::property_tree::ptree const &params)
 
 void YoloInference::Configure()
 {
+	{
+		// These buffers come from the allocator, which the base class is about to reset.
+		std::scoped_lock<std::mutex> l(batch_lock_);
+		batch_.clear();
+		batch_objects_.clear();
+	}
+
 	HailoPostProcessingStage::Configure();
 }
 
@@ -145,47 +170,6 @@ bool YoloInference::Process(CompletedRequestPtr &completed_request)
 		return false;
 	}
 
-	BufferReadSync r(app_, completed_request->buffers[low_res_stream_]);
-	libcamera::Span<uint8_t> buffer = r.Get()[0];
-	std::shared_ptr<uint8_t> input;
-	uint8_t *input_ptr;
-
-	if (low_res_info_.pixel_format == libcamera::formats::YUV420)
-	{
-		StreamInfo rgb_info;
-		rgb_info.width = InputTensorSize().width;
-		rgb_info.height = InputTensorSize().height;
-		rgb_info.stride = rgb_info.width * 3;
-
-		input = allocator_.Allocate(rgb_info.stride * rgb_info.height);
-		input_ptr = input.get();
-
-		Yuv420ToRgb(input.get(), buffer.data(), low_res_info_, rgb_info);
-	}
-	else if (low_res_info_.pixel_format == libcamera::formats::RGB888 ||
-			 low_res_info_.pixel_format == libcamera::formats::BGR888)
-	{
-		unsigned int stride = low_res_info_.width * 3;
-
-		// If the stride shows we have padding on the right edge of the buffer, we must copy it out to another buffer
-		// without padding.
-		if (low_res_info_.stride != stride)
-		{
-			input = allocator_.Allocate(stride * low_res_info_.height);
-			input_ptr = input.get();
-
-			for (unsigned int i = 0; i < low_res_info_.height; i++)
-				memcpy(input_ptr + i * stride, buffer.data() + i * low_res_info_.stride, stride);
-		}
-		else
-			input_ptr = buffer.data();
-	}
-	else
-	{
-		LOG_ERROR("Unexpected lores format " << low_res_info_.pixel_format);
-		return false;
-	}
-
 	std::vector<Rectangle> scaler_crops;
 	auto scaler_crop = completed_request->metadata.get(controls::ScalerCrop);
 	auto rpi_scaler_crop = completed_request->metadata.get(controls::rpi::ScalerCrops);
@@ -202,35 +186,95 @@ bool YoloInference::Process(CompletedRequestPtr &completed_request)
 		scaler_crops.push_back(*scaler_crop);
 	}
 
-	std::vector<Detection> objects = runInference(input_ptr, scaler_crops);
-	if (objects.size())
+	std::vector<Detection> objects;
+	libcamera::FrameBuffer *dmabuf = BatchSize() == 1 ? DmabufInput(completed_request) : nullptr;
+
+	if (dmabuf)
 	{
-		if (temporal_filtering_)
+		// The device reads the lores buffer for itself, so there's nothing here to map, sync or copy.
+		objects = runInference(dmabuf, scaler_crops);
+		temporalFilter(objects);
+	}
+	else
+	{
+		BufferReadSync r(app_, completed_request->buffers[low_res_stream_]);
+		libcamera::Span<uint8_t> buffer = r.Get()[0];
+		std::shared_ptr<uint8_t> input;
+		uint8_t *input_ptr;
+
+		if (low_res_info_.pixel_format == libcamera::formats::YUV420)
 		{
-			// Process() can be concurrently called through different threads for consecutive CompletedRequests if
-			// things are running behind.  So protect access to the inference state.
-			std::scoped_lock<std::mutex> l(lock_);
+			StreamInfo rgb_info;
+			rgb_info.width = InputTensorSize().width;
+			rgb_info.height = InputTensorSize().height;
+			rgb_info.stride = rgb_info.width * 3;
 
-			filterOutputObjects(objects);
-			if (lt_objects_.size())
+			input = allocator_.Allocate(rgb_info.stride * rgb_info.height);
+			input_ptr = input.get();
+
+			Yuv420ToRgb(input.get(), buffer.data(), low_res_info_, rgb_info);
+		}
+		else if (low_res_info_.pixel_format == libcamera::formats::RGB888 ||
+				 low_res_info_.pixel_format == libcamera::formats::BGR888)
+		{
+			unsigned int stride = low_res_info_.width * 3;
+
+			// If the stride shows we have padding on the right edge of the buffer, we must copy it out to another
+			// buffer without padding.
+			if (low_res_info_.stride != stride)
 			{
-				objects.clear();
-				for (auto const &obj : lt_objects_)
-				{
-					if (!obj.hidden)
-						objects.push_back(obj.params);
-				}
+				input = allocator_.Allocate(stride * low_res_info_.height);
+				input_ptr = input.get();
+
+				for (unsigned int i = 0; i < low_res_info_.height; i++)
+					memcpy(input_ptr + i * stride, buffer.data() + i * low_res_info_.stride, stride);
 			}
+			else
+				input_ptr = buffer.data();
+		}
+		else
+		{
+			LOG_ERROR("Unexpected lores format " << low_res_info_.pixel_format);
+			return false;
 		}
 
-		if (objects.size())
-			completed_request->post_process_metadata.Set("object_detect.results", objects);
+		if (BatchSize() > 1)
+			objects = runBatched(std::move(input), input_ptr, scaler_crops);
+		else
+		{
+			objects = runInference(input_ptr, scaler_crops);
+			temporalFilter(objects);
+		}
 	}
 
+	if (objects.size())
+		completed_request->post_process_metadata.Set(OBJECT_DETECT_RESULTS, objects);
+
 	return false;
 }
 
-std::vector<Detection> YoloInference::runInference(const uint8_t *frame, const std::vector<Rectangle> &scaler_crops)
+void YoloInference::temporalFilter(std::vector<Detection> &objects)
+{
+	if (!temporal_filtering_ || objects.empty())
+		return;
+
+	// Process() can be concurrently called through different threads for consecutive CompletedRequests if
+	// things are running behind.  So protect access to the inference state.
+	std::scoped_lock<std::mutex> l(lock_);
+
+	filterOutputObjects(objects);
+	if (lt_objects_.size())
+	{
+		objects.clear();
+		for (auto const &obj : lt_objects_)
+		{
+			if (!obj.hidden)
+				objects.push_back(obj.params);
+		}
+	}
+}
+
+std::vector<Detection> YoloInference::runInference(HailoInput frame, const std::vector<Rectangle> &scaler_crops)
 {
 	hailort::AsyncInferJob job;
 	std::vector<OutTensor> output_tensors;
@@ -240,9 +284,6 @@ std::vector<Detection> YoloInference::runInference(const uint8_t *frame, const s
 	if (status != HAILO_SUCCESS)
 		return {};
 
-	// Prepare tensors for postprocessing.
-	std::sort(output_tensors.begin(), output_tensors.end(), OutTensor::SortFunction);
-
 	// Wait for job completion.
 	status = job.wait(1s);
 	if (status != HAILO_SUCCESS)
@@ -251,6 +292,67 @@ std::vector<Detection> YoloInference::runInference(const uint8_t *frame, const s
 		return {};
 	}
 
+	return getDetections(output_tensors, scaler_crops);
+}
+
+std::vector<Detection> YoloInference::runBatched(std::shared_ptr<uint8_t> input, const uint8_t *input_ptr,
+												 const std::vector<Rectangle> &scaler_crops)
+{
+	// The frame has to outlive this request, so take a copy if it's still in the camera buffer.
+	if (!input)
+	{
+		size_t size = InputTensorSize().width * InputTensorSize().height * 3;
+		input = allocator_.Allocate(size);
+		if (!input)
+		{
+			LOG_ERROR("Could not allocate an input buffer!");
+			return {};
+		}
+		memcpy(input.get(), input_ptr, size);
+	}
+
+	std::vector<PendingFrame> batch;
+	{
+		std::scoped_lock<std::mutex> l(batch_lock_);
+		batch_.push_back({ std::move(input), scaler_crops });
+		if (batch_.size() < BatchSize())
+			return batch_objects_;
+		batch.swap(batch_);
+	}
+
+	std::vector<const uint8_t *> inputs;
+	for (auto const &frame : batch)
+		inputs.push_back(frame.input.get());
+
+	hailort::AsyncInferJob job;
+	std::vector<std::vector<OutTensor>> output_tensors;
+	hailo_status status = HailoPostProcessingStage::DispatchBatch(inputs, job, output_tensors);
+	if (status == HAILO_SUCCESS)
+	{
+		status = job.wait(1s);
+		if (status != HAILO_SUCCESS)
+			LOG_ERROR("Failed to wait for inference to finish, status = " << status);
+	}
+
+	// Run the frames through the temporal filter in order, so that it still sees every one of them.
+	std::vector<Detection> objects;
+	for (unsigned int i = 0; status == HAILO_SUCCESS && i < batch.size(); i++)
+	{
+		objects = getDetections(output_tensors[i], batch[i].scaler_crops);
+		temporalFilter(objects);
+	}
+
+	std::scoped_lock<std::mutex> l(batch_lock_);
+	batch_objects_ = objects;
+	return objects;
+}
+
+std::vector<Detection> YoloInference::getDetections(std::vector<OutTensor> &output_tensors,
+													 const std::vector<Rectangle> &scaler_crops)
+{
+	// Prepare tensors for postprocessing.
+	std::sort(output_tensors.begin(), output_tensors.end(), OutTensor::SortFunction);
+
 	HailoROIPtr roi = MakeROI(output_tensors);
 	PostProcFuncPtrNms filter = reinterpret_cast<PostProcFuncPtrNms>(postproc_nms_.GetSymbol("filter"));
 
@@ -22,11 +22,24 @@
 // pixel manipulations, especially when it comes to colour, are a bit random. You have
 // been warned. Enjoy!
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include <libcamera/stream.h>
 
+#include "core/memory_account.hpp"
 #include "core/rpicam_app.hpp"
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
+#include "core/thread_config.hpp"
 
 #include "image/image.hpp"
 
@@ -105,159 +118,162 @@ struct HdrImage
 	void Scale(double factor);
 };
 
-static void add_Y_pixels(int16_t *dest, uint8_t const *src, int width, int stride, int height)
+// Split the rows [0, rows) into bands, whose sizes are a multiple of align, and run fn(begin, end)
+// over each band on its own thread. The calling thread takes the first band.
+
+template <typename F>
+static void for_each_band(int rows, F const &fn, int align = 2)
 {
-	for (int y = 0; y < height; y++, src += stride)
+	int num_bands = std::max(1u, std::thread::hardware_concurrency());
+	int band = ((rows + num_bands - 1) / num_bands + align - 1) / align * align;
+	std::vector<std::thread> threads;
+	for (int begin = band; begin < rows; begin += band)
+		threads.emplace_back(fn, begin, std::min(begin + band, rows));
+	fn(0, std::min(band, rows));
+	for (auto &thread : threads)
+		thread.join();
+}
+
+static void add_pixels(int16_t *dest, uint8_t const *src, int width, int offset)
+{
+	int x = 0;
+#if defined(__ARM_NEON)
+	int16x8_t off = vdupq_n_s16(offset);
+	for (; x + 8 <= width; x += 8)
 	{
-		for (int x = 0; x < width; x++)
-			*(dest++) += src[x];
+		int16x8_t pixels = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(src + x))), off);
+		vst1q_s16(dest + x, vaddq_s16(vld1q_s16(dest + x), pixels));
 	}
+#endif
+	for (; x < width; x++)
+		dest[x] += src[x] - offset;
 }
 
 // Add the new image buffer to this "accumulator" image. We just add them as
-// we don't have the horsepower to do any fancy alignment or anything.
-// Actually, spreading it across a few threads doesn't seem to help much, though
-// compiling with "gcc -mfpu=neon-fp-armv8 -ftree-vectorize" gives a big
-// improvement.
+// we don't have the horsepower to do any fancy alignment or anything. Each band
+// handles its own Y rows and the same number of rows of the (half width) U and V planes.
 
 void HdrImage::Accumulate(uint8_t const *src, int stride)
 {
-	int16_t *dest = &P(0);
+	int16_t *dest_Y = &P(0), *dest_UV = dest_Y + width * height;
+	uint8_t const *src_UV = src + stride * height;
 	int width2 = width / 2, stride2 = stride / 2;
-	std::thread thread1(add_Y_pixels, dest, src, width, stride, height);
-
-	dest += width * height;
-	src += stride * height;
 
-	// U and V components
-	for (int y = 0; y < height; y++, src += stride2)
-	{
-		for (int x = 0; x < width2; x++)
-			*(dest++) += src[x] - 128;
-	}
+	for_each_band(height, [&](int begin, int end) {
+		for (int y = begin; y < end; y++)
+			add_pixels(dest_Y + y * width, src + y * stride, width, 0);
+		for (int y = begin; y < end; y++)
+			add_pixels(dest_UV + y * width2, src_UV + y * stride2, width2, 128);
+	});
 
 	dynamic_range += 256;
+}
+
+struct LpFilterTables
+{
+	std::vector<double> threshold;
+	std::vector<double> weights;
+	double strength;
+};
 
-	thread1.join();
+// One row of the IIR low pass filter. The new value of each pixel depends on the three pixels in the
+// previous row and the one before it in this row, where "previous" and "before" depend on the direction.
+
+static void iir_row(double *pixels, double *weight_sums, double const *prev_pixels, int16_t const *in, int width,
+					int size, bool forward, LpFilterTables const &tables)
+{
+	std::vector<double> const &weights = tables.weights;
+	int dir = forward ? 1 : -1;
+	int x = forward ? size : width - 1 - size, x_end = forward ? width : -1;
+	for (; x != x_end; x += dir)
+	{
+		int pixel = in[x];
+		double scale = 10 / tables.threshold[pixel];
+		double pixel_wt_sum = pixel * tables.strength, wt_sum = tables.strength;
+
+		// Compiler generates faster code from this:
+		unsigned int p[4], idx[4];
+		double wt[4];
+		p[0] = prev_pixels[x - dir];
+		p[1] = prev_pixels[x];
+		p[2] = prev_pixels[std::clamp(x + dir, 0, width - 1)];
+		p[3] = pixels[x - dir];
+		idx[0] = std::abs(static_cast<int>(p[0]) - pixel) * scale;
+		idx[1] = std::abs(static_cast<int>(p[1]) - pixel) * scale;
+		idx[2] = std::abs(static_cast<int>(p[2]) - pixel) * scale;
+		idx[3] = std::abs(static_cast<int>(p[3]) - pixel) * scale;
+		wt[0] = idx[0] >= weights.size() ? 0.0 : weights[idx[0]];
+		wt[1] = idx[1] >= weights.size() ? 0.0 : weights[idx[1]];
+		wt[2] = idx[2] >= weights.size() ? 0.0 : weights[idx[2]];
+		wt[3] = idx[3] >= weights.size() ? 0.0 : weights[idx[3]];
+		pixel_wt_sum += wt[0] * p[0] + wt[1] * p[1] + wt[2] * p[2] + wt[3] * p[3];
+		wt_sum += wt[0] + wt[1] + wt[2] + wt[3];
+
+		pixels[x] = pixel_wt_sum / wt_sum;
+		weight_sums[x] = wt_sum;
+	}
 }
 
-// Forward pass of the IIR low pass filter.
+// Run the filter in one direction over the rows [begin, end) of a band. As the filter is recursive, each
+// band first runs over a "halo" of rows belonging to its neighbour (into scratch memory) so that the
+// state it starts with is close to what a single pass over the whole image would have given.
 
-static void forward_pass(std::vector<double> &fwd_pixels, std::vector<double> &fwd_weight_sums, HdrImage const &in,
-						 std::vector<double> &weights, std::vector<double> &threshold, int width, int height, int size,
-						 double strength)
+static constexpr int LP_FILTER_HALO = 32;
 
+static void iir_band(std::vector<double> &pixels, std::vector<double> &weight_sums, HdrImage const &in, int begin,
+					 int end, int size, bool forward, LpFilterTables const &tables)
 {
-	// (Should probably initialise the top/left elements of fwd_pixels/fwd_weight_sums...)
-	for (int y = size; y < height; y++)
+	int width = in.width, height = in.height;
+	int first = forward ? std::max(size, begin - LP_FILTER_HALO) : std::min(height - 1 - size, end - 1 + LP_FILTER_HALO);
+	int last = forward ? end : begin - 1, dir = forward ? 1 : -1;
+	if (forward ? first >= last : first <= last)
+		return;
+
+	std::vector<double> halo_pixels(2 * width), halo_weight_sums(width);
+	double *prev = halo_pixels.data();
+	for (int y = first; y != last; y += dir)
 	{
-		unsigned int off = y * width + size;
-		for (int x = size; x < width; x++, off++)
-		{
-			int pixel = in.P(off);
-			double scale = 10 / threshold[pixel];
-			double pixel_wt_sum = pixel * strength, wt_sum = strength;
-
-			// Compiler generates faster code from this:
-			unsigned int p[4], idx[4];
-			double wt[4];
-			p[0] = fwd_pixels[off - width - 1];
-			p[1] = fwd_pixels[off - width];
-			p[2] = fwd_pixels[off - width + 1];
-			p[3] = fwd_pixels[off - 1];
-			idx[0] = std::abs(static_cast<int>(p[0]) - pixel) * scale;
-			idx[1] = std::abs(static_cast<int>(p[1]) - pixel) * scale;
-			idx[2] = std::abs(static_cast<int>(p[2]) - pixel) * scale;
-			idx[3] = std::abs(static_cast<int>(p[3]) - pixel) * scale;
-			wt[0] = idx[0] >= weights.size() ? 0.0 : weights[idx[0]];
-			wt[1] = idx[1] >= weights.size() ? 0.0 : weights[idx[1]];
-			wt[2] = idx[2] >= weights.size() ? 0.0 : weights[idx[2]];
-			wt[3] = idx[3] >= weights.size() ? 0.0 : weights[idx[3]];
-			pixel_wt_sum += wt[0] * p[0] + wt[1] * p[1] + wt[2] * p[2] + wt[3] * p[3];
-			wt_sum += wt[0] + wt[1] + wt[2] + wt[3];
-
-			fwd_pixels[off] = pixel_wt_sum / wt_sum;
-			fwd_weight_sums[off] = wt_sum;
-		}
+		bool in_band = y >= begin && y < end;
+		double *cur = in_band ? &pixels[y * width] : (prev == halo_pixels.data() ? &halo_pixels[width] : halo_pixels.data());
+		double *cur_weight_sums = in_band ? &weight_sums[y * width] : halo_weight_sums.data();
+		// (Should probably initialise the edge elements of the row, as for the previous row...)
+		iir_row(cur, cur_weight_sums, prev, &in.pixels[y * width], width, size, forward, tables);
+		prev = cur;
 	}
 }
 
 // Low pass IIR filter. We perform a forwards and a reverse pass, finally combining
 // the results to get a smoothed but vaguely edge-preserving version of the
 // accumulator image. You could imagine implementing alternative (more sophisticated)
-// filters.
+// filters. The image is split into bands of rows which are filtered in parallel.
 
 HdrImage HdrImage::LpFilter(LpFilterConfig const &config) const
 {
+	LpFilterTables tables;
 	// Cache threshold values, computing them would be slow.
-	std::vector<double> threshold = config.threshold.GenerateLut<double>();
-
+	tables.threshold = config.threshold.GenerateLut<double>();
 	// Cache values of e^(-x^2) for 0 <= x <= 3, it will be much quicker
-	std::vector<double> weights(31);
+	tables.weights.resize(31);
 	for (int d = 0; d <= 30; d++)
-		weights[d] = exp(-d * d / 100.0);
+		tables.weights[d] = exp(-d * d / 100.0);
+	tables.strength = config.strength;
 
 	int size = 1;
-	double strength = config.strength;
-
-	// Forward pass.
-	std::vector<double> fwd_weight_sums(width * height);
-	std::vector<double> fwd_pixels(width * height);
+	std::vector<double> fwd_weight_sums(width * height), fwd_pixels(width * height);
+	std::vector<double> rev_weight_sums(width * height), rev_pixels(width * height);
 
 	HdrImage out(width, height, width * height);
 	out.dynamic_range = dynamic_range;
 
-	// Run the forward pass in other thread, so that the two passes run in parallel.
-	std::thread fwd_pass(forward_pass, std::ref(fwd_pixels), std::ref(fwd_weight_sums), std::ref(*this),
-						 std::ref(weights), std::ref(threshold), width, height, size, strength);
-
-	// Reverse pass, but otherwise the same as the forward pass. There could be a small
-	// saving in omitting it, but it's not huge given that they run in parallel.
-	std::vector<double> rev_weight_sums(width * height);
-	std::vector<double> rev_pixels(width * height);
-	// (Should probably initialise the bottom/right elements of rev_pixels/rev_weight_sums...)
-	for (int y = height - 1 - size; y >= 0; y--)
-	{
-		unsigned int off = y * width + width - 1 - size;
-		for (int x = width - 1 - size; x >= 0; x--, off--)
-		{
-			int pixel = P(off);
-			double scale = 10 / threshold[pixel];
-			double pixel_wt_sum = pixel * strength, wt_sum = strength;
-
-			// Compiler generates faster code from this:
-			unsigned int p[4], idx[4];
-			double wt[4];
-			p[0] = rev_pixels[off + width + 1];
-			p[1] = rev_pixels[off + width];
-			p[2] = rev_pixels[off + width - 1];
-			p[3] = rev_pixels[off + 1];
-			idx[0] = std::abs(static_cast<int>(p[0]) - pixel) * scale;
-			idx[1] = std::abs(static_cast<int>(p[1]) - pixel) * scale;
-			idx[2] = std::abs(static_cast<int>(p[2]) - pixel) * scale;
-			idx[3] = std::abs(static_cast<int>(p[3]) - pixel) * scale;
-			wt[0] = idx[0] >= weights.size() ? 0.0 : weights[idx[0]];
-			wt[1] = idx[1] >= weights.size() ? 0.0 : weights[idx[1]];
-			wt[2] = idx[2] >= weights.size() ? 0.0 : weights[idx[2]];
-			wt[3] = idx[3] >= weights.size() ? 0.0 : weights[idx[3]];
-			pixel_wt_sum += wt[0] * p[0] + wt[1] * p[1] + wt[2] * p[2] + wt[3] * p[3];
-			wt_sum += wt[0] + wt[1] + wt[2] + wt[3];
-
-			rev_pixels[off] = pixel_wt_sum / wt_sum;
-			rev_weight_sums[off] = wt_sum;
-		}
-	}
-
-	fwd_pass.join();
+	for_each_band(height, [&](int begin, int end) {
+		iir_band(fwd_pixels, fwd_weight_sums, *this, begin, end, size, true, tables);
+		iir_band(rev_pixels, rev_weight_sums, *this, begin, end, size, false, tables);
 
-	// Combine.
-	unsigned int off = 0;
-	for (int y = 0; y < height; y++)
-	{
-		for (int x = 0; x < width; x++, off++)
+		// Combine.
+		for (unsigned int off = begin * width; off < (unsigned int)(end * width); off++)
 			out.P(off) = (fwd_pixels[off] * fwd_weight_sums[off] + rev_pixels[off] * rev_weight_sums[off]) /
 						 (fwd_weight_sums[off] + rev_weight_sums[off]);
-	}
+	});
 
 	return out;
 }
@@ -295,45 +311,97 @@ Pwl HdrImage::CreateTonemap(GlobalTonemapConfig const &config) const
 	return tonemap;
 }
 
+// The local contrast strengths are held in Q12, and the reciprocals of (Y_lp + 1) in Q31.
+
+static constexpr int STRENGTH_BITS = 12;
+static constexpr int RECIP_BITS = 31;
+
+// One row of the luma tonemap: Y = mapped[lp] + strength[lp] * (Y - lp), with the strength for a pixel
+// brighter than its neighbourhood at strength[2 * lp + 1] and for a darker one at strength[2 * lp].
+
+static void tonemap_row(int16_t *Y, int16_t const *lp, int width, int16_t const *mapped, int16_t const *strength,
+						int maxval)
+{
+	int x = 0;
+#if defined(__ARM_NEON)
+	int16x8_t zero = vdupq_n_s16(0), max = vdupq_n_s16(maxval);
+	for (; x + 8 <= width; x += 8)
+	{
+		// No gathers in NEON, so the lookups stay scalar, but without branches.
+		int16_t m[8], s[8];
+		for (int i = 0; i < 8; i++)
+		{
+			m[i] = mapped[lp[x + i]];
+			s[i] = strength[2 * lp[x + i] + (Y[x + i] > lp[x + i])];
+		}
+		int16x8_t hp = vsubq_s16(vld1q_s16(Y + x), vld1q_s16(lp + x));
+		int16x8_t str = vld1q_s16(s);
+		int32x4_t lo = vrshrq_n_s32(vmull_s16(vget_low_s16(str), vget_low_s16(hp)), STRENGTH_BITS);
+		int32x4_t hi = vrshrq_n_s32(vmull_s16(vget_high_s16(str), vget_high_s16(hp)), STRENGTH_BITS);
+		int16x8_t detail = vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi));
+		int16x8_t out = vqaddq_s16(vld1q_s16(m), detail);
+		vst1q_s16(Y + x, vminq_s16(vmaxq_s16(out, zero), max));
+	}
+#endif
+	for (; x < width; x++)
+	{
+		int hp = Y[x] - lp[x];
+		int s = strength[2 * lp[x] + (hp > 0)];
+		int detail = (s * hp + (1 << (STRENGTH_BITS - 1))) >> STRENGTH_BITS;
+		Y[x] = std::clamp(mapped[lp[x]] + detail, 0, maxval);
+	}
+}
+
 // Tonemap the low pass image according to the global tone curve, and add back the high pass
-// detail (given by the original pixel minus the low pass equivalent).
+// detail (given by the original pixel minus the low pass equivalent). Everything runs from
+// fixed point tables indexed by the low pass value.
 
 void HdrImage::Tonemap(HdrImage const &lp, HdrConfig const &config)
 {
 	Pwl tonemap = CreateTonemap(config.global_tonemap);
-
-	// Make LUTs for the all the Pwls, it'll be much quicker.
+	std::vector<double> pos_strength = config.local_tonemap.pos_strength.GenerateLut<double>();
+	std::vector<double> neg_strength = config.local_tonemap.neg_strength.GenerateLut<double>();
 	std::vector<int> tonemap_lut = tonemap.GenerateLut<int>();
-	std::vector<double> pos_strength_lut = config.local_tonemap.pos_strength.GenerateLut<double>();
-	std::vector<double> neg_strength_lut = config.local_tonemap.neg_strength.GenerateLut<double>();
-	double colour_scale = config.local_tonemap.colour_scale;
 
 	int maxval = dynamic_range - 1;
-	for (int y = 0; y < height; y++)
+	std::vector<int16_t> mapped(dynamic_range), strength(2 * dynamic_range);
+	std::vector<uint32_t> recip(dynamic_range);
+	auto q = [](std::vector<double> const &lut, int i) {
+		double s = lut[std::min<size_t>(i, lut.size() - 1)] * (1 << STRENGTH_BITS);
+		return (int16_t)std::clamp<double>(std::lround(s), INT16_MIN, INT16_MAX);
+	};
+	for (int i = 0; i < dynamic_range; i++)
 	{
-		unsigned int off_Y = y * width;
-		unsigned int off_U = y * width / 4 + width * height;
-		unsigned int off_V = off_U + width * height / 4;
-		for (int x = 0; x < width; x++, off_Y++)
+		mapped[i] = std::clamp(tonemap_lut[std::min<size_t>(i, tonemap_lut.size() - 1)], 0, maxval);
+		strength[2 * i] = q(neg_strength, i);
+		strength[2 * i + 1] = q(pos_strength, i);
+		recip[i] = ((1ull << RECIP_BITS) + (i + 1) / 2) / (i + 1);
+	}
+	// The values here are non-linear to colours can come out slightly saturated.
+	// The colour_scale allows us to tweak that a little if we want.
+	int64_t colour_scale = std::lround(config.local_tonemap.colour_scale * 65536);
+
+	for_each_band(height, [&](int begin, int end) {
+		for (int y = begin; y < end; y++)
 		{
-			int Y_lp_orig = lp.P(off_Y), Y_hp = P(off_Y) - Y_lp_orig;
-			int Y_lp_mapped = tonemap_lut[Y_lp_orig];
-			double strength = (Y_hp > 0 ? pos_strength_lut : neg_strength_lut)[Y_lp_orig];
-			int Y_final = std::clamp(Y_lp_mapped + (int)(strength * Y_hp), 0, maxval);
-			P(off_Y) = Y_final;
-			if (!(x & 1) && !(y & 1))
+			int16_t *Y = &P(y * width);
+			int16_t const *Y_lp = &lp.pixels[y * width];
+			tonemap_row(Y, Y_lp, width, mapped.data(), strength.data(), maxval);
+			if (y & 1)
+				continue;
+
+			// Scale the chroma of each 2x2 block by 1 + ((Y_final + 1) / (Y_lp_orig + 1) - 1) * colour_scale,
+			// taken at its top left pixel, all in Q16.
+			int16_t *U = &P(y * width / 4 + width * height), *V = U + width * height / 4;
+			for (int x = 0; x < width; x += 2, U++, V++)
 			{
-				double f = (Y_final + 1) / (double)(Y_lp_orig + 1);
-				// The values here are non-linear to colours can come out slightly saturated.
-				// The colour_scale allows us to tweak that a little if we want.
-				f = (f - 1) * colour_scale + 1;
-				int U = P(off_U), V = P(off_V);
-				P(off_U) = U * f;
-				P(off_V) = V * f;
-				off_U++, off_V++;
+				int64_t ratio = ((uint64_t)(Y[x] + 1) * recip[Y_lp[x]]) >> (RECIP_BITS - 16);
+				int64_t f = 65536 + (((ratio - 65536) * colour_scale) >> 16);
+				*U = (*U * f + 32768) >> 16;
+				*V = (*V * f + 32768) >> 16;
 			}
 		}
-	}
+	});
 }
 
 // Write image back out to 8-bit buffer with given stride.
@@ -343,34 +411,38 @@ void HdrImage::Extract(uint8_t *dest, int stride) const
 	double ratio = dynamic_range / 256;
 	const int16_t *Y_ptr = &pixels[0];
 	const int16_t *U_ptr = Y_ptr + width * height, *V_ptr = U_ptr + width * height / 4;
-	uint8_t *dest_y = dest;
-	uint8_t *dest_u = dest_y + stride * height, *dest_v = dest_u + stride * height / 4;
+	uint8_t *dest_u = dest + stride * height, *dest_v = dest_u + stride * height / 4;
+	int w = width / 2, s = stride / 2;
 
-	for (int y = 0; y < height; y++, dest_y += stride)
-	{
-		for (int x = 0; x < width; x++)
-			dest_y[x] = *(Y_ptr++) / ratio;
-	}
+	for_each_band(height, [&](int begin, int end) {
+		for (int y = begin; y < end; y++)
+		{
+			for (int x = 0; x < width; x++)
+				dest[y * stride + x] = Y_ptr[y * width + x] / ratio;
+		}
 
-	int w = width / 2, h = height / 2, s = stride / 2;
-	for (int y = 0; y < h; y++, dest_u += s, dest_v += s)
-	{
-		for (int x = 0; x < w; x++)
+		for (int y = begin / 2; y < end / 2; y++)
 		{
-			int U = *(U_ptr++) / ratio;
-			int V = *(V_ptr++) / ratio;
-			dest_u[x] = std::clamp(U + 128, 0, 255);
-			dest_v[x] = std::clamp(V + 128, 0, 255);
+			for (int x = 0; x < w; x++)
+			{
+				int U = U_ptr[y * w + x] / ratio;
+				int V = V_ptr[y * w + x] / ratio;
+				dest_u[y * s + x] = std::clamp(U + 128, 0, 255);
+				dest_v[y * s + x] = std::clamp(V + 128, 0, 255);
+			}
 		}
-	}
+	});
 }
 
 // Apply simple scaling to all pixels.
 
 void HdrImage::Scale(double factor)
 {
-	for (unsigned int i = 0; i < pixels.size(); i++)
-		pixels[i] *= factor;
+	int rows = pixels.size() / width;
+	for_each_band(rows, [&](int begin, int end) {
+		for (unsigned int i = begin * width; i < (unsigned int)(end * width); i++)
+			pixels[i] *= factor;
+	});
 	dynamic_range *= factor;
 }
 
@@ -387,15 +459,28 @@ public:
 
 	void Configure() override;
 
+	void Start() override;
+
 	bool Process(CompletedRequestPtr &completed_request) override;
 
+	void Stop() override;
+
 private:
+	void accumulateThread();
+	void accumulate(CompletedRequestPtr &completed_request, unsigned int frame_num);
+
 	Stream *stream_;
 	StreamInfo info_;
 	HdrConfig config_;
 	unsigned int frame_num_;
 	std::mutex mutex_;
 	HdrImage acc_, lp_;
+	// Frames wait here, holding on to their buffers, until the accumulate thread has added them in.
+	// A frame is only removed from the queue once it has been accumulated.
+	std::deque<std::pair<CompletedRequestPtr, unsigned int>> queue_;
+	std::condition_variable cond_;
+	std::thread accumulate_thread_;
+	bool abort_;
 };
 
 #define NAME "hdr"
@@ -460,35 +545,32 @@ void HdrStage::Configure()
 	acc_ = HdrImage(info_.width, info_.height, info_.width * info_.height * 3 / 2);
 	acc_.Clear();
 	lp_ = HdrImage(info_.width, info_.height, info_.width * info_.height);
+	MemoryAccount::Set(app_->GetOptions()->Get().camera, "stage.hdr", MemoryPool::System,
+					   (acc_.pixels.size() + lp_.pixels.size()) * sizeof(int16_t), 2);
 }
 
-bool HdrStage::Process(CompletedRequestPtr &completed_request)
+void HdrStage::Start()
 {
-	if (!stream_)
-		return false; // in viewfinder mode, do nothing
-
-	std::lock_guard<std::mutex> lock(mutex_);
-
-	// Once the HDR frame has been done it's not clear what to do... so let's just
-	// send the subsequent frames through unmodified.
-	if (frame_num_ >= config_.num_frames)
-		return false;
+	abort_ = false;
+	if (stream_)
+		accumulate_thread_ = std::thread(&HdrStage::accumulateThread, this);
+}
 
-	BufferWriteSync w(app_, completed_request->buffers[stream_]);
-	std::vector<libcamera::Span<uint8_t>> const &buffers = w.Get();
-	libcamera::Span<uint8_t> buffer = buffers[0];
-	uint8_t *image = buffer.data();
+void HdrStage::accumulate(CompletedRequestPtr &completed_request, unsigned int frame_num)
+{
+	BufferReadSync r(app_, completed_request->buffers[stream_]);
+	std::vector<libcamera::Span<uint8_t>> const &buffers = r.Get();
 
 	// Accumulate frame.
-	LOG(1, "Accumulating frame " << frame_num_);
-	acc_.Accumulate(image, info_.stride);
+	LOG(1, "Accumulating frame " << frame_num);
+	acc_.Accumulate(buffers[0].data(), info_.stride);
 
 	// Optionally save individual JPEGs of each of the constituent images. Obviously this
 	// will rather slow down the accumulation process.
 	if (!config_.jpeg_filename.empty())
 	{
 		char filename[128];
-		snprintf(filename, sizeof(filename), config_.jpeg_filename.c_str(), frame_num_);
+		snprintf(filename, sizeof(filename), config_.jpeg_filename.c_str(), frame_num);
 		filename[sizeof(filename) - 1] = 0;
 		StillOptions const *options = dynamic_cast<StillOptions *>(app_->GetOptions());
 		if (options)
@@ -496,26 +578,100 @@ bool HdrStage::Process(CompletedRequestPtr &completed_request)
 		else
 			LOG(1, "No still options - unable to save JPEG");
 	}
+}
+
+// Accumulating a frame takes a while, so we do it here and hang on to the buffer meanwhile. That way
+// the pipeline keeps delivering frames at the full rate instead of us dropping every other one.
 
-	// Now we'll drop this frame unless it's the last one that we need, at which point
-	// we do our HDR processing and send that through.
-	frame_num_++;
+void HdrStage::accumulateThread()
+{
+	ThreadConfig::Apply("pp-worker");
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true)
+	{
+		cond_.wait(lock, [this] { return abort_ || !queue_.empty(); });
+		if (abort_)
+			return;
+
+		auto &[completed_request, frame_num] = queue_.front();
+		lock.unlock();
+		try
+		{
+			accumulate(completed_request, frame_num);
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("HdrStage: failed to accumulate frame " << frame_num << ": " << e.what());
+		}
+		lock.lock();
+
+		// Releasing the request here returns its buffer to the camera.
+		queue_.pop_front();
+		cond_.notify_all();
+	}
+}
+
+bool HdrStage::Process(CompletedRequestPtr &completed_request)
+{
+	if (!stream_)
+		return false; // in viewfinder mode, do nothing
+
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	// Once the HDR frame has been done it's not clear what to do... so let's just
+	// send the subsequent frames through unmodified.
+	if (frame_num_ >= config_.num_frames)
+		return false;
+
+	// We'll drop this frame (once it's been accumulated) unless it's the last one that
+	// we need, at which point we do our HDR processing and send that through.
+	unsigned int frame_num = frame_num_++;
 	if (frame_num_ < config_.num_frames)
+	{
+		queue_.emplace_back(completed_request, frame_num);
+		cond_.notify_all();
 		return true;
+	}
+
+	cond_.wait(lock, [this] { return abort_ || queue_.empty(); });
+	if (abort_)
+		return false;
+	lock.unlock();
+
+	accumulate(completed_request, frame_num);
 
 	// Do HDR processing.
 	LOG(1, "Doing HDR processing...");
 	acc_.Scale(16.0 / config_.num_frames);
 
+	// The filter's forward and reverse passes need 4 doubles a pixel while it runs, far more than the images.
+	unsigned int camera = app_->GetOptions()->Get().camera;
+	MemoryAccount::Set(camera, "stage.hdr.lp_filter", MemoryPool::System,
+					   4 * sizeof(double) * info_.width * info_.height, 4);
 	lp_ = acc_.LpFilter(config_.lp_filter);
+	MemoryAccount::Set(camera, "stage.hdr.lp_filter", MemoryPool::System, 0, 0);
 	acc_.Tonemap(lp_, config_);
 
-	acc_.Extract(image, info_.stride);
+	BufferWriteSync w(app_, completed_request->buffers[stream_]);
+	acc_.Extract(w.Get()[0].data(), info_.stride);
 	LOG(1, "HDR done!");
 
 	return false;
 }
 
+void HdrStage::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	cond_.notify_all();
+	if (accumulate_thread_.joinable())
+		accumulate_thread_.join();
+	queue_.clear();
+}
+
 static PostProcessingStage *Create(RPiCamApp *app)
 {
 	return new HdrStage(app);
@@ -176,7 +176,7 @@ bool ObjectDetection::Process(CompletedRequestPtr &completed_request)
 	}
 
 	if (objects.size())
-		completed_request->post_process_metadata.Set("object_detect.results", objects);
+		completed_request->post_process_metadata.Set(OBJECT_DETECT_RESULTS, objects);
 
 	return IMX500PostProcessingStage::Process(completed_request);
 }
@@ -15,6 +15,10 @@
 #include <string>
 #include <vector>
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include <libcamera/control_ids.h>
 #include <libcamera/geometry.h>
 
@@ -169,6 +173,7 @@ float squared_distance(const Point &a, const Point &b)
 std::vector<float> format_tensor(const float *data, unsigned int size, unsigned int div)
 {
 	std::vector<float> tensor(size * MAP_SIZE.width * MAP_SIZE.height);
+	const float scale = 1.0f / div; // div is always a power of 2, so this is exact
 
 	for (unsigned int i = 0; i < size; i++)
 	{
@@ -177,7 +182,7 @@ std::vector<float> format_tensor(const float *data, unsigned int size, unsigned
 			for (unsigned int k = 0; k < MAP_SIZE.height; k++)
 			{
 				tensor[(size * MAP_SIZE.width * k) + (size * j) + i] =
-					data[(MAP_SIZE.width * MAP_SIZE.height * i) + (j * MAP_SIZE.height) + k] / div;
+					data[(MAP_SIZE.width * MAP_SIZE.height * i) + (j * MAP_SIZE.height) + k] * scale;
 			}
 		}
 	}
@@ -185,6 +190,21 @@ std::vector<float> format_tensor(const float *data, unsigned int size, unsigned
 	return tensor;
 }
 
+// Whether any of the NUM_KEYPOINTS scores of a map location reaches the threshold.
+inline bool any_score_above(const float *scores, float threshold)
+{
+#if defined(__ARM_NEON)
+	static_assert(NUM_KEYPOINTS == 17, "keypoint count has changed");
+	const float32x4_t t = vdupq_n_f32(threshold);
+	uint32x4_t above = vorrq_u32(vorrq_u32(vcgeq_f32(vld1q_f32(scores), t), vcgeq_f32(vld1q_f32(scores + 4), t)),
+								 vorrq_u32(vcgeq_f32(vld1q_f32(scores + 8), t), vcgeq_f32(vld1q_f32(scores + 12), t)));
+	uint32x2_t folded = vorr_u32(vget_low_u32(above), vget_high_u32(above));
+	return (vget_lane_u32(folded, 0) | vget_lane_u32(folded, 1)) || scores[16] >= threshold;
+#else
+	return std::any_of(scores, scores + NUM_KEYPOINTS, [threshold](float s) { return s >= threshold; });
+#endif
+}
+
 // Build an adjacency list of the pose graph.
 AdjacencyList build_agency_list()
 {
@@ -306,6 +326,13 @@ KeypointQueue build_keypoint_queue(const std::vector<float> &scores, const std::
 	{
 		for (unsigned int x = 0; x < MAP_SIZE.width; ++x)
 		{
+			// Nearly every location has nothing to offer, so test all its keypoints at once before looking closer.
+			if (!any_score_above(&scores[score_index], score_threshold))
+			{
+				score_index += NUM_KEYPOINTS;
+				continue;
+			}
+
 			unsigned int offset_index = 2 * score_index;
 			for (unsigned int j = 0; j < NUM_KEYPOINTS; ++j)
 			{
@@ -505,6 +532,15 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
+	// Everything we put in the metadata for one frame.
+	struct PoseMetadata
+	{
+		std::vector<std::vector<libcamera::Point>> locations;
+		std::vector<std::vector<float>> confidences;
+	};
+
+	PoseMetadata decode(const float *tensor, const Rectangle &scaler_crop);
+	static void setMetadata(CompletedRequestPtr &completed_request, const PoseMetadata &poses);
 	std::vector<PoseResults> decodeAllPoses(const std::vector<float> &scores, const std::vector<float> &short_offsets,
 											const std::vector<float> &mid_offsets);
 	void translateCoordinates(std::vector<PoseResults> &results, const Rectangle &scaler_crop) const;
@@ -594,18 +630,38 @@ bool PoseNet::Process(CompletedRequestPtr &completed_request)
 		return false;
 	}
 
-	std::vector<float> scores =
-		format_tensor((float *)output->data(), NUM_HEATMAPS / (MAP_SIZE.width * MAP_SIZE.height), 1);
-	std::vector<float> short_offsets = format_tensor((float *)output->data() + NUM_HEATMAPS,
-													 NUM_SHORT_OFFSETS / (MAP_SIZE.width * MAP_SIZE.height), STRIDE);
-	std::vector<float> mid_offsets = format_tensor((float *)output->data() + NUM_HEATMAPS + NUM_SHORT_OFFSETS,
+	if (AsyncDecode())
+	{
+		// The tensor belongs to the request, which we mustn't hold on to, so the worker gets a copy.
+		std::vector<float> tensor((float *)output->data(),
+								  (float *)output->data() + NUM_HEATMAPS + NUM_SHORT_OFFSETS + NUM_MID_OFFSETS);
+		Rectangle crop = *scaler_crop;
+		QueueDecode(completed_request->sequence, [this, tensor = std::move(tensor), crop]() -> ApplyFunc {
+			auto poses = std::make_shared<PoseMetadata>(decode(tensor.data(), crop));
+			return [poses](CompletedRequestPtr &request) { setMetadata(request, *poses); };
+		});
+		ApplyDecoded(completed_request);
+	}
+	else
+		setMetadata(completed_request, decode((float *)output->data(), *scaler_crop));
+
+	return IMX500PostProcessingStage::Process(completed_request);
+}
+
+PoseNet::PoseMetadata PoseNet::decode(const float *tensor, const Rectangle &scaler_crop)
+{
+	std::vector<float> scores = format_tensor(tensor, NUM_HEATMAPS / (MAP_SIZE.width * MAP_SIZE.height), 1);
+	std::vector<float> short_offsets =
+		format_tensor(tensor + NUM_HEATMAPS, NUM_SHORT_OFFSETS / (MAP_SIZE.width * MAP_SIZE.height), STRIDE);
+	std::vector<float> mid_offsets = format_tensor(tensor + NUM_HEATMAPS + NUM_SHORT_OFFSETS,
 												   NUM_MID_OFFSETS / (MAP_SIZE.width * MAP_SIZE.height), STRIDE);
 
 	std::vector<PoseResults> results = decodeAllPoses(scores, short_offsets, mid_offsets);
-	translateCoordinates(results, *scaler_crop);
+	translateCoordinates(results, scaler_crop);
 
-	std::vector<std::vector<libcamera::Point>> locations;
-	std::vector<std::vector<float>> confidences;
+	PoseMetadata poses;
+	auto &locations = poses.locations;
+	auto &confidences = poses.confidences;
 
 	if (temporal_filtering_)
 	{
@@ -642,13 +698,16 @@ bool PoseNet::Process(CompletedRequestPtr &completed_request)
 		}
 	}
 
-	if (locations.size() && locations.size() == confidences.size())
+	return poses;
+}
+
+void PoseNet::setMetadata(CompletedRequestPtr &completed_request, const PoseMetadata &poses)
+{
+	if (poses.locations.size() && poses.locations.size() == poses.confidences.size())
 	{
-		completed_request->post_process_metadata.Set("pose_estimation.locations", locations);
-		completed_request->post_process_metadata.Set("pose_estimation.confidences", confidences);
+		completed_request->post_process_metadata.Set("pose_estimation.locations", poses.locations);
+		completed_request->post_process_metadata.Set("pose_estimation.confidences", poses.confidences);
 	}
-
-	return IMX500PostProcessingStage::Process(completed_request);
 }
 
 // Decodes poses from the score map, the short and mid offsets.
@@ -17,6 +17,8 @@
 
 #include <boost/property_tree/ptree.hpp>
 
+#include "core/thread_config.hpp"
+
 #include "imx500_post_processing_stage.hpp"
 
 #include <libcamera/control_ids.h>
@@ -35,6 +37,26 @@ namespace
 const unsigned int ROI_CTRL_ID = 0x00982900;
 const unsigned int NETWORK_FW_CTRL_ID = 0x00982901;
 
+// The sensor can't tell us which network it holds, so we remember which one each device was last seen running.
+// This lives under /run so that it's forgotten when the system restarts, as the sensor's own copy is.
+const char *const NETWORK_RECORD_DIR = "/run/rpicam-apps";
+
+// FNV-1a over the whole file.
+std::string file_hash(std::string const &filename)
+{
+	std::ifstream in(filename, std::ios::binary);
+	uint64_t hash = 0xcbf29ce484222325ull;
+	char buf[65536];
+	while (in.read(buf, sizeof(buf)) || in.gcount())
+	{
+		for (std::streamsize i = 0; i < in.gcount(); i++)
+			hash = (hash ^ (uint8_t)buf[i]) * 0x100000001b3ull;
+	}
+	std::stringstream ss;
+	ss << std::hex << hash;
+	return ss.str();
+}
+
 inline int16_t conv_reg_signed(int16_t reg)
 {
 	constexpr unsigned int ROT_DNN_NORM_SIGNED_SHT = 8;
@@ -72,6 +94,7 @@ IMX500PostProcessingStage::IMX500PostProcessingStage(RPiCamApp *app)
 				assert(pos != std::string::npos);
 
 				const std::string imx500_device_id = test_dir_str.substr(pos);
+				device_id_ = imx500_device_id;
 				std::string spi_device_id = imx500_device_id;
 				const std::size_t rep = spi_device_id.find("001a");
 				spi_device_id.replace(rep, 4, "0040");
@@ -95,6 +118,16 @@ IMX500PostProcessingStage::IMX500PostProcessingStage(RPiCamApp *app)
 
 IMX500PostProcessingStage::~IMX500PostProcessingStage()
 {
+	if (decode_thread_.joinable())
+	{
+		{
+			std::scoped_lock<std::mutex> l(decode_lock_);
+			decode_abort_ = true;
+		}
+		decode_cv_.notify_all();
+		decode_thread_.join();
+	}
+
 	if (device_fd_ >= 0)
 		close(device_fd_);
 }
@@ -115,11 +148,29 @@ void IMX500PostProcessingStage::Read(boost::property_tree::ptree const &params)
 		div_shift_ = pt.get<unsigned int>("div_shift", 0);
 	}
 
+	async_decode_ = params.get<int>("async_decode", 0);
+	if (async_decode_ && !decode_thread_.joinable())
+		decode_thread_ = std::thread(&IMX500PostProcessingStage::decodeThread, this);
+
 	/* Load the network firmware. */
 	std::string network_file = params.get<std::string>("network_file");
 	if (!fs::exists(network_file))
 		throw std::runtime_error(network_file + " not found!");
 
+	// Skip the upload if the sensor was already running this network, unless told otherwise. "Running" means
+	// its output reached us, so an upload that never finished gets done again.
+	network_hash_ = file_hash(network_file);
+	std::string recorded;
+	std::ifstream(networkRecordPath()) >> recorded;
+	if (!params.get<int>("force_network_upload", 0) && recorded == network_hash_)
+	{
+		LOG(1, "IMX500: network firmware " << network_file << " is already loaded");
+		network_recorded_ = true;
+		return;
+	}
+	std::error_code ec;
+	fs::remove(networkRecordPath(), ec);
+
 	int fd = open(network_file.c_str(), O_RDONLY, 0);
 
 	v4l2_control ctrl { NETWORK_FW_CTRL_ID, fd };
@@ -141,8 +192,24 @@ void IMX500PostProcessingStage::Configure()
 	save_frames_ = num_input_tensors_saved_;
 }
 
+std::string IMX500PostProcessingStage::networkRecordPath() const
+{
+	return std::string(NETWORK_RECORD_DIR) + "/imx500-" + device_id_ + ".network";
+}
+
 bool IMX500PostProcessingStage::Process(CompletedRequestPtr &completed_request)
 {
+	if (!network_recorded_ && completed_request->metadata.get(controls::rpi::CnnOutputTensor) &&
+		!network_recorded_.exchange(true))
+	{
+		std::error_code ec;
+		fs::create_directories(NETWORK_RECORD_DIR, ec);
+		std::ofstream record(networkRecordPath());
+		record << network_hash_ << std::endl;
+		if (!record)
+			LOG(2, "IMX500: unable to record the network firmware in " << networkRecordPath());
+	}
+
 	auto input = completed_request->metadata.get(controls::rpi::CnnInputTensor);
 
 	if (input && input_tensor_file_.is_open())
@@ -166,6 +233,82 @@ bool IMX500PostProcessingStage::Process(CompletedRequestPtr &completed_request)
 	return false;
 }
 
+void IMX500PostProcessingStage::Stop()
+{
+	// Results from before a restart are no use afterwards, and the stage may reset its state once we return.
+	std::unique_lock<std::mutex> l(decode_lock_);
+	decode_job_ = nullptr;
+	decode_cv_.wait(l, [this] { return !decode_busy_; });
+	decoded_ = nullptr;
+}
+
+void IMX500PostProcessingStage::QueueDecode(unsigned int sequence, DecodeFunc decode)
+{
+	{
+		std::scoped_lock<std::mutex> l(decode_lock_);
+		if (decode_job_)
+			LOG(2, "IMX500: decoder busy, dropping output tensor from frame " << decode_sequence_);
+		decode_job_ = std::move(decode);
+		decode_sequence_ = sequence;
+	}
+	decode_cv_.notify_all();
+}
+
+void IMX500PostProcessingStage::ApplyDecoded(CompletedRequestPtr &completed_request)
+{
+	ApplyFunc apply;
+	unsigned int sequence;
+	{
+		std::scoped_lock<std::mutex> l(decode_lock_);
+		if (!decoded_)
+			return;
+		apply = decoded_;
+		sequence = decoded_sequence_;
+	}
+
+	apply(completed_request);
+	completed_request->post_process_metadata.Set(IMX500_RESULT_LATENCY, completed_request->sequence - sequence);
+}
+
+void IMX500PostProcessingStage::decodeThread()
+{
+	ThreadConfig::Apply("pp-worker");
+
+	std::unique_lock<std::mutex> l(decode_lock_);
+
+	while (true)
+	{
+		decode_cv_.wait(l, [this] { return decode_abort_ || decode_job_; });
+		if (decode_abort_)
+			break;
+
+		DecodeFunc decode = std::move(decode_job_);
+		decode_job_ = nullptr;
+		unsigned int sequence = decode_sequence_;
+		decode_busy_ = true;
+		l.unlock();
+
+		ApplyFunc apply;
+		try
+		{
+			apply = decode();
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("IMX500: failed to decode output tensor: " << e.what());
+		}
+
+		l.lock();
+		decode_busy_ = false;
+		if (apply)
+		{
+			decoded_ = std::move(apply);
+			decoded_sequence_ = sequence;
+		}
+		decode_cv_.notify_all();
+	}
+}
+
 Rectangle IMX500PostProcessingStage::ConvertInferenceCoordinates(const std::vector<float> &coords,
 																 const Rectangle &scaler_crop) const
 {
@@ -7,8 +7,12 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
 #include <fstream>
+#include <functional>
 #include <mutex>
+#include <thread>
 
 #include <boost/property_tree/ptree.hpp>
 
@@ -16,9 +20,13 @@
 #include <libcamera/stream.h>
 
 #include "core/completed_request.hpp"
+#include "core/metadata.hpp"
 #include "core/rpicam_app.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 
+// When the output tensor is decoded asynchronously, how many frames before this one the results came from.
+inline const MetadataKey<unsigned int> IMX500_RESULT_LATENCY("imx500.result_latency");
+
 class IMX500PostProcessingStage : public PostProcessingStage
 {
 public:
@@ -49,6 +57,10 @@ public:
 
 	bool Process(CompletedRequestPtr &completed_request) override;
 
+	bool ExclusiveDevice() const override { return true; }
+
+	void Stop() override;
+
 	libcamera::Rectangle ConvertInferenceCoordinates(const std::vector<float> &coords,
 													 const libcamera::Rectangle &scalerCrop) const;
 	void SetInferenceRoiAbs(const libcamera::Rectangle &roi_) const;
@@ -56,14 +68,32 @@ public:
 	void ShowFwProgressBar();
 
 protected:
+	// Writes a set of decoded results into a request's metadata, possibly more than once.
+	using ApplyFunc = std::function<void(CompletedRequestPtr &completed_request)>;
+	using DecodeFunc = std::function<ApplyFunc()>;
+
+	// With "async_decode" set, stages should hand their output tensor decoding to QueueDecode, which runs it on a
+	// worker thread so that it costs no time in the post-processing chain. Only the newest tensor waits for the
+	// worker; an older one that hasn't started is dropped. ApplyDecoded then gives every request the most recent
+	// results, labelled with their age in frames.
+	bool AsyncDecode() const { return async_decode_; }
+	void QueueDecode(unsigned int sequence, DecodeFunc decode);
+	void ApplyDecoded(CompletedRequestPtr &completed_request);
+
 	libcamera::Rectangle full_sensor_resolution_ = libcamera::Rectangle(0, 0, 4056, 3040);
 	libcamera::Stream *output_stream_;
 	libcamera::Stream *raw_stream_;
 
 private:
 	void doProgressBar();
+	void decodeThread();
+	std::string networkRecordPath() const;
 
 	int device_fd_;
+	std::string device_id_;
+	// A hash of the network firmware file, recorded once the sensor is seen to be running it.
+	std::string network_hash_;
+	std::atomic<bool> network_recorded_ = false;
 	std::ifstream fw_progress_;
 	std::ifstream fw_progress_chunk_;
 
@@ -75,4 +105,15 @@ private:
 	std::vector<int16_t> div_val_;
 	unsigned int div_shift_;
 	std::mutex lock_;
+
+	bool async_decode_ = false;
+	std::thread decode_thread_;
+	std::mutex decode_lock_;
+	std::condition_variable decode_cv_;
+	bool decode_abort_ = false;
+	bool decode_busy_ = false;
+	DecodeFunc decode_job_;
+	unsigned int decode_sequence_ = 0;
+	ApplyFunc decoded_;
+	unsigned int decoded_sequence_ = 0;
 };
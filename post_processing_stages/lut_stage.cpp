@@ -0,0 +1,163 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * lut_stage.cpp - apply per-plane lookup tables to the image
+ */
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include <libcamera/formats.h>
+#include <libcamera/stream.h>
+
+#include "core/rpicam_app.hpp"
+
+#include "post_processing_stages/post_processing_stage.hpp"
+#include "post_processing_stages/pwl.hpp"
+
+using Stream = libcamera::Stream;
+
+// Each of the Y, U and V planes may be given its own curve as a Pwl over the 0 to 255 range. A
+// "gamma" value is applied to Y after any curve, and "negate" then inverts every plane. Planes
+// that end up with an identity table are not touched at all.
+
+class LutStage : public PostProcessingStage
+{
+public:
+	LutStage(RPiCamApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+	bool PerPixel() const override { return stream_ != nullptr; }
+
+	void ProcessTile(uint8_t *ptr, size_t offset, size_t size) override;
+
+private:
+	using Lut = std::array<uint8_t, 256>;
+
+	Stream *stream_;
+	StreamInfo info_;
+	size_t plane_offsets_[4];
+	Lut luts_[3];
+	bool active_[3];
+};
+
+#define NAME "lut"
+
+char const *LutStage::Name() const
+{
+	return NAME;
+}
+
+void LutStage::Read(boost::property_tree::ptree const &params)
+{
+	static const char *plane_names[3] = { "y", "u", "v" };
+	double gamma = params.get<double>("gamma", 1.0);
+	bool negate = params.get<int>("negate", 0);
+	if (gamma <= 0)
+		throw std::runtime_error("LutStage: gamma must be positive");
+
+	for (unsigned int p = 0; p < 3; p++)
+	{
+		Pwl pwl;
+		if (auto curve = params.get_child_optional(plane_names[p]))
+			pwl.Read(*curve);
+
+		active_[p] = false;
+		for (unsigned int i = 0; i < 256; i++)
+		{
+			double value = pwl.Empty() ? i : pwl.Eval(i);
+			if (p == 0 && gamma != 1.0)
+				value = 255.0 * std::pow(std::clamp(value, 0.0, 255.0) / 255.0, 1.0 / gamma);
+			if (negate)
+				value = 255.0 - value;
+			luts_[p][i] = std::clamp<int>(std::lround(value), 0, 255);
+			active_[p] |= luts_[p][i] != i;
+		}
+	}
+}
+
+void LutStage::Configure()
+{
+	stream_ = app_->GetMainStream();
+	if (!stream_)
+		return;
+	if (stream_->configuration().pixelFormat != libcamera::formats::YUV420)
+		throw std::runtime_error("LutStage: only supports YUV420");
+	info_ = app_->GetStreamInfo(stream_);
+
+	size_t y_size = info_.height * info_.stride, uv_size = (info_.height / 2) * (info_.stride / 2);
+	plane_offsets_[0] = 0;
+	plane_offsets_[1] = y_size;
+	plane_offsets_[2] = y_size + uv_size;
+	plane_offsets_[3] = y_size + 2 * uv_size;
+}
+
+static void apply_lut(uint8_t *ptr, size_t size, const uint8_t *lut)
+{
+	size_t i = 0;
+#if defined(__aarch64__)
+	// A 256 entry table is four 64 byte tables. Indices outside each table leave the previous result
+	// alone, so we can rebase the index and look it up in each table in turn.
+	uint8x16x4_t t0 = vld1q_u8_x4(lut), t1 = vld1q_u8_x4(lut + 64);
+	uint8x16x4_t t2 = vld1q_u8_x4(lut + 128), t3 = vld1q_u8_x4(lut + 192);
+	uint8x16_t step = vdupq_n_u8(64);
+	for (; i + 16 <= size; i += 16)
+	{
+		uint8x16_t index = vld1q_u8(ptr + i);
+		uint8x16_t result = vqtbl4q_u8(t0, index);
+		index = vsubq_u8(index, step);
+		result = vqtbx4q_u8(result, t1, index);
+		index = vsubq_u8(index, step);
+		result = vqtbx4q_u8(result, t2, index);
+		index = vsubq_u8(index, step);
+		result = vqtbx4q_u8(result, t3, index);
+		vst1q_u8(ptr + i, result);
+	}
+#endif
+	for (; i < size; i++)
+		ptr[i] = lut[ptr[i]];
+}
+
+// The piece of the image from offset to offset + size may cover parts of more than one plane.
+
+void LutStage::ProcessTile(uint8_t *ptr, size_t offset, size_t size)
+{
+	for (unsigned int p = 0; p < 3; p++)
+	{
+		size_t start = std::max(offset, plane_offsets_[p]), end = std::min(offset + size, plane_offsets_[p + 1]);
+		if (active_[p] && start < end)
+			apply_lut(ptr + (start - offset), end - start, luts_[p].data());
+	}
+}
+
+bool LutStage::Process(CompletedRequestPtr &completed_request)
+{
+	if (!stream_ || !(active_[0] || active_[1] || active_[2]))
+		return false;
+
+	BufferWriteSync w(app_, completed_request->buffers[stream_]);
+	libcamera::Span<uint8_t> buffer = w.Get()[0];
+	ProcessTile(buffer.data(), 0, buffer.size());
+
+	return false;
+}
+
+static PostProcessingStage *Create(RPiCamApp *app)
+{
+	return new LutStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
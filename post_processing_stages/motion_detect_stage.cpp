@@ -20,6 +20,22 @@
 // the application can take that as true immediately. To be sure there's no motion,
 // an application should probably wait for "a few frames" of "no motion".
 
+// Setting tiles_x and/or tiles_y splits the ROI into a grid of tiles that are each tested
+// against tile_threshold (as a fraction of the tile's area). The per-tile counts are then
+// added as "motion_detect.tiles" (a std::vector<unsigned int>, row by row), and the tiles
+// that passed as "motion_detect.regions" (a std::vector<libcamera::Rectangle> in lores
+// image pixels). "motion_detect.result" is set if any tile passed.
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include <libcamera/geometry.h>
 #include <libcamera/stream.h>
 
 #include "core/rpicam_app.hpp"
@@ -42,6 +58,10 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
+	unsigned int countRow(uint8_t const *src, uint8_t *prev, unsigned int width) const;
+	void copyRow(uint8_t const *src, uint8_t *prev) const;
+	bool processTiles(uint8_t *image, CompletedRequestPtr &completed_request);
+
 	// In the Config, dimensions are given as fractions of the lores image size.
 	struct Config
 	{
@@ -51,6 +71,8 @@ private:
 		float difference_m;
 		int difference_c;
 		float region_threshold;
+		unsigned int tiles_x, tiles_y;
+		float tile_threshold;
 		int frame_period;
 		bool verbose;
 		std::string region_name;
@@ -62,6 +84,17 @@ private:
 	unsigned int roi_x_, roi_y_;
 	unsigned int roi_width_, roi_height_;
 	unsigned int region_threshold_;
+	// A pixel has changed when its absolute difference exceeds threshold_lut_[old value]. This is the
+	// difference_m * old_value + difference_c test, exactly, but without the float arithmetic.
+	std::array<int, 256> threshold_lut_;
+	// The same thresholds clamped to 8 bits for the NEON path, which gives identical results as differences
+	// never exceed 255. It needs hskip <= 4 and no negative thresholds.
+	bool use_neon_;
+	std::array<uint8_t, 256> neon_lut_;
+	// Tile boundaries, in subsampled ROI pixels, when tiling is enabled.
+	std::vector<unsigned int> tile_x_edges_, tile_y_edges_;
+	std::vector<unsigned int> tile_thresholds_;
+	std::vector<unsigned int> tile_counts_;
 	std::vector<uint8_t> previous_frame_;
 	bool first_time_;
 	bool motion_detected_;
@@ -86,6 +119,9 @@ void MotionDetectStage::Read(boost::property_tree::ptree const &params)
 	config_.difference_m = params.get<float>("difference_m", 0.1);
 	config_.difference_c = params.get<int>("difference_c", 10);
 	config_.region_threshold = params.get<float>("region_threshold", 0.005);
+	config_.tiles_x = params.get<unsigned int>("tiles_x", 1);
+	config_.tiles_y = params.get<unsigned int>("tiles_y", 1);
+	config_.tile_threshold = params.get<float>("tile_threshold", config_.region_threshold);
 	config_.frame_period = params.get<int>("frame_period", 5);
 	config_.verbose = params.get<int>("verbose", 0);
 	config_.region_name = params.get<std::string>("region_name", "");
@@ -122,11 +158,144 @@ void MotionDetectStage::Configure()
 		LOG(1, "Lores: " << info.width << "x" << info.height << " roi: (" << roi_x_ << "," << roi_y_ << ") "
 						 << roi_width_ << "x" << roi_height_ << " threshold: " << region_threshold_);
 
+	for (unsigned int v = 0; v < threshold_lut_.size(); v++)
+		threshold_lut_[v] = std::floor(config_.difference_m * v + config_.difference_c);
+
+	for (unsigned int v = 0; v < neon_lut_.size(); v++)
+		neon_lut_[v] = std::clamp(threshold_lut_[v], 0, 255);
+#if defined(__aarch64__)
+	use_neon_ = config_.hskip <= 4 && *std::min_element(threshold_lut_.begin(), threshold_lut_.end()) >= 0;
+#else
+	use_neon_ = false;
+#endif
+
+	tile_x_edges_.clear();
+	tile_y_edges_.clear();
+	tile_thresholds_.clear();
+	if (config_.tiles_x > 1 || config_.tiles_y > 1)
+	{
+		unsigned int tiles_x = std::clamp(config_.tiles_x, 1u, std::max(roi_width_, 1u));
+		unsigned int tiles_y = std::clamp(config_.tiles_y, 1u, std::max(roi_height_, 1u));
+		for (unsigned int i = 0; i <= tiles_x; i++)
+			tile_x_edges_.push_back(i * roi_width_ / tiles_x);
+		for (unsigned int i = 0; i <= tiles_y; i++)
+			tile_y_edges_.push_back(i * roi_height_ / tiles_y);
+		for (unsigned int ty = 0; ty < tiles_y; ty++)
+		{
+			for (unsigned int tx = 0; tx < tiles_x; tx++)
+			{
+				unsigned int area = (tile_x_edges_[tx + 1] - tile_x_edges_[tx]) *
+									(tile_y_edges_[ty + 1] - tile_y_edges_[ty]);
+				tile_thresholds_.push_back(std::clamp<unsigned int>(config_.tile_threshold * area, 0u, area));
+			}
+		}
+		tile_counts_.resize(tile_thresholds_.size());
+
+		if (config_.verbose)
+			LOG(1, "Motion tiles: " << tiles_x << "x" << tiles_y);
+	}
+
 	previous_frame_.resize(roi_width_ * roi_height_);
 	first_time_ = true;
 	motion_detected_ = false;
 }
 
+#if defined(__aarch64__)
+template <int HSKIP>
+static unsigned int count_row_neon(uint8_t const *src, uint8_t *prev, unsigned int width, uint8_t const *lut)
+{
+	// The 256 entry threshold table, as four 64 byte quarters for the table lookups.
+	auto quarter = [lut](unsigned int q)
+	{
+		uint8_t const *p = lut + q * 64;
+		return uint8x16x4_t { { vld1q_u8(p), vld1q_u8(p + 16), vld1q_u8(p + 32), vld1q_u8(p + 48) } };
+	};
+	uint8x16x4_t lut0 = quarter(0), lut1 = quarter(1), lut2 = quarter(2), lut3 = quarter(3);
+	uint8x16_t q1 = vdupq_n_u8(64), q2 = vdupq_n_u8(128), q3 = vdupq_n_u8(192), one = vdupq_n_u8(1);
+	uint16x8_t count = vdupq_n_u16(0);
+	unsigned int x = 0;
+
+	for (; x + 16 <= width; x += 16, src += 16 * HSKIP)
+	{
+		// The deinterleaving loads give us every HSKIP'th pixel directly.
+		uint8x16_t cur;
+		if constexpr (HSKIP == 1)
+			cur = vld1q_u8(src);
+		else if constexpr (HSKIP == 2)
+			cur = vld2q_u8(src).val[0];
+		else if constexpr (HSKIP == 3)
+			cur = vld3q_u8(src).val[0];
+		else
+			cur = vld4q_u8(src).val[0];
+		uint8x16_t old = vld1q_u8(prev + x);
+		vst1q_u8(prev + x, cur);
+
+		// Look up lut[old]. Each lookup gives 0 for indices outside its quarter, so OR-ing them together
+		// picks out the right one.
+		uint8x16_t thresh = vqtbl4q_u8(lut0, old);
+		thresh = vorrq_u8(thresh, vqtbl4q_u8(lut1, vsubq_u8(old, q1)));
+		thresh = vorrq_u8(thresh, vqtbl4q_u8(lut2, vsubq_u8(old, q2)));
+		thresh = vorrq_u8(thresh, vqtbl4q_u8(lut3, vsubq_u8(old, q3)));
+		uint8x16_t changed = vandq_u8(vcgtq_u8(vabdq_u8(cur, old), thresh), one);
+		count = vpadalq_u8(count, changed);
+	}
+
+	uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(count));
+	unsigned int regions = vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1);
+
+	for (; x < width; x++, src += HSKIP)
+	{
+		int cur = *src, old = prev[x];
+		prev[x] = cur;
+		regions += std::abs(cur - old) > lut[old];
+	}
+
+	return regions;
+}
+#endif
+
+// Count the changed pixels in (part of) a row of the ROI, updating the previous image at the same time.
+unsigned int MotionDetectStage::countRow(uint8_t const *src, uint8_t *prev, unsigned int width) const
+{
+#if defined(__aarch64__)
+	if (use_neon_)
+	{
+		switch (config_.hskip)
+		{
+		case 1:
+			return count_row_neon<1>(src, prev, width, neon_lut_.data());
+		case 2:
+			return count_row_neon<2>(src, prev, width, neon_lut_.data());
+		case 3:
+			return count_row_neon<3>(src, prev, width, neon_lut_.data());
+		default:
+			return count_row_neon<4>(src, prev, width, neon_lut_.data());
+		}
+	}
+#endif
+
+	unsigned int regions = 0;
+	for (unsigned int x = 0; x < width; x++, src += config_.hskip)
+	{
+		int new_value = *src;
+		int old_value = prev[x];
+		prev[x] = new_value;
+		regions += std::abs(new_value - old_value) > threshold_lut_[old_value];
+	}
+	return regions;
+}
+
+void MotionDetectStage::copyRow(uint8_t const *src, uint8_t *prev) const
+{
+	if (config_.hskip == 1)
+		memcpy(prev, src, roi_width_);
+	else
+	{
+		for (unsigned int x = 0; x < roi_width_; x++, src += config_.hskip)
+			prev[x] = *src;
+	}
+}
+
 bool MotionDetectStage::Process(CompletedRequestPtr &completed_request)
 {
 	if (!stream_)
@@ -146,43 +315,83 @@ bool MotionDetectStage::Process(CompletedRequestPtr &completed_request)
 	{
 		first_time_ = false;
 		for (unsigned int y = 0; y < roi_height_; y++)
-		{
-			uint8_t *new_value_ptr = image + (roi_y_ + y) * lores_stride_ + roi_x_ * config_.hskip;
-			uint8_t *old_value_ptr = &previous_frame_[0] + y * roi_width_;
-			for (unsigned int x = 0; x < roi_width_; x++, new_value_ptr += config_.hskip)
-				*(old_value_ptr++) = *new_value_ptr;
-		}
+			copyRow(image + (roi_y_ + y) * lores_stride_ + roi_x_ * config_.hskip, &previous_frame_[0] + y * roi_width_);
 
-		completed_request->post_process_metadata.Set("motion_detect.result", motion_detected_);
+		completed_request->post_process_metadata.Set(MOTION_DETECT_RESULT, motion_detected_);
 
 		return false;
 	}
 
-	bool motion_detected = false;
+	if (!tile_thresholds_.empty())
+		return processTiles(image, completed_request);
+
 	unsigned int regions = 0;
+	unsigned int y = 0;
 
 	// Count the lores pixels where the difference between the new and previous values
 	// exceeds the threshold. At the same time, update the previous image buffer.
-	for (unsigned int y = 0; y < roi_height_; y++)
+	for (; y < roi_height_ && regions < region_threshold_; y++)
+		regions += countRow(image + (roi_y_ + y) * lores_stride_ + roi_x_ * config_.hskip,
+							&previous_frame_[0] + y * roi_width_, roi_width_);
+
+	// Once there are enough, the rest of the ROI only has to be copied for next time.
+	for (; y < roi_height_; y++)
+		copyRow(image + (roi_y_ + y) * lores_stride_ + roi_x_ * config_.hskip, &previous_frame_[0] + y * roi_width_);
+
+	bool motion_detected = regions >= region_threshold_;
+
+	if (config_.verbose && motion_detected != motion_detected_)
+		LOG(1, "Motion " << (motion_detected ? "detected" : "stopped")
+						 << (config_.region_name.empty() ? "" : " in region " + config_.region_name));
+
+	motion_detected_ = motion_detected;
+	completed_request->post_process_metadata.Set(MOTION_DETECT_RESULT, motion_detected);
+
+	return false;
+}
+
+bool MotionDetectStage::processTiles(uint8_t *image, CompletedRequestPtr &completed_request)
+{
+	// All the tile counts come out of a single pass over the ROI, splitting each row at the tile edges.
+	// There's no stopping early here as every tile needs its full count.
+	unsigned int tiles_x = tile_x_edges_.size() - 1;
+	std::fill(tile_counts_.begin(), tile_counts_.end(), 0);
+	for (unsigned int ty = 0; ty + 1 < tile_y_edges_.size(); ty++)
 	{
-		uint8_t *new_value_ptr = image + (roi_y_ + y) * lores_stride_ + roi_x_ * config_.hskip;
-		uint8_t *old_value_ptr = &previous_frame_[0] + y * roi_width_;
-		for (unsigned int x = 0; x < roi_width_; x++, new_value_ptr += config_.hskip)
+		unsigned int *counts = &tile_counts_[ty * tiles_x];
+		for (unsigned int y = tile_y_edges_[ty]; y < tile_y_edges_[ty + 1]; y++)
 		{
-			int new_value = *new_value_ptr;
-			int old_value = *old_value_ptr;
-			*(old_value_ptr++) = new_value;
-			regions += std::abs(new_value - old_value) > config_.difference_m * old_value + config_.difference_c;
-			motion_detected = regions >= region_threshold_;
+			uint8_t const *src = image + (roi_y_ + y) * lores_stride_ + roi_x_ * config_.hskip;
+			uint8_t *prev = &previous_frame_[0] + y * roi_width_;
+			for (unsigned int tx = 0; tx < tiles_x; tx++)
+			{
+				unsigned int x0 = tile_x_edges_[tx], x1 = tile_x_edges_[tx + 1];
+				counts[tx] += countRow(src + x0 * config_.hskip, prev + x0, x1 - x0);
+			}
 		}
 	}
 
+	// Report the active tiles in (non-subsampled) lores image coordinates.
+	std::vector<libcamera::Rectangle> regions;
+	for (unsigned int i = 0; i < tile_counts_.size(); i++)
+	{
+		if (tile_counts_[i] < tile_thresholds_[i])
+			continue;
+		unsigned int tx = i % tiles_x, ty = i / tiles_x;
+		regions.emplace_back((roi_x_ + tile_x_edges_[tx]) * config_.hskip, (roi_y_ + tile_y_edges_[ty]) * config_.vskip,
+							 (tile_x_edges_[tx + 1] - tile_x_edges_[tx]) * config_.hskip,
+							 (tile_y_edges_[ty + 1] - tile_y_edges_[ty]) * config_.vskip);
+	}
+	bool motion_detected = !regions.empty();
+
 	if (config_.verbose && motion_detected != motion_detected_)
-		LOG(1, "Motion " << (motion_detected ? "detected" : "stopped")
+		LOG(1, "Motion " << (motion_detected ? "detected in " + std::to_string(regions.size()) + " tiles" : "stopped")
 						 << (config_.region_name.empty() ? "" : " in region " + config_.region_name));
 
 	motion_detected_ = motion_detected;
-	completed_request->post_process_metadata.Set("motion_detect.result", motion_detected);
+	completed_request->post_process_metadata.Set("motion_detect.tiles", tile_counts_);
+	completed_request->post_process_metadata.Set("motion_detect.regions", std::move(regions));
+	completed_request->post_process_metadata.Set(MOTION_DETECT_RESULT, motion_detected);
 
 	return false;
 }
@@ -5,6 +5,10 @@
  * negate_stage.cpp - image negate effect
  */
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include <libcamera/stream.h>
 
 #include "core/rpicam_app.hpp"
@@ -26,6 +30,10 @@ public:
 
 	bool Process(CompletedRequestPtr &completed_request) override;
 
+	bool PerPixel() const override { return stream_ != nullptr; }
+
+	void ProcessTile(uint8_t *ptr, size_t offset, size_t size) override;
+
 private:
 	Stream *stream_;
 };
@@ -42,15 +50,26 @@ void NegateStage::Configure()
 	stream_ = app_->GetMainStream();
 }
 
-bool NegateStage::Process(CompletedRequestPtr &completed_request)
+void NegateStage::ProcessTile(uint8_t *data, size_t offset, size_t size)
 {
-	BufferWriteSync w(app_, completed_request->buffers[stream_]);
-	libcamera::Span<uint8_t> buffer = w.Get()[0];
-	uint32_t *ptr = (uint32_t *)buffer.data();
+	size_t i = 0;
+
+#if defined(__ARM_NEON)
+	for (; i + 16 <= size; i += 16)
+		vst1q_u8(data + i, vmvnq_u8(vld1q_u8(data + i)));
+#endif
 
 	// Constraints on the stride mean we always have multiple-of-4 bytes.
-	for (unsigned int i = 0; i < buffer.size(); i += 4)
+	uint32_t *ptr = (uint32_t *)(data + i);
+	for (; i < size; i += 4)
 		*(ptr++) ^= 0xffffffff;
+}
+
+bool NegateStage::Process(CompletedRequestPtr &completed_request)
+{
+	BufferWriteSync w(app_, completed_request->buffers[stream_]);
+	libcamera::Span<uint8_t> buffer = w.Get()[0];
+	ProcessTile(buffer.data(), 0, buffer.size());
 
 	return false;
 }
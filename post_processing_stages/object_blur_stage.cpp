@@ -7,15 +7,23 @@
  * This stage applies blur effects to detected objects in the video stream.
  * Objects are identified by their class names (e.g., "person", "cup", "wine glass") from
  * previous detection stages like hailo_yolo_inference. Multiple blur types are supported:
- * pixelation (default), Gaussian blur, and median blur. The blur strength, bounding box
- * expansion, and target object classes can be configured via JSON.
+ * pixelation (default), Gaussian blur, median blur, and a fast box blur. The blur strength,
+ * bounding box expansion, and target object classes can be configured via JSON. Overlapping
+ * objects are merged into one region, and the regions and colour planes are blurred in parallel.
  * This is useful for privacy applications or to obscure specific objects in real-time.
  */
 
 #include <algorithm>
+#include <atomic>
 #include <string>
+#include <thread>
 #include <vector>
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <libcamera/formats.h>
 #include <libcamera/stream.h>
 
 #include "core/rpicam_app.hpp"
@@ -42,18 +50,123 @@ public:
 
 private:
 	bool shouldBlurObject(const std::string &label) const;
+	int strength(int width) const;
+	int chromaStrength(int strength) const;
+	int reach(int strength) const;
+	void blurRegion(Mat &plane, Rect const &roi, int strength) const;
 
 	Stream *stream_;
 	std::vector<std::string> blur_labels_;
-	std::string blur_type_ = "pixelate"; // "pixelate", "gaussian", "median"
-	int blur_strength_ = 0; // 0 = auto, otherwise block size for pixelate or kernel size for blur
+	std::string blur_type_ = "pixelate"; // "pixelate", "gaussian", "median", "box"
+	int blur_strength_ = 0; // 0 = auto, otherwise block size for pixelate, kernel size for blur, radius for box
 	int gaussian_sigma_ = 0; // 0 = auto for gaussian blur
+	int box_passes_ = 3; // repeated box blurs approach a Gaussian
 	bool expand_box_ = false; // expand bounding box before blurring
 	int expand_pixels_ = 0; // pixels to expand box by
 };
 
 #define NAME "object_blur"
 
+// Largest box radius, which keeps the running sums within 16 bits.
+static constexpr int MAX_BOX_RADIUS = 127;
+
+// Box blur the rows of src into dest, clamping at the ends of each row. A running sum makes the cost per
+// pixel the same whatever the radius, and the division is a 16 bit fixed point multiply.
+
+static void box_rows(uint8_t *dest, uint8_t const *src, int width, int height, int radius)
+{
+	unsigned int mul = (65536 + radius) / (2 * radius + 1);
+	for (int y = 0; y < height; y++, src += width, dest += width)
+	{
+		unsigned int sum = (radius + 1) * src[0];
+		for (int k = 1; k <= radius; k++)
+			sum += src[std::min(k, width - 1)];
+		for (int x = 0; x < width; x++)
+		{
+			dest[x] = (sum * mul + 32768) >> 16;
+			sum += src[std::min(x + radius + 1, width - 1)] - src[std::max(x - radius, 0)];
+		}
+	}
+}
+
+// The same down the columns, where a whole row of sums is updated together, so this is where NEON helps.
+
+static void box_cols(uint8_t *dest, uint8_t const *src, int width, int height, int radius,
+					 std::vector<uint16_t> &sums)
+{
+	uint16_t mul = (65536 + radius) / (2 * radius + 1);
+	sums.assign(width, 0);
+	for (int k = -radius; k <= radius; k++)
+	{
+		uint8_t const *row = src + std::clamp(k, 0, height - 1) * width;
+		for (int x = 0; x < width; x++)
+			sums[x] += row[x];
+	}
+
+	for (int y = 0; y < height; y++, dest += width)
+	{
+		uint8_t const *add = src + std::min(y + radius + 1, height - 1) * width;
+		uint8_t const *sub = src + std::max(y - radius, 0) * width;
+		int x = 0;
+#if defined(__ARM_NEON)
+		uint16x4_t mul4 = vdup_n_u16(mul);
+		for (; x + 8 <= width; x += 8)
+		{
+			uint16x8_t sum = vld1q_u16(&sums[x]);
+			uint16x4_t lo = vrshrn_n_u32(vmull_u16(vget_low_u16(sum), mul4), 16);
+			uint16x4_t hi = vrshrn_n_u32(vmull_u16(vget_high_u16(sum), mul4), 16);
+			vst1_u8(dest + x, vmovn_u16(vcombine_u16(lo, hi)));
+			vst1q_u16(&sums[x], vsubw_u8(vaddw_u8(sum, vld1_u8(add + x)), vld1_u8(sub + x)));
+		}
+#endif
+		for (; x < width; x++)
+		{
+			dest[x] = ((unsigned int)sums[x] * mul + 32768) >> 16;
+			sums[x] += add[x] - sub[x];
+		}
+	}
+}
+
+// Blur roi by repeated box blurs of the given radius. The pixels round it are read as far as the blur can
+// reach, and only the roi itself is written back.
+
+static void box_blur(Mat &plane, Rect const &roi, int radius, int passes)
+{
+	int reach = radius * passes;
+	Rect padded = Rect(roi.x - reach, roi.y - reach, roi.width + 2 * reach, roi.height + 2 * reach) &
+				  Rect(0, 0, plane.cols, plane.rows);
+	Mat a, b(padded.size(), CV_8U);
+	plane(padded).copyTo(a);
+	std::vector<uint16_t> sums;
+	for (int i = 0; i < passes; i++)
+	{
+		box_rows(b.data, a.data, a.cols, a.rows, radius);
+		box_cols(a.data, b.data, a.cols, a.rows, radius, sums);
+	}
+	a(roi - padded.tl()).copyTo(plane(roi));
+}
+
+// Run fn(i) for i in [0, n), spreading them over as many threads as we have cores, the calling thread
+// included.
+
+template <typename F>
+static void for_each_task(int n, F const &fn)
+{
+	std::atomic<int> next = 0;
+	auto worker = [&]() {
+		int i;
+		while ((i = next.fetch_add(1)) < n)
+			fn(i);
+	};
+	int num_threads = std::min<int>(n, std::max(1u, std::thread::hardware_concurrency()));
+	std::vector<std::thread> threads;
+	for (int i = 1; i < num_threads; i++)
+		threads.emplace_back(worker);
+	worker();
+	for (auto &thread : threads)
+		thread.join();
+}
+
 char const *ObjectBlurStage::Name() const
 {
 	return NAME;
@@ -76,6 +189,7 @@ void ObjectBlurStage::Read(boost::property_tree::ptree const &params)
 	blur_type_ = params.get<std::string>("blur_type", "pixelate");
 	blur_strength_ = params.get<int>("blur_strength", 0);
 	gaussian_sigma_ = params.get<int>("gaussian_sigma", 0);
+	box_passes_ = std::max(1, params.get<int>("box_passes", 3));
 	expand_box_ = params.get<bool>("expand_box", false);
 	expand_pixels_ = params.get<int>("expand_pixels", 0);
 	
@@ -93,105 +207,182 @@ void ObjectBlurStage::Configure()
 	stream_ = app_->GetMainStream();
 }
 
+// The strength to use for a region of the given width.
+
+int ObjectBlurStage::strength(int width) const
+{
+	int s = blur_strength_;
+	if (blur_type_ == "gaussian" || blur_type_ == "median")
+	{
+		if (s == 0)
+			s = std::max(5, std::min(51, width / 10));
+		// Kernel size must be odd
+		s |= 1;
+	}
+	else if (blur_type_ == "box")
+	{
+		if (s == 0)
+			s = std::max(2, std::min(24, width / 30));
+		s = std::min(s, MAX_BOX_RADIUS);
+	}
+	else if (s == 0) // pixelate
+	{
+		// Auto-calculate based on bounding box size
+		s = std::max(8, std::min(32, width / 15));
+	}
+	return std::max(1, s);
+}
+
+// The strength that matches it in the half resolution chroma planes.
+
+int ObjectBlurStage::chromaStrength(int strength) const
+{
+	int s = std::max(1, strength / 2);
+	if (blur_type_ == "gaussian" || blur_type_ == "median")
+		s |= 1;
+	return s;
+}
+
+// How far outside a region its blur reads.
+
+int ObjectBlurStage::reach(int strength) const
+{
+	if (blur_type_ == "gaussian" || blur_type_ == "median")
+		return strength / 2;
+	else if (blur_type_ == "box")
+		return strength * box_passes_;
+	return 0;
+}
+
+void ObjectBlurStage::blurRegion(Mat &plane, Rect const &roi, int strength) const
+{
+	Mat region = plane(roi);
+
+	if (blur_type_ == "gaussian")
+	{
+		double sigma = gaussian_sigma_;
+		if (sigma == 0)
+			sigma = strength / 6.0;
+		GaussianBlur(region, region, Size(strength, strength), sigma);
+	}
+	else if (blur_type_ == "median")
+		medianBlur(region, region, strength);
+	else if (blur_type_ == "box")
+		box_blur(plane, roi, strength, box_passes_);
+	else // pixelate (default)
+	{
+		int small_width = std::max(1, roi.width / strength);
+		int small_height = std::max(1, roi.height / strength);
+
+		Mat small;
+		resize(region, small, Size(small_width, small_height), 0, 0, INTER_LINEAR);
+		resize(small, region, Size(roi.width, roi.height), 0, 0, INTER_NEAREST);
+	}
+}
+
 bool ObjectBlurStage::Process(CompletedRequestPtr &completed_request)
 {
 	if (!stream_ || blur_labels_.empty())
 		return false;
 
 	std::vector<Detection> detections;
-	completed_request->post_process_metadata.Get("object_detect.results", detections);
+	completed_request->post_process_metadata.Get(OBJECT_DETECT_RESULTS, detections);
 
 	if (detections.empty())
 		return false;
 
-	BufferWriteSync w(app_, completed_request->buffers[stream_]);
-	libcamera::Span<uint8_t> buffer = w.Get()[0];
 	StreamInfo info = app_->GetStreamInfo(stream_);
+	Rect image_rect(0, 0, info.width, info.height);
 
-	Mat image(info.height, info.width, CV_8U, (uint32_t *)buffer.data(), info.stride);
-
-	int blurred_count = 0;
+	std::vector<Rect> rois;
 	for (auto &detection : detections)
 	{
-		if (shouldBlurObject(detection.name))
-		{
-			Rect roi(detection.box.x, detection.box.y, detection.box.width, detection.box.height);
-			
-			// Optional: expand bounding box
-			if (expand_box_ || expand_pixels_ > 0)
-			{
-				int expand = expand_pixels_ > 0 ? expand_pixels_ : std::max(10, (int)(roi.width * 0.1));
-				roi.x -= expand;
-				roi.y -= expand;
-				roi.width += 2 * expand;
-				roi.height += 2 * expand;
-			}
+		if (!shouldBlurObject(detection.name))
+			continue;
+
+		Rect roi(detection.box.x, detection.box.y, detection.box.width, detection.box.height);
 			
-			// Clamp to image bounds
-			roi.x = std::max(0, roi.x);
-			roi.y = std::max(0, roi.y);
-			roi.width = std::min(roi.width, (int)info.width - roi.x);
-			roi.height = std::min(roi.height, (int)info.height - roi.y);
+		// Optional: expand bounding box
+		if (expand_box_ || expand_pixels_ > 0)
+		{
+			int expand = expand_pixels_ > 0 ? expand_pixels_ : std::max(10, (int)(roi.width * 0.1));
+			roi.x -= expand;
+			roi.y -= expand;
+			roi.width += 2 * expand;
+			roi.height += 2 * expand;
+		}
+
+		// Clamp to image bounds
+		roi &= image_rect;
+		if (roi.width > 0 && roi.height > 0)
+			rois.push_back(roi);
+	}
+
+	if (rois.empty())
+		return false;
 
-			if (roi.width > 0 && roi.height > 0)
+	// Merge regions that overlap, or come close enough that one's blur would read what the other writes.
+	// That blurs each pixel once, even in a crowd, and leaves the regions independent so that they can be
+	// done in parallel. The margin allows for the chroma planes rounding differently.
+	for (bool merged = true; merged;)
+	{
+		merged = false;
+		for (unsigned int i = 0; i < rois.size() && !merged; i++)
+		{
+			for (unsigned int j = i + 1; j < rois.size() && !merged; j++)
 			{
-				Mat region = image(roi);
-				
-				if (blur_type_ == "gaussian")
-				{
-					// Gaussian blur
-					int kernel_size = blur_strength_;
-					if (kernel_size == 0)
-						kernel_size = std::max(5, std::min(51, (int)(roi.width / 10)));
-					
-					// Kernel size must be odd
-					if (kernel_size % 2 == 0)
-						kernel_size++;
-					
-					double sigma = gaussian_sigma_;
-					if (sigma == 0)
-						sigma = kernel_size / 6.0;
-					
-					GaussianBlur(region, region, Size(kernel_size, kernel_size), sigma);
-				}
-				else if (blur_type_ == "median")
-				{
-					// Median blur
-					int kernel_size = blur_strength_;
-					if (kernel_size == 0)
-						kernel_size = std::max(5, std::min(51, (int)(roi.width / 10)));
-					
-					// Kernel size must be odd
-					if (kernel_size % 2 == 0)
-						kernel_size++;
-					
-					medianBlur(region, region, kernel_size);
-				}
-				else // pixelate (default)
+				int margin = std::max(reach(strength(rois[i].width)), reach(strength(rois[j].width))) + 2;
+				Rect padded(rois[i].x - margin, rois[i].y - margin, rois[i].width + 2 * margin,
+							rois[i].height + 2 * margin);
+				if ((padded & rois[j]).area() > 0)
 				{
-					// Pixelation effect
-					int block_size = blur_strength_;
-					if (block_size == 0)
-					{
-						// Auto-calculate based on bounding box size
-						block_size = std::max(8, std::min(32, (int)(roi.width / 15)));
-					}
-					
-					int small_width = std::max(1, roi.width / block_size);
-					int small_height = std::max(1, roi.height / block_size);
-					
-					Mat small;
-					resize(region, small, Size(small_width, small_height), 0, 0, INTER_LINEAR);
-					resize(small, region, Size(roi.width, roi.height), 0, 0, INTER_NEAREST);
+					rois[i] |= rois[j];
+					rois.erase(rois.begin() + j);
+					merged = true;
 				}
-				
-				blurred_count++;
 			}
 		}
 	}
 
-	if (blurred_count > 0)
-		LOG(2, "ObjectBlur: Blurred " << blurred_count << " objects");
+	BufferWriteSync w(app_, completed_request->buffers[stream_]);
+	libcamera::Span<uint8_t> buffer = w.Get()[0];
+	uint8_t *ptr = buffer.data();
+
+	// Blur the colour too, when we know where it is, or it gives away more than it should. Each plane of
+	// each region is a separate task, largest first so that they balance out across the threads.
+	struct Task
+	{
+		Mat plane;
+		Rect roi;
+		int strength;
+	};
+	std::vector<Task> tasks;
+	Mat y_plane(info.height, info.width, CV_8U, ptr, info.stride);
+	for (auto const &roi : rois)
+		tasks.push_back({ y_plane, roi, strength(roi.width) });
+	if (info.pixel_format == libcamera::formats::YUV420)
+	{
+		int stride2 = info.stride / 2;
+		uint8_t *u = ptr + info.stride * info.height;
+		uint8_t *v = u + stride2 * (info.height / 2);
+		Mat u_plane(info.height / 2, info.width / 2, CV_8U, u, stride2);
+		Mat v_plane(info.height / 2, info.width / 2, CV_8U, v, stride2);
+		for (auto const &roi : rois)
+		{
+			Rect roi2 = Rect(roi.x / 2, roi.y / 2, (roi.x + roi.width + 1) / 2 - roi.x / 2,
+							 (roi.y + roi.height + 1) / 2 - roi.y / 2) &
+						Rect(0, 0, u_plane.cols, u_plane.rows);
+			int s = chromaStrength(strength(roi.width));
+			tasks.push_back({ u_plane, roi2, s });
+			tasks.push_back({ v_plane, roi2, s });
+		}
+	}
+	std::sort(tasks.begin(), tasks.end(),
+			  [](Task const &a, Task const &b) { return a.roi.area() > b.roi.area(); });
+
+	for_each_task(tasks.size(), [&](int i) { blurRegion(tasks[i].plane, tasks[i].roi, tasks[i].strength); });
+
+	LOG(2, "ObjectBlur: Blurred " << rois.size() << " regions");
 
 	return false;
 }
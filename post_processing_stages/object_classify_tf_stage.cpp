@@ -5,8 +5,20 @@
  * object_classify_tf_stage.cpp - object classifier
  */
 
+#include <algorithm>
+#include <cstring>
+
+#include "core/memory_account.hpp"
+
+#include "object_detect.hpp"
 #include "tf_stage.hpp"
 
+// Normally the stage classifies the whole lores image. With "classify_detections", it instead classifies each
+// of the (up to "max_objects" most confident) objects that an earlier object_detect stage found, cropping each
+// one's box, widened by "crop_margin" on each side, and scaling it to the model's input size. They all go to
+// the model as one batch, sized once for max_objects, if it lets us resize its input, or one at a time
+// otherwise, and objects whose best label reaches threshold_high are published as "object_classify.objects".
+
 struct ObjectClassifyTfConfig : public TfConfig
 {
 	int number_of_results;
@@ -14,6 +26,9 @@ struct ObjectClassifyTfConfig : public TfConfig
 	float threshold_high;
 	float threshold_low;
 	bool display_labels;
+	bool classify_detections;
+	unsigned int max_objects;
+	float crop_margin;
 };
 
 #define NAME "object_classify_tf"
@@ -34,6 +49,10 @@ protected:
 	// Read the label file, plus some confidence thresholds.
 	void readExtras(boost::property_tree::ptree const &params) override;
 
+	// With classify_detections, crop out the detected objects and classify those instead.
+	void prepareInput(CompletedRequestPtr &completed_request, uint8_t const *lores) override;
+	void runModel() override;
+
 	// Retrieve the top-n most likely results.
 	void interpretOutputs() override;
 
@@ -44,19 +63,47 @@ protected:
 private:
 	void readLabelsFile(const std::string &file_name);
 	void getTopResults(uint8_t *prediction, int prediction_size, size_t num_results);
+	void resizeBatch(unsigned int n);
+	void fillInput(uint8_t const *rgb, size_t size);
+	void interpretObjects();
 
 	std::vector<std::pair<std::string, float>> output_results_;
 	std::vector<std::string> labels_;
 	size_t label_count_;
 	std::vector<std::pair<float, int>> top_results_;
+
+	// For classify_detections. The crops and detections are only touched by the inference thread while it's
+	// running, and by prepareInput in between.
+	std::vector<uint8_t> crops_;
+	std::vector<Detection> crop_objects_;
+	std::vector<uint8_t> scores_; // label_count_ for each object
+	std::vector<Detection> objects_;
+	unsigned int batch_ = 1; // images per invoke of the model
 };
 
+// Copy the crop of an RGB image, scaled to the destination size, by nearest neighbour.
+
+static void crop_rgb(uint8_t *dst, uint8_t const *src, StreamInfo const &src_info, libcamera::Rectangle const &crop,
+					 StreamInfo const &dst_info)
+{
+	for (unsigned int y = 0; y < dst_info.height; y++)
+	{
+		uint8_t const *row = src + (crop.y + (2 * y + 1) * crop.height / (2 * dst_info.height)) * src_info.stride;
+		for (unsigned int x = 0; x < dst_info.width; x++)
+			memcpy(dst + y * dst_info.stride + x * 3, row + (crop.x + (2 * x + 1) * crop.width / (2 * dst_info.width)) * 3,
+				   3);
+	}
+}
+
 void ObjectClassifyTfStage::readExtras(boost::property_tree::ptree const &params)
 {
 	config()->number_of_results = params.get<int>("number_of_results", 3);
 	config()->threshold_high = params.get<float>("threshold_high", 0.2f);
 	config()->threshold_low = params.get<float>("threshold_low", 0.1f);
 	config()->display_labels = params.get<int>("display_labels", 1);
+	config()->classify_detections = params.get<int>("classify_detections", 0);
+	config()->max_objects = std::max(params.get<unsigned int>("max_objects", 8), 1u);
+	config()->crop_margin = params.get<float>("crop_margin", 0.1f);
 
 	std::string labels_file = params.get<std::string>("labels_file", "/home/pi/models/labels.txt");
 	readLabelsFile(labels_file);
@@ -67,6 +114,9 @@ void ObjectClassifyTfStage::readExtras(boost::property_tree::ptree const &params
 	// Causes might include loading the wrong model, or the wrong labels file.
 	if (output_dims->data[output_dims->size - 1] != static_cast<int>(label_count_))
 		throw std::runtime_error("ObjectClassifyTfStage: Label count mismatch");
+
+	if (config()->classify_detections)
+		resizeBatch(config()->max_objects);
 }
 
 void ObjectClassifyTfStage::readLabelsFile(const std::string &file_name)
@@ -89,6 +139,8 @@ void ObjectClassifyTfStage::readLabelsFile(const std::string &file_name)
 void ObjectClassifyTfStage::applyResults(CompletedRequestPtr &completed_request)
 {
 	completed_request->post_process_metadata.Set("object_classify.results", output_results_);
+	if (config()->classify_detections)
+		completed_request->post_process_metadata.Set(OBJECT_CLASSIFY_OBJECTS, objects_);
 
 	if (config()->display_labels)
 	{
@@ -109,12 +161,151 @@ void ObjectClassifyTfStage::applyResults(CompletedRequestPtr &completed_request)
 			first = false;
 		}
 
-		completed_request->post_process_metadata.Set("annotate.text", annotation.str());
+		completed_request->post_process_metadata.Set(ANNOTATE_TEXT, annotation.str());
+	}
+}
+
+void ObjectClassifyTfStage::prepareInput(CompletedRequestPtr &completed_request, uint8_t const *lores)
+{
+	if (!config()->classify_detections)
+		return TfStage::prepareInput(completed_request, lores);
+
+	crop_objects_.clear();
+	completed_request->post_process_metadata.Get(OBJECT_DETECT_RESULTS, crop_objects_);
+	std::stable_sort(crop_objects_.begin(), crop_objects_.end(),
+					 [](Detection const &a, Detection const &b) { return a.confidence > b.confidence; });
+	if (crop_objects_.size() > config()->max_objects)
+		crop_objects_.resize(config()->max_objects);
+
+	StreamInfo tf_info;
+	tf_info.width = tf_w_, tf_info.height = tf_h_, tf_info.stride = tf_w_ * 3;
+	size_t image_size = tf_info.height * tf_info.stride;
+	if (crops_.size() != crop_objects_.size() * image_size)
+	{
+		crops_.resize(crop_objects_.size() * image_size);
+		MemoryAccount::Set(app_->GetOptions()->Get().camera, "stage.object_classify_tf.crops", MemoryPool::System,
+						   crops_.capacity(), crop_objects_.size());
+	}
+
+	// The boxes are in main stream coordinates.
+	unsigned int main_w = main_stream_ ? main_stream_info_.width : lores_info_.width;
+	unsigned int main_h = main_stream_ ? main_stream_info_.height : lores_info_.height;
+	for (unsigned int i = 0; i < crop_objects_.size(); i++)
+	{
+		libcamera::Rectangle const &box = crop_objects_[i].box;
+		int margin_x = box.width * config()->crop_margin, margin_y = box.height * config()->crop_margin;
+		int x0 = std::clamp<int>((int64_t)(box.x - margin_x) * lores_info_.width / main_w, 0, lores_info_.width - 1);
+		int y0 = std::clamp<int>((int64_t)(box.y - margin_y) * lores_info_.height / main_h, 0, lores_info_.height - 1);
+		int x1 = std::clamp<int>((int64_t)(box.x + box.width + margin_x) * lores_info_.width / main_w, x0 + 1,
+								 lores_info_.width);
+		int y1 = std::clamp<int>((int64_t)(box.y + box.height + margin_y) * lores_info_.height / main_h, y0 + 1,
+								 lores_info_.height);
+		libcamera::Rectangle crop(x0, y0, x1 - x0, y1 - y0);
+
+		uint8_t *dst = crops_.data() + i * image_size;
+		if (lores_info_.pixel_format == libcamera::formats::BGR888)
+			crop_rgb(dst, lores, lores_info_, crop, tf_info);
+		else
+			Yuv420ToRgbScaled(dst, lores, lores_info_, crop, tf_info, true);
+	}
+}
+
+void ObjectClassifyTfStage::runModel()
+{
+	if (!config()->classify_detections)
+		return TfStage::runModel();
+
+	unsigned int n = crop_objects_.size();
+	size_t image_size = tf_w_ * tf_h_ * 3;
+	scores_.clear();
+	if (!n)
+		return;
+
+	// Any places in the batch beyond the objects we have are left with whatever they had, and ignored.
+	for (unsigned int first = 0; first < n; first += batch_)
+	{
+		unsigned int count = std::min(batch_, n - first);
+		fillInput(crops_.data() + first * image_size, count * image_size);
+		if (interpreter_->Invoke() != kTfLiteOk)
+			throw std::runtime_error("ObjectClassifyTfStage: Failed to invoke TFLite");
+		uint8_t const *scores = interpreter_->typed_output_tensor<uint8_t>(0);
+		scores_.insert(scores_.end(), scores, scores + count * label_count_);
+	}
+}
+
+// Give the model a batch of n images, which happens just the once, as reallocating the tensors isn't cheap. Not
+// every model lets us, in which case it goes back to one image, and we classify the objects one at a time.
+
+void ObjectClassifyTfStage::resizeBatch(unsigned int n)
+{
+	int input = interpreter_->inputs()[0];
+	TfLiteIntArray const *dims = interpreter_->tensor(input)->dims;
+	std::vector<int> shape(dims->data, dims->data + dims->size);
+
+	shape[0] = n;
+	if (interpreter_->ResizeInputTensor(input, shape) == kTfLiteOk && interpreter_->AllocateTensors() == kTfLiteOk &&
+		interpreter_->tensor(interpreter_->outputs()[0])->dims->data[0] == static_cast<int>(n))
+	{
+		batch_ = n;
+		return;
+	}
+
+	LOG(1, "ObjectClassifyTfStage: model won't take a batch, classifying objects one at a time");
+	batch_ = 1;
+	shape[0] = 1;
+	if (interpreter_->ResizeInputTensor(input, shape) != kTfLiteOk || interpreter_->AllocateTensors() != kTfLiteOk)
+		throw std::runtime_error("ObjectClassifyTfStage: Failed to restore the input tensor");
+}
+
+void ObjectClassifyTfStage::fillInput(uint8_t const *rgb, size_t size)
+{
+	int input = interpreter_->inputs()[0];
+	if (interpreter_->tensor(input)->type == kTfLiteUInt8)
+		memcpy(interpreter_->typed_tensor<uint8_t>(input), rgb, size);
+	else
+	{
+		float *tensor = interpreter_->typed_tensor<float>(input);
+		for (size_t i = 0; i < size; i++)
+			tensor[i] = (rgb[i] - config_->normalisation_offset) / config_->normalisation_scale;
+	}
+}
+
+// Each object gets its single most likely label.
+
+void ObjectClassifyTfStage::interpretObjects()
+{
+	objects_.clear();
+	output_results_.clear();
+
+	for (unsigned int i = 0; i < crop_objects_.size() && (i + 1) * label_count_ <= scores_.size(); i++)
+	{
+		uint8_t const *scores = &scores_[i * label_count_];
+		unsigned int best = std::max_element(scores, scores + label_count_) - scores;
+		float confidence = scores[best] / 255.0;
+		if (confidence < config()->threshold_high)
+			continue;
+
+		Detection object = crop_objects_[i];
+		object.category = best;
+		object.name = labels_[best];
+		object.confidence = confidence;
+		objects_.push_back(object);
+		output_results_.push_back(std::make_pair(labels_[best], confidence));
+	}
+
+	if (config_->verbose)
+	{
+		for (const auto &object : objects_)
+			LOG(1, object.toString());
+		LOG(1, "");
 	}
 }
 
 void ObjectClassifyTfStage::interpretOutputs()
 {
+	if (config()->classify_detections)
+		return interpretObjects();
+
 	int output = interpreter_->outputs()[0];
 	TfLiteIntArray *output_dims = interpreter_->tensor(output)->dims;
 	// assume output dims to be something like (1, 1, ... ,size)
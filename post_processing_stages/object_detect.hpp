@@ -8,9 +8,12 @@
 #pragma once
 
 #include <sstream>
+#include <vector>
 
 #include <libcamera/geometry.h>
 
+#include "core/metadata.hpp"
+
 struct Detection
 {
 	Detection(int c, const std::string &n, float conf, int x, int y, int w, int h)
@@ -30,3 +33,7 @@ struct Detection
 		return output.str();
 	}
 };
+
+inline const MetadataKey<std::vector<Detection>> OBJECT_DETECT_RESULTS("object_detect.results");
+// The detections that object_classify_tf has given its own labels to.
+inline const MetadataKey<std::vector<Detection>> OBJECT_CLASSIFY_OBJECTS("object_classify.objects");
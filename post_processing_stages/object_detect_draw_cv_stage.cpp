@@ -7,6 +7,7 @@
 
 #include "opencv2/imgproc.hpp"
 
+#include "core/overlay.hpp"
 #include "core/rpicam_app.hpp"
 
 #include "post_processing_stages/post_processing_stage.hpp"
@@ -35,6 +36,8 @@ private:
 	Stream *stream_;
 	int line_thickness_;
 	double font_size_;
+	bool overlay_requested_;
+	bool overlay_;
 };
 
 #define NAME "object_detect_draw_cv"
@@ -47,12 +50,18 @@ char const *ObjectDetectDrawCvStage::Name() const
 void ObjectDetectDrawCvStage::Configure()
 {
 	stream_ = app_->GetMainStream();
+	overlay_ = overlay_requested_ && app_->PreviewSupportsOverlay();
+	if (overlay_requested_ && !overlay_)
+		LOG(1, "ObjectDetectDrawCv: preview can't draw overlays, drawing into the image instead");
 }
 
 void ObjectDetectDrawCvStage::Read(boost::property_tree::ptree const &params)
 {
 	line_thickness_ = params.get<int>("line_thickness", 1);
 	font_size_ = params.get<double>("font_size", 1.0);
+	// Leave the boxes to the preview window, if it can draw them. They then won't appear in any recording, and
+	// the labels aren't shown.
+	overlay_requested_ = params.get<int>("overlay", 0);
 }
 
 bool ObjectDetectDrawCvStage::Process(CompletedRequestPtr &completed_request)
@@ -60,14 +69,27 @@ bool ObjectDetectDrawCvStage::Process(CompletedRequestPtr &completed_request)
 	if (!stream_)
 		return false;
 
-	BufferWriteSync w(app_, completed_request->buffers[stream_]);
-	libcamera::Span<uint8_t> buffer = w.Get()[0];
-	uint32_t *ptr = (uint32_t *)buffer.data();
 	StreamInfo info = app_->GetStreamInfo(stream_);
-
 	std::vector<Detection> detections;
 
-	completed_request->post_process_metadata.Get("object_detect.results", detections);
+	completed_request->post_process_metadata.Get(OBJECT_DETECT_RESULTS, detections);
+
+	if (overlay_)
+	{
+		std::vector<OverlayShape> shapes;
+		for (auto &detection : detections)
+		{
+			auto const &box = detection.box;
+			shapes.push_back({ OverlayShape::Rect, (float)box.x, (float)box.y, (float)(box.x + box.width),
+							   (float)(box.y + box.height), 0xffffff, (unsigned int)line_thickness_ });
+		}
+		AppendOverlay(completed_request->post_process_metadata, info.width, info.height, shapes);
+		return false;
+	}
+
+	BufferWriteSync w(app_, completed_request->buffers[stream_]);
+	libcamera::Span<uint8_t> buffer = w.Get()[0];
+	uint32_t *ptr = (uint32_t *)buffer.data();
 
 	Mat image(info.height, info.width, CV_8U, ptr, info.stride);
 	Scalar colour = Scalar(255, 255, 255);
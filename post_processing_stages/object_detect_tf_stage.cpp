@@ -94,7 +94,7 @@ void ObjectDetectTfStage::checkConfiguration()
 
 void ObjectDetectTfStage::applyResults(CompletedRequestPtr &completed_request)
 {
-	completed_request->post_process_metadata.Set("object_detect.results", output_results_);
+	completed_request->post_process_metadata.Set(OBJECT_DETECT_RESULTS, output_results_);
 }
 
 static unsigned int area(const Rectangle &r)
@@ -124,10 +124,20 @@ void ObjectDetectTfStage::interpretOutputs()
 		int x = std::clamp<int>(WIDTH * boxes[i * 4 + 1], 0, WIDTH);
 		int h = std::clamp<int>(HEIGHT * boxes[i * 4 + 2] - y, 0, HEIGHT);
 		int w = std::clamp<int>(WIDTH * boxes[i * 4 + 3] - x, 0, WIDTH);
-		// The network is fed a crop from the lores (if that was too large), so the coords
-		// in the full lores image are:
-		y += (lores_info_.height - HEIGHT) / 2;
-		x += (lores_info_.width - WIDTH) / 2;
+		// The network is fed either a scaled copy of the lores, or a crop from it (if that
+		// was too large), so the coords in the full lores image are:
+		if (config()->scale_input)
+		{
+			y = y * lores_info_.height / HEIGHT;
+			x = x * lores_info_.width / WIDTH;
+			h = h * lores_info_.height / HEIGHT;
+			w = w * lores_info_.width / WIDTH;
+		}
+		else
+		{
+			y += (lores_info_.height - HEIGHT) / 2;
+			x += (lores_info_.width - WIDTH) / 2;
+		}
 		// The lores is a pure scaling of the main image (squishing if the aspect ratios
 		// don't match), so:
 		y = y * main_stream_info_.height / lores_info_.height;
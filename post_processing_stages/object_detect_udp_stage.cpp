@@ -11,7 +11,10 @@
 
 #include "object_detect.hpp"
 
+#include <algorithm>
 #include <array>
+#include <chrono>
+#include <cstring>
 #include <string>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -32,6 +35,18 @@ constexpr static uint32_t START_DELIMITER = 0xDDCCBBAA; // little-endian represe
 #define UDP_IP "127.0.0.1"
 #define UDP_PORT 12347
 
+// The "packed" format batches whole frames into each datagram, all little endian:
+//   header:    u32 magic "RPOD", u8 version, u8 frame count, u16 reserved, u32 camera id, u32 datagram sequence
+//   frame:     u32 frame sequence, u64 sensor timestamp (ns), u8 flags, u8 detection count
+//   detection: u16 x, y, width, height, u16 confidence (0-65535), u16 category, u8 name length, name bytes
+// A frame flagged UNCHANGED carries no detections, meaning they are the same as in that camera's last frame.
+constexpr static uint32_t PACKED_MAGIC = 0x444f5052; // "RPOD"
+constexpr static uint8_t PACKED_VERSION = 1;
+constexpr static size_t PACKED_HEADER_SIZE = 16;
+constexpr static size_t PACKED_FRAME_SIZE = 14;
+constexpr static size_t PACKED_DETECTION_SIZE = 13;
+constexpr static uint8_t FRAME_UNCHANGED = 1;
+
 class ObjectDetectUDPStage : public PostProcessingStage
 {
 public:
@@ -45,14 +60,42 @@ public:
 	
 	bool Process(CompletedRequestPtr &completed_request) override;
 
+	void Stop() override;
+
 	virtual ~ObjectDetectUDPStage() override;
 	
 private:
+	void sendLegacy(std::vector<Detection> const &detections);
+	void addFrame(CompletedRequestPtr &completed_request, std::vector<Detection> const &detections);
+	void flush();
+
+	template <typename T>
+	void put(T value)
+	{
+		std::memcpy(packet_.data() + packet_size_, &value, sizeof(T));
+		packet_size_ += sizeof(T);
+	}
+
 	Stream *stream_;
 	std::string udp_broadcast_address = "127.0.0.1";
 	u_int16_t udp_broadcast_port = 12345;
 	int sockfd_;
 	struct sockaddr_in servaddr_;
+
+	// For the packed format.
+	bool packed_ = false;
+	uint32_t camera_id_ = 0;
+	unsigned int batch_frames_ = 1;
+	std::chrono::microseconds max_latency_ { 0 };
+	bool delta_ = false;
+	unsigned int keyframe_interval_ = 30;
+	std::vector<uint8_t> packet_; // allocated once, at the maximum datagram size
+	size_t packet_size_ = 0;
+	unsigned int packet_frames_ = 0;
+	uint32_t packet_sequence_ = 0;
+	std::chrono::steady_clock::time_point packet_start_;
+	std::vector<Detection> last_sent_;
+	unsigned int frames_since_full_ = 0;
 };
 
 #define NAME "object_detect_udp"
@@ -65,6 +108,7 @@ char const *ObjectDetectUDPStage::Name() const
 
 ObjectDetectUDPStage::~ObjectDetectUDPStage()
 {
+	flush();
 	if (sockfd_ != -1)
 	{
 		close(sockfd_);
@@ -107,6 +151,20 @@ void ObjectDetectUDPStage::Read(boost::property_tree::ptree const &params)
 {
 	udp_broadcast_address = params.get<std::string>("ip", UDP_IP);
 	udp_broadcast_port = params.get<u_int16_t>("port", UDP_PORT);
+
+	std::string format = params.get<std::string>("format", "legacy");
+	if (format != "legacy" && format != "packed")
+		throw std::runtime_error("ObjectDetectUDPStage: unknown format " + format);
+	packed_ = format == "packed";
+	camera_id_ = params.get<uint32_t>("camera_id", 0);
+	batch_frames_ = std::clamp(params.get<unsigned int>("batch_frames", 1), 1u, 255u);
+	max_latency_ = std::chrono::microseconds((int64_t)(params.get<double>("max_latency_ms", 0) * 1000));
+	delta_ = params.get<bool>("delta", false);
+	keyframe_interval_ = params.get<unsigned int>("keyframe_interval", 30);
+	size_t max_datagram = params.get<size_t>("max_datagram", 1400);
+	if (max_datagram < PACKED_HEADER_SIZE + PACKED_FRAME_SIZE + PACKED_DETECTION_SIZE + 255)
+		throw std::runtime_error("ObjectDetectUDPStage: max_datagram too small");
+	packet_.resize(max_datagram);
 }
 
 template <typename T>
@@ -124,12 +182,27 @@ bool ObjectDetectUDPStage::Process(CompletedRequestPtr &completed_request)
 		return false;
 
 	std::vector<Detection> detections;
-	completed_request->post_process_metadata.Get("object_detect.results", detections);
+	completed_request->post_process_metadata.Get(OBJECT_DETECT_RESULTS, detections);
 
 	if (sockfd_ == -1)
 		return false;
 
-	for (auto &detection : detections)
+	if (packed_)
+		addFrame(completed_request, detections);
+	else
+		sendLegacy(detections);
+
+	return false;
+}
+
+void ObjectDetectUDPStage::Stop()
+{
+	flush();
+}
+
+void ObjectDetectUDPStage::sendLegacy(std::vector<Detection> const &detections)
+{
+	for (auto const &detection : detections)
 	{
 		// Draw rectangle and text on the image
 		std::stringstream text_stream;
@@ -173,7 +246,94 @@ bool ObjectDetectUDPStage::Process(CompletedRequestPtr &completed_request)
 			perror("Failed to send UDP message");
 	}
 
-	return false;
+}
+
+static bool same_detections(std::vector<Detection> const &a, std::vector<Detection> const &b)
+{
+	if (a.size() != b.size())
+		return false;
+	for (unsigned int i = 0; i < a.size(); i++)
+	{
+		if (a[i].category != b[i].category || a[i].box != b[i].box || a[i].name != b[i].name ||
+			std::abs(a[i].confidence - b[i].confidence) > 0.01)
+			return false;
+	}
+	return true;
+}
+
+void ObjectDetectUDPStage::addFrame(CompletedRequestPtr &completed_request, std::vector<Detection> const &detections)
+{
+	// Only send what changed, but everything every so often so that a receiver can pick up from anywhere.
+	bool unchanged = delta_ && frames_since_full_ + 1 < keyframe_interval_ && same_detections(detections, last_sent_);
+	unsigned int count = unchanged ? 0 : std::min<size_t>(detections.size(), 255);
+	size_t size = PACKED_FRAME_SIZE;
+	for (unsigned int i = 0; i < count; i++)
+		size += PACKED_DETECTION_SIZE + std::min<size_t>(detections[i].name.size(), 255);
+
+	if (packet_frames_ && packet_size_ + size > packet_.size())
+		flush();
+	if (!packet_frames_)
+	{
+		packet_size_ = PACKED_HEADER_SIZE;
+		packet_start_ = std::chrono::steady_clock::now();
+	}
+
+	// A frame with more detections than fit in a datagram loses the ones that don't.
+	while (count && packet_size_ + size > packet_.size())
+		size -= PACKED_DETECTION_SIZE + std::min<size_t>(detections[--count].name.size(), 255);
+
+	put<uint32_t>(completed_request->sequence);
+	put<uint64_t>(completed_request->metadata.get(libcamera::controls::SensorTimestamp).value_or(0));
+	put<uint8_t>(unchanged ? FRAME_UNCHANGED : 0);
+	put<uint8_t>(count);
+	for (unsigned int i = 0; i < count; i++)
+	{
+		Detection const &d = detections[i];
+		put<uint16_t>(std::clamp(d.box.x, 0, 65535));
+		put<uint16_t>(std::clamp(d.box.y, 0, 65535));
+		put<uint16_t>(std::min(d.box.width, 65535u));
+		put<uint16_t>(std::min(d.box.height, 65535u));
+		put<uint16_t>(std::clamp(d.confidence, 0.0f, 1.0f) * 65535);
+		put<uint16_t>(d.category);
+		uint8_t name_length = std::min<size_t>(d.name.size(), 255);
+		put<uint8_t>(name_length);
+		std::memcpy(packet_.data() + packet_size_, d.name.data(), name_length);
+		packet_size_ += name_length;
+	}
+	packet_frames_++;
+
+	if (unchanged)
+		frames_since_full_++;
+	else
+	{
+		last_sent_ = detections;
+		frames_since_full_ = 0;
+	}
+
+	// The latency bound is checked as each frame arrives, so it's only as fine as the frame interval.
+	if (packet_frames_ >= batch_frames_ ||
+		(max_latency_.count() && std::chrono::steady_clock::now() - packet_start_ >= max_latency_))
+		flush();
+}
+
+void ObjectDetectUDPStage::flush()
+{
+	if (!packet_frames_ || sockfd_ == -1)
+		return;
+
+	size_t end = packet_size_;
+	packet_size_ = 0;
+	put<uint32_t>(PACKED_MAGIC);
+	put<uint8_t>(PACKED_VERSION);
+	put<uint8_t>(packet_frames_);
+	put<uint16_t>(0);
+	put<uint32_t>(camera_id_);
+	put<uint32_t>(packet_sequence_++);
+
+	if (sendto(sockfd_, packet_.data(), end, 0, (const struct sockaddr *)&servaddr_, sizeof(servaddr_)) < 0)
+		perror("Failed to send UDP message");
+	packet_frames_ = 0;
+	packet_size_ = 0;
 }
 
 static PostProcessingStage *Create(RPiCamApp *app)
@@ -15,6 +15,7 @@
 #include <libcamera/geometry.h>
 #include <libcamera/stream.h>
 
+#include "core/overlay.hpp"
 #include "core/rpicam_app.hpp"
 
 #include "post_processing_stages/post_processing_stage.hpp"
@@ -62,10 +63,13 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
-	void drawFeatures(cv::Mat &img, std::vector<Point> locations, std::vector<float> confidences);
+	void getFeatures(std::vector<libcamera::Point> const &locations, std::vector<float> const &confidences,
+					 std::vector<OverlayShape> &shapes);
 
 	Stream *stream_;
 	float confidence_threshold_;
+	bool overlay_requested_;
+	bool overlay_;
 };
 
 #define NAME "plot_pose_cv"
@@ -78,11 +82,16 @@ char const *PlotPoseCvStage::Name() const
 void PlotPoseCvStage::Configure()
 {
 	stream_ = app_->GetMainStream();
+	overlay_ = overlay_requested_ && app_->PreviewSupportsOverlay();
+	if (overlay_requested_ && !overlay_)
+		LOG(1, "PlotPoseCv: preview can't draw overlays, drawing into the image instead");
 }
 
 void PlotPoseCvStage::Read(boost::property_tree::ptree const &params)
 {
 	confidence_threshold_ = params.get<float>("confidence_threshold", -1.0);
+	// Leave the skeletons to the preview window, if it can draw them, in which case they won't be recorded.
+	overlay_requested_ = params.get<int>("overlay", 0);
 }
 
 bool PlotPoseCvStage::Process(CompletedRequestPtr &completed_request)
@@ -90,100 +99,109 @@ bool PlotPoseCvStage::Process(CompletedRequestPtr &completed_request)
 	if (!stream_)
 		return false;
 
-	BufferWriteSync w(app_, completed_request->buffers[stream_]);
-	libcamera::Span<uint8_t> buffer = w.Get()[0];
-	uint32_t *ptr = (uint32_t *)buffer.data();
-	StreamInfo info = app_->GetStreamInfo(stream_);
-
 	std::vector<std::vector<libcamera::Point>> lib_locations;
 	std::vector<std::vector<float>> confidences;
 	completed_request->post_process_metadata.Get("pose_estimation.locations", lib_locations);
 	completed_request->post_process_metadata.Get("pose_estimation.confidences", confidences);
 
-	unsigned int i = 0;
-	for (auto const &loc : lib_locations)
+	std::vector<OverlayShape> shapes;
+	for (unsigned int i = 0; i < lib_locations.size() && i < confidences.size(); i++)
+	{
+		if (!confidences[i].empty() && !lib_locations[i].empty())
+			getFeatures(lib_locations[i], confidences[i], shapes);
+	}
+
+	StreamInfo info = app_->GetStreamInfo(stream_);
+	if (overlay_)
 	{
-		std::vector<cv::Rect> rects;
-		std::vector<Point> cv_locations;
-
-		std::vector<float> &conf = confidences[i];
-
-		if (!conf.empty() && !loc.empty())
-		{
-			Mat image(info.height, info.width, CV_8U, ptr, info.stride);
-			for (libcamera::Point lib_location : loc)
-			{
-				Point cv_location;
-				cv_location.x = lib_location.x;
-				cv_location.y = lib_location.y;
-				cv_locations.push_back(cv_location);
-			}
-			drawFeatures(image, cv_locations, conf);
-		}
+		AppendOverlay(completed_request->post_process_metadata, info.width, info.height, shapes);
+		return false;
 	}
+	if (shapes.empty())
+		return false;
+
+	BufferWriteSync w(app_, completed_request->buffers[stream_]);
+	libcamera::Span<uint8_t> buffer = w.Get()[0];
+	Mat image(info.height, info.width, CV_8U, buffer.data(), info.stride);
+	Scalar colour = Scalar(255, 255, 255);
+
+	for (auto const &shape : shapes)
+	{
+		if (shape.type == OverlayShape::Circle)
+			circle(image, Point(shape.x0, shape.y0), shape.x1, colour, shape.thickness, 8, 0);
+		else
+			line(image, Point(shape.x0, shape.y0), Point(shape.x1, shape.y1), colour, shape.thickness);
+	}
+
 	return false;
 }
 
-void PlotPoseCvStage::drawFeatures(Mat &img, std::vector<cv::Point> locations, std::vector<float> confidences)
+void PlotPoseCvStage::getFeatures(std::vector<libcamera::Point> const &locations,
+								  std::vector<float> const &confidences, std::vector<OverlayShape> &shapes)
 {
-	Scalar colour = Scalar(255, 255, 255);
-	int radius = 5;
+	auto circle = [&](int i) {
+		shapes.push_back({ OverlayShape::Circle, (float)locations[i].x, (float)locations[i].y, 5, 0, 0xffffff, 2 });
+	};
+	auto line = [&](int i, int j) {
+		shapes.push_back({ OverlayShape::Line, (float)locations[i].x, (float)locations[i].y, (float)locations[j].x,
+						   (float)locations[j].y, 0xffffff, 2 });
+	};
 
 	for (int i = 0; i < FEATURE_SIZE; i++)
 	{
 		if (confidences[i] < confidence_threshold_)
-			circle(img, locations[i], radius, colour, 2, 8, 0);
+			circle(i);
 	}
 
 	if (confidences[leftShoulder] > confidence_threshold_)
 	{
 		if (confidences[rightShoulder] > confidence_threshold_)
-			line(img, locations[leftShoulder], locations[rightShoulder], colour, 2);
+			line(leftShoulder, rightShoulder);
 
 		if (confidences[leftElbow] > confidence_threshold_)
-			line(img, locations[leftShoulder], locations[leftElbow], colour, 2);
+			line(leftShoulder, leftElbow);
 
 		if (confidences[leftHip] > confidence_threshold_)
-			line(img, locations[leftShoulder], locations[leftHip], colour, 2);
+			line(leftShoulder, leftHip);
 	}
 	if (confidences[rightShoulder] > confidence_threshold_)
 	{
 		if (confidences[rightElbow] > confidence_threshold_)
-			line(img, locations[rightShoulder], locations[rightElbow], colour, 2);
+			line(rightShoulder, rightElbow);
 
 		if (confidences[rightHip] > confidence_threshold_)
-			line(img, locations[rightShoulder], locations[rightHip], colour, 2);
+			line(rightShoulder, rightHip);
 	}
 	if (confidences[leftElbow] > confidence_threshold_)
 	{
 		if (confidences[leftWrist] > confidence_threshold_)
-			line(img, locations[leftElbow], locations[leftWrist], colour, 2);
+			line(leftElbow, leftWrist);
 	}
 	if (confidences[rightElbow] > confidence_threshold_)
 	{
 		if (confidences[rightWrist] > confidence_threshold_)
-			line(img, locations[rightElbow], locations[rightWrist], colour, 2);
+			line(rightElbow, rightWrist);
 	}
 	if (confidences[leftHip] > confidence_threshold_)
 	{
 		if (confidences[rightHip] > confidence_threshold_)
-			line(img, locations[leftHip], locations[rightHip], colour, 2);
+			line(leftHip, rightHip);
 
 		if (confidences[leftKnee] > confidence_threshold_)
-			line(img, locations[leftHip], locations[leftKnee], colour, 2);
+			line(leftHip, leftKnee);
 	}
 	if (confidences[leftKnee] > confidence_threshold_)
 	{
 		if (confidences[leftAnkle] > confidence_threshold_)
-			line(img, locations[leftKnee], locations[leftAnkle], colour, 2);
+			line(leftKnee, leftAnkle);
 	}
 	if (confidences[rightKnee] > confidence_threshold_)
 	{
 		if (confidences[rightHip] > confidence_threshold_)
-			line(img, locations[rightKnee], locations[rightHip], colour, 2);
+			line(rightKnee, rightHip);
 
 		if (confidences[rightAnkle] > confidence_threshold_)
-			line(img, locations[rightKnee], locations[rightAnkle], colour, 2);
+			line(rightKnee, rightAnkle);
 	}
 }
 
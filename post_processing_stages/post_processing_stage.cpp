@@ -5,6 +5,13 @@
  * post_processing_stage.cpp - Post processing stage base class implementation.
  */
 
+#include <algorithm>
+#include <cassert>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "post_processing_stage.hpp"
 
 PostProcessingStage::PostProcessingStage(RPiCamApp *app) : app_(app)
@@ -48,202 +55,124 @@ std::vector<uint8_t> PostProcessingStage::Yuv420ToRgb(const uint8_t *src, Stream
 	return output;
 }
 
+// The conversion uses 6-bit fixed point coefficients (1.402, 0.345, 0.714 and 1.771 scaled by 64), which
+// keeps every intermediate within 16 bits for NEON, and the scalar code gives identical answers.
+static inline uint8_t clamp_u8(int x)
+{
+	return std::clamp(x, 0, 255);
+}
+
+// Convert a row of pixels where Y, U and V each have one sample per output pixel.
+static void yuv_row_to_rgb(uint8_t *dst, const uint8_t *Y, const uint8_t *U, const uint8_t *V, unsigned int width)
+{
+	unsigned int x = 0;
+#if defined(__ARM_NEON)
+	int16x8_t offset = vdupq_n_s16(128);
+	for (; x + 8 <= width; x += 8, dst += 24)
+	{
+		int16x8_t y = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(Y + x)));
+		int16x8_t u = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(U + x))), offset);
+		int16x8_t v = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(V + x))), offset);
+		uint8x8x3_t rgb;
+		rgb.val[0] = vqmovun_s16(vaddq_s16(y, vrshrq_n_s16(vmulq_n_s16(v, 90), 6)));
+		rgb.val[1] = vqmovun_s16(vsubq_s16(y, vrshrq_n_s16(vmlaq_n_s16(vmulq_n_s16(u, 22), v, 46), 6)));
+		rgb.val[2] = vqmovun_s16(vaddq_s16(y, vrshrq_n_s16(vmulq_n_s16(u, 113), 6)));
+		vst3_u8(dst, rgb);
+	}
+#endif
+	for (; x < width; x++)
+	{
+		int y = Y[x], u = U[x] - 128, v = V[x] - 128;
+		*(dst++) = clamp_u8(y + ((90 * v + 32) >> 6));
+		*(dst++) = clamp_u8(y - ((22 * u + 46 * v + 32) >> 6));
+		*(dst++) = clamp_u8(y + ((113 * u + 32) >> 6));
+	}
+}
+
 void PostProcessingStage::Yuv420ToRgb(uint8_t *dst, const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info)
 {
 	assert(src_info.width >= dst_info.width && src_info.height >= dst_info.height);
 	int off_x = ((src_info.width - dst_info.width) / 2) & ~1, off_y = ((src_info.height - dst_info.height) / 2) & ~1;
 	int src_Y_size = src_info.height * src_info.stride, src_U_size = (src_info.height / 2) * (src_info.stride / 2);
 
-	// We're going to process 4x2 pixel blocks, as far as alignment allows.
-	unsigned int dst_h_aligned = dst_info.height & ~1, dst_w_aligned = dst_info.width & ~3;
-
-	unsigned int y = 0;
-	for (; y < dst_h_aligned; y += 2)
+	// Chroma is upsampled into these rows so that the conversion sees one sample per pixel.
+	std::vector<uint8_t> U(dst_info.width), V(dst_info.width);
+	for (unsigned int y = 0; y < dst_info.height; y++)
 	{
-		const uint8_t *src_Y0 = src + (y + off_y) * src_info.stride + off_x;
-		const uint8_t *src_U = src + src_Y_size + ((y + off_y) / 2) * (src_info.stride / 2) + off_x / 2;
-		const uint8_t *src_V = src_U + src_U_size;
-		const uint8_t *src_Y1 = src_Y0 + src_info.stride;
-		uint8_t *dst0 = &dst[y * dst_info.stride];
-		uint8_t *dst1 = dst0 + dst_info.stride;
-
-		unsigned int x = 0;
-		for (; x < dst_w_aligned; x += 4)
+		const uint8_t *src_Y = src + (y + off_y) * src_info.stride + off_x;
+		if (y == 0 || ((y + off_y) & 1) == 0)
 		{
-			int Y0 = *(src_Y0++);
-			int U0 = *(src_U++);
-			int V0 = *(src_V++);
-			int Y1 = *(src_Y0++);
-			int Y2 = *(src_Y0++);
-			int U2 = *(src_U++);
-			int V2 = *(src_V++);
-			int Y3 = *(src_Y0++);
-			int Y4 = *(src_Y1++);
-			int Y5 = *(src_Y1++);
-			int Y6 = *(src_Y1++);
-			int Y7 = *(src_Y1++);
-
-			U0 -= 128;
-			V0 -= 128;
-			U2 -= 128;
-			V2 -= 128;
-			int U1 = U0;
-			int V1 = V0;
-			int U4 = U0;
-			int V4 = V0;
-			int U5 = U0;
-			int V5 = V0;
-			int U3 = U2;
-			int V3 = V2;
-			int U6 = U2;
-			int V6 = V2;
-			int U7 = U2;
-			int V7 = V2;
-
-			int R0 = Y0 + 1.402 * V0;
-			int G0 = Y0 - 0.345 * U0 - 0.714 * V0;
-			int B0 = Y0 + 1.771 * U0;
-			int R1 = Y1 + 1.402 * V1;
-			int G1 = Y1 - 0.345 * U1 - 0.714 * V1;
-			int B1 = Y1 + 1.771 * U1;
-			int R2 = Y2 + 1.402 * V2;
-			int G2 = Y2 - 0.345 * U2 - 0.714 * V2;
-			int B2 = Y2 + 1.771 * U2;
-			int R3 = Y3 + 1.402 * V3;
-			int G3 = Y3 - 0.345 * U3 - 0.714 * V3;
-			int B3 = Y3 + 1.771 * U3;
-			int R4 = Y4 + 1.402 * V4;
-			int G4 = Y4 - 0.345 * U4 - 0.714 * V4;
-			int B4 = Y4 + 1.771 * U4;
-			int R5 = Y5 + 1.402 * V5;
-			int G5 = Y5 - 0.345 * U5 - 0.714 * V5;
-			int B5 = Y5 + 1.771 * U5;
-			int R6 = Y6 + 1.402 * V6;
-			int G6 = Y6 - 0.345 * U6 - 0.714 * V6;
-			int B6 = Y6 + 1.771 * U6;
-			int R7 = Y7 + 1.402 * V7;
-			int G7 = Y7 - 0.345 * U7 - 0.714 * V7;
-			int B7 = Y7 + 1.771 * U7;
-
-			R0 = std::clamp(R0, 0, 255);
-			G0 = std::clamp(G0, 0, 255);
-			B0 = std::clamp(B0, 0, 255);
-			R1 = std::clamp(R1, 0, 255);
-			G1 = std::clamp(G1, 0, 255);
-			B1 = std::clamp(B1, 0, 255);
-			R2 = std::clamp(R2, 0, 255);
-			G2 = std::clamp(G2, 0, 255);
-			B2 = std::clamp(B2, 0, 255);
-			R3 = std::clamp(R3, 0, 255);
-			G3 = std::clamp(G3, 0, 255);
-			B3 = std::clamp(B3, 0, 255);
-			R4 = std::clamp(R4, 0, 255);
-			G4 = std::clamp(G4, 0, 255);
-			B4 = std::clamp(B4, 0, 255);
-			R5 = std::clamp(R5, 0, 255);
-			G5 = std::clamp(G5, 0, 255);
-			B5 = std::clamp(B5, 0, 255);
-			R6 = std::clamp(R6, 0, 255);
-			G6 = std::clamp(G6, 0, 255);
-			B6 = std::clamp(B6, 0, 255);
-			R7 = std::clamp(R7, 0, 255);
-			G7 = std::clamp(G7, 0, 255);
-			B7 = std::clamp(B7, 0, 255);
-
-			*(dst0++) = R0;
-			*(dst0++) = G0;
-			*(dst0++) = B0;
-			*(dst0++) = R1;
-			*(dst0++) = G1;
-			*(dst0++) = B1;
-			*(dst0++) = R2;
-			*(dst0++) = G2;
-			*(dst0++) = B2;
-			*(dst0++) = R3;
-			*(dst0++) = G3;
-			*(dst0++) = B3;
-			*(dst1++) = R4;
-			*(dst1++) = G4;
-			*(dst1++) = B4;
-			*(dst1++) = R5;
-			*(dst1++) = G5;
-			*(dst1++) = B5;
-			*(dst1++) = R6;
-			*(dst1++) = G6;
-			*(dst1++) = B6;
-			*(dst1++) = R7;
-			*(dst1++) = G7;
-			*(dst1++) = B7;
+			const uint8_t *src_U = src + src_Y_size + ((y + off_y) / 2) * (src_info.stride / 2) + off_x / 2;
+			const uint8_t *src_V = src_U + src_U_size;
+			for (unsigned int x = 0; x < dst_info.width; x++)
+				U[x] = src_U[x / 2], V[x] = src_V[x / 2];
 		}
-		// Straggling pixel columns - we must still do both rows.
-		for (; x < dst_info.width; x++)
-		{
-			int Y0 = *(src_Y0++);
-			int U0 = *(src_U);
-			int V0 = *(src_V);
-			int Y4 = *(src_Y1++);
-			src_U += (x & 1);
-			src_V += (x & 1);
-
-			U0 -= 128;
-			V0 -= 128;
-			int U4 = U0;
-			int V4 = V0;
+		yuv_row_to_rgb(&dst[y * dst_info.stride], src_Y, U.data(), V.data(), dst_info.width);
+	}
+}
 
-			int R0 = Y0 + 1.402 * V0;
-			int G0 = Y0 - 0.345 * U0 - 0.714 * V0;
-			int B0 = Y0 + 1.771 * U0;
-			int R4 = Y4 + 1.402 * V4;
-			int G4 = Y4 - 0.345 * U4 - 0.714 * V4;
-			int B4 = Y4 + 1.771 * U4;
+std::vector<uint8_t> PostProcessingStage::Yuv420ToRgbScaled(const uint8_t *src, StreamInfo const &src_info,
+															StreamInfo const &dst_info, bool bilinear)
+{
+	std::vector<uint8_t> output(dst_info.height * dst_info.stride);
+	Yuv420ToRgbScaled(output.data(), src, src_info, dst_info, bilinear);
+	return output;
+}
 
-			R0 = std::clamp(R0, 0, 255);
-			G0 = std::clamp(G0, 0, 255);
-			B0 = std::clamp(B0, 0, 255);
-			R4 = std::clamp(R4, 0, 255);
-			G4 = std::clamp(G4, 0, 255);
-			B4 = std::clamp(B4, 0, 255);
+void PostProcessingStage::Yuv420ToRgbScaled(uint8_t *dst, const uint8_t *src, StreamInfo const &src_info,
+											StreamInfo const &dst_info, bool bilinear)
+{
+	Yuv420ToRgbScaled(dst, src, src_info, libcamera::Rectangle(0, 0, src_info.width, src_info.height), dst_info,
+					  bilinear);
+}
 
-			*(dst0++) = R0;
-			*(dst0++) = G0;
-			*(dst0++) = B0;
-			*(dst1++) = R4;
-			*(dst1++) = G4;
-			*(dst1++) = B4;
-		}
-	}
-	// Any straggling final row is done with extreme steam power.
-	for (; y < dst_info.height; y++)
+void PostProcessingStage::Yuv420ToRgbScaled(uint8_t *dst, const uint8_t *src, StreamInfo const &src_info,
+											libcamera::Rectangle const &crop, StreamInfo const &dst_info,
+											bool bilinear)
+{
+	const uint8_t *src_U_plane = src + src_info.height * src_info.stride;
+	const uint8_t *src_V_plane = src_U_plane + (src_info.height / 2) * (src_info.stride / 2);
+
+	// Source positions for each output column, in 8-bit fixed point, sampling at pixel centres of the crop.
+	auto position = [](unsigned int i, int offset, unsigned int src_size, unsigned int dst_size) {
+		int pos = ((2 * i + 1) * src_size * 256 / dst_size - 256) / 2;
+		return offset * 256 + std::clamp(pos, 0, (int)(src_size - 1) * 256);
+	};
+	std::vector<int> x_pos(dst_info.width);
+	for (unsigned int x = 0; x < dst_info.width; x++)
+		x_pos[x] = position(x, crop.x, crop.width, dst_info.width);
+
+	// Gather (and perhaps interpolate) one row of samples per output pixel, then convert them. Chroma is
+	// always taken from the nearest sample, as it has half the resolution anyway.
+	std::vector<uint8_t> Y(dst_info.width), U(dst_info.width), V(dst_info.width);
+	for (unsigned int y = 0; y < dst_info.height; y++)
 	{
-		const uint8_t *src_Y0 = src + (y + off_y) * src_info.stride + off_x;
-		const uint8_t *src_U = src + src_Y_size + ((y + off_y) / 2) * (src_info.stride / 2) + off_x / 2;
-		const uint8_t *src_V = src_U + src_U_size;
-		uint8_t *dst0 = &dst[y * dst_info.stride];
-
-		unsigned int x = 0;
-		for (; x < dst_info.width; x++)
+		int y_pos = position(y, crop.y, crop.height, dst_info.height);
+		unsigned int y0 = y_pos >> 8, y1 = std::min(y0 + 1, src_info.height - 1), fy = y_pos & 255;
+		const uint8_t *src_Y0 = src + y0 * src_info.stride, *src_Y1 = src + y1 * src_info.stride;
+		unsigned int cy = (bilinear ? (y_pos + 128) >> 8 : y0) / 2;
+		const uint8_t *src_U = src_U_plane + cy * (src_info.stride / 2);
+		const uint8_t *src_V = src_V_plane + cy * (src_info.stride / 2);
+
+		for (unsigned int x = 0; x < dst_info.width; x++)
 		{
-			int Y0 = *(src_Y0++);
-			int U0 = *(src_U);
-			int V0 = *(src_V);
-			src_U += (x & 1);
-			src_V += (x & 1);
-
-			U0 -= 128;
-			V0 -= 128;
-
-			int R0 = Y0 + 1.402 * V0;
-			int G0 = Y0 - 0.345 * U0 - 0.714 * V0;
-			int B0 = Y0 + 1.771 * U0;
-
-			R0 = std::clamp(R0, 0, 255);
-			G0 = std::clamp(G0, 0, 255);
-			B0 = std::clamp(B0, 0, 255);
-
-			*(dst0++) = R0;
-			*(dst0++) = G0;
-			*(dst0++) = B0;
+			unsigned int x0 = x_pos[x] >> 8;
+			if (bilinear)
+			{
+				unsigned int x1 = std::min(x0 + 1, src_info.width - 1), fx = x_pos[x] & 255;
+				unsigned int top = src_Y0[x0] * (256 - fx) + src_Y0[x1] * fx;
+				unsigned int bottom = src_Y1[x0] * (256 - fx) + src_Y1[x1] * fx;
+				Y[x] = (top * (256 - fy) + bottom * fy + (1 << 15)) >> 16;
+				unsigned int cx = ((x_pos[x] + 128) >> 8) / 2;
+				U[x] = src_U[cx], V[x] = src_V[cx];
+			}
+			else
+			{
+				Y[x] = src_Y0[x0];
+				U[x] = src_U[x0 / 2], V[x] = src_V[x0 / 2];
+			}
 		}
+		yuv_row_to_rgb(&dst[y * dst_info.stride], Y.data(), U.data(), V.data(), dst_info.width);
 	}
 }
 
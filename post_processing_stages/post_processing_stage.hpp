@@ -8,7 +8,9 @@
 #pragma once
 
 #include <chrono>
+#include <functional>
 #include <map>
+#include <optional>
 #include <string>
 #include <vector>
 
@@ -18,6 +20,8 @@
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/property_tree/ptree.hpp>
 
+#include <libcamera/geometry.h>
+
 #include "core/completed_request.hpp"
 #include "core/stream_info.hpp"
 
@@ -50,16 +54,54 @@ public:
 	// Return true if this request is to be dropped.
 	virtual bool Process(CompletedRequestPtr &completed_request) = 0;
 
+	// A stage that changes each byte of the main stream's buffer independently of all the others may return
+	// true here (once configured) and do that in ProcessTile, given size bytes starting offset bytes into the
+	// buffer. The post-processor then runs a sequence of such stages together, a tile at a time, so that the
+	// image passes through the cache once rather than once for each of them. The tiles are all a multiple of
+	// 16 bytes, except perhaps the last. Process is still used when a stage runs on its own.
+	virtual bool PerPixel() const { return false; }
+	virtual void ProcessTile(uint8_t *ptr, size_t offset, size_t size) {}
+
+	// A stage that scales the whole lores image to the input size of a network can ask (once it has Read its
+	// parameters) for a lores image of exactly that size, and say whether it can take it as RGB. If neither
+	// the JSON file nor the command line sets up a lores stream, the post-processor then configures one to
+	// suit, so that the ISP does the scaling, and on Pi 5 the conversion to RGB, instead of the stage.
+	struct LoresPreference
+	{
+		unsigned int width;
+		unsigned int height;
+		bool rgb;
+	};
+	virtual std::optional<LoresPreference> PreferredLores() const { return std::nullopt; }
+
+	// A stage that keeps a device to itself until it is destroyed returns true here, so that a reload replacing
+	// it destroys the old one before creating the new.
+	virtual bool ExclusiveDevice() const { return false; }
+
 	virtual void Stop();
 
 	virtual void Teardown();
 
+	// Called with the time taken by work a stage does outside Process, such as on a thread of its own. The
+	// post-processor installs one of these so that such timings appear in its statistics.
+	using TimingCallback = std::function<void(char const *what, double time_us)>;
+	void SetTimingCallback(TimingCallback callback) { timing_callback_ = std::move(callback); }
+
 	// Below here are some helpers provided for the convenience of derived classes.
 
 	// Convert YUV420 image to RGB. We crop from the centre of the image if the src
 	// image is larger than the destination.
 	static std::vector<uint8_t> Yuv420ToRgb(const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info);
 	static void Yuv420ToRgb(uint8_t *dst, const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info);
+	// As above, but scale the whole of the src image to the destination size (nearest neighbour or
+	// bilinear) during the conversion, instead of cropping.
+	static std::vector<uint8_t> Yuv420ToRgbScaled(const uint8_t *src, StreamInfo const &src_info,
+												  StreamInfo const &dst_info, bool bilinear = false);
+	static void Yuv420ToRgbScaled(uint8_t *dst, const uint8_t *src, StreamInfo const &src_info,
+								  StreamInfo const &dst_info, bool bilinear = false);
+	// As above, scaling just the crop rectangle of the src image, which must lie within it.
+	static void Yuv420ToRgbScaled(uint8_t *dst, const uint8_t *src, StreamInfo const &src_info,
+								  libcamera::Rectangle const &crop, StreamInfo const &dst_info, bool bilinear = false);
 
 protected:
 	// Helper to calculate the execution time of any callable object and return it in as a std::chrono::duration.
@@ -92,7 +134,16 @@ protected:
 		return vec;
 	}
 
+	void ReportTiming(char const *what, double time_us) const
+	{
+		if (timing_callback_)
+			timing_callback_(what, time_us);
+	}
+
 	RPiCamApp *app_;
+
+private:
+	TimingCallback timing_callback_;
 };
 
 typedef PostProcessingStage *(*StageCreateFunc)(RPiCamApp *app);
@@ -9,6 +9,7 @@
 
 #include <cstdint>
 #include <string>
+#include <utility>
 #include <vector>
 
 struct Segmentation
@@ -20,5 +21,8 @@ struct Segmentation
 	int width;
 	int height;
 	std::vector<std::string> labels;
-	std::vector<uint8_t> segmentation;
+	std::vector<uint8_t> segmentation; // a label index for each pixel, or empty if run-length encoded
+	std::vector<uint32_t> histogram; // the number of pixels with each label
+	// The labels as (label, length) runs in raster order, in place of segmentation when asked for.
+	std::vector<std::pair<uint8_t, uint32_t>> runs;
 };
@@ -5,6 +5,10 @@
  * segmentation_tf_stage - image segmentation
  */
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "segmentation.hpp"
 #include "tf_stage.hpp"
 
@@ -16,6 +20,7 @@ constexpr int HEIGHT = 257;
 struct SegmentationTfConfig : public TfConfig
 {
 	bool draw;
+	bool rle; // output the segmentation run-length encoded
 	uint32_t threshold; // number of pixels in a category before we print its name
 };
 
@@ -48,8 +53,61 @@ protected:
 private:
 	std::vector<std::string> labels_;
 	std::vector<uint8_t> segmentation_;
+	std::vector<uint32_t> histogram_;
+	std::vector<std::pair<uint8_t, uint32_t>> runs_;
 };
 
+// Return the index of the largest of the n scores, the first of them if there's a tie, as std::max_element does.
+
+static int argmax(const float *scores, int n)
+{
+	int best = 0, i = 1;
+	float best_score = scores[0];
+
+#if defined(__ARM_NEON)
+	if (n >= 8)
+	{
+		// Each lane keeps the first of the largest scores it sees, and its index.
+		static const uint32_t first_indices[4] = { 0, 1, 2, 3 };
+		float32x4_t max = vld1q_f32(scores);
+		uint32x4_t index = vld1q_u32(first_indices), max_index = index;
+		for (i = 4; i + 4 <= n; i += 4)
+		{
+			float32x4_t v = vld1q_f32(scores + i);
+			index = vaddq_u32(index, vdupq_n_u32(4));
+			uint32x4_t greater = vcgtq_f32(v, max);
+			max = vbslq_f32(greater, v, max);
+			max_index = vbslq_u32(greater, index, max_index);
+		}
+
+		float lane_max[4];
+		uint32_t lane_index[4];
+		vst1q_f32(lane_max, max);
+		vst1q_u32(lane_index, max_index);
+		best_score = lane_max[0];
+		best = lane_index[0];
+		for (int l = 1; l < 4; l++)
+		{
+			if (lane_max[l] > best_score || (lane_max[l] == best_score && (int)lane_index[l] < best))
+			{
+				best_score = lane_max[l];
+				best = lane_index[l];
+			}
+		}
+	}
+#endif
+
+	for (; i < n; i++)
+	{
+		if (scores[i] > best_score)
+		{
+			best_score = scores[i];
+			best = i;
+		}
+	}
+	return best;
+}
+
 void SegmentationTfStage::readLabelsFile(const std::string &file_name)
 {
 	std::ifstream file(file_name);
@@ -63,6 +121,7 @@ void SegmentationTfStage::readLabelsFile(const std::string &file_name)
 void SegmentationTfStage::readExtras([[maybe_unused]] boost::property_tree::ptree const &params)
 {
 	config()->draw = params.get<int>("draw", 1);
+	config()->rle = params.get<int>("rle", 0);
 	config()->threshold = params.get<uint32_t>("threshold", 5000);
 	std::string labels_file = params.get<std::string>("labels_file", "");
 	readLabelsFile(labels_file);
@@ -83,9 +142,12 @@ void SegmentationTfStage::checkConfiguration()
 
 void SegmentationTfStage::applyResults(CompletedRequestPtr &completed_request)
 {
-	// Store the segmentation in image metadata.
-	completed_request->post_process_metadata.Set("segmentation.result",
-												Segmentation(WIDTH, HEIGHT, labels_, segmentation_));
+	// Store the segmentation in image metadata, run-length encoded if asked, which is usually much smaller.
+	Segmentation result(WIDTH, HEIGHT, labels_, config()->rle ? std::vector<uint8_t>() : segmentation_);
+	result.histogram = histogram_;
+	if (config()->rle)
+		result.runs = runs_;
+	completed_request->post_process_metadata.Set("segmentation.result", std::move(result));
 
 	// Optionally, draw the segmentation in the bottom right corner of the main image.
 	if (!config()->draw)
@@ -124,25 +186,34 @@ void SegmentationTfStage::interpretOutputs()
 	float *output = interpreter_->tensor(interpreter_->outputs()[0])->data.f;
 	uint8_t *seg_ptr = &segmentation_[0];
 	int num_categories = labels_.size();
-	std::vector<std::pair<size_t, int>> hist(num_categories);
-	std::generate(hist.begin(), hist.end(), [i = 0]() mutable { return std::pair<size_t, int>(0, i++); });
+	histogram_.assign(num_categories, 0);
+	runs_.clear();
 
-	// Extract the segmentation from the output tensor. Also accumulate a histogram.
+	// Extract the segmentation from the output tensor. Also accumulate a histogram, and the runs if we want them.
 
 	for (int y = 0; y < HEIGHT; y++)
 	{
 		for (int x = 0; x < WIDTH; x++, output += num_categories)
 		{
 			// For each pixel we get a "confidence" value for every category - pick the largest.
-			int index = std::max_element(output, output + num_categories) - output;
+			int index = argmax(output, num_categories);
 			*(seg_ptr++) = index;
-			hist[index].first++;
+			histogram_[index]++;
+			if (!config()->rle)
+				continue;
+			if (!runs_.empty() && runs_.back().first == index)
+				runs_.back().second++;
+			else
+				runs_.emplace_back(index, 1);
 		}
 	}
 
 	if (config()->verbose)
 	{
 		// Output the category names of the largest histogram bins.
+		std::vector<std::pair<size_t, int>> hist(num_categories);
+		for (int i = 0; i < num_categories; i++)
+			hist[i] = { histogram_[i], i };
 		std::sort(hist.begin(), hist.end(), [](const auto &lhs, const auto &rhs) { return lhs.first > rhs.first; });
 		for (int i = 0; i < num_categories && hist[i].first >= config()->threshold; i++)
 			std::cerr << (i ? ", " : "") << labels_[hist[i].second] << " (" << hist[i].first << ")";
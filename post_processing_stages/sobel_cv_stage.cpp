@@ -2,9 +2,17 @@
 /*
  * Copyright (C) 2021, Raspberry Pi (Trading) Limited
  *
- * sobel_cv_stage.cpp - Sobel filter implementation, using OpenCV
+ * sobel_cv_stage.cpp - Sobel filter implementation, using OpenCV or a fused 3x3 kernel
  */
 
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include <libcamera/stream.h>
 
 #include "core/rpicam_app.hpp"
@@ -32,12 +40,77 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
+	double edgesInPlace(uint8_t *ptr, StreamInfo const &info);
+	double measure(uint8_t const *ptr, StreamInfo const &info) const;
+	void edgesCv(uint8_t *ptr, StreamInfo const &info) const;
+
 	Stream *stream_;
+	StreamInfo info_;
 	int ksize_ = 3;
+	bool lores_ = false;
+	bool output_ = true;
+	int subsample_ = 1;
+	std::vector<uint8_t> rows_;
 };
 
 #define NAME "sobel_cv"
 
+// 3x3 Sobel over the pixels x = 1, 1 + step, ... of the row r1, with r0 and r2 the rows above and below.
+// Returns the sum of gx^2 + gy^2, and if dest is given writes the same magnitude as the OpenCV path,
+// (|gx| + |gy|) / 2 with each saturated to 8 bits, for every pixel but the two at the ends, which are 0.
+
+static uint64_t sobel_row(uint8_t const *r0, uint8_t const *r1, uint8_t const *r2, int width, int step,
+						  uint8_t *dest)
+{
+	uint64_t energy = 0;
+	int x = 1;
+
+#if defined(__ARM_NEON)
+	if (step == 1)
+	{
+		uint64x2_t acc = vdupq_n_u64(0);
+		for (; x + 9 <= width; x += 8)
+		{
+			uint8x8_t a0 = vld1_u8(r0 + x - 1), c0 = vld1_u8(r0 + x), b0 = vld1_u8(r0 + x + 1);
+			uint8x8_t a1 = vld1_u8(r1 + x - 1), b1 = vld1_u8(r1 + x + 1);
+			uint8x8_t a2 = vld1_u8(r2 + x - 1), c2 = vld1_u8(r2 + x), b2 = vld1_u8(r2 + x + 1);
+
+			int16x8_t dx0 = vreinterpretq_s16_u16(vsubl_u8(b0, a0));
+			int16x8_t dx1 = vreinterpretq_s16_u16(vsubl_u8(b1, a1));
+			int16x8_t dx2 = vreinterpretq_s16_u16(vsubl_u8(b2, a2));
+			int16x8_t gx = vaddq_s16(vaddq_s16(dx0, dx2), vshlq_n_s16(dx1, 1));
+			uint16x8_t s0 = vaddq_u16(vaddl_u8(a0, b0), vshll_n_u8(c0, 1));
+			uint16x8_t s2 = vaddq_u16(vaddl_u8(a2, b2), vshll_n_u8(c2, 1));
+			int16x8_t gy = vreinterpretq_s16_u16(vsubq_u16(s2, s0));
+
+			int16x4_t gx_lo = vget_low_s16(gx), gx_hi = vget_high_s16(gx);
+			int16x4_t gy_lo = vget_low_s16(gy), gy_hi = vget_high_s16(gy);
+			int32x4_t e_lo = vmlal_s16(vmull_s16(gx_lo, gx_lo), gy_lo, gy_lo);
+			int32x4_t e_hi = vmlal_s16(vmull_s16(gx_hi, gx_hi), gy_hi, gy_hi);
+			acc = vpadalq_u32(acc, vreinterpretq_u32_s32(e_lo));
+			acc = vpadalq_u32(acc, vreinterpretq_u32_s32(e_hi));
+
+			if (dest)
+				vst1_u8(dest + x, vrhadd_u8(vqmovun_s16(vabsq_s16(gx)), vqmovun_s16(vabsq_s16(gy))));
+		}
+		energy = vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1);
+	}
+#endif
+
+	for (; x < width - 1; x += step)
+	{
+		int gx = (r0[x + 1] - r0[x - 1]) + 2 * (r1[x + 1] - r1[x - 1]) + (r2[x + 1] - r2[x - 1]);
+		int gy = (r2[x - 1] + 2 * r2[x] + r2[x + 1]) - (r0[x - 1] + 2 * r0[x] + r0[x + 1]);
+		energy += gx * gx + gy * gy;
+		if (dest)
+			dest[x] = (std::min(std::abs(gx), 255) + std::min(std::abs(gy), 255) + 1) >> 1;
+	}
+
+	if (dest)
+		dest[0] = dest[width - 1] = 0;
+	return energy;
+}
+
 char const *SobelCvStage::Name() const
 {
 	return NAME;
@@ -46,33 +119,65 @@ char const *SobelCvStage::Name() const
 void SobelCvStage::Read(boost::property_tree::ptree const &params)
 {
 	ksize_ = params.get<int16_t>("ksize", 3);
+	lores_ = params.get<std::string>("stream", "main") == "lores";
+	output_ = params.get<bool>("output", true);
+	subsample_ = std::max(1, params.get<int>("subsample", 1));
 }
 
 void SobelCvStage::Configure()
 {
-	stream_ = app_->GetMainStream();
+	stream_ = lores_ ? app_->LoresStream() : app_->GetMainStream();
 	if (!stream_ || stream_->configuration().pixelFormat != libcamera::formats::YUV420)
 		throw std::runtime_error("SobelCvStage: only YUV420 format supported");
+	info_ = app_->GetStreamInfo(stream_);
+	rows_.resize(2 * info_.width);
 }
 
-bool SobelCvStage::Process(CompletedRequestPtr &completed_request)
+// Replace the image by its edges with the fused kernel, keeping copies of the two rows it still needs to
+// read as it overwrites them, and return the mean energy.
+
+double SobelCvStage::edgesInPlace(uint8_t *ptr, StreamInfo const &info)
 {
-	StreamInfo info = app_->GetStreamInfo(stream_);
-	BufferWriteSync w(app_, completed_request->buffers[stream_]);
-	libcamera::Span<uint8_t> buffer = w.Get()[0];
-	uint8_t *ptr = (uint8_t *)buffer.data();
+	if (info.width < 3 || info.height < 3)
+		return 0;
+
+	uint8_t *prev = rows_.data(), *cur = prev + info.width;
+	uint64_t energy = 0;
+	memcpy(prev, ptr, info.width);
+	for (unsigned int y = 1; y < info.height - 1; y++)
+	{
+		uint8_t *row = ptr + y * info.stride;
+		memcpy(cur, row, info.width);
+		energy += sobel_row(prev, cur, row + info.stride, info.width, 1, row);
+		std::swap(prev, cur);
+	}
+	memset(ptr, 0, info.width);
+	memset(ptr + (info.height - 1) * info.stride, 0, info.width);
+
+	return (double)energy / ((info.width - 2) * (info.height - 2));
+}
 
-	//Everything beyond this point is image processing...
+// Only measure the mean energy, on every subsample'th row and column.
 
-	uint8_t value = 128;
-	int num = (info.stride * info.height) / 2;
+double SobelCvStage::measure(uint8_t const *ptr, StreamInfo const &info) const
+{
+	uint64_t energy = 0, count = 0;
+	for (unsigned int y = 1; y + 1 < info.height; y += subsample_)
+	{
+		uint8_t const *row = ptr + y * info.stride;
+		energy += sobel_row(row - info.stride, row, row + info.stride, info.width, subsample_, nullptr);
+		count += (info.width - 2 + subsample_ - 1) / subsample_;
+	}
+	return count ? (double)energy / count : 0;
+}
+
+void SobelCvStage::edgesCv(uint8_t *ptr, StreamInfo const &info) const
+{
 	Mat src = Mat(info.height, info.width, CV_8U, ptr, info.stride);
 	int scale = 1;
 	int delta = 0;
 	int ddepth = CV_16S;
 
-	memset(ptr + info.stride * info.height, value, num);
-
 	// Remove noise by blurring with a Gaussian filter ( kernal size = 3 )
 	GaussianBlur(src, src, Size(3, 3), 0, 0, BORDER_DEFAULT);
 
@@ -89,6 +194,38 @@ bool SobelCvStage::Process(CompletedRequestPtr &completed_request)
 
 	//weight the x and y gradients and add their magnitudes
 	addWeighted(grad_x, 0.5, grad_y, 0.5, 0, src);
+}
+
+bool SobelCvStage::Process(CompletedRequestPtr &completed_request)
+{
+	double energy;
+
+	if (!output_)
+	{
+		BufferReadSync r(app_, completed_request->buffers[stream_]);
+		energy = measure(r.Get()[0].data(), info_);
+	}
+	else
+	{
+		BufferWriteSync w(app_, completed_request->buffers[stream_]);
+		libcamera::Span<uint8_t> buffer = w.Get()[0];
+		uint8_t *ptr = (uint8_t *)buffer.data();
+
+		// A 3x3 kernel at full resolution goes through the fused kernel (without OpenCV's noise reducing
+		// blur), which measures as it goes. Otherwise measure before OpenCV runs.
+		if (ksize_ == 3 && subsample_ == 1)
+			energy = edgesInPlace(ptr, info_);
+		else
+		{
+			energy = measure(ptr, info_);
+			edgesCv(ptr, info_);
+		}
+
+		memset(ptr + info_.stride * info_.height, 128, (info_.stride * info_.height) / 2);
+	}
+
+	// The mean of gx^2 + gy^2 rises as the image comes into focus, so is useful as a sharpness measure.
+	completed_request->post_process_metadata.Set("sobel.edge_energy", energy);
 
 	return false;
 }
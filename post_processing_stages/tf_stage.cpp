@@ -4,8 +4,25 @@
  *
  * tf_stage.hpp - base class for TensorFlowLite stages
  */
+#include <cstring>
+#include <dlfcn.h>
+
+#include "core/memory_account.hpp"
+
 #include "tf_stage.hpp"
 
+#if HAVE_TFLITE_XNNPACK
+#include "tensorflow/lite/delegates/xnnpack/xnnpack_delegate.h"
+#endif
+#if HAVE_TFLITE_GPU
+#include "tensorflow/lite/delegates/gpu/delegate.h"
+#endif
+
+// The entry points every TFLite external delegate library provides.
+using PluginCreateFunc = TfLiteDelegate *(*)(char **keys, char **values, size_t num_options,
+											  void (*report_error)(char const *));
+using PluginDestroyFunc = void (*)(TfLiteDelegate *delegate);
+
 TfStage::TfStage(RPiCamApp *app, int tf_w, int tf_h) : PostProcessingStage(app), tf_w_(tf_w), tf_h_(tf_h)
 {
 	if (tf_w_ <= 0 || tf_h_ <= 0)
@@ -20,6 +37,17 @@ void TfStage::Read(boost::property_tree::ptree const &params)
 	config_->verbose = params.get<int>("verbose", 0);
 	config_->normalisation_offset = params.get<float>("normalisation_offset", 127.5);
 	config_->normalisation_scale = params.get<float>("normalisation_scale", 127.5);
+	config_->motion_only = params.get<int>("motion_only", 0);
+	config_->scale_input = params.get<int>("scale_input", 0);
+	config_->delegate = params.get<std::string>("delegate", "none");
+	config_->xnnpack_quantized = params.get<int>("xnnpack_quantized", 1);
+	config_->delegate_library = params.get<std::string>("delegate_library", "");
+	if (auto options = params.get_child_optional("delegate_options"))
+	{
+		for (auto const &option : *options)
+			config_->delegate_options.emplace_back(option.first, option.second.get_value<std::string>());
+	}
+	config_->warmup = params.get<unsigned int>("warmup", 0);
 
 	initialise();
 
@@ -33,14 +61,27 @@ void TfStage::initialise()
 		throw std::runtime_error("TfStage: Failed to load model");
 	LOG(1, "TfStage: Loaded model " << config_->model_file);
 
-	tflite::ops::builtin::BuiltinOpResolver resolver;
-	tflite::InterpreterBuilder(*model_, resolver)(&interpreter_);
+	// Leave the built-in XNNPACK delegate out when we're applying one of our own choosing.
+	std::unique_ptr<tflite::ops::builtin::BuiltinOpResolver> resolver;
+	if (config_->delegate == "none")
+		resolver = std::make_unique<tflite::ops::builtin::BuiltinOpResolver>();
+	else
+		resolver = std::make_unique<tflite::ops::builtin::BuiltinOpResolverWithoutDefaultDelegates>();
+	tflite::InterpreterBuilder(*model_, *resolver)(&interpreter_);
 	if (!interpreter_)
 		throw std::runtime_error("TfStage: Failed to construct interpreter");
 
 	if (config_->number_of_threads != -1)
 		interpreter_->SetNumThreads(config_->number_of_threads);
 
+	createDelegate();
+	if (delegate_)
+	{
+		if (interpreter_->ModifyGraphWithDelegate(delegate_.get()) != kTfLiteOk)
+			throw std::runtime_error("TfStage: Failed to apply " + config_->delegate + " delegate");
+		LOG(1, "TfStage: Using " << config_->delegate << " delegate");
+	}
+
 	if (interpreter_->AllocateTensors() != kTfLiteOk)
 		throw std::runtime_error("TfStage: Failed to allocate tensors");
 
@@ -60,6 +101,98 @@ void TfStage::initialise()
 		throw std::runtime_error("TfStage: Input tensor size mismatch");
 }
 
+void TfStage::createDelegate()
+{
+	if (config_->delegate == "none")
+		return;
+	else if (config_->delegate == "xnnpack")
+	{
+#if HAVE_TFLITE_XNNPACK
+		TfLiteXNNPackDelegateOptions options = TfLiteXNNPackDelegateOptionsDefault();
+		if (config_->number_of_threads > 0)
+			options.num_threads = config_->number_of_threads;
+		if (config_->xnnpack_quantized)
+			options.flags |= TFLITE_XNNPACK_DELEGATE_FLAG_QS8 | TFLITE_XNNPACK_DELEGATE_FLAG_QU8;
+		delegate_ = { TfLiteXNNPackDelegateCreate(&options), TfLiteXNNPackDelegateDelete };
+#else
+		throw std::runtime_error("TfStage: Built without XNNPACK delegate support");
+#endif
+	}
+	else if (config_->delegate == "gpu")
+	{
+#if HAVE_TFLITE_GPU
+		TfLiteGpuDelegateOptionsV2 options = TfLiteGpuDelegateOptionsV2Default();
+		options.inference_preference = TFLITE_GPU_INFERENCE_PREFERENCE_SUSTAINED_SPEED;
+		delegate_ = { TfLiteGpuDelegateV2Create(&options), TfLiteGpuDelegateV2Delete };
+#else
+		throw std::runtime_error("TfStage: Built without GPU delegate support");
+#endif
+	}
+	else if (config_->delegate == "external")
+	{
+		void *lib = dlopen(config_->delegate_library.c_str(), RTLD_NOW | RTLD_LOCAL);
+		if (!lib)
+			throw std::runtime_error("TfStage: Failed to open delegate library " + config_->delegate_library);
+
+		auto create = (PluginCreateFunc)dlsym(lib, "tflite_plugin_create_delegate");
+		auto destroy = (PluginDestroyFunc)dlsym(lib, "tflite_plugin_destroy_delegate");
+		if (!create || !destroy)
+		{
+			dlclose(lib);
+			throw std::runtime_error("TfStage: " + config_->delegate_library + " is not a TFLite delegate");
+		}
+
+		std::vector<char *> keys, values;
+		for (auto &[key, value] : config_->delegate_options)
+			keys.push_back(key.data()), values.push_back(value.data());
+		TfLiteDelegate *delegate = create(keys.data(), values.data(), keys.size(),
+										  [](char const *message) { LOG_ERROR("TfStage: delegate: " << message); });
+		if (!delegate)
+		{
+			dlclose(lib);
+			throw std::runtime_error("TfStage: Failed to create delegate from " + config_->delegate_library);
+		}
+		delegate_ = { delegate, [lib, destroy](TfLiteDelegate *d) {
+						 destroy(d);
+						 dlclose(lib);
+					 } };
+	}
+	else
+		throw std::runtime_error("TfStage: Unknown delegate " + config_->delegate);
+}
+
+// When the whole lores image is scaled to the input size anyway, the ISP can do that for us.
+
+std::optional<PostProcessingStage::LoresPreference> TfStage::PreferredLores() const
+{
+	if (!config_->scale_input)
+		return std::nullopt;
+	return LoresPreference { tf_w_, tf_h_, true };
+}
+
+// Copy an RGB image, which needs no conversion. If it's bigger than wanted, either scale all of it down (by
+// nearest neighbour), as the stages that scale their input expect, or copy out the centre.
+
+static void copy_rgb(uint8_t *dst, uint8_t const *src, StreamInfo const &src_info, StreamInfo const &dst_info,
+					 bool scale)
+{
+	if (scale && (src_info.width != dst_info.width || src_info.height != dst_info.height))
+	{
+		for (unsigned int y = 0; y < dst_info.height; y++)
+		{
+			uint8_t const *row = src + ((2 * y + 1) * src_info.height / (2 * dst_info.height)) * src_info.stride;
+			for (unsigned int x = 0; x < dst_info.width; x++)
+				memcpy(dst + y * dst_info.stride + x * 3, row + ((2 * x + 1) * src_info.width / (2 * dst_info.width)) * 3,
+					   3);
+		}
+		return;
+	}
+
+	unsigned int x_off = (src_info.width - dst_info.width) / 2, y_off = (src_info.height - dst_info.height) / 2;
+	for (unsigned int y = 0; y < dst_info.height; y++)
+		memcpy(dst + y * dst_info.stride, src + (y + y_off) * src_info.stride + x_off * 3, dst_info.width * 3);
+}
+
 void TfStage::Configure()
 {
 	lores_stream_ = app_->LoresStream();
@@ -88,6 +221,23 @@ void TfStage::Configure()
 		LOG(1, "TfStage: No main stream");
 
 	checkConfiguration();
+
+	// Delegates and the default kernels both do much of their setup on the first Invoke. The input tensor
+	// holds nothing useful yet, but that doesn't matter as the outputs are thrown away.
+	if (!warmed_up_)
+	{
+		warmed_up_ = true;
+		auto invoke = [this] {
+			if (interpreter_->Invoke() != kTfLiteOk)
+				throw std::runtime_error("TfStage: Failed to invoke TFLite");
+		};
+		for (unsigned int i = 0; i < config_->warmup; i++)
+		{
+			auto time_taken = ExecutionTime<std::micro>(invoke).count();
+			if (config_->verbose)
+				LOG(1, "TfStage: Warm-up inference " << i << " time: " << time_taken << " us");
+		}
+	}
 }
 
 bool TfStage::Process(CompletedRequestPtr &completed_request)
@@ -97,58 +247,89 @@ bool TfStage::Process(CompletedRequestPtr &completed_request)
 
 	{
 		std::unique_lock<std::mutex> lck(future_mutex_);
-		if (config_->refresh_rate && completed_request->sequence % config_->refresh_rate == 0 &&
+		completed_request->post_process_metadata.Get(MOTION_DETECT_RESULT, motion_);
+		bool wanted = !config_->motion_only || motion_;
+		if (wanted && config_->refresh_rate && completed_request->sequence % config_->refresh_rate == 0 &&
 			(!future_ || future_->wait_for(std::chrono::seconds(0)) == std::future_status::ready))
 		{
-			BufferReadSync r(app_, completed_request->buffers[lores_stream_]);
-			libcamera::Span<uint8_t> buffer = r.Get()[0];
-
-			// Copy the lores image here and let the asynchronous thread convert it to RGB.
-			// Doing the "extra" copy is in fact hugely beneficial because it turns uncacned
-			// memory into cached memory, which is then *much* quicker.
-			lores_copy_.assign(buffer.data(), buffer.data() + buffer.size());
+			{
+				BufferReadSync r(app_, completed_request->buffers[lores_stream_]);
+				prepareInput(completed_request, r.Get()[0].data());
+			}
 
 			future_ = std::make_unique<std::future<void>>();
-			*future_ = std::async(std::launch::async, [this] {
-				auto time_taken = ExecutionTime<std::micro>(&TfStage::runInference, this).count();
+			*future_ = std::async(std::launch::async, [this, sequence = completed_request->sequence] {
+				auto time_taken = ExecutionTime<std::micro>(&TfStage::runInference, this, sequence).count();
+				ReportTiming("inference", time_taken);
 
 				if (config_->verbose)
-					LOG(1, "TfStage: Inference time: " << time_taken << " ms");
+					LOG(1, "TfStage: Inference time: " << time_taken << " us");
 			});
 		}
 	}
 
 	std::unique_lock<std::mutex> lock(output_mutex_);
 	applyResults(completed_request);
+	if (results_sequence_)
+		completed_request->post_process_metadata.Set(RESULTS_SEQUENCE, *results_sequence_);
 
 	return false;
 }
 
-void TfStage::runInference()
+void TfStage::prepareInput(CompletedRequestPtr &, uint8_t const *lores)
 {
-	int input = interpreter_->inputs()[0];
+	// Convert straight from the lores buffer into the (much smaller) RGB input image, so that the uncached
+	// memory is read just once and we never copy the whole of it. The last inference has finished, so a
+	// uint8 input tensor can be written directly; float ones get normalised from rgb_image_ on the inference
+	// thread.
 	StreamInfo tf_info;
 	tf_info.width = tf_w_, tf_info.height = tf_h_, tf_info.stride = tf_w_ * 3;
-	std::vector<uint8_t> rgb_image = Yuv420ToRgb(lores_copy_.data(), lores_info_, tf_info);
-
+	int input = interpreter_->inputs()[0];
+	uint8_t *rgb;
 	if (interpreter_->tensor(input)->type == kTfLiteUInt8)
+		rgb = interpreter_->typed_tensor<uint8_t>(input);
+	else
 	{
-		uint8_t *tensor = interpreter_->typed_tensor<uint8_t>(input);
-		for (unsigned int i = 0; i < rgb_image.size(); i++)
-			tensor[i] = rgb_image[i];
+		if (rgb_image_.size() != tf_info.height * tf_info.stride)
+		{
+			rgb_image_.resize(tf_info.height * tf_info.stride);
+			MemoryAccount::Set(app_->GetOptions()->Get().camera, "stage." + std::string(Name()) + ".input",
+							   MemoryPool::System, rgb_image_.size());
+		}
+		rgb = rgb_image_.data();
 	}
-	else if (interpreter_->tensor(input)->type == kTfLiteFloat32)
+	if (lores_info_.pixel_format == libcamera::formats::BGR888)
+		copy_rgb(rgb, lores, lores_info_, tf_info, config_->scale_input);
+	else if (config_->scale_input)
+		Yuv420ToRgbScaled(rgb, lores, lores_info_, tf_info, true);
+	else
+		Yuv420ToRgb(rgb, lores, lores_info_, tf_info);
+}
+
+void TfStage::runModel()
+{
+	if (interpreter_->Invoke() != kTfLiteOk)
+		throw std::runtime_error("TfStage: Failed to invoke TFLite");
+}
+
+void TfStage::runInference(unsigned int sequence)
+{
+	int input = interpreter_->inputs()[0];
+	const std::vector<uint8_t> &rgb_image = rgb_image_;
+
+	// A uint8 input tensor was filled in by prepareInput already.
+	if (interpreter_->tensor(input)->type == kTfLiteFloat32)
 	{
 		float *tensor = interpreter_->typed_tensor<float>(input);
 		for (unsigned int i = 0; i < rgb_image.size(); i++)
 			tensor[i] = (rgb_image[i] - config_->normalisation_offset) / config_->normalisation_scale;
 	}
 
-	if (interpreter_->Invoke() != kTfLiteOk)
-		throw std::runtime_error("TfStage: Failed to invoke TFLite");
+	runModel();
 
 	std::unique_lock<std::mutex> lock(output_mutex_);
 	interpretOutputs();
+	results_sequence_ = sequence;
 }
 
 void TfStage::Stop()
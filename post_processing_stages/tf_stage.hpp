@@ -7,8 +7,11 @@
 
 #pragma once
 
+#include <functional>
 #include <memory>
 #include <mutex>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include <libcamera/stream.h>
@@ -35,6 +38,18 @@ struct TfConfig
 	bool verbose = false;
 	float normalisation_offset = 127.5;
 	float normalisation_scale = 127.5;
+	// Only run inference while an earlier motion_detect stage reports motion.
+	bool motion_only = false;
+	// Scale the whole lores image down to the TFLite input size, rather than taking a centre crop.
+	bool scale_input = false;
+	// Hand the graph to a delegate: "none", "xnnpack", "gpu" or "external" (the library in delegate_library,
+	// given the key/value pairs in delegate_options).
+	std::string delegate = "none";
+	bool xnnpack_quantized = true;
+	std::string delegate_library;
+	std::vector<std::pair<std::string, std::string>> delegate_options;
+	// Inferences to run in Configure, so that the first real frame doesn't pay for lazy initialisation.
+	unsigned int warmup = 0;
 };
 
 class TfStage : public PostProcessingStage
@@ -56,6 +71,8 @@ public:
 
 	void Stop() override;
 
+	std::optional<LoresPreference> PreferredLores() const override;
+
 protected:
 	TfConfig *config() const { return config_.get(); }
 
@@ -69,6 +86,13 @@ protected:
 	// and/or fail.
 	virtual void checkConfiguration() {}
 
+	// Get the model's input ready from the lores image, just before it runs. The default converts the
+	// image (or its centre, or all of it scaled) into the one input image.
+	virtual void prepareInput(CompletedRequestPtr &completed_request, uint8_t const *lores);
+
+	// Run the model, asynchronously. The default simply invokes it once.
+	virtual void runModel();
+
 	// This runs asynchronously from the main thread right after the model has run. The
 	// outputs should be processed into a form where applyResults can make use of them.
 	virtual void interpretOutputs() {}
@@ -92,14 +116,22 @@ protected:
 	StreamInfo main_stream_info_;
 
 	std::unique_ptr<tflite::FlatBufferModel> model_;
+	// Declared before the interpreter, which must be destroyed first.
+	std::unique_ptr<TfLiteDelegate, std::function<void(TfLiteDelegate *)>> delegate_;
 	std::unique_ptr<tflite::Interpreter> interpreter_;
 
 private:
 	void initialise();
-	void runInference();
+	void createDelegate();
+	void runInference(unsigned int sequence);
 
 	std::mutex future_mutex_;
 	std::unique_ptr<std::future<void>> future_;
-	std::vector<uint8_t> lores_copy_;
+	std::vector<uint8_t> rgb_image_; // only for models with float inputs
 	std::mutex output_mutex_;
+	// The frame the latest results came from, protected by output_mutex_.
+	std::optional<unsigned int> results_sequence_;
+	bool warmed_up_ = false;
+	// The motion_detect stage may not run on every frame, so remember what it last said.
+	bool motion_ = false;
 };
@@ -5,13 +5,24 @@
  * drm_preview.cpp - DRM-based preview window.
  */
 
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 #include <drm.h>
 #include <drm_fourcc.h>
 #include <drm_mode.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include "core/memory_account.hpp"
 #include "core/options.hpp"
+#include "core/thread_config.hpp"
 
 #include "preview.hpp"
 
@@ -44,8 +55,15 @@ private:
 		unsigned int fb_handle;
 	};
 	void makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer &buffer);
+	void accountImports();
 	void findCrtc();
 	void findPlane();
+	void setupAtomic();
+	void eventThread();
+	bool waitFlip(std::unique_lock<std::mutex> &lock);
+	void flipComplete();
+	static void pageFlipHandler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec,
+								void *user_data);
 	int drmfd_;
 	int conId_;
 	uint32_t crtcId_;
@@ -60,6 +78,19 @@ private:
 	unsigned int screen_height_;
 	std::map<int, Buffer> buffers_; // map the DMABUF's fd to the Buffer
 	int last_fd_;
+	// With atomic modesetting, the buffer waiting for its page flip. Until then, last_fd_ is still being scanned out.
+	// The flip events are read as they arrive on a thread of our own, so that last_fd_ goes back straight away
+	// rather than at the next Show.
+	bool atomic_;
+	int pending_fd_;
+	std::mutex mutex_;
+	std::condition_variable flip_cv_;
+	int abort_fd_;
+	std::thread event_thread_;
+	struct
+	{
+		uint32_t fb_id, crtc_id, src_x, src_y, src_w, src_h, crtc_x, crtc_y, crtc_w, crtc_h;
+	} plane_props_;
 	unsigned int max_image_width_;
 	unsigned int max_image_height_;
 	bool first_time_;
@@ -242,7 +273,55 @@ void DrmPreview::findPlane()
 	drmModeFreePlaneResources(planes);
 }
 
-DrmPreview::DrmPreview(Options const *options) : Preview(options), last_fd_(-1), first_time_(true)
+static uint32_t find_property(int fd, uint32_t object_id, uint32_t object_type, char const *name)
+{
+	drmModeObjectPropertiesPtr properties = drmModeObjectGetProperties(fd, object_id, object_type);
+	if (!properties)
+		return 0;
+
+	uint32_t id = 0;
+	for (unsigned int i = 0; i < properties->count_props && !id; i++)
+	{
+		drmModePropertyPtr prop = drmModeGetProperty(fd, properties->props[i]);
+		if (prop && !strcmp(prop->name, name))
+			id = prop->prop_id;
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(properties);
+	return id;
+}
+
+void DrmPreview::setupAtomic()
+{
+	atomic_ = drmSetClientCap(drmfd_, DRM_CLIENT_CAP_ATOMIC, 1) == 0;
+	if (!atomic_)
+	{
+		LOG(1, "DrmPreview: no atomic modesetting, using legacy plane updates");
+		return;
+	}
+
+	std::pair<uint32_t &, char const *> props[] = {
+		{ plane_props_.fb_id, "FB_ID" },   { plane_props_.crtc_id, "CRTC_ID" },
+		{ plane_props_.src_x, "SRC_X" },   { plane_props_.src_y, "SRC_Y" },
+		{ plane_props_.src_w, "SRC_W" },   { plane_props_.src_h, "SRC_H" },
+		{ plane_props_.crtc_x, "CRTC_X" }, { plane_props_.crtc_y, "CRTC_Y" },
+		{ plane_props_.crtc_w, "CRTC_W" }, { plane_props_.crtc_h, "CRTC_H" },
+	};
+	for (auto &[id, name] : props)
+	{
+		id = find_property(drmfd_, planeId_, DRM_MODE_OBJECT_PLANE, name);
+		if (!id)
+		{
+			LOG(1, "DrmPreview: plane has no " << name << " property, using legacy plane updates");
+			atomic_ = false;
+			return;
+		}
+	}
+}
+
+DrmPreview::DrmPreview(Options const *options)
+	: Preview(options), last_fd_(-1), atomic_(false), pending_fd_(-1), abort_fd_(-1), first_time_(true)
 {
 	drmfd_ = drmOpen("vc4", NULL);
 	if (drmfd_ < 0)
@@ -264,6 +343,13 @@ DrmPreview::DrmPreview(Options const *options) : Preview(options), last_fd_(-1),
 		findCrtc();
 		out_fourcc_ = DRM_FORMAT_YUV420;
 		findPlane();
+		setupAtomic();
+		if (atomic_)
+		{
+			abort_fd_ = eventfd(0, EFD_CLOEXEC);
+			if (abort_fd_ < 0)
+				throw std::runtime_error("failed to create eventfd for drm preview");
+		}
 	}
 	catch (std::exception const &e)
 	{
@@ -271,6 +357,9 @@ DrmPreview::DrmPreview(Options const *options) : Preview(options), last_fd_(-1),
 		throw;
 	}
 
+	if (atomic_)
+		event_thread_ = std::thread(&DrmPreview::eventThread, this);
+
 	// Default behaviour here is to go fullscreen.
 	if (options_->Get().fullscreen || width_ == 0 || height_ == 0 || x_ + width_ > screen_width_ ||
 		y_ + height_ > screen_height_)
@@ -283,6 +372,15 @@ DrmPreview::DrmPreview(Options const *options) : Preview(options), last_fd_(-1),
 
 DrmPreview::~DrmPreview()
 {
+	if (event_thread_.joinable())
+	{
+		uint64_t one = 1;
+		if (write(abort_fd_, &one, sizeof(one)) != sizeof(one))
+			LOG_ERROR("DrmPreview: failed to stop event thread");
+		event_thread_.join();
+	}
+	if (abort_fd_ >= 0)
+		close(abort_fd_);
 	close(drmfd_);
 }
 
@@ -393,7 +491,10 @@ void DrmPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &i
 {
 	Buffer &buffer = buffers_[fd];
 	if (buffer.fd == -1)
+	{
 		makeBuffer(fd, span.size(), info, buffer);
+		accountImports();
+	}
 
 	unsigned int x_off = 0, y_off = 0;
 	unsigned int w = width_, h = height_;
@@ -402,16 +503,104 @@ void DrmPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &i
 	else
 		w = height_ * info.width / info.height, x_off = (width_ - w) / 2;
 
-	if (drmModeSetPlane(drmfd_, planeId_, crtcId_, buffer.fb_handle, 0, x_off + x_, y_off + y_, w, h, 0, 0,
-						buffer.info.width << 16, buffer.info.height << 16))
-		throw std::runtime_error("drmModeSetPlane failed: " + std::string(ERRSTR));
+	if (!atomic_)
+	{
+		if (drmModeSetPlane(drmfd_, planeId_, crtcId_, buffer.fb_handle, 0, x_off + x_, y_off + y_, w, h, 0, 0,
+							buffer.info.width << 16, buffer.info.height << 16))
+			throw std::runtime_error("drmModeSetPlane failed: " + std::string(ERRSTR));
+		if (last_fd_ >= 0)
+			done_callback_(last_fd_);
+		last_fd_ = fd;
+		return;
+	}
+
+	// Only one flip can be outstanding, and the display will be done with it within a refresh.
+	std::unique_lock<std::mutex> lock(mutex_);
+	if (!waitFlip(lock))
+	{
+		// Something's wrong with the display; rather than queue frames up, give this one straight back.
+		LOG(1, "DrmPreview: page flip not completing, dropping frame");
+		done_callback_(fd);
+		return;
+	}
+
+	drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+	if (!req)
+		throw std::runtime_error("drmModeAtomicAlloc failed");
+	drmModeAtomicAddProperty(req, planeId_, plane_props_.fb_id, buffer.fb_handle);
+	drmModeAtomicAddProperty(req, planeId_, plane_props_.crtc_id, crtcId_);
+	drmModeAtomicAddProperty(req, planeId_, plane_props_.src_x, 0);
+	drmModeAtomicAddProperty(req, planeId_, plane_props_.src_y, 0);
+	drmModeAtomicAddProperty(req, planeId_, plane_props_.src_w, buffer.info.width << 16);
+	drmModeAtomicAddProperty(req, planeId_, plane_props_.src_h, buffer.info.height << 16);
+	drmModeAtomicAddProperty(req, planeId_, plane_props_.crtc_x, x_off + x_);
+	drmModeAtomicAddProperty(req, planeId_, plane_props_.crtc_y, y_off + y_);
+	drmModeAtomicAddProperty(req, planeId_, plane_props_.crtc_w, w);
+	drmModeAtomicAddProperty(req, planeId_, plane_props_.crtc_h, h);
+
+	int ret = drmModeAtomicCommit(drmfd_, req, DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, this);
+	drmModeAtomicFree(req);
+	if (ret)
+		throw std::runtime_error("drmModeAtomicCommit failed: " + std::string(ERRSTR));
+
+	// The buffer we're replacing goes back once the flip event tells us it's no longer being scanned out.
+	pending_fd_ = fd;
+}
+
+void DrmPreview::pageFlipHandler(int, unsigned int, unsigned int, unsigned int, void *user_data)
+{
+	static_cast<DrmPreview *>(user_data)->flipComplete();
+}
+
+void DrmPreview::flipComplete()
+{
+	// Called from drmHandleEvent, with mutex_ held.
 	if (last_fd_ >= 0)
 		done_callback_(last_fd_);
-	last_fd_ = fd;
+	last_fd_ = pending_fd_;
+	pending_fd_ = -1;
+	flip_cv_.notify_all();
+}
+
+bool DrmPreview::waitFlip(std::unique_lock<std::mutex> &lock)
+{
+	return flip_cv_.wait_for(lock, std::chrono::milliseconds(100), [this] { return pending_fd_ < 0; });
+}
+
+void DrmPreview::eventThread()
+{
+	ThreadConfig::Apply("preview");
+
+	drmEventContext context = {};
+	context.version = 2;
+	context.page_flip_handler = &DrmPreview::pageFlipHandler;
+	pollfd pfd[2] = { { drmfd_, POLLIN, 0 }, { abort_fd_, POLLIN, 0 } };
+	while (true)
+	{
+		if (poll(pfd, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			LOG_ERROR("DrmPreview: failed to poll for page flips");
+			return;
+		}
+		if (pfd[1].revents & POLLIN)
+			return;
+		if (pfd[0].revents & POLLIN)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			drmHandleEvent(drmfd_, &context);
+		}
+	}
 }
 
 void DrmPreview::Reset()
 {
+	// Let any flip finish before its framebuffer disappears.
+	std::unique_lock<std::mutex> lock(mutex_);
+	waitFlip(lock);
+	pending_fd_ = -1;
+
 	for (auto &it : buffers_)
 	{
 		drmModeRmFB(drmfd_, it.second.fb_handle);
@@ -424,10 +613,21 @@ void DrmPreview::Reset()
 			LOG(1, "DRM_IOCTL_GEM_CLOSE failed");
 	}
 	buffers_.clear();
+	accountImports();
 	last_fd_ = -1;
 	first_time_ = true;
 }
 
+// The imports hold no memory of their own, but say which of the camera's buffers the preview has on hand.
+
+void DrmPreview::accountImports()
+{
+	uint64_t bytes = 0;
+	for (auto const &it : buffers_)
+		bytes += it.second.size;
+	MemoryAccount::Set(options_->Get().camera, "preview.imports", MemoryPool::Import, bytes, buffers_.size());
+}
+
 static Preview *Create(Options const *options)
 {
 	return new DrmPreview(options);
@@ -5,12 +5,19 @@
  * egl_preview.cpp - X/EGL-based preview window.
  */
 
+#include <algorithm>
+#include <cmath>
+#include <iterator>
 #include <map>
 #include <string>
+#include <vector>
+
+#include <sys/stat.h>
 
 // Include libcamera stuff before X11, as X11 #defines both Status and None
 // which upsets the libcamera headers.
 
+#include "core/memory_account.hpp"
 #include "core/options.hpp"
 
 #include "preview.hpp"
@@ -32,6 +39,8 @@ public:
 	EglPreview(Options const *options);
 	~EglPreview();
 	virtual void SetInfoText(const std::string &text) override;
+	virtual bool SupportsOverlay() const override { return true; }
+	virtual void SetOverlay(Overlay const &overlay) override { overlay_ = overlay; }
 	// Display the buffer. You get given the fd back in the BufferDoneCallback
 	// once its available for re-use.
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) override;
@@ -50,22 +59,40 @@ public:
 private:
 	struct Buffer
 	{
-		Buffer() : fd(-1) {}
+		Buffer() : fd(-1), texture(0) {}
 		int fd;
 		size_t size;
 		StreamInfo info;
 		GLuint texture;
+		ino_t inode; // identifies the dmabuf, as fd numbers get re-used
 	};
 	void makeWindow(char const *name);
 	void makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer &buffer);
+	void pruneBuffers();
+	void freeBuffers();
+	void accountImports();
+	void drawOverlay();
 	::Display *display_;
 	EGLDisplay egl_display_;
 	Window window_;
 	EGLContext egl_context_;
 	EGLSurface egl_surface_;
-	std::map<int, Buffer> buffers_; // map the DMABUF's fd to the Buffer
+	// Map the DMABUF's fd to the Buffer. These outlive a Reset, as the application may give us the same buffers again.
+	std::map<int, Buffer> buffers_;
 	int last_fd_;
 	bool first_time_;
+	bool prune_;
+	bool vsync_;
+	// The shader program, which depends on the image size.
+	GLint program_;
+	unsigned int program_width_, program_height_;
+	float verts_[8];
+	Overlay overlay_;
+	GLint overlay_program_;
+	GLint overlay_pos_;
+	GLint overlay_transform_;
+	GLint overlay_colour_;
+	std::vector<float> overlay_verts_;
 	Atom wm_delete_window_;
 	// size of preview window
 	int x_;
@@ -130,7 +157,7 @@ static GLint link_program(GLint vs, GLint fs)
 	return prog;
 }
 
-static void gl_setup(int width, int height, int window_width, int window_height)
+static GLint gl_setup(int width, int height, int window_width, int window_height, float verts[8])
 {
 	float w_factor = width / (float)window_width;
 	float h_factor = height / (float)window_height;
@@ -160,15 +187,46 @@ static void gl_setup(int width, int height, int window_width, int window_height)
 	GLint fs_s = compile_shader(GL_FRAGMENT_SHADER, fs);
 	GLint prog = link_program(vs_s, fs_s);
 
+	glDeleteShader(vs_s);
+	glDeleteShader(fs_s);
 	glUseProgram(prog);
 
-	static const float verts[] = { -w_factor, -h_factor, w_factor, -h_factor, w_factor, h_factor, -w_factor, h_factor };
+	// GL keeps only a pointer to the vertices, so the caller owns them.
+	const float quad[] = { -w_factor, -h_factor, w_factor, -h_factor, w_factor, h_factor, -w_factor, h_factor };
+	std::copy(std::begin(quad), std::end(quad), verts);
 	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, verts);
 	glEnableVertexAttribArray(0);
+
+	return prog;
 }
 
-EglPreview::EglPreview(Options const *options) : Preview(options), last_fd_(-1), first_time_(true)
+static GLint overlay_setup()
 {
+	// Overlay vertices arrive in image pixels, and the transform maps them into the letterboxed image area.
+	const char *vs = "attribute vec2 pos;\n"
+					 "uniform vec4 transform;\n"
+					 "void main() {\n"
+					 "  gl_Position = vec4(pos * transform.xy + transform.zw, 0.0, 1.0);\n"
+					 "}\n";
+	const char *fs = "precision mediump float;\n"
+					 "uniform vec4 colour;\n"
+					 "void main() {\n"
+					 "  gl_FragColor = colour;\n"
+					 "}\n";
+	GLint vs_s = compile_shader(GL_VERTEX_SHADER, vs);
+	GLint fs_s = compile_shader(GL_FRAGMENT_SHADER, fs);
+	GLint prog = link_program(vs_s, fs_s);
+	glDeleteShader(vs_s);
+	glDeleteShader(fs_s);
+	return prog;
+}
+
+EglPreview::EglPreview(Options const *options)
+	: Preview(options), last_fd_(-1), first_time_(true), prune_(false), program_(0), program_width_(0),
+	  program_height_(0), overlay_program_(0)
+{
+	vsync_ = options_->Get().preview_sync == "vsync";
+
 	display_ = XOpenDisplay(NULL);
 	if (!display_)
 		throw std::runtime_error("Couldn't open X display");
@@ -193,7 +251,14 @@ EglPreview::EglPreview(Options const *options) : Preview(options), last_fd_(-1),
 
 EglPreview::~EglPreview()
 {
-	EglPreview::Reset();
+	// GL objects can only be deleted with the context current, which it no longer is in the preview thread.
+	eglMakeCurrent(egl_display_, EGL_NO_SURFACE, EGL_NO_SURFACE, egl_context_);
+	freeBuffers();
+	if (program_)
+		glDeleteProgram(program_);
+	if (overlay_program_)
+		glDeleteProgram(overlay_program_);
+	eglMakeCurrent(egl_display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
 	eglDestroyContext(egl_display_, egl_context_);
 }
 
@@ -359,18 +424,14 @@ static void get_colour_space_info(std::optional<libcamera::ColorSpace> const &cs
 
 void EglPreview::makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer &buffer)
 {
-	if (first_time_)
-	{
-		// This stuff has to be delayed until we know we're in the thread doing the display.
-		if (!eglMakeCurrent(egl_display_, egl_surface_, egl_surface_, egl_context_))
-			throw std::runtime_error("eglMakeCurrent failed");
-		gl_setup(info.width, info.height, width_, height_);
-		first_time_ = false;
-	}
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		throw std::runtime_error("failed to stat fd " + std::to_string(fd));
 
 	buffer.fd = fd;
 	buffer.size = size;
 	buffer.info = info;
+	buffer.inode = st.st_ino;
 
 	EGLint encoding, range;
 	get_colour_space_info(info.colour_space, encoding, range);
@@ -397,7 +458,9 @@ void EglPreview::makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer
 	if (!image)
 		throw std::runtime_error("failed to import fd " + std::to_string(fd));
 
-	glGenTextures(1, &buffer.texture);
+	// A texture we had for this fd is simply pointed at the new image.
+	if (!buffer.texture)
+		glGenTextures(1, &buffer.texture);
 	glBindTexture(GL_TEXTURE_EXTERNAL_OES, buffer.texture);
 	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
@@ -412,29 +475,161 @@ void EglPreview::SetInfoText(const std::string &text)
 		XStoreName(display_, window_, text.c_str());
 }
 
+void EglPreview::pruneBuffers()
+{
+	// Drop the textures of buffers that have gone since the last Reset, which would otherwise keep them allocated.
+	for (auto it = buffers_.begin(); it != buffers_.end();)
+	{
+		struct stat st;
+		if (fstat(it->first, &st) < 0 || st.st_ino != it->second.inode)
+		{
+			glDeleteTextures(1, &it->second.texture);
+			it = buffers_.erase(it);
+		}
+		else
+			it++;
+	}
+	accountImports();
+}
+
+void EglPreview::freeBuffers()
+{
+	for (auto &it : buffers_)
+		glDeleteTextures(1, &it.second.texture);
+	buffers_.clear();
+	accountImports();
+}
+
+// The imports hold no memory of their own, but say which of the camera's buffers the preview has on hand.
+
+void EglPreview::accountImports()
+{
+	uint64_t bytes = 0;
+	for (auto const &it : buffers_)
+		bytes += it.second.size;
+	MemoryAccount::Set(options_->Get().camera, "preview.imports", MemoryPool::Import, bytes, buffers_.size());
+}
+
 void EglPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info)
 {
+	if (first_time_)
+	{
+		// This stuff has to be delayed until we know we're in the thread doing the display.
+		if (!eglMakeCurrent(egl_display_, egl_surface_, egl_surface_, egl_context_))
+			throw std::runtime_error("eglMakeCurrent failed");
+		if (!vsync_)
+			eglSwapInterval(egl_display_, 0);
+		first_time_ = false;
+	}
+
+	if (prune_)
+	{
+		pruneBuffers();
+		prune_ = false;
+	}
+
+	if (info.width != program_width_ || info.height != program_height_)
+	{
+		if (program_)
+			glDeleteProgram(program_);
+		program_ = gl_setup(info.width, info.height, width_, height_, verts_);
+		program_width_ = info.width;
+		program_height_ = info.height;
+	}
+
 	Buffer &buffer = buffers_[fd];
-	if (buffer.fd == -1)
+	if (buffer.fd == -1 || buffer.size != span.size() || buffer.info.width != info.width ||
+		buffer.info.height != info.height || buffer.info.stride != info.stride ||
+		buffer.info.colour_space != info.colour_space)
+	{
 		makeBuffer(fd, span.size(), info, buffer);
+		accountImports();
+	}
 
 	glClearColor(0, 0, 0, 0);
 	glClear(GL_COLOR_BUFFER_BIT);
 
 	glBindTexture(GL_TEXTURE_EXTERNAL_OES, buffer.texture);
 	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+	if (!overlay_.shapes.empty())
+		drawOverlay();
 	EGLBoolean success [[maybe_unused]] = eglSwapBuffers(egl_display_, egl_surface_);
+
+	if (!vsync_)
+	{
+		// Without vsync nothing waits for the display, so once the GPU has drawn the frame we can give the buffer
+		// straight back. We never hold more than the one we're showing.
+		glFinish();
+		done_callback_(fd);
+		return;
+	}
+
 	if (last_fd_ >= 0)
 		done_callback_(last_fd_);
 	last_fd_ = fd;
 }
 
+void EglPreview::drawOverlay()
+{
+	if (!overlay_program_)
+	{
+		overlay_program_ = overlay_setup();
+		overlay_pos_ = glGetAttribLocation(overlay_program_, "pos");
+		overlay_transform_ = glGetUniformLocation(overlay_program_, "transform");
+		overlay_colour_ = glGetUniformLocation(overlay_program_, "colour");
+	}
+
+	// The image quad spans -w..w, -h..h in normalised coordinates, which the overlay's pixel grid has to cover.
+	float w = verts_[2], h = verts_[5];
+	glUseProgram(overlay_program_);
+	glUniform4f(overlay_transform_, 2 * w / overlay_.width, -2 * h / overlay_.height, -w, h);
+	glDisableVertexAttribArray(0);
+	glEnableVertexAttribArray(overlay_pos_);
+
+	for (OverlayShape const &shape : overlay_.shapes)
+	{
+		overlay_verts_.clear();
+		GLenum mode = GL_LINE_LOOP;
+		if (shape.type == OverlayShape::Line)
+		{
+			overlay_verts_ = { shape.x0, shape.y0, shape.x1, shape.y1 };
+			mode = GL_LINES;
+		}
+		else if (shape.type == OverlayShape::Rect)
+			overlay_verts_ = { shape.x0, shape.y0, shape.x1, shape.y0, shape.x1, shape.y1, shape.x0, shape.y1 };
+		else
+		{
+			constexpr int SEGMENTS = 24;
+			for (int i = 0; i < SEGMENTS; i++)
+			{
+				float angle = 2 * M_PI * i / SEGMENTS;
+				overlay_verts_.push_back(shape.x0 + shape.x1 * cosf(angle));
+				overlay_verts_.push_back(shape.y0 + shape.x1 * sinf(angle));
+			}
+		}
+
+		glUniform4f(overlay_colour_, ((shape.colour >> 16) & 0xff) / 255.0, ((shape.colour >> 8) & 0xff) / 255.0,
+					(shape.colour & 0xff) / 255.0, 1.0);
+		glLineWidth(std::max(shape.thickness, 1u));
+		glVertexAttribPointer(overlay_pos_, 2, GL_FLOAT, GL_FALSE, 0, overlay_verts_.data());
+		glDrawArrays(mode, 0, overlay_verts_.size() / 2);
+	}
+
+	// Put things back as the image drawing expects them.
+	glDisableVertexAttribArray(overlay_pos_);
+	glUseProgram(program_);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, verts_);
+	glEnableVertexAttribArray(0);
+}
+
 void EglPreview::Reset()
 {
-	for (auto &it : buffers_)
-		glDeleteTextures(1, &it.second.texture);
-	buffers_.clear();
+	// Keep the textures and the program, though textures for buffers that don't come back are dropped on the next
+	// Show. We no longer hold any of the camera's buffers once this returns.
 	last_fd_ = -1;
+	prune_ = true;
+	if (!first_time_)
+		glFinish();
 	eglMakeCurrent(egl_display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
 	first_time_ = true;
 }
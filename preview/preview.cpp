@@ -5,16 +5,12 @@
  * preview.cpp - preview window interface
  */
 
-#include <filesystem>
-
 #include "core/dl_lib.hpp"
 #include "core/options.hpp"
 
 #include "config.h"
 #include "preview.hpp"
 
-namespace fs = std::filesystem;
-
 PreviewFactory &PreviewFactory::GetInstance()
 {
 	static PreviewFactory instance;
@@ -28,41 +24,22 @@ void PreviewFactory::RegisterPreview(const std::string &name, PreviewCreateFunc
 
 PreviewCreateFunc PreviewFactory::CreatePreview(const std::string &name)
 {
-	auto it = previews_.find(name);
-	if (it != previews_.end())
-		return it->second;
-	return nullptr;
+	if (!HasPreview(name))
+		return nullptr;
+	return previews_.find(name)->second;
 }
 
 bool PreviewFactory::HasPreview(const std::string &name) const
 {
+	// As for the encoders, the library providing a preview is loaded only when it's asked for.
+	if (previews_.find(name) == previews_.end())
+		libraries_.Load(name);
 	return previews_.find(name) != previews_.end();
 }
 
 void PreviewFactory::LoadPreviewLibraries(const std::string &lib_dir)
 {
-	const fs::path path(!lib_dir.empty() ? lib_dir : PREVIEW_LIB_DIR);
-	const std::string ext(".so");
-
-	if (!fs::exists(path))
-		return;
-
-	// Dynamically load all .so files from the system preview lib path.
-	// This will automatically register the stages with the factory.
-	for (auto const &p : fs::recursive_directory_iterator(path))
-	{
-		if (p.path().extension() == ext)
-		{
-			const std::string library_path = p.path().string();
-
-			// Check if this library has already been loaded
-			if (loaded_library_paths_.find(library_path) == loaded_library_paths_.end())
-			{
-				preview_libraries_.emplace_back(library_path);
-				loaded_library_paths_.insert(library_path);
-			}
-		}
-	}
+	libraries_.Scan(!lib_dir.empty() ? lib_dir : PREVIEW_LIB_DIR);
 }
 
 RegisterPreview::RegisterPreview(char const *name, PreviewCreateFunc create_func)
@@ -9,16 +9,16 @@
 
 #include <functional>
 #include <map>
-#include <set>
 #include <string>
 #include <vector>
 
 #include <libcamera/base/span.h>
 
+#include "core/dl_lib.hpp"
+#include "core/overlay.hpp"
 #include "core/stream_info.hpp"
 
 struct Options;
-class DlLib;
 
 class Preview
 {
@@ -31,6 +31,10 @@ public:
 	// is no longer displaying the buffer and it can be safely recycled.
 	void SetDoneCallback(DoneCallback callback) { done_callback_ = callback; }
 	virtual void SetInfoText(const std::string &text) {}
+	// Previews that can draw annotations over the image themselves say so here, and are then given the overlay
+	// for each frame just before it is shown.
+	virtual bool SupportsOverlay() const { return false; }
+	virtual void SetOverlay(Overlay const &overlay) {}
 	// Display the buffer. You get given the fd back in the BufferDoneCallback
 	// once its available for re-use.
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) = 0;
@@ -71,8 +75,7 @@ private:
 	~PreviewFactory() = default;
 
 	std::map<std::string, PreviewCreateFunc> previews_;
-	std::vector<DlLib> preview_libraries_;
-	std::set<std::string> loaded_library_paths_;
+	mutable PluginLibraries libraries_;
 };
 
 struct RegisterPreview
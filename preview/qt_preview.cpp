@@ -5,11 +5,18 @@
  * qt_preview.cpp - Qt preview window
  */
 
+#include <algorithm>
+#include <cmath>
 #include <condition_variable>
 #include <iostream>
 #include <mutex>
 #include <string.h>
 #include <thread>
+#include <vector>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 // This header must be before the QT headers, as the latter #defines slot and emit!
 #include "core/options.hpp"
@@ -23,6 +30,65 @@
 
 #include "preview.hpp"
 
+// YUV to RGB conversion coefficients, in 6 fractional bits so that the NEON path works in 16 bits.
+struct YuvCoeffs
+{
+	int16_t offset_y;
+	int16_t y, vr, ug, vg, ub;
+};
+
+// Convert a row of width pixels to RGB888, where each U and V sample covers a pair of pixels. The NEON
+// and plain versions give identical results.
+
+static void yuv_row_to_rgb(uint8_t const *Y, uint8_t const *U, uint8_t const *V, unsigned int width,
+						   YuvCoeffs const &c, uint8_t *dest)
+{
+	unsigned int x = 0;
+
+#if defined(__ARM_NEON)
+	int16x8_t offset_y = vdupq_n_s16(c.offset_y), offset_uv = vdupq_n_s16(128);
+	for (; x + 16 <= width; x += 16)
+	{
+		uint8x16_t y = vld1q_u8(Y + x);
+		int16x8_t u = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(U + x / 2))), offset_uv);
+		int16x8_t v = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(V + x / 2))), offset_uv);
+		int16x8_t y_lo = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(y))), offset_y);
+		int16x8_t y_hi = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(y))), offset_y);
+		y_lo = vmulq_n_s16(y_lo, c.y);
+		y_hi = vmulq_n_s16(y_hi, c.y);
+
+		// Work out the chroma terms once for each pair of pixels, then spread them across both.
+		int16x8_t r = vmulq_n_s16(v, c.vr);
+		int16x8_t g = vmlaq_n_s16(vmulq_n_s16(u, c.ug), v, c.vg);
+		int16x8_t b = vmulq_n_s16(u, c.ub);
+		int16x8x2_t r2 = vzipq_s16(r, r), g2 = vzipq_s16(g, g), b2 = vzipq_s16(b, b);
+
+		uint8x16x3_t rgb;
+		rgb.val[0] = vcombine_u8(vqrshrun_n_s16(vqaddq_s16(y_lo, r2.val[0]), 6),
+								 vqrshrun_n_s16(vqaddq_s16(y_hi, r2.val[1]), 6));
+		rgb.val[1] = vcombine_u8(vqrshrun_n_s16(vqaddq_s16(y_lo, g2.val[0]), 6),
+								 vqrshrun_n_s16(vqaddq_s16(y_hi, g2.val[1]), 6));
+		rgb.val[2] = vcombine_u8(vqrshrun_n_s16(vqaddq_s16(y_lo, b2.val[0]), 6),
+								 vqrshrun_n_s16(vqaddq_s16(y_hi, b2.val[1]), 6));
+		vst3q_u8(dest + 3 * x, rgb);
+	}
+#endif
+
+	dest += 3 * x;
+	for (; x < width; x += 2)
+	{
+		int u = U[x / 2] - 128, v = V[x / 2] - 128;
+		int r = c.vr * v, g = c.ug * u + c.vg * v, b = c.ub * u;
+		for (unsigned int i = 0; i < 2; i++)
+		{
+			int y = c.y * (Y[x + i] - c.offset_y);
+			*(dest++) = std::clamp((y + r + 32) >> 6, 0, 255);
+			*(dest++) = std::clamp((y + g + 32) >> 6, 0, 255);
+			*(dest++) = std::clamp((y + b + 32) >> 6, 0, 255);
+		}
+	}
+}
+
 class MyMainWindow : public QMainWindow
 {
 public:
@@ -86,8 +152,9 @@ public:
 		// Quick and simple nearest-neighbour-ish resampling is used here.
 		// We further share U,V samples between adjacent output pixel pairs
 		// (even when downscaling) to speed up the conversion.
-		unsigned x_step = (info.width << 16) / window_width_;
 		unsigned y_step = (info.height << 16) / window_height_;
+		if (info.width != indexed_width_)
+			makeIndex(info.width);
 
 		// Choose the right matrix to convert YUV back to RGB.
 		static const float YUV2RGB[3][9] = {
@@ -95,37 +162,16 @@ public:
 			{ 1.164, 0.0, 1.596, 1.164, -0.392, -0.813, 1.164, 2.017, 0.0 }, // SMPTE170M
 			{ 1.164, 0.0, 1.793, 1.164, -0.213, -0.533, 1.164, 2.112, 0.0 }, // Rec709
 		};
-		int offsetY;
-		float coeffY, coeffVR, coeffUG, coeffVG, coeffUB;
+		int matrix = 0;
 		if (info.colour_space == libcamera::ColorSpace::Smpte170m)
-		{
-			offsetY = 16;
-			coeffY = YUV2RGB[1][0];
-			coeffVR = YUV2RGB[1][2];
-			coeffUG = YUV2RGB[1][4];
-			coeffVG = YUV2RGB[1][5];
-			coeffUB = YUV2RGB[1][7];
-		}
+			matrix = 1;
 		else if (info.colour_space == libcamera::ColorSpace::Rec709)
-		{
-			offsetY = 16;
-			coeffY = YUV2RGB[2][0];
-			coeffVR = YUV2RGB[2][2];
-			coeffUG = YUV2RGB[2][4];
-			coeffVG = YUV2RGB[2][5];
-			coeffUB = YUV2RGB[2][7];
-		}
-		else
-		{
-			offsetY = 0;
-			coeffY = YUV2RGB[0][0];
-			coeffVR = YUV2RGB[0][2];
-			coeffUG = YUV2RGB[0][4];
-			coeffVG = YUV2RGB[0][5];
-			coeffUB = YUV2RGB[0][7];
-			if (info.colour_space != libcamera::ColorSpace::Sycc)
-				LOG(1, "QtPreview: unexpected colour space " << libcamera::ColorSpace::toString(info.colour_space));
-		}
+			matrix = 2;
+		else if (info.colour_space != libcamera::ColorSpace::Sycc)
+			LOG(1, "QtPreview: unexpected colour space " << libcamera::ColorSpace::toString(info.colour_space));
+		auto q6 = [](float f) { return (int16_t)std::lround(f * 64); };
+		YuvCoeffs coeffs = { (int16_t)(matrix ? 16 : 0), q6(YUV2RGB[matrix][0]), q6(YUV2RGB[matrix][2]),
+							 q6(YUV2RGB[matrix][4]), q6(YUV2RGB[matrix][5]), q6(YUV2RGB[matrix][7]) };
 
 		// Because the source buffer is uncached, and we want to read it a byte at a time,
 		// take a copy of each row used. This is a speedup provided memcpy() is vectorized.
@@ -134,46 +180,29 @@ public:
 		uint8_t *Y_row = &tmp_stripe_[0];
 		uint8_t *U_row = Y_row + info.stride;
 		uint8_t *V_row = U_row + (info.stride >> 1);
+		unsigned int half_width = window_width_ >> 1;
+		uint8_t *Y_out = &line_[0], *U_out = Y_out + window_width_, *V_out = U_out + half_width;
 
 		// Possibly this should be locked in case a repaint is happening? In practice the risk
-		// is only that there might be some tearing, so I don't think we worry. We could speed
-		// it up by getting the ISP to supply RGB, but I'm not sure I want to handle that extra
-		// possibility in our main application code, so we'll put up with the slow conversion.
+		// is only that there might be some tearing, so I don't think we worry. Each row is
+		// resampled into line_ and then converted in one go, which NEON does 16 pixels at a time.
 		for (unsigned int y = 0; y < window_height_; y++)
 		{
 			unsigned row = (y * y_step) >> 16;
-			uint8_t *dest = pane_->image.scanLine(y);
-			unsigned x_pos = x_step >> 1;
 
 			memcpy(Y_row, Y_start + row * info.stride, info.stride);
 			memcpy(U_row, Y_start + ((4 * info.height + row) >> 1) * (info.stride >> 1), info.stride >> 1);
 			memcpy(V_row, Y_start + ((5 * info.height + row) >> 1) * (info.stride >> 1), info.stride >> 1);
 
-			for (unsigned int x = 0; x < window_width_; x += 2)
+			for (unsigned int x = 0; x < window_width_; x++)
+				Y_out[x] = Y_row[x_index_[x]];
+			for (unsigned int x = 0; x < half_width; x++)
 			{
-				int Y0 = Y_row[x_pos >> 16];
-				x_pos += x_step;
-				int Y1 = Y_row[x_pos >> 16];
-				int U = U_row[x_pos >> 17];
-				int V = V_row[x_pos >> 17];
-				x_pos += x_step;
-				Y0 -= offsetY;
-				Y1 -= offsetY;
-				U -= 128;
-				V -= 128;
-				int R0 = coeffY * Y0 + coeffVR * V;
-				int G0 = coeffY * Y0 + coeffUG * U + coeffVG * V;
-				int B0 = coeffY * Y0 + coeffUB * U;
-				int R1 = coeffY * Y1 + coeffVR * V;
-				int G1 = coeffY * Y1 + coeffUG * U + coeffVG * V;
-				int B1 = coeffY * Y1 + coeffUB * U;
-				*(dest++) = std::clamp(R0, 0, 255);
-				*(dest++) = std::clamp(G0, 0, 255);
-				*(dest++) = std::clamp(B0, 0, 255);
-				*(dest++) = std::clamp(R1, 0, 255);
-				*(dest++) = std::clamp(G1, 0, 255);
-				*(dest++) = std::clamp(B1, 0, 255);
+				U_out[x] = U_row[uv_index_[x]];
+				V_out[x] = V_row[uv_index_[x]];
 			}
+
+			yuv_row_to_rgb(Y_out, U_out, V_out, window_width_, coeffs, pane_->image.scanLine(y));
 		}
 
 		pane_->update();
@@ -190,6 +219,26 @@ public:
 	virtual void MaxImageSize(unsigned int &w, unsigned int &h) const override { w = h = 0; }
 
 private:
+	// Work out which source samples each output pixel (and pixel pair) takes, with the same stepping as
+	// we had when resampling on the fly.
+	void makeIndex(unsigned int width)
+	{
+		unsigned x_step = (width << 16) / window_width_;
+		unsigned x_pos = x_step >> 1;
+		x_index_.resize(window_width_);
+		uv_index_.resize(window_width_ >> 1);
+		for (unsigned int x = 0; x < window_width_; x += 2)
+		{
+			x_index_[x] = x_pos >> 16;
+			x_pos += x_step;
+			x_index_[x + 1] = x_pos >> 16;
+			uv_index_[x >> 1] = x_pos >> 17;
+			x_pos += x_step;
+		}
+		line_.resize(2 * window_width_);
+		indexed_width_ = width;
+	}
+
 	void threadFunc(Options const *options)
 	{
 		// This acts as Qt's event loop. Really Qt prefers to own the application's event loop
@@ -218,6 +267,10 @@ private:
 	std::mutex mutex_;
 	std::condition_variable cond_var_;
 	std::vector<uint8_t> tmp_stripe_;
+	unsigned int indexed_width_ = 0;
+	std::vector<unsigned int> x_index_;
+	std::vector<unsigned int> uv_index_;
+	std::vector<uint8_t> line_;
 };
 
 static Preview *Create(Options const *options)
@@ -0,0 +1,39 @@
+#!/usr/bin/python3
+
+# Copyright (C) 2025, Raspberry Pi Ltd
+# Generate the manifest of names that a plugin library registers
+
+import re
+import sys
+
+# Matches eg. 'static RegisterStage reg(NAME, &Create);' or 'static RegisterEncoder reg("libav", &Create);'
+register_re = re.compile(r'\bRegister(?:Stage|Encoder|Preview)\s+\w+\s*\(\s*(\w+|"[^"]*")\s*,')
+define_re = re.compile(r'^\s*#\s*define\s+(\w+)\s+"([^"]*)"', re.MULTILINE)
+
+
+def main():
+    if len(sys.argv) < 3:
+        print(f'Usage: {sys.argv[0]} <output> <source>...', file=sys.stderr)
+        sys.exit(1)
+
+    names = []
+    for source in sys.argv[2:]:
+        with open(source) as f:
+            text = f.read()
+        defines = dict(define_re.findall(text))
+        for arg in register_re.findall(text):
+            if arg.startswith('"'):
+                names.append(arg[1:-1])
+            elif arg in defines:
+                names.append(defines[arg])
+            else:
+                print(f'{source}: cannot resolve registered name {arg}', file=sys.stderr)
+                sys.exit(1)
+
+    with open(sys.argv[1], 'w') as f:
+        for name in sorted(set(names)):
+            f.write(name + '\n')
+
+
+if __name__ == '__main__':
+    main()
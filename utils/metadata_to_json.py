@@ -0,0 +1,65 @@
+#!/usr/bin/python3
+#
+# rpicam-apps binary metadata to JSON converter
+# Copyright (C) 2025, Raspberry Pi Ltd.
+#
+# Converts a file written with "--metadata-format bin" (see MetadataRecord in output/output.hpp) into the
+# same sort of JSON list that "--metadata-format json" produces.
+#
+import argparse
+import json
+import struct
+import sys
+
+HEADER = struct.Struct('<8sII')
+RECORD = struct.Struct('<qqIIiffffiffiI')
+
+# (valid bit, JSON name, record field index), in the order they appear in the record.
+FIELDS = [
+    (1, 'SensorTimestamp', 0),
+    (2, 'ExposureTime', 4),
+    (4, 'AnalogueGain', 5),
+    (8, 'DigitalGain', 6),
+    (16, 'ColourGains', (7, 8)),
+    (32, 'ColourTemperature', 9),
+    (64, 'Lux', 10),
+    (128, 'LensPosition', 11),
+    (256, 'FocusFoM', 12),
+]
+
+
+def read_records(f):
+    magic, version, record_size = HEADER.unpack(f.read(HEADER.size))
+    if magic != b'RPIMETA\0' or version != 1:
+        raise RuntimeError('Not an rpicam-apps binary metadata file')
+    if record_size < RECORD.size:
+        raise RuntimeError(f'Unexpected record size {record_size}')
+
+    while True:
+        data = f.read(record_size)
+        if len(data) < record_size:
+            return
+        yield RECORD.unpack_from(data)
+
+
+def to_dict(record):
+    valid = record[13]
+    out = {'Sequence': record[2], 'Timestamp': record[1], 'Keyframe': bool(record[3] & 1)}
+    for bit, name, index in FIELDS:
+        if valid & bit:
+            out[name] = [record[i] for i in index] if isinstance(index, tuple) else record[index]
+    return out
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='rpicam-apps binary metadata to JSON converter')
+    parser.add_argument('filename', help='Metadata file written with --metadata-format bin', type=str)
+    parser.add_argument('--output', '-o', help='JSON file to write (default stdout)', type=str)
+    args = parser.parse_args()
+
+    with open(args.filename, 'rb') as f:
+        records = [to_dict(r) for r in read_records(f)]
+
+    out = open(args.output, 'w') if args.output else sys.stdout
+    json.dump(records, out, indent=4)
+    out.write('\n')
@@ -17,8 +17,10 @@ import fcntl
 import json
 import os
 import os.path
+import signal
 import subprocess
 import sys
+import time
 from timeit import default_timer as timer
 import videodev2
 import numpy as np
@@ -639,6 +641,301 @@ def test_post_processing(exe_dir, output_dir, json_dir, postproc_dir):
     print("post-processing tests passed")
 
 
+# Performance tests. Each app is run in the way that exercises what it is there for, and we measure
+# the time to the first frame (from the -v 2 startup timing), the time from triggering a capture to the
+# file being written, the sustained framerate and dropped frames (from --save-pts), the CPU used by the
+# whole process and by each thread (ours are named after their --thread-config class), the peak RSS
+# and the peak CMA in use. The results are compared against a baseline for the platform, and anything
+# worse than the tolerance allows is a failure. Everything runs with no preview, so that whether a
+# display is attached does not change the numbers.
+
+# For each metric, whether bigger is better, and how far it may change regardless of the tolerance,
+# which keeps small or noisy values from failing on a frame or a percent here and there.
+PERF_METRICS = {
+    'first_frame_ms': (False, 50),
+    'capture_ms': (False, 50),
+    'fps': (True, 0.5),
+    'dropped': (False, 2),
+    'cpu': (False, 5),
+    'rss_mb': (False, 4),
+    'cma_mb': (False, 4),
+}
+PERF_THREAD_SLACK = 3  # percent of a CPU
+
+
+def read_cma_free():
+    try:
+        with open('/proc/meminfo') as f:
+            for line in f:
+                if line.startswith('CmaFree:'):
+                    return int(line.split()[1]) / 1024
+    except OSError:
+        pass
+    return None
+
+
+def read_thread_cpu(pid, threads):
+    # Update the CPU seconds used so far by each thread of the process. Threads that have gone keep
+    # what they last had.
+    ticks = os.sysconf('SC_CLK_TCK')
+    try:
+        tids = os.listdir('/proc/' + str(pid) + '/task')
+    except OSError:
+        return
+    for tid in tids:
+        try:
+            with open('/proc/' + str(pid) + '/task/' + tid + '/stat') as f:
+                stat = f.read()
+        except OSError:
+            continue
+        name = stat[stat.index('(') + 1:stat.rindex(')')]
+        fields = stat[stat.rindex(')') + 2:].split()
+        threads[tid] = (name, (int(fields[11]) + int(fields[12])) / ticks)
+
+
+def read_first_frame_ms(logfile):
+    with open(logfile) as f:
+        for line in f:
+            if 'Startup timing:' in line and '(total ' in line:
+                return float(line.split('(total ')[1].split('ms')[0])
+    return None
+
+
+def read_pts_stats(file):
+    # The sustained framerate, and how many frames went missing, going by gaps of more than one and a
+    # half times the typical frame interval.
+    try:
+        with open(file) as f:
+            pts = [float(line) for line in f if not line.startswith('#')]
+    except (OSError, ValueError):
+        return {}
+    if len(pts) < 3:
+        return {}
+    diffs = np.diff(pts)
+    interval = np.median(diffs)
+    dropped = sum(int(round(d / interval)) - 1 for d in diffs if d > 1.5 * interval)
+    return {'fps': (len(pts) - 1) * 1000 / (pts[-1] - pts[0]), 'dropped': dropped}
+
+
+def run_perf(args, logfile, trigger=None, capture_file=None, timeout=60):
+    # Run the executable like run_executable, measuring it as it goes. Once the first frame has arrived,
+    # trigger (if given) is called with the process to trigger a capture, and capture_ms is how long it
+    # took from there until capture_file was last written. trigger may return a signal to then have the
+    # process stopped with once the file is written. Anything still running after timeout seconds is
+    # killed, and fails.
+    results = {}
+    threads = {}
+    cma_start = read_cma_free()
+    cma_min = cma_start
+    trigger_time = None
+    stop_signal = None
+    start_time = timer()
+    with open(logfile, 'w') as log:
+        p = subprocess.Popen(args, stdout=log, stderr=subprocess.STDOUT, stdin=subprocess.PIPE)
+        while True:
+            pid, status, rusage = os.wait4(p.pid, os.WNOHANG)
+            if pid:
+                break
+            if timer() - start_time > timeout:
+                p.kill()
+                p.wait()
+                raise TestFailure(args[0] + " perf run still going after " + str(timeout) + " seconds")
+            read_thread_cpu(p.pid, threads)
+            cma = read_cma_free()
+            if cma is not None and cma_min is not None:
+                cma_min = min(cma_min, cma)
+            if trigger and trigger_time is None and read_first_frame_ms(logfile) is not None:
+                trigger_time = time.time()
+                stop_signal = trigger(p)
+            if stop_signal and os.path.isfile(capture_file) and \
+               os.stat(capture_file).st_mtime > trigger_time + 0.1:
+                # Leave it a moment to finish writing.
+                time.sleep(0.5)
+                p.send_signal(stop_signal)
+                stop_signal = None
+            time.sleep(0.1)
+    time_taken = timer() - start_time
+    p.returncode = os.waitstatus_to_exitcode(status)
+
+    first_frame_ms = read_first_frame_ms(logfile)
+    if first_frame_ms is not None:
+        results['first_frame_ms'] = first_frame_ms
+    if trigger_time is not None and capture_file and os.path.isfile(capture_file):
+        results['capture_ms'] = (os.stat(capture_file).st_mtime - trigger_time) * 1000
+    results['cpu'] = (rusage.ru_utime + rusage.ru_stime) * 100 / time_taken
+    results['rss_mb'] = rusage.ru_maxrss / 1024
+    if cma_start is not None:
+        results['cma_mb'] = cma_start - cma_min
+    thread_cpu = {}
+    for name, cpu in threads.values():
+        thread_cpu[name] = thread_cpu.get(name, 0) + cpu
+    for name, cpu in thread_cpu.items():
+        results['cpu.' + name] = cpu * 100 / time_taken
+    return p.returncode, results
+
+
+def perf_vid_args(executable, output, timestamps, seconds):
+    return [executable, '-n', '-v', '2', '-t', str(seconds * 1000), '-o', output, '--save-pts', timestamps]
+
+
+def perf_hello(exe_dir, output_dir):
+    executable = os.path.join(exe_dir, 'rpicam-hello')
+    check_exists(executable, 'perf_hello')
+    retcode, results = run_perf([executable, '-n', '-v', '2', '-t', '5000'], os.path.join(output_dir, 'log.txt'))
+    check_retcode(retcode, "perf_hello")
+    return {'hello': results}
+
+
+def perf_still(exe_dir, output_dir):
+    executable = os.path.join(exe_dir, 'rpicam-still')
+    output_jpg = os.path.join(output_dir, 'test.jpg')
+    check_exists(executable, 'perf_still')
+    clean_dir(output_dir)
+
+    # SIGUSR1 captures, after which rpicam-still goes back to the viewfinder, and SIGUSR2 makes it quit
+    # cleanly (SIGINT would not).
+    def trigger(p):
+        p.send_signal(signal.SIGUSR1)
+        return signal.SIGUSR2
+
+    retcode, results = run_perf([executable, '-n', '-v', '2', '-t', '0', '--signal', '-o', output_jpg],
+                                os.path.join(output_dir, 'log.txt'), trigger, output_jpg)
+    check_retcode(retcode, "perf_still")
+    check_exists(output_jpg, "perf_still")
+    return {'still': results}
+
+
+def perf_jpeg(exe_dir, output_dir):
+    executable = os.path.join(exe_dir, 'rpicam-jpeg')
+    output_jpg = os.path.join(output_dir, 'test.jpg')
+    check_exists(executable, 'perf_jpeg')
+    clean_dir(output_dir)
+    retcode, results = run_perf([executable, '-n', '-v', '2', '-t', '1000', '-o', output_jpg],
+                                os.path.join(output_dir, 'log.txt'))
+    check_retcode(retcode, "perf_jpeg")
+    check_exists(output_jpg, "perf_jpeg")
+    return {'jpeg': results}
+
+
+def perf_vid(exe_dir, output_dir):
+    executable = os.path.join(exe_dir, 'rpicam-vid')
+    output_h264 = os.path.join(output_dir, 'test.h264')
+    timestamps = os.path.join(output_dir, 'timestamps.txt')
+    check_exists(executable, 'perf_vid')
+    results = {}
+    for name, extra in (('vid', []), ('vid-1080p', ['--width', '1920', '--height', '1080'])):
+        clean_dir(output_dir)
+        retcode, results[name] = run_perf(perf_vid_args(executable, output_h264, timestamps, 10) + extra,
+                                          os.path.join(output_dir, 'log.txt'))
+        check_retcode(retcode, "perf_vid: " + name)
+        results[name].update(read_pts_stats(timestamps))
+    return results
+
+
+def perf_raw(exe_dir, output_dir):
+    # Only the pipeline, not the disk, is of interest here.
+    executable = os.path.join(exe_dir, 'rpicam-raw')
+    timestamps = os.path.join(output_dir, 'timestamps.txt')
+    check_exists(executable, 'perf_raw')
+    clean_dir(output_dir)
+    retcode, results = run_perf(perf_vid_args(executable, '/dev/null', timestamps, 5),
+                                os.path.join(output_dir, 'log.txt'))
+    check_retcode(retcode, "perf_raw")
+    results.update(read_pts_stats(timestamps))
+    return {'raw': results}
+
+
+def perf_mathorcam(exe_dir, output_dir):
+    # Captures on a 'c' from the keyboard, and otherwise runs until it is stopped.
+    executable = os.path.join(exe_dir, 'mathorcam')
+    output_jpg = os.path.join(output_dir, 'test.jpg')
+    check_exists(executable, 'perf_mathorcam')
+    clean_dir(output_dir)
+
+    def trigger(p):
+        p.stdin.write(b'c')
+        p.stdin.flush()
+        return signal.SIGINT
+
+    retcode, results = run_perf([executable, '-n', '-v', '2', '-t', '0', '-o', output_jpg],
+                                os.path.join(output_dir, 'log.txt'), trigger, output_jpg)
+    check_exists(output_jpg, "perf_mathorcam")
+    return {'mathorcam': results}
+
+
+def perf_post_processing(exe_dir, output_dir, json_dir):
+    # Stages that need no models, run through rpicam-vid so that a slow stage shows up as dropped frames.
+    executable = os.path.join(exe_dir, 'rpicam-vid')
+    timestamps = os.path.join(output_dir, 'timestamps.txt')
+    check_exists(executable, 'perf_post_processing')
+    results = {}
+    for stage in ('negate', 'sobel_cv', 'motion_detect', 'annotate_cv'):
+        json_file = os.path.join(json_dir, stage + '.json')
+        if not os.path.isfile(json_file):
+            print("WARNING: perf_post_processing:", json_file, "not found, skipping")
+            continue
+        clean_dir(output_dir)
+        retcode, results[stage] = run_perf(perf_vid_args(executable, '/dev/null', timestamps, 5) +
+                                           ['--post-process-file', json_file],
+                                           os.path.join(output_dir, 'log.txt'))
+        check_retcode(retcode, "perf_post_processing: " + stage)
+        results[stage].update(read_pts_stats(timestamps))
+    return results
+
+
+def perf_regressions(name, results, baseline, tolerance):
+    regressions = []
+    for metric, old in baseline.items():
+        if metric not in results:
+            continue
+        new = results[metric]
+        higher_better, slack = PERF_METRICS.get(metric, (False, PERF_THREAD_SLACK))
+        allowed = max(abs(old) * tolerance / 100, slack)
+        if (old - new if higher_better else new - old) > allowed:
+            regressions.append(name + " " + metric + " " + "{:.1f}".format(new) + " vs " + "{:.1f}".format(old))
+    return regressions
+
+
+def test_perf(apps, exe_dir, output_dir, json_dir, baseline_file, tolerance, update):
+    platform = get_platform()
+    tests = (('hello', perf_hello), ('still', perf_still), ('jpeg', perf_jpeg), ('vid', perf_vid),
+             ('raw', perf_raw), ('mathorcam', perf_mathorcam))
+    results = {}
+    print("Performance testing on", platform)
+    for app, test in tests:
+        if app in apps:
+            print("    " + app + " perf test")
+            results.update(test(exe_dir, output_dir))
+    if 'post-processing' in apps:
+        print("    post-processing perf test")
+        results.update(perf_post_processing(exe_dir, output_dir, json_dir))
+
+    baselines = {}
+    if os.path.isfile(baseline_file):
+        with open(baseline_file) as f:
+            baselines = json.load(f)
+    baseline = baselines.get(platform, {})
+
+    regressions = []
+    for name, values in results.items():
+        print("   ", name + ":", ", ".join(metric + " " + "{:.1f}".format(value) for metric, value in values.items()))
+        if name in baseline:
+            regressions += perf_regressions(name, values, baseline[name], tolerance)
+        elif not update:
+            print("WARNING: no", platform, "baseline for", name)
+
+    if update:
+        baseline.update(results)
+        baselines[platform] = baseline
+        with open(baseline_file, 'w') as f:
+            json.dump(baselines, f, indent=4, sort_keys=True)
+        print("Updated", platform, "baseline in", baseline_file)
+    elif regressions:
+        raise TestFailure("performance regressions:\n    " + "\n    ".join(regressions))
+
+    print("Performance tests passed")
+
+
 def test_all(apps, exe_dir, output_dir, json_dir, postproc_dir, preview_dir, encoder_dir):
     try:
         if 'hello' in apps:
@@ -680,6 +977,15 @@ if __name__ == '__main__':
                         help='Directory name custom preview libraries')
     parser.add_argument('--encoder-libs', action='store', default=None,
                         help='Directory name custom encoder libraries')
+    parser.add_argument('--perf', action='store_true',
+                        help='Run the performance tests (which also take mathorcam in --apps) instead')
+    parser.add_argument('--perf-baseline', action='store',
+                        default=os.path.join(os.path.dirname(os.path.abspath(__file__)), 'perf_baseline.json'),
+                        help='File of baseline performance results, by platform')
+    parser.add_argument('--perf-tolerance', action='store', type=float, default=15,
+                        help='How much worse, in percent, a result may be than the baseline')
+    parser.add_argument('--perf-update', action='store_true',
+                        help='Save the performance results as the baseline for this platform')
     args = parser.parse_args()
     apps = args.apps.split(',')
     exe_dir = args.exe_dir.rstrip('/')
@@ -690,4 +996,13 @@ if __name__ == '__main__':
     encoder_dir = args.encoder_libs
     print("Exe_dir:", exe_dir, "Output_dir:", output_dir, "Json_dir:", json_dir, "Postproc_dir:", postproc_dir,
           "Preview dir:", preview_dir, "Encoder dir:", encoder_dir)
-    test_all(apps, exe_dir, output_dir, json_dir, postproc_dir, preview_dir, encoder_dir)
+    if args.perf:
+        try:
+            test_perf(apps, exe_dir, output_dir, json_dir, args.perf_baseline, args.perf_tolerance,
+                      args.perf_update)
+            clean_dir(output_dir)
+        except TestFailure as e:
+            print("ERROR:", e)
+            sys.exit(1)
+    else:
+        test_all(apps, exe_dir, output_dir, json_dir, postproc_dir, preview_dir, encoder_dir)
@@ -0,0 +1,115 @@
+#!/usr/bin/python3
+#
+# rpicam-apps pipeline latency tool
+# Copyright (C) 2025, Raspberry Pi Ltd.
+#
+import argparse
+import re
+import struct
+
+try:
+    from matplotlib import pyplot as plt
+    plot_available = True
+except ImportError:
+    plot_available = False
+
+HOPS = ['sensor', 'request-complete', 'post-processed', 'encode-queued', 'encode-input-done', 'encode-dequeued',
+        'output-ready', 'written']
+NO_SEQUENCE = 0xffffffff
+
+
+def read_binary(file):
+    with open(file, 'rb') as f:
+        data = f.read()
+    magic, version, size = struct.unpack_from('<8sII', data)
+    if magic != b'RPITRACE' or version != 1:
+        raise RuntimeError('Trace file format unknown')
+    events = []
+    for offset in range(16, len(data) - size + 1, size):
+        time_ns, ts_us, seq, hop, _ = struct.unpack_from('<qqIHH', data, offset)
+        if hop < len(HOPS):
+            events.append((HOPS[hop], seq, ts_us, time_ns))
+    return events
+
+
+def read_ftrace(file):
+    pattern = re.compile(r'rpicam: hop=(\S+) seq=(-?\d+) ts_us=(-?\d+) time_ns=(\d+)')
+    events = []
+    with open(file) as f:
+        for line in f:
+            m = pattern.search(line)
+            if m:
+                seq = int(m.group(2))
+                events.append((m.group(1), NO_SEQUENCE if seq < 0 else seq, int(m.group(3)), int(m.group(4))))
+    return events
+
+
+def frames(events):
+    # Frames are known by sequence number up to the encoder and by timestamp after it. The
+    # encode-queued hop has both, so use it to put the two halves of each frame together.
+    by_seq, by_ts, link = {}, {}, {}
+    for hop, seq, ts, time_ns in events:
+        if seq != NO_SEQUENCE:
+            by_seq.setdefault(seq, {}).setdefault(hop, time_ns)
+            if ts >= 0:
+                link[ts] = seq
+        elif ts >= 0:
+            by_ts.setdefault(ts, {}).setdefault(hop, time_ns)
+    for ts, hops in by_ts.items():
+        if ts in link:
+            for hop, time_ns in hops.items():
+                by_seq[link[ts]].setdefault(hop, time_ns)
+    return [by_seq[seq] for seq in sorted(by_seq)]
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(int(p * len(values)), len(values) - 1)]
+
+
+def report(frame_list):
+    # Each hop's latency is measured from the sensor timestamp, so that the last one is glass to disk.
+    print(f'{len(frame_list)} frames')
+    print(f'{"hop":>18} {"frames":>7} {"min":>8} {"p50":>8} {"p95":>8} {"p99":>8} {"max":>8}  (ms from sensor)')
+    latencies = {}
+    for hop in HOPS[1:]:
+        values = [(f[hop] - f['sensor']) / 1e6 for f in frame_list if hop in f and 'sensor' in f]
+        if not values:
+            continue
+        latencies[hop] = values
+        print(f'{hop:>18} {len(values):>7} {min(values):8.2f} {percentile(values, 0.5):8.2f} '
+              f'{percentile(values, 0.95):8.2f} {percentile(values, 0.99):8.2f} {max(values):8.2f}')
+    return latencies
+
+
+def plot(latencies):
+    fig, ax = plt.subplots()
+    for hop, values in latencies.items():
+        ax.hist(values, bins=100, histtype='step', label=hop)
+    ax.legend()
+    plt.title('Latency from sensor timestamp')
+    plt.xlabel('Latency (ms)')
+    plt.ylabel('Frames')
+    plt.grid(True)
+    plt.show()
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='rpicam-apps pipeline latency tool')
+    parser.add_argument('filename', help='Trace file written by --trace, or a text ftrace dump from --trace ftrace',
+                        type=str)
+    parser.add_argument('--plot', help='Plot the latency distribution of each hop', action='store_true')
+    args = parser.parse_args()
+
+    with open(args.filename, 'rb') as f:
+        binary = f.read(8) == b'RPITRACE'
+    events = read_binary(args.filename) if binary else read_ftrace(args.filename)
+    if not events:
+        raise RuntimeError('No trace events found')
+
+    latencies = report(frames(events))
+    if args.plot:
+        if plot_available:
+            plot(latencies)
+        else:
+            print('\nError: matplotlib is not installed, please install with "pip3 install matplotlib"')
@@ -28,6 +28,16 @@ class ParsedDetection:
     name: str
     confidence: float
 
+
+@dataclass
+class ParsedFrame:
+    """A frame from the "packed" format, which can carry any number of detections."""
+    camera_id: int
+    sequence: int
+    timestamp_ns: int
+    unchanged: bool  # the detections are the same as in this camera's previous frame, and are not repeated
+    detections: list
+
 # --- UDP_AI_Receiver Class Definition ---
 
 
@@ -36,7 +46,8 @@ class UDP_AI_Receiver:
     The UDP_AI_Receiver class handles the establishment of a UDP socket,
     receiving incoming data, and parsing it into the ParsedDetection format.
     """
-    MAX_BUFFER_SIZE = 1024
+    MAX_BUFFER_SIZE = 65536
+    PACKED_MAGIC = 0x444F5052
 
     def __init__(self, port: int):
         """
@@ -60,19 +71,51 @@ class UDP_AI_Receiver:
         """Destructor: Cleans up resources by closing the socket."""
         self.sock.close()
 
-    def receive_detection(self) -> ParsedDetection | None:
+    def receive_detection(self) -> ParsedDetection | list[ParsedFrame] | None:
         """
         Method to receive and parse a single detection packet.
-        :return: A ParsedDetection object if a packet was successfully received and parsed,
-                 None otherwise.
+        :return: A ParsedDetection object for the legacy format, a list of ParsedFrame objects for the
+                 packed format, or None if the packet could not be received or parsed.
         """
         try:
             buffer, addr = self.sock.recvfrom(self.MAX_BUFFER_SIZE)
+            if len(buffer) >= 4 and struct.unpack('<I', buffer[0:4])[0] == self.PACKED_MAGIC:
+                return self._parse_packed(buffer)
             return self._parse_detection(buffer)
         except socket.error as e:
             print(f"Failed to receive UDP message: {e}", file=sys.stderr)
             return None
 
+    @staticmethod
+    def _parse_packed(buffer: bytes) -> list[ParsedFrame] | None:
+        """
+        Helper method to parse a "packed" format datagram, which batches one or more frames.
+        :param buffer: A byte string containing the received data.
+        :return: A list of ParsedFrame objects if parsing was successful, None otherwise.
+        """
+        try:
+            _, version, frame_count, _, camera_id, _ = struct.unpack_from('<IBBHII', buffer, 0)
+            if version != 1:
+                print(f"Unsupported packed format version {version}.", file=sys.stderr)
+                return None
+            offset = 16
+            frames = []
+            for _ in range(frame_count):
+                sequence, timestamp_ns, flags, count = struct.unpack_from('<IQBB', buffer, offset)
+                offset += 14
+                detections = []
+                for _ in range(count):
+                    x, y, width, height, confidence, _, name_length = struct.unpack_from('<HHHHHHB', buffer, offset)
+                    offset += 13
+                    name = buffer[offset:offset + name_length].decode('utf-8', errors='replace')
+                    offset += name_length
+                    detections.append(ParsedDetection(x, y, width, height, name, confidence / 65535))
+                frames.append(ParsedFrame(camera_id, sequence, timestamp_ns, bool(flags & 1), detections))
+            return frames
+        except struct.error as e:
+            print(f"Error unpacking packet data: {e}", file=sys.stderr)
+            return None
+
     @staticmethod
     def _parse_detection(buffer: bytes) -> ParsedDetection | None:
         """
@@ -138,7 +181,13 @@ if __name__ == "__main__":
     # Enter an infinite loop to continuously receive and process detection packets.
     while True:
         detection = receiver.receive_detection()
-        if detection:
+        if isinstance(detection, list):
+            for frame in detection:
+                state = "unchanged" if frame.unchanged else f"{len(frame.detections)} detections"
+                print(f"Camera {frame.camera_id} frame {frame.sequence} ({frame.timestamp_ns}): {state}")
+                for d in frame.detections:
+                    print(f"  {d.name} {d.confidence:.2f} at ({d.x}, {d.y}, {d.width}, {d.height})")
+        elif detection:
             # If a packet was successfully received and parsed, print its contents.
             print("Received Detection:")
             print(